@@ -0,0 +1,837 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  bench-micro: microbenchmarks of the stack's hot primitives
+ *
+ *  Times the functions that every segment goes through (the circular
+ *  buffers, the checksum, the socket demultiplexing lookup, creating
+ *  and freeing packets, and (de)serializing chitcpd messages) in
+ *  isolation, and reports how long each call takes, how many times
+ *  it allocates memory, and (where perf counters are available) how
+ *  many CPU cycles it takes.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "serverinfo.h"
+#include "server.h"
+#include "protobuf-wrapper.h"
+#include "fast-codec.h"
+#include "chitcp/buffer.h"
+#include "chitcp/packet.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+
+/* Every case is run until it has taken at least this long... */
+#define BENCH_MIN_TIME_DEFAULT (0.2)
+/* ...this many times, and the median run is reported */
+#define BENCH_RUNS_DEFAULT (5)
+#define BENCH_RUNS_MAX (101)
+
+/* A benchmark case. Like a test with .init and .fini fixtures, except
+ * that the body is given how many times it has to do its operation */
+typedef struct bench_case
+{
+    const char *name;
+    uint32_t param;
+    /* Sets up the case's context (or returns something other than CHITCP_OK) */
+    int (*init)(void **ctx, uint32_t param);
+    /* Does the operation ITERS times */
+    int (*run)(void *ctx, uint64_t iters);
+    void (*fini)(void *ctx);
+} bench_case_t;
+
+/* One run of a case */
+typedef struct bench_sample
+{
+    uint64_t iters;
+    uint64_t ns;
+    uint64_t allocs;
+    int64_t cycles;     /* -1 if perf counters are not available */
+} bench_sample_t;
+
+typedef struct bench_options
+{
+    double min_time;
+    int runs;
+    const char *filter;
+    bool_t json;
+} bench_options_t;
+
+
+/*
+ * Allocation counting
+ *
+ * glibc lets a program replace malloc & co., and the replacements are
+ * also used by the libraries the program is linked with (chiTCP,
+ * protobuf-c, etc.). The counter is per-thread, so the allocations
+ * made by other threads (e.g., the timer thread) are not counted.
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread uint64_t bench_allocs;
+
+void *malloc(size_t size)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+#else
+static uint64_t bench_allocs;
+#endif
+
+
+/*
+ * Cycle counting
+ */
+static int bench_cycles_fd = -1;
+
+static void bench_cycles_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* This thread only, on any CPU. This fails if there is no PMU (e.g.,
+     * in many VMs) or if perf_event_paranoid does not allow it */
+    bench_cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static int64_t bench_cycles(void)
+{
+    uint64_t count;
+
+    if (bench_cycles_fd < 0 || read(bench_cycles_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+
+    return (int64_t) count;
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * SECOND + now.tv_nsec;
+}
+
+/* Keeps the compiler from optimizing away a result that is never used */
+static volatile uint32_t bench_sink;
+
+
+/*
+ * Circular buffers
+ */
+typedef struct bench_buffer
+{
+    circular_buffer_t buf;
+    uint32_t len;
+    uint8_t *data;
+    uint8_t *dst;       /* Only for the copy-and-checksum cases */
+} bench_buffer_t;
+
+static int bench_buffer_init_capacity(void **ctx, uint32_t len, uint32_t capacity, bool_t spsc)
+{
+    bench_buffer_t *b = calloc(1, sizeof(bench_buffer_t));
+
+    if (b == NULL || (b->data = malloc(MAX(len, 1))) == NULL)
+    {
+        free(b);
+        return CHITCP_ENOMEM;
+    }
+    for (uint32_t i = 0; i < len; i++)
+        b->data[i] = i;
+    b->len = len;
+
+    if ((spsc? circular_buffer_init_spsc(&b->buf, capacity) : circular_buffer_init(&b->buf, capacity)) != CHITCP_OK)
+    {
+        free(b->data);
+        free(b);
+        return CHITCP_ENOMEM;
+    }
+    circular_buffer_set_seq_initial(&b->buf, 1000);
+
+    *ctx = b;
+    return CHITCP_OK;
+}
+
+/* Large enough that the writes and reads rarely wrap around */
+static int bench_buffer_init(void **ctx, uint32_t len)
+{
+    return bench_buffer_init_capacity(ctx, len, 65536, FALSE);
+}
+
+static int bench_buffer_init_spsc(void **ctx, uint32_t len)
+{
+    return bench_buffer_init_capacity(ctx, len, 65536, TRUE);
+}
+
+/* One and a half writes' worth, so every other write and read wraps around */
+static int bench_buffer_init_wrap(void **ctx, uint32_t len)
+{
+    return bench_buffer_init_capacity(ctx, len, len + len / 2, FALSE);
+}
+
+static void bench_buffer_fini(void *ctx)
+{
+    bench_buffer_t *b = ctx;
+
+    circular_buffer_free(&b->buf);
+    free(b->data);
+    free(b->dst);
+    free(b);
+}
+
+static int bench_buffer_write_read(void *ctx, uint64_t iters)
+{
+    bench_buffer_t *b = ctx;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        if (circular_buffer_write(&b->buf, b->data, b->len, BUFFER_NONBLOCKING) != b->len ||
+            circular_buffer_read(&b->buf, b->data, b->len, BUFFER_NONBLOCKING) != b->len)
+            return CHITCP_EINVAL;
+    }
+
+    return CHITCP_OK;
+}
+
+/* Fills the buffer and peeks at it all over (like a retransmission would) */
+static int bench_buffer_init_peek(void **ctx, uint32_t len)
+{
+    bench_buffer_t *b;
+    int rc;
+
+    if ((rc = bench_buffer_init(ctx, len)) != CHITCP_OK)
+        return rc;
+
+    b = *ctx;
+    while (circular_buffer_available(&b->buf) >= len)
+        circular_buffer_write(&b->buf, b->data, len, BUFFER_NONBLOCKING);
+
+    return CHITCP_OK;
+}
+
+static int bench_buffer_peek_at(void *ctx, uint64_t iters)
+{
+    bench_buffer_t *b = ctx;
+    uint32_t range = circular_buffer_count(&b->buf) - b->len + 1;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        uint32_t at = 1000 + (uint32_t) ((i * 1031) % range);
+
+        if (circular_buffer_peek_at(&b->buf, b->data, at, b->len) != b->len)
+            return CHITCP_EINVAL;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * Checksum
+ */
+static int bench_cksum(void *ctx, uint64_t iters)
+{
+    bench_buffer_t *b = ctx;
+    uint32_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        b->data[0] = i;
+        sum += cksum(b->data, b->len);
+    }
+    bench_sink = sum;
+
+    return CHITCP_OK;
+}
+
+
+static int bench_cksum_init_copy(void **ctx, uint32_t len)
+{
+    bench_buffer_t *b;
+    int rc;
+
+    if ((rc = bench_buffer_init(ctx, len)) != CHITCP_OK)
+        return rc;
+
+    b = *ctx;
+    if ((b->dst = malloc(MAX(len, 1))) == NULL)
+    {
+        bench_buffer_fini(b);
+        return CHITCP_ENOMEM;
+    }
+
+    return CHITCP_OK;
+}
+
+static int bench_cksum_copy(void *ctx, uint64_t iters)
+{
+    bench_buffer_t *b = ctx;
+    uint32_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        b->data[0] = i;
+        sum += cksum_finish(cksum_copy_partial(b->dst, b->data, b->len, 0));
+    }
+    bench_sink = sum;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * Packets
+ */
+static int bench_packet_create_free(void *ctx, uint64_t iters)
+{
+    bench_buffer_t *b = ctx;
+    tcp_packet_t packet;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        if (chitcp_tcp_packet_create(&packet, b->data, b->len) < 0)
+            return CHITCP_ENOMEM;
+        bench_sink = packet.length;
+        chitcp_tcp_packet_free(&packet);
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * Socket demultiplexing
+ *
+ * The sockets are indexed just like the daemon would, but they are
+ * never connected to anything: the daemon is initialized, not started.
+ */
+typedef struct bench_lookup
+{
+    serverinfo_t si;
+    uint32_t nsockets;
+    struct sockaddr_in local, remote;
+} bench_lookup_t;
+
+static void bench_lookup_addr(struct sockaddr_in *addr, const char *ip, uint16_t port)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = chitcp_htons(port);
+    inet_pton(AF_INET, ip, &addr->sin_addr);
+}
+
+/* NSOCKETS connected sockets (127.0.0.1:10000+i <-> 127.0.0.2:80+i)
+ * and a socket listening on 127.0.0.1:80 */
+static int bench_lookup_init(void **ctx, uint32_t nsockets)
+{
+    bench_lookup_t *l = calloc(1, sizeof(bench_lookup_t));
+    chisocketentry_t *entry;
+    int sockfd, rc = CHITCP_OK;
+
+    if (l == NULL)
+        return CHITCP_ENOMEM;
+    if (chitcpd_server_init(&l->si) != CHITCP_OK)
+    {
+        free(l);
+        return CHITCP_EINIT;
+    }
+    l->nsockets = nsockets;
+
+    for (uint32_t i = 0; i <= nsockets; i++)
+    {
+        if ((rc = chitcpd_allocate_socket(&l->si, &sockfd)) != CHITCP_OK)
+            goto done;
+        entry = CHISOCKET_ENTRY(&l->si, sockfd);
+
+        if (i < nsockets)
+        {
+            bench_lookup_addr((struct sockaddr_in *) &entry->local_addr, "127.0.0.1", 10000 + i);
+            bench_lookup_addr((struct sockaddr_in *) &entry->remote_addr, "127.0.0.2", 80 + i);
+        }
+        else
+        {
+            bench_lookup_addr((struct sockaddr_in *) &entry->local_addr, "127.0.0.1", 80);
+            bench_lookup_addr((struct sockaddr_in *) &entry->remote_addr, "0.0.0.0", 0);
+        }
+
+        if ((rc = chitcpd_index_socket(&l->si, entry)) != CHITCP_OK)
+            goto done;
+    }
+
+done:
+    if (rc != CHITCP_OK)
+    {
+        chitcpd_server_free(&l->si);
+        free(l);
+        return rc;
+    }
+
+    *ctx = l;
+    return CHITCP_OK;
+}
+
+static void bench_lookup_fini(void *ctx)
+{
+    bench_lookup_t *l = ctx;
+
+    chitcpd_server_free(&l->si);
+    free(l);
+}
+
+/* Lookups of the connected sockets, as for the segments of an open connection */
+static int bench_lookup_conn(void *ctx, uint64_t iters)
+{
+    bench_lookup_t *l = ctx;
+
+    bench_lookup_addr(&l->local, "127.0.0.1", 0);
+    bench_lookup_addr(&l->remote, "127.0.0.2", 0);
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        uint32_t n = i % l->nsockets;
+
+        l->local.sin_port = chitcp_htons(10000 + n);
+        l->remote.sin_port = chitcp_htons(80 + n);
+        if (chitcpd_lookup_socket(&l->si, (struct sockaddr *) &l->local,
+                                  (struct sockaddr *) &l->remote, FALSE) == NULL)
+            return CHITCP_ENOENT;
+    }
+
+    return CHITCP_OK;
+}
+
+/* Lookups that fall through to the listening socket, as for incoming SYNs */
+static int bench_lookup_listen(void *ctx, uint64_t iters)
+{
+    bench_lookup_t *l = ctx;
+
+    bench_lookup_addr(&l->local, "127.0.0.1", 80);
+    bench_lookup_addr(&l->remote, "127.0.0.3", 0);
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        l->remote.sin_port = chitcp_htons(1024 + i % 60000);
+        if (chitcpd_lookup_socket(&l->si, (struct sockaddr *) &l->local,
+                                  (struct sockaddr *) &l->remote, FALSE) == NULL)
+            return CHITCP_ENOENT;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd messages
+ *
+ * A SEND request with a LEN-byte payload goes through a socketpair,
+ * and is unpacked on the other end.
+ */
+typedef struct bench_msg
+{
+    int fds[2];
+    chitcpd_channel_t tx, rx;
+    uint8_t *data;
+    ChitcpdMsg msg;
+    ChitcpdSendArgs send_args;
+} bench_msg_t;
+
+static int bench_msg_init(void **ctx, uint32_t len)
+{
+    bench_msg_t *m = calloc(1, sizeof(bench_msg_t));
+
+    if (m == NULL || (m->data = calloc(1, MAX(len, 1))) == NULL)
+    {
+        free(m);
+        return CHITCP_ENOMEM;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, m->fds) < 0)
+    {
+        free(m->data);
+        free(m);
+        return CHITCP_ESOCKET;
+    }
+
+    chitcpd_msg__init(&m->msg);
+    chitcpd_send_args__init(&m->send_args);
+    m->msg.code = CHITCPD_MSG_CODE__SEND;
+    m->msg.send_args = &m->send_args;
+    m->send_args.sockfd = 3;
+    m->send_args.buf.data = m->data;
+    m->send_args.buf.len = len;
+
+    chitcpd_channel_init(&m->tx, m->fds[0]);
+    chitcpd_channel_init(&m->rx, m->fds[1]);
+
+    *ctx = m;
+    return CHITCP_OK;
+}
+
+/* Same, on channels that have agreed on the fast-path encoding */
+static int bench_msg_init_fast(void **ctx, uint32_t len)
+{
+    bench_msg_t *m;
+    int rc;
+
+    if ((rc = bench_msg_init(ctx, len)) != CHITCP_OK)
+        return rc;
+
+    m = *ctx;
+    m->tx.fast_version = CHITCPD_FAST_VERSION;
+    m->rx.fast_version = CHITCPD_FAST_VERSION;
+
+    return CHITCP_OK;
+}
+
+static void bench_msg_fini(void *ctx)
+{
+    bench_msg_t *m = ctx;
+
+    chitcpd_channel_free(&m->tx);
+    chitcpd_channel_free(&m->rx);
+    close(m->fds[0]);
+    close(m->fds[1]);
+    free(m->data);
+    free(m);
+}
+
+/* chitcpd_send_msg and chitcpd_recv_msg (protobuf, new buffers every time) */
+static int bench_msg_send_recv(void *ctx, uint64_t iters)
+{
+    bench_msg_t *m = ctx;
+    ChitcpdMsg *msg;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        if (chitcpd_send_msg(m->fds[0], &m->msg) < 0 || chitcpd_recv_msg(m->fds[1], &msg) < 0)
+            return CHITCP_ESOCKET;
+        chitcpd_msg__free_unpacked(msg, NULL);
+    }
+
+    return CHITCP_OK;
+}
+
+/* chitcpd_channel_send_msg and chitcpd_channel_recv_msg */
+static int bench_msg_channel(void *ctx, uint64_t iters)
+{
+    bench_msg_t *m = ctx;
+    ChitcpdMsg *msg;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        if (chitcpd_channel_send_msg(&m->tx, &m->msg) < 0 || chitcpd_channel_recv_msg(&m->rx, &msg) < 0)
+            return CHITCP_ESOCKET;
+        chitcpd_msg__free_unpacked(msg, NULL);
+    }
+
+    return CHITCP_OK;
+}
+
+
+static const bench_case_t bench_cases[] =
+{
+    {"buffer/write_read/1",        1,     bench_buffer_init,      bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read/64",       64,    bench_buffer_init,      bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read/536",      536,   bench_buffer_init,      bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read/4096",     4096,  bench_buffer_init,      bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read_wrap/64",  64,    bench_buffer_init_wrap, bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read_wrap/536", 536,   bench_buffer_init_wrap, bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read_wrap/4096",4096,  bench_buffer_init_wrap, bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/write_read_spsc/536", 536,   bench_buffer_init_spsc, bench_buffer_write_read,  bench_buffer_fini},
+    {"buffer/peek_at/64",          64,    bench_buffer_init_peek, bench_buffer_peek_at,     bench_buffer_fini},
+    {"buffer/peek_at/536",         536,   bench_buffer_init_peek, bench_buffer_peek_at,     bench_buffer_fini},
+    {"buffer/peek_at/4096",        4096,  bench_buffer_init_peek, bench_buffer_peek_at,     bench_buffer_fini},
+    {"cksum/20",                   20,    bench_buffer_init,      bench_cksum,              bench_buffer_fini},
+    {"cksum/536",                  536,   bench_buffer_init,      bench_cksum,              bench_buffer_fini},
+    {"cksum/1500",                 1500,  bench_buffer_init,      bench_cksum,              bench_buffer_fini},
+    {"cksum/65535",                65535, bench_buffer_init,      bench_cksum,              bench_buffer_fini},
+    {"cksum/copy/1500",            1500,  bench_cksum_init_copy,  bench_cksum_copy,         bench_buffer_fini},
+    {"cksum/copy/65535",           65535, bench_cksum_init_copy,  bench_cksum_copy,         bench_buffer_fini},
+    {"packet/create_free/0",       0,     bench_buffer_init,      bench_packet_create_free, bench_buffer_fini},
+    {"packet/create_free/536",     536,   bench_buffer_init,      bench_packet_create_free, bench_buffer_fini},
+    {"packet/create_free/1460",    1460,  bench_buffer_init,      bench_packet_create_free, bench_buffer_fini},
+    {"lookup/conn/10",             10,    bench_lookup_init,      bench_lookup_conn,        bench_lookup_fini},
+    {"lookup/conn/100",            100,   bench_lookup_init,      bench_lookup_conn,        bench_lookup_fini},
+    {"lookup/conn/1000",           1000,  bench_lookup_init,      bench_lookup_conn,        bench_lookup_fini},
+    {"lookup/listen/10",           10,    bench_lookup_init,      bench_lookup_listen,      bench_lookup_fini},
+    {"lookup/listen/1000",         1000,  bench_lookup_init,      bench_lookup_listen,      bench_lookup_fini},
+    {"msg/send_recv/64",           64,    bench_msg_init,         bench_msg_send_recv,      bench_msg_fini},
+    {"msg/send_recv/4096",         4096,  bench_msg_init,         bench_msg_send_recv,      bench_msg_fini},
+    {"msg/channel/64",             64,    bench_msg_init,         bench_msg_channel,        bench_msg_fini},
+    {"msg/channel/4096",           4096,  bench_msg_init,         bench_msg_channel,        bench_msg_fini},
+    {"msg/channel_fast/64",        64,    bench_msg_init_fast,    bench_msg_channel,        bench_msg_fini},
+    {"msg/channel_fast/4096",      4096,  bench_msg_init_fast,    bench_msg_channel,        bench_msg_fini},
+};
+
+#define BENCH_NUM_CASES (sizeof(bench_cases) / sizeof(bench_case_t))
+
+
+static int bench_sample(const bench_case_t *c, void *ctx, uint64_t iters, bench_sample_t *s)
+{
+    int64_t cycles_start, cycles_end;
+    uint64_t allocs_start, start;
+    int rc;
+
+    allocs_start = bench_allocs;
+    cycles_start = bench_cycles();
+    start = bench_now();
+
+    rc = c->run(ctx, iters);
+
+    s->ns = bench_now() - start;
+    cycles_end = bench_cycles();
+    s->allocs = bench_allocs - allocs_start;
+    s->cycles = (cycles_start < 0 || cycles_end < 0)? -1 : cycles_end - cycles_start;
+    s->iters = iters;
+
+    return rc;
+}
+
+static int bench_cmp_sample(const void *a, const void *b)
+{
+    const bench_sample_t *x = a, *y = b;
+    double nx = (double) x->ns / x->iters, ny = (double) y->ns / y->iters;
+
+    return (nx > ny) - (nx < ny);
+}
+
+/*
+ * bench_run_case - Run a benchmark case
+ *
+ * The number of iterations is doubled until a run takes a tenth of
+ * the minimum time, and then scaled up so each run takes (about)
+ * the minimum time. The median of the runs is reported.
+ *
+ * c: Benchmark case
+ *
+ * opts: Benchmark options
+ *
+ * result: Output parameter with the median run
+ *
+ * Returns:
+ *  - CHITCP_OK: The case ran
+ *  - Anything else: The case could not be set up, or one of its operations failed
+ *
+ */
+static int bench_run_case(const bench_case_t *c, const bench_options_t *opts, bench_sample_t *result)
+{
+    bench_sample_t samples[BENCH_RUNS_MAX];
+    uint64_t min_ns = opts->min_time * SECOND, iters = 1;
+    void *ctx = NULL;
+    int rc;
+
+    if ((rc = c->init(&ctx, c->param)) != CHITCP_OK)
+        return rc;
+
+    /* Warm up, and find out how many iterations to do */
+    for (;;)
+    {
+        if ((rc = bench_sample(c, ctx, iters, &samples[0])) != CHITCP_OK)
+            goto done;
+        if (samples[0].ns >= min_ns / 10)
+            break;
+        iters *= 2;
+    }
+    iters = MAX(iters * min_ns / MAX(samples[0].ns, 1), 1);
+
+    for (int i = 0; i < opts->runs; i++)
+        if ((rc = bench_sample(c, ctx, iters, &samples[i])) != CHITCP_OK)
+            goto done;
+
+    qsort(samples, opts->runs, sizeof(bench_sample_t), bench_cmp_sample);
+    *result = samples[opts->runs / 2];
+
+done:
+    c->fini(ctx);
+
+    return rc;
+}
+
+static void bench_print(FILE *out, const bench_case_t *c, const bench_sample_t *s, bool_t json, bool_t first)
+{
+    double ns = (double) s->ns / s->iters;
+    double allocs = (double) s->allocs / s->iters;
+
+    if (json)
+    {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, ",
+                first? "" : ",", c->name, (unsigned long long) s->iters, ns);
+#ifdef BENCH_COUNT_ALLOCS
+        fprintf(out, "\"allocs_per_op\": %.3f, ", allocs);
+#else
+        fprintf(out, "\"allocs_per_op\": null, ");
+#endif
+        if (s->cycles >= 0)
+            fprintf(out, "\"cycles_per_op\": %.1f}", (double) s->cycles / s->iters);
+        else
+            fprintf(out, "\"cycles_per_op\": null}");
+        return;
+    }
+
+    fprintf(out, "%-30s %12llu %12.1f", c->name, (unsigned long long) s->iters, ns);
+#ifdef BENCH_COUNT_ALLOCS
+    fprintf(out, " %12.2f", allocs);
+#else
+    fprintf(out, " %12s", "-");
+#endif
+    if (s->cycles >= 0)
+        fprintf(out, " %12.1f\n", (double) s->cycles / s->iters);
+    else
+        fprintf(out, " %12s\n", "-");
+}
+
+
+static void bench_usage(void)
+{
+    printf("Usage: bench-micro [-t SECONDS] [-r RUNS] [-f FILTER] [-j] [-l]\n");
+    printf("       -t: Minimum duration of each run (default %.1f)\n", BENCH_MIN_TIME_DEFAULT);
+    printf("       -r: Runs of each case; the median is reported (default %i)\n", BENCH_RUNS_DEFAULT);
+    printf("       -f: Only run the cases whose name contains FILTER\n");
+    printf("       -j: Write the results as JSON\n");
+    printf("       -l: List the cases and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t opts = {BENCH_MIN_TIME_DEFAULT, BENCH_RUNS_DEFAULT, NULL, FALSE};
+    bench_sample_t result;
+    bool_t first = TRUE;
+    int opt, rc, failed = 0;
+
+    while ((opt = getopt(argc, argv, "t:r:f:jlh")) != -1)
+        switch (opt)
+        {
+        case 't':
+            opts.min_time = strtod(optarg, NULL);
+            if (opts.min_time <= 0)
+                opts.min_time = BENCH_MIN_TIME_DEFAULT;
+            break;
+        case 'r':
+            opts.runs = MIN(MAX(atoi(optarg), 1), BENCH_RUNS_MAX);
+            break;
+        case 'f':
+            opts.filter = optarg;
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        case 'l':
+            for (size_t i = 0; i < BENCH_NUM_CASES; i++)
+                printf("%s\n", bench_cases[i].name);
+            exit(0);
+        case 'h':
+            bench_usage();
+            exit(0);
+        default:
+            printf("ERROR: Unknown option -%c\n", opt);
+            exit(-1);
+        }
+
+    chitcp_setloglevel(CRITICAL);
+    bench_cycles_open();
+
+    if (opts.json)
+        printf("{\n  \"config\": {\"min_time\": %.3f, \"runs\": %i, \"cycles\": %s},\n  \"results\": [",
+               opts.min_time, opts.runs, bench_cycles_fd >= 0? "true" : "false");
+    else
+        printf("%-30s %12s %12s %12s %12s\n", "case", "iterations", "ns/op", "allocs/op", "cycles/op");
+
+    for (size_t i = 0; i < BENCH_NUM_CASES; i++)
+    {
+        const bench_case_t *c = &bench_cases[i];
+
+        if (opts.filter && !strstr(c->name, opts.filter))
+            continue;
+
+        if ((rc = bench_run_case(c, &opts, &result)) != CHITCP_OK)
+        {
+            fprintf(stderr, "%s: failed (error %i)\n", c->name, rc);
+            failed++;
+            continue;
+        }
+
+        bench_print(stdout, c, &result, opts.json, first);
+        first = FALSE;
+        fflush(stdout);
+    }
+
+    if (opts.json)
+        printf("\n  ]\n}\n");
+
+    if (bench_cycles_fd >= 0)
+        close(bench_cycles_fd);
+
+    return failed? 1 : 0;
+}
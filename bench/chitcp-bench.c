@@ -0,0 +1,713 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  chitcp-bench: end-to-end benchmarks of the chiTCP stack
+ *
+ *  Runs a chiTCP daemon in-process and drives it with chitcp_tester_t
+ *  peers, measuring bulk transfer throughput, request/response latency,
+ *  connection setup and teardown rate, and how throughput scales with
+ *  the number of concurrent connections. The results are written as JSON.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "netem.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/utlist.h"
+#include "chitcp/log.h"
+
+/* Connection rate and concurrency scenarios use the ports starting
+ * at the base port, wrapping around after BENCH_PORT_RANGE ports */
+#define BENCH_PORT_RANGE (1000)
+
+enum
+{
+    SCENARIO_THROUGHPUT  = 1 << 0,
+    SCENARIO_LATENCY     = 1 << 1,
+    SCENARIO_CONNRATE    = 1 << 2,
+    SCENARIO_CONCURRENCY = 1 << 3,
+    SCENARIO_ALL         = 0xf
+};
+
+typedef struct bench_options
+{
+    int scenarios;
+    uint32_t buf_size;      /* Sockets' send and receive buffers (0: default) */
+    uint32_t write_size;    /* Bytes per send/recv call in bulk transfers */
+    uint64_t bytes;         /* Bytes per bulk transfer */
+    uint32_t msg_size;      /* Request and response size */
+    int iterations;         /* Requests, or connections opened */
+    int max_conns;          /* Most concurrent connections */
+    double delay;           /* Emulated one-way delay, in seconds */
+    double loss;            /* Emulated loss probability */
+    uint64_t seed;
+    uint16_t port;
+} bench_options_t;
+
+/* A bulk transfer from a tester's client to its server */
+typedef struct bench_transfer
+{
+    const bench_options_t *opts;
+    int client_sockfd;
+    uint64_t start;         /* When the client started sending */
+    uint64_t end;           /* When the server received the last byte */
+    uint64_t received;
+    chitcp_socket_stats_t client_stats;
+} bench_transfer_t;
+
+/* Request/response exchanges between a tester's client and server */
+typedef struct bench_rpc
+{
+    const bench_options_t *opts;
+    uint64_t *samples;      /* Round-trip time of each request, in ns */
+    int completed;
+} bench_rpc_t;
+
+static serverinfo_t *si;
+
+
+static uint64_t bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * SECOND + now.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Value below which there is a fraction P of the (sorted) samples */
+static uint64_t bench_percentile(const uint64_t *sorted, int n, double p)
+{
+    int i = (int) ceil(p * n) - 1;
+
+    if (n == 0)
+        return 0;
+
+    return sorted[MIN(MAX(i, 0), n - 1)];
+}
+
+/* Writes the distribution of N samples (in ns) as a JSON object, in microseconds */
+static void bench_json_distribution(FILE *out, uint64_t *samples, int n)
+{
+    uint64_t total = 0;
+
+    qsort(samples, n, sizeof(uint64_t), bench_cmp_u64);
+    for (int i = 0; i < n; i++)
+        total += samples[i];
+
+    fprintf(out, "{\"count\": %i, \"min_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                 "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+            n, n? samples[0] / 1e3 : 0.0, n? total / 1e3 / n : 0.0,
+            bench_percentile(samples, n, 0.5) / 1e3, bench_percentile(samples, n, 0.99) / 1e3,
+            bench_percentile(samples, n, 0.999) / 1e3, n? samples[n - 1] / 1e3 : 0.0);
+}
+
+
+/*
+ * bench_daemon_start - Start the in-process chiTCP daemon
+ *
+ * opts: Benchmark options (buffer sizes and link emulation)
+ *
+ * Returns:
+ *  - CHITCP_OK: The daemon is running
+ *  - CHITCP_EINVAL: Could not set up the link emulation
+ *  - CHITCP_EINIT: Could not start the daemon
+ *
+ */
+static int bench_daemon_start(const bench_options_t *opts)
+{
+    si = calloc(1, sizeof(serverinfo_t));
+    si->server_port = chitcp_htons(GET_CHITCPD_PORT);
+    chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
+    si->tcp_sndbuf_default = opts->buf_size;
+    si->tcp_rcvbuf_default = opts->buf_size;
+
+    /* All the peers are local, so a default profile covers every packet */
+    if (opts->delay > 0 || opts->loss > 0)
+    {
+        netem_profile_t *profile = malloc(sizeof(netem_profile_t));
+        char line[128];
+
+        snprintf(line, sizeof(line), "default delay=%.6fs loss=%.6f seed=%llu",
+                 opts->delay, opts->loss, (unsigned long long) opts->seed);
+        if (profile == NULL || netem_parse_profile(line, profile) != CHITCP_OK)
+        {
+            free(profile);
+            return CHITCP_EINVAL;
+        }
+        DL_APPEND(si->netem_profiles, profile);
+    }
+
+    if (chitcpd_server_init(si) != CHITCP_OK || chitcpd_server_start(si) != CHITCP_OK)
+        return CHITCP_EINIT;
+
+    return CHITCP_OK;
+}
+
+static void bench_daemon_stop(void)
+{
+    chitcpd_server_stop(si);
+    chitcpd_server_wait(si);
+    chitcpd_server_free(si);
+    free(si);
+}
+
+
+/*
+ * bench_tester_open - Start a tester and connect its client to its server
+ *
+ * Returns once both sockets are ESTABLISHED.
+ *
+ * tester: Tester data structure
+ *
+ * port: Port the server listens on
+ *
+ * client_func, server_func: What the client and server run (and their arguments)
+ *
+ * Returns:
+ *  - CHITCP_OK: The peers are connected
+ *  - CHITCP_EINIT: Could not start the tester
+ *
+ */
+static int bench_tester_open(chitcp_tester_t *tester, uint16_t port,
+                             chitcp_tester_runnable client_func, void *client_args,
+                             chitcp_tester_runnable server_func, void *server_args)
+{
+    if (chitcp_tester_init(tester) != CHITCP_OK)
+        return CHITCP_EINIT;
+
+    chitcp_tester_set_port(tester, port);
+    chitcp_tester_client_run_set(tester, client_func, client_args);
+    chitcp_tester_server_run_set(tester, server_func, server_args);
+
+    if (chitcp_tester_start(tester) != CHITCP_OK ||
+        chitcp_tester_server_listen(tester) != CHITCP_OK ||
+        chitcp_tester_server_accept(tester) != CHITCP_OK ||
+        chitcp_tester_client_connect(tester) != CHITCP_OK)
+        return CHITCP_EINIT;
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    return CHITCP_OK;
+}
+
+/* Runs the tester's functions (servers first, so they are ready
+ * for whatever the clients send) */
+static void bench_tester_run(chitcp_tester_t *tester)
+{
+    chitcp_tester_server_run(tester);
+    chitcp_tester_client_run(tester);
+}
+
+/* Waits for the tester's functions to finish, and closes both sockets */
+static void bench_tester_close(chitcp_tester_t *tester)
+{
+    chitcp_tester_client_close(tester);
+    chitcp_tester_server_close(tester);
+
+    chitcp_tester_client_wait_for_state(tester, CLOSED);
+    chitcp_tester_server_wait_for_state(tester, CLOSED);
+
+    chitcp_tester_client_exit(tester);
+    chitcp_tester_server_exit(tester);
+    chitcp_tester_free(tester);
+}
+
+
+static int bench_transfer_client(int sockfd, void *args)
+{
+    bench_transfer_t *transfer = (bench_transfer_t *) args;
+    uint32_t write_size = transfer->opts->write_size;
+    uint8_t *buf = calloc(1, write_size);
+    uint64_t sent = 0;
+
+    transfer->client_sockfd = sockfd;
+    transfer->start = bench_now();
+
+    while (sent < transfer->opts->bytes)
+    {
+        int len = (int) MIN(write_size, transfer->opts->bytes - sent);
+
+        if (chitcp_socket_send(sockfd, buf, len) != len)
+            break;
+        sent += len;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int bench_transfer_server(int sockfd, void *args)
+{
+    bench_transfer_t *transfer = (bench_transfer_t *) args;
+    uint32_t write_size = transfer->opts->write_size;
+    uint8_t *buf = malloc(write_size);
+
+    transfer->received = 0;
+    while (transfer->received < transfer->opts->bytes)
+    {
+        ssize_t nbytes = chisocket_recv(sockfd, buf, MIN(write_size, transfer->opts->bytes - transfer->received), 0);
+
+        if (nbytes <= 0)
+            break;
+        transfer->received += nbytes;
+    }
+    transfer->end = bench_now();
+
+    /* The sender's counters (retransmissions, RTT, etc.), now that
+     * everything it sent has arrived */
+    if (chitcpd_get_stats(transfer->client_sockfd, &transfer->client_stats, NULL) != 0)
+        memset(&transfer->client_stats, 0, sizeof(chitcp_socket_stats_t));
+
+    free(buf);
+
+    return 0;
+}
+
+static void bench_json_transfer(FILE *out, bench_transfer_t *transfer)
+{
+    double secs = (transfer->end - transfer->start) / (double) SECOND;
+
+    fprintf(out, "{\"bytes\": %llu, \"seconds\": %.6f, \"bytes_per_sec\": %.1f, "
+                 "\"segs_out\": %llu, \"retransmits\": %llu, \"srtt_us\": %llu, \"cwnd\": %u}",
+            (unsigned long long) transfer->received, secs, secs > 0? transfer->received / secs : 0.0,
+            (unsigned long long) transfer->client_stats.segs_out,
+            (unsigned long long) transfer->client_stats.retransmits,
+            (unsigned long long) transfer->client_stats.srtt_us, transfer->client_stats.cwnd);
+}
+
+
+/* Bulk transfer throughput over a single connection */
+static int bench_throughput(FILE *out, const bench_options_t *opts)
+{
+    chitcp_tester_t tester;
+    bench_transfer_t transfer = { .opts = opts };
+
+    if (bench_tester_open(&tester, opts->port, bench_transfer_client, &transfer,
+                          bench_transfer_server, &transfer) != CHITCP_OK)
+        return CHITCP_EINIT;
+
+    bench_tester_run(&tester);
+    bench_tester_close(&tester);
+
+    fprintf(out, "  \"throughput\": ");
+    bench_json_transfer(out, &transfer);
+
+    return CHITCP_OK;
+}
+
+
+static int bench_rpc_client(int sockfd, void *args)
+{
+    bench_rpc_t *rpc = (bench_rpc_t *) args;
+    uint32_t size = rpc->opts->msg_size;
+    uint8_t *buf = calloc(1, size);
+
+    for (rpc->completed = 0; rpc->completed < rpc->opts->iterations; rpc->completed++)
+    {
+        uint64_t start = bench_now();
+
+        if (chitcp_socket_send(sockfd, buf, size) != size ||
+            chitcp_socket_recv(sockfd, buf, size) != size)
+            break;
+        rpc->samples[rpc->completed] = bench_now() - start;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int bench_rpc_server(int sockfd, void *args)
+{
+    bench_rpc_t *rpc = (bench_rpc_t *) args;
+    uint32_t size = rpc->opts->msg_size;
+    uint8_t *buf = malloc(size);
+
+    for (int i = 0; i < rpc->opts->iterations; i++)
+    {
+        if (chitcp_socket_recv(sockfd, buf, size) != size ||
+            chitcp_socket_send(sockfd, buf, size) != size)
+            break;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+/* Round-trip time of request/response exchanges over a single connection */
+static int bench_latency(FILE *out, const bench_options_t *opts)
+{
+    chitcp_tester_t tester;
+    bench_rpc_t rpc = { .opts = opts };
+
+    rpc.samples = calloc(opts->iterations, sizeof(uint64_t));
+    if (rpc.samples == NULL)
+        return CHITCP_ENOMEM;
+
+    if (bench_tester_open(&tester, opts->port, bench_rpc_client, &rpc,
+                          bench_rpc_server, &rpc) != CHITCP_OK)
+    {
+        free(rpc.samples);
+        return CHITCP_EINIT;
+    }
+
+    bench_tester_run(&tester);
+    bench_tester_close(&tester);
+
+    fprintf(out, "  \"latency\": {\"msg_size\": %u, \"rtt\": ", opts->msg_size);
+    bench_json_distribution(out, rpc.samples, rpc.completed);
+    fprintf(out, "}");
+
+    free(rpc.samples);
+
+    return CHITCP_OK;
+}
+
+
+/* Connections opened and closed one after the other */
+static int bench_connrate(FILE *out, const bench_options_t *opts)
+{
+    uint64_t *setup, *teardown, start, t0, t1;
+    int n;
+
+    setup = calloc(opts->iterations, sizeof(uint64_t));
+    teardown = calloc(opts->iterations, sizeof(uint64_t));
+    if (setup == NULL || teardown == NULL)
+    {
+        free(setup);
+        free(teardown);
+        return CHITCP_ENOMEM;
+    }
+
+    start = bench_now();
+    for (n = 0; n < opts->iterations; n++)
+    {
+        chitcp_tester_t tester;
+
+        t0 = bench_now();
+        if (bench_tester_open(&tester, opts->port + n % BENCH_PORT_RANGE, NULL, NULL, NULL, NULL) != CHITCP_OK)
+            break;
+        t1 = bench_now();
+        bench_tester_close(&tester);
+
+        setup[n] = t1 - t0;
+        teardown[n] = bench_now() - t1;
+    }
+
+    fprintf(out, "  \"connrate\": {\"connections\": %i, \"conns_per_sec\": %.1f, \"setup\": ",
+            n, n * (double) SECOND / (bench_now() - start));
+    bench_json_distribution(out, setup, n);
+    fprintf(out, ", \"teardown\": ");
+    bench_json_distribution(out, teardown, n);
+    fprintf(out, "}");
+
+    free(setup);
+    free(teardown);
+
+    return CHITCP_OK;
+}
+
+
+/* Aggregate throughput of 1, 2, 4, ... concurrent bulk transfers */
+static int bench_concurrency(FILE *out, const bench_options_t *opts)
+{
+    chitcp_tester_t *testers = calloc(opts->max_conns, sizeof(chitcp_tester_t));
+    bench_transfer_t *transfers = calloc(opts->max_conns, sizeof(bench_transfer_t));
+    int rc = CHITCP_OK;
+
+    if (testers == NULL || transfers == NULL)
+    {
+        rc = CHITCP_ENOMEM;
+        goto done;
+    }
+
+    fprintf(out, "  \"concurrency\": [");
+    for (int conns = 1; ; conns = MIN(conns * 2, opts->max_conns))
+    {
+        uint64_t start = UINT64_MAX, end = 0, bytes = 0, retransmits = 0;
+        int opened;
+
+        for (opened = 0; opened < conns; opened++)
+        {
+            transfers[opened].opts = opts;
+            if (bench_tester_open(&testers[opened], opts->port + opened % BENCH_PORT_RANGE,
+                                  bench_transfer_client, &transfers[opened],
+                                  bench_transfer_server, &transfers[opened]) != CHITCP_OK)
+                break;
+        }
+
+        for (int i = 0; i < opened; i++)
+            bench_tester_run(&testers[i]);
+        for (int i = 0; i < opened; i++)
+        {
+            bench_tester_close(&testers[i]);
+            start = MIN(start, transfers[i].start);
+            end = MAX(end, transfers[i].end);
+            bytes += transfers[i].received;
+            retransmits += transfers[i].client_stats.retransmits;
+        }
+
+        if (opened < conns)
+        {
+            rc = CHITCP_EINIT;
+            break;
+        }
+
+        double secs = (end - start) / (double) SECOND;
+        fprintf(out, "%s\n    {\"conns\": %i, \"bytes\": %llu, \"seconds\": %.6f, \"bytes_per_sec\": %.1f, \"retransmits\": %llu}",
+                conns == 1? "" : ",", conns, (unsigned long long) bytes, secs, secs > 0? bytes / secs : 0.0,
+                (unsigned long long) retransmits);
+
+        if (conns == opts->max_conns)
+            break;
+    }
+    fprintf(out, "\n  ]");
+
+done:
+    free(testers);
+    free(transfers);
+
+    return rc;
+}
+
+
+static void bench_usage(void)
+{
+    printf("Usage: chitcp-bench [-s SCENARIO[,SCENARIO...]] [-b BYTES] [-w BYTES] [-n BYTES] [-m BYTES]\n");
+    printf("                    [-i ITERATIONS] [-c CONNECTIONS] [-d MS] [-l LOSS] [-r SEED] [-p PORT]\n");
+    printf("                    [-o FILE] [(-v|-vv|-vvv|-vvvv)]\n");
+    printf("       -s: throughput, latency, connrate, concurrency or all (default)\n");
+    printf("       -b: Size of the sockets' send and receive buffers\n");
+    printf("       -w: Bytes per send/recv call in bulk transfers (default 4096)\n");
+    printf("       -n: Bytes per bulk transfer (default 1048576)\n");
+    printf("       -m: Size of the requests and responses (default 64)\n");
+    printf("       -i: Requests sent, and connections opened (default 1000)\n");
+    printf("       -c: Most concurrent connections (default 16)\n");
+    printf("       -d: Emulated one-way delay, in milliseconds\n");
+    printf("       -l: Emulated loss probability (e.g., 0.01 or 1%%)\n");
+    printf("       -r: Seed of the emulated losses\n");
+    printf("       -p: First port the testers' servers listen on (default 7000)\n");
+    printf("       -o: Write the results to FILE instead of stdout\n");
+    printf("The MSS is set when chiTCP is built (with -DTCP_MSS=BYTES).\n");
+}
+
+static int bench_parse_scenarios(char *arg)
+{
+    int scenarios = 0;
+
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        if (!strcmp(tok, "throughput"))
+            scenarios |= SCENARIO_THROUGHPUT;
+        else if (!strcmp(tok, "latency"))
+            scenarios |= SCENARIO_LATENCY;
+        else if (!strcmp(tok, "connrate"))
+            scenarios |= SCENARIO_CONNRATE;
+        else if (!strcmp(tok, "concurrency"))
+            scenarios |= SCENARIO_CONCURRENCY;
+        else if (!strcmp(tok, "all"))
+            scenarios |= SCENARIO_ALL;
+        else
+            return -1;
+    }
+
+    return scenarios;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t opts = {SCENARIO_ALL, 0, 4096, 1024 * 1024, 64, 1000, 16, 0, 0, 1, 7000};
+    const char *output = NULL;
+    int verbosity = 0, opt, rc = CHITCP_OK;
+    sigset_t new;
+    FILE *out = stdout;
+    char *end;
+
+    /* Stop SIGPIPE from messing with our sockets */
+    sigemptyset (&new);
+    sigaddset(&new, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &new, NULL);
+
+    while ((opt = getopt(argc, argv, "s:b:w:n:m:i:c:d:l:r:p:o:vh")) != -1)
+        switch (opt)
+        {
+        case 's':
+            if ((opts.scenarios = bench_parse_scenarios(optarg)) <= 0)
+            {
+                printf("ERROR: Unknown scenario in %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'b':
+            opts.buf_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.write_size = MAX(strtoul(optarg, NULL, 10), 1);
+            break;
+        case 'n':
+            opts.bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            opts.msg_size = MAX(strtoul(optarg, NULL, 10), 1);
+            break;
+        case 'i':
+            opts.iterations = MAX(atoi(optarg), 1);
+            break;
+        case 'c':
+            opts.max_conns = MAX(atoi(optarg), 1);
+            break;
+        case 'd':
+            opts.delay = strtod(optarg, NULL) / 1000.0;
+            break;
+        case 'l':
+            opts.loss = strtod(optarg, &end);
+            if (*end == '%')
+                opts.loss /= 100.0;
+            break;
+        case 'r':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'v':
+            verbosity++;
+            break;
+        case 'h':
+            bench_usage();
+            exit(0);
+        default:
+            printf("ERROR: Unknown option -%c\n", opt);
+            exit(-1);
+        }
+
+    switch(verbosity)
+    {
+    case 0:
+        chitcp_setloglevel(CRITICAL);
+        break;
+    case 1:
+        chitcp_setloglevel(ERROR);
+        break;
+    case 2:
+        chitcp_setloglevel(INFO);
+        break;
+    case 3:
+        chitcp_setloglevel(DEBUG);
+        break;
+    default:
+        chitcp_setloglevel(TRACE);
+        break;
+    }
+
+    if (output && (out = fopen(output, "w")) == NULL)
+    {
+        perror("Could not open output file");
+        exit(-1);
+    }
+
+    if (bench_daemon_start(&opts) != CHITCP_OK)
+    {
+        fprintf(stderr, "Could not start the chiTCP daemon.\n");
+        exit(-1);
+    }
+
+    fprintf(out, "{\n  \"config\": {\"mss\": %i, \"buf_size\": %u, \"write_size\": %u, \"bytes\": %llu, "
+                 "\"msg_size\": %u, \"iterations\": %i, \"max_conns\": %i, \"delay_ms\": %.3f, "
+                 "\"loss\": %.6f, \"seed\": %llu}",
+            TCP_MSS, opts.buf_size, opts.write_size, (unsigned long long) opts.bytes, opts.msg_size,
+            opts.iterations, opts.max_conns, opts.delay * 1000.0, opts.loss, (unsigned long long) opts.seed);
+
+    if (opts.scenarios & SCENARIO_THROUGHPUT)
+    {
+        fprintf(out, ",\n");
+        rc = bench_throughput(out, &opts);
+    }
+    if (!rc && opts.scenarios & SCENARIO_LATENCY)
+    {
+        fprintf(out, ",\n");
+        rc = bench_latency(out, &opts);
+    }
+    if (!rc && opts.scenarios & SCENARIO_CONNRATE)
+    {
+        fprintf(out, ",\n");
+        rc = bench_connrate(out, &opts);
+    }
+    if (!rc && opts.scenarios & SCENARIO_CONCURRENCY)
+    {
+        fprintf(out, ",\n");
+        rc = bench_concurrency(out, &opts);
+    }
+    fprintf(out, "\n}\n");
+
+    bench_daemon_stop();
+
+    if (out != stdout)
+        fclose(out);
+
+    if (rc != CHITCP_OK)
+    {
+        fprintf(stderr, "A benchmark could not be run (error %i).\n", rc);
+        return 1;
+    }
+
+    return 0;
+}
@@ -135,6 +135,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include "chitcp/types.h"
 
 #ifndef BUFFER_H_
@@ -144,6 +145,17 @@
 #define BUFFER_BLOCKING (1)
 
 #include <pthread.h>
+#include <stdatomic.h>
+
+struct circular_buffer;
+
+/* Function called when the state of a buffer changes (see
+ * circular_buffer_set_notify) */
+typedef void (*circular_buffer_notify_t)(struct circular_buffer *buf, void *arg);
+
+/* Function called when the data of a buffer is allocated (see
+ * circular_buffer_set_alloc_hook) */
+typedef void (*circular_buffer_alloc_hook_t)(uint8_t *data, size_t len, void *arg);
 
 typedef struct circular_buffer
 {
@@ -158,20 +170,47 @@ typedef struct circular_buffer
 
     uint32_t count;
 
-    bool_t closed;
+    atomic_int closed;
 
     pthread_mutex_t lock;
     pthread_cond_t cv_notfull;
     pthread_cond_t cv_notempty;
 
     uint32_t maxsize;
+
+    /* Single-producer/single-consumer mode (see circular_buffer_init_spsc).
+     * start, end, count, seq_start and seq_end are not used. Instead, head
+     * and tail are free-running counts of the bytes read and written, and
+     * data has mask+1 bytes (a power of two), so position i of the stream
+     * is at data[i & mask]. seq_initial is the sequence number of the
+     * byte at position 0. The lock and condition variables are only
+     * used by a side that has to block (waiters_* count how many do). */
+    bool_t spsc;
+    atomic_uint head;
+    atomic_uint tail;
+    uint32_t mask;
+    atomic_int waiters_notempty;
+    atomic_int waiters_notfull;
+
+    /* State change notification (see circular_buffer_set_notify) */
+    circular_buffer_notify_t notify;
+    void *notify_arg;
+
+    /* The data is allocated on the first write, and can be freed again
+     * when the buffer is empty (see circular_buffer_trim). In SPSC mode,
+     * writing and trimming keep the writer and the trimmer apart. */
+    circular_buffer_alloc_hook_t alloc_hook;
+    void *alloc_hook_arg;
+    atomic_int writing;
+    atomic_int trimming;
 } circular_buffer_t;
 
 
 /*
  * circular_buffer_init - Initializes the buffer
  *
- * Creates an empty buffer.
+ * Creates an empty buffer. Its data is not allocated until something
+ * is written to it.
  *
  * buf: circular_buffer_t struct
  *
@@ -179,12 +218,34 @@ typedef struct circular_buffer
  *
  * Returns:
  *  - CHITCP_OK: Buffer created correctly
- *  - CHITCP_ENOMEM: Could not allocate memory for buffer
  *
  */
 int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize);
 
 
+/*
+ * circular_buffer_init_spsc - Initializes a single-producer/single-consumer buffer
+ *
+ * Creates an empty buffer that behaves exactly like one created with
+ * circular_buffer_init, except that it is lock-free as long as there is
+ * at most one thread writing to it and at most one thread reading from it
+ * at any given time (additional threads may only peek at it, with no
+ * guarantee that the data won't be overwritten while it's being copied).
+ * The lock is only taken by a reader or writer that has to block.
+ *
+ * SPSC buffers can't be resized (see circular_buffer_resize).
+ *
+ * buf: circular_buffer_t struct
+ *
+ * maxsize: The maximum capacity of the buffer
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer created correctly
+ *
+ */
+int circular_buffer_init_spsc(circular_buffer_t *buf, uint32_t maxsize);
+
+
 /*
  * circular_buffer_set_seq_initial - Set the initial sequence number
  *
@@ -199,6 +260,27 @@ int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize);
 int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial);
 
 
+/*
+ * circular_buffer_set_notify - Set a function to call when the buffer's state changes
+ *
+ * The function is called (without holding the buffer's lock) every time
+ * data is written to the buffer, every time data is read (but not peeked)
+ * from it, and when the buffer is closed. This is meant to let a reader or
+ * writer that doesn't want to block find out when it may try again.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * notify: Function to call (NULL for none)
+ *
+ * arg: Argument to pass to the function
+ *
+ * Returns:
+ *  - CHITCP_OK: Function set correctly
+ *
+ */
+int circular_buffer_set_notify(circular_buffer_t *buf, circular_buffer_notify_t notify, void *arg);
+
+
 /*
  * circular_buffer_read - Read data from the buffer
  *
@@ -215,7 +297,8 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
  *
  * If the buffer is closed (using circular_buffer_close)
  * while the function is blocked, the function returns
- * zero immediately.
+ * zero immediately. Reading from a closed, empty buffer
+ * also returns zero, even if "blocking" is false.
  *
  * buf: circular_buffer_t struct
  *
@@ -247,6 +330,23 @@ int circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, boo
 int circular_buffer_peek(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking);
 
 
+/*
+ * circular_buffer_read_lowat - Read data from the buffer once enough has arrived
+ *
+ * Same as circular_buffer_read (or circular_buffer_peek, if "peeking" is
+ * true), but the buffer is only considered readable once it has at least
+ * "lowat" bytes in it (or "len" bytes, if that is less, or as many bytes
+ * as it can hold, if that is less still). Until then, a blocking read
+ * blocks, and a non-blocking one returns CHITCP_EWOULDBLOCK. Once the
+ * buffer is closed, whatever is left in it is returned right away.
+ *
+ * A "lowat" of 1 (or 0) behaves just like circular_buffer_read, and
+ * a "lowat" of "len" waits for the full "len" bytes (like MSG_WAITALL).
+ *
+ */
+int circular_buffer_read_lowat(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t lowat, bool_t blocking, bool_t peeking);
+
+
 /*
  * circular_buffer_peek_at - Peek data from the buffer starting at a specific
  *                           sequence number
@@ -293,11 +393,52 @@ int circular_buffer_peek_at(circular_buffer_t *buf, uint8_t *dst, uint32_t at, u
  *
  * Returns:
  *  - Number of bytes written
+ *  - CHITCP_EWOULDBLOCK: Not enough space, and "blocking" is false
+ *  - CHITCP_ENOMEM: Could not allocate memory for the buffer's data
  *
  */
 int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking);
 
 
+/*
+ * circular_buffer_trim - Free the data of an empty buffer
+ *
+ * The data will be allocated again by the next write, so a buffer that
+ * has been drained and is expected to stay idle for a while can give
+ * its memory back. Sequence numbers are not affected. In SPSC mode, this
+ * may only be called by the reader or the writer (and the buffer is left
+ * as it is if the writer happens to be writing to it).
+ *
+ * buf: circular_buffer_t struct
+ *
+ * Returns:
+ *  - CHITCP_OK: The data was freed (or had not been allocated)
+ *  - CHITCP_EWOULDBLOCK: The buffer is not empty
+ *
+ */
+int circular_buffer_trim(circular_buffer_t *buf);
+
+
+/*
+ * circular_buffer_set_alloc_hook - Set a function to call when the data is allocated
+ *
+ * The function is called by the writer, right after the data has been
+ * allocated (and before anything is written to it). It can be used to
+ * decide where the data's pages are placed.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * hook: Function to call (or NULL, to call none)
+ *
+ * arg: Argument to the function
+ *
+ * Returns:
+ *  - CHITCP_OK: Hook set correctly
+ *
+ */
+int circular_buffer_set_alloc_hook(circular_buffer_t *buf, circular_buffer_alloc_hook_t hook, void *arg);
+
+
 /*
  * circular_buffer_first - Get sequence number of first unread byte
  *
@@ -322,6 +463,28 @@ int circular_buffer_first(circular_buffer_t *buf);
 int circular_buffer_next(circular_buffer_t *buf);
 
 
+/*
+ * circular_buffer_resize - Grow the maximum capacity of the buffer
+ *
+ * The contents of the buffer (and its sequence numbers) are preserved.
+ * Any writer blocked on a full buffer is woken up. Buffers can only grow;
+ * a request for a capacity that is not larger than the current one
+ * leaves the buffer unmodified. SPSC buffers can't be resized at all,
+ * since readers and writers access them without taking the lock.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * maxsize: The new maximum capacity of the buffer
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer resized correctly (or left as it was)
+ *  - CHITCP_ENOMEM: Could not allocate memory for buffer
+ *  - CHITCP_EINVAL: The buffer is an SPSC buffer
+ *
+ */
+int circular_buffer_resize(circular_buffer_t *buf, uint32_t maxsize);
+
+
 /*
  * circular_buffer_capacity - Get maximum capacity of buffer
  *
@@ -53,10 +53,20 @@
 #define GET_CHITCPD_PORT_STRING (getenv("CHITCPD_PORT")? getenv("CHITCPD_PORT"): "23300")
 #define GET_CHITCPD_PORT (atoi(GET_CHITCPD_PORT_STRING))
 
+/* Size of the shared memory window that libchitcp sets up with the
+ * daemon (one per connection to the daemon) to move send()/recv()
+ * payloads without going through the UNIX socket. The window is split
+ * into slots, so each request in flight can use one. The daemon will
+ * not map windows larger than CHITCPD_SHM_MAX. */
+#define CHITCPD_SHM_SLOT_SIZE (64 * 1024)
+#define CHITCPD_SHM_SLOTS (16)
+#define CHITCPD_SHM_SIZE (CHITCPD_SHM_SLOT_SIZE * CHITCPD_SHM_SLOTS)
+#define CHITCPD_SHM_MAX (16 * 1024 * 1024)
+
 /* Returns location of UNIX socket */
 int chitcp_unix_socket(char* buf, int buflen);
 
 /* Macro for getting a sockfd from a pointer in the socket table */
-#define ptr_to_fd(si, entry) ((int) (((char *)entry - (char *)si->chisocket_table) / sizeof(chisocketentry_t)))
+#define ptr_to_fd(si, entry) ((entry)->sockfd)
 
 #endif /* CHITCP_CHITCPD_H_ */
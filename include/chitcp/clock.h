@@ -0,0 +1,162 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Clock used by the timers, the delivery queue and the RTT measurements
+ *
+ *  By default, this is just the system's clock (MT_CLOCK). With the
+ *  virtual clock, time only moves forward when nothing is happening:
+ *  once every thread that waits for a deadline (with chitcp_clock_timedwait
+ *  or chitcp_clock_sleep) is waiting, and none of the threads has looked
+ *  at the clock for a short (real) quiet period, the clock jumps straight
+ *  to the earliest of their deadlines. Long timeouts and delays then take
+ *  almost no real time, so an hour of traffic over a slow, lossy link can
+ *  be simulated in seconds.
+ *
+ *  The quiet period is what tells "idle" apart from "busy": it must be
+ *  longer than it takes for a thread that doesn't use the clock (e.g.,
+ *  one blocked on a socket) to hand its work to one that does. If it is
+ *  too short, the clock can jump while a packet is still on its way,
+ *  which looks to TCP like a slower (but not broken) network.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_CLOCK_H_
+#define CHITCP_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* System clock used for the timer expiry times. A monotonic clock is not
+ * affected by changes to the system time but, on macOS, condition
+ * variables can only wait on the realtime clock (there is no
+ * pthread_condattr_setclock). Condition variables passed to
+ * chitcp_clock_timedwait must wait on this clock. */
+#ifdef __APPLE__
+#define MT_CLOCK CLOCK_REALTIME
+#else
+#define MT_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* Default quiet period of the virtual clock (in nanoseconds) */
+#define CHITCP_CLOCK_QUIET_DEFAULT (2 * 1000000L)
+
+typedef enum
+{
+    CHITCP_CLOCK_REAL     = 0,  /* The system clock */
+    CHITCP_CLOCK_VIRTUAL  = 1,  /* Discrete-event virtual time */
+} chitcp_clock_type_t;
+
+
+/*
+ * chitcp_clock_set - Choose the clock
+ *
+ * This must be done before any timers, threads or daemon are started,
+ * since times taken with one clock make no sense with the other. The
+ * virtual clock starts at the current time of the system clock.
+ *
+ * type: Clock to use
+ *
+ * quiet: For the virtual clock, the quiet period (in nanoseconds, 0 for
+ *        CHITCP_CLOCK_QUIET_DEFAULT). Ignored for the real clock.
+ *
+ * Returns:
+ *  - CHITCP_OK: The clock has been set
+ *  - CHITCP_EINVAL: Unknown clock, or there are threads waiting on the clock
+ *
+ */
+int chitcp_clock_set(chitcp_clock_type_t type, uint64_t quiet);
+
+
+/*
+ * chitcp_clock_type - Get the clock in use
+ *
+ * Returns: The clock's type
+ *
+ */
+chitcp_clock_type_t chitcp_clock_type(void);
+
+
+/*
+ * chitcp_clock_now - Get the current time
+ *
+ * ts: Output parameter for the time (comparable to MT_CLOCK's times)
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcp_clock_now(struct timespec *ts);
+
+
+/*
+ * chitcp_clock_now_ns - Get the current time, in nanoseconds
+ *
+ * Returns: The current time
+ *
+ */
+uint64_t chitcp_clock_now_ns(void);
+
+
+/*
+ * chitcp_clock_timedwait - Wait on a condition variable until a deadline
+ *
+ * Same as pthread_cond_timedwait, except that the deadline is measured
+ * with this clock. Like pthread_cond_timedwait, it can return before the
+ * deadline without having been signalled, so the caller must check
+ * whatever it is waiting for again.
+ *
+ * cv: Condition variable (waiting on MT_CLOCK)
+ *
+ * lock: Mutex, held by the caller
+ *
+ * abstime: Deadline (see chitcp_clock_now)
+ *
+ * Returns: 0 if woken up, ETIMEDOUT if the deadline has passed.
+ *
+ */
+int chitcp_clock_timedwait(pthread_cond_t *cv, pthread_mutex_t *lock, const struct timespec *abstime);
+
+
+/*
+ * chitcp_clock_sleep - Sleep for a while
+ *
+ * ns: How long to sleep (in nanoseconds)
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcp_clock_sleep(uint64_t ns);
+
+#endif /* CHITCP_CLOCK_H_ */
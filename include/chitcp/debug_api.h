@@ -41,6 +41,8 @@
 #define __CHITCPD_DEBUG_API__H_
 
 #include "chitcp/types.h"
+#include <stdio.h>
+#include <sys/socket.h>
 
 /* 
  *
@@ -85,6 +87,15 @@ enum chitcpd_debug_event {
 };
 
 
+/* Can be OR'd into the event flags passed to chitcpd_debug. The daemon
+ * then doesn't wait for the handler at breakpoints: the events are
+ * streamed to the handler, and its responses are ignored (except
+ * DBG_RESP_STOP and DBG_RESP_ACCEPT_MONITOR, which take effect once
+ * the handler returns). So the socket may have moved on from the
+ * event by the time the handler runs. */
+#define DBG_FLAG_NONBLOCKING (1 << 16)
+
+
 /* Methods for turning an enum value into a string suitable for printing in
  * debug print statements or log messages. */
 char *dbg_evt_str(enum chitcpd_debug_event evt);
@@ -196,4 +207,174 @@ debug_socket_state_t *chitcpd_get_socket_state(int sockfd, bool_t include_buffer
 
 int chitcpd_wait_for_state(int sockfd, tcp_state_t tcp_state);
 
+
+/*
+ * Subscriptions: instead of polling chitcpd_get_socket_state, or making
+ * a blocking chitcpd_wait_for_state call for every state, a client can
+ * subscribe to the changes of several sockets at once. The daemon then
+ * pushes notifications over the process's connection to the daemon as
+ * the sockets change, and they are picked up with chitcpd_get_notifications.
+ */
+
+/* Events a subscription can be notified of. Readiness is edge-triggered:
+ * READABLE and WRITABLE are reported when the socket becomes ready
+ * (so, once it has been read from or written to until it would block,
+ * they are reported again the next time it is ready). */
+#define CHITCPD_NOTIFY_STATE    (1 << 0)  /* The socket's TCP state has changed */
+#define CHITCPD_NOTIFY_READABLE (1 << 1)  /* recv() (or accept()) would not block */
+#define CHITCPD_NOTIFY_WRITABLE (1 << 2)  /* send() would not block */
+#define CHITCPD_NOTIFY_WINDOW   (1 << 3)  /* The peer's receive window has reopened */
+#define CHITCPD_NOTIFY_FREED    (1 << 4)  /* Not a valid socket (any more); always reported */
+
+/* A socket to subscribe to (see chitcpd_subscribe) */
+typedef struct chitcpd_subscription_fd
+{
+    int sockfd;
+    int events;     /* CHITCPD_NOTIFY_* flags */
+} chitcpd_subscription_fd_t;
+
+/* Something that happened to a subscribed socket */
+typedef struct chitcpd_notification
+{
+    int sockfd;
+    int events;             /* Which of the subscribed events happened */
+    tcp_state_t tcp_state;  /* State of the socket when the notification was sent */
+    unsigned int states;    /* Every state the socket has been in since the
+                             * previous notification (bit N is set for state N) */
+} chitcpd_notification_t;
+
+typedef struct chitcpd_subscription chitcpd_subscription_t;
+
+/*
+ * Subscribes to the events of NFDS sockets. The first notification about
+ * each socket describes its current state and readiness (so nothing that
+ * happened before the subscription was made can be missed), and the
+ * following ones describe what has changed since. Sockets that have
+ * already been freed (or were never valid) get a CHITCPD_NOTIFY_FREED
+ * notification right away.
+ *
+ * Returns: The subscription (to be cancelled with chitcpd_unsubscribe),
+ *          or NULL if there was an error (and sets errno accordingly).
+ *
+ * Error codes:
+ *  ENOMEM - no memory on client-side
+ *  EPROTO - could not communicate with the daemon
+ */
+chitcpd_subscription_t *chitcpd_subscribe(const chitcpd_subscription_fd_t *fds, int nfds);
+
+/*
+ * Gets up to MAX notifications from subscription SUB, waiting for at most
+ * TIMEOUT milliseconds (indefinitely if TIMEOUT is negative) if there are
+ * none. A subscription should only be waited on by one thread at a time.
+ *
+ * Returns:
+ *  - The number of notifications stored in NOTES (0 on a timeout)
+ *  - -1: error (and sets errno accordingly)
+ *
+ * Error codes:
+ *  ENOMEM - the daemon could not set up the subscription
+ *  EPROTO - could not communicate with the daemon
+ */
+int chitcpd_get_notifications(chitcpd_subscription_t *sub, chitcpd_notification_t *notes, int max, int timeout);
+
+/*
+ * Cancels subscription SUB, and frees it. Notifications that have not
+ * been picked up yet are discarded.
+ *
+ * Returns:
+ *  - 0: success
+ *  - -1: error (and sets errno accordingly)
+ */
+int chitcpd_unsubscribe(chitcpd_subscription_t *sub);
+
+
+/* Performance counters of an active chisocket, returned by
+ * chitcpd_get_stats (see below). The byte counts only include
+ * the segments' payloads. */
+typedef struct chitcp_socket_stats
+{
+    uint64_t segs_in;
+    uint64_t segs_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t retransmits;   /* segments sent more than once */
+    uint64_t dup_acks;      /* duplicate ACKs received */
+    uint64_t out_of_order;  /* segments received after a gap */
+    uint64_t zero_window;   /* times the peer closed its window */
+    uint64_t srtt_us;       /* smoothed round-trip time */
+    uint32_t cwnd;          /* congestion window, in bytes */
+} chitcp_socket_stats_t;
+
+/* Packets sent to, and received from, another chiTCP daemon */
+typedef struct chitcp_connection_stats
+{
+    struct sockaddr_storage peer_addr;
+    uint64_t packets_in;
+    uint64_t packets_out;
+} chitcp_connection_stats_t;
+
+/* Latency of the requests with a given code handled by the daemon.
+ * buckets[i] is the number of requests that took less than 2^i
+ * microseconds (and at least 2^(i-1)), except for the last bucket,
+ * which counts all the slower ones. */
+#define CHITCP_RPC_LATENCY_BUCKETS (24)
+
+typedef struct chitcp_rpc_stats
+{
+    int code;
+    char name[32];  /* e.g., "SEND" */
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t buckets[CHITCP_RPC_LATENCY_BUCKETS];
+} chitcp_rpc_stats_t;
+
+/* Daemon-wide counters, returned by chitcpd_get_stats (see below).
+ * The arrays must be freed with chitcpd_free_stats. */
+typedef struct chitcp_daemon_stats
+{
+    int num_connections;
+    chitcp_connection_stats_t *connections;
+    uint64_t delivery_queue_len;    /* packets waiting to be delivered */
+    uint64_t delivery_queue_max;    /* most packets that have been waiting */
+    uint64_t mem_limit;             /* memory budget (0: no limit) */
+    uint64_t mem_used;              /* bytes charged to it */
+    uint64_t mem_drops;             /* charges refused because it was full */
+    int num_rpcs;
+    chitcp_rpc_stats_t *rpcs;       /* only request codes that have been used */
+    int num_stages;
+    chitcp_rpc_stats_t *stages;     /* latency of the received segments in each stage
+                                     * of the daemon ("delivery", "pending", "tcp" and
+                                     * "total"), if chitcpd samples them (-P) */
+} chitcp_daemon_stats_t;
+
+/*
+ * Gets the performance counters of socket SOCKFD (in SOCKET_STATS) and
+ * the daemon-wide counters (in DAEMON_STATS). SOCKFD can be -1 to only
+ * get the daemon-wide counters, and either of SOCKET_STATS and
+ * DAEMON_STATS can be NULL.
+ *
+ * Returns:
+ *  - 0: success
+ *  - -1: error (and sets errno accordingly)
+ *
+ * Error codes:
+ *  EBADF  - SOCKFD is not an active socket
+ *  ENOMEM - no memory (either in daemon process or on client-side)
+ */
+int chitcpd_get_stats(int sockfd, chitcp_socket_stats_t *socket_stats, chitcp_daemon_stats_t *daemon_stats);
+
+/* Frees the arrays in DAEMON_STATS (but not DAEMON_STATS itself) */
+void chitcpd_free_stats(chitcp_daemon_stats_t *daemon_stats);
+
+/*
+ * Writes the counters returned by chitcpd_get_stats to OUT in the
+ * Prometheus text exposition format, so they can be served to a
+ * Prometheus server (e.g., by a textfile collector). SOCKET_STATS
+ * (labelled with SOCKFD) and DAEMON_STATS can be NULL.
+ *
+ * Returns: 0 on success, -1 if there was an error writing to OUT.
+ */
+int chitcpd_write_stats_prometheus(FILE *out, int sockfd, const chitcp_socket_stats_t *socket_stats,
+                                   const chitcp_daemon_stats_t *daemon_stats);
+
 #endif /* __CHITCPD_DEBUG_API__H_ */
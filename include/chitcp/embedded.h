@@ -0,0 +1,130 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Embedded mode
+ *
+ *  Runs the chiTCP stack inside the application's own process, instead
+ *  of in a separate chitcpd. Once chitcp_embedded_start() returns, the
+ *  chisocket functions are handled directly in the calling thread, and
+ *  send()/recv() data on a single buffer is passed by pointer instead
+ *  of being copied into (and out of) a message.
+ *
+ *  The stack still talks to other chiTCP stacks (embedded or not) over
+ *  its TCP port, just like chitcpd. Only one stack can be embedded in a
+ *  process.
+ *
+ *  Things the application should take care of:
+ *
+ *  - Block or ignore SIGPIPE (chitcpd does this in main()), since the
+ *    stack writes to sockets whose peers may have gone away.
+ *
+ *  - Logging. The stack logs through chilog(), so the application can
+ *    set the level with chitcp_setloglevel() and, if it wants, start the
+ *    log writer with chitcp_log_async_start().
+ *
+ *  - chitcpd_subscribe() is not supported in embedded mode (it fails
+ *    with ENOTSUP). chitcpd_debug() still works if the stack listens
+ *    on a UNIX socket (see unix_socket below).
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_EMBEDDED_H_
+#define CHITCP_EMBEDDED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chitcp/types.h"
+
+typedef struct chitcp_embedded_config
+{
+    /* TCP port for the other chiTCP stacks (0: the chitcpd default) */
+    uint16_t port;
+
+    /* UNIX socket to also accept requests from other processes on, like
+     * chitcpd does (NULL: none; the requests can only come from this
+     * process) */
+    const char *unix_socket;
+
+    /* Run TCP on a pool of num_tcp_workers threads (0: one per CPU)
+     * instead of one thread per socket */
+    bool_t tcp_worker_pool;
+    int num_tcp_workers;
+
+    /* Default size of the sockets' buffers (0: the chitcpd default), and
+     * (if not 0) how large they can grow as they fill up */
+    uint32_t buf_size;
+    uint32_t buf_max;
+
+    /* Memory budget of the stack, and of each socket's queued packets
+     * (0: no limit; see chitcpd's -M and -Q options) */
+    size_t mem_limit;
+    size_t socket_mem_limit;
+
+    /* TCP options */
+    bool_t timestamps;
+    bool_t sack;
+} chitcp_embedded_config_t;
+
+
+/*
+ * chitcp_embedded_start - Start the stack in this process
+ *
+ * config: Configuration (NULL to use the defaults)
+ *
+ * Returns:
+ *  - CHITCP_OK: The stack is running, and the chisocket functions
+ *               will use it
+ *  - CHITCP_EINVAL: A stack is already running in this process
+ *  - CHITCP_ENOMEM: Could not allocate memory for the stack
+ *  - CHITCP_EINIT: Could not start the stack
+ *
+ */
+int chitcp_embedded_start(const chitcp_embedded_config_t *config);
+
+
+/*
+ * chitcp_embedded_stop - Stop the stack running in this process
+ *
+ * Any chisocket calls that are blocked return with an error, and no
+ * more can be made once this function returns.
+ *
+ * Returns:
+ *  - CHITCP_OK: The stack has been stopped
+ *  - CHITCP_EINVAL: No stack is running in this process
+ *
+ */
+int chitcp_embedded_stop(void);
+
+#endif /* CHITCP_EMBEDDED_H_ */
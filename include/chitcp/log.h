@@ -76,6 +76,21 @@ typedef enum {
 #define MINLOG_RCVD_DROP ("DROP_RCVD")
 #define MINLOG_RCVD_DUPLD ("RCVD_DUPLICATE")
 #define MINLOG_RCVD_DELAYED ("RCVD_DELAYED")
+
+/* Most verbose log level compiled in. Messages above this level are
+ * removed at compile time (e.g., build with -DCHILOG_MAX_LEVEL=INFO
+ * to remove all the DEBUG and TRACE messages) */
+#ifndef CHILOG_MAX_LEVEL
+#define CHILOG_MAX_LEVEL TRACE
+#endif
+
+/* Current logging level (use chitcp_setloglevel to change it). The
+ * logging macros check it before calling the logging functions, so
+ * messages that are not printed cost a single comparison */
+extern int chilog_level;
+
+#define CHILOG_ENABLED(level) ((level) <= CHILOG_MAX_LEVEL && (int) (level) <= chilog_level)
+
 /*
  * chitcp_setloglevel - Sets the logging level
  *
@@ -90,9 +105,42 @@ typedef enum {
 void chitcp_setloglevel(loglevel_t level);
 
 
+/*
+ * chitcp_log_async_start - Start logging asynchronously
+ *
+ * Once started, log messages are formatted into a ring buffer of the
+ * thread that logs them (without taking any locks), and a writer
+ * thread prints them, in timestamp order. Messages longer than
+ * CHILOG_MSG_MAX bytes are truncated. If a thread's ring is full,
+ * the thread waits for the writer to catch up, so no messages are lost.
+ *
+ * Messages are printed synchronously until this function is called
+ * (and after chitcp_log_async_stop).
+ *
+ * Returns:
+ *  - CHITCP_OK: The writer thread was started
+ *  - CHITCP_ETHREAD: Could not start the writer thread
+ */
+int chitcp_log_async_start();
+
+
+/*
+ * chitcp_log_async_stop - Print all pending log messages and go back
+ *                         to logging synchronously
+ *
+ * Also called at exit, if asynchronous logging was started.
+ *
+ * Returns: nothing.
+ */
+void chitcp_log_async_stop();
+
+
 /*
  * chilog - Print a log message
  *
+ * The name of the thread is read the first time the thread logs
+ * a message, so threads should be named before they log anything.
+ *
  * level: Logging level of the message
  *
  * fmt: printf-style formatting string
@@ -101,7 +149,9 @@ void chitcp_setloglevel(loglevel_t level);
  *
  * Returns: nothing.
  */
-void chilog(loglevel_t level, char *fmt, ...);
+#define chilog(level, ...) \
+    do { if (CHILOG_ENABLED(level)) chilog_emit(level, __VA_ARGS__); } while(0)
+void chilog_emit(loglevel_t level, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
 /*
  * chilog_tcp - Print the header and payload of a TCP packet
@@ -115,10 +165,30 @@ void chilog(loglevel_t level, char *fmt, ...);
  *
  * Returns: nothing.
  */
-void chilog_tcp(loglevel_t level, tcp_packet_t *packet, char prefix);
+#define chilog_tcp(level, packet, prefix) \
+    do { if (CHILOG_ENABLED(level)) chilog_tcp_emit(level, packet, prefix); } while(0)
+void chilog_tcp_emit(loglevel_t level, tcp_packet_t *packet, char prefix);
 
 
-void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char *prefix);
+/*
+ * chilog_tcp_minimal - Print a one-line summary of a TCP packet
+ *
+ * Only printed when the log level is MINIMAL.
+ *
+ * src, dst: Source and destination of the packet
+ *
+ * sockfd: Socket that sent or received the packet
+ *
+ * packet: TCP packet
+ *
+ * prefix: One of the MINLOG_* prefixes
+ *
+ * Returns: nothing.
+ */
+#define chilog_tcp_minimal(src, dst, sockfd, packet, prefix) \
+    do { if (MINIMAL <= CHILOG_MAX_LEVEL && chilog_level == MINIMAL) \
+             chilog_tcp_minimal_emit(src, dst, sockfd, packet, prefix); } while(0)
+void chilog_tcp_minimal_emit(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char *prefix);
 
 
 /*
@@ -135,7 +205,9 @@ void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd,
  *
  * Returns: nothing
  */
-void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix);
+#define chilog_chitcp(level, packet, prefix) \
+    do { if (CHILOG_ENABLED(level)) chilog_chitcp_emit(level, packet, prefix); } while(0)
+void chilog_chitcp_emit(loglevel_t level, uint8_t *packet, char prefix);
 
 
 /*
@@ -149,7 +221,9 @@ void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix);
  *
  * Returns: nothing.
  */
-void chilog_hex (loglevel_t level, void *data, int len);
+#define chilog_hex(level, data, len) \
+    do { if (CHILOG_ENABLED(level)) chilog_hex_emit(level, data, len); } while(0)
+void chilog_hex_emit(loglevel_t level, void *data, int len);
 
 
 #endif /* CHITCP_LOG_H_ */
@@ -46,6 +46,7 @@
 #include "chitcp/types.h"
 #include "chitcp/utlist.h"
 #include "chitcp/log.h"
+#include "chitcp/clock.h"
 
 #define MAX_TIMER_NAME_LEN (16)
 #define SECOND      (1000000000L)
@@ -53,10 +54,12 @@
 #define MICROSECOND (1000L)
 #define NANOSECOND  (1L)
 
+/* The timer expiry times are measured with chitcp_clock_now (see clock.h) */
 
 /* Forward declarations */
 typedef struct single_timer single_timer_t;
 typedef struct multi_timer multi_timer_t;
+typedef struct timer_wheel timer_wheel_t;
 
 /* Function pointer typedef for timer callback function
  *
@@ -66,7 +69,11 @@ typedef struct multi_timer multi_timer_t;
  * - The parameters to the callback function (can be NULL to indicate
  *   there are no parameters)
  *
- * The callback function does not return anything. */
+ * The callback function does not return anything.
+ *
+ * The callback function is called from the multitimer thread without
+ * holding any of the multitimer's locks, so it can safely call other
+ * mt_* functions on the same multitimer. */
 typedef void (*mt_callback_func)(multi_timer_t*, single_timer_t*, void*);
 
 /* Represents a single timer. */
@@ -89,13 +96,59 @@ typedef struct single_timer
 
     /* How many times has this timer timed out? */
     uint64_t num_timeouts;
+
+    /* Time at which the timer will expire (only meaningful
+     * if the timer is active), measured with chitcp_clock_now */
+    struct timespec expiry;
+
+    /* Callback function, and its parameters */
+    mt_callback_func callback;
+    void *callback_args;
+
+    /* Position of the timer in the multitimer's heap
+     * (only meaningful if the timer is active) */
+    uint16_t heap_index;
+
+    /* Multitimer this timer belongs to */
+    multi_timer_t *mt;
+
+    /* If the multitimer uses a timer wheel: the tick at which the
+     * timer expires, and the wheel list the timer is in */
+    uint64_t expiry_tick;
+    single_timer_t **wheel_list;
+    struct single_timer *prev;
+    struct single_timer *next;
 } single_timer_t;
 
 
 /* A multitimer */
 typedef struct multi_timer
 {
-    /* Add fields here */
+    /* Timers, indexed by their identifier */
+    single_timer_t *timers;
+    uint16_t num_timers;
+
+    /* Binary min-heap with the active timers, ordered by
+     * expiry time. heap[0] is the next timer to expire. */
+    single_timer_t **heap;
+    uint16_t heap_size;
+
+    /* Thread that waits for the next timer to expire, and
+     * calls the callback function when it does. The lock
+     * protects all the fields in the multitimer, and the
+     * condition variable is signaled when heap[0] changes. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+
+    /* Set by mt_free to stop the multitimer thread */
+    bool done;
+
+    /* Timer wheel that this multitimer's timers are kept in.
+     * If not NULL, the multitimer has no heap or thread of its own,
+     * and the wheel's lock is used instead of the multitimer's lock
+     * (see mt_init_wheel) */
+    timer_wheel_t *wheel;
 } multi_timer_t;
 
 
@@ -118,6 +171,29 @@ typedef struct multi_timer
 int mt_init(multi_timer_t *mt, uint16_t num_timers);
 
 
+/*
+ * mt_init_wheel - Initializes a multitimer on top of a timer wheel
+ *
+ * Same as mt_init, but the timers are kept in a timer wheel (see
+ * timerwheel.h) that can be shared by many multitimers, instead of
+ * in a heap with a dedicated thread. The callback functions are
+ * called from the timer wheel's thread. The rest of the mt_* functions
+ * work the same way regardless of how the multitimer was initialized.
+ *
+ * mt: A pointer to enough memory for a multitimer_t struct
+ *
+ * num_timers: The number of timers
+ *
+ * tw: An initialized timer wheel. It must not be freed before
+ *     the multitimer is freed.
+ *
+ * Returns:
+ *  - CHITCP_OK: multitimer created successfully
+ *  - CHITCP_ENOMEM: Could not allocate memory for multitimer
+ */
+int mt_init_wheel(multi_timer_t *mt, uint16_t num_timers, timer_wheel_t *tw);
+
+
 /*
  * mt_free - Frees the multitimer
  *
@@ -199,12 +275,11 @@ int mt_cancel_timer(multi_timer_t *mt, uint16_t id);
  *
  * id: Identifier of the timer
  *
- * name: Name to set for the timer
+ * name: Name to set for the timer (truncated to MAX_TIMER_NAME_LEN)
  *
  * Returns:
  *  - CHITCP_OK: timer set correctly
- *  - CHITCP_EINVAL: Invalid timer identifier, or specified a timer
- *                   that is not active
+ *  - CHITCP_EINVAL: Invalid timer identifier
  */
 int mt_set_timer_name(multi_timer_t *mt, uint16_t id, const char *name);
 
@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
 #include "utlist.h"
 
@@ -75,6 +76,15 @@ typedef struct tcp_packet
 {
     uint8_t    *raw;
     size_t  length;
+
+    /* When chitcpd received the packet, and handed it to its socket
+     * (both zero if the packet's latency is not being traced) */
+    uint64_t trace_recv;
+    uint64_t trace_delivered;
+
+    /* Next packet, when the packet is in a queue of packets (see
+     * tcp_packet_queue_t) or in a list taken off one */
+    struct tcp_packet *next;
 } tcp_packet_t;
 
 
@@ -102,6 +112,9 @@ int chitcp_tcp_packet_create(tcp_packet_t *packet, const uint8_t* payload, uint1
  * the packet (header + payload). It does not free up the tcp_packet_t variable
  * itself. It is the responsibility of the calling function to do so.
  *
+ * If the raw contents are shared with other packets (see
+ * chitcp_tcp_packet_share), they are only freed along with the last packet.
+ *
  * packet: Pointer to packet.
  *
  * Returns: nothing.
@@ -109,6 +122,82 @@ int chitcp_tcp_packet_create(tcp_packet_t *packet, const uint8_t* payload, uint1
 void chitcp_tcp_packet_free(tcp_packet_t *packet);
 
 
+/*
+ * chitcp_tcp_packet_share - Makes a packet share the raw contents of another packet
+ *
+ * Instead of copying the raw contents of the packet, this takes another
+ * reference on them (see chitcp_packet_buf_ref), so the contents must
+ * not be modified while they're shared. Each packet must still be freed
+ * with chitcp_tcp_packet_free.
+ *
+ * dst: Pointer to unitialized tcp_packet_t variable.
+ *
+ * src: Pointer to packet whose contents will be shared.
+ *
+ * Returns: the size in bytes of the TCP packet.
+ */
+int chitcp_tcp_packet_share(tcp_packet_t *dst, tcp_packet_t *src);
+
+
+
+/*
+ *
+ *  Packet buffer pool
+ *
+ */
+
+/* The raw contents of every TCP packet (the "raw" field in tcp_packet_t)
+ * are allocated from a pool of fixed-size slabs, which are large enough
+ * for a TCP header (with options) and an MSS-sized payload. Larger
+ * buffers are allocated with malloc, but are handled the same way.
+ *
+ * Freed slabs go into a per-thread cache (of at most
+ * CHITCP_PACKET_CACHE_SIZE slabs), so the common case of allocating
+ * and freeing a buffer does not take any locks. Slabs only go
+ * back to (or come from) the shared pool in batches.
+ *
+ * Buffers are reference counted, so several packets (e.g., withheld or
+ * duplicated packets) can share the same contents. A buffer is returned
+ * to the pool when its last reference is released. */
+
+#define CHITCP_PACKET_SLAB_SIZE (1024)
+#define CHITCP_PACKET_CACHE_SIZE (64)
+
+/*
+ * chitcp_packet_buf_alloc - Allocates a packet buffer
+ *
+ * The contents of the buffer are not initialized.
+ *
+ * size: Size of the buffer in bytes
+ *
+ * Returns: Pointer to the buffer (with a reference count of one),
+ *          or NULL if memory could not be allocated.
+ */
+uint8_t *chitcp_packet_buf_alloc(size_t size);
+
+
+/*
+ * chitcp_packet_buf_ref - Takes an additional reference on a packet buffer
+ *
+ * raw: Buffer returned by chitcp_packet_buf_alloc
+ *
+ * Returns: raw
+ */
+uint8_t *chitcp_packet_buf_ref(uint8_t *raw);
+
+
+/*
+ * chitcp_packet_buf_unref - Releases a reference on a packet buffer
+ *
+ * The buffer is freed when its last reference is released.
+ *
+ * raw: Buffer returned by chitcp_packet_buf_alloc (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chitcp_packet_buf_unref(uint8_t *raw);
+
+
 /*
  *
  *  List of TCP Packets
@@ -186,6 +275,98 @@ int chitcp_packet_list_destroy(tcp_packet_list_t **pl);
 int chitcp_packet_list_size(tcp_packet_list_t *pl);
 
 
+/*
+ *
+ *  Queue of TCP Packets
+ *
+ */
+
+/* Intrusive multi-producer, single-consumer queue of TCP packets, linked
+ * through their next field. Any number of threads can push packets onto
+ * it, with one atomic operation and no allocation, and a single consumer
+ * takes all the queued packets at once. Internally, it is a stack of the
+ * packets (newest first) that is reversed when it is taken. */
+typedef struct tcp_packet_queue
+{
+    _Atomic(tcp_packet_t *) head;
+} tcp_packet_queue_t;
+
+
+/*
+ * chitcp_packet_queue_init - Initializes an empty queue of packets
+ *
+ * q: Queue
+ *
+ * Returns: Always returns CHITCP_OK.
+ */
+int chitcp_packet_queue_init(tcp_packet_queue_t *q);
+
+
+/*
+ * chitcp_packet_queue_push - Adds a packet to a queue of packets
+ *
+ * Can be called concurrently by any number of threads (and concurrently
+ * with chitcp_packet_queue_take).
+ *
+ * q: Queue
+ *
+ * packet: Packet to add. Its next field is overwritten.
+ *
+ * Returns: true if the queue was empty, false otherwise.
+ */
+bool chitcp_packet_queue_push(tcp_packet_queue_t *q, tcp_packet_t *packet);
+
+
+/*
+ * chitcp_packet_queue_take - Takes all the packets in a queue of packets
+ *
+ * Only the queue's consumer may call this function.
+ *
+ * q: Queue (empty once this function returns)
+ *
+ * Returns: The packets, in the order they were pushed, and linked through
+ *          their next field (the last one's is NULL). NULL if the queue
+ *          was empty.
+ */
+tcp_packet_t *chitcp_packet_queue_take(tcp_packet_queue_t *q);
+
+
+/*
+ * chitcp_packet_queue_empty - Checks whether a queue of packets is empty
+ *
+ * q: Queue
+ *
+ * Returns: true if the queue is empty, false otherwise.
+ */
+bool chitcp_packet_queue_empty(tcp_packet_queue_t *q);
+
+
+/*
+ * chitcp_packet_queue_size - Returns the number of packets in a queue
+ *
+ * Only the queue's consumer may call this function (packets are only
+ * freed once they have been taken off the queue, so it is safe to walk
+ * the packets that are in it).
+ *
+ * q: Queue
+ *
+ * Returns: Number of packets in the queue
+ */
+int chitcp_packet_queue_size(tcp_packet_queue_t *q);
+
+
+/*
+ * chitcp_packet_queue_destroy - Frees the packets in a queue of packets
+ *
+ * There must be no more producers when this function is called.
+ *
+ * q: Queue (empty once this function returns)
+ *
+ * Returns: Always returns CHITCP_OK.
+ */
+int chitcp_packet_queue_destroy(tcp_packet_queue_t *q);
+
+
 /*
  *
  * Withheld packets
@@ -284,6 +465,220 @@ typedef struct tcphdr
 #define SEG_UP(p) (chitcp_ntohs(TCP_PACKET_HEADER(p)->urp))
 
 
+/*
+ *
+ *  TCP Options
+ *
+ */
+
+#define TCP_OPTION_EOL (0)      /* End of option list */
+#define TCP_OPTION_NOP (1)      /* No-operation */
+#define TCP_OPTION_WSCALE (3)   /* Window scale (RFC 7323) */
+#define TCP_OPTION_SACK_PERMITTED (4) /* SACK permitted (RFC 2018) */
+#define TCP_OPTION_SACK (5)     /* SACK (RFC 2018) */
+#define TCP_OPTION_TIMESTAMP (8) /* Timestamps (RFC 7323) */
+#define TCP_OPTION_FASTOPEN (34) /* TCP Fast Open cookie (RFC 7413) */
+
+/* Length of the window scale option, and largest shift allowed */
+#define TCP_OPTION_WSCALE_LEN (3)
+#define TCP_WSCALE_MAX (14)
+
+/* Length of the timestamps option */
+#define TCP_OPTION_TIMESTAMP_LEN (10)
+
+/* Length of the SACK permitted option, and largest number of blocks
+ * in a SACK option (which is two bytes plus eight bytes per block).
+ * Only three blocks fit in a header that also carries timestamps */
+#define TCP_OPTION_SACK_PERMITTED_LEN (2)
+#define TCP_SACK_MAX_BLOCKS (4)
+
+/* Length of the cookies in a TCP Fast Open option (RFC 7413 allows
+ * 4 to 16 bytes, but chiTCP only issues 8-byte cookies) */
+#define TCP_FASTOPEN_COOKIE_LEN (8)
+
+/* A SACK block: the peer has received the bytes from left up to
+ * (but not including) right. Both are in host byte order */
+typedef struct tcp_sack_block
+{
+    uint32_t left;
+    uint32_t right;
+} tcp_sack_block_t;
+
+
+/*
+ * chitcp_tcp_packet_add_wscale - Adds a window scale option to a TCP packet
+ *
+ * The option (preceded by a NOP, to keep the header 32-bit aligned)
+ * is appended to the header's options, and the data offset is updated.
+ * The packet's raw contents are reallocated, so they must not be shared
+ * (see chitcp_tcp_packet_share).
+ *
+ * packet: Pointer to packet.
+ *
+ * shift: Window scale shift count (at most TCP_WSCALE_MAX)
+ *
+ * Returns:
+ *  - CHITCP_OK: Option added correctly
+ *  - CHITCP_EINVAL: Invalid shift count, or no room for more options
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+int chitcp_tcp_packet_add_wscale(tcp_packet_t *packet, uint8_t shift);
+
+
+/*
+ * chitcp_tcp_packet_get_wscale - Gets the window scale option of a TCP packet
+ *
+ * packet: Pointer to packet.
+ *
+ * Returns:
+ *  - The shift count in the packet's window scale option (capped
+ *    to TCP_WSCALE_MAX, as required by RFC 7323)
+ *  - CHITCP_ENOENT: The packet has no window scale option
+ *
+ */
+int chitcp_tcp_packet_get_wscale(tcp_packet_t *packet);
+
+
+/*
+ * chitcp_tcp_packet_add_timestamp - Adds a timestamps option to a TCP packet
+ *
+ * The option (preceded by two NOPs, to keep the header 32-bit aligned)
+ * is appended to the header's options, as in chitcp_tcp_packet_add_wscale.
+ *
+ * packet: Pointer to packet.
+ *
+ * tsval: Timestamp value (TSval)
+ *
+ * tsecr: Timestamp echo reply (TSecr)
+ *
+ * Returns:
+ *  - CHITCP_OK: Option added correctly
+ *  - CHITCP_EINVAL: No room for more options
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+int chitcp_tcp_packet_add_timestamp(tcp_packet_t *packet, uint32_t tsval, uint32_t tsecr);
+
+
+/*
+ * chitcp_tcp_packet_get_timestamp - Gets the timestamps option of a TCP packet
+ *
+ * packet: Pointer to packet.
+ *
+ * tsval, tsecr: Output parameters for the option's TSval and TSecr
+ *
+ * Returns:
+ *  - CHITCP_OK: The packet has a timestamps option
+ *  - CHITCP_ENOENT: The packet has no timestamps option
+ *
+ */
+int chitcp_tcp_packet_get_timestamp(tcp_packet_t *packet, uint32_t *tsval, uint32_t *tsecr);
+
+
+/*
+ * chitcp_tcp_packet_add_sack_permitted - Adds a SACK permitted option to a TCP packet
+ *
+ * The option (preceded by two NOPs, to keep the header 32-bit aligned)
+ * is appended to the header's options, as in chitcp_tcp_packet_add_wscale.
+ *
+ * packet: Pointer to packet.
+ *
+ * Returns:
+ *  - CHITCP_OK: Option added correctly
+ *  - CHITCP_EINVAL: No room for more options
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+int chitcp_tcp_packet_add_sack_permitted(tcp_packet_t *packet);
+
+
+/*
+ * chitcp_tcp_packet_get_sack_permitted - Checks for a SACK permitted option
+ *
+ * packet: Pointer to packet.
+ *
+ * Returns:
+ *  - CHITCP_OK: The packet has a SACK permitted option
+ *  - CHITCP_ENOENT: The packet has no SACK permitted option
+ *
+ */
+int chitcp_tcp_packet_get_sack_permitted(tcp_packet_t *packet);
+
+
+/*
+ * chitcp_tcp_packet_add_sack - Adds a SACK option to a TCP packet
+ *
+ * The option (preceded by two NOPs, to keep the header 32-bit aligned)
+ * is appended to the header's options, as in chitcp_tcp_packet_add_wscale.
+ * If there isn't room for all the blocks, only the first ones are added.
+ *
+ * packet: Pointer to packet.
+ *
+ * blocks: SACK blocks
+ *
+ * nblocks: Number of blocks (at most TCP_SACK_MAX_BLOCKS)
+ *
+ * Returns:
+ *  - The number of blocks added
+ *  - CHITCP_EINVAL: Invalid number of blocks, or no room for even one block
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+int chitcp_tcp_packet_add_sack(tcp_packet_t *packet, const tcp_sack_block_t *blocks, int nblocks);
+
+
+/*
+ * chitcp_tcp_packet_get_sack - Gets the blocks in the SACK option of a TCP packet
+ *
+ * packet: Pointer to packet.
+ *
+ * blocks: Output parameter for the blocks (room for TCP_SACK_MAX_BLOCKS)
+ *
+ * Returns: The number of blocks in the packet's SACK option
+ *          (zero if it has no SACK option)
+ *
+ */
+int chitcp_tcp_packet_get_sack(tcp_packet_t *packet, tcp_sack_block_t *blocks);
+
+
+/*
+ * chitcp_tcp_packet_add_fastopen - Adds a TCP Fast Open option to a TCP packet
+ *
+ * The option (preceded by two NOPs, to keep the header 32-bit aligned)
+ * is appended to the header's options, as in chitcp_tcp_packet_add_wscale.
+ * An option without a cookie is a cookie request.
+ *
+ * packet: Pointer to packet.
+ *
+ * cookie, len: Cookie (len must be zero or TCP_FASTOPEN_COOKIE_LEN)
+ *
+ * Returns:
+ *  - CHITCP_OK: Option added correctly
+ *  - CHITCP_EINVAL: Invalid cookie length, or no room for more options
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+int chitcp_tcp_packet_add_fastopen(tcp_packet_t *packet, const uint8_t *cookie, int len);
+
+
+/*
+ * chitcp_tcp_packet_get_fastopen - Gets the TCP Fast Open option of a TCP packet
+ *
+ * packet: Pointer to packet.
+ *
+ * cookie: Output parameter for the cookie (room for TCP_FASTOPEN_COOKIE_LEN
+ *         bytes). A cookie of any other length is ignored, and the option
+ *         is treated as a cookie request.
+ *
+ * Returns:
+ *  - The length of the cookie (zero for a cookie request)
+ *  - CHITCP_ENOENT: The packet has no TCP Fast Open option
+ *
+ */
+int chitcp_tcp_packet_get_fastopen(tcp_packet_t *packet, uint8_t *cookie);
+
+
 /*
  *
  *  chiTCP Header
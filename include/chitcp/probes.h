@@ -0,0 +1,77 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Static tracepoints
+ *
+ *  CHITCP_PROBE(name, args...) marks a point in the code (with up to
+ *  twelve integer or pointer arguments) that a tracer can attach to.
+ *  When chiTCP is built with CHITCP_USDT (cmake -DCHITCP_USDT=ON, which
+ *  needs <sys/sdt.h> from SystemTap), these are USDT probes in the
+ *  "chitcp" provider, which can be used with bpftrace, SystemTap, perf
+ *  or DTrace, e.g.:
+ *
+ *      bpftrace -e 'usdt:./chitcpd:chitcp:deliver_packet { @[arg0] = count(); }'
+ *
+ *  A probe is a single nop until a tracer is attached to it. Without
+ *  CHITCP_USDT, probes compile to nothing (and their arguments are
+ *  not evaluated).
+ *
+ *  The probes along the path of a received segment are:
+ *
+ *  - connection_recv(packet, len): read from another chitcpd
+ *  - recv_tcp_packet(packet, len): about to be demultiplexed
+ *  - deliver_packet(sockfd, packet, len): handed to the socket (after
+ *    the delivery queue, if there is any latency)
+ *  - dispatch_tcp_entry(sockfd, event, state) and
+ *    dispatch_tcp_exit(sockfd, event, state, rc): TCP handling an event
+ *  - buffer_write(buf, len, written) and buffer_read(buf, len, read):
+ *    data going in and out of the socket buffers
+ *  - handler_entry(code, request_id) and handler_exit(code, request_id,
+ *    rc): a request being handled (once per attempt, if it has to wait),
+ *    and handler_done(code, us) once it is complete
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHITCP_PROBES_H_
+#define CHITCP_PROBES_H_
+
+#ifdef CHITCP_USDT
+#include <sys/sdt.h>
+#define CHITCP_PROBE(name, ...) STAP_PROBEV(chitcp, name, ##__VA_ARGS__)
+#else
+#define CHITCP_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* CHITCP_PROBES_H_ */
@@ -55,6 +55,8 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 extern int chisocket_socket(int domain, int type, int protocol);
 extern int chisocket_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
@@ -64,6 +66,216 @@ extern int chisocket_accept(int sockfd, struct sockaddr* addr, socklen_t *addrle
 extern int chisocket_close(int sockfd);
 extern ssize_t chisocket_recv(int sockfd, void *buffer, size_t length, int flags);
 extern ssize_t chisocket_send(int sockfd, const void *buffer, size_t length, int flags);
+extern ssize_t chisocket_sendto(int sockfd, const void *buffer, size_t length, int flags,
+                                const struct sockaddr *addr, socklen_t addrlen);
+extern int chisocket_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+extern int chisocket_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
+
+/*
+ * Socket options
+ *
+ * At the SOL_SOCKET level, SO_SNDBUF and SO_RCVBUF set the size of the
+ * socket's buffers, and SO_RCVLOWAT sets how many bytes a blocking recv()
+ * waits for (and poll() waits for before reporting POLLIN), unless the
+ * connection is closing. SO_REUSEPORT, which must be set before the
+ * socket is bound, lets several sockets (e.g., in different processes)
+ * bind to the same address and port if all of them set it. If several
+ * of them are listening, each new connection goes to one of them,
+ * chosen by a hash of its addresses and ports, so each one has its own
+ * accept queue. At the IPPROTO_TCP level, TCP_NODELAY disables
+ * Nagle's algorithm (small segments are sent right away, even if there
+ * is unacknowledged data) and TCP_QUICKACK disables delayed ACKs (every
+ * segment with data is acknowledged right away). Unlike Linux, where
+ * TCP_QUICKACK is only a temporary hint, it remains set until cleared.
+ * All TCP-level options are inherited by sockets returned by
+ * chisocket_accept().
+ */
+/* These have the same values as on Linux (<netinet/tcp.h> can't be
+ * included alongside chiTCP's packet.h, which defines its own tcphdr) */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY (1)
+#endif
+#ifndef TCP_QUICKACK
+#define TCP_QUICKACK (12)
+#endif
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION (13)
+#endif
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN (23)
+#endif
+#ifndef MSG_FASTOPEN
+#define MSG_FASTOPEN (0x20000000)
+#endif
+
+/* TCP_CONGESTION selects the socket's congestion control algorithm.
+ * Unlike on Linux, it takes an int (one of the values below) instead
+ * of the algorithm's name, and it must be set before the socket is
+ * connected (setting it on a listening socket sets it for the sockets
+ * it accepts). The daemon's default can be set with chitcpd -C */
+#define CHITCP_CC_NEWRENO (0)
+#define CHITCP_CC_CUBIC (1)
+
+/* SO_MAX_PACING_RATE paces the socket's transmissions: segments are
+ * released at an even rate (in small bursts) instead of a whole window
+ * at a time. Unlike on Linux, where it caps the rate the fq qdisc paces
+ * at, the value is the rate itself, in bytes per second.
+ * CHITCP_PACING_AUTO paces at a rate derived from the connection's
+ * congestion window and smoothed RTT (and doesn't pace until there is
+ * an RTT sample), and zero (the default) disables pacing. It can be
+ * set at any time, and is inherited by sockets returned by
+ * chisocket_accept() */
+/* SO_PRIORITY (0 to 6, as on Linux without CAP_NET_ADMIN) sets the
+ * socket's share of the connection to the peer's daemon, which all
+ * the sockets to that peer hashed onto it share: their segments are
+ * sent by deficit round robin, and a socket with priority p gets
+ * p + 1 times the share of one with priority 0. Sockets with priority 6
+ * (TC_PRIO_INTERACTIVE) have strict priority over all the others. It
+ * is inherited by sockets returned by chisocket_accept() */
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE (47)
+#endif
+#define CHITCP_PACING_AUTO (-1)
+
+/*
+ * TCP Fast Open (RFC 7413)
+ *
+ * chisocket_sendto() with the MSG_FASTOPEN flag connects an unconnected
+ * socket to addr and sends the data, like connect() followed by send(),
+ * but the data can go in the SYN itself. For that, the daemon needs a
+ * cookie from the peer, which it asks for in the SYN of the first
+ * connection to that peer (whose data is then sent after the handshake,
+ * as usual) and caches for the following ones. It returns the number of
+ * bytes that were queued (at most the socket's send buffer), once the
+ * connection is established (or right away, on a non-blocking socket).
+ * Without MSG_FASTOPEN, chisocket_sendto() is the same as chisocket_send(),
+ * and addr is ignored.
+ *
+ * A listening socket only accepts data in SYNs (and issues cookies) if
+ * TCP_FASTOPEN is set (to a non-zero int) before chisocket_listen().
+ * The data is then handed to the application right away: its socket is
+ * returned by chisocket_accept(), and can send, before the handshake is
+ * complete, so a reply can go out one RTT earlier too.
+ */
+
+/*
+ * Vectored and file-backed I/O
+ *
+ * chisocket_sendv() and chisocket_recvv() are like chisocket_send() and
+ * chisocket_recv(), but gather the data from (or scatter it into) several
+ * buffers, like writev() and readv(). The data is copied straight between
+ * those buffers and the shared data window, so there is no need to
+ * assemble a message in a single buffer first.
+ *
+ * chisocket_sendfile() sends up to count bytes of the file open on fd,
+ * like Linux's sendfile(): starting at *offset (which is then advanced
+ * past the data that was sent), or, if offset is NULL, at the file's
+ * current offset (which is advanced instead). The daemon reads the file
+ * itself, so the data never goes through the application's memory.
+ * Regular files are mapped into the daemon's memory; other files
+ * (e.g., pipes) are read, and then offset must be NULL.
+ */
+extern ssize_t chisocket_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+extern ssize_t chisocket_recvv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+extern ssize_t chisocket_sendfile(int sockfd, int fd, off_t *offset, size_t count);
+
+/*
+ * Non-blocking sockets
+ *
+ * chisocket_fcntl() supports F_GETFL and F_SETFL, and O_NONBLOCK is the
+ * only flag that can be set (sockets can also be created non-blocking
+ * by passing SOCK_NONBLOCK to chisocket_socket(), where available).
+ * On a non-blocking socket, recv(), send() and accept() fail with
+ * EAGAIN instead of blocking, and connect() fails with EINPROGRESS once
+ * it has started the three-way handshake. As in BSD, sockets returned by
+ * accept() inherit O_NONBLOCK from the listening socket, and they are
+ * returned before the handshake has finished. The same can be done for
+ * a single recv() or send() by passing the MSG_DONTWAIT flag.
+ *
+ * recv() also supports MSG_PEEK (the data is returned, but left in the
+ * socket's buffer) and MSG_WAITALL (a blocking recv() waits for all the
+ * data it asked for, or for as much as the socket's receive buffer can
+ * hold, unless the connection is closing). A recv() that goes through the
+ * shared data window never asks for more than fits in its slot.
+ *
+ * chisocket_poll() waits, like poll(), until any of the given chisockets
+ * is ready. POLLOUT is only reported once a socket is connected, so it
+ * also signals the end of a non-blocking connect(). Since a chisocket is
+ * freed once its connection is fully closed, POLLNVAL may be reported
+ * for a socket that was closed (or whose connection attempt failed).
+ * Each call to chisocket_poll() is a single request to the daemon, which
+ * is woken up by the sockets themselves (instead of checking them
+ * periodically), so a single thread can serve many sockets.
+ */
+extern int chisocket_fcntl(int sockfd, int cmd, ... /* int arg */);
+extern int chisocket_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/*
+ * Batches of socket operations
+ *
+ * A batch collects several operations and sends them to the chiTCP
+ * daemon in a single request when chisocket_batch_run() is called.
+ * The daemon carries them out in the order they were added, just as
+ * if they had been called one by one.
+ *
+ * Each chisocket_batch_* call returns the index of the operation in the
+ * batch (or -1, with errno set, if it could not be added). Operations
+ * that take a socket can refer to the socket created by an earlier
+ * chisocket_batch_socket() in the same batch with CHISOCKET_BATCH_RESULT(i),
+ * where i is the index of that operation. For example:
+ *
+ *     chisocket_batch_t *batch = chisocket_batch_new();
+ *     int s = chisocket_batch_socket(batch, AF_INET, SOCK_STREAM, IPPROTO_TCP);
+ *     chisocket_batch_connect(batch, CHISOCKET_BATCH_RESULT(s), addr, addrlen);
+ *     chisocket_batch_send(batch, CHISOCKET_BATCH_RESULT(s), msg, msglen, 0);
+ *     chisocket_batch_run(batch, 0);
+ *     ...
+ *     chisocket_batch_free(batch);
+ *
+ * Once the batch has run, chisocket_batch_result() returns what each
+ * operation would have returned if it had been called on its own.
+ */
+typedef struct chisocket_batch chisocket_batch_t;
+
+#define CHISOCKET_BATCH_RESULT(i) (-2 - (i))
+
+extern chisocket_batch_t *chisocket_batch_new();
+extern int chisocket_batch_socket(chisocket_batch_t *batch, int domain, int type, int protocol);
+extern int chisocket_batch_bind(chisocket_batch_t *batch, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+extern int chisocket_batch_listen(chisocket_batch_t *batch, int sockfd, int backlog);
+extern int chisocket_batch_connect(chisocket_batch_t *batch, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+extern int chisocket_batch_send(chisocket_batch_t *batch, int sockfd, const void *buffer, size_t length, int flags);
+extern int chisocket_batch_close(chisocket_batch_t *batch, int sockfd);
+
+/*
+ * chisocket_batch_run - Carry out the operations in a batch
+ *
+ * batch: Batch
+ *
+ * stop_on_error: If true, the operations after the first one that fails
+ *                are not carried out
+ *
+ * Returns: The number of operations that were carried out, or -1 (with
+ *          errno set) if the batch could not be sent to the daemon.
+ */
+extern int chisocket_batch_run(chisocket_batch_t *batch, int stop_on_error);
+
+/*
+ * chisocket_batch_result - Get the result of an operation in a batch
+ *
+ * batch: Batch (that has been run)
+ *
+ * i: Index of the operation
+ *
+ * error: If not NULL, used to return the operation's errno (0 if it succeeded)
+ *
+ * Returns: The operation's return value, or -1 (with *error set to
+ *          ECANCELED) if the operation was not carried out.
+ */
+extern int chisocket_batch_result(chisocket_batch_t *batch, int i, int *error);
+
+extern void chisocket_batch_free(chisocket_batch_t *batch);
 
 #endif  /* __CHITCP_SOCKET_H__ */
 
@@ -1,6 +1,7 @@
 #ifndef TESTER_H_
 #define TESTER_H_
 
+#include <pthread.h>
 #include "chitcp/debug_api.h"
 
 typedef struct chitcp_tester_peer chitcp_tester_peer_t;
@@ -9,8 +10,14 @@ typedef struct chitcp_tester
 {
     chitcp_tester_peer_t *server;
     chitcp_tester_peer_t *client;
+
+    /* Port the server listens on (and the client connects to) */
+    uint16_t port;
 } chitcp_tester_t;
 
+/* Port used by a tester unless chitcp_tester_set_port is called */
+#define CHITCP_TESTER_DEFAULT_PORT (7) // The echo protocol
+
 
 typedef int (*chitcp_tester_runnable)(int sockfd, void *args);
 
@@ -27,6 +34,23 @@ typedef int (*chitcp_tester_runnable)(int sockfd, void *args);
 int chitcp_tester_init(chitcp_tester_t* tester);
 
 
+/*
+ * chitcp_tester_set_port - Sets the port the tester's server listens on
+ *
+ * Testers that run at the same time must use different ports.
+ * Must be called before chitcp_tester_start.
+ *
+ * tester: Tester data structure
+ *
+ * port: Port (in host byte order)
+ *
+ * Returns:
+ *  - CHITCP_OK: Port set correctly
+ *
+ */
+int chitcp_tester_set_port(chitcp_tester_t* tester, uint16_t port);
+
+
 /*
  * chitcp_tester_free - Frees a tester's resources
  *
@@ -212,4 +236,169 @@ int chitcp_tester_server_close(chitcp_tester_t* tester);
 int chitcp_tester_server_exit(chitcp_tester_t* tester);
 int chitcp_tester_client_exit(chitcp_tester_t* tester);
 
+
+/*
+ * Multi-peer mode
+ *
+ * A chitcp_multi_tester_t runs N clients against one or more servers.
+ * Server s listens on port + s, and client i connects to server
+ * i % num_servers. Every connection a server accepts runs the server's
+ * runnable in a thread of its own, and every client runs its own
+ * runnable (which can be set for each client, or for all of them).
+ * At most "concurrency" clients are connected at a time (all of them,
+ * if it is zero), and their start times are spread evenly over the
+ * first ramp_up seconds. Each side closes its socket once its runnable
+ * returns.
+ */
+typedef struct chitcp_multi_tester_client chitcp_multi_tester_client_t;
+typedef struct chitcp_multi_tester_server chitcp_multi_tester_server_t;
+
+typedef struct chitcp_multi_tester
+{
+    int num_clients;
+    int num_servers;
+    uint16_t port;
+    int concurrency;
+    double ramp_up;
+
+    chitcp_tester_runnable server_func;
+    void *server_args;
+
+    chitcp_multi_tester_client_t *clients;
+    chitcp_multi_tester_server_t *servers;
+
+    /* Next client to start, and when the first one started */
+    int next_client;
+    uint64_t start;
+    pthread_mutex_t lock;
+} chitcp_multi_tester_t;
+
+/* Outcome of a client in a multi-peer tester */
+typedef struct chitcp_tester_result
+{
+    int rc;              /* What the runnable returned (-1 if it didn't run) */
+    int error;           /* errno, if the socket couldn't be opened or connected */
+    uint64_t connect_ns; /* How long connect() took */
+    uint64_t run_ns;     /* How long the runnable took */
+} chitcp_tester_result_t;
+
+/* Aggregated results of a multi-peer tester */
+typedef struct chitcp_tester_summary
+{
+    int clients;
+    int connected;          /* Clients that connected */
+    int failed;             /* Clients that didn't connect, or whose runnable failed */
+    int server_failed;      /* Connections whose server runnable failed */
+    uint64_t elapsed_ns;    /* From the start of the first client until all sockets were closed */
+    uint64_t connect_avg_ns;
+    uint64_t connect_max_ns;
+    uint64_t run_avg_ns;
+    uint64_t run_max_ns;
+} chitcp_tester_summary_t;
+
+
+/*
+ * chitcp_multi_tester_init - Initializes a multi-peer tester
+ *
+ * The servers listen on CHITCP_TESTER_DEFAULT_PORT and up, all the
+ * clients are connected at once, and there is no ramp-up (the fields
+ * of the tester can be changed before chitcp_multi_tester_run).
+ *
+ * mt: Tester data structure
+ *
+ * num_clients: Number of clients
+ *
+ * num_servers: Number of servers
+ *
+ * Returns:
+ *  - CHITCP_OK: Tester initialized correctly
+ *  - CHITCP_EINVAL: There must be at least a client and a server
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *  - CHITCP_ESYNC: Could not initialize the tester's lock
+ *
+ */
+int chitcp_multi_tester_init(chitcp_multi_tester_t *mt, int num_clients, int num_servers);
+
+
+/*
+ * chitcp_multi_tester_client_run_set - Specify a function for clients to run
+ *
+ * mt: Tester data structure
+ *
+ * client: Client (or -1 for all of them)
+ *
+ * func: Function to run
+ *
+ * args: Argument to func
+ *
+ * Returns:
+ *  - CHITCP_OK: Function set correctly
+ *  - CHITCP_EINVAL: No such client
+ */
+int chitcp_multi_tester_client_run_set(chitcp_multi_tester_t *mt, int client, chitcp_tester_runnable func, void *args);
+
+
+/*
+ * chitcp_multi_tester_server_run_set - Specify a function for the servers
+ *                                      to run on each connection
+ *
+ * func may be called by several threads at once (with the same args).
+ *
+ * Returns:
+ *  - CHITCP_OK: Function set correctly
+ */
+int chitcp_multi_tester_server_run_set(chitcp_multi_tester_t *mt, chitcp_tester_runnable func, void *args);
+
+
+/*
+ * chitcp_multi_tester_run - Run a multi-peer tester
+ *
+ * Opens the servers' sockets, runs all the clients, and returns once
+ * every client and every connection the servers accepted is done and
+ * closed (and the servers' sockets are closed).
+ *
+ * mt: Tester data structure
+ *
+ * Returns:
+ *  - CHITCP_OK: The tester ran (the results of each client are in
+ *               chitcp_multi_tester_result)
+ *  - CHITCP_ESOCKET: A server could not listen on its port
+ *  - CHITCP_ETHREAD: Could not create a thread
+ */
+int chitcp_multi_tester_run(chitcp_multi_tester_t *mt);
+
+
+/*
+ * chitcp_multi_tester_result - Get the results of a client
+ *
+ * mt: Tester data structure
+ *
+ * client: Client
+ *
+ * Returns: The client's results (NULL if there is no such client).
+ */
+const chitcp_tester_result_t *chitcp_multi_tester_result(chitcp_multi_tester_t *mt, int client);
+
+
+/*
+ * chitcp_multi_tester_summary - Aggregate the results of all the clients
+ *
+ * mt: Tester data structure
+ *
+ * summary: Output parameter
+ *
+ * Returns:
+ *  - CHITCP_OK: Always
+ */
+int chitcp_multi_tester_summary(chitcp_multi_tester_t *mt, chitcp_tester_summary_t *summary);
+
+
+/*
+ * chitcp_multi_tester_free - Frees a multi-peer tester's resources
+ *
+ * Returns:
+ *  - CHITCP_OK: Always
+ */
+int chitcp_multi_tester_free(chitcp_multi_tester_t *mt);
+
 #endif /* TESTER_H_ */
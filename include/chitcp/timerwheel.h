@@ -0,0 +1,166 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  A hierarchical timer wheel, which can hold the timers of
+ *  many multitimers and drive all of them from a single thread.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "chitcp/multitimer.h"
+
+/* The wheel has TW_LEVELS levels of TW_SLOTS slots each. A slot
+ * in level 0 covers one tick, a slot in level 1 covers TW_SLOTS
+ * ticks, and so on. Timers further in the future than the wheel
+ * can represent (~4.6 hours with 1ms ticks) are parked in the
+ * last level and re-inserted when that level cascades. */
+#define TW_TICK      (1 * MILLISECOND)
+#define TW_LEVELS    (4)
+#define TW_SLOT_BITS (6)
+#define TW_SLOTS     (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+struct timer_wheel
+{
+    /* Each slot is a list of timers */
+    single_timer_t *slots[TW_LEVELS][TW_SLOTS];
+
+    /* Timers that have expired, and whose callbacks are pending */
+    single_timer_t *expired;
+
+    /* Number of timers in the wheel (including the expired list) */
+    uint32_t num_timers;
+
+    /* Next tick to process. Ticks are counted from start_time */
+    uint64_t current_tick;
+    struct timespec start_time;
+
+    /* Tick the thread will sleep until (UINT64_MAX if it is
+     * waiting for a timer to be added) */
+    uint64_t wake_tick;
+
+    /* Timer whose callback is being run (if any) */
+    single_timer_t *running;
+
+    /* Thread that advances the wheel. The lock protects the wheel,
+     * and the state of all the timers in it. cv is signaled when
+     * the thread must recompute how long to sleep for, and
+     * cv_running when a callback has finished running. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_cond_t cv_running;
+
+    /* Set by tw_free to stop the thread */
+    bool done;
+};
+
+
+/*
+ * tw_init - Initializes a timer wheel and starts its thread
+ *
+ * tw: A pointer to enough memory for a timer_wheel_t struct
+ *
+ * Returns:
+ *  - CHITCP_OK: timer wheel created successfully
+ *  - CHITCP_EINIT: Could not initialize some part of the timer wheel
+ *  - CHITCP_ETHREAD: Could not create timer wheel thread
+ */
+int tw_init(timer_wheel_t *tw);
+
+
+/*
+ * tw_free - Stops the timer wheel thread and frees its resources
+ *
+ * All multitimers using this wheel must have been freed already.
+ *
+ * tw: Timer wheel
+ *
+ * Returns:
+ *  - CHITCP_OK: timer wheel freed successfully
+ */
+int tw_free(timer_wheel_t *tw);
+
+
+/*
+ * __tw_add - Adds a timer to the wheel
+ *
+ * The timer's expiry, callback, and callback_args must already be set.
+ * Must be called with the wheel's lock held.
+ *
+ * tw: Timer wheel
+ *
+ * timer: Timer
+ *
+ * timeout: Timeout in nanoseconds (rounded up to a whole number of ticks)
+ *
+ * Returns: nothing
+ */
+void __tw_add(timer_wheel_t *tw, single_timer_t *timer, uint64_t timeout);
+
+
+/*
+ * __tw_remove - Removes a timer from the wheel
+ *
+ * Must be called with the wheel's lock held.
+ *
+ * tw: Timer wheel
+ *
+ * timer: Timer
+ *
+ * Returns: nothing
+ */
+void __tw_remove(timer_wheel_t *tw, single_timer_t *timer);
+
+
+/*
+ * __tw_wait_for_callbacks - Waits until no callback of a multitimer is running
+ *
+ * Must be called with the wheel's lock held.
+ *
+ * tw: Timer wheel
+ *
+ * mt: Multitimer
+ *
+ * Returns: nothing
+ */
+void __tw_wait_for_callbacks(timer_wheel_t *tw, multi_timer_t *mt);
+
+#endif /* TIMERWHEEL_H_ */
@@ -76,6 +76,10 @@ typedef int bool_t;
 
 #define UNIX_PATH_MAX (108)
 
+/* Size of a cache line. Data that is written by different threads is
+ * kept apart by this much, so that the threads don't contend for it */
+#define CHITCP_CACHE_LINE (64)
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
@@ -42,6 +42,8 @@
 #ifndef CHITCP_UTILS_H_
 #define CHITCP_UTILS_H_
 
+#include <stdint.h>
+
 /*
  * cksum - Computes a checksum
  *
@@ -56,6 +58,86 @@
  */
 uint16_t cksum(const void *_data, int len);
 
+/*
+ * cksum_partial - Adds data to a running checksum
+ *
+ * A checksum over several pieces of data (e.g., a pseudo-header and a
+ * TCP segment) is computed by passing the sum returned for each piece to
+ * the next one, starting with 0, and then calling cksum_finish. Every
+ * piece but the last one must have an even length.
+ *
+ * The sum is kept in host byte order (the one's complement sum does not
+ * depend on the byte order, as long as cksum_finish is given the same
+ * kind of sum), so the data does not have to be aligned or converted.
+ *
+ * _data: Pointer to the data to add
+ *
+ * len: Number of bytes of data
+ *
+ * sum: Running sum (0 for the first piece)
+ *
+ * Returns: The new running sum
+ *
+ */
+uint32_t cksum_partial(const void *_data, int len, uint32_t sum);
+
+/*
+ * cksum_copy_partial - Copies data and adds it to a running checksum
+ *
+ * Same as memcpy followed by cksum_partial, but the data is only read
+ * once. DST and SRC must not overlap.
+ *
+ * dst: Where to copy the data to
+ *
+ * src: Data to copy and add to the sum
+ *
+ * len: Number of bytes of data
+ *
+ * sum: Running sum (0 for the first piece)
+ *
+ * Returns: The new running sum
+ *
+ */
+uint32_t cksum_copy_partial(void *dst, const void *src, int len, uint32_t sum);
+
+/*
+ * cksum_finish - Turns a running sum into a checksum
+ *
+ * sum: Running sum, from cksum_partial or cksum_copy_partial
+ *
+ * Returns: 16-bit checksum, in network byte order (ready to be
+ *          stored in a header)
+ *
+ */
+uint16_t cksum_finish(uint32_t sum);
+
+/*
+ * cksum_update16 - Updates a checksum after a 16-bit field has changed
+ *
+ * Computes the new checksum without going over the rest of the data
+ * again, as in RFC 1624 (eqn. 3). All values are as stored in the
+ * header (in network byte order).
+ *
+ * check: Checksum before the change
+ *
+ * old: Previous value of the field
+ *
+ * new: New value of the field
+ *
+ * Returns: The checksum with the new value of the field
+ *
+ */
+uint16_t cksum_update16(uint16_t check, uint16_t old, uint16_t new);
+
+/*
+ * cksum_update32 - Updates a checksum after a 32-bit field has changed
+ *
+ * Same as cksum_update16, for a 32-bit field (e.g., a sequence or
+ * acknowledgement number) that starts at an even offset.
+ *
+ */
+uint16_t cksum_update32(uint16_t check, uint32_t old, uint32_t new);
+
 int chitcp_socket_send(int socket, const void *buffer, int length);
 int chitcp_socket_recv(int socket, void *buffer, int length);
 
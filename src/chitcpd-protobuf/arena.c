@@ -0,0 +1,147 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Bump allocator for unpacking and building chitcpd messages.
+ *
+ *  See arena.h for more details.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#include "chitcp/types.h"
+#include "arena.h"
+
+#define ARENA_ALIGN (alignof(max_align_t))
+
+
+/* The allocator given to protobuf-c */
+static void *chitcpd_arena_pb_alloc(void *allocator_data, size_t size)
+{
+    return chitcpd_arena_alloc((chitcpd_arena_t *) allocator_data, size);
+}
+
+/* Memory is only given back when the arena is reset */
+static void chitcpd_arena_pb_free(void *allocator_data, void *pointer)
+{
+}
+
+
+/* See arena.h */
+void chitcpd_arena_init(chitcpd_arena_t *arena)
+{
+    arena->allocator.alloc = chitcpd_arena_pb_alloc;
+    arena->allocator.free = chitcpd_arena_pb_free;
+    arena->allocator.allocator_data = arena;
+    arena->chunks = NULL;
+    arena->used = 0;
+}
+
+/* See arena.h */
+void *chitcpd_arena_alloc(chitcpd_arena_t *arena, size_t size)
+{
+    chitcpd_arena_chunk_t *chunk = arena->chunks;
+    void *mem;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - arena->used < size)
+    {
+        size_t chunk_size = chunk? chunk->size * 2 : CHITCPD_ARENA_CHUNK_SIZE;
+
+        chunk = malloc(sizeof(chitcpd_arena_chunk_t) + MAX(chunk_size, size));
+        if (chunk == NULL)
+            return NULL;
+        chunk->size = MAX(chunk_size, size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+
+    mem = (uint8_t *) chunk->data + arena->used;
+    arena->used += size;
+
+    return mem;
+}
+
+/* See arena.h */
+void *chitcpd_arena_calloc(chitcpd_arena_t *arena, size_t nmemb, size_t size)
+{
+    void *mem;
+
+    if (size > 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    if ((mem = chitcpd_arena_alloc(arena, nmemb * size)) != NULL)
+        memset(mem, 0, nmemb * size);
+
+    return mem;
+}
+
+/* See arena.h */
+void chitcpd_arena_reset(chitcpd_arena_t *arena)
+{
+    chitcpd_arena_chunk_t *chunk = arena->chunks, *next;
+
+    if (chunk == NULL)
+        return;
+
+    /* The chunk in use is the largest one */
+    for (next = chunk->next; next != NULL; next = chunk->next)
+    {
+        chunk->next = next->next;
+        free(next);
+    }
+
+    if (chunk->size > CHITCPD_ARENA_KEEP_MAX)
+        chitcpd_arena_free(arena);
+    arena->used = 0;
+}
+
+/* See arena.h */
+void chitcpd_arena_free(chitcpd_arena_t *arena)
+{
+    chitcpd_arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->chunks = NULL;
+    arena->used = 0;
+}
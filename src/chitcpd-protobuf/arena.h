@@ -0,0 +1,136 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Bump allocator for unpacking and building chitcpd messages.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <protobuf-c/protobuf-c.h>
+
+/* Size of an arena's first chunk. Later chunks are at least twice the
+ * size of the previous one. */
+#define CHITCPD_ARENA_CHUNK_SIZE (4096)
+
+/* A chunk larger than this isn't kept when its arena is reset, so a
+ * single large message doesn't pin its memory for good */
+#define CHITCPD_ARENA_KEEP_MAX (256 * 1024)
+
+/* The memory in a chunk comes after its header */
+typedef struct chitcpd_arena_chunk
+{
+    struct chitcpd_arena_chunk *next;
+    size_t size;
+    max_align_t data[];
+} chitcpd_arena_chunk_t;
+
+/* A bump allocator: memory is handed out from a chunk until it is full
+ * (and then from a new chunk), and is only given back all at once, when
+ * the arena is reset. The chunk in use when the arena is reset is kept,
+ * so once a chunk is large enough for everything allocated between two
+ * resets, the arena doesn't allocate anything at all.
+ *
+ * allocator can be passed to protobuf-c (its free function does
+ * nothing), so that an unpacked message is allocated in the arena.
+ * An arena can't be used from several threads at once.
+ */
+typedef struct chitcpd_arena
+{
+    ProtobufCAllocator allocator;
+    chitcpd_arena_chunk_t *chunks;   /* Chunk in use first */
+    size_t used;                     /* Bytes used in the chunk in use */
+} chitcpd_arena_t;
+
+/*
+ * chitcpd_arena_init - Initialize an (empty) arena
+ *
+ * arena: Arena
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_arena_init(chitcpd_arena_t *arena);
+
+/*
+ * chitcpd_arena_alloc - Allocate memory in an arena
+ *
+ * The memory is suitably aligned for any type, and is valid until the
+ * arena is reset or freed.
+ *
+ * arena: Arena
+ *
+ * size: Number of bytes
+ *
+ * Returns: The memory, or NULL if it could not be allocated
+ *
+ */
+void *chitcpd_arena_alloc(chitcpd_arena_t *arena, size_t size);
+
+/*
+ * chitcpd_arena_calloc - Allocate zeroed memory in an arena
+ *
+ * Same as chitcpd_arena_alloc, but for an array of NMEMB elements of
+ * SIZE bytes each, which are set to zero.
+ *
+ */
+void *chitcpd_arena_calloc(chitcpd_arena_t *arena, size_t nmemb, size_t size);
+
+/*
+ * chitcpd_arena_reset - Give back everything allocated in an arena
+ *
+ * arena: Arena
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_arena_reset(chitcpd_arena_t *arena);
+
+/*
+ * chitcpd_arena_free - Free an arena's chunks
+ *
+ * The arena is left empty (and can still be used).
+ *
+ * arena: Arena
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_arena_free(chitcpd_arena_t *arena);
+
+#endif /* ARENA_H_ */
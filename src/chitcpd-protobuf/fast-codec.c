@@ -0,0 +1,433 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Fixed-layout binary encoding for the most frequent chitcpd messages.
+ *
+ *  See fast-codec.h for more details.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fast-codec.h"
+
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t) p[0] | ((uint16_t) p[1] << 8);
+}
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+           ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* The fields of the fixed-layout header, before encoding */
+typedef struct fast_hdr
+{
+    uint8_t code;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t lane;
+    int32_t sockfd;
+    int32_t arg0;
+    int32_t arg1;
+    uint32_t shm_offset;
+    uint32_t shm_len;
+    uint32_t payload_len;
+} fast_hdr_t;
+
+
+/*
+ * chitcpd_fast_fill_hdr - Map a message to a fixed-layout header
+ *
+ * msg: Message
+ *
+ * hdr: Header to fill in
+ *
+ * payload: Output parameter to return the payload (if any)
+ *
+ * Returns: TRUE if the message can be sent with the fast-path encoding,
+ *          FALSE otherwise.
+ *
+ */
+static bool_t chitcpd_fast_fill_hdr(const ChitcpdMsg *msg, fast_hdr_t *hdr, const uint8_t **payload)
+{
+    memset(hdr, 0, sizeof(fast_hdr_t));
+    *payload = NULL;
+
+    hdr->code = msg->code;
+    hdr->request_id = msg->request_id;
+    hdr->lane = msg->lane;
+
+    switch (msg->code)
+    {
+    case CHITCPD_MSG_CODE__SEND:
+        if (msg->send_args == NULL)
+            return FALSE;
+        hdr->sockfd = msg->send_args->sockfd;
+        hdr->arg0 = msg->send_args->flags;
+        hdr->shm_offset = msg->send_args->shm_offset;
+        hdr->shm_len = msg->send_args->shm_len;
+        hdr->payload_len = msg->send_args->buf.len;
+        *payload = msg->send_args->buf.data;
+        return TRUE;
+
+    case CHITCPD_MSG_CODE__RECV:
+        if (msg->recv_args == NULL)
+            return FALSE;
+        hdr->sockfd = msg->recv_args->sockfd;
+        hdr->arg0 = msg->recv_args->flags;
+        hdr->arg1 = msg->recv_args->len;
+        hdr->shm_offset = msg->recv_args->shm_offset;
+        if (msg->recv_args->use_shm)
+            hdr->flags |= CHITCPD_FAST_USE_SHM;
+        return TRUE;
+
+    case CHITCPD_MSG_CODE__CLOSE:
+        if (msg->close_args == NULL)
+            return FALSE;
+        hdr->sockfd = msg->close_args->sockfd;
+        return TRUE;
+
+    case CHITCPD_MSG_CODE__GET_SOCKET_STATE:
+        if (msg->get_socket_state_args == NULL)
+            return FALSE;
+        hdr->sockfd = msg->get_socket_state_args->sockfd;
+        return TRUE;
+
+    case CHITCPD_MSG_CODE__WAIT_FOR_STATE:
+        if (msg->wait_for_state_args == NULL)
+            return FALSE;
+        hdr->sockfd = msg->wait_for_state_args->sockfd;
+        hdr->arg0 = msg->wait_for_state_args->tcp_state;
+        return TRUE;
+
+    case CHITCPD_MSG_CODE__RESP:
+        /* Responses with an address, buffer contents, INIT information,
+         * statistics, or a variable number of results (from BATCH,
+         * POLL or NOTIFY) go through protobuf */
+        if (msg->resp == NULL || msg->resp->has_addr ||
+            msg->resp->socket_buffer_contents != NULL || msg->resp->stats != NULL ||
+            msg->resp->shm_size != 0 || msg->resp->fast_codec != 0 ||
+            msg->resp->n_batch != 0 || msg->resp->n_revents != 0 ||
+            msg->resp->n_notifications != 0 ||
+            (msg->resp->has_buf && msg->resp->socket_state != NULL))
+            return FALSE;
+        hdr->arg0 = msg->resp->ret;
+        hdr->arg1 = msg->resp->error_code;
+        if (msg->resp->has_buf)
+        {
+            hdr->flags |= CHITCPD_FAST_HAS_BUF;
+            hdr->payload_len = msg->resp->buf.len;
+            *payload = msg->resp->buf.data;
+        }
+        else if (msg->resp->socket_state != NULL)
+        {
+            hdr->flags |= CHITCPD_FAST_HAS_STATE;
+            hdr->payload_len = CHITCPD_FAST_STATE_LEN;
+        }
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+
+/* See fast-codec.h */
+size_t chitcpd_fast_get_packed_size(const ChitcpdMsg *msg)
+{
+    fast_hdr_t hdr;
+    const uint8_t *payload;
+
+    if (!chitcpd_fast_fill_hdr(msg, &hdr, &payload))
+        return 0;
+
+    return CHITCPD_FAST_HDR_LEN + hdr.payload_len;
+}
+
+
+/* See fast-codec.h */
+size_t chitcpd_fast_pack(const ChitcpdMsg *msg, uint8_t *out)
+{
+    fast_hdr_t hdr;
+    const uint8_t *payload;
+
+    chitcpd_fast_fill_hdr(msg, &hdr, &payload);
+
+    out[0] = CHITCPD_FAST_VERSION;
+    out[1] = hdr.code;
+    put_u16(out + 2, hdr.flags);
+    put_u32(out + 4, hdr.request_id);
+    put_u32(out + 8, hdr.lane);
+    put_u32(out + 12, (uint32_t) hdr.sockfd);
+    put_u32(out + 16, (uint32_t) hdr.arg0);
+    put_u32(out + 20, (uint32_t) hdr.arg1);
+    put_u32(out + 24, hdr.shm_offset);
+    put_u32(out + 28, hdr.shm_len);
+    put_u32(out + 32, hdr.payload_len);
+
+    if (hdr.flags & CHITCPD_FAST_HAS_STATE)
+    {
+        ChitcpdSocketState *state = msg->resp->socket_state;
+        uint8_t *p = out + CHITCPD_FAST_HDR_LEN;
+
+        put_u32(p, (uint32_t) state->tcp_state);
+        put_u32(p + 4, (uint32_t) state->iss);
+        put_u32(p + 8, (uint32_t) state->irs);
+        put_u32(p + 12, (uint32_t) state->snd_una);
+        put_u32(p + 16, (uint32_t) state->rcv_nxt);
+        put_u32(p + 20, (uint32_t) state->snd_nxt);
+        put_u32(p + 24, (uint32_t) state->rcv_wnd);
+        put_u32(p + 28, (uint32_t) state->snd_wnd);
+    }
+    else if (hdr.payload_len > 0)
+        memcpy(out + CHITCPD_FAST_HDR_LEN, payload, hdr.payload_len);
+
+    return CHITCPD_FAST_HDR_LEN + hdr.payload_len;
+}
+
+
+/*
+ * chitcpd_fast_alloc - Allocate memory the way protobuf-c would
+ *
+ * allocator: Allocator (NULL for malloc)
+ *
+ * size: Number of bytes
+ *
+ * Returns: The memory, or NULL if it could not be allocated
+ *
+ */
+static void *chitcpd_fast_alloc(ProtobufCAllocator *allocator, size_t size)
+{
+    if (allocator == NULL)
+        return malloc(size);
+    return allocator->alloc(allocator->allocator_data, size);
+}
+
+
+/*
+ * chitcpd_fast_copy_payload - Copy a payload into a newly allocated buffer
+ *
+ * allocator: Allocator (NULL for malloc)
+ *
+ * bd: Where to store the copy
+ *
+ * payload: Payload
+ *
+ * len: Payload length
+ *
+ * Returns: FALSE if memory could not be allocated, TRUE otherwise.
+ *
+ */
+static bool_t chitcpd_fast_copy_payload(ProtobufCAllocator *allocator, ProtobufCBinaryData *bd, const uint8_t *payload, uint32_t len)
+{
+    bd->len = len;
+    bd->data = NULL;
+    if (len == 0)
+        return TRUE;
+
+    bd->data = chitcpd_fast_alloc(allocator, len);
+    if (bd->data == NULL)
+        return FALSE;
+    memcpy(bd->data, payload, len);
+
+    return TRUE;
+}
+
+
+/* See fast-codec.h */
+ChitcpdMsg *chitcpd_fast_unpack(ProtobufCAllocator *allocator, const uint8_t *data, size_t len)
+{
+    fast_hdr_t hdr;
+    const uint8_t *payload = data + CHITCPD_FAST_HDR_LEN;
+    ChitcpdMsg *msg;
+    bool_t ok = TRUE;
+
+    if (len < CHITCPD_FAST_HDR_LEN || data[0] != CHITCPD_FAST_VERSION)
+        return NULL;
+
+    hdr.code = data[1];
+    hdr.flags = get_u16(data + 2);
+    hdr.request_id = get_u32(data + 4);
+    hdr.lane = get_u32(data + 8);
+    hdr.sockfd = (int32_t) get_u32(data + 12);
+    hdr.arg0 = (int32_t) get_u32(data + 16);
+    hdr.arg1 = (int32_t) get_u32(data + 20);
+    hdr.shm_offset = get_u32(data + 24);
+    hdr.shm_len = get_u32(data + 28);
+    hdr.payload_len = get_u32(data + 32);
+
+    if (hdr.payload_len != len - CHITCPD_FAST_HDR_LEN)
+        return NULL;
+
+    msg = chitcpd_fast_alloc(allocator, sizeof(ChitcpdMsg));
+    if (msg == NULL)
+        return NULL;
+    chitcpd_msg__init(msg);
+    msg->code = hdr.code;
+    msg->request_id = hdr.request_id;
+    msg->lane = hdr.lane;
+
+    /* Submessages are allocated separately, so that the whole message
+     * can be freed with chitcpd_msg__free_unpacked */
+    switch (hdr.code)
+    {
+    case CHITCPD_MSG_CODE__SEND:
+        if ((msg->send_args = chitcpd_fast_alloc(allocator, sizeof(ChitcpdSendArgs))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_send_args__init(msg->send_args);
+        msg->send_args->sockfd = hdr.sockfd;
+        msg->send_args->flags = hdr.arg0;
+        msg->send_args->shm_offset = hdr.shm_offset;
+        msg->send_args->shm_len = hdr.shm_len;
+        ok = chitcpd_fast_copy_payload(allocator, &msg->send_args->buf, payload, hdr.payload_len);
+        break;
+
+    case CHITCPD_MSG_CODE__RECV:
+        if ((msg->recv_args = chitcpd_fast_alloc(allocator, sizeof(ChitcpdRecvArgs))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_recv_args__init(msg->recv_args);
+        msg->recv_args->sockfd = hdr.sockfd;
+        msg->recv_args->flags = hdr.arg0;
+        msg->recv_args->len = hdr.arg1;
+        msg->recv_args->shm_offset = hdr.shm_offset;
+        msg->recv_args->use_shm = (hdr.flags & CHITCPD_FAST_USE_SHM) != 0;
+        break;
+
+    case CHITCPD_MSG_CODE__CLOSE:
+        if ((msg->close_args = chitcpd_fast_alloc(allocator, sizeof(ChitcpdCloseArgs))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_close_args__init(msg->close_args);
+        msg->close_args->sockfd = hdr.sockfd;
+        break;
+
+    case CHITCPD_MSG_CODE__GET_SOCKET_STATE:
+        if ((msg->get_socket_state_args = chitcpd_fast_alloc(allocator, sizeof(ChitcpdGetSocketStateArgs))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_get_socket_state_args__init(msg->get_socket_state_args);
+        msg->get_socket_state_args->sockfd = hdr.sockfd;
+        break;
+
+    case CHITCPD_MSG_CODE__WAIT_FOR_STATE:
+        if ((msg->wait_for_state_args = chitcpd_fast_alloc(allocator, sizeof(ChitcpdWaitForStateArgs))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_wait_for_state_args__init(msg->wait_for_state_args);
+        msg->wait_for_state_args->sockfd = hdr.sockfd;
+        msg->wait_for_state_args->tcp_state = hdr.arg0;
+        break;
+
+    case CHITCPD_MSG_CODE__RESP:
+        if ((msg->resp = chitcpd_fast_alloc(allocator, sizeof(ChitcpdResp))) == NULL)
+        {
+            ok = FALSE;
+            break;
+        }
+        chitcpd_resp__init(msg->resp);
+        msg->resp->ret = hdr.arg0;
+        msg->resp->error_code = hdr.arg1;
+        if (hdr.flags & CHITCPD_FAST_HAS_BUF)
+        {
+            msg->resp->has_buf = TRUE;
+            ok = chitcpd_fast_copy_payload(allocator, &msg->resp->buf, payload, hdr.payload_len);
+        }
+        else if (hdr.flags & CHITCPD_FAST_HAS_STATE)
+        {
+            ChitcpdSocketState *state;
+
+            if (hdr.payload_len != CHITCPD_FAST_STATE_LEN ||
+                (state = chitcpd_fast_alloc(allocator, sizeof(ChitcpdSocketState))) == NULL)
+            {
+                ok = FALSE;
+                break;
+            }
+            chitcpd_socket_state__init(state);
+            state->tcp_state = (int32_t) get_u32(payload);
+            state->iss = (int32_t) get_u32(payload + 4);
+            state->irs = (int32_t) get_u32(payload + 8);
+            state->snd_una = (int32_t) get_u32(payload + 12);
+            state->rcv_nxt = (int32_t) get_u32(payload + 16);
+            state->snd_nxt = (int32_t) get_u32(payload + 20);
+            state->rcv_wnd = (int32_t) get_u32(payload + 24);
+            state->snd_wnd = (int32_t) get_u32(payload + 28);
+            msg->resp->socket_state = state;
+        }
+        break;
+
+    default:
+        ok = FALSE;
+        break;
+    }
+
+    if (!ok)
+    {
+        chitcpd_msg__free_unpacked(msg, allocator);
+        return NULL;
+    }
+
+    return msg;
+}
@@ -0,0 +1,123 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Fixed-layout binary encoding for the most frequent chitcpd messages.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FAST_CODEC_H_
+#define FAST_CODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "chitcp/types.h"
+#include "chitcpd.pb-c.h"
+
+/*
+ * The messages on the data path (SEND, RECV, CLOSE, GET_SOCKET_STATE and
+ * WAIT_FOR_STATE requests, and most responses) can be encoded as a
+ * fixed-layout header, optionally followed by a raw payload, instead of
+ * as a protobuf message. Both ends agree on the version of this encoding
+ * in the INIT handshake; everything else is still sent as protobuf.
+ *
+ * All the header fields are little-endian:
+ *
+ *   Offset  Size  Field
+ *        0     1  version (CHITCPD_FAST_VERSION)
+ *        1     1  code (a ChitcpdMsgCode)
+ *        2     2  flags (CHITCPD_FAST_*)
+ *        4     4  request_id
+ *        8     4  lane
+ *       12     4  sockfd
+ *       16     4  arg0 (SEND/RECV: flags, WAIT_FOR_STATE: tcp_state, RESP: ret)
+ *       20     4  arg1 (RECV: len, RESP: error_code)
+ *       24     4  shm_offset
+ *       28     4  shm_len
+ *       32     4  payload_len
+ *
+ * The payload is the data for SEND and RECV (when it is not in the shared
+ * data window), or the eight fields of a ChitcpdSocketState in a
+ * GET_SOCKET_STATE response (as 32-bit little-endian integers).
+ */
+#define CHITCPD_FAST_VERSION (1)
+#define CHITCPD_FAST_HDR_LEN (36)
+#define CHITCPD_FAST_STATE_LEN (8 * 4)
+
+#define CHITCPD_FAST_USE_SHM   (1 << 0)  /* RECV: return data in the shared data window */
+#define CHITCPD_FAST_HAS_BUF   (1 << 1)  /* RESP: payload is the RECV data */
+#define CHITCPD_FAST_HAS_STATE (1 << 2)  /* RESP: payload is a socket state */
+
+/*
+ * chitcpd_fast_get_packed_size - Size of a message in the fast-path encoding
+ *
+ * msg: Message
+ *
+ * Returns: The encoded size, or 0 if the message cannot be encoded
+ *          with the fast-path encoding (and has to be sent as protobuf)
+ *
+ */
+size_t chitcpd_fast_get_packed_size(const ChitcpdMsg *msg);
+
+/*
+ * chitcpd_fast_pack - Encode a message with the fast-path encoding
+ *
+ * msg: Message (for which chitcpd_fast_get_packed_size is not 0)
+ *
+ * out: Buffer of at least chitcpd_fast_get_packed_size(msg) bytes
+ *
+ * Returns: Number of bytes written to OUT
+ *
+ */
+size_t chitcpd_fast_pack(const ChitcpdMsg *msg, uint8_t *out);
+
+/*
+ * chitcpd_fast_unpack - Decode a message in the fast-path encoding
+ *
+ * The message is allocated just like chitcpd_msg__unpack would, so it
+ * must be freed with chitcpd_msg__free_unpacked(msg, allocator).
+ *
+ * allocator: Allocator the message is allocated with (NULL for malloc)
+ *
+ * data: Encoded message
+ *
+ * len: Length of DATA
+ *
+ * Returns: The decoded message, or NULL if DATA is not a valid message
+ *          (or memory could not be allocated)
+ *
+ */
+ChitcpdMsg *chitcpd_fast_unpack(ProtobufCAllocator *allocator, const uint8_t *data, size_t len);
+
+#endif /* FAST_CODEC_H_ */
@@ -43,94 +43,266 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "chitcp/types.h"
 #include "protobuf-wrapper.h"
+#include "fast-codec.h"
 
 
-int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg)
+/* Frames in the fast-path encoding have this bit set in their length */
+#define FRAME_FAST ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
+/* We refuse to receive frames larger than this */
+#define FRAME_MAX (64 * 1024 * 1024)
+
+/* A thread's buffers for chitcpd_send_msg and chitcpd_recv_msg aren't
+ * kept if they grow larger than this */
+#define THREAD_BUF_KEEP_MAX (64 * 1024)
+
+
+/* Buffers that chitcpd_send_msg and chitcpd_recv_msg (which don't have
+ * a channel of their own) use, kept by each thread so that they don't
+ * have to be allocated for every message */
+typedef struct thread_bufs
 {
-    int nbytes;
-    size_t size;
-    uint8_t *packed;
+    uint8_t *send_buf;
+    size_t send_buf_size;
+    uint8_t *recv_buf;
+    size_t recv_buf_size;
+} thread_bufs_t;
+
+static pthread_key_t thread_bufs_key;
+static pthread_once_t thread_bufs_key_init = PTHREAD_ONCE_INIT;
+
+/* Frees a thread's buffers when it exits */
+static void thread_bufs_destructor(void *mem)
+{
+    thread_bufs_t *bufs = (thread_bufs_t *) mem;
+
+    free(bufs->send_buf);
+    free(bufs->recv_buf);
+    free(bufs);
+}
+
+static void create_thread_bufs_key()
+{
+    pthread_key_create(&thread_bufs_key, thread_bufs_destructor);
+}
+
+/* Returns the calling thread's buffers (or NULL if they could not be
+ * allocated) */
+static thread_bufs_t *thread_bufs_get()
+{
+    thread_bufs_t *bufs;
 
-    size = chitcpd_msg__get_packed_size(msg);
-    packed = malloc(sizeof(size_t) + size); /* message length, then message */
-    /* We use malloc rather than stack space because message length
-     * can be arbitrarily long.*/
-    if (!packed)
+    pthread_once(&thread_bufs_key_init, create_thread_bufs_key);
+    if ((bufs = pthread_getspecific(thread_bufs_key)) == NULL)
     {
-        perror("chitcpd_send_msg: malloc failed");
-        return -2;
+        if ((bufs = calloc(1, sizeof(thread_bufs_t))) == NULL)
+            return NULL;
+        pthread_setspecific(thread_bufs_key, bufs);
     }
-    *((size_t *) packed) = size; /* copy over the length (host byte order) */
-    chitcpd_msg__pack(msg, packed + sizeof(size_t));
 
-    /* Send request */
-    nbytes = send(sockfd, packed, sizeof(size_t) + size, 0);
-    free(packed);
-    if (nbytes == -1 && (errno == ECONNRESET || errno == EPIPE))
+    return bufs;
+}
+
+/* Takes a buffer back from a channel, unless it has grown too large */
+static void thread_buf_keep(uint8_t **buf, size_t *buf_size, uint8_t *ch_buf, size_t ch_buf_size)
+{
+    if (ch_buf_size > THREAD_BUF_KEEP_MAX)
     {
-        /* Peer disconnected */
-        close(sockfd);
-        return -1;
+        free(ch_buf);
+        ch_buf = NULL;
+        ch_buf_size = 0;
     }
-    else if (nbytes == -1)
+    *buf = ch_buf;
+    *buf_size = ch_buf_size;
+}
+
+
+/*
+ * chitcpd_ensure_buf - Make sure a channel buffer is large enough
+ *
+ * buf: Buffer (may be reallocated)
+ *
+ * buf_size: Size of the buffer (updated if it is reallocated)
+ *
+ * size: Required size
+ *
+ * Returns: 0 on success, -2 if memory could not be allocated.
+ *
+ */
+static int chitcpd_ensure_buf(uint8_t **buf, size_t *buf_size, size_t size)
+{
+    uint8_t *newbuf;
+
+    if (*buf_size >= size)
+        return CHITCP_OK;
+
+    newbuf = realloc(*buf, size);
+    if (!newbuf)
     {
-        perror("chitcpd_send_msg: Unexpected error in send()");
+        perror("chitcpd_ensure_buf: realloc failed");
         return -2;
     }
+    *buf = newbuf;
+    *buf_size = size;
 
     return CHITCP_OK;
 }
 
-int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
+
+/*
+ * chitcpd_send_all - Send an entire buffer, resuming after short writes
+ *
+ * Returns: Same as chitcpd_send_msg
+ *
+ */
+static int chitcpd_send_all(int sockfd, const uint8_t *buf, size_t len)
 {
-    int nbytes;
-    size_t size;
-    uint8_t *packed;
+    ssize_t nbytes;
 
-    /* Get the message length */
-    nbytes = recv(sockfd, &size, sizeof(size_t), 0);
-    if (nbytes == 0)
+    while (len > 0)
     {
-        /* Peer disconnected */
-        errno = ECONNRESET;
-        close(sockfd);
-        return -1;
+        nbytes = send(sockfd, buf, len, 0);
+        if (nbytes == -1 && errno == EINTR)
+            continue;
+        else if (nbytes == -1 && (errno == ECONNRESET || errno == EPIPE))
+        {
+            /* Peer disconnected */
+            close(sockfd);
+            return -1;
+        }
+        else if (nbytes == -1)
+        {
+            perror("chitcpd_send_msg: Unexpected error in send()");
+            return -2;
+        }
+
+        buf += nbytes;
+        len -= nbytes;
     }
-    else if (nbytes == -1)
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_recv_all - Fill an entire buffer, resuming after short reads
+ *
+ * Returns: Same as chitcpd_recv_msg
+ *
+ */
+static int chitcpd_recv_all(int sockfd, uint8_t *buf, size_t len)
+{
+    ssize_t nbytes;
+
+    while (len > 0)
     {
-        perror("chitcpd_recv_msg: Unexpected error in recv()");
-        return -2;
+        nbytes = recv(sockfd, buf, len, 0);
+        if (nbytes == 0)
+        {
+            /* Peer disconnected */
+            errno = ECONNRESET;
+            close(sockfd);
+            return -1;
+        }
+        else if (nbytes == -1 && errno == EINTR)
+            continue;
+        else if (nbytes == -1)
+        {
+            perror("chitcpd_recv_msg: Unexpected error in recv()");
+            return -2;
+        }
+
+        buf += nbytes;
+        len -= nbytes;
     }
 
-    packed = malloc(size);
-    if (!packed)
+    return CHITCP_OK;
+}
+
+
+void chitcpd_channel_init(chitcpd_channel_t *ch, int sockfd)
+{
+    ch->sockfd = sockfd;
+    ch->fast_version = 0;
+    ch->send_buf = NULL;
+    ch->send_buf_size = 0;
+    ch->recv_buf = NULL;
+    ch->recv_buf_size = 0;
+}
+
+void chitcpd_channel_free(chitcpd_channel_t *ch)
+{
+    free(ch->send_buf);
+    free(ch->recv_buf);
+    ch->send_buf = NULL;
+    ch->send_buf_size = 0;
+    ch->recv_buf = NULL;
+    ch->recv_buf_size = 0;
+}
+
+int chitcpd_channel_send_msg(chitcpd_channel_t *ch, const ChitcpdMsg *msg)
+{
+    size_t size = 0, frame_len;
+    int rc;
+
+    if (ch->fast_version > 0)
+        size = chitcpd_fast_get_packed_size(msg);
+
+    if (size > 0)
+        frame_len = size | FRAME_FAST;
+    else
+        frame_len = size = chitcpd_msg__get_packed_size(msg);
+
+    /* Message length (host byte order), then message */
+    if ((rc = chitcpd_ensure_buf(&ch->send_buf, &ch->send_buf_size, sizeof(size_t) + size)) < 0)
+        return rc;
+
+    memcpy(ch->send_buf, &frame_len, sizeof(size_t));
+    if (frame_len & FRAME_FAST)
+        chitcpd_fast_pack(msg, ch->send_buf + sizeof(size_t));
+    else
+        chitcpd_msg__pack(msg, ch->send_buf + sizeof(size_t));
+
+    return chitcpd_send_all(ch->sockfd, ch->send_buf, sizeof(size_t) + size);
+}
+
+int chitcpd_channel_recv_msg(chitcpd_channel_t *ch, ChitcpdMsg **msg_p, ProtobufCAllocator *allocator)
+{
+    size_t size;
+    bool_t fast;
+    int rc;
+
+    /* Get the message length */
+    if ((rc = chitcpd_recv_all(ch->sockfd, (uint8_t *) &size, sizeof(size_t))) < 0)
+        return rc;
+
+    fast = (size & FRAME_FAST) != 0;
+    size &= ~FRAME_FAST;
+
+    if ((fast && ch->fast_version == 0) || size > FRAME_MAX)
     {
-        perror("chitcpd_recv_msg: malloc failed");
+        errno = EPROTO;
+        perror("chitcpd_recv_msg: Received an invalid frame");
         return -2;
     }
 
+    if ((rc = chitcpd_ensure_buf(&ch->recv_buf, &ch->recv_buf_size, size)) < 0)
+        return rc;
+
     /* Get the message itself */
-    nbytes = recv(sockfd, packed, size, 0);
-    if (nbytes == 0)
-    {
-        /* Peer disconnected */
-        errno = ECONNRESET;
-        free(packed);
-        close(sockfd);
-        return -1;
-    }
-    else if (nbytes == -1)
-    {
-        perror("chitcpd_recv_msg: Unexpected error in recv()");
-        free(packed);
-        return -2;
-    }
+    if ((rc = chitcpd_recv_all(ch->sockfd, ch->recv_buf, size)) < 0)
+        return rc;
 
-    *msg_p = chitcpd_msg__unpack(NULL, size, packed);
-    free(packed);
+    if (fast)
+        *msg_p = chitcpd_fast_unpack(allocator, ch->recv_buf, size);
+    else
+        *msg_p = chitcpd_msg__unpack(allocator, size, ch->recv_buf);
     if (!*msg_p)
     {
         errno = EPROTO;
@@ -141,9 +313,47 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
     return CHITCP_OK;
 }
 
+int chitcpd_send_msg(int sockfd, const ChitcpdMsg *msg)
+{
+    chitcpd_channel_t ch;
+    thread_bufs_t *bufs;
+    int rc;
+
+    if ((bufs = thread_bufs_get()) == NULL)
+        return -2;
+
+    /* A throwaway channel, with the thread's buffer */
+    chitcpd_channel_init(&ch, sockfd);
+    ch.send_buf = bufs->send_buf;
+    ch.send_buf_size = bufs->send_buf_size;
+    rc = chitcpd_channel_send_msg(&ch, msg);
+    thread_buf_keep(&bufs->send_buf, &bufs->send_buf_size, ch.send_buf, ch.send_buf_size);
+
+    return rc;
+}
+
+int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg_p)
+{
+    chitcpd_channel_t ch;
+    thread_bufs_t *bufs;
+    int rc;
+
+    if ((bufs = thread_bufs_get()) == NULL)
+        return -2;
+
+    chitcpd_channel_init(&ch, sockfd);
+    ch.recv_buf = bufs->recv_buf;
+    ch.recv_buf_size = bufs->recv_buf_size;
+    rc = chitcpd_channel_recv_msg(&ch, msg_p, NULL);
+    thread_buf_keep(&bufs->recv_buf, &bufs->recv_buf_size, ch.recv_buf, ch.recv_buf_size);
+
+    return rc;
+}
+
 /* Note: if two threads call this function on the same socket, each thread
  * may get the response intended for the other. Therefore be careful not
- * to do that. */
+ * to do that (libchitcp's chitcpd_send_command matches responses to
+ * requests by their request_id instead). */
 int chitcpd_send_and_recv_msg(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp)
 {
     int r;
@@ -156,3 +366,95 @@ int chitcpd_send_and_recv_msg(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **re
 
     return CHITCP_OK;
 }
+
+int chitcpd_send_fd(int sockfd, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char c = 0;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+
+    /* At least one byte of data has to go with the descriptor */
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sockfd, &msg, 0) == -1)
+    {
+        if (errno == ECONNRESET || errno == EPIPE)
+        {
+            /* Peer disconnected */
+            close(sockfd);
+            return -1;
+        }
+        perror("chitcpd_send_fd: Unexpected error in sendmsg()");
+        return -2;
+    }
+
+    return CHITCP_OK;
+}
+
+int chitcpd_recv_fd(int sockfd, int *fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t nbytes;
+    char c;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    nbytes = recvmsg(sockfd, &msg, 0);
+    if (nbytes == 0)
+    {
+        /* Peer disconnected */
+        errno = ECONNRESET;
+        close(sockfd);
+        return -1;
+    }
+    else if (nbytes == -1)
+    {
+        perror("chitcpd_recv_fd: Unexpected error in recvmsg()");
+        return -2;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        errno = EPROTO;
+        perror("chitcpd_recv_fd: Message did not contain a file descriptor");
+        return -2;
+    }
+
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return CHITCP_OK;
+}
@@ -41,12 +41,82 @@
 #ifndef PROTOBUF_WRAPPER_H_
 #define PROTOBUF_WRAPPER_H_
 
+#include <stdint.h>
+#include <stddef.h>
 #include "chitcpd.pb-c.h"
 
+/* A connection on which messages are exchanged with chitcpd.
+ *
+ * Messages are framed the same way as with chitcpd_send_msg and
+ * chitcpd_recv_msg, but the buffers used to (de)serialize them are kept
+ * across messages, and the fast-path encoding (see fast-codec.h) is used
+ * for the messages that support it once both ends have agreed on it.
+ * Since the buffers are reused, sending (or receiving) on the same
+ * channel from several threads at once must be serialized by the caller.
+ */
+typedef struct chitcpd_channel
+{
+    int sockfd;
+    uint32_t fast_version;   /* Fast-path encoding version (0 if not in use) */
+    uint8_t *send_buf;
+    size_t send_buf_size;
+    uint8_t *recv_buf;
+    size_t recv_buf_size;
+} chitcpd_channel_t;
+
+/*
+ * chitcpd_channel_init - Initialize a channel on a connected socket
+ *
+ * The channel starts out using protobuf only.
+ *
+ * ch: Channel
+ * sockfd: Connected socket
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_channel_init(chitcpd_channel_t *ch, int sockfd);
+
+/*
+ * chitcpd_channel_free - Free a channel's buffers (the socket is not closed)
+ *
+ * ch: Channel
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_channel_free(chitcpd_channel_t *ch);
+
+/*
+ * chitcpd_channel_send_msg - Serialize and send a message on a channel
+ *
+ * Same as chitcpd_send_msg, but on a channel.
+ *
+ */
+int chitcpd_channel_send_msg(chitcpd_channel_t *ch, const ChitcpdMsg *msg);
+
+/*
+ * chitcpd_channel_recv_msg - Receive and deserialize a message from a channel
+ *
+ * Same as chitcpd_recv_msg, but on a channel, and the message is
+ * allocated with ALLOCATOR (so it must be freed with
+ * chitcpd_msg__free_unpacked(*msg, allocator)). With an arena's
+ * allocator (see arena.h), the message is instead freed along with
+ * everything else in the arena.
+ *
+ * allocator: Allocator (NULL for malloc)
+ *
+ */
+int chitcpd_channel_recv_msg(chitcpd_channel_t *ch, ChitcpdMsg **msg, ProtobufCAllocator *allocator);
+
 /*
  * chitcpd_send_msg - Serialize and send a message to SOCKFD. If unsuccessful,
  *                    this function automatically closes SOCKFD.
  *
+ * The message is serialized into a buffer kept by the calling thread
+ * (as is the one chitcpd_recv_msg deserializes from), so sending a
+ * message doesn't usually allocate anything.
+ *
  * sockfd: Message destination
  * msg: Pointer to the message
  *
@@ -91,6 +161,37 @@ int chitcpd_recv_msg(int sockfd, ChitcpdMsg **msg);
  */
 int chitcpd_send_and_recv_msg(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp);
 
+/*
+ * chitcpd_send_fd - Pass a file descriptor to the peer on a UNIX socket
+ *
+ * The descriptor is sent as SCM_RIGHTS ancillary data attached to a
+ * single byte, so the peer must read it with chitcpd_recv_fd.
+ *
+ * sockfd: UNIX socket connected to the peer
+ * fd: File descriptor to pass
+ *
+ * Returns:
+ *   0 - Success
+ *  -1 - Peer disconnected (sets errno to ECONNRESET)
+ *  -2 - Unexpected error
+ *
+ */
+int chitcpd_send_fd(int sockfd, int fd);
+
+/*
+ * chitcpd_recv_fd - Receive a file descriptor sent with chitcpd_send_fd
+ *
+ * sockfd: UNIX socket connected to the peer
+ * fd: Location in which to store the received file descriptor
+ *
+ * Returns:
+ *   0 - Success
+ *  -1 - Peer disconnected (sets errno to ECONNRESET)
+ *  -2 - Unexpected error (including a message without a descriptor)
+ *
+ */
+int chitcpd_recv_fd(int sockfd, int *fd);
+
 
 #endif /* PROTOBUF_WRAPPER_H */
 
@@ -0,0 +1,270 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Thread placement
+ *
+ *  By default, the scheduler is free to move chitcpd's threads across
+ *  CPUs, caches and NUMA nodes. With a placement, the network I/O
+ *  threads and TCP workers are pinned to CPUs of their own, each
+ *  socket's TCP thread runs on the NUMA node of the network I/O thread
+ *  that receives its packets, and the socket's buffers are allocated
+ *  from that node.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#include "affinity.h"
+#include "chitcp/log.h"
+
+/* Largest CPU and NUMA node numbers we know how to handle */
+#define AFFINITY_MAX_CPU (1023)
+#define AFFINITY_MAX_NODE (63)
+
+
+/*
+ * affinity_cpu_node - Find the NUMA node of a CPU
+ *
+ * The node is the "nodeN" entry in the CPU's sysfs directory.
+ *
+ * cpu: CPU
+ *
+ * Returns: The node, or -1 if it is not known.
+ *
+ */
+static int affinity_cpu_node(int cpu)
+{
+    int node = -1;
+#ifdef __linux__
+    char path[64];
+    struct dirent *dirent;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i", cpu);
+    if((dir = opendir(path)) == NULL)
+        return -1;
+
+    while((dirent = readdir(dir)) != NULL)
+        if(!strncmp(dirent->d_name, "node", 4) && isdigit((unsigned char) dirent->d_name[4]))
+        {
+            node = atoi(dirent->d_name + 4);
+            break;
+        }
+    closedir(dir);
+#endif
+    return node;
+}
+
+
+/* See affinity.h */
+int affinity_parse_cpus(const char *list, cpu_placement_t *placement)
+{
+    const char *p = list;
+    int max = 0;
+
+    memset(placement, 0, sizeof(cpu_placement_t));
+
+    /* A CPU can be listed more than once (giving it more than one slot),
+     * but there can't be more slots than CPUs we can handle */
+    placement->cpus = calloc(AFFINITY_MAX_CPU + 1, sizeof(int));
+    if(placement->cpus == NULL)
+        return CHITCP_ENOMEM;
+
+    while(*p)
+    {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p, &end, 10);
+        if(end == p || first < 0 || first > AFFINITY_MAX_CPU)
+            goto einval;
+        p = end;
+
+        if(*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first || last > AFFINITY_MAX_CPU)
+                goto einval;
+            p = end;
+        }
+
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            if(max > AFFINITY_MAX_CPU)
+                goto einval;
+            placement->cpus[max++] = (int) cpu;
+        }
+
+        if(*p == ',')
+            p++;
+        else if(*p)
+            goto einval;
+    }
+
+    if(max == 0)
+        goto einval;
+
+    placement->num_cpus = max;
+    placement->nodes = calloc(max, sizeof(int));
+    if(placement->nodes == NULL)
+    {
+        affinity_free(placement);
+        return CHITCP_ENOMEM;
+    }
+    for(int i = 0; i < max; i++)
+        placement->nodes[i] = affinity_cpu_node(placement->cpus[i]);
+
+    return CHITCP_OK;
+
+einval:
+    affinity_free(placement);
+    return CHITCP_EINVAL;
+}
+
+
+/* See affinity.h */
+void affinity_free(cpu_placement_t *placement)
+{
+    free(placement->cpus);
+    free(placement->nodes);
+    memset(placement, 0, sizeof(cpu_placement_t));
+}
+
+
+/*
+ * affinity_pin - Pin the calling thread to some of the placement's CPUs
+ *
+ * placement: Placement
+ *
+ * node: Only the CPUs on this node (if -2, all the CPUs; if -1, only
+ *       the CPU of the slot)
+ *
+ * slot: Slot
+ *
+ * Returns:
+ *  - CHITCP_OK: Thread pinned (or there is no placement)
+ *  - CHITCP_ETHREAD: Could not set the thread's affinity
+ *
+ */
+static int affinity_pin(cpu_placement_t *placement, int node, int slot)
+{
+    if(placement->num_cpus == 0)
+        return CHITCP_OK;
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if(node == -1)
+        CPU_SET(placement->cpus[slot % placement->num_cpus], &set);
+    else
+        for(int i = 0; i < placement->num_cpus; i++)
+            if(node == -2 || placement->nodes[i] == node)
+                CPU_SET(placement->cpus[i], &set);
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+    {
+        chilog(WARNING, "Could not set the affinity of a thread");
+        return CHITCP_ETHREAD;
+    }
+#endif
+
+    return CHITCP_OK;
+}
+
+
+/* See affinity.h */
+int affinity_pin_cpu(cpu_placement_t *placement, int slot)
+{
+    return affinity_pin(placement, -1, slot);
+}
+
+
+/* See affinity.h */
+int affinity_pin_node(cpu_placement_t *placement, int slot)
+{
+    if(slot < 0)
+        return affinity_pin(placement, -2, 0);
+
+    return affinity_pin(placement, affinity_node(placement, slot), slot);
+}
+
+
+/* See affinity.h */
+int affinity_pin_all(cpu_placement_t *placement)
+{
+    return affinity_pin(placement, -2, 0);
+}
+
+
+/* See affinity.h */
+int affinity_node(cpu_placement_t *placement, int slot)
+{
+    if(placement->num_cpus == 0)
+        return -1;
+
+    return placement->nodes[slot % placement->num_cpus];
+}
+
+
+/* See affinity.h */
+void affinity_bind_memory(void *addr, size_t len, int node)
+{
+#ifdef __linux__
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) addr + page_size - 1) & ~(uintptr_t) (page_size - 1);
+    uintptr_t end = ((uintptr_t) addr + len) & ~(uintptr_t) (page_size - 1);
+    unsigned long nodemask;
+
+    if(node < 0 || node > AFFINITY_MAX_NODE || end <= start)
+        return;
+
+    nodemask = 1UL << node;
+    if(syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &nodemask, AFFINITY_MAX_NODE + 2, 0) != 0)
+        chilog(DEBUG, "Could not bind memory to NUMA node %i", node);
+#endif
+}
@@ -0,0 +1,164 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Thread placement (see affinity.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <stddef.h>
+#include "chitcp/types.h"
+
+/* CPUs that the daemon's threads are placed on (see chitcpd -A), and
+ * the NUMA node of each one (-1 if it is not known). The CPUs are
+ * handed out in "slots": slot i is the i-th CPU in the list (wrapping
+ * around). With no CPUs, threads are not pinned at all. */
+typedef struct cpu_placement
+{
+    int num_cpus;
+    int *cpus;
+    int *nodes;
+} cpu_placement_t;
+
+
+/*
+ * affinity_parse_cpus - Parse a list of CPUs
+ *
+ * list: Comma-separated CPUs and ranges of CPUs (e.g., "0-3,8,10-11")
+ *
+ * placement: Placement to initialize
+ *
+ * Returns:
+ *  - CHITCP_OK: List parsed correctly
+ *  - CHITCP_EINVAL: Syntax error (or an empty list)
+ *  - CHITCP_ENOMEM: Could not allocate memory for the list
+ *
+ */
+int affinity_parse_cpus(const char *list, cpu_placement_t *placement);
+
+
+/*
+ * affinity_free - Free a placement's list of CPUs
+ *
+ * placement: Placement
+ *
+ * Returns: Nothing.
+ *
+ */
+void affinity_free(cpu_placement_t *placement);
+
+
+/*
+ * affinity_pin_cpu - Pin the calling thread to the CPU of a slot
+ *
+ * Used for the threads that do the network I/O, so each one has a
+ * CPU (and its caches) to itself as long as there are enough CPUs.
+ *
+ * placement: Placement
+ *
+ * slot: Slot
+ *
+ * Returns:
+ *  - CHITCP_OK: Thread pinned (or there is no placement)
+ *  - CHITCP_ETHREAD: Could not set the thread's affinity
+ *
+ */
+int affinity_pin_cpu(cpu_placement_t *placement, int slot);
+
+
+/*
+ * affinity_pin_node - Pin the calling thread to the NUMA node of a slot
+ *
+ * The thread can run on any of the placement's CPUs that are on the
+ * same NUMA node as the slot's CPU (or on the slot's CPU, if its node
+ * is not known).
+ *
+ * placement: Placement
+ *
+ * slot: Slot (if negative, the thread can run on any of the CPUs)
+ *
+ * Returns:
+ *  - CHITCP_OK: Thread pinned (or there is no placement)
+ *  - CHITCP_ETHREAD: Could not set the thread's affinity
+ *
+ */
+int affinity_pin_node(cpu_placement_t *placement, int slot);
+
+
+/*
+ * affinity_pin_all - Restrict the calling thread to the placement's CPUs
+ *
+ * placement: Placement
+ *
+ * Returns:
+ *  - CHITCP_OK: Thread pinned (or there is no placement)
+ *  - CHITCP_ETHREAD: Could not set the thread's affinity
+ *
+ */
+int affinity_pin_all(cpu_placement_t *placement);
+
+
+/*
+ * affinity_node - NUMA node of a slot
+ *
+ * placement: Placement
+ *
+ * slot: Slot
+ *
+ * Returns: The node, or -1 if it is not known (or there is no placement)
+ *
+ */
+int affinity_node(cpu_placement_t *placement, int slot);
+
+
+/*
+ * affinity_bind_memory - Place memory on a NUMA node
+ *
+ * The pages that are entirely within the memory are allocated from the
+ * node when they are first touched. This is only a preference, so the
+ * memory can still be used if the node runs out of it.
+ *
+ * addr, len: Memory (that hasn't been touched yet)
+ *
+ * node: NUMA node (if negative, nothing is done)
+ *
+ * Returns: Nothing.
+ *
+ */
+void affinity_bind_memory(void *addr, size_t len, int node);
+
+#endif /* AFFINITY_H_ */
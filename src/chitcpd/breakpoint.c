@@ -45,6 +45,7 @@
 #include <errno.h>
 #include "protobuf-wrapper.h"
 #include "chitcp/log.h"
+#include "chitcp/utlist.h"
 #include "serverinfo.h"
 
 /* Internal functions */
@@ -60,6 +61,8 @@ static bool_t socket_monitors_event(chisocketentry_t *entry, int event_flag);
 static debug_monitor_t *obtain_debug_mon(chisocketentry_t *entry, int event_flag);
 static bool_t valid_parameters(serverinfo_t *si, int sockfd, int event_flag);
 static void handle_special_breakpoint_responses(int *response, serverinfo_t *si, chisocketentry_t *entry, debug_monitor_t *debug_mon, int event_flag, int new_sockfd);
+static bool_t queue_debug_event(chisocketentry_t *entry, int sockfd, int event_flag, int new_sockfd);
+static void *debug_mon_streamer(void *args);
 
 
 int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags, int client_socket)
@@ -68,7 +71,7 @@ int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags,
 
     chilog(TRACE, ">>> Initializing debug connection");
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         return EBADF;
@@ -85,23 +88,47 @@ int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags,
     pthread_mutex_init(&debug_mon->lock_sockfd, NULL);
     debug_mon->sockfd = client_socket;
     debug_mon->ref_count = 1;
-
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
-    pthread_mutex_lock(&entry->lock_debug_monitor);
-    if (entry->debug_monitor != NULL)
+    debug_mon->nonblocking = (event_flags & DBG_FLAG_NONBLOCKING) != 0;
+    debug_mon->si = si;
+    debug_mon->events = NULL;
+    debug_mon->num_events = 0;
+    debug_mon->dropped_events = 0;
+    debug_mon->stopping = FALSE;
+    event_flags &= ~DBG_FLAG_NONBLOCKING;
+
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+    pthread_mutex_lock(&entry->cold->lock_debug_monitor);
+    if (entry->cold->debug_monitor != NULL)
     {
         /* Some other thread is already registered as debugging this socket */
         chilog(TRACE, "Socket %d already has a debug monitor", sockfd);
-        pthread_mutex_unlock(&entry->lock_debug_monitor);
+        pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
         pthread_mutex_destroy(&debug_mon->lock_numwaiters);
         pthread_mutex_destroy(&debug_mon->lock_sockfd);
         free(debug_mon);
         return EAGAIN;
     }
 
-    entry->event_flags = event_flags;
-    entry->debug_monitor = debug_mon;
-    pthread_mutex_unlock(&entry->lock_debug_monitor);
+    if (debug_mon->nonblocking)
+    {
+        pthread_mutex_init(&debug_mon->lock_events, NULL);
+        pthread_cond_init(&debug_mon->cv_events, NULL);
+        if (pthread_create(&debug_mon->streamer, NULL, debug_mon_streamer, debug_mon) != 0)
+        {
+            pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
+            pthread_mutex_destroy(&debug_mon->lock_events);
+            pthread_cond_destroy(&debug_mon->cv_events);
+            pthread_mutex_destroy(&debug_mon->lock_numwaiters);
+            pthread_mutex_destroy(&debug_mon->lock_sockfd);
+            free(debug_mon);
+            return EAGAIN;
+        }
+        pthread_detach(debug_mon->streamer);
+    }
+
+    entry->cold->debug_monitor = debug_mon;
+    atomic_store(&entry->event_flags, event_flags);
+    pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
 
     chilog(DEBUG, "Created new debug monitor for socket %d", sockfd);
     chilog(TRACE, "<<< Finished initializing debug connection");
@@ -110,7 +137,7 @@ int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags,
 }
 
 
-/* chitcpd_debug_breakpoint - If SOCKFD has a debug monitor which is watching
+/* chitcpd_debug_breakpoint_reached - If SOCKFD has a debug monitor which is watching
  *                  - events of type EVENT_FLAG, sends a debug event message
  *                  - to the corresponding client, and returns the client's
  *                  - response.
@@ -121,12 +148,17 @@ int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags,
  *  DBG_RESP_NONE   - take no action (note: this is also returned if SOCKFD is invalid)
  *  value R > 0     - take action R (depending on the event)
  */
-enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockfd, int event_flag, int new_sockfd)
+enum chitcpd_debug_response chitcpd_debug_breakpoint_reached(serverinfo_t *si, int sockfd, int event_flag, int new_sockfd)
 {
     if (!valid_parameters(si, sockfd, event_flag))
         return DBG_RESP_NONE;
 
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    /* Non-blocking monitors don't make us wait for the client */
+    if (queue_debug_event(entry, sockfd, event_flag, new_sockfd))
+        return DBG_RESP_NONE;
+
     debug_monitor_t *debug_mon = obtain_debug_mon(entry, event_flag);
     if (!debug_mon)
         /* The client doesn't care about this event. */
@@ -157,7 +189,7 @@ enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockf
 
 void chitcpd_debug_detach_monitor(chisocketentry_t *entry)
 {
-    debug_monitor_t *debug_mon = entry->debug_monitor;
+    debug_monitor_t *debug_mon = entry->cold->debug_monitor;
     debug_mon_lock(debug_mon, NULL);
     detach_monitor_from_entry(debug_mon, entry);
     debug_mon_release(debug_mon);
@@ -178,7 +210,7 @@ static bool_t valid_parameters(serverinfo_t *si, int sockfd, int event_flag)
         return FALSE;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         return FALSE;
@@ -193,19 +225,19 @@ static bool_t valid_parameters(serverinfo_t *si, int sockfd, int event_flag)
  */
 static debug_monitor_t *obtain_debug_mon(chisocketentry_t *entry, int event_flag)
 {
-    pthread_mutex_lock(&entry->lock_debug_monitor);
+    pthread_mutex_lock(&entry->cold->lock_debug_monitor);
 
     if (!socket_monitors_event(entry, event_flag))
     {
-        pthread_mutex_unlock(&entry->lock_debug_monitor);
+        pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
         return NULL;
     }
 
-    debug_monitor_t *debug_mon = entry->debug_monitor;
-    debug_mon_lock(debug_mon, &entry->lock_debug_monitor);
+    debug_monitor_t *debug_mon = entry->cold->debug_monitor;
+    debug_mon_lock(debug_mon, &entry->cold->lock_debug_monitor);
 
     /* Perhaps this debug_mon is no longer being used with this socket. */
-    if (debug_mon != entry->debug_monitor)
+    if (debug_mon != entry->cold->debug_monitor)
     {
         debug_mon_release(debug_mon);
         return NULL;
@@ -216,7 +248,7 @@ static debug_monitor_t *obtain_debug_mon(chisocketentry_t *entry, int event_flag
 
 static bool_t socket_monitors_event(chisocketentry_t *entry, int event_flag)
 {
-    if (entry->debug_monitor && (event_flag & entry->event_flags))
+    if (entry->cold->debug_monitor && (event_flag & atomic_load(&entry->event_flags)))
         return TRUE;
     else
         return FALSE;
@@ -270,8 +302,8 @@ static void handle_special_breakpoint_responses(int *response, serverinfo_t *si,
          * so we must double-check that the event_flag was DBG_EVT_PENDING_CONNECTION. */
 
         *response = DBG_RESP_NONE;
-        chisocketentry_t *active_entry = &si->chisocket_table[new_sockfd];
-        attach_monitor_and_flags_to_entry(debug_mon, entry->event_flags, active_entry);
+        chisocketentry_t *active_entry = CHISOCKET_ENTRY(si, new_sockfd);
+        attach_monitor_and_flags_to_entry(debug_mon, atomic_load(&entry->event_flags), active_entry);
         chilog(DEBUG, "Added debug monitor for new active socket %d", new_sockfd);
     }
 }
@@ -279,25 +311,25 @@ static void handle_special_breakpoint_responses(int *response, serverinfo_t *si,
 /* Ensure debug_mon is locked before calling. */
 static void detach_monitor_from_entry(debug_monitor_t *debug_mon, chisocketentry_t *entry)
 {
-    pthread_mutex_lock(&entry->lock_debug_monitor);
-    if (entry->debug_monitor == debug_mon)
+    pthread_mutex_lock(&entry->cold->lock_debug_monitor);
+    if (entry->cold->debug_monitor == debug_mon)
     {
-        entry->debug_monitor = NULL;
-        entry->event_flags = 0;
+        entry->cold->debug_monitor = NULL;
+        atomic_store(&entry->event_flags, 0);
 
         if (--(debug_mon->ref_count) == 0)
             debug_mon->dying = TRUE;
     }
-    pthread_mutex_unlock(&entry->lock_debug_monitor);
+    pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
 }
  
 /* Ensure debug_mon is locked before calling. */
 static void attach_monitor_and_flags_to_entry(debug_monitor_t *debug_mon, int event_flags, chisocketentry_t *entry)
 {
-    pthread_mutex_lock(&entry->lock_debug_monitor);
-    entry->debug_monitor = debug_mon;
-    entry->event_flags = event_flags;
-    pthread_mutex_unlock(&entry->lock_debug_monitor);
+    pthread_mutex_lock(&entry->cold->lock_debug_monitor);
+    entry->cold->debug_monitor = debug_mon;
+    atomic_store(&entry->event_flags, event_flags);
+    pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
 
     debug_mon->ref_count++;
 }
@@ -308,7 +340,7 @@ static void debug_mon_remove_from_chisocket_table(serverinfo_t *si, debug_monito
 {
     for (int i=0; i < si->chisocket_table_size; i++)
     {
-        chisocketentry_t *e = &si->chisocket_table[i];
+        chisocketentry_t *e = CHISOCKET_ENTRY(si, i);
         detach_monitor_from_entry(debug_mon, e);
     }
 }
@@ -352,9 +384,132 @@ static void debug_mon_unlock(debug_monitor_t *debug_mon)
 
 static void debug_mon_destroy(debug_monitor_t *debug_mon)
 {
+    if (debug_mon->nonblocking)
+    {
+        /* The streaming thread may be waiting for events, so it
+         * takes care of freeing the monitor */
+        pthread_mutex_unlock(&debug_mon->lock_sockfd);
+        pthread_mutex_lock(&debug_mon->lock_events);
+        debug_mon->stopping = TRUE;
+        pthread_cond_signal(&debug_mon->cv_events);
+        pthread_mutex_unlock(&debug_mon->lock_events);
+        return;
+    }
+
     close(debug_mon->sockfd);
     pthread_mutex_destroy(&debug_mon->lock_sockfd);
     pthread_mutex_destroy(&debug_mon->lock_numwaiters);
     free(debug_mon);
 }
 
+
+/* queue_debug_event -
+ *  If entry has a non-blocking debug monitor watching events of type
+ *  event_flag, queue the event for the monitor's streaming thread and
+ *  return TRUE. Otherwise, return FALSE.
+ */
+static bool_t queue_debug_event(chisocketentry_t *entry, int sockfd, int event_flag, int new_sockfd)
+{
+    debug_monitor_t *debug_mon;
+    debug_event_t *event;
+
+    pthread_mutex_lock(&entry->cold->lock_debug_monitor);
+
+    debug_mon = entry->cold->debug_monitor;
+    if (!socket_monitors_event(entry, event_flag) || !debug_mon->nonblocking)
+    {
+        pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
+        return FALSE;
+    }
+
+    /* The monitor can't be freed while it is attached to the entry */
+    pthread_mutex_lock(&debug_mon->lock_events);
+    if (debug_mon->num_events < DEBUG_MONITOR_MAX_EVENTS && (event = malloc(sizeof(debug_event_t))) != NULL)
+    {
+        event->sockfd = sockfd;
+        event->event_flag = event_flag;
+        event->new_sockfd = new_sockfd;
+        event->is_active = entry->actpas_type == SOCKET_ACTIVE;
+        DL_APPEND(debug_mon->events, event);
+        debug_mon->num_events++;
+        pthread_cond_signal(&debug_mon->cv_events);
+    }
+    else if (debug_mon->dropped_events++ == 0)
+        chilog(WARNING, "Debug client for socket %d is not keeping up. Dropping events.", sockfd);
+    pthread_mutex_unlock(&debug_mon->lock_events);
+
+    pthread_mutex_unlock(&entry->cold->lock_debug_monitor);
+
+    return TRUE;
+}
+
+/* debug_mon_streamer -
+ *  Streaming thread of a non-blocking debug monitor. It sends the
+ *  queued events to the client one by one (so the client sees them in
+ *  order), and frees the monitor once it is destroyed.
+ */
+static void *debug_mon_streamer(void *args)
+{
+    debug_monitor_t *debug_mon = (debug_monitor_t *) args;
+    serverinfo_t *si = debug_mon->si;
+    debug_event_t *event, *tmp;
+
+    pthread_setname_np("debug-stream");
+
+    for(;;)
+    {
+        pthread_mutex_lock(&debug_mon->lock_events);
+        while (debug_mon->events == NULL && !debug_mon->stopping)
+            pthread_cond_wait(&debug_mon->cv_events, &debug_mon->lock_events);
+
+        if (debug_mon->stopping)
+        {
+            pthread_mutex_unlock(&debug_mon->lock_events);
+            break;
+        }
+
+        event = debug_mon->events;
+        DL_DELETE(debug_mon->events, event);
+        debug_mon->num_events--;
+        pthread_mutex_unlock(&debug_mon->lock_events);
+
+        debug_mon_lock(debug_mon, NULL);
+        if (!debug_mon->dying)
+        {
+            chisocketentry_t *entry = CHISOCKET_ENTRY(si, event->sockfd);
+            int response = exchange_breakpoint_messages(debug_mon, event->sockfd, event->event_flag,
+                                                        event->new_sockfd, event->is_active);
+
+            /* The new socket may be gone by now */
+            if (response == DBG_RESP_ACCEPT_MONITOR && CHISOCKET_ENTRY(si, event->new_sockfd)->available)
+                response = DBG_RESP_NONE;
+            handle_special_breakpoint_responses(&response, si, entry, debug_mon, event->event_flag, event->new_sockfd);
+
+            if (debug_mon->dying)
+            {
+                chilog(DEBUG, "Debug monitor for socket %d is dying.", event->sockfd);
+                debug_mon_remove_from_chisocket_table(si, debug_mon);
+            }
+        }
+        debug_mon_release(debug_mon);
+        free(event);
+    }
+
+    if (debug_mon->dropped_events > 0)
+        chilog(WARNING, "Dropped %d debug events", debug_mon->dropped_events);
+
+    DL_FOREACH_SAFE(debug_mon->events, event, tmp)
+    {
+        DL_DELETE(debug_mon->events, event);
+        free(event);
+    }
+
+    close(debug_mon->sockfd);
+    pthread_mutex_destroy(&debug_mon->lock_events);
+    pthread_cond_destroy(&debug_mon->cv_events);
+    pthread_mutex_destroy(&debug_mon->lock_sockfd);
+    pthread_mutex_destroy(&debug_mon->lock_numwaiters);
+    free(debug_mon);
+
+    return NULL;
+}
@@ -47,12 +47,21 @@
 int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags, int client_socket);
 
 
+/* Slow path of chitcpd_debug_breakpoint (the socket may have a monitor) */
+enum chitcpd_debug_response chitcpd_debug_breakpoint_reached(serverinfo_t *si, int sockfd, int event_flag, int new_sockfd);
+
+
 /*
  * chitcpd_debug_breakpoint - An easy interface for adding a breakpoint to
  *      the daemon. All arguments except SI will be forwarded to the client's
  *      debug monitor, and the client will return a code describing which
  *      action to take (see debug_api.h).
  *
+ *      If the socket doesn't have a monitor watching EVENT_FLAG, this only
+ *      reads the socket's event flags (without taking any locks). If the
+ *      monitor is non-blocking, the event is queued and DBG_RESP_NONE is
+ *      returned right away.
+ *
  * si           - server info structure
  * sockfd       - the socket that generated the debug event
  * event_flag   - the type of the debug event
@@ -63,7 +72,14 @@ int chitcpd_init_debug_connection(serverinfo_t *si, int sockfd, int event_flags,
  *          any chitcpd_debug_response (including DBG_RESP_NONE) - the return code from the user's debug_event_handler
  *          
  */
-enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockfd, int event_flag, int new_sockfd);
+static inline enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockfd, int event_flag, int new_sockfd)
+{
+    if (sockfd >= 0 && sockfd < atomic_load_explicit(&si->chisocket_table_size, memory_order_relaxed) &&
+        !(atomic_load_explicit(&CHISOCKET_ENTRY(si, sockfd)->event_flags, memory_order_relaxed) & event_flag))
+        return DBG_RESP_NONE;
+
+    return chitcpd_debug_breakpoint_reached(si, sockfd, event_flag, new_sockfd);
+}
 
 /*
  * When closing a chisocketentry_t,
@@ -56,163 +56,358 @@
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "handlers.h"
 #include "connection.h"
+#include "transport.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/addr.h"
 #include "chitcp/log.h"
 #include "chitcp/utils.h"
+#include "chitcp/multitimer.h"
+#include "chitcp/probes.h"
 #include "breakpoint.h"
+#include "tcp_thread.h"
+#include "netem.h"
+
+/* SYN cookies: the counter is incremented every SYNCOOKIE_PERIOD seconds,
+ * and its lower SYNCOOKIE_COUNT_BITS bits are encoded in the cookie */
+#define SYNCOOKIE_PERIOD (64)
+#define SYNCOOKIE_COUNT_BITS (5)
 
 
 
 /*
- * chitcpd_connection_thread_func - Connection thread function
+ * chitcpd_connection_close_rx - Stop receiving on a connection
+ *
+ * Closes the connection's receive socket and releases its reassembly
+ * buffer (and any partially received packet), as well as the receiving
+ * side of its transport. Only called from the network I/O thread (or
+ * once it has exited).
  *
- * This thread is spawned from chitcpd_server_network_thread_func
- * (in server.c) each time a peer connects to the chiTCP daemon.
+ * si: Server info
  *
- * args: arguments (connection_thread_args_t)
+ * connection: Connection entry
  *
  * Returns: Nothing.
  *
  */
-void* chitcpd_connection_thread_func(void *args)
+static void chitcpd_connection_close_rx(serverinfo_t *si, tcpconnentry_t *connection)
 {
-    connection_thread_args_t *cta = (connection_thread_args_t *) args;
+    pthread_mutex_lock(&si->lock_connection_table);
+    if(connection->transport->close)
+        connection->transport->close(connection);
+    close(connection->realsocket_recv);
+    connection->rx_registered = FALSE;
+    free(connection->rx_buf);
+    connection->rx_buf = NULL;
+    connection->rx_len = 0;
+    if(connection->rx_packet)
+    {
+        chitcp_tcp_packet_free(connection->rx_packet);
+        free(connection->rx_packet);
+        connection->rx_packet = NULL;
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+}
 
-    ssize_t nbytes;
-    bool_t done = FALSE;
-    serverinfo_t *si = cta->si;
-    tcpconnentry_t *connection = cta->connection;
-    pthread_setname_np(cta->thread_name);
-    free(args);
-    struct sockaddr_storage local_addr, peer_addr;
-    chitcphdr_t chitcp_header;
-    uint8_t buf[1000];
-    uint16_t payload_len;
+
+/* See connection.h */
+void chitcpd_connection_deliver(serverinfo_t *si, tcpconnentry_t *connection, tcp_packet_t *packet)
+{
     int ret;
-    /* Get the local and peer addresses */
-    socklen_t lsize, psize;
-    lsize = psize = sizeof(struct sockaddr_storage);
-    getsockname(connection->realsocket_recv, (struct sockaddr*) &local_addr, &lsize);
-    getpeername(connection->realsocket_recv, (struct sockaddr*) &peer_addr, &psize);
 
-    do
+    /* Print the packet to the log */
+    chilog_tcp(TRACE, packet, LOG_INBOUND);
+
+    atomic_fetch_add_explicit(&connection->packets_in, 1, memory_order_relaxed);
+    CHITCP_PROBE(connection_recv, packet, packet->length);
+
+    /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
+     * packet to the right socket */
+    ret = chitcpd_recv_tcp_packet(si, packet, (struct sockaddr*) &connection->rx_local_addr, (struct sockaddr*) &connection->rx_peer_addr);
+
+    if(ret != CHITCP_OK)
     {
-        /* Receive a chiTCP header */
-        nbytes = recv(connection->realsocket_recv, &chitcp_header, sizeof(chitcphdr_t), 0);
+        /* TODO: Should send some sort of ICMP-ish message back to peer.
+         * For now, we just silently drop the packet */
+        chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
+    }
+}
+
 
-        if (nbytes == 0)
+/*
+ * chitcpd_netio_thread_func - Network I/O thread function
+ *
+ * This thread polls the receive sockets of the registered connections
+ * of its stripe (plus a wakeup pipe), and has their transports receive
+ * the chiTCP frames sent by the peers. Transports that don't receive
+ * through the socket itself (see transport_t's arm) are checked before
+ * sleeping.
+ *
+ * args: Network I/O thread (netio_thread_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+void* chitcpd_netio_thread_func(void *args)
+{
+    netio_thread_t *netio = (netio_thread_t *) args;
+    serverinfo_t *si = netio->si;
+    struct pollfd *fds;
+    tcpconnentry_t **conns;
+    bool_t *pending;
+    int nfds = 0, timeout;
+    bool_t rebuild = TRUE;
+    char thread_name[16];
+    char c;
+
+    snprintf(thread_name, 16, "network-io-%d", netio->id);
+    pthread_setname_np(thread_name);
+    affinity_pin_cpu(&si->placement, netio->id);
+
+    /* At most one pollfd per connection, plus the wakeup pipe */
+    fds = calloc(si->connection_table_size + 1, sizeof(struct pollfd));
+    conns = calloc(si->connection_table_size + 1, sizeof(tcpconnentry_t*));
+    pending = calloc(si->connection_table_size + 1, sizeof(bool_t));
+
+    for(;;)
+    {
+        if(rebuild)
         {
-            // Server closed the connection
-            close(connection->realsocket_recv);
-            done = 1;
+            fds[0].fd = netio->wakeup[0];
+            fds[0].events = POLLIN;
+            nfds = 1;
+
+            pthread_mutex_lock(&si->lock_connection_table);
+            for(int i=0; i < si->connection_table_size; i++)
+            {
+                tcpconnentry_t *connection = &si->connection_table[i];
+                if(!connection->available && connection->rx_registered &&
+                   connection->stripe % si->num_netio_threads == netio->id)
+                {
+                    fds[nfds].fd = connection->realsocket_recv;
+                    fds[nfds].events = POLLIN;
+                    conns[nfds] = connection;
+                    nfds++;
+                }
+            }
+            pthread_mutex_unlock(&si->lock_connection_table);
+            rebuild = FALSE;
         }
-        else if (nbytes == -1)
+
+        timeout = -1;
+        for(int i=1; i < nfds; i++)
         {
-            chilog(ERROR, "Socket recv() failed on fd %d: %s", connection->realsocket_recv,
-                    strerror(errno));
-            close(connection->realsocket_recv);
-            pthread_exit(NULL);
+            const transport_t *transport = conns[i]->transport;
+
+            pending[i] = transport->arm != NULL && transport->arm(conns[i]);
+            if(pending[i])
+                timeout = 0;
         }
-        else if (si->state != CHITCPD_STATE_STOPPING)
+
+        if(poll(fds, nfds, timeout) == -1)
         {
-            chilog(TRACE, "Received a chiTCP header.");
-            chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
+            if(errno == EINTR)
+                continue;
+            perror("Network I/O poll() failed");
+            break;
+        }
 
-            /* Inspect the chiTCP header to determine ho w to proceed */
+        if(fds[0].revents & POLLIN)
+        {
+            while(read(netio->wakeup[0], &c, 1) == 1);
+            if(si->netio_done)
+                break;
+            rebuild = TRUE;
+        }
 
-            payload_len = chitcp_ntohs(chitcp_header.payload_len);
+        for(int i=1; i < nfds; i++)
+        {
+            if(fds[i].revents == 0 && !pending[i])
+                continue;
 
-            if(chitcp_header.proto == CHITCP_PROTO_TCP)
+            if(conns[i]->transport->recv(si, conns[i]) != CHITCP_OK)
             {
-                /* This means the header will be following by a TCP packet */
-
-                /* Receive the packet */
-                nbytes = recv(connection->realsocket_recv, buf, payload_len, 0);
-                if (nbytes == 0)
-                {
-                    // Server closed the connection
-                    close(connection->realsocket_recv);
-                    done = 1;
-                }
-                else if (nbytes == -1)
-                {
-                    chilog(ERROR, "Socket recv() failed on fd %d: %s",
-                            connection->realsocket_recv,
-                            strerror(errno));
-                    close(connection->realsocket_recv);
-                    pthread_exit(NULL);
-                }
-                else
-                {
-                    chilog(TRACE, "chiTCP packet contains a TCP payload");
-
-                    /* Allocate memory for received TCP packet */
-                    tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
-                    packet->raw = malloc(payload_len);
-                    memcpy(packet->raw, buf, payload_len);
-                    packet->length = payload_len;
-
-                    /* Print the packet to the log */
-                    chilog_tcp(TRACE, packet, LOG_INBOUND);
-
-                    /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
-                     * packet to the right socket */
-                    ret = chitcpd_recv_tcp_packet(si, packet, (struct sockaddr*) &local_addr, (struct sockaddr*) &peer_addr);
-
-                    if(ret != CHITCP_OK)
-                    {
-                        /* TODO: Should send some sort of ICMP-ish message back to peer.
-                         * For now, we just silently drop the packet */
-                        chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
-                    }
-                }
+                chitcpd_connection_close_rx(si, conns[i]);
+                rebuild = TRUE;
             }
-            else
+        }
+    }
+
+    free(fds);
+    free(conns);
+    free(pending);
+
+    chilog(DEBUG, "Network I/O thread %i is exiting.", netio->id);
+
+    pthread_exit(NULL);
+}
+
+
+/* See connection.h */
+int chitcpd_start_netio_threads(serverinfo_t *si)
+{
+    si->num_netio_threads = MIN(MAX(si->connection_stripes, 1), CONNECTION_MAX_STRIPES);
+    si->netio_threads = calloc(si->num_netio_threads, sizeof(netio_thread_t));
+    if(si->netio_threads == NULL)
+        return CHITCP_ENOMEM;
+    si->netio_done = FALSE;
+
+    for(int i=0; i < si->num_netio_threads; i++)
+    {
+        netio_thread_t *netio = &si->netio_threads[i];
+        int rc = CHITCP_OK;
+
+        netio->id = i;
+        netio->si = si;
+
+        if(pipe(netio->wakeup) == -1)
+        {
+            perror("Could not create network I/O wakeup pipe");
+            rc = CHITCP_ESOCKET;
+        }
+        else
+        {
+            fcntl(netio->wakeup[0], F_SETFL, O_NONBLOCK);
+            fcntl(netio->wakeup[1], F_SETFL, O_NONBLOCK);
+
+            if (pthread_create(&netio->thread, NULL, chitcpd_netio_thread_func, netio) != 0)
             {
-                chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header.proto);
-                close(connection->realsocket_recv);
-                done = 1;
+                perror("Could not create network I/O thread");
+                close(netio->wakeup[0]);
+                close(netio->wakeup[1]);
+                rc = CHITCP_ETHREAD;
             }
+        }
 
+        if(rc != CHITCP_OK)
+        {
+            si->num_netio_threads = i;
+            chitcpd_stop_netio_threads(si);
+            return rc;
         }
     }
-    while (!done);
 
-    pthread_exit(NULL);
+    return CHITCP_OK;
+}
+
+
+/* See connection.h */
+void chitcpd_stop_netio_threads(serverinfo_t *si)
+{
+    char c = 0;
+
+    si->netio_done = TRUE;
+    for(int i=0; i < si->num_netio_threads; i++)
+        if (write(si->netio_threads[i].wakeup[1], &c, 1) == -1)
+            perror("Could not wake up network I/O thread");
+    for(int i=0; i < si->num_netio_threads; i++)
+        pthread_join(si->netio_threads[i].thread, NULL);
+
+    for(int i=0; i < si->connection_table_size; i++)
+    {
+        tcpconnentry_t *connection = &si->connection_table[i];
+        if(!connection->available && connection->rx_registered)
+            chitcpd_connection_close_rx(si, connection);
+    }
+
+    for(int i=0; i < si->num_netio_threads; i++)
+    {
+        close(si->netio_threads[i].wakeup[0]);
+        close(si->netio_threads[i].wakeup[1]);
+    }
+    free(si->netio_threads);
+    si->netio_threads = NULL;
+    si->num_netio_threads = 0;
+}
+
+
+/*
+ * chitcpd_peer_key_init - Build the peer index key of an address
+ *
+ * key: Key to initialize
+ *
+ * addr: Address of the peer's daemon (the port is ignored)
+ *
+ * Returns: nothing.
+ *
+ */
+static void chitcpd_peer_key_init(tcppeer_key_t *key, struct sockaddr *addr)
+{
+    size_t addr_len = addr->sa_family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+
+    memset(key, 0, sizeof(tcppeer_key_t));
+    key->family = addr->sa_family;
+    memcpy(key->addr, chitcp_get_addr(addr), addr_len);
 }
 
+
 /*
- * chitcpd_get_connection - Get a TCP connection (if one already exists) to another chiTCP daemon
+ * chitcpd_lookup_peer - Find a peer in the peer index
+ *
+ * Must be called with lock_connection_table held.
  *
  * si: Server info
  *
- * addr: Address of peer where chiTCP daemon is running
+ * addr: Address of the peer's daemon
  *
- * Returns: Pointer to entry in connection table with connection to peer.
- *          NULL if a connection to that peer has not been established yet-
+ * Returns: The peer, or NULL if there is no connection to it.
  *
  */
-tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr)
+static tcppeer_t* chitcpd_lookup_peer(serverinfo_t *si, struct sockaddr *addr)
 {
-    assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
+    tcppeer_key_t key;
+    tcppeer_t *peer;
+
+    chitcpd_peer_key_init(&key, addr);
+    HASH_FIND(hh, si->peer_index, &key, sizeof(tcppeer_key_t), peer);
+
+    return peer;
+}
+
+
+/*
+ * chitcpd_peer_stripe - Pick the stripe that a socket is hashed onto
+ *
+ * peer: Peer (with at least one stripe)
+ *
+ * local_addr, remote_addr: Socket's addresses
+ *
+ * Returns: The stripe's connection entry.
+ *
+ */
+static tcpconnentry_t* chitcpd_peer_stripe(tcppeer_t *peer, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    chisocket_demux_key_t key;
+    unsigned hashv;
+
+    if(peer->num_stripes == 1)
+        return peer->stripes[0];
+
+    chitcpd_demux_key_init(&key, local_addr, remote_addr);
+    HASH_VALUE(&key, sizeof(chisocket_demux_key_t), hashv);
+
+    return peer->stripes[hashv % peer->num_stripes];
+}
+
+
+/* See connection.h */
+tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
 
     tcpconnentry_t *ret = NULL;
+    tcppeer_t *peer;
 
     pthread_mutex_lock(&si->lock_connection_table);
-    /* Find connection in connection table table */
-    for(int i=0; i < si->connection_table_size; i++)
+    peer = chitcpd_lookup_peer(si, remote_addr);
+    if(peer != NULL)
     {
-        if(!si->connection_table[i].available)
-        {
-            if(chitcp_addr_cmp(addr, (struct sockaddr *) &si->connection_table[i].peer_addr) == 0)
-            {
-                ret = &si->connection_table[i];
-                break;
-            }
-        }
+        while(!peer->ready)
+            pthread_cond_wait(&si->cv_connection_table, &si->lock_connection_table);
+        ret = chitcpd_peer_stripe(peer, local_addr, remote_addr);
     }
     pthread_mutex_unlock(&si->lock_connection_table);
 
@@ -220,16 +415,80 @@ tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr)
 }
 
 
+/* See connection.h */
+void chitcpd_fastopen_cookie(serverinfo_t *si, struct sockaddr *remote_addr, uint8_t *cookie)
+{
+    tcppeer_key_t key;
+
+    chitcpd_peer_key_init(&key, remote_addr);
+
+    /* Two FNV-1a hashes (as in chitcpd_syncookie), with different seeds */
+    for(int half = 0; half < TCP_FASTOPEN_COOKIE_LEN / 4; half++)
+    {
+        uint32_t words[2] = {si->syncookie_secret, half};
+        uint32_t hash = 2166136261u;
+        uint8_t *bytes;
+
+        bytes = (uint8_t *) words;
+        for(size_t i = 0; i < sizeof(words); i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+
+        bytes = (uint8_t *) &key;
+        for(size_t i = 0; i < sizeof(key); i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+
+        memcpy(cookie + half * 4, &hash, 4);
+    }
+}
+
+
+/* See connection.h */
+bool_t chitcpd_fastopen_cookie_get(serverinfo_t *si, struct sockaddr *remote_addr, uint8_t *cookie)
+{
+    tcppeer_t *peer;
+    bool_t found = FALSE;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    peer = chitcpd_lookup_peer(si, remote_addr);
+    if(peer != NULL && peer->has_tfo_cookie)
+    {
+        memcpy(cookie, peer->tfo_cookie, TCP_FASTOPEN_COOKIE_LEN);
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return found;
+}
+
+
+/* See connection.h */
+void chitcpd_fastopen_cookie_set(serverinfo_t *si, struct sockaddr *remote_addr, const uint8_t *cookie)
+{
+    tcppeer_t *peer;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    peer = chitcpd_lookup_peer(si, remote_addr);
+    if(peer != NULL)
+    {
+        memcpy(peer->tfo_cookie, cookie, TCP_FASTOPEN_COOKIE_LEN);
+        peer->has_tfo_cookie = TRUE;
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+}
+
+
 /*
  * chitcpd_get_available_connection_entry - Find an avalable slot in the connection table
  *
+ * Must be called with lock_connection_table held.
+ *
  * si: Server info
  *
  * Returns: Pointer to available entry in connection table.
  *          NULL if there are no available entries.
  *
  */
-tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
+static tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
 {
     tcpconnentry_t *ret = NULL;
 
@@ -247,123 +506,58 @@ tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
 
 
 /*
- * chitcpd_create_connection - Establish a connection to another chiTCP daemon
+ * chitcpd_add_peer - Add a peer to the peer index
+ *
+ * Must be called with lock_connection_table held.
  *
  * si: Server info
  *
- * addr: Address of peer running a chiTCP daemon
+ * addr: Address of the peer's daemon
  *
- * Returns: Pointer to entry in connection table for this new connection.
- *          NULL if the connection table is full, or if connection was unsuccessful
+ * Returns: The new peer (with no stripes), or NULL if it could not
+ *          be allocated.
  *
  */
-tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr)
+static tcppeer_t* chitcpd_add_peer(serverinfo_t *si, struct sockaddr *addr)
 {
-    assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
-
-    socklen_t addrsize;
-    tcpconnentry_t* connection = NULL;
-
-    connection = chitcpd_get_available_connection_entry(si);
-
-    if(connection == NULL)
-        return connection;
+    tcppeer_t *peer = calloc(1, sizeof(tcppeer_t));
 
-    connection->available = FALSE;
-
-    /* Set address of peer in connection entry
-     * Note that we keep the IP address, but set the port to the chiTCP port
-     * (since the peer address will be using an ephemeral port) */
-    if(addr->sa_family == AF_INET)
-    {
-        addrsize = sizeof(struct sockaddr_in);
-    }
-    else if(addr->sa_family == AF_INET6)
-        addrsize = sizeof(struct sockaddr_in6);
-    else
-    {
-        /* Should not happen; assert at top of function will fail first */
+    if(peer == NULL)
         return NULL;
-    }
-
-
-    memcpy(&connection->peer_addr, addr, addrsize);
-    chitcp_set_addr_port((struct sockaddr*) &connection->peer_addr, chitcp_htons(GET_CHITCPD_PORT));
-
-    /* Establish connection */
-    /* TODO: Fail gracefully if unable to connect to peer */
-    connection->realsocket_send = socket(addr->sa_family,
-                             SOCK_STREAM,
-                             IPPROTO_TCP);
-
-    /* The following value will be set later, either in this function (below)
-     * or by the network thread (see comment below). For now, we simply
-     * get rid of garbage data. (It is important to do this before calling
-     * connect() below, otherwise there is a race condition.) */
-    connection->realsocket_recv = -1;
-
-    connect(connection->realsocket_send, (struct sockaddr*) &connection->peer_addr, addrsize);
-
-    /* Create connection thread */
 
-    /* If we're connecting to the loopback address, the connection thread
-     * is created by the network thread (when the connection is accepted)
-     * not here. The reason is that the connection thread handles all
-     * inbound packets (through realsocket_recv), and we do not know what
-     * the socket for receiving packets will be until we accept() the connection.
-     */
-    if(!chitcp_addr_is_loopback((struct sockaddr *) &connection->peer_addr))
-    {
-        connection->realsocket_recv = connection->realsocket_send;
-        chitcpd_create_connection_thread(si, connection);
-    }
+    chitcpd_peer_key_init(&peer->key, addr);
+    HASH_ADD(hh, si->peer_index, key, sizeof(tcppeer_key_t), peer);
 
-    return connection;
+    return peer;
 }
 
-int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connection)
-{
-    connection_thread_args_t *cta;
-    pthread_t connection_thread;
-
-    /* For naming the connection threads we create (for debugging/logging) */
-    static int next_thread_id = 0;
-
-    cta = malloc(sizeof(connection_thread_args_t));
-    cta->si = si;
-    cta->connection = connection;
-    snprintf(cta->thread_name, 16, "network-layer-%d", next_thread_id++);
-
-    if (pthread_create(&connection_thread, NULL, chitcpd_connection_thread_func, cta) != 0)
-    {
-        perror("Could not create a connection thread");
-        return CHITCP_ETHREAD;
-    }
-
-    connection->thread = connection_thread;
-
-    return CHITCP_OK;
-}
 
 /*
- * chitcpd_add_connection - Add a connection to the connection table.
+ * chitcpd_add_stripe - Add a connection entry to a peer
+ *
+ * Must be called with lock_connection_table held.
  *
  * si: Server info
  *
- * realsocket: TCP socket of connection
+ * peer: Peer
+ *
+ * transport: Transport of the connection
+ *
+ * realsocket_send, realsocket_recv: Sockets of the connection
  *
  * addr: Address of peer running a chiTCP daemon
  *
- * Returns: Pointer to available entry in connection table.
- *          NULL if connection table is full.
+ * Returns: Pointer to the new entry in the connection table.
+ *          NULL if the table is full, or the peer has too many stripes.
  *
  */
-tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_send, socket_t realsocket_recv, struct sockaddr* addr)
+static tcpconnentry_t* chitcpd_add_stripe(serverinfo_t *si, tcppeer_t *peer, const transport_t *transport,
+                                          socket_t realsocket_send, socket_t realsocket_recv, struct sockaddr* addr)
 {
-    assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
-
     tcpconnentry_t *ret = NULL;
-    socklen_t addrsize;
+
+    if(peer->num_stripes == CONNECTION_MAX_STRIPES)
+        return NULL;
 
     ret = chitcpd_get_available_connection_entry(si);
 
@@ -375,101 +569,491 @@ tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_sen
     /* Set address of peer in connection entry
      * Note that we keep the IP address, but set the port to the chiTCP port
      * (since the peer address will be using an ephemeral port) */
-    if(addr->sa_family == AF_INET)
-    {
-        addrsize = sizeof(struct sockaddr_in);
-    }
-    else if(addr->sa_family == AF_INET6)
-        addrsize = sizeof(struct sockaddr_in6);
-    else
-    {
-        /* Should not happen; assert at top of function will fail first */
-        return NULL;
-    }
-
-    memcpy(&ret->peer_addr, addr, addrsize);
+    memcpy(&ret->peer_addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
     chitcp_set_addr_port((struct sockaddr*) &ret->peer_addr, chitcp_htons(GET_CHITCPD_PORT));
 
     /* Set sockets */
     ret->realsocket_send = realsocket_send;
     ret->realsocket_recv = realsocket_recv;
+    ret->transport = transport;
+    ret->transport_data = NULL;
+
+    atomic_store(&ret->packets_in, 0);
+    atomic_store(&ret->packets_out, 0);
+
+    ret->peer = peer;
+    ret->stripe = peer->num_stripes;
+    peer->stripes[peer->num_stripes++] = ret;
 
     return ret;
 }
 
-/*
- * chitcpd_send_tcp_packet - Sends a TCP packet over chiTCP
- *
- * si: Serverinfo struct
- *
- * sock: Socket table entry
- *
- * tcp_packet: TCP packet to send
- *
- * Returns: Number of bytes of data (excluding packet headers) sent
- *
- */
-int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet)
-{
-    enum chitcpd_debug_response r = chitcpd_debug_breakpoint(si, ptr_to_fd(si, sock), DBG_EVT_OUTGOING_PACKET, -1);
 
-    if (r == DBG_RESP_DROP)
-    {
-        chilog(TRACE, "chitcpd_send_tcp_packet: dropping the packet");
-        chilog_tcp_minimal((struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr, SOCKET_NO(si, sock), tcp_packet, MINLOG_SEND_DROP);
-        return tcp_packet->length; /* fake that the packet was sent */
-    }
-    tcpconnentry_t *connection = sock->socket_state.active.realtcpconn;
+/* See connection.h */
+tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
 
-    /* Allocate memory for the chiTCP header and the TCP packet */
-    uint8_t *full_packet = calloc(sizeof(chitcphdr_t) + tcp_packet->length, 1);
+    int nstripes = MIN(MAX(si->connection_stripes, 1), CONNECTION_MAX_STRIPES);
+    const transport_t *transport = transport_for_peer(si, remote_addr);
+    tcppeer_t *peer;
 
+    pthread_mutex_lock(&si->lock_connection_table);
 
-    /* Create the chiTCP header */
-    chitcphdr_t *header = (chitcphdr_t *) full_packet;
-    header->payload_len = chitcp_htons(tcp_packet->length);
-    header->proto = CHITCP_PROTO_TCP;
+    /* Another thread may have connected to the peer in the meantime */
+    if(chitcpd_lookup_peer(si, remote_addr) != NULL)
+    {
+        pthread_mutex_unlock(&si->lock_connection_table);
+        return chitcpd_get_connection(si, local_addr, remote_addr);
+    }
 
-    /* Copy the packet */
-    memcpy(full_packet + sizeof(chitcphdr_t), tcp_packet->raw, tcp_packet->length);
+    peer = chitcpd_add_peer(si, remote_addr);
+    if(peer == NULL)
+    {
+        pthread_mutex_unlock(&si->lock_connection_table);
+        return NULL;
+    }
 
-    /* Print the chiTCP header and the full TCP packet */
-    chilog(TRACE, "Sending a chiTCP packet with a TCP payload.");
-    chilog(TRACE, "chiTCP Header:");
-    chilog_chitcp(TRACE, (uint8_t*) header, LOG_OUTBOUND);
+    /* The receive sockets will be set later, either by the transport (below)
+     * or by the network thread (see chitcpd_accept_connection). For now, we
+     * simply get rid of garbage data. (It is important to do this before
+     * calling connect() below, otherwise there is a race condition.) */
+    for(int i=0; i < nstripes; i++)
+        if(chitcpd_add_stripe(si, peer, transport, -1, -1, remote_addr) == NULL)
+            break;
+    nstripes = peer->num_stripes;
 
-    chilog(TRACE, "TCP payload:");
-    chilog_tcp_minimal((struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr, SOCKET_NO(si, sock), tcp_packet, MINLOG_SEND);
-    chilog_tcp(TRACE, tcp_packet, LOG_OUTBOUND);
+    pthread_mutex_unlock(&si->lock_connection_table);
 
-    /* Send the chiTCP header and the TCP packet */
-    int nbytes, nleft, nwritten = 0;
+    /* Establish the connections. The peer is not ready yet, so
+     * nobody else will use them until they are connected. */
+    /* TODO: Fail gracefully if unable to connect to peer */
+    for(int i=0; i < nstripes; i++)
+        if(transport->connect(si, peer->stripes[i]) != CHITCP_OK)
+            chilog(ERROR, "Could not connect to the peer's daemon (%s transport)", transport->name);
 
-    uint8_t *buf = full_packet;
-    nleft = sizeof(chitcphdr_t) + tcp_packet->length;
+    pthread_mutex_lock(&si->lock_connection_table);
+    peer->ready = TRUE;
+    pthread_cond_broadcast(&si->cv_connection_table);
+    pthread_mutex_unlock(&si->lock_connection_table);
 
-    /* TODO: Possible race condition if multiple TCP threads want to send
-     * at the same time *and* this send() doesn't send the entire packet */
-    while ( nleft > 0 ) {
-        if ( (nbytes = send(connection->realsocket_send, buf, nleft, 0)) <= 0 ) {
-            return -1;
-        }
-        nleft -= nbytes;
-        buf += nbytes;
-        nwritten += nbytes;
-    }
-    assert(nwritten == sizeof(chitcphdr_t) + tcp_packet->length);
+    /* Register the connections with the network I/O threads */
 
-    free(full_packet);
+    /* If we're connecting to the loopback address, the connections are
+     * registered by the network thread (when the connections are accepted)
+     * not here. The reason is that the network I/O threads read all
+     * inbound packets (through realsocket_recv), and we do not know what
+     * the socket for receiving packets will be until we accept() the connection.
+     * The transport only sets realsocket_recv if it is not the case.
+     */
+    for(int i=0; i < nstripes; i++)
+        if(peer->stripes[i]->realsocket_recv != -1)
+            chitcpd_register_connection(si, peer->stripes[i]);
 
-    return tcp_packet->length;
+    return nstripes > 0 ? chitcpd_peer_stripe(peer, local_addr, remote_addr) : NULL;
 }
 
-
+/* See connection.h */
+int chitcpd_register_connection(serverinfo_t *si, tcpconnentry_t* connection)
+{
+    socklen_t lsize, psize;
+    netio_thread_t *netio;
+    char c = 0;
+
+    /* Get the local and peer addresses. With a local transport, there
+     * is no IP address to get from the socket, but both are the
+     * (loopback) address of the peer. */
+    if(connection->transport->local)
+    {
+        memcpy(&connection->rx_local_addr, &connection->peer_addr, sizeof(struct sockaddr_storage));
+        memcpy(&connection->rx_peer_addr, &connection->peer_addr, sizeof(struct sockaddr_storage));
+    }
+    else
+    {
+        lsize = psize = sizeof(struct sockaddr_storage);
+        getsockname(connection->realsocket_recv, (struct sockaddr*) &connection->rx_local_addr, &lsize);
+        getpeername(connection->realsocket_recv, (struct sockaddr*) &connection->rx_peer_addr, &psize);
+    }
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    connection->rx_buf = malloc(CONNECTION_RX_BUFFER_SIZE);
+    connection->rx_len = 0;
+    connection->rx_packet = NULL;
+    connection->rx_packet_len = 0;
+    if(connection->rx_buf == NULL)
+    {
+        pthread_mutex_unlock(&si->lock_connection_table);
+        return CHITCP_ENOMEM;
+    }
+    connection->rx_registered = TRUE;
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    /* Make the network I/O thread of the connection's stripe pick it up */
+    netio = &si->netio_threads[connection->stripe % si->num_netio_threads];
+    if (write(netio->wakeup[1], &c, 1) == -1 && errno != EAGAIN)
+    {
+        perror("Could not wake up network I/O thread");
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+/* See connection.h */
+tcpconnentry_t* chitcpd_accept_connection(serverinfo_t *si, const transport_t *transport, socket_t realsocket, struct sockaddr *addr)
+{
+    assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
+
+    tcpconnentry_t *ret = NULL;
+    tcppeer_t *peer;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    peer = chitcpd_lookup_peer(si, addr);
+
+    /* If this is a loopback connection, one of the peer's stripes
+     * is waiting for its receive socket */
+    if(peer != NULL && chitcp_addr_is_loopback(addr))
+    {
+        for(int i=0; i < peer->num_stripes; i++)
+            if(peer->stripes[i]->realsocket_recv == -1)
+            {
+                ret = peer->stripes[i];
+                ret->realsocket_recv = realsocket;
+                break;
+            }
+    }
+
+    /* Otherwise, the peer's daemon has opened a new stripe */
+    if(ret == NULL)
+    {
+        if(peer == NULL && (peer = chitcpd_add_peer(si, addr)) != NULL)
+            peer->ready = TRUE;
+        if(peer != NULL)
+            ret = chitcpd_add_stripe(si, peer, transport, realsocket, realsocket, addr);
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return ret;
+}
+
+/* See connection.h */
+tcpconnentry_t* chitcpd_find_connection(serverinfo_t *si, struct sockaddr *realaddr)
+{
+    tcpconnentry_t *ret = NULL;
+    tcppeer_t *peer;
+
+    pthread_mutex_lock(&si->lock_connection_table);
+    peer = chitcpd_lookup_peer(si, realaddr);
+    for(int i=0; peer != NULL && i < peer->num_stripes; i++)
+    {
+        tcpconnentry_t *connection = peer->stripes[i];
+        struct sockaddr *rx_peer_addr = (struct sockaddr*) &connection->rx_peer_addr;
+
+        if(connection->rx_registered && rx_peer_addr->sa_family == realaddr->sa_family &&
+           !chitcp_addr_cmp(rx_peer_addr, realaddr) && !chitcp_addr_port_cmp(rx_peer_addr, realaddr))
+        {
+            ret = connection;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&si->lock_connection_table);
+
+    return ret;
+}
+
+static void chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr *src, struct sockaddr *dst,
+                                int sockfd, pcap_direction_t direction);
+
+
+/*
+ * chitcpd_connection_send_packet - Sends a TCP packet over a connection
+ *
+ * si: Serverinfo struct
+ *
+ * connection: Connection to the peer's daemon
+ *
+ * tcp_packet: TCP packet to send
+ *
+ * sock: Active socket that sends the packet, whose queue in the connection's
+ *       transmit scheduler it goes in (NULL if the packet is not sent by
+ *       an active socket, in which case it has strict priority)
+ *
+ * local_addr, remote_addr, sockno: Addresses and socket number (for logging)
+ *
+ * Returns: Number of bytes of data (excluding packet headers) sent
+ *
+ */
+static int chitcpd_connection_send_packet(serverinfo_t *si, tcpconnentry_t *connection, tcp_packet_t* tcp_packet,
+                                          chisocketentry_t *sock,
+                                          struct sockaddr *local_addr, struct sockaddr *remote_addr, int sockno)
+{
+    tx_flow_t *flow = NULL;
+    connection_tx_entry_t tx_entry;
+
+    /* Create the chiTCP header */
+    chitcphdr_t *header = &tx_entry.header;
+    memset(header, 0, sizeof(chitcphdr_t));
+    header->payload_len = chitcp_htons(tcp_packet->length);
+    header->proto = CHITCP_PROTO_TCP;
+
+    tx_entry.packet = tcp_packet;
+    tx_entry.done = FALSE;
+    tx_entry.rc = CHITCP_OK;
+
+    /* Print the chiTCP header and the full TCP packet */
+    chilog(TRACE, "Sending a chiTCP packet with a TCP payload.");
+    chilog(TRACE, "chiTCP Header:");
+    chilog_chitcp(TRACE, (uint8_t*) header, LOG_OUTBOUND);
+
+    chilog(TRACE, "TCP payload:");
+    chilog_tcp_minimal(local_addr, remote_addr, sockno, tcp_packet, MINLOG_SEND);
+    chilog_tcp(TRACE, tcp_packet, LOG_OUTBOUND);
+
+    chitcpd_pcap_packet(si, tcp_packet, local_addr, remote_addr, sockno, PCAP_OUTBOUND);
+
+    /* Queue the segment. If another thread is already writing to this
+     * connection, it will send our segment along with its own (and any
+     * others that were queued in the meantime). Otherwise, we become
+     * the writer, and send everything that is queued, in the order the
+     * transmit scheduler picks, until nothing is left. Either way, there
+     * is only ever one thread writing to the socket, so segments can't
+     * be interleaved. */
+    pthread_mutex_lock(&connection->lock_tx);
+    if(sock != NULL)
+    {
+        flow = &sock->socket_state.active.tx_flow;
+        tx_flow_set_priority(flow, sock->priority);
+    }
+    tx_sched_enqueue(&connection->tx_sched, flow, &tx_entry);
+
+    while(!tx_entry.done && connection->tx_busy)
+        pthread_cond_wait(&connection->cv_tx, &connection->lock_tx);
+
+    if(!tx_entry.done)
+    {
+        connection->tx_busy = TRUE;
+
+        while(!tx_sched_empty(&connection->tx_sched))
+        {
+            connection_tx_entry_t *batch, *elt;
+            int rc;
+
+            batch = tx_sched_dequeue(&connection->tx_sched, CONNECTION_TX_BATCH_MAX);
+            pthread_mutex_unlock(&connection->lock_tx);
+
+            rc = connection->transport->send(connection, batch);
+
+            pthread_mutex_lock(&connection->lock_tx);
+            DL_FOREACH(batch, elt)
+            {
+                elt->rc = rc;
+                elt->done = TRUE;
+            }
+            pthread_cond_broadcast(&connection->cv_tx);
+        }
+
+        connection->tx_busy = FALSE;
+        pthread_cond_broadcast(&connection->cv_tx);
+    }
+    pthread_mutex_unlock(&connection->lock_tx);
+
+    if(tx_entry.rc != CHITCP_OK)
+        return -1;
+
+    atomic_fetch_add_explicit(&connection->packets_out, 1, memory_order_relaxed);
+
+    return tcp_packet->length;
+}
+
+
+/*
+ * chitcpd_send_tcp_packet - Sends a TCP packet over chiTCP
+ *
+ * si: Serverinfo struct
+ *
+ * sock: Socket table entry
+ *
+ * tcp_packet: TCP packet to send
+ *
+ * Returns: Number of bytes of data (excluding packet headers) sent
+ *
+ */
+int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet)
+{
+    tcp_data_t *tcp_data = &sock->socket_state.active.tcp_data;
+    tcphdr_t *tcp_header = TCP_PACKET_HEADER(tcp_packet);
+
+    /* Offer window scaling in our SYN if we need it, and reply to
+     * the peer's offer in our SYN/ACK (see chitcpd_tcp_process_syn) */
+    if (tcp_header->syn &&
+        ((!tcp_header->ack && tcp_data->RCV_WND_SHIFT > 0) || (tcp_header->ack && tcp_data->wscale_rcvd)))
+    {
+        if (chitcp_tcp_packet_add_wscale(tcp_packet, tcp_data->RCV_WND_SHIFT) != CHITCP_OK)
+            chilog(WARNING, "Could not add window scale option to SYN");
+    }
+
+    /* Offer SACK in our SYN, or accept the peer's offer in our SYN/ACK
+     * (once the SYN has been processed, sack_enabled is only still set
+     * if the peer offered it) */
+    if (TCP_PACKET_HEADER(tcp_packet)->syn && tcp_data->sack_enabled)
+    {
+        if (chitcp_tcp_packet_add_sack_permitted(tcp_packet) != CHITCP_OK)
+            chilog(WARNING, "Could not add SACK permitted option to SYN");
+    }
+
+    /* With TCP Fast Open, our SYN carries the peer's cookie (or asks for
+     * one), and our SYN/ACK issues a cookie if the peer's SYN didn't carry
+     * a valid one (see chitcpd_tcp_process_syn) */
+    if (TCP_PACKET_HEADER(tcp_packet)->syn && tcp_data->fastopen &&
+        (!TCP_PACKET_HEADER(tcp_packet)->ack || tcp_data->tfo_cookie_len > 0))
+    {
+        if (chitcp_tcp_packet_add_fastopen(tcp_packet, tcp_data->tfo_cookie, tcp_data->tfo_cookie_len) != CHITCP_OK)
+            chilog(WARNING, "Could not add Fast Open option to SYN");
+    }
+
+    /* Every segment carries a timestamp once both SYNs have (and our
+     * SYN carries one if we offer the option) */
+    if (tcp_data->ts_enabled)
+    {
+        if (chitcp_tcp_packet_add_timestamp(tcp_packet, TCP_TS_NOW(), TCP_PACKET_HEADER(tcp_packet)->ack? tcp_data->TS_RECENT : 0) != CHITCP_OK)
+            chilog(WARNING, "Could not add timestamps option to segment");
+    }
+
+    return chitcpd_send_prepared_tcp_packet(si, sock, tcp_packet);
+}
+
+
+/* See connection.h */
+int chitcpd_send_prepared_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet)
+{
+    tcp_data_t *tcp_data = &sock->socket_state.active.tcp_data;
+    enum chitcpd_debug_response r = chitcpd_debug_breakpoint(si, ptr_to_fd(si, sock), DBG_EVT_OUTGOING_PACKET, -1);
+
+    if (r == DBG_RESP_DROP)
+    {
+        chilog(TRACE, "chitcpd_send_tcp_packet: dropping the packet");
+        chilog_tcp_minimal((struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr, SOCKET_NO(si, sock), tcp_packet, MINLOG_SEND_DROP);
+        return tcp_packet->length; /* fake that the packet was sent */
+    }
+
+    int nbytes = chitcpd_connection_send_packet(si, sock->socket_state.active.realtcpconn, tcp_packet, sock,
+                                                (struct sockaddr *) &sock->local_addr, (struct sockaddr *) &sock->remote_addr,
+                                                SOCKET_NO(si, sock));
+
+    if (nbytes >= 0)
+    {
+        TCP_STATS_ADD(tcp_data, segs_out, 1);
+        TCP_STATS_ADD(tcp_data, bytes_out, TCP_PAYLOAD_LEN(tcp_packet));
+    }
+
+    return nbytes;
+}
+
+
 /* Forward declarations */
-void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix);
+void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix, struct timespec *delivery_time);
+static void chitcpd_dispatch_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix);
 void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix);
-int chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *peer_addr);
+static bool_t chitcpd_timewait_input(serverinfo_t *si, tcp_packet_t *tcp_packet, struct sockaddr *local_addr, struct sockaddr *remote_addr);
+
+
+/* Is a due before b in the delivery queue? */
+static inline bool_t chitcpd_delivery_before(packet_delivery_list_entry_t *a, packet_delivery_list_entry_t *b)
+{
+    if(a->delivery_time.tv_sec != b->delivery_time.tv_sec)
+        return a->delivery_time.tv_sec < b->delivery_time.tv_sec;
+    if(a->delivery_time.tv_nsec != b->delivery_time.tv_nsec)
+        return a->delivery_time.tv_nsec < b->delivery_time.tv_nsec;
+    return a->seq < b->seq;
+}
+
+
+/*
+ * chitcpd_delivery_queue_push - Add a packet to the delivery queue
+ *
+ * Must be called with lock_delivery held.
+ *
+ * si: Server info
+ *
+ * delivery_entry: Packet to deliver
+ *
+ * Returns:
+ *  - CHITCP_OK: Packet added to the queue
+ *  - CHITCP_ENOMEM: Could not grow the queue
+ *
+ */
+static int chitcpd_delivery_queue_push(serverinfo_t *si, packet_delivery_list_entry_t *delivery_entry)
+{
+    packet_delivery_list_entry_t **queue;
+    size_t i;
+
+    if(si->delivery_queue_len == si->delivery_queue_size)
+    {
+        size_t size = si->delivery_queue_size ? 2 * si->delivery_queue_size : 64;
+
+        queue = realloc(si->delivery_queue, size * sizeof(packet_delivery_list_entry_t*));
+        if(queue == NULL)
+            return CHITCP_ENOMEM;
+        si->delivery_queue = queue;
+        si->delivery_queue_size = size;
+    }
+
+    queue = si->delivery_queue;
+    delivery_entry->seq = si->delivery_seq++;
+
+    /* Sift up */
+    for(i = si->delivery_queue_len++; i > 0; i = (i - 1) / 2)
+    {
+        if(!chitcpd_delivery_before(delivery_entry, queue[(i - 1) / 2]))
+            break;
+        queue[i] = queue[(i - 1) / 2];
+    }
+    queue[i] = delivery_entry;
+
+    if(si->delivery_queue_len > si->delivery_queue_max)
+        si->delivery_queue_max = si->delivery_queue_len;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_delivery_queue_pop - Remove the first packet from the delivery queue
+ *
+ * Must be called with lock_delivery held, and with a non-empty queue.
+ *
+ * si: Server info
+ *
+ * Returns: The packet with the earliest delivery time.
+ *
+ */
+static packet_delivery_list_entry_t *chitcpd_delivery_queue_pop(serverinfo_t *si)
+{
+    packet_delivery_list_entry_t **queue = si->delivery_queue;
+    packet_delivery_list_entry_t *first = queue[0];
+    packet_delivery_list_entry_t *last = queue[--si->delivery_queue_len];
+    size_t len = si->delivery_queue_len;
+    size_t i = 0;
+
+    /* Sift down */
+    for(;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if(child >= len)
+            break;
+        if(child + 1 < len && chitcpd_delivery_before(queue[child + 1], queue[child]))
+            child++;
+        if(!chitcpd_delivery_before(queue[child], last))
+            break;
+        queue[i] = queue[child];
+        i = child;
+    }
+    if(len > 0)
+        queue[i] = last;
+
+    return first;
+}
 
 
 void* chitcpd_packet_delivery_thread_func(void *args)
@@ -484,21 +1068,30 @@ void* chitcpd_packet_delivery_thread_func(void *args)
     serverinfo_t *si = pdta->si;
     free(args);
 
+    affinity_pin_all(&si->placement);
+
     pthread_mutex_lock(&si->lock_delivery);
 
-    while(! (si->state == CHITCPD_STATE_STOPPING || si->state == CHITCPD_STATE_STOPPING) )
+    while(! (si->state == CHITCPD_STATE_STOPPING || si->state == CHITCPD_STATE_STOPPED) )
     {
-        while(si->delivery_queue)
+        while(si->delivery_queue_len > 0)
         {
-            packet_delivery_list_entry_t *list_entry = si->delivery_queue;
+            packet_delivery_list_entry_t *list_entry = si->delivery_queue[0];
 
-            clock_gettime(CLOCK_REALTIME, &now);
+            chitcp_clock_now(&now);
             if(now.tv_sec > list_entry->delivery_time.tv_sec ||
                (now.tv_sec == list_entry->delivery_time.tv_sec && now.tv_nsec >= list_entry->delivery_time.tv_nsec))
             {
+                chitcpd_delivery_queue_pop(si);
+                mem_budget_uncharge(&si->mem, MEM_PACKET_COST(list_entry->tcp_packet) + sizeof(packet_delivery_list_entry_t));
+
+                /* The network thread can keep queueing packets
+                 * while this one is delivered */
+                pthread_mutex_unlock(&si->lock_delivery);
                 chitcpd_deliver_packet(si, list_entry->entry, list_entry->tcp_packet,
                                        &list_entry->local_addr, &list_entry->remote_addr, list_entry->log_prefix);
-                DL_DELETE(si->delivery_queue, list_entry);
+                free(list_entry);
+                pthread_mutex_lock(&si->lock_delivery);
             }
             else
             {
@@ -508,17 +1101,19 @@ void* chitcpd_packet_delivery_thread_func(void *args)
             }
         }
 
-        if(si->delivery_queue == NULL)
+        if(si->delivery_queue_len == 0)
         {
             pthread_cond_wait(&si->cv_delivery, &si->lock_delivery);
         }
         else
         {
-            pthread_cond_timedwait(&si->cv_delivery, &si->lock_delivery, &next);
+            chitcp_clock_timedwait(&si->cv_delivery, &si->lock_delivery, &next);
         }
 
     }
 
+    pthread_mutex_unlock(&si->lock_delivery);
+
     return NULL;
 }
 
@@ -545,6 +1140,15 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
     struct sockaddr_storage local_addr, remote_addr;
 
     /* We construct the addresses based on the underlying TCP addresses */
+    CHITCP_PROBE(recv_tcp_packet, tcp_packet, tcp_packet->length);
+
+    /* Time one in every trace_sample segments (see trace_stage_t) */
+    tcp_packet->trace_recv = 0;
+    tcp_packet->trace_delivered = 0;
+    if(si->trace_sample > 0 &&
+       atomic_fetch_add_explicit(&si->trace_seq, 1, memory_order_relaxed) % si->trace_sample == 0)
+        tcp_packet->trace_recv = tcp_now();
+
     memcpy(&local_addr, local_realaddr, sizeof(struct sockaddr_storage));
     memcpy(&remote_addr, peer_realaddr, sizeof(struct sockaddr_storage));
     chitcp_set_addr_port((struct sockaddr*) &local_addr, header->dest);
@@ -553,6 +1157,12 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
     /* Get entry of socket that will receive this packet */
     entry = chitcpd_lookup_socket(si, (struct sockaddr *) &local_addr, (struct sockaddr *) &remote_addr, FALSE);
 
+    /* A connection in TIME_WAIT no longer has a socket, but it goes
+     * before the listener that would otherwise get the packet */
+    if((entry == NULL || entry->demux_index == DEMUX_INDEX_LISTENER) &&
+       chitcpd_timewait_input(si, tcp_packet, (struct sockaddr *) &local_addr, (struct sockaddr *) &remote_addr))
+        return CHITCP_OK;
+
     if(entry == NULL)
     {
         chilog(DEBUG, "No socket listening on port %i", chitcp_ntohs(header->dest));
@@ -579,6 +1189,17 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
      * to deliver */
     withheld_tcp_packet_t *withheld_packet = NULL;
 
+    /* A withheld packet may be held indefinitely, so it is charged to
+     * the socket's memory budget until it is delivered. Without the
+     * memory for it, a duplicate is not made, and a withheld packet
+     * is dropped */
+    if ((r == DBG_RESP_WITHHOLD || r == DBG_RESP_DUPLICATE) &&
+        !chitcpd_mem_charge(si, entry, MEM_PACKET_COST(tcp_packet), TRUE))
+    {
+        chilog(DEBUG, "[S%i] Memory budget is full. Not withholding a packet.", sockfd);
+        r = (r == DBG_RESP_DUPLICATE) ? DBG_RESP_NONE : DBG_RESP_DROP;
+    }
+
     if (r == DBG_RESP_DROP)
     {
         /* If dropping the packet, we don't do anything but we log it */
@@ -598,14 +1219,13 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
 
             withheld_tcp_packet_t *wp = calloc(sizeof(withheld_tcp_packet_t), 1);
 
-            /* If we're creating a duplicate, make a deep copy */
+            /* If we're creating a duplicate, it shares the contents of the
+             * packet (each copy will be freed separately once processed) */
             if (r == DBG_RESP_DUPLICATE)
             {
                 wp->packet = calloc(sizeof(tcp_packet_t), 1);
-                wp->packet->length = tcp_packet->length;
-                wp->packet->raw = calloc(tcp_packet->length, 1);
+                chitcp_tcp_packet_share(wp->packet, tcp_packet);
                 wp->duplicate = TRUE;
-                memcpy(wp->packet->raw, tcp_packet->raw, tcp_packet->length);
             }
             /* Otherwise, if we're just withholding the packet, we just
              * need to point to it, since it won't be processed (and freed)
@@ -619,9 +1239,9 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
             memcpy(&wp->local_addr, &local_addr, sizeof(struct sockaddr_storage));
             memcpy(&wp->remote_addr, &remote_addr, sizeof(struct sockaddr_storage));
 
-            pthread_mutex_lock(&entry->lock_withheld_packets);
-            DL_APPEND(entry->withheld_packets, wp);
-            pthread_mutex_unlock(&entry->lock_withheld_packets);
+            pthread_mutex_lock(&entry->cold->lock_withheld_packets);
+            DL_APPEND(entry->cold->withheld_packets, wp);
+            pthread_mutex_unlock(&entry->cold->lock_withheld_packets);
         }
         /* If, besides receiving the current packet, we also want to deliver a withheld packet,
          * we get one from the withheld list */
@@ -629,11 +1249,13 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
         {
             /* Put a previously withheld packet in the socket's packet queue */
             chilog(TRACE, "chitcpd_recv_tcp_packet: delivering a withheld packet");
-            pthread_mutex_lock(&entry->lock_withheld_packets);
-            withheld_packet = entry->withheld_packets;
+            pthread_mutex_lock(&entry->cold->lock_withheld_packets);
+            withheld_packet = entry->cold->withheld_packets;
             if(withheld_packet)
-                DL_DELETE(entry->withheld_packets, entry->withheld_packets);
-            pthread_mutex_unlock(&entry->lock_withheld_packets);
+                DL_DELETE(entry->cold->withheld_packets, entry->cold->withheld_packets);
+            pthread_mutex_unlock(&entry->cold->lock_withheld_packets);
+            if(withheld_packet)
+                chitcpd_mem_uncharge(si, entry, MEM_PACKET_COST(withheld_packet->packet));
         }
 
         /* If DBG_RESP_NONE, none of the previous conditions were triggered, so we deliver the
@@ -644,15 +1266,7 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
          */
         if (r == DBG_RESP_NONE || r == DBG_RESP_DRAW_WITHHELD || r == DBG_RESP_DUPLICATE)
         {
-            if(si->latency > 0.0)
-            {
-                chitcpd_queue_packet_delivery(si, entry, tcp_packet, &local_addr, &remote_addr, MINLOG_RCVD);
-            }
-            else
-            {
-                /* No need to put the packet in the delivery queue; just deliver the packet */
-                chitcpd_deliver_packet(si, entry, tcp_packet, &local_addr, &remote_addr, MINLOG_RCVD);
-            }
+            chitcpd_dispatch_packet(si, entry, tcp_packet, &local_addr, &remote_addr, MINLOG_RCVD);
 
 
             /* If there is an additional packet, we actually need to look up its socket
@@ -665,18 +1279,9 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
                 /* Get entry of socket that will receive this packet */
                 chisocketentry_t *withheld_entry = chitcpd_lookup_socket(si, (struct sockaddr *) &withheld_packet->local_addr, (struct sockaddr *) &withheld_packet->remote_addr, FALSE);
 
-                if(si->latency > 0.0)
-                {
-                    chitcpd_queue_packet_delivery(si, withheld_entry, withheld_packet->packet,
-                                                  &withheld_entry->local_addr, &withheld_entry->remote_addr,
-                                                  withheld_packet->duplicate? MINLOG_RCVD_DUPLD : MINLOG_RCVD_DELAYED);
-                }
-                else
-                {
-                    chitcpd_deliver_packet(si, withheld_entry, withheld_packet->packet,
-                                           &withheld_entry->local_addr, &withheld_entry->remote_addr,
-                                           withheld_packet->duplicate? MINLOG_RCVD_DUPLD : MINLOG_RCVD_DELAYED);
-                }
+                chitcpd_dispatch_packet(si, withheld_entry, withheld_packet->packet,
+                                        &withheld_entry->local_addr, &withheld_entry->remote_addr,
+                                        withheld_packet->duplicate? MINLOG_RCVD_DUPLD : MINLOG_RCVD_DELAYED);
 
                 free(withheld_packet);
             }
@@ -690,90 +1295,886 @@ int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct s
 #define SECOND (1000000000L)
 #define SECOND_F (1000000000.0)
 
-void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix)
+void chitcpd_queue_packet_delivery(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix, struct timespec *delivery_time)
 {
-    packet_delivery_list_entry_t *delivery_entry = malloc(sizeof(packet_delivery_list_entry_t));
+    size_t cost = MEM_PACKET_COST(tcp_packet) + sizeof(packet_delivery_list_entry_t);
+    packet_delivery_list_entry_t *delivery_entry;
+
+    if(!mem_budget_charge(&si->mem, cost, TCP_PAYLOAD_LEN(tcp_packet) > 0))
+    {
+        chilog(DEBUG, "Memory budget is full. Dropping a packet before it is delayed.");
+        chitcp_tcp_packet_free(tcp_packet);
+        free(tcp_packet);
+        return;
+    }
+
+    delivery_entry = malloc(sizeof(packet_delivery_list_entry_t));
 
     delivery_entry->entry = entry;
     delivery_entry->tcp_packet = tcp_packet;
     delivery_entry->log_prefix = log_prefix;
+    delivery_entry->delivery_time = *delivery_time;
     memcpy(&delivery_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
     memcpy(&delivery_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
 
-    clock_gettime(CLOCK_REALTIME, &delivery_entry->delivery_time);
-
-    long latency_ns = (long) (si->latency * SECOND_F);
-
-    delivery_entry->delivery_time.tv_sec += latency_ns / SECOND;
-    delivery_entry->delivery_time.tv_nsec += latency_ns % SECOND;
-    if (delivery_entry->delivery_time.tv_nsec >= SECOND)
+    pthread_mutex_lock(&si->lock_delivery);
+    if(chitcpd_delivery_queue_push(si, delivery_entry) != CHITCP_OK)
     {
-        delivery_entry->delivery_time.tv_nsec -= SECOND;
-        delivery_entry->delivery_time.tv_sec += 1;
+        pthread_mutex_unlock(&si->lock_delivery);
+        chilog(ERROR, "Could not queue packet for delivery. Dropping it.");
+        mem_budget_uncharge(&si->mem, cost);
+        chitcp_tcp_packet_free(tcp_packet);
+        free(tcp_packet);
+        free(delivery_entry);
+        return;
     }
-
-    pthread_mutex_lock(&si->lock_delivery);
-    DL_APPEND(si->delivery_queue, delivery_entry);
     pthread_cond_signal(&si->cv_delivery);
     pthread_mutex_unlock(&si->lock_delivery);
 }
 
-void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix)
-{
-    chilog_tcp_minimal((struct sockaddr *) remote_addr,
-                       (struct sockaddr *) local_addr,
-                       SOCKET_NO(si, entry),
-                       tcp_packet,
-                       log_prefix);
 
-    chitcpd_pcap_packet(si, tcp_packet, remote_addr, local_addr);
+/*
+ * chitcpd_dispatch_packet - Deliver a packet, emulating the link it came through
+ *
+ * If the peer has a link profile (or there is a fixed latency), the
+ * packet may be lost and, if not, it is queued for delivery (even
+ * if it isn't delayed, so packets from the same peer are always
+ * delivered by the same thread, in delivery time order). Otherwise,
+ * it is delivered right away.
+ *
+ * si: Server info
+ *
+ * entry: Socket that will receive the packet
+ *
+ * tcp_packet: Packet
+ *
+ * local_addr, remote_addr: Addresses of the packet
+ *
+ * log_prefix: Prefix for the minimal log
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_dispatch_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix)
+{
+    netem_profile_t *profile = netem_lookup_profile(si->netem_profiles, (struct sockaddr *) remote_addr);
+    struct timespec now, delivery_time;
 
-    /* We need to treat this differently depending on whether the socket is active or passive */
-    if(entry->actpas_type == SOCKET_ACTIVE)
+    if(profile == NULL && si->latency <= 0.0)
     {
-        active_chisocket_state_t *socket_state = &entry->socket_state.active;
-
-        /* Put the packet in the socket's packet queue */
-        pthread_mutex_lock(&socket_state->tcp_data.lock_pending_packets);
-        chitcp_packet_list_append(&socket_state->tcp_data.pending_packets, tcp_packet);
-        pthread_mutex_unlock(&socket_state->tcp_data.lock_pending_packets);
-
-        /* Notify the socket that there is a pending packet (or packets) */
-        pthread_mutex_lock(&entry->socket_state.active.lock_event);
-        entry->socket_state.active.flags.net_recv = 1;
-        pthread_cond_broadcast(&entry->socket_state.active.cv_event);
-        pthread_mutex_unlock(&entry->socket_state.active.lock_event);
+        /* No need to put the packet in the delivery queue; just deliver the packet */
+        chitcpd_deliver_packet(si, entry, tcp_packet, local_addr, remote_addr, log_prefix);
+        return;
     }
-    else if (entry->actpas_type == SOCKET_PASSIVE)
-    {
-        /* If the socket is passive, this means the packet is probably
-         * a SYN packet that is initiating a three-way handshake.
-         * However, it is not our responsibility to check this. We
-         * simply enqueue the packet as a "pending connection"
-         * in the passive socket; if it is a SYN packet, it will spawn
-         * an active socket next time the application layer calls
-         * chisocket_accept()
-         */
-        tcphdr_t *header = (tcphdr_t*) tcp_packet->raw;
 
-        chilog(DEBUG, "Received packet for passive socket %i (port %i)", SOCKET_NO(si, entry), chitcp_ntohs(header->dest));
+    chitcp_clock_now(&now);
 
-        passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
-        chilog(DEBUG, "Enqueueing packet as pending connection in passive socket");
+    if(profile != NULL)
+    {
+        bool_t lost;
 
-        /* Create pending connection */
-        pending_connection_t *pending_connection = calloc(1, sizeof(pending_connection_t));
-        pending_connection->initial_packet = tcp_packet;
-        memcpy(&pending_connection->local_addr, local_addr, sizeof(struct sockaddr_storage));
-        memcpy(&pending_connection->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
+        /* Profiles have state (the rate limiter, the loss model, the random
+         * number generator), and the packets from a peer may be received
+         * by several network I/O threads */
+        pthread_mutex_lock(&si->lock_delivery);
+        lost = !netem_schedule(profile, tcp_packet->length, &now, &delivery_time);
+        pthread_mutex_unlock(&si->lock_delivery);
 
-        /* Add to queue */
-        pthread_mutex_lock(&socket_state->lock_pending_connections);
-        DL_APPEND(socket_state->pending_connections, pending_connection);
-        pthread_cond_broadcast(&socket_state->cv_pending_connections);
-        pthread_mutex_unlock(&socket_state->lock_pending_connections);
+        if(lost)
+        {
+            chilog_tcp_minimal((struct sockaddr *) remote_addr, (struct sockaddr *) local_addr,
+                               SOCKET_NO(si, entry), tcp_packet, MINLOG_RCVD_DROP);
+            chitcp_tcp_packet_free(tcp_packet);
+            free(tcp_packet);
+            return;
+        }
     }
-}
+    else
+    {
+        long latency_ns = (long) (si->latency * SECOND_F);
+
+        delivery_time.tv_sec = now.tv_sec + latency_ns / SECOND;
+        delivery_time.tv_nsec = now.tv_nsec + latency_ns % SECOND;
+        if (delivery_time.tv_nsec >= SECOND)
+        {
+            delivery_time.tv_nsec -= SECOND;
+            delivery_time.tv_sec += 1;
+        }
+    }
+
+    chitcpd_queue_packet_delivery(si, entry, tcp_packet, local_addr, remote_addr, log_prefix, &delivery_time);
+}
+
+
+/*
+ * chitcpd_deliver_active - Deliver a packet to an active socket
+ *
+ * Adds the packet to the socket's pending packets, and notifies the
+ * socket's TCP thread. It takes no locks, so any number of threads can
+ * deliver packets to the same socket at once.
+ *
+ * si: Server info
+ *
+ * entry: Active socket
+ *
+ * tcp_packet: Packet to deliver
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_deliver_active(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    size_t cost;
+
+    TCP_STATS_ADD(&socket_state->tcp_data, segs_in, 1);
+    TCP_STATS_ADD(&socket_state->tcp_data, bytes_in, TCP_PAYLOAD_LEN(tcp_packet));
+
+    /* Put the packet in the socket's packet queue, unless the memory
+     * budgets are full (and the sender will have to retransmit it).
+     * The cost is added before the packet is queued, so the TCP thread
+     * never returns less than the cost of the packets it takes */
+    cost = MEM_PACKET_COST(tcp_packet);
+    if (!chitcpd_mem_charge(si, entry, cost, TCP_PAYLOAD_LEN(tcp_packet) > 0))
+    {
+        chilog(DEBUG, "[S%i] Memory budget is full. Dropping a packet.", SOCKET_NO(si, entry));
+        chitcp_tcp_packet_free(tcp_packet);
+        free(tcp_packet);
+        return;
+    }
+    atomic_fetch_add(&socket_state->tcp_data.pending_mem, cost);
+    chitcp_packet_queue_push(&socket_state->tcp_data.pending_packets, tcp_packet);
+
+    /* Notify the socket that there is a pending packet (or packets) */
+    chitcpd_tcp_raise_event(si, entry, TCP_EVENT_NET_RECV);
+}
+
+
+/*
+ * chitcpd_syncookie_count - Current SYN cookie counter
+ *
+ * The counter is incremented every SYNCOOKIE_PERIOD seconds, and only
+ * its lower SYNCOOKIE_COUNT_BITS bits are encoded in a cookie.
+ *
+ * Returns: Counter
+ *
+ */
+static uint32_t chitcpd_syncookie_count()
+{
+    struct timespec now;
+
+    chitcp_clock_now(&now);
+
+    return (uint32_t) (now.tv_sec / SYNCOOKIE_PERIOD);
+}
+
+
+/*
+ * chitcpd_syncookie - Compute a SYN cookie
+ *
+ * A SYN cookie is the ISS of a SYN/ACK that is sent without creating
+ * a socket. The top SYNCOOKIE_COUNT_BITS bits of the cookie are the
+ * counter, and the rest are a hash (FNV-1a) of the connection's addresses,
+ * the peer's ISS, the counter, and the server's secret, so the cookie
+ * can be checked using only the peer's ACK.
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Connection's addresses
+ *
+ * irs: Peer's initial sequence number
+ *
+ * count: SYN cookie counter
+ *
+ * Returns: Cookie
+ *
+ */
+static uint32_t chitcpd_syncookie(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, uint32_t irs, uint32_t count)
+{
+    chisocket_demux_key_t key;
+    uint32_t words[3] = {si->syncookie_secret, irs, count};
+    uint32_t hash = 2166136261u;
+    uint8_t *bytes;
+
+    chitcpd_demux_key_init(&key, local_addr, remote_addr);
+
+    bytes = (uint8_t *) words;
+    for(size_t i = 0; i < sizeof(words); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    bytes = (uint8_t *) &key;
+    for(size_t i = 0; i < sizeof(key); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return (count << (32 - SYNCOOKIE_COUNT_BITS)) | (hash & (UINT32_MAX >> SYNCOOKIE_COUNT_BITS));
+}
+
+
+/*
+ * chitcpd_syncookie_check - Check whether an ACK acknowledges a SYN cookie
+ *
+ * A cookie is valid if it was computed with the current counter
+ * or the previous one (i.e., it is at most 2*SYNCOOKIE_PERIOD seconds old)
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Connection's addresses
+ *
+ * tcp_packet: Packet to check
+ *
+ * Returns: TRUE if the packet acknowledges a valid cookie, FALSE otherwise.
+ *
+ */
+static bool_t chitcpd_syncookie_check(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, tcp_packet_t *tcp_packet)
+{
+    uint32_t cookie = SEG_ACK(tcp_packet) - 1;
+    uint32_t irs = SEG_SEQ(tcp_packet) - 1;
+    uint32_t count = chitcpd_syncookie_count();
+    uint32_t mask = UINT32_MAX >> (32 - SYNCOOKIE_COUNT_BITS);
+
+    for(uint32_t age = 0; age < 2; age++)
+    {
+        uint32_t c = (count - age) & mask;
+
+        if((cookie >> (32 - SYNCOOKIE_COUNT_BITS)) == c &&
+           chitcpd_syncookie(si, local_addr, remote_addr, irs, c) == cookie)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * chitcpd_syncookie_send - Answer a SYN with a SYN cookie
+ *
+ * The SYN/ACK is built and sent directly on the real connection,
+ * since there is no socket for it. It doesn't carry any options.
+ *
+ * si: Server info
+ *
+ * entry: Passive socket
+ *
+ * tcp_packet: SYN packet
+ *
+ * local_addr, remote_addr: Connection's addresses
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_syncookie_send(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t *tcp_packet, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    uint32_t count = chitcpd_syncookie_count() & (UINT32_MAX >> (32 - SYNCOOKIE_COUNT_BITS));
+    tcpconnentry_t *connection = chitcpd_get_connection(si, local_addr, remote_addr);
+    tcp_packet_t synack;
+    tcphdr_t *header;
+
+    if(connection == NULL)
+    {
+        chilog(ERROR, "[S%i] No connection to send a SYN cookie on", SOCKET_NO(si, entry));
+        return;
+    }
+
+    chitcp_tcp_packet_create(&synack, NULL, 0);
+    header = TCP_PACKET_HEADER(&synack);
+
+    header->source = chitcp_get_addr_port(local_addr);
+    header->dest = chitcp_get_addr_port(remote_addr);
+    header->seq = chitcp_htonl(chitcpd_syncookie(si, local_addr, remote_addr, SEG_SEQ(tcp_packet), count));
+    header->ack_seq = chitcp_htonl(SEG_SEQ(tcp_packet) + 1);
+    header->syn = 1;
+    header->ack = 1;
+    header->win = chitcp_htons(MIN(entry->rcvbuf_size, TCP_MAX_WND));
+
+    chitcpd_connection_send_packet(si, connection, &synack, NULL, local_addr, remote_addr, SOCKET_NO(si, entry));
+
+    chitcp_tcp_packet_free(&synack);
+}
+
+
+/*
+ * chitcpd_listen_spawn - Spawn an active socket for a new connection
+ *
+ * Creates an active socket that inherits the passive socket's settings,
+ * indexes it with the connection's addresses (so the rest of the
+ * connection's packets are delivered to it, and not to the passive
+ * socket), and adds it to the passive socket's SYN queue. The
+ * DBG_EVT_PENDING_CONNECTION breakpoint is hit before the socket's TCP
+ * thread is started, so a debug monitor can follow the whole handshake.
+ *
+ * The caller must have checked that there is room in the passive
+ * socket's queues, and is responsible for starting the TCP thread.
+ *
+ * si: Server info
+ *
+ * entry: Passive socket
+ *
+ * local_addr, remote_addr: Connection's addresses
+ *
+ * Returns: The new active socket, or NULL if it could not be allocated.
+ *
+ */
+static chisocketentry_t *chitcpd_listen_spawn(serverinfo_t *si, chisocketentry_t *entry, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr)
+{
+    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+    int sockfd = SOCKET_NO(si, entry);
+    int socket_index;
+
+    /* Allocate a socket. This will be an active socket */
+    if(chitcpd_allocate_socket(si, &socket_index) != CHITCP_OK)
+    {
+        chilog(WARNING, "[S%i] Could not allocate a socket for a new connection", sockfd);
+        return NULL;
+    }
+
+    chilog(MINIMAL, "[S%i] Passive socket has spawned active socket S%i", sockfd, socket_index);
+
+    /* Initialize the socket entry */
+    chisocketentry_t *active_entry = CHISOCKET_ENTRY(si, socket_index);
+    active_chisocket_state_t *active_socket_state = &active_entry->socket_state.active;
+
+    /* The socket belongs to the listener's handler until it is accepted */
+    active_entry->cold->creator = entry->cold->creator;
+    active_entry->domain = entry->domain;
+    active_entry->type = entry->type;
+    active_entry->protocol = entry->protocol;
+
+    /* As in BSD, accepted sockets are non-blocking if the listener is */
+    active_entry->nonblocking = entry->nonblocking;
+
+    /* Accepted sockets inherit the listener's buffer settings */
+    active_entry->sndbuf_size = entry->sndbuf_size;
+    active_entry->rcvbuf_size = entry->rcvbuf_size;
+    active_entry->buf_autotune = entry->buf_autotune;
+    active_entry->rcvlowat = entry->rcvlowat;
+    active_entry->nodelay = entry->nodelay;
+    active_entry->quickack = entry->quickack;
+    active_entry->cc_algorithm = entry->cc_algorithm;
+    active_entry->fastopen = entry->fastopen;
+    active_entry->pacing_rate = entry->pacing_rate;
+    active_entry->priority = entry->priority;
+
+    active_entry->actpas_type = SOCKET_ACTIVE;
+    active_socket_state->parent_socket = entry;
+    active_socket_state->listen_queue = LISTEN_QUEUE_NONE;
+
+    tcp_data_init(si, active_entry);
+    tx_flow_init(&active_socket_state->tx_flow);
+
+    atomic_init(&active_socket_state->events, TCP_EVENT_SLEEPING);
+    pthread_mutex_init(&active_socket_state->lock_event, NULL);
+    pthread_cond_init(&active_socket_state->cv_event, NULL);
+
+    active_socket_state->realtcpconn = chitcpd_get_connection(si, (struct sockaddr *) local_addr, (struct sockaddr *) remote_addr);
+
+    memcpy(&active_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
+    memcpy(&active_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
+
+    /* From now on, packets with this 4-tuple are delivered to the
+     * active socket, not to the passive socket */
+    chitcpd_index_socket(si, active_entry);
+
+    pthread_mutex_lock(&si->lock_listen);
+    DL_APPEND2(socket_state->syn_queue, active_entry, socket_state.active.lq_prev, socket_state.active.lq_next);
+    socket_state->syn_qlen++;
+    active_socket_state->listen_queue = LISTEN_QUEUE_SYN;
+    pthread_mutex_unlock(&si->lock_listen);
+
+    enum chitcpd_debug_response r =
+        chitcpd_debug_breakpoint(si, sockfd, DBG_EVT_PENDING_CONNECTION, socket_index);
+
+    if (r != DBG_RESP_NONE)
+    {
+        chilog(ERROR, "Unexpected return value in DBG_EVT_PENDING_CONNECTION breakpoint.");
+    }
+
+    /* Linking of the debug monitor to the new socket
+     * (if r == DBG_RESP_ACCEPT_MONITOR) is actually performed _within_
+     * chitcpd_debug_breakpoint, in order to avoid a race condition. */
+
+    return active_entry;
+}
+
+
+/*
+ * chitcpd_listen_establish - Establish a connection from a SYN cookie
+ *
+ * The three-way handshake was completed without a socket, so the
+ * connection's state is reconstructed from the peer's ACK. The options
+ * in the peer's SYN were never seen, so window scaling, timestamps and
+ * SACK are disabled.
+ *
+ * si: Server info
+ *
+ * active_entry: Socket spawned for the connection
+ *
+ * tcp_packet: ACK of the SYN cookie
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_listen_establish(serverinfo_t *si, chisocketentry_t *active_entry, tcp_packet_t *tcp_packet)
+{
+    tcp_data_t *tcp_data = &active_entry->socket_state.active.tcp_data;
+
+    active_entry->tcp_state = SYN_RCVD;
+
+    /* Start TCP thread */
+    chitcpd_tcp_start_thread(si, active_entry);
+
+    tcp_data->RCV_WND_SHIFT = 0;
+    tcp_data->SND_WND_SHIFT = 0;
+    tcp_data->wscale_rcvd = FALSE;
+    tcp_data->ts_enabled = FALSE;
+    tcp_data->sack_enabled = FALSE;
+
+    tcp_data->IRS = SEG_SEQ(tcp_packet) - 1;
+    tcp_data->RCV_NXT = SEG_SEQ(tcp_packet);
+    circular_buffer_set_seq_initial(&tcp_data->recv, tcp_data->RCV_NXT);
+    tcp_data->RCV_WND = circular_buffer_available(&tcp_data->recv);
+
+    tcp_data->ISS = SEG_ACK(tcp_packet) - 1;
+    tcp_data->SND_UNA = SEG_ACK(tcp_packet);
+    tcp_data->SND_NXT = SEG_ACK(tcp_packet);
+    circular_buffer_set_seq_initial(&tcp_data->send, tcp_data->SND_NXT);
+    tcp_data->SND_WND = SEG_WND(tcp_packet);
+
+    chitcpd_update_tcp_state(si, active_entry, ESTABLISHED);
+
+    /* The ACK may also carry data (or a FIN) */
+    if(TCP_PAYLOAD_LEN(tcp_packet) > 0 || TCP_PACKET_HEADER(tcp_packet)->fin)
+        chitcpd_deliver_active(si, active_entry, tcp_packet);
+    else
+    {
+        chitcp_tcp_packet_free(tcp_packet);
+        free(tcp_packet);
+    }
+}
+
+
+/*
+ * chitcpd_deliver_passive - Deliver a packet to a passive socket
+ *
+ * A SYN spawns an active socket, which is added to the passive socket's
+ * SYN queue and does the rest of the three-way handshake on its own
+ * (see chitcpd_listen_update). If the SYN and accept queues are full,
+ * the SYN is dropped or, if SYN cookies are enabled, answered with a
+ * SYN cookie. An ACK of a valid SYN cookie spawns an ESTABLISHED
+ * socket. Any other packet is dropped.
+ *
+ * si: Server info
+ *
+ * entry: Passive socket
+ *
+ * tcp_packet: Packet to deliver
+ *
+ * local_addr, remote_addr: Connection's addresses
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_deliver_passive(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr)
+{
+    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+    tcphdr_t *header = TCP_PACKET_HEADER(tcp_packet);
+    int sockfd = SOCKET_NO(si, entry);
+    chisocketentry_t *active_entry;
+    bool_t full;
+
+    chilog(DEBUG, "Received packet for passive socket %i (port %i)", sockfd, chitcp_ntohs(header->dest));
+
+    /* The packet may have been looked up before the previous SYN of the
+     * same connection spawned a socket (e.g., if it was delayed). It
+     * belongs to that socket, and is most likely a retransmitted SYN. */
+    active_entry = chitcpd_lookup_socket(si, (struct sockaddr *) local_addr, (struct sockaddr *) remote_addr, TRUE);
+    if(active_entry != NULL && active_entry->actpas_type == SOCKET_ACTIVE)
+    {
+        chitcpd_deliver_active(si, active_entry, tcp_packet);
+        return;
+    }
+
+    pthread_mutex_lock(&si->lock_listen);
+    full = socket_state->syn_qlen + socket_state->accept_qlen >= MIN(MAX(socket_state->backlog, 1), SOMAXCONN);
+    pthread_mutex_unlock(&si->lock_listen);
+
+    /* Under memory pressure, new connections are turned away as if the
+     * queues were full (the connections that are already open need the
+     * memory to drain) */
+    full = full || mem_budget_pressure(&si->mem);
+
+    if(header->syn && !header->ack)
+    {
+        if(!full)
+        {
+            active_entry = chitcpd_listen_spawn(si, entry, local_addr, remote_addr);
+
+            if(active_entry != NULL)
+            {
+                /* Strictly speaking, the socket should transition to SYN_RCVD
+                 * because we've received a SYN packet. However, this transition
+                 * is handled in the TCP thread, not here. So, we initialize
+                 * the state of the socket to LISTEN (even though only the passive
+                 * socket should have that state), so that the transition will
+                 * correctly happen in the TCP thread. */
+                active_entry->tcp_state = LISTEN;
+
+                /* Start TCP thread */
+                chitcpd_tcp_start_thread(si, active_entry);
+
+                /* Assuming it's a SYN packet, this will initiate the three-way
+                 * handshake with the peer */
+                chitcpd_deliver_active(si, active_entry, tcp_packet);
+                return;
+            }
+        }
+        else if(si->tcp_syncookies)
+        {
+            chilog(DEBUG, "[S%i] SYN and accept queues are full. Sending SYN cookie.", sockfd);
+            chitcpd_syncookie_send(si, entry, tcp_packet, (struct sockaddr *) local_addr, (struct sockaddr *) remote_addr);
+        }
+        else
+            chilog(DEBUG, "[S%i] SYN and accept queues are full. Dropping SYN.", sockfd);
+    }
+    else if(header->ack && !header->syn && !header->rst && si->tcp_syncookies && !full &&
+            chitcpd_syncookie_check(si, (struct sockaddr *) local_addr, (struct sockaddr *) remote_addr, tcp_packet))
+    {
+        chilog(DEBUG, "[S%i] Received ACK of a valid SYN cookie.", sockfd);
+        active_entry = chitcpd_listen_spawn(si, entry, local_addr, remote_addr);
+
+        if(active_entry != NULL)
+        {
+            chitcpd_listen_establish(si, active_entry, tcp_packet);
+            return;
+        }
+    }
+    else
+        chilog(DEBUG, "[S%i] Dropping packet that does not start a connection.", sockfd);
+
+    chitcp_tcp_packet_free(tcp_packet);
+    free(tcp_packet);
+}
+
+
+void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr, char* log_prefix)
+{
+    CHITCP_PROBE(deliver_packet, SOCKET_NO(si, entry), tcp_packet, tcp_packet->length);
+
+    if(tcp_packet->trace_recv != 0)
+    {
+        tcp_packet->trace_delivered = tcp_now();
+        chitcpd_trace_stage(si, TRACE_STAGE_DELIVERY, tcp_packet->trace_recv, tcp_packet->trace_delivered);
+    }
+
+    chilog_tcp_minimal((struct sockaddr *) remote_addr,
+                       (struct sockaddr *) local_addr,
+                       SOCKET_NO(si, entry),
+                       tcp_packet,
+                       log_prefix);
+
+    chitcpd_pcap_packet(si, tcp_packet, (struct sockaddr *) remote_addr, (struct sockaddr *) local_addr,
+                        SOCKET_NO(si, entry), PCAP_INBOUND);
+
+    /* We need to treat this differently depending on whether the socket is active or passive */
+    if(entry->actpas_type == SOCKET_ACTIVE)
+        chitcpd_deliver_active(si, entry, tcp_packet);
+    else if (entry->actpas_type == SOCKET_PASSIVE)
+        chitcpd_deliver_passive(si, entry, tcp_packet, local_addr, remote_addr);
+}
+
+
+/* See connection.h */
+void chitcpd_listen_update(serverinfo_t *si, chisocketentry_t *entry, tcp_state_t newstate)
+{
+    active_chisocket_state_t *active_socket_state = &entry->socket_state.active;
+    chisocketentry_t *parent = NULL;
+
+    /* A socket that accepted the data in its peer's SYN (see
+     * chitcpd_tcp_process_syn) can be accepted right away */
+    if(newstate != ESTABLISHED && newstate != CLOSED &&
+       !(newstate == SYN_RCVD && active_socket_state->tcp_data.tfo_accepted))
+        return;
+
+    pthread_mutex_lock(&si->lock_listen);
+    if(active_socket_state->listen_queue != LISTEN_QUEUE_NONE)
+    {
+        passive_chisocket_state_t *socket_state = &active_socket_state->parent_socket->socket_state.passive;
+
+        if(active_socket_state->listen_queue == LISTEN_QUEUE_SYN)
+        {
+            DL_DELETE2(socket_state->syn_queue, entry, socket_state.active.lq_prev, socket_state.active.lq_next);
+            socket_state->syn_qlen--;
+            active_socket_state->listen_queue = LISTEN_QUEUE_NONE;
+
+            if(newstate != CLOSED)
+            {
+                DL_APPEND2(socket_state->accept_queue, entry, socket_state.active.lq_prev, socket_state.active.lq_next);
+                socket_state->accept_qlen++;
+                active_socket_state->listen_queue = LISTEN_QUEUE_ACCEPT;
+                pthread_cond_signal(&socket_state->cv_accept);
+                parent = active_socket_state->parent_socket;
+            }
+        }
+        else if(newstate == CLOSED)
+        {
+            DL_DELETE2(socket_state->accept_queue, entry, socket_state.active.lq_prev, socket_state.active.lq_next);
+            socket_state->accept_qlen--;
+            active_socket_state->listen_queue = LISTEN_QUEUE_NONE;
+        }
+    }
+    pthread_mutex_unlock(&si->lock_listen);
+
+    if(parent != NULL)
+        chitcpd_poll_notify(si, parent);
+}
+
+
+/* See connection.h */
+void chitcpd_listen_close(serverinfo_t *si, chisocketentry_t *entry)
+{
+    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+    chisocketentry_t *orphans = NULL, *elt, *tmp;
+
+    pthread_mutex_lock(&si->lock_listen);
+    DL_CONCAT2(orphans, socket_state->syn_queue, socket_state.active.lq_prev, socket_state.active.lq_next);
+    DL_CONCAT2(orphans, socket_state->accept_queue, socket_state.active.lq_prev, socket_state.active.lq_next);
+    DL_FOREACH2(orphans, elt, socket_state.active.lq_next)
+    {
+        elt->socket_state.active.listen_queue = LISTEN_QUEUE_NONE;
+        elt->socket_state.active.parent_socket = NULL;
+    }
+    socket_state->syn_queue = NULL;
+    socket_state->accept_queue = NULL;
+    socket_state->syn_qlen = 0;
+    socket_state->accept_qlen = 0;
+    pthread_mutex_unlock(&si->lock_listen);
+
+    /* Connections that were never accepted are aborted */
+    DL_FOREACH_SAFE2(orphans, elt, tmp, socket_state.active.lq_next)
+    {
+        chilog(DEBUG, "[S%i] Aborting connection that was never accepted (S%i)", SOCKET_NO(si, entry), SOCKET_NO(si, elt));
+        chitcpd_update_tcp_state(si, elt, CLOSED);
+        chitcpd_tcp_join_thread(si, elt);
+    }
+}
+
+
+/**************************/
+/**** TIME_WAIT state  ****/
+/**************************/
+
+
+/*
+ * chitcpd_timewait_remove - Remove an entry from the TIME_WAIT index
+ *
+ * Must be called with lock_timewait held.
+ *
+ * si: Server info
+ *
+ * tw: TIME_WAIT entry (it is freed)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_timewait_remove(serverinfo_t *si, timewait_entry_t *tw)
+{
+    HASH_DEL(si->timewait_index, tw);
+    DL_DELETE(si->timewait_list, tw);
+    atomic_fetch_sub(&si->timewait_count, 1);
+    free(tw);
+}
+
+
+/*
+ * chitcpd_timewait_expire - Remove the TIME_WAIT entries that have expired
+ *
+ * This is the callback of the TIME_WAIT timer, which is then set again
+ * for the next entry to expire (if any).
+ *
+ * mt: TIME_WAIT timer's multitimer
+ *
+ * timer: TIME_WAIT timer
+ *
+ * args: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_timewait_expire(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    serverinfo_t *si = (serverinfo_t *) args;
+    uint64_t now = tcp_now();
+    timewait_entry_t *tw;
+
+    pthread_mutex_lock(&si->lock_timewait);
+    while((tw = si->timewait_list) != NULL && tw->expiry <= now)
+        chitcpd_timewait_remove(si, tw);
+
+    if(tw != NULL)
+        mt_set_timer(mt, 0, tw->expiry - now, chitcpd_timewait_expire, si);
+    pthread_mutex_unlock(&si->lock_timewait);
+}
+
+
+/* See connection.h */
+void chitcpd_timewait_enter(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    timewait_entry_t *tw, *old;
+
+    tw = calloc(1, sizeof(timewait_entry_t));
+    if(tw == NULL)
+    {
+        chilog(WARNING, "[S%i] Could not allocate a TIME_WAIT entry", SOCKET_NO(si, entry));
+        return;
+    }
+
+    chitcpd_demux_key_init(&tw->key, (struct sockaddr *) &entry->local_addr, (struct sockaddr *) &entry->remote_addr);
+    tw->SND_NXT = tcp_data->SND_NXT;
+    tw->RCV_NXT = tcp_data->RCV_NXT;
+    tw->win = TCP_ADVERTISED_WND(tcp_data, FALSE);
+    tw->ts_enabled = tcp_data->ts_enabled;
+    tw->TS_RECENT = tcp_data->TS_RECENT;
+    tw->expiry = tcp_now() + 2 * TCP_MSL;
+
+    pthread_mutex_lock(&si->lock_timewait);
+
+    /* The 4-tuple may have been reused while it was still in TIME_WAIT */
+    HASH_FIND(hh, si->timewait_index, &tw->key, sizeof(chisocket_demux_key_t), old);
+    if(old != NULL)
+        chitcpd_timewait_remove(si, old);
+
+    /* Every entry lasts the same time, so the list stays ordered by
+     * expiry as long as new entries are appended. If the list was empty,
+     * the timer may still be set for an entry that was removed early */
+    if(si->timewait_list == NULL)
+    {
+        mt_cancel_timer(&si->timewait_timer, 0);
+        mt_set_timer(&si->timewait_timer, 0, 2 * TCP_MSL, chitcpd_timewait_expire, si);
+    }
+    HASH_ADD(hh, si->timewait_index, key, sizeof(chisocket_demux_key_t), tw);
+    DL_APPEND(si->timewait_list, tw);
+    atomic_fetch_add(&si->timewait_count, 1);
+
+    pthread_mutex_unlock(&si->lock_timewait);
+
+    chilog(DEBUG, "[S%i] Connection is in TIME_WAIT for %lu seconds", SOCKET_NO(si, entry), 2 * TCP_MSL / SECOND);
+}
+
+
+/*
+ * chitcpd_timewait_input - Handle a packet for a connection in TIME_WAIT
+ *
+ * Retransmissions of the peer's FIN (and any other segment with something
+ * to acknowledge) are acknowledged, and a FIN restarts the 2*MSL timeout.
+ * RSTs are ignored (RFC 1337). A SYN with a sequence number beyond the old
+ * connection's can start a new connection (RFC 1122, section 4.2.2.13),
+ * so the entry is removed and the SYN goes to the listener.
+ *
+ * si: Server info
+ *
+ * tcp_packet: Received packet
+ *
+ * local_addr, remote_addr: Packet's addresses
+ *
+ * Returns: TRUE if the packet belonged to a connection in TIME_WAIT
+ *          (and it has been freed), FALSE otherwise.
+ *
+ */
+static bool_t chitcpd_timewait_input(serverinfo_t *si, tcp_packet_t *tcp_packet, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(tcp_packet);
+    chisocket_demux_key_t key;
+    timewait_entry_t *tw;
+    tcpconnentry_t *connection;
+    timewait_entry_t reply;
+    tcp_packet_t ack;
+    bool_t send_ack;
+
+    if(atomic_load(&si->timewait_count) == 0)
+        return FALSE;
+
+    chitcpd_demux_key_init(&key, local_addr, remote_addr);
+
+    pthread_mutex_lock(&si->lock_timewait);
+    HASH_FIND(hh, si->timewait_index, &key, sizeof(chisocket_demux_key_t), tw);
+
+    /* The socket may have had a wildcard local address (see chitcpd_lookup_socket) */
+    if(tw == NULL && !chitcp_addr_is_any(local_addr))
+    {
+        memset(key.local_addr, 0, sizeof(key.local_addr));
+        HASH_FIND(hh, si->timewait_index, &key, sizeof(chisocket_demux_key_t), tw);
+    }
+
+    if(tw == NULL)
+    {
+        pthread_mutex_unlock(&si->lock_timewait);
+        return FALSE;
+    }
+
+    if(header->syn && !header->ack && !header->rst && SEQ_GT(SEG_SEQ(tcp_packet), tw->RCV_NXT))
+    {
+        chilog(DEBUG, "SYN for a connection in TIME_WAIT. Starting a new connection.");
+        chitcpd_timewait_remove(si, tw);
+        pthread_mutex_unlock(&si->lock_timewait);
+        return FALSE;
+    }
+
+    send_ack = !header->rst && (header->syn || header->fin || TCP_PAYLOAD_LEN(tcp_packet) > 0);
+    if(header->fin && !header->rst)
+    {
+        /* We have already received the peer's FIN, so this can only be
+         * the same FIN (in case RCV_NXT was recorded before it was
+         * acknowledged) */
+        uint32_t fin_end = SEG_SEQ(tcp_packet) + TCP_PAYLOAD_LEN(tcp_packet) + 1;
+        if(SEQ_GT(fin_end, tw->RCV_NXT))
+            tw->RCV_NXT = fin_end;
+
+        tw->expiry = tcp_now() + 2 * TCP_MSL;
+        DL_DELETE(si->timewait_list, tw);
+        DL_APPEND(si->timewait_list, tw);
+    }
+    reply = *tw;
+    pthread_mutex_unlock(&si->lock_timewait);
+
+    if(send_ack && (connection = chitcpd_get_connection(si, local_addr, remote_addr)) != NULL)
+    {
+        chilog(DEBUG, "Acknowledging a segment for a connection in TIME_WAIT.");
+
+        chitcp_tcp_packet_create(&ack, NULL, 0);
+        header = TCP_PACKET_HEADER(&ack);
+        header->source = chitcp_get_addr_port(local_addr);
+        header->dest = chitcp_get_addr_port(remote_addr);
+        header->seq = chitcp_htonl(reply.SND_NXT);
+        header->ack_seq = chitcp_htonl(reply.RCV_NXT);
+        header->ack = 1;
+        header->win = chitcp_htons(reply.win);
+
+        if (reply.ts_enabled && chitcp_tcp_packet_add_timestamp(&ack, TCP_TS_NOW(), reply.TS_RECENT) != CHITCP_OK)
+            chilog(WARNING, "Could not add timestamps option to segment");
+
+        chitcpd_connection_send_packet(si, connection, &ack, NULL, local_addr, remote_addr, -1);
+
+        chitcp_tcp_packet_free(&ack);
+    }
+
+    chitcp_tcp_packet_free(tcp_packet);
+    free(tcp_packet);
+
+    return TRUE;
+}
+
+
+/* See connection.h */
+void chitcpd_timewait_free(serverinfo_t *si)
+{
+    timewait_entry_t *tw, *tmp;
+
+    mt_free(&si->timewait_timer);
+
+    DL_FOREACH_SAFE(si->timewait_list, tw, tmp)
+        chitcpd_timewait_remove(si, tw);
+    pthread_mutex_destroy(&si->lock_timewait);
+}
 
 
 /***************************/
@@ -782,67 +2183,28 @@ void chitcpd_deliver_packet(serverinfo_t *si, chisocketentry_t *entry, tcp_packe
 
 
 
-/* Define a new pcap record, when logging to a pcap file. */
-typedef struct pcaprecord_hdr {
-   uint32_t ts_sec;         /* timestamp seconds */
-   uint32_t ts_nsec;        /* timestamp nanoseconds */
-   uint32_t incl_len;       /* length of data saved */
-   uint32_t orig_len;       /* original length of packet */
-} pcaprec_hdr_t;
-
-/* IP Header struct, necessary when creating pcap file */
-struct iphdr
-{
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    uint8_t  ihl:4,
-             version:4;
-#elif __BYTE_ORDER == __BIG_ENDIAN
-    uint8_t  version:4,
-             ihl:4;
-#else
-#error __BYTE_ORDER must be defined as __LITTLE_ENDIAN or __BIG_ENDIAN!
-#endif
-    uint8_t tos;         /* Type of service */
-    uint16_t len;        /* Total Length */
-    uint16_t id;         /* Identification */
-    uint16_t off;        /* Fragment flags + Fragment Offset */
-    uint8_t ttl;         /* Time to Live */
-    uint8_t proto;       /* protocol */
-    uint16_t cksum;      /* checksum */
-    uint32_t src;     /* Source Address */
-    uint32_t dst;     /* Destination Address */
-  } __attribute__ ((packed)) ;
-typedef struct iphdr iphdr_t;
-
-int chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr_storage *local_addr, struct sockaddr_storage *peer_addr)
-{
-    if (si->libpcap_file != NULL) {
-        pcaprec_hdr_t pcap_header;
-        struct timespec spec;
-        clock_gettime(CLOCK_REALTIME, &spec);
-        pcap_header.ts_sec = spec.tv_sec;
-        pcap_header.ts_nsec = spec.tv_nsec;
-        pcap_header.incl_len = sizeof(iphdr_t) + tcp_packet->length;
-        pcap_header.orig_len = pcap_header.incl_len;
-
-        /* TODO: Assumes IPv4 */
-        iphdr_t ip_header = {0};
-
-        ip_header.src = ((struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
-        ip_header.dst = ((struct sockaddr_in *) local_addr)->sin_addr.s_addr;
-
-        ip_header.version = 4;
-        ip_header.ihl = 5;
-        ip_header.len = htons(20 + tcp_packet->length);
-        ip_header.ttl = 233;
-        ip_header.proto = 6;
-        ip_header.cksum = cksum(&ip_header, sizeof(iphdr_t));
-
-        fwrite(&pcap_header, sizeof(pcaprec_hdr_t), 1, si->libpcap_file);
-        fwrite(&ip_header, sizeof(iphdr_t), 1, si->libpcap_file);
-        fwrite(tcp_packet->raw, tcp_packet->length, 1, si->libpcap_file);
-        fflush(si->libpcap_file); /* Flush to make sure we get the data out, in case the server is improperly shutdown. */
-    }
-
-    return CHITCP_OK;
+/*
+ * chitcpd_pcap_packet - Capture a packet, if the server has a capture file
+ *
+ * The packet is only added to the capture ring, and is written out
+ * by the capture thread (see pcap.h).
+ *
+ * si: Server info
+ *
+ * tcp_packet: TCP packet
+ *
+ * src, dst: Source and destination of the packet
+ *
+ * sockfd: Socket that sent or received the packet
+ *
+ * direction: PCAP_INBOUND or PCAP_OUTBOUND
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_pcap_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr *src, struct sockaddr *dst,
+                                int sockfd, pcap_direction_t direction)
+{
+    if (si->pcap != NULL)
+        pcap_capture(si->pcap, sockfd, direction, src, dst, tcp_packet);
 }
@@ -42,16 +42,44 @@
 #define CONNECTION_H_
 
 #include "serverinfo.h"
+#include "transport.h"
 #include "chitcp/packet.h"
 
-typedef struct connection_thread_args
-{
-    serverinfo_t *si;
-    tcpconnentry_t *connection;
-    char thread_name[16];
-} connection_thread_args_t;
+/* Size of the per-connection reassembly buffer. Frames don't have to
+ * fit in it, since payloads that aren't fully in the buffer are read
+ * directly into their packet (see transport_tcp_recv). */
+#define CONNECTION_RX_BUFFER_SIZE (16384)
 
-void* chitcpd_connection_thread_func(void *args);
+void* chitcpd_netio_thread_func(void *args);
+
+/*
+ * chitcpd_start_netio_threads - Starts the network I/O threads
+ *
+ * One thread is started for each of the si->connection_stripes stripes.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: Threads started correctly
+ *  - CHITCP_ENOMEM: Could not allocate memory for the threads
+ *  - CHITCP_ESOCKET: Could not create a thread's wakeup pipe
+ *  - CHITCP_ETHREAD: Could not create a thread
+ *
+ */
+int chitcpd_start_netio_threads(serverinfo_t *si);
+
+/*
+ * chitcpd_stop_netio_threads - Stops the network I/O threads
+ *
+ * Waits for the threads to exit, and then closes the receive
+ * sockets of the connections that are still registered.
+ *
+ * si: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_stop_netio_threads(serverinfo_t *si);
 
 
 typedef struct packet_delivery_thread_args
@@ -62,12 +90,243 @@ typedef struct packet_delivery_thread_args
 void* chitcpd_packet_delivery_thread_func(void *args);
 
 
-tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr);
-tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr);
-tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_send, socket_t realsocket_recv, struct sockaddr* addr);
-int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connection);
+/*
+ * chitcpd_get_connection - Get the connection that a socket's packets are sent on
+ *
+ * The socket's addresses are hashed onto one of the stripes of the
+ * connection to the peer's daemon, so all of its packets go through
+ * the same stripe. If we are still connecting to the peer, waits until
+ * the connection is ready.
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Socket's addresses (the remote address
+ *                          is the address of the peer's daemon)
+ *
+ * Returns: Pointer to the stripe's entry in the connection table.
+ *          NULL if there is no connection to the peer yet.
+ *
+ */
+tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr);
+
+/*
+ * chitcpd_fastopen_cookie - Compute the TCP Fast Open cookie of a client
+ *
+ * The cookie is a hash of the client's address (but not its port, so
+ * it is valid for any connection from the same host) keyed with the
+ * server's secret, so it can be checked without keeping any state.
+ *
+ * si: Server info
+ *
+ * remote_addr: Client's address
+ *
+ * cookie: Output parameter for the cookie (TCP_FASTOPEN_COOKIE_LEN bytes)
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_fastopen_cookie(serverinfo_t *si, struct sockaddr *remote_addr, uint8_t *cookie);
+
+/*
+ * chitcpd_fastopen_cookie_get - Get the TCP Fast Open cookie cached for a server
+ *
+ * Cookies are cached with the peer that issued them (see tcppeer_t),
+ * so they last as long as the connection to the peer's daemon.
+ *
+ * si: Server info
+ *
+ * remote_addr: Server's address
+ *
+ * cookie: Output parameter for the cookie (TCP_FASTOPEN_COOKIE_LEN bytes)
+ *
+ * Returns: TRUE if there is a cookie for the server, FALSE otherwise.
+ *
+ */
+bool_t chitcpd_fastopen_cookie_get(serverinfo_t *si, struct sockaddr *remote_addr, uint8_t *cookie);
+
+/*
+ * chitcpd_fastopen_cookie_set - Cache the TCP Fast Open cookie issued by a server
+ *
+ * si: Server info
+ *
+ * remote_addr: Server's address
+ *
+ * cookie: Cookie (TCP_FASTOPEN_COOKIE_LEN bytes)
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_fastopen_cookie_set(serverinfo_t *si, struct sockaddr *remote_addr, const uint8_t *cookie);
+
+/*
+ * chitcpd_create_connection - Establish a connection to another chiTCP daemon
+ *
+ * Opens si->connection_stripes connections to the peer's daemon (unless
+ * another thread got there first), and returns the one that the socket
+ * with the given addresses is hashed onto (see chitcpd_get_connection).
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Socket's addresses
+ *
+ * Returns: Pointer to the stripe's entry in the connection table.
+ *          NULL if the connection table is full.
+ *
+ */
+tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr);
+
+/*
+ * chitcpd_accept_connection - Add a connection accepted from another chiTCP daemon
+ *
+ * The connection becomes a new stripe of the peer. If we are connecting
+ * to ourselves (through the loopback address), it is instead the receiving
+ * side of one of the stripes we opened.
+ *
+ * si: Server info
+ *
+ * transport: Transport of the connection
+ *
+ * realsocket: Accepted socket
+ *
+ * addr: Address of peer running a chiTCP daemon
+ *
+ * Returns: Pointer to the entry in the connection table, which has to
+ *          be registered with chitcpd_register_connection. NULL if the
+ *          connection table is full, or if the peer has too many stripes.
+ *
+ */
+tcpconnentry_t* chitcpd_accept_connection(serverinfo_t *si, const transport_t *transport, socket_t realsocket, struct sockaddr *addr);
+
+/*
+ * chitcpd_find_connection - Find the connection that receives from a real address
+ *
+ * si: Server info
+ *
+ * realaddr: Address (and port) of the peer's end of the connection
+ *
+ * Returns: Pointer to the registered connection whose realsocket_recv is
+ *          connected to that address, or NULL if there is none.
+ *
+ */
+tcpconnentry_t* chitcpd_find_connection(serverinfo_t *si, struct sockaddr *realaddr);
+
+/*
+ * chitcpd_register_connection - Start receiving packets on a connection
+ *
+ * Hands the connection's receive socket (realsocket_recv) over to
+ * the network I/O thread of its stripe.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry (with realsocket_recv already set)
+ *
+ * Returns:
+ *  - CHITCP_OK: Connection registered correctly
+ *  - CHITCP_ENOMEM: Could not allocate the reassembly buffer
+ *  - CHITCP_ESOCKET: Could not wake up the network I/O thread
+ *
+ */
+int chitcpd_register_connection(serverinfo_t *si, tcpconnentry_t* connection);
+
+/*
+ * chitcpd_connection_deliver - Deliver a packet received on a connection
+ *
+ * Called by the transports, once they have received a whole frame.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry
+ *
+ * packet: Received TCP packet
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_connection_deliver(serverinfo_t *si, tcpconnentry_t *connection, tcp_packet_t *packet);
 
 int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet);
+
+/*
+ * chitcpd_send_prepared_tcp_packet - Sends a TCP packet that already has
+ *                                    all its options
+ *
+ * Like chitcpd_send_tcp_packet, but the window scale, SACK permitted and
+ * timestamps options are not added to the packet (the caller, e.g. the
+ * pure ACK fast path in tcp_send_ack, has already filled them in).
+ *
+ * si: Serverinfo struct
+ *
+ * sock: Socket table entry
+ *
+ * tcp_packet: TCP packet to send
+ *
+ * Returns: Number of bytes of data (excluding packet headers) sent
+ *
+ */
+int chitcpd_send_prepared_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet);
 int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr *local_realaddr, struct sockaddr *peer_realaddr);
 
+/*
+ * chitcpd_listen_update - Update a passive socket's queues
+ *
+ * Called when a socket spawned by a passive socket changes state.
+ * Once the socket is ESTABLISHED (or SYN_RCVD, if it accepted data
+ * sent with TCP Fast Open), it is moved from the SYN queue to the
+ * accept queue (and accept() is woken up). A socket that becomes
+ * CLOSED is removed from whatever queue it is in.
+ *
+ * si: Server info
+ *
+ * entry: Spawned (active) socket
+ *
+ * newstate: The socket's new state
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_listen_update(serverinfo_t *si, chisocketentry_t *entry, tcp_state_t newstate);
+
+/*
+ * chitcpd_listen_close - Abort a passive socket's pending connections
+ *
+ * Every socket still in the passive socket's SYN or accept queues
+ * is CLOSED, and its TCP thread joined.
+ *
+ * si: Server info
+ *
+ * entry: Passive socket
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_listen_close(serverinfo_t *si, chisocketentry_t *entry);
+
+/*
+ * chitcpd_timewait_enter - Keep track of a connection that enters TIME_WAIT
+ *
+ * The connection's addresses and sequence numbers are added to the
+ * TIME_WAIT index (see timewait_entry_t), so the socket entry can be
+ * freed right away (see chitcpd_update_tcp_state).
+ *
+ * si: Server info
+ *
+ * entry: Active socket that is entering TIME_WAIT
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_timewait_enter(serverinfo_t *si, chisocketentry_t *entry);
+
+/*
+ * chitcpd_timewait_free - Free the TIME_WAIT index
+ *
+ * Must be called before the timer wheel is freed.
+ *
+ * si: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_timewait_free(serverinfo_t *si);
+
 #endif /* CONNECTION_H_ */
@@ -0,0 +1,179 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Embedded mode (see chitcp/embedded.h)
+ *
+ *  The stack is set up just like chitcpd's main() does, and the
+ *  application gets a command connection of its own in the handler pool
+ *  (see chitcpd_handler_add_local_connection). libchitcp is then told to
+ *  hand its requests to that connection instead of sending them to a
+ *  daemon (see chitcpd_set_local).
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chitcp/chitcpd.h"
+#include "chitcp/embedded.h"
+#include "chitcp/log.h"
+#include "server.h"
+#include "handlers.h"
+#include "transport.h"
+#include "daemon_api.h"
+
+static serverinfo_t *embedded_si = NULL;
+static handler_thread_args_t *embedded_ha = NULL;
+
+static int chitcp_embedded_call(void *arg, ChitcpdMsg *req, int fd, void *dst, ChitcpdMsg **resp_p)
+{
+    return chitcpd_handler_call((handler_thread_args_t *) arg, req, fd, dst, resp_p);
+}
+
+static void chitcp_embedded_release(void *arg, ChitcpdMsg *resp)
+{
+    chitcpd_handler_release((handler_thread_args_t *) arg, resp);
+}
+
+static chitcpd_local_t embedded_local =
+{
+    .call = chitcp_embedded_call,
+    .release = chitcp_embedded_release,
+    .arg = NULL
+};
+
+
+/* See embedded.h */
+int chitcp_embedded_start(const chitcp_embedded_config_t *config)
+{
+    chitcp_embedded_config_t defaults = {0};
+    serverinfo_t *si;
+    int rc;
+
+    if (embedded_si != NULL)
+        return CHITCP_EINVAL;
+
+    if (config == NULL)
+        config = &defaults;
+
+    si = calloc(1, sizeof(serverinfo_t));
+    if (si == NULL)
+        return CHITCP_ENOMEM;
+
+    si->server_port = chitcp_htons(config->port? config->port : GET_CHITCPD_PORT);
+
+    /* Without a UNIX socket, all the requests come from this process's
+     * threads, which handle them themselves, so the pool only has to
+     * resume the requests they are blocked on */
+    if (config->unix_socket)
+        strncpy(si->server_socket_path, config->unix_socket, UNIX_PATH_MAX - 1);
+    else
+        si->num_handler_threads = 1;
+
+    si->libpcap_file_name = NULL;
+    si->tcp_engine = config->tcp_worker_pool? TCP_ENGINE_WORKER_POOL : TCP_ENGINE_THREAD_PER_SOCKET;
+    si->num_tcp_workers = config->num_tcp_workers;
+    si->connection_stripes = 1;
+    si->transport = &transport_tcp;
+    si->tcp_sndbuf_default = config->buf_size;
+    si->tcp_rcvbuf_default = config->buf_size;
+    si->tcp_buf_max = config->buf_max;
+    si->tcp_buf_autotune = (config->buf_max != 0);
+    si->mem_limit = config->mem_limit;
+    si->socket_mem_limit = config->socket_mem_limit;
+    si->tcp_timestamps = config->timestamps;
+    si->tcp_sack = config->sack;
+    si->tcp_cc_default = TCP_CC_NEWRENO;
+
+    rc = chitcpd_server_init(si);
+    if (rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not initialize the embedded chiTCP stack.");
+        free(si);
+        return CHITCP_EINIT;
+    }
+
+    rc = chitcpd_server_start(si);
+    if (rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not start the embedded chiTCP stack.");
+        chitcpd_server_free(si);
+        free(si);
+        return CHITCP_EINIT;
+    }
+
+    embedded_ha = chitcpd_handler_add_local_connection(si);
+    if (embedded_ha == NULL)
+    {
+        chitcpd_server_stop(si);
+        chitcpd_server_wait(si);
+        chitcpd_server_free(si);
+        free(si);
+        return CHITCP_ENOMEM;
+    }
+
+    embedded_local.arg = embedded_ha;
+    chitcpd_set_local(&embedded_local);
+    embedded_si = si;
+
+    chilog(INFO, "Embedded chiTCP stack running. TCP socket: %i", chitcp_ntohs(si->server_port));
+
+    return CHITCP_OK;
+}
+
+
+/* See embedded.h */
+int chitcp_embedded_stop(void)
+{
+    serverinfo_t *si = embedded_si;
+
+    if (si == NULL)
+        return CHITCP_EINVAL;
+
+    /* New calls go nowhere, and the ones in progress are woken up.
+     * The connection itself goes away once their responses have
+     * been released. */
+    chitcpd_set_local(NULL);
+    chitcpd_handler_remove_local_connection(embedded_ha);
+    embedded_ha = NULL;
+
+    chitcpd_server_stop(si);
+    chitcpd_server_wait(si);
+    chitcpd_server_free(si);
+    free(si);
+    embedded_si = NULL;
+
+    return CHITCP_OK;
+}
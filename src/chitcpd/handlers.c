@@ -39,29 +39,53 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "handlers.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/socket.h"
 #include "chitcp/addr.h"
 #include "chitcp/log.h"
 #include "chitcp/packet.h"
+#include "chitcp/utlist.h"
+#include "chitcp/probes.h"
 #include "protobuf-wrapper.h"
 #include "connection.h"
 #include "tcp_thread.h"
 #include "breakpoint.h"
 #include "tcp.h"
+#include "affinity.h"
 
 /* Dispatch table */
 
-typedef int (*handler_function)(serverinfo_t *si, ChitcpdMsg *req_msg, ChitcpdResp *resp);
+/* A handler returns CHITCP_OK once the response is ready, or CHITCP_EWOULDBLOCK
+ * if it has parked the request (see chitcpd_handler_park) */
+typedef int (*handler_function)(serverinfo_t *si, handler_thread_args_t *ha, handler_request_t *r, ChitcpdMsg *req_msg, ChitcpdResp *resp);
 
 #define HANDLER_NAME(NAME) chitcpd_handle_ ## NAME
 #define HANDLER_ENTRY(NAME) [NAME] = chitcpd_handle_ ## NAME
-#define HANDLER_FUNCTION(NAME) int chitcpd_handle_ ## NAME (serverinfo_t *si, ChitcpdMsg *req_msg, ChitcpdResp *resp)
+#define HANDLER_FUNCTION(NAME) int chitcpd_handle_ ## NAME (serverinfo_t *si, handler_thread_args_t *ha, handler_request_t *r, ChitcpdMsg *req_msg, ChitcpdResp *resp)
+
+/* sendfile() maps regular files this many bytes at a time, and reads
+ * other files this many bytes at a time */
+#define SENDFILE_MAP_SIZE (1024 * 1024)
+#define SENDFILE_READ_SIZE (64 * 1024)
+
+/* Most events the poll thread handles at a time */
+#define HANDLER_POLL_EVENTS (64)
+
+/* Steps of a CLOSE that is waiting for a closing state (see handler_request_t) */
+#define CLOSE_FROM_ESTABLISHED (1)
+#define CLOSE_FROM_CLOSE_WAIT (2)
 
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND);
@@ -74,6 +98,15 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SETSOCKOPT);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GETSOCKOPT);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BATCH);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__FCNTL);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__POLL);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SENDFILE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_STATS);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SUBSCRIBE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__UNSUBSCRIBE);
 
 /* Handling DEBUG requires a slightly modified prototype */
 int chitcpd_handle_CHITCPD_MSG_CODE__DEBUG(serverinfo_t *si, ChitcpdMsg *req, ChitcpdMsg *resp_outer, ChitcpdResp *resp_inner, int client_sockfd);
@@ -90,7 +123,16 @@ handler_function handlers[] =
     HANDLER_ENTRY(CHITCPD_MSG_CODE__CLOSE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_STATE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS),
-    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__SETSOCKOPT),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__GETSOCKOPT),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__BATCH),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__FCNTL),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__POLL),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__SENDFILE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_STATS),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__SUBSCRIBE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__UNSUBSCRIBE)
 };
 
 static char *code_strs[] =
@@ -108,7 +150,17 @@ static char *code_strs[] =
     "RESP",
     "DEBUG",
     "DEBUG_EVENT",
-    "WAIT_FOR_STATE"
+    "WAIT_FOR_STATE",
+    "SETSOCKOPT",
+    "GETSOCKOPT",
+    "BATCH",
+    "FCNTL",
+    "POLL",
+    "SENDFILE",
+    "GET_STATS",
+    "SUBSCRIBE",
+    "UNSUBSCRIBE",
+    "NOTIFY"
 };
 
 static inline char *handler_code_string (int code)
@@ -117,94 +169,237 @@ static inline char *handler_code_string (int code)
 }
 
 /*
- * chitcpd_handler_dispatch - Handler thread function
+ * chitcpd_handler_record_latency - Add a request to the RPC latency histograms
+ *
+ * si: Server info
  *
- * Handles a connection on chitcpd's UNIX socket, and dispatches
- * incoming requests to the appropriate function, using the
- * dispatch table defined above.
+ * code: Request code
  *
- * args: arguments (in handler_thread_args_t)
+ * start: When the handler was called (as returned by tcp_now)
  *
  * Returns: Nothing.
  *
  */
-void* chitcpd_handler_dispatch(void *args)
+static void chitcpd_handler_record_latency(serverinfo_t *si, int code, uint64_t start)
 {
-    handler_thread_args_t *ha = (handler_thread_args_t *) args;
-
-    serverinfo_t *si = ha->si;
-    socket_t client_socket = ha->client_socket;
-    pthread_mutex_t *handler_lock = ha->handler_lock;
-    pthread_setname_np(ha->thread_name);
-    ChitcpdMsg *req;
-    ChitcpdMsg resp_outer = CHITCPD_MSG__INIT;
-    ChitcpdResp resp_inner = CHITCPD_RESP__INIT;
-    bool_t done = FALSE; /* Should we keep looping? */
-    int rc;
+    uint64_t us = (tcp_now() - start) / MICROSECOND;
 
-    resp_outer.code = CHITCPD_MSG_CODE__RESP;
-    resp_outer.resp = &resp_inner;
+    CHITCP_PROBE(handler_done, code, us);
 
-    do
-    {
-        rc = chitcpd_recv_msg(client_socket, &req);
-        if (rc < 0)
-            break;
+    if (code < 0 || code >= RPC_STATS_MAX_CODES)
+        return;
+    rpc_stats_add(&si->rpc_stats[code], us);
+}
 
-        chilog(TRACE, "Received request (code=%s)", handler_code_string(req->code));
 
-        /* We have received a request, so we grab the handler lock to
-         * prevent a race condition when the server is shutting down */
-        pthread_mutex_lock(handler_lock);
+/*
+ * chitcpd_handler_enqueue - Put a request on the pool's run queue
+ *
+ * Must be called with the pool's lock held.
+ *
+ * pool: Handler pool
+ *
+ * r: Request (or a connection's reader)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_enqueue(handler_pool_t *pool, handler_request_t *r)
+{
+    DL_APPEND2(pool->run_queue, r, rq_prev, rq_next);
+    pthread_cond_signal(&pool->cv_run_queue);
+}
 
-        /* Call handler function using dispatch table */
-        rc = handlers[req->code](si, req, &resp_inner);
 
-        chitcpd_msg__free_unpacked(req, NULL);
+/*
+ * chitcpd_handler_wake - Wake function of a request's poll waiter
+ *
+ * If the request is parked, it is put back on the run queue (or, if it
+ * was made in-process, its thread is woken up). Otherwise, its handler is running, and will find out it has been notified when
+ * it tries to park the request (see chitcpd_handler_run). Called with
+ * lock_poll held.
+ *
+ * waiter: The request's poll waiter
+ *
+ * arg: The request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_wake(poll_waiter_t *waiter, void *arg)
+{
+    handler_request_t *r = (handler_request_t *) arg;
+    handler_pool_t *pool = r->ha->si->handler_pool;
 
-        if(rc != CHITCP_OK)
+    if (r->parked)
+    {
+        r->parked = FALSE;
+        waiter->notified = FALSE;
+        if (r->cv_local)
+            pthread_cond_signal(r->cv_local);
+        else
         {
-            chilog(ERROR, "Error when handling request.");
-            /* We don't need to bail out just because one request failed */
+            pthread_mutex_lock(&pool->lock);
+            chitcpd_handler_enqueue(pool, r);
+            pthread_mutex_unlock(&pool->lock);
         }
+    }
+}
 
-        /* Send response */
-        rc = chitcpd_send_msg(client_socket, &resp_outer);
 
-        if (resp_inner.has_buf)
-        {
-            /* This buffer was allocated in RECV. */
-            free(resp_inner.buf.data);
-            resp_inner.has_buf = FALSE;
-        }
-        if (resp_inner.socket_state != NULL)
-        {
-            /* This submessage was allocated in GET_SOCKET_STATE. */
-            free(resp_inner.socket_state);
-            resp_inner.socket_state = NULL;
-        }
-        if (resp_inner.socket_buffer_contents != NULL)
-        {
-            /* This submessage was allocated in GET_SOCKET_BUFFER_CONTENTS. */
-            if (resp_inner.socket_buffer_contents->snd.data != NULL)
-                free(resp_inner.socket_buffer_contents->snd.data);
-            if (resp_inner.socket_buffer_contents->rcv.data != NULL)
-                free(resp_inner.socket_buffer_contents->rcv.data);
-            free(resp_inner.socket_buffer_contents);
-            resp_inner.socket_buffer_contents = NULL;
-        }
+/*
+ * chitcpd_handler_watch - Register a request on the socket it will wait on
+ *
+ * This has to be done before checking whether the request can complete
+ * (or, in CONNECT and CLOSE, before starting the state changes the request
+ * will wait for), so no change can go unnoticed. A request only watches
+ * one socket, so this does nothing if it is already registered.
+ *
+ * si: Server info
+ *
+ * r: Request
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_watch(serverinfo_t *si, handler_request_t *r, chisocketentry_t *entry)
+{
+    if (r->registered)
+        return;
+
+    /* Nobody can notify the waiter before it is registered, and
+     * setting notified makes sure the handler checks the socket again
+     * after it has registered (see chitcpd_handler_run) */
+    r->waiter.notified = TRUE;
+    r->registered = TRUE;
+    chitcpd_poll_register(si, entry, &r->reg, &r->waiter);
+}
 
-        /* We're done processing the request (we've run the handler and
-         * we've returned a response). We can release the handler lock and,
-         * if a shutdown is in progress, it will make sure it can proceed
-         * safely */
-        pthread_mutex_unlock(handler_lock);
 
-        if (rc < 0)
-            break;
+/*
+ * chitcpd_handler_park - Park a request until the socket it is waiting on changes
+ *
+ * A handler calls this instead of blocking, and must return whatever this
+ * returns if it is CHITCP_EWOULDBLOCK. The handler is then called again
+ * (with the same request) whenever the socket changes, so it must be able
+ * to pick up where it left off (e.g., using the request's step and done).
+ *
+ * si: Server info
+ *
+ * r: Request
+ *
+ * entry: Socket entry
+ *
+ * Returns:
+ *  - CHITCP_EWOULDBLOCK: The request has been parked
+ *  - CHITCP_ESOCKET: The client has disconnected, so the handler
+ *                    must complete the request now
+ *
+ */
+static int chitcpd_handler_park(serverinfo_t *si, handler_request_t *r, chisocketentry_t *entry)
+{
+    if (r->ha->stopping)
+        return CHITCP_ESOCKET;
+
+    chitcpd_handler_watch(si, r, entry);
 
+    return CHITCP_EWOULDBLOCK;
+}
+
+
+/*
+ * chitcpd_handler_seen_states - TCP states of the socket a request is watching
+ *
+ * si: Server info
+ *
+ * r: Request (see chitcpd_handler_watch)
+ *
+ * gone: Output parameter; set to true if the socket has been freed
+ *
+ * Returns: The states the socket has been in since the request started
+ *          watching it (see poll_registration_t).
+ *
+ */
+static unsigned int chitcpd_handler_seen_states(serverinfo_t *si, handler_request_t *r, bool_t *gone)
+{
+    unsigned int states;
+
+    pthread_mutex_lock(&si->lock_poll);
+    states = r->reg.states;
+    if (r->reg.entry != NULL)
+        states |= 1 << r->reg.entry->tcp_state;
+    *gone = (r->reg.entry == NULL);
+    pthread_mutex_unlock(&si->lock_poll);
+
+    return states;
+}
+
+
+/*
+ * chitcpd_handler_unwait - Remove all of a request's registrations (and its timer)
+ *
+ * si: Server info
+ *
+ * r: Request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_unwait(serverinfo_t *si, handler_request_t *r)
+{
+    if (r->registered)
+    {
+        chitcpd_poll_unregister(si, &r->reg);
+        r->registered = FALSE;
+    }
+
+    if (r->regs != NULL)
+    {
+        for (size_t i = 0; i < r->num_regs; i++)
+            chitcpd_poll_unregister(si, &r->regs[i]);
+        free(r->regs);
+        r->regs = NULL;
+        r->num_regs = 0;
+    }
+
+    if (r->subs != NULL)
+    {
+        free(r->subs);
+        r->subs = NULL;
+    }
+
+    /* This waits for the timer's callback, if it is running */
+    if (r->has_timer)
+    {
+        mt_free(&r->mt);
+        r->has_timer = FALSE;
     }
-    while (!done);
+
+    r->waiter.notified = FALSE;
+}
+
+
+/*
+ * chitcpd_handler_free_connection - Free a connection once its client has disconnected
+ *
+ * All the sockets created through the connection are freed (or, if they
+ * are active, closed), so this must be called once none of the connection's
+ * requests are running or queued.
+ *
+ * pool: Handler pool
+ *
+ * ha: Connection
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_free_connection(handler_pool_t *pool, handler_thread_args_t *ha)
+{
+    serverinfo_t *si = ha->si;
+    handler_request_t *r;
+    int freed_sockets = 0;
 
     /* TODO: Be more discerning about what kind of shutdown this is */
     if(si->state == CHITCPD_STATE_STOPPING)
@@ -212,12 +407,10 @@ void* chitcpd_handler_dispatch(void *args)
     else
         chilog(DEBUG, "Daemon client has disconnected. Freeing open sockets for this handler...");
 
-    int freed_sockets = 0;
-
     for(int i=0; i < si->chisocket_table_size; i++)
     {
-        chisocketentry_t *entry = &si->chisocket_table[i];
-        if(!entry->available && entry->creator_thread == pthread_self())
+        chisocketentry_t *entry = CHISOCKET_ENTRY(si, i);
+        if(!entry->available && entry->cold->creator == ha)
         {
             chilog(DEBUG, "Freeing socket %i", i);
             /* TODO: The connection should be aborted (not closed) here.
@@ -228,7 +421,7 @@ void* chitcpd_handler_dispatch(void *args)
             {
                 /* Any transition to CLOSED will force a termination of the TCP thread */
                 chitcpd_update_tcp_state(si, entry, CLOSED);
-                pthread_join(entry->socket_state.active.tcp_thread, NULL);
+                chitcpd_tcp_join_thread(si, entry);
             }
             else if(entry->actpas_type == SOCKET_PASSIVE)
                 chitcpd_free_socket_entry(si, entry);
@@ -242,136 +435,2368 @@ void* chitcpd_handler_dispatch(void *args)
     else
         chilog(DEBUG, "This handler had no sockets to free.");
 
+    chitcpd_channel_free(&ha->channel);
+    if (ha->shm)
+        munmap(ha->shm, ha->shm_size);
+    free(ha->recv_buf);
+    while ((r = ha->spare) != NULL)
+    {
+        ha->spare = r->next;
+        chitcpd_arena_free(&r->arena);
+        free(r);
+    }
+
+    /* Once the connection is off the list, chitcpd_handler_stop_pool
+     * won't touch its socket */
+    pthread_mutex_lock(&pool->lock);
+    DL_DELETE(pool->connections, ha);
+    pthread_cond_broadcast(&pool->cv_connections);
+    pthread_mutex_unlock(&pool->lock);
+
+    close(ha->client_socket);
+    pthread_mutex_destroy(&ha->handler_lock);
+    free(ha);
+
     chilog(DEBUG, "Handler is exiting.");
-    free(args);
-    return NULL;
 }
 
 
-
-/* Handler for chisocket_socket() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
+/*
+ * chitcpd_handler_disconnect - Handle a client's disconnection
+ *
+ * The requests that are parked are handled again (and complete right
+ * away, see chitcpd_handler_park), and any requests that are still queued
+ * are handled too. The last one to complete frees the connection (or we
+ * do, if there are none).
+ *
+ * pool: Handler pool
+ *
+ * ha: Connection
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_disconnect(handler_pool_t *pool, handler_thread_args_t *ha)
 {
-    int domain, type, protocol;
-    int socket_index, ret;
-    ChitcpdSocketArgs *req;
+    serverinfo_t *si = ha->si;
+    handler_request_t *r;
+    bool_t idle;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SOCKET");
+    if (ha->client_socket != -1)
+        epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, ha->client_socket, NULL);
 
-    /* Unpack request */
-    assert(req_msg->socket_args != NULL);
-    req = req_msg->socket_args;
+    /* Requests waiting on a socket's buffers would otherwise have to
+     * wait for the socket to be freed (which is about to happen anyway) */
+    for(int i=0; i < si->chisocket_table_size; i++)
+    {
+        chisocketentry_t *entry = CHISOCKET_ENTRY(si, i);
+        if(!entry->available && entry->cold->creator == ha &&
+           entry->actpas_type == SOCKET_ACTIVE && entry->tcp_state != CLOSED)
+        {
+            circular_buffer_close(&entry->socket_state.active.tcp_data.send);
+            circular_buffer_close(&entry->socket_state.active.tcp_data.recv);
+        }
+    }
 
-    domain = req->domain;
-    type = req->type;
-    protocol = req->protocol;
+    pthread_mutex_lock(&si->lock_poll);
+    pthread_mutex_lock(&pool->lock);
+    ha->stopping = TRUE;
+    DL_FOREACH(ha->running, r)
+    {
+        if (r->parked)
+        {
+            r->parked = FALSE;
+            r->waiter.notified = FALSE;
+            if (r->cv_local)
+                pthread_cond_signal(r->cv_local);
+            else
+                chitcpd_handler_enqueue(pool, r);
+        }
+    }
+    idle = (ha->running == NULL && ha->requests == NULL);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&si->lock_poll);
 
-    ret = chitcpd_allocate_socket(si, &socket_index);
+    if (idle)
+        chitcpd_handler_free_connection(pool, ha);
+}
 
-    if(ret == CHITCP_OK)
-    {
-        si->chisocket_table[socket_index].domain = domain;
-        si->chisocket_table[socket_index].type = type;
-        si->chisocket_table[socket_index].protocol = protocol;
 
-        resp->ret = socket_index;
-        resp->error_code = 0;
+/*
+ * chitcpd_handler_new_request - Get a request for a connection
+ *
+ * One of the requests the connection has kept (see
+ * chitcpd_handler_recycle) is reused if there is one, in which
+ * case its arena most likely has room for the request and its response
+ * already.
+ *
+ * pool: Handler pool
+ *
+ * ha: Connection
+ *
+ * Returns: The request (with its response initialized), or NULL if it
+ *          could not be allocated.
+ *
+ */
+static handler_request_t *chitcpd_handler_new_request(handler_pool_t *pool, handler_thread_args_t *ha)
+{
+    handler_request_t *r;
+
+    pthread_mutex_lock(&pool->lock);
+    r = ha->spare;
+    if (r != NULL)
+    {
+        ha->spare = r->next;
+        r->next = NULL;
     }
-    else
+    pthread_mutex_unlock(&pool->lock);
+
+    if (r == NULL)
     {
-        resp->ret = -1;
-        resp->error_code = ENOMEM;
+        if ((r = calloc(1, sizeof(handler_request_t))) == NULL)
+            return NULL;
+        chitcpd_arena_init(&r->arena);
     }
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SOCKET");
+    r->ha = ha;
+    chitcpd_resp__init(&r->resp);
+    r->waiter.wake = chitcpd_handler_wake;
+    r->waiter.wake_arg = r;
 
-    return CHITCP_OK;
+    return r;
 }
 
 
-/* Handler for chisocket_bind() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
+/*
+ * chitcpd_handler_recycle - Keep a request that is done, to reuse it
+ *
+ * Everything allocated in the request's arena (the request message,
+ * unless it was made in-process, and the parts of the response) is
+ * given back, and the request is put on its connection's spare list.
+ * Must be called with the pool's lock held.
+ *
+ * r: Request (which isn't on any other list)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_recycle(handler_request_t *r)
 {
-    int addrlen;
-    struct sockaddr* addr;
-    chisocket_t sockfd;
-    int ret, error_code = 0;;
-    ChitcpdBindArgs *req;
+    handler_thread_args_t *ha = r->ha;
+    chitcpd_arena_t arena = r->arena;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__BIND");
+    /* The copy still points to r->arena (which is where it goes back) */
+    chitcpd_arena_reset(&arena);
+    memset(r, 0, sizeof(handler_request_t));
+    r->arena = arena;
 
-    /* Unpack request */
-    assert(req_msg->bind_args != NULL);
-    req = req_msg->bind_args;
+    r->next = ha->spare;
+    ha->spare = r;
+}
 
-    sockfd = req->sockfd;
-    addrlen = req->addr.len;
-    addr = (struct sockaddr*) req->addr.data;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+/*
+ * chitcpd_handler_put_request - Give back a request that was never run
+ *
+ * pool: Handler pool
+ *
+ * r: Request returned by chitcpd_handler_new_request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_put_request(handler_pool_t *pool, handler_request_t *r)
+{
+    pthread_mutex_lock(&pool->lock);
+    chitcpd_handler_recycle(r);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * chitcpd_handler_read - Read the next request from a connection
+ *
+ * The request is queued (or, if its lane is free, put on the run
+ * queue), and we go back to polling the connection's socket.
+ *
+ * pool: Handler pool
+ *
+ * ha: Connection (whose socket is readable)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_read(handler_pool_t *pool, handler_thread_args_t *ha)
+{
+    struct epoll_event ev;
+    ChitcpdMsg *req;
+    handler_request_t *r, *running;
+    bool_t busy = FALSE;
+    int rc;
+
+    r = chitcpd_handler_new_request(pool, ha);
+    if (r == NULL)
     {
-        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
-        goto done;
+        chilog(ERROR, "Could not allocate request");
+        chitcpd_handler_disconnect(pool, ha);
+        return;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
 
-    if(entry->tcp_state != CLOSED)
+    rc = chitcpd_channel_recv_msg(&ha->channel, &req, &r->arena.allocator);
+    if (rc < 0)
     {
-        chilog(ERROR, "Tried to bind a non-CLOSED socket: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
-        goto done;
+        chitcpd_handler_put_request(pool, r);
+        chitcpd_handler_disconnect(pool, ha);
+        return;
     }
 
-    /* TODO: Check whether socket is already bound to an address.
-     *       The socket API only allows a socket to be bound once. */
-
-    /* Extract port from address, and verify whether it is valid */
-    uint16_t port;
+    if (req->code < CHITCPD_MSG_CODE__SOCKET ||
+        req->code >= sizeof(handlers) / sizeof(handler_function) ||
+        handlers[req->code] == NULL)
+    {
+        chilog(ERROR, "Received request with unexpected code %i", req->code);
+        chitcpd_handler_put_request(pool, r);
+        goto rearm;
+    }
 
-    port = chitcp_ntohs(chitcp_get_addr_port(addr));
+    chilog(TRACE, "Received request (id=%u, lane=%u, code=%s)",
+           req->request_id, req->lane, handler_code_string(req->code));
 
-    if (port < 0)
+    /* The file to send comes right after a SENDFILE request. The
+     * client's number for it means nothing to us, so it is replaced
+     * with ours (or -1 if it didn't come with the request) */
+    if (req->code == CHITCPD_MSG_CODE__SENDFILE && req->sendfile_args != NULL)
     {
-        chilog(ERROR, "Port could not be extracted from address.");
-        ret = -1;
-        error_code = EINVAL;
-        goto done;
+        int fd;
+
+        rc = chitcpd_recv_fd(ha->channel.sockfd, &fd);
+        if (rc == -1)
+        {
+            chitcpd_handler_put_request(pool, r);
+            chitcpd_handler_disconnect(pool, ha);
+            return;
+        }
+        req->sendfile_args->fd = (rc == CHITCP_OK)? fd : -1;
     }
 
-    if (port > si->port_table_size)
+    r->req = req;
+    r->lane = req->lane;
+
+    /* If there is a request running in the same lane, this one has to
+     * wait for it (see chitcpd_handler_complete) */
+    pthread_mutex_lock(&pool->lock);
+    DL_FOREACH(ha->running, running)
     {
-        chilog(ERROR, "Invalid port specified: %i", port);
-        ret = -1;
-        error_code = EINVAL;
-        goto done;
+        if (running->lane == r->lane)
+        {
+            busy = TRUE;
+            break;
+        }
     }
+    if (busy)
+        DL_APPEND(ha->requests, r);
+    else
+    {
+        DL_APPEND(ha->running, r);
+        chitcpd_handler_enqueue(pool, r);
+    }
+    pthread_mutex_unlock(&pool->lock);
 
-    if (si->port_table[port] != NULL)
+rearm:
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = ha;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, ha->client_socket, &ev) == -1)
     {
-        chilog(ERROR, "Port is already taken: %i", port);
+        perror("Could not poll the client socket");
+        chitcpd_handler_disconnect(pool, ha);
+    }
+}
+
+
+/*
+ * chitcpd_handler_keep_recv_buf - Give a request's RECV buffer back to its connection
+ *
+ * The data returned by RECV is not freed with the response. Instead, the
+ * connection keeps the larger of its buffer and the request's (and the
+ * request's buffer then has to be freed). Must be called with the
+ * connection's handler lock held, once the response has been sent.
+ *
+ * ha: Connection
+ *
+ * r: Request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_keep_recv_buf(handler_thread_args_t *ha, handler_request_t *r)
+{
+    if (r->resp.has_buf && r->resp.buf.data == r->recv_buf)
+        r->resp.has_buf = FALSE;
+    if (r->recv_buf_size > ha->recv_buf_size)
+    {
+        uint8_t *recv_buf = ha->recv_buf;
+        size_t recv_buf_size = ha->recv_buf_size;
+
+        ha->recv_buf = r->recv_buf;
+        ha->recv_buf_size = r->recv_buf_size;
+        r->recv_buf = recv_buf;
+        r->recv_buf_size = recv_buf_size;
+    }
+}
+
+
+/*
+ * chitcpd_handler_complete - Send a request's response, and free the request
+ *
+ * The next request queued in the request's lane (if any) is put on the
+ * run queue and, if the client has disconnected and this was its last
+ * request, the connection is freed.
+ *
+ * pool: Handler pool
+ *
+ * r: Request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_complete(handler_pool_t *pool, handler_request_t *r)
+{
+    handler_thread_args_t *ha = r->ha;
+    serverinfo_t *si = ha->si;
+    ChitcpdMsg resp_outer = CHITCPD_MSG__INIT;
+    handler_request_t *next;
+    bool_t idle;
+    int rc;
+
+    chitcpd_handler_unwait(si, r);
+    chitcpd_handler_record_latency(si, r->req->code, r->start);
+
+    resp_outer.code = CHITCPD_MSG_CODE__RESP;
+    resp_outer.resp = &r->resp;
+    resp_outer.request_id = r->req->request_id;
+
+    /* Send response. The handler lock makes sure responses from
+     * different requests are not interleaved, and prevents a race
+     * condition when the server is shutting down. */
+    pthread_mutex_lock(&ha->handler_lock);
+    rc = chitcpd_channel_send_msg(&ha->channel, &resp_outer);
+
+    chitcpd_handler_keep_recv_buf(ha, r);
+    pthread_mutex_unlock(&ha->handler_lock);
+
+    if (rc < 0)
+        chilog(DEBUG, "Could not send response (client may have disconnected)");
+
+    free(r->recv_buf);
+
+    pthread_mutex_lock(&pool->lock);
+    DL_DELETE(ha->running, r);
+
+    /* The request's lane is free again */
+    DL_FOREACH(ha->requests, next)
+    {
+        if (next->lane == r->lane)
+        {
+            DL_DELETE(ha->requests, next);
+            DL_APPEND(ha->running, next);
+            chitcpd_handler_enqueue(pool, next);
+            break;
+        }
+    }
+    idle = ha->stopping && ha->running == NULL && ha->requests == NULL;
+    chitcpd_handler_recycle(r);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (idle)
+        chitcpd_handler_free_connection(pool, ha);
+}
+
+
+/*
+ * chitcpd_handler_run - Handle a request
+ *
+ * Calls the appropriate function in the dispatch table. If the function
+ * parks the request, it is put back on the run queue right away when it
+ * was notified while the function was running (or when the client has
+ * disconnected). Otherwise, the response is sent back.
+ *
+ * pool: Handler pool
+ *
+ * r: Request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_run(handler_pool_t *pool, handler_request_t *r)
+{
+    serverinfo_t *si = pool->si;
+    int rc;
+
+    if (r->start == 0)
+        r->start = tcp_now();
+
+    /* Call handler function using dispatch table */
+    CHITCP_PROBE(handler_entry, r->req->code, r->req->request_id);
+    rc = handlers[r->req->code](si, r->ha, r, r->req, &r->resp);
+    CHITCP_PROBE(handler_exit, r->req->code, r->req->request_id, rc);
+
+    if (rc == CHITCP_EWOULDBLOCK)
+    {
+        pthread_mutex_lock(&si->lock_poll);
+        if (r->waiter.notified || r->ha->stopping)
+        {
+            r->waiter.notified = FALSE;
+            pthread_mutex_lock(&pool->lock);
+            chitcpd_handler_enqueue(pool, r);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        else
+            r->parked = TRUE;
+        pthread_mutex_unlock(&si->lock_poll);
+
+        return;
+    }
+
+    if(rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Error when handling request.");
+        /* We don't need to bail out just because one request failed */
+    }
+
+    chitcpd_handler_complete(pool, r);
+}
+
+
+/*
+ * chitcpd_handler_thread_func - Handler pool thread function
+ *
+ * Takes requests (and connections' readers) from the pool's run queue,
+ * and handles them.
+ *
+ * args: arguments (in handler_pool_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void* chitcpd_handler_thread_func(void *args)
+{
+    handler_pool_t *pool = (handler_pool_t *) args;
+    handler_request_t *r;
+    char thread_name[16];
+
+    snprintf(thread_name, 16, "socket-layer-%d", atomic_fetch_add(&pool->next_thread_id, 1));
+    pthread_setname_np(thread_name);
+    affinity_pin_all(&pool->si->placement);
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while (pool->run_queue == NULL && !pool->done)
+            pthread_cond_wait(&pool->cv_run_queue, &pool->lock);
+
+        if (pool->run_queue == NULL)
+            break;
+
+        r = pool->run_queue;
+        DL_DELETE2(pool->run_queue, r, rq_prev, rq_next);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (r->req == NULL)
+            chitcpd_handler_read(pool, r->ha);
+        else
+            chitcpd_handler_run(pool, r);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/*
+ * chitcpd_handler_poll_thread_func - Handler pool's poll thread function
+ *
+ * Waits for the client sockets to become readable, and queues their
+ * readers. Each socket is polled in one-shot mode, so only one thread at
+ * a time reads from it (see chitcpd_handler_read, which polls it again).
+ *
+ * args: arguments (in handler_pool_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void* chitcpd_handler_poll_thread_func(void *args)
+{
+    handler_pool_t *pool = (handler_pool_t *) args;
+    struct epoll_event events[HANDLER_POLL_EVENTS];
+    int nevents;
+
+    pthread_setname_np("socket-poll");
+    affinity_pin_all(&pool->si->placement);
+
+    for(;;)
+    {
+        nevents = epoll_wait(pool->epoll_fd, events, HANDLER_POLL_EVENTS, -1);
+        if (nevents == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll the client sockets");
+            break;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->done)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        for (int i = 0; i < nevents; i++)
+        {
+            handler_thread_args_t *ha = (handler_thread_args_t *) events[i].data.ptr;
+
+            if (ha != NULL)
+                chitcpd_handler_enqueue(pool, &ha->reader);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+/* See handlers.h */
+int chitcpd_handler_start_pool(serverinfo_t *si)
+{
+    handler_pool_t *pool;
+    struct epoll_event ev;
+
+    if (si->num_handler_threads <= 0)
+    {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        si->num_handler_threads = ncpus > 2 ? (int) ncpus : 2;
+    }
+
+    pool = calloc(1, sizeof(handler_pool_t));
+    if (pool == NULL)
+        return CHITCP_ENOMEM;
+    pool->threads = calloc(si->num_handler_threads, sizeof(pthread_t));
+    if (pool->threads == NULL)
+    {
+        free(pool);
+        return CHITCP_ENOMEM;
+    }
+
+    pool->si = si;
+    pool->run_queue = NULL;
+    pool->connections = NULL;
+    pool->done = FALSE;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cv_run_queue, NULL);
+    pthread_cond_init(&pool->cv_connections, NULL);
+
+    /* The wakeup descriptor is polled along with the client sockets (with
+     * no connection attached to it), so the poll thread can be stopped */
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pool->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (pool->epoll_fd == -1 || pool->wakeup_fd == -1 ||
+        epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, pool->wakeup_fd, &ev) == -1)
+    {
+        perror("Could not create the handler pool's poll descriptors");
+        if (pool->epoll_fd != -1)
+            close(pool->epoll_fd);
+        if (pool->wakeup_fd != -1)
+            close(pool->wakeup_fd);
+        free(pool->threads);
+        free(pool);
+        return CHITCP_ESOCKET;
+    }
+
+    si->handler_pool = pool;
+
+    for (int i = 0; i < si->num_handler_threads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, chitcpd_handler_thread_func, pool) != 0)
+        {
+            perror("Could not create a handler thread");
+            chitcpd_handler_stop_pool(si);
+            return CHITCP_ETHREAD;
+        }
+        pool->num_threads = i + 1;
+    }
+
+    if (pthread_create(&pool->poll_thread, NULL, chitcpd_handler_poll_thread_func, pool) != 0)
+    {
+        perror("Could not create the handler pool's poll thread");
+        chitcpd_handler_stop_pool(si);
+        return CHITCP_ETHREAD;
+    }
+    pool->polling = TRUE;
+
+    chilog(DEBUG, "Started %i handler threads", pool->num_threads);
+
+    return CHITCP_OK;
+}
+
+
+/* See handlers.h */
+int chitcpd_handler_add_connection(serverinfo_t *si, handler_thread_args_t *ha)
+{
+    handler_pool_t *pool = si->handler_pool;
+    struct epoll_event ev;
+
+    ha->si = si;
+    ha->requests = NULL;
+    ha->running = NULL;
+    ha->stopping = FALSE;
+    memset(&ha->reader, 0, sizeof(handler_request_t));
+    ha->reader.ha = ha;
+    pthread_mutex_init(&ha->handler_lock, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    DL_APPEND(pool->connections, ha);
+    pthread_mutex_unlock(&pool->lock);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = ha;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, ha->client_socket, &ev) == -1)
+    {
+        perror("Could not poll the client socket");
+        pthread_mutex_lock(&pool->lock);
+        DL_DELETE(pool->connections, ha);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_destroy(&ha->handler_lock);
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See handlers.h */
+handler_thread_args_t *chitcpd_handler_add_local_connection(serverinfo_t *si)
+{
+    handler_pool_t *pool = si->handler_pool;
+    handler_thread_args_t *ha;
+
+    ha = calloc(1, sizeof(handler_thread_args_t));
+    if (ha == NULL)
+        return NULL;
+
+    /* There is no client socket (or shared data window) */
+    ha->si = si;
+    ha->client_socket = -1;
+    chitcpd_channel_init(&ha->channel, -1);
+    ha->requests = NULL;
+    ha->running = NULL;
+    ha->stopping = FALSE;
+    ha->reader.ha = ha;
+    pthread_mutex_init(&ha->handler_lock, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    DL_APPEND(pool->connections, ha);
+    pthread_mutex_unlock(&pool->lock);
+
+    return ha;
+}
+
+
+/* See handlers.h */
+int chitcpd_handler_call(handler_thread_args_t *ha, ChitcpdMsg *req, int fd, uint8_t *recv_dst, ChitcpdMsg **resp_p)
+{
+    serverinfo_t *si = ha->si;
+    handler_pool_t *pool = si->handler_pool;
+    pthread_cond_t cv_local;
+    handler_request_t *r;
+    int rc;
+
+    if (req->code < CHITCPD_MSG_CODE__SOCKET ||
+        req->code >= sizeof(handlers) / sizeof(handler_function) ||
+        handlers[req->code] == NULL ||
+        req->code == CHITCPD_MSG_CODE__SUBSCRIBE || req->code == CHITCPD_MSG_CODE__UNSUBSCRIBE)
+    {
+        chilog(ERROR, "Unsupported in-process request (code %i)", req->code);
+        return CHITCP_EINVAL;
+    }
+
+    r = chitcpd_handler_new_request(pool, ha);
+    if (r == NULL)
+        return CHITCP_ENOMEM;
+    r->req = req;
+    r->cv_local = &cv_local;
+    r->recv_dst = recv_dst;
+    r->start = tcp_now();
+    pthread_cond_init(&cv_local, NULL);
+
+    /* SENDFILE closes its descriptor when it's done */
+    if (req->code == CHITCPD_MSG_CODE__SENDFILE && req->sendfile_args != NULL)
+        req->sendfile_args->fd = (fd >= 0)? dup(fd) : -1;
+
+    /* The request is running until it is released, so the connection
+     * can't be freed while the caller is still looking at the response */
+    pthread_mutex_lock(&pool->lock);
+    DL_APPEND(ha->running, r);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Same as chitcpd_handler_run, except that we wait for the request
+     * to be woken up instead of putting it back on the run queue */
+    for(;;)
+    {
+        CHITCP_PROBE(handler_entry, req->code, req->request_id);
+        rc = handlers[req->code](si, ha, r, req, &r->resp);
+        CHITCP_PROBE(handler_exit, req->code, req->request_id, rc);
+        if (rc != CHITCP_EWOULDBLOCK)
+            break;
+
+        pthread_mutex_lock(&si->lock_poll);
+        if (ha->stopping)
+        {
+            /* The stack is going away, so this is never going to finish */
+            pthread_mutex_unlock(&si->lock_poll);
+            r->resp.ret = -1;
+            r->resp.error_code = ESHUTDOWN;
+            rc = CHITCP_OK;
+            break;
+        }
+        if (!r->waiter.notified)
+        {
+            r->parked = TRUE;
+            while (r->parked)
+                pthread_cond_wait(&cv_local, &si->lock_poll);
+        }
+        r->waiter.notified = FALSE;
+        pthread_mutex_unlock(&si->lock_poll);
+    }
+
+    if (rc != CHITCP_OK)
+        chilog(ERROR, "Error when handling request.");
+
+    chitcpd_handler_unwait(si, r);
+    chitcpd_handler_record_latency(si, req->code, r->start);
+    r->cv_local = NULL;
+    pthread_cond_destroy(&cv_local);
+
+    chitcpd_msg__init(&r->resp_msg);
+    r->resp_msg.code = CHITCPD_MSG_CODE__RESP;
+    r->resp_msg.resp = &r->resp;
+    r->resp_msg.request_id = req->request_id;
+    *resp_p = &r->resp_msg;
+
+    return CHITCP_OK;
+}
+
+
+/* See handlers.h */
+void chitcpd_handler_release(handler_thread_args_t *ha, ChitcpdMsg *resp)
+{
+    handler_pool_t *pool = ha->si->handler_pool;
+    handler_request_t *r;
+    bool_t idle;
+
+    r = (handler_request_t *) ((uint8_t *) resp - offsetof(handler_request_t, resp_msg));
+
+    pthread_mutex_lock(&ha->handler_lock);
+    chitcpd_handler_keep_recv_buf(ha, r);
+    pthread_mutex_unlock(&ha->handler_lock);
+
+    free(r->recv_buf);
+
+    pthread_mutex_lock(&pool->lock);
+    DL_DELETE(ha->running, r);
+    idle = ha->stopping && ha->running == NULL;
+    chitcpd_handler_recycle(r);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (idle)
+        chitcpd_handler_free_connection(pool, ha);
+}
+
+
+/* See handlers.h */
+void chitcpd_handler_remove_local_connection(handler_thread_args_t *ha)
+{
+    chitcpd_handler_disconnect(ha->si->handler_pool, ha);
+}
+
+
+/* See handlers.h */
+void chitcpd_handler_stop_pool(serverinfo_t *si)
+{
+    handler_pool_t *pool = si->handler_pool;
+    handler_thread_args_t *ha;
+    uint64_t one = 1;
+
+    if (pool == NULL)
+        return;
+
+    /* Shutting down a connection's socket makes it readable, and its
+     * reader will then find out the client is gone. We don't want to
+     * shut it down while a response is being sent. */
+    pthread_mutex_lock(&pool->lock);
+    DL_FOREACH(pool->connections, ha)
+    {
+        pthread_mutex_lock(&ha->handler_lock);
+        shutdown(ha->client_socket, SHUT_RDWR);
+        pthread_mutex_unlock(&ha->handler_lock);
+    }
+    while (pool->connections != NULL && pool->polling)
+        pthread_cond_wait(&pool->cv_connections, &pool->lock);
+
+    pool->done = TRUE;
+    pthread_cond_broadcast(&pool->cv_run_queue);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (write(pool->wakeup_fd, &one, sizeof(one)) != sizeof(one))
+        perror("Could not wake up the handler pool's poll thread");
+
+    if (pool->polling)
+        pthread_join(pool->poll_thread, NULL);
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    close(pool->epoll_fd);
+    close(pool->wakeup_fd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cv_run_queue);
+    pthread_cond_destroy(&pool->cv_connections);
+    free(pool->threads);
+    free(pool);
+    si->handler_pool = NULL;
+
+    chilog(DEBUG, "Handler pool has stopped.");
+}
+
+
+
+/* Handler for chisocket_socket() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
+{
+    int domain, type, protocol;
+    int socket_index, ret;
+    ChitcpdSocketArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SOCKET");
+
+    /* Unpack request */
+    assert(req_msg->socket_args != NULL);
+    req = req_msg->socket_args;
+
+    domain = req->domain;
+    type = req->type;
+    protocol = req->protocol;
+
+    ret = chitcpd_allocate_socket(si, &socket_index);
+
+    if(ret == CHITCP_OK)
+    {
+        /* The socket belongs to this connection (not to the worker
+         * thread that happens to be handling the request) */
+        CHISOCKET_ENTRY(si, socket_index)->cold->creator = ha;
+        CHISOCKET_ENTRY(si, socket_index)->domain = domain;
+        CHISOCKET_ENTRY(si, socket_index)->type = type;
+        CHISOCKET_ENTRY(si, socket_index)->protocol = protocol;
+#ifdef SOCK_NONBLOCK
+        if (type & SOCK_NONBLOCK)
+        {
+            CHISOCKET_ENTRY(si, socket_index)->type = type & ~SOCK_NONBLOCK;
+            CHISOCKET_ENTRY(si, socket_index)->nonblocking = TRUE;
+        }
+#endif
+
+        resp->ret = socket_index;
+        resp->error_code = 0;
+    }
+    else
+    {
+        resp->ret = -1;
+        resp->error_code = ENOMEM;
+    }
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SOCKET");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_bind() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
+{
+    int addrlen;
+    struct sockaddr* addr;
+    chisocket_t sockfd;
+    int ret, error_code = 0;;
+    ChitcpdBindArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__BIND");
+
+    /* Unpack request */
+    assert(req_msg->bind_args != NULL);
+    req = req_msg->bind_args;
+
+    sockfd = req->sockfd;
+    addrlen = req->addr.len;
+    addr = (struct sockaddr*) req->addr.data;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(entry->tcp_state != CLOSED)
+    {
+        chilog(ERROR, "Tried to bind a non-CLOSED socket: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    /* TODO: Check whether socket is already bound to an address.
+     *       The socket API only allows a socket to be bound once. */
+
+    /* Extract port from address, and verify whether it is valid */
+    uint16_t port;
+
+    port = chitcp_ntohs(chitcp_get_addr_port(addr));
+
+    if (port < 0)
+    {
+        chilog(ERROR, "Port could not be extracted from address.");
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    int rc = chitcpd_reserve_port(si, entry, port);
+
+    if (rc == CHITCP_EINVAL)
+    {
+        chilog(ERROR, "Invalid port specified: %i", port);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+    else if (rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Port is already taken: %i", port);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    /* Bind address to socket */
+    chilog(DEBUG, "Socket %i will take port %i", sockfd, port);
+
+    /* TODO: Validate that the local address actually
+     * corresponds to one our interfaces */
+
+    /* Set local address */
+    memcpy(&entry->local_addr, addr, addrlen);
+
+    /* Set remote address */
+    entry->remote_addr.ss_family = entry->local_addr.ss_family;
+    chitcp_addr_set_any((struct sockaddr *) &entry->remote_addr);
+    chitcp_set_addr_port((struct sockaddr *) &entry->remote_addr, 0);
+
+    if (chitcpd_index_socket(si, entry) != CHITCP_OK)
+    {
+        chitcpd_release_port(si, entry, port);
+        ret = -1;
+        error_code = EADDRINUSE;
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__BIND");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_listen() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__LISTEN)
+{
+    chisocket_t sockfd;
+    int backlog;
+    int ret, error_code = 0;;
+    ChitcpdListenArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__LISTEN");
+
+    /* Unpack request */
+    assert(req_msg->listen_args != NULL);
+    req = req_msg->listen_args;
+
+    sockfd = req->sockfd;
+    backlog = req->backlog;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(entry->tcp_state != CLOSED)
+    {
+        chilog(ERROR, "Tried to listen() a non-CLOSED socket: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    /* Update the socket to reflect that this will be a passive socket */
+    passive_chisocket_state_t *socket_state;
+
+    CHISOCKET_ENTRY(si, sockfd)->actpas_type = SOCKET_PASSIVE;
+    socket_state = &CHISOCKET_ENTRY(si, sockfd)->socket_state.passive;
+    entry->tcp_state = LISTEN;
+
+    socket_state->backlog = backlog;
+
+    socket_state->syn_queue = NULL;
+    socket_state->accept_queue = NULL;
+    socket_state->syn_qlen = 0;
+    socket_state->accept_qlen = 0;
+    pthread_cond_init(&socket_state->cv_accept, NULL);
+
+    ret = 0;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__LISTEN");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_accept() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
+{
+    chisocket_t sockfd;
+    int socket_index;
+    int ret, error_code = 0;;
+    ChitcpdAcceptArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__ACCEPT");
+
+    /* Unpack request */
+    assert(req_msg->accept_args != NULL);
+    req = req_msg->accept_args;
+
+    sockfd = req->sockfd;
+
+    /* The socket may have been closed while we were waiting */
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available ||
+       (r->registered && r->reg.entry == NULL))
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+    chisocketentry_t *active_entry;
+
+    if(entry->actpas_type != SOCKET_PASSIVE)
+    {
+        /* We need to check this because sockets spawned by a passive socket are
+         * (fleetingly) in the LISTEN state. */
+        chilog(ERROR, "Tried to accept() a socket that is not passive: %i", sockfd);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    if(entry->tcp_state != LISTEN)
+    {
+        chilog(ERROR, "Tried to accept() a socket that is not in LISTEN state: %i", sockfd);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    /* Get the next established connection from the accept queue.
+     * If there are none, then wait until one arrives (unless the
+     * socket is non-blocking). The three-way handshake is done by
+     * the spawned socket, as soon as the SYN arrives. */
+    if(!entry->nonblocking)
+        chitcpd_handler_watch(si, r, entry);
+
+    pthread_mutex_lock(&si->lock_listen);
+    if(socket_state->accept_queue == NULL && entry->nonblocking)
+    {
+        pthread_mutex_unlock(&si->lock_listen);
+        ret = -1;
+        error_code = EAGAIN;
+        goto done;
+    }
+    if(socket_state->accept_queue == NULL)
+    {
+        pthread_mutex_unlock(&si->lock_listen);
+        if(chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+            return CHITCP_EWOULDBLOCK;
+        ret = -1;
+        error_code = EINTR;
+        goto done;
+    }
+    active_entry = socket_state->accept_queue;
+    DL_DELETE2(socket_state->accept_queue, active_entry, socket_state.active.lq_prev, socket_state.active.lq_next);
+    socket_state->accept_qlen--;
+    active_entry->socket_state.active.listen_queue = LISTEN_QUEUE_NONE;
+
+    /* The socket now belongs to the accepting handler */
+    active_entry->cold->creator = ha;
+    pthread_mutex_unlock(&si->lock_listen);
+
+    socket_index = SOCKET_NO(si, active_entry);
+
+    chilog(DEBUG, "[S%i] Accepted connection on socket S%i", sockfd, socket_index);
+
+    ret = socket_index;
+
+    /* Create chitcpd response address information */
+    resp->has_addr = TRUE;
+    resp->addr.data = (uint8_t *) &active_entry->remote_addr;
+
+    /* Finding the length of this address turns out to be complicated. */
+#ifdef SIN6_LEN
+    if(active_entry->remote_addr.ss_len != 0)
+        resp->addr.len = active_entry->remote_addr.ss_len;
+#else
+    switch(active_entry->remote_addr.ss_family)
+    {
+    case AF_INET:
+        resp->addr.len = sizeof(struct sockaddr_in);
+    case AF_INET6:
+        resp->addr.len = sizeof(struct sockaddr_in6);
+    default:
+        resp->addr.len = sizeof(struct sockaddr_storage);
+    }
+#endif
+
+done:
+    /* Create response return code */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__ACCEPT");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_connect() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
+{
+    chisocket_t sockfd;
+    int addrlen;
+    struct sockaddr_storage addr;
+    int ret, error_code = 0;;
+    ChitcpdConnectArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__CONNECT");
+
+    /* Unpack request */
+    assert(req_msg->connect_args != NULL);
+    req = req_msg->connect_args;
+
+    sockfd = req->sockfd;
+    addrlen = req->addr.len;
+    memcpy(&addr, req->addr.data, addrlen);
+
+    /* We have already started connecting, and are waiting for the
+     * connection to be established */
+    if(r->step == 1)
+        goto wait;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    active_chisocket_state_t *socket_state;
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+    int port;
+
+    if(entry->tcp_state != CLOSED)
+    {
+        chilog(ERROR, "Tried to connect a non-CLOSED socket: %i %i", sockfd, entry->tcp_state);
+        ret = -1;
+        error_code = EALREADY;
+        goto done;
+    }
+
+    /* Under memory pressure, new connections are refused (as they are
+     * by listeners, see chitcpd_deliver_passive), since the buffers of
+     * a connected socket are charged even if they don't fit */
+    if(mem_budget_pressure(&si->mem))
+    {
+        ret = -1;
+        error_code = ENOBUFS;
+        goto done;
+    }
+
+    /* Reserve an available ephemeral port */
+    port = chitcpd_reserve_ephemeral_port(si, entry);
+
+    if(port == -1)
+    {
+        ret = -1;
+        error_code = EAGAIN;
+        goto done;
+    }
+
+    /* Initialize socket entry */
+    entry = CHISOCKET_ENTRY(si, sockfd);
+    entry->actpas_type = SOCKET_ACTIVE;
+    socket_state = &entry->socket_state.active;
+
+    tcp_data_init(si, entry);
+    tx_flow_init(&socket_state->tx_flow);
+
+    atomic_init(&socket_state->events, TCP_EVENT_SLEEPING);
+    pthread_mutex_init(&socket_state->lock_event, NULL);
+    pthread_cond_init(&socket_state->cv_event, NULL);
+
+    /* Zero out the local address, effectively binding the local address
+     * to the ANY address. This is not ideal, but will work.
+     * Ideally, we would query the routing table to determine what
+     * interface we would use for the specified remote_address, and
+     * set the local_address to the address of that interface.
+     *
+     * Note: We treat the loopback address as a special case because
+     * that is what will be used for the tests. */
+    bzero(&entry->local_addr, sizeof(struct sockaddr_storage));
+    if (chitcp_addr_is_loopback((struct sockaddr *) &addr))
+    {
+        memcpy(&entry->local_addr,  &addr, sizeof(struct sockaddr_storage));
+    }
+    entry->local_addr.ss_family = addr.ss_family;
+    chitcp_set_addr_port((struct sockaddr *) &entry->local_addr, chitcp_htons(port));
+
+    /* Copy remote address */
+    memcpy(&entry->remote_addr, &addr, sizeof(struct sockaddr_storage));
+
+    /* Update demultiplexing index. If another socket already has the
+     * same addresses (e.g., one bound with SO_REUSEPORT), this one would
+     * never get its packets, so the socket goes back to being unused */
+    if(chitcpd_index_socket(si, entry) != CHITCP_OK)
+    {
+        chitcpd_release_port(si, entry, port);
+        tcp_data_free(si, entry);
+        pthread_mutex_destroy(&socket_state->lock_event);
+        pthread_cond_destroy(&socket_state->cv_event);
+        bzero(&entry->local_addr, sizeof(struct sockaddr_storage));
+        bzero(&entry->remote_addr, sizeof(struct sockaddr_storage));
+        entry->actpas_type = SOCKET_UNINITIALIZED;
+        ret = -1;
+        error_code = EADDRINUSE;
+        goto done;
+    }
+
+    /* See if we are already connected to the chiTCP daemon on the peer
+     * (and, if so, which of the connections the socket is hashed onto) */
+    socket_state->realtcpconn = chitcpd_get_connection(si, (struct sockaddr*) &entry->local_addr, (struct sockaddr*) &entry->remote_addr);
+
+    /* If not, establish a connection with the peer's chiTCP daemon */
+    if(socket_state->realtcpconn == NULL)
+    {
+        chilog(DEBUG, "No connection entry found, creating one.");
+        socket_state->realtcpconn = chitcpd_create_connection(si, (struct sockaddr*) &entry->local_addr, (struct sockaddr*) &entry->remote_addr);
+    }
+
+    /* A MSG_FASTOPEN connect (see chisocket_sendto) uses TCP Fast Open
+     * even if TCP_FASTOPEN wasn't set on the socket */
+    if(req->fastopen)
+        entry->fastopen = TRUE;
+
+    /* Start socket thread */
+    chitcpd_tcp_start_thread(si, CHISOCKET_ENTRY(si, sockfd));
+
+    /* The data is queued before the SYN is sent, so it can go in the
+     * SYN (see chitcpd_tcp_state_handle_CLOSED). The buffer is still
+     * empty, so what doesn't fit in it is simply not sent */
+    if(req->fastopen && req->data.len > 0)
+    {
+        circular_buffer_t *send = &socket_state->tcp_data.send;
+        int nbytes = circular_buffer_write(send, req->data.data, MIN(req->data.len, (size_t) circular_buffer_available(send)), FALSE);
+
+        r->done = MAX(nbytes, 0);
+    }
+
+    /* Signal the TCP thread to let it know that the application
+     * has produced a CONNECT event. This will trigger a three-way
+     * handshake with the peer. A blocking connect() watches the socket
+     * before that, so it sees every state the socket goes through. */
+    if(!entry->nonblocking)
+        chitcpd_handler_watch(si, r, entry);
+
+    chilog(TRACE, "Signaling socket thread...");
+    pthread_mutex_lock(&entry->lock_tcp_state);
+    chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_CONNECT);
+    pthread_mutex_unlock(&entry->lock_tcp_state);
+
+    /* A non-blocking socket becomes writable once it is connected
+     * (see chitcpd_poll_socket). A MSG_FASTOPEN connect returns the
+     * number of bytes it queued instead (they are sent once they can) */
+    if(entry->nonblocking && req->fastopen)
+    {
+        ret = r->done;
+        goto done;
+    }
+    if(entry->nonblocking)
+    {
+        ret = -1;
+        error_code = EINPROGRESS;
+        goto done;
+    }
+    r->step = 1;
+
+wait:
+    /* Wait for socket to enter ESTABLISHED state. Since the registration
+     * remembers the states the socket has been in, it doesn't matter if
+     * the peer has already started tearing the connection down. */
+    chilog(TRACE, "Waiting for ESTABLISHED...");
+    {
+        bool_t gone;
+        unsigned int states = chitcpd_handler_seen_states(si, r, &gone);
+
+        if(!(states & (1 << ESTABLISHED)))
+        {
+            /* TODO: Implement ETIMEDOUT return value in connect() */
+            if(gone || ((states & (1 << SYN_SENT)) && CHISOCKET_ENTRY(si, sockfd)->tcp_state == CLOSED))
+            {
+                chilog(TRACE, "Socket was closed before it was ESTABLISHED");
+                ret = -1;
+                error_code = ECONNREFUSED;
+                goto done;
+            }
+
+            if(chitcpd_handler_park(si, r, CHISOCKET_ENTRY(si, sockfd)) == CHITCP_EWOULDBLOCK)
+                return CHITCP_EWOULDBLOCK;
+            ret = -1;
+            error_code = EINTR;
+            goto done;
+        }
+    }
+
+    chilog(TRACE, "Socket connection is ESTABLISHED");
+
+    /* A MSG_FASTOPEN connect returns the number of bytes it queued */
+    ret = req->fastopen? (int) r->done : 0;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__CONNECT");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_send_check - Check that the application can send data on a socket
+ *
+ * si: Server info
+ *
+ * sockfd: Socket
+ *
+ * error_code: Output parameter to return the error (if any)
+ *
+ * Returns: The socket entry, or NULL if data can't be sent on the socket.
+ *
+ */
+static chisocketentry_t *chitcpd_send_check(serverinfo_t *si, chisocket_t sockfd, int *error_code)
+{
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        *error_code = EBADF;
+        return NULL;
+    }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(entry->tcp_state == CLOSED)
+    {
+        chilog(ERROR, "Tried to send() on a CLOSED socket: %i", sockfd);
+        *error_code = ENOTCONN;
+        return NULL;
+    }
+
+    if (entry->tcp_state == LISTEN )
+    {
+        /* This is allowed by the TCP standard, but we do not support it
+         * in chitcp */
+        chilog(ERROR, "Tried to send() on a LISTEN socket: %i", sockfd);
+        *error_code = EOPNOTSUPP;
+        return NULL;
+    }
+
+    if (entry->tcp_state != SYN_SENT    && entry->tcp_state != SYN_RCVD   &&
+        entry->tcp_state != ESTABLISHED && entry->tcp_state != CLOSE_WAIT    )
+    {
+        chilog(ERROR, "Tried to send() on a closing socket: %i", sockfd);
+        *error_code = ENOTCONN;
+        return NULL;
+    }
+
+    return entry;
+}
+
+
+/*
+ * chitcpd_send_buffer - Write data to a socket's send buffer
+ *
+ * If the socket is connected, its TCP thread is notified that there
+ * is data to send. This never waits for space in the buffer: it only
+ * writes as much as fits right now (handlers that have to send more
+ * park their request until there is space, see chitcpd_handler_park).
+ *
+ * si: Server info
+ *
+ * entry: Socket entry (see chitcpd_send_check)
+ *
+ * data, length: Data to write
+ *
+ * Returns: The number of bytes written (zero if the buffer has been
+ *          closed), or CHITCP_EWOULDBLOCK if the buffer is full.
+ *
+ */
+static int chitcpd_send_buffer(serverinfo_t *si, chisocketentry_t *entry, uint8_t *data, size_t length)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    tcp_data_t *tcp_data = &socket_state->tcp_data;
+    int nbytes;
+
+    if (tcp_data->send.closed)
+        return 0;
+
+    length = MIN(length, (size_t) circular_buffer_available(&tcp_data->send));
+
+    if (length == 0)
+        return CHITCP_EWOULDBLOCK;
+
+    nbytes = circular_buffer_write(&tcp_data->send, data, length, FALSE);
+
+    /* If the socket is still being synchronized, we enqueue the data,
+     * but we don't notify the TCP thread (unless the peer's SYN carried
+     * data with a valid Fast Open cookie, so we can already reply) */
+    if (nbytes > 0 && (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT ||
+                       (entry->tcp_state == SYN_RCVD && tcp_data->tfo_accepted)))
+    {
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_SEND);
+    }
+
+    return nbytes;
+}
+
+
+/* Handler for chitcp_send() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
+{
+    chisocket_t sockfd;
+    uint8_t *data;
+    size_t length;
+    int ret, error_code = 0;;
+    ChitcpdSendArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SEND");
+
+    /* Unpack request */
+    assert(req_msg->send_args != NULL);
+    req = req_msg->send_args;
+
+    sockfd = req->sockfd;
+    if (req->shm_len > 0)
+    {
+        /* The data is in the shared data window */
+        if (ha->shm == NULL || req->shm_offset > ha->shm_size ||
+            req->shm_len > ha->shm_size - req->shm_offset)
+        {
+            chilog(ERROR, "Invalid shared data window region: %u bytes at %u", req->shm_len, req->shm_offset);
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+        length = req->shm_len;
+        data = ha->shm + req->shm_offset;
+    }
+    else
+    {
+        length = req->buf.len;
+        data = req->buf.data;
+    }
+
+    /* TODO: handle the rest of the flags */
+    bool_t blocking = !(req->flags & MSG_DONTWAIT);
+
+    if(length <= 0)
+    {
+        chilog(ERROR, "Invalid length: %zu", length);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    chisocketentry_t *entry = chitcpd_send_check(si, sockfd, &error_code);
+    size_t target;
+    int nbytes;
+
+    /* If the socket stops being usable while we're waiting for space,
+     * we return what we have sent so far */
+    if (entry == NULL || (r->registered && r->reg.entry == NULL))
+    {
+        if (r->done > 0)
+        {
+            ret = r->done;
+            error_code = 0;
+        }
+        else
+        {
+            ret = -1;
+            if (entry != NULL)
+                error_code = EBADF;
+        }
+        goto done;
+    }
+
+    if (entry->nonblocking)
+        blocking = FALSE;
+
+    /* A blocking send() writes as much as fits in the buffer (at most
+     * its capacity), waiting for space if necessary, while a non-blocking
+     * send() only writes as much as fits right now. r->done is what
+     * we have written so far. */
+    target = length;
+    if (blocking)
+    {
+        target = MIN(length, (size_t) circular_buffer_capacity(&entry->socket_state.active.tcp_data.send));
+        chitcpd_handler_watch(si, r, entry);
+    }
+
+    nbytes = chitcpd_send_buffer(si, entry, data + r->done, length - r->done);
+
+    if (nbytes > 0)
+        r->done += nbytes;
+
+    if (blocking && r->done < target && nbytes != 0 && nbytes != CHITCP_ENOMEM)
+    {
+        if (chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+            return CHITCP_EWOULDBLOCK;
+    }
+
+    if (r->done > 0)
+    {
+        ret = r->done;
+        goto done;
+    }
+
+    if (nbytes == CHITCP_EWOULDBLOCK)
+    {
+        ret = -1;
+        error_code = blocking? EINTR : EAGAIN;
+        goto done;
+    }
+
+    /* TODO: Be more discerning about the returned error */
+    if (nbytes < 0)
+    {
+        chilog(ERROR, "circular_buffer_write returned an error: %i", nbytes);
+        ret = -1;
+        error_code = (nbytes == CHITCP_ENOMEM)? ENOMEM : EINVAL;
+        goto done;
+    }
+
+    ret = nbytes;
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SEND");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_sendfile_mmap - Send part of a regular file by mapping it
+ *
+ * The file is mapped SENDFILE_MAP_SIZE bytes at a time, and written
+ * to the socket's send buffer straight from the mapping, until the
+ * send buffer is full.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry (see chitcpd_send_check)
+ *
+ * fd, offset, count: Part of the file to send (which must be in the file)
+ *
+ * Returns: The number of bytes sent, or -1 (with errno set) if nothing
+ *          could be sent. errno is set to EAGAIN if the send buffer
+ *          filled up before everything was sent.
+ *
+ */
+static ssize_t chitcpd_sendfile_mmap(serverinfo_t *si, chisocketentry_t *entry, int fd, off_t offset, size_t count)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t sent = 0;
+
+    while (sent < count)
+    {
+        off_t start = offset + sent;
+        off_t map_start = start - (start % page_size);
+        size_t map_len = MIN(SENDFILE_MAP_SIZE, count - sent + (start - map_start));
+        size_t len = map_len - (start - map_start);
+        size_t written = 0;
+        uint8_t *map;
+        int nbytes;
+
+        map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+        if (map == MAP_FAILED)
+            break;
+
+        while (written < len)
+        {
+            nbytes = chitcpd_send_buffer(si, entry, map + (start - map_start) + written, len - written);
+            if (nbytes <= 0)
+            {
+                errno = (nbytes == CHITCP_EWOULDBLOCK)? EAGAIN : (nbytes == CHITCP_ENOMEM)? ENOMEM : EPIPE;
+                break;
+            }
+            written += nbytes;
+        }
+
+        munmap(map, map_len);
+        sent += written;
+
+        if (written < len)
+            break;
+    }
+
+    if (sent == 0 && count > 0)
+    {
+        if (errno == 0)
+            errno = EAGAIN;
+        return -1;
+    }
+
+    return sent;
+}
+
+
+/*
+ * chitcpd_sendfile_read - Send part of a file by reading it
+ *
+ * This is used for files that can't be mapped (such as pipes). We never
+ * read more than fits in the send buffer, so no data is lost when it
+ * can't all be sent.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry (see chitcpd_send_check)
+ *
+ * fd: File descriptor
+ *
+ * use_offset, offset: Where to start reading from (if use_offset is false,
+ *                     the file's current offset is used)
+ *
+ * count: Number of bytes to send
+ *
+ * Returns: The number of bytes sent, or -1 (with errno set) if nothing
+ *          could be sent. errno is set to EAGAIN if the send buffer
+ *          filled up before everything was sent.
+ *
+ */
+static ssize_t chitcpd_sendfile_read(serverinfo_t *si, chisocketentry_t *entry, int fd, bool_t use_offset, off_t offset,
+                                     size_t count)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    uint8_t *buf;
+    size_t sent = 0;
+
+    if ((buf = malloc(SENDFILE_READ_SIZE)) == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (sent < count)
+    {
+        size_t len = MIN(SENDFILE_READ_SIZE, count - sent);
+        size_t written = 0;
+        ssize_t nread;
+        int nbytes;
+
+        len = MIN(len, (size_t) circular_buffer_available(&tcp_data->send));
+        if (len == 0)
+        {
+            errno = EAGAIN;
+            break;
+        }
+
+        nread = use_offset? pread(fd, buf, len, offset + sent) : read(fd, buf, len);
+        if (nread <= 0)
+            break;
+
+        while (written < (size_t) nread)
+        {
+            nbytes = chitcpd_send_buffer(si, entry, buf + written, nread - written);
+            if (nbytes <= 0)
+            {
+                errno = (nbytes == CHITCP_ENOMEM)? ENOMEM : EPIPE;
+                break;
+            }
+            written += nbytes;
+        }
+        sent += written;
+
+        if (written < (size_t) nread)
+            break;
+    }
+
+    free(buf);
+
+    return (sent == 0 && count > 0 && errno != 0)? -1 : (ssize_t) sent;
+}
+
+
+/* Handler for chisocket_sendfile() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SENDFILE)
+{
+    int ret, error_code = 0;
+    ChitcpdSendfileArgs *req;
+    chisocketentry_t *entry;
+    struct stat st;
+    off_t offset;
+    size_t count;
+    ssize_t nbytes;
+    bool_t use_offset;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SENDFILE");
+
+    /* Unpack request */
+    assert(req_msg->sendfile_args != NULL);
+    req = req_msg->sendfile_args;
+
+    if (req->fd < 0 || fstat(req->fd, &st) == -1)
+    {
+        chilog(ERROR, "sendfile() request did not come with a valid file descriptor");
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    /* If the socket stops being usable while we're waiting for space,
+     * we return what we have sent so far (r->done) */
+    if ((entry = chitcpd_send_check(si, req->sockfd, &error_code)) == NULL ||
+        (r->registered && r->reg.entry == NULL))
+    {
+        if (r->done > 0)
+        {
+            ret = r->done;
+            error_code = 0;
+        }
+        else
+        {
+            ret = -1;
+            if (entry != NULL)
+                error_code = EBADF;
+        }
+        goto done;
+    }
+
+    /* A single response can't report more than this */
+    count = MIN(req->count, (uint64_t) INT32_MAX) - r->done;
+    use_offset = req->use_offset;
+    offset = req->offset + r->done;
+
+    if (use_offset && req->offset < 0)
+    {
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    if (!entry->nonblocking)
+        chitcpd_handler_watch(si, r, entry);
+
+    errno = 0;
+    if (S_ISREG(st.st_mode))
+    {
+        /* The file's current offset is shared with the client's descriptor,
+         * so we have to move it past the data we send */
+        if (!use_offset && (offset = lseek(req->fd, 0, SEEK_CUR)) == -1)
+        {
+            ret = -1;
+            error_code = errno;
+            goto done;
+        }
+
+        count = (offset < st.st_size)? MIN(count, (size_t) (st.st_size - offset)) : 0;
+        if (count == 0)
+            nbytes = 0;
+        else
+            nbytes = chitcpd_sendfile_mmap(si, entry, req->fd, offset, count);
+
+        if (nbytes > 0 && !use_offset)
+            lseek(req->fd, offset + nbytes, SEEK_SET);
+    }
+    else if (use_offset && lseek(req->fd, 0, SEEK_CUR) == -1)
+    {
+        /* Files that can't seek (pipes, sockets) can't be sent from an offset */
+        ret = -1;
+        error_code = ESPIPE;
+        goto done;
+    }
+    else
+        nbytes = chitcpd_sendfile_read(si, entry, req->fd, use_offset, offset, count);
+
+    if (nbytes > 0)
+        r->done += nbytes;
+
+    /* A blocking sendfile() waits for space in the send buffer until
+     * everything has been sent (or the end of the file is reached) */
+    if (!entry->nonblocking && errno == EAGAIN)
+    {
+        if (chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+            return CHITCP_EWOULDBLOCK;
+    }
+
+    if (r->done > 0)
+    {
+        ret = r->done;
+        goto done;
+    }
+
+    if (nbytes < 0)
+    {
+        ret = -1;
+        error_code = (errno == EAGAIN && !entry->nonblocking)? EINTR : errno;
+        goto done;
+    }
+
+    ret = nbytes;
+
+done:
+    if (req->fd >= 0)
+    {
+        close(req->fd);
+        req->fd = -1;
+    }
+
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SENDFILE");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_recv_lowat - Number of bytes a blocking recv() has to wait for
+ *
+ * This is the socket's SO_RCVLOWAT (or, with MSG_WAITALL, the number of
+ * bytes requested), but never more than "len" or than the receive buffer
+ * can hold (or the recv() would never return).
+ *
+ * entry: Socket entry (of an active socket)
+ *
+ * len: Number of bytes requested
+ *
+ * waitall: True if MSG_WAITALL was given
+ *
+ * Returns: Number of bytes (at least one).
+ *
+ */
+static uint32_t chitcpd_recv_lowat(chisocketentry_t *entry, size_t len, bool_t waitall)
+{
+    circular_buffer_t *recv = &entry->socket_state.active.tcp_data.recv;
+    size_t lowat = waitall? len : MIN(len, entry->rcvlowat);
+
+    return MAX(MIN(lowat, (size_t) circular_buffer_capacity(recv)), 1);
+}
+
+
+/*
+ * chitcpd_handler_recv_buf - Get a buffer for the data returned by RECV
+ *
+ * A RECV takes the connection's buffer (growing it, if needed), and
+ * gives it back once it has sent its response (see chitcpd_handler_complete),
+ * so most RECVs don't have to allocate anything. A RECV that runs alongside
+ * another one gets a buffer of its own, which is kept instead if it is
+ * larger. RECVs in a batch just get a buffer in the request's arena.
+ *
+ * ha: Connection
+ *
+ * r: Request
+ *
+ * resp: Response the data will be returned in
+ *
+ * len: Number of bytes needed
+ *
+ * Returns: A buffer of at least "len" bytes, or NULL if it could not
+ *          be allocated.
+ *
+ */
+static uint8_t *chitcpd_handler_recv_buf(handler_thread_args_t *ha, handler_request_t *r, ChitcpdResp *resp, size_t len)
+{
+    uint8_t *buf;
+
+    if (resp != &r->resp)
+        return chitcpd_arena_alloc(&r->arena, len);
+
+    if (r->recv_buf == NULL)
+    {
+        pthread_mutex_lock(&ha->handler_lock);
+        r->recv_buf = ha->recv_buf;
+        r->recv_buf_size = ha->recv_buf_size;
+        ha->recv_buf = NULL;
+        ha->recv_buf_size = 0;
+        pthread_mutex_unlock(&ha->handler_lock);
+    }
+
+    if (r->recv_buf_size < len)
+    {
+        if ((buf = realloc(r->recv_buf, len)) == NULL)
+            return NULL;
+        r->recv_buf = buf;
+        r->recv_buf_size = len;
+    }
+
+    return r->recv_buf;
+}
+
+
+/* Handler for chisocket_recv() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
+{
+    chisocket_t sockfd;
+    size_t length;
+    int ret, error_code = 0;;
+    ChitcpdRecvArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__RECV");
+
+    /* Unpack request */
+    assert(req_msg->recv_args != NULL);
+    req = req_msg->recv_args;
+
+    sockfd = req->sockfd;
+    length = req->len;
+    bool_t blocking = !(req->flags & MSG_DONTWAIT);
+    bool_t peeking = (req->flags & MSG_PEEK) != 0;
+    bool_t waitall = (req->flags & MSG_WAITALL) != 0;
+
+    if(length <= 0)
+    {
+        chilog(ERROR, "Invalid length: %zu", length);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+
+    /* Like a closed buffer, a socket that was freed while we were
+     * waiting for data means there is no more data */
+    if(r->registered && r->reg.entry == NULL)
+    {
+        ret = 0;
+        goto done;
+    }
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(entry->tcp_state == CLOSED)
+    {
+        chilog(ERROR, "Tried to recv() on a CLOSED socket: %i", sockfd);
+        ret = -1;
+        error_code = ENOTCONN;
+        goto done;
+    }
+
+    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_PASSIVE)
+    {
+        chilog(ERROR, "Cannot recv() on a passive socket: %i", sockfd);
+        ret = -1;
+        error_code = ENOTCONN;
+        goto done;
+    }
+
+    else if (entry->tcp_state == LAST_ACK    || entry->tcp_state == TIME_WAIT ||
+             entry->tcp_state == CLOSING)
+    {
+        ret = 0;
+        goto done;
+    }
+
+    /* Extract maximum possible data from buffer. If there is not enough
+     * data to receive, a blocking recv() waits for more to arrive */
+    active_chisocket_state_t *socket_state;
+    tcp_data_t *tcp_data;
+    uint8_t *dst;
+    size_t avail;
+    uint32_t lowat;
+    bool_t direct;
+    int nbytes;
+
+    if (entry->nonblocking)
+        blocking = FALSE;
+
+    socket_state = &CHISOCKET_ENTRY(si, sockfd)->socket_state.active;
+    tcp_data = &CHISOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
+
+    if (blocking)
+        chitcpd_handler_watch(si, r, entry);
+
+    /* Once the peer has closed its side, no more data will arrive,
+     * so a recv() on an empty buffer is at its end */
+    if (entry->tcp_state == CLOSE_WAIT && circular_buffer_count(&tcp_data->recv) == 0)
+    {
+        ret = 0;
+        goto done;
+    }
+
+    /* A blocking recv() waits for the low watermark (or, with MSG_WAITALL,
+     * for everything it asked for). Once the peer has closed its side, no
+     * more data will arrive, so it returns what there is. As on Linux, a
+     * non-blocking recv() returns whatever there is. */
+    if (blocking && entry->tcp_state != CLOSE_WAIT)
+        lowat = chitcpd_recv_lowat(entry, length, waitall);
+    else
+        lowat = 1;
+
+    if (blocking && (uint32_t) circular_buffer_count(&tcp_data->recv) < lowat && !tcp_data->recv.closed)
+    {
+        if (chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+            return CHITCP_EWOULDBLOCK;
+
+        /* The client is gone, so nobody is going to get the data anyway */
+        ret = 0;
+        goto done;
+    }
+
+    /* The response is sized to the data that is there. More data may
+     * arrive before we read it, but we only return what we made room for
+     * (less may be left, if another request reads from the socket too). */
+    avail = MIN(length, (size_t) circular_buffer_count(&tcp_data->recv));
+    dst = NULL;
+    nbytes = tcp_data->recv.closed? 0 : CHITCP_EWOULDBLOCK;
+
+    /* The data goes in the response, unless it can be copied straight to
+     * where the client wants it: the shared data window or, for an
+     * in-process client, its own buffer (see chitcpd_handler_call) */
+    direct = req->use_shm || (r->recv_dst != NULL && resp == &r->resp);
+
+    if (req->use_shm)
+    {
+        /* Return the data through the shared data window */
+        if (ha->shm == NULL || req->shm_offset > ha->shm_size ||
+            length > ha->shm_size - req->shm_offset)
+        {
+            chilog(ERROR, "Invalid shared data window region: %zu bytes at %u", length, req->shm_offset);
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+        dst = ha->shm + req->shm_offset;
+    }
+    else if (direct)
+        dst = r->recv_dst;
+    else if (avail > 0 && (dst = chitcpd_handler_recv_buf(ha, r, resp, avail)) == NULL)
+    {
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
+    if (avail > 0)
+        nbytes = circular_buffer_read_lowat(&tcp_data->recv, dst, avail, lowat, FALSE, peeking);
+
+    if (nbytes == CHITCP_EWOULDBLOCK && blocking)
+    {
+        /* Someone else got to the data first */
+        if (chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+            return CHITCP_EWOULDBLOCK;
+        ret = 0;
+        goto done;
+    }
+
+    if (nbytes == CHITCP_EWOULDBLOCK)
+    {
+        ret = -1;
+        error_code = EAGAIN;
+        goto done;
+    }
+
+    /* TODO: Be more discerning about the returned error */
+    if (nbytes < 0)
+    {
+        chilog(ERROR, "circular_buffer_read returned an error: %i", nbytes);
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
+    if (nbytes == 0)
+    {
+        /* This means the buffer has been closed (either by TCP, or
+         * because this connection's handler is stopping) */
+        assert(ha->stopping                   ||
+               entry->tcp_state == CLOSING    ||
+               entry->tcp_state == TIME_WAIT  ||
+               entry->tcp_state == CLOSE_WAIT ||
+               entry->tcp_state == LAST_ACK   ||
+               entry->tcp_state == CLOSED);
+
+        ret = 0;
+        goto done;
+    }
+
+    chilog(DEBUG, "recv() has %s %i bytes from the recv buffer", peeking? "peeked" : "extracted", nbytes);
+
+    /* We don't signal the TCP thread if the connection has not yet
+     * been synchronized (or if the data is still in the buffer) */
+    if (!peeking && (entry->tcp_state == ESTABLISHED ||
+                     entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2))
+    {
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_RECV);
+    }
+
+    ret = nbytes;
+
+    /* Create response payload */
+    if (!direct)
+    {
+        resp->has_buf = TRUE;
+        resp->buf.data = dst;
+        resp->buf.len = nbytes;
+    }
+
+ done:
+    /* Create response return value */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__RECV");
+
+    return CHITCP_OK;
+}
+
+
+/* Handler for chisocket_close() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdCloseArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__CLOSE");
+
+    /* Unpack request */
+    assert(req_msg->close_args != NULL);
+    req = req_msg->close_args;
+
+    sockfd = req->sockfd;
+
+    chilog(TRACE, ">>> CLOSE sockfd=%i", sockfd);
+
+    /* We have already signalled the TCP thread, and are waiting for
+     * a closing state (see below) */
+    if(r->step > 0)
+        goto wait;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
-        error_code = EINVAL;
+        error_code = EBADF;
         goto done;
     }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
 
-    /* Bind address to socket */
-    chilog(DEBUG, "Socket %i will take port %i", sockfd, port);
+    if(entry->tcp_state == CLOSED)
+    {
+        chilog(ERROR, "Tried to close() a CLOSED socket: %i", sockfd);
+        ret = -1;
+        error_code = ENOTCONN;
+        goto done;
+    }
 
-    /* TODO: Validate that the local address actually
-     * corresponds to one our interfaces */
+    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_PASSIVE)
+    {
+        /* Since this is a passive socket, there is no TCP thread, so we
+         * can simply go ahead and release its resources */
+        /* TODO: If chitcp ever implements ICMP, we would need to sent
+         * ICMP messages to any pending connections to let them know
+         * this socket has been closed. */
+        chitcpd_free_socket_entry(si, entry);
+        ret = 0;
+        goto done;
+    }
 
-    /* Set local address */
-    memcpy(&entry->local_addr, addr, addrlen);
+    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_ACTIVE)
+    {
+        /* Very unlikely this will happen, since an active LISTEN socket
+         * almost immediately transitions to SYN_RCVD. */
+        chilog(ERROR, "Not supported: close()ing an active LISTEN socket: %i", sockfd);
+        ret = -1;
+        error_code = EOPNOTSUPP;
+        goto done;
+    }
 
-    /* Set remote address */
-    entry->remote_addr.ss_family = entry->local_addr.ss_family;
-    chitcp_addr_set_any((struct sockaddr *) &entry->remote_addr);
-    chitcp_set_addr_port((struct sockaddr *) &entry->remote_addr, 0);
+    if (entry->tcp_state == SYN_SENT)
+    {
+        /* Not supported. TCP standard requires:
+         *
+         *     SYN-SENT STATE
+         *
+         *       Delete the TCB and return "error:  closing" responses to any
+         *       queued SENDs, or RECEIVEs.
+         *
+         */
+        chilog(ERROR, "Not supported: close()ing a SYN_SENT socket: %i", sockfd);
+        ret = -1;
+        error_code = EOPNOTSUPP;
+        goto done;
+    }
+
+    /* A socket accepted with the data in its peer's SYN (see
+     * chitcpd_listen_update) may be closed before the handshake is
+     * complete. As the TCP standard requires (see below), the close
+     * then waits until the socket is ESTABLISHED */
+    if (entry->tcp_state == SYN_RCVD && entry->socket_state.active.tcp_data.tfo_accepted)
+    {
+        chitcpd_handler_watch(si, r, entry);
+
+        if (entry->tcp_state == SYN_RCVD)
+        {
+            if (chitcpd_handler_park(si, r, entry) == CHITCP_EWOULDBLOCK)
+                return CHITCP_EWOULDBLOCK;
+            ret = -1;
+            error_code = EINTR;
+            goto done;
+        }
+    }
+
+    if (entry->tcp_state == SYN_RCVD)
+    {
+        /* Not supported. TCP standard requires:
+         *
+         *     SYN-RECEIVED STATE
+         *
+         *       If no SENDs have been issued and there is no pending data to send,
+         *       then form a FIN segment and send it, and enter FIN-WAIT-1 state;
+         *       otherwise queue for processing after entering ESTABLISHED state.
+         *
+         */
+        chilog(ERROR, "Not supported: close()ing a SYN_RCVD socket: %i", sockfd);
+        ret = -1;
+        error_code = EOPNOTSUPP;
+        goto done;
+    }
+
+    if (entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2  ||
+        entry->tcp_state == CLOSING     || entry->tcp_state == LAST_ACK    ||
+        entry->tcp_state == TIME_WAIT )
+    {
+        chilog(ERROR, "Tried to close() an already closing socket: %i", sockfd);
+        ret = -1;
+        error_code = ENOTCONN;
+        goto done;
+    }
+
+    /* ESTABLISHED or CLOSE_WAIT */
+
+    /* Signal the TCP thread that the application has
+     * requested that the connection be closed. We watch the socket
+     * before that, so we see every state the socket goes through. */
+    chitcpd_handler_watch(si, r, entry);
+
+    chilog(TRACE, "Signaling socket thread...");
+    pthread_mutex_lock(&entry->lock_tcp_state);
+
+    /* TODO: According to RFC 793, we actually shouldn't return from close()
+     * until we're in FIN_WAIT_2 *and* the retransmission queue is empty.
+     * However, a simultaneous close could land us in CLOSING or TIME_WAIT */
+    if (entry->tcp_state == ESTABLISHED)
+        r->step = CLOSE_FROM_ESTABLISHED;
+    else if (entry->tcp_state == CLOSE_WAIT)
+        r->step = CLOSE_FROM_CLOSE_WAIT;
+    else
+    {
+        pthread_mutex_unlock(&entry->lock_tcp_state);
+        chilog(ERROR, "Socket entered an inconsist"
+                "ent state (should be ESTABLISHED or CLOSE_WAIT)");
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+
+    chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_CLOSE);
+    pthread_mutex_unlock(&entry->lock_tcp_state);
+
+wait:
+    /* Wait for socket to enter a valid closing state */
+    chilog(TRACE, "Waiting for closing state...");
+    {
+        unsigned int closing_states, states;
+        bool_t gone;
+
+        if (r->step == CLOSE_FROM_ESTABLISHED)
+            closing_states = (1 << FIN_WAIT_2) | (1 << CLOSING) | (1 << TIME_WAIT) | (1 << CLOSED);
+        else
+            closing_states = (1 << LAST_ACK) | (1 << CLOSED);
 
-    si->port_table[port] = entry;
+        states = chitcpd_handler_seen_states(si, r, &gone);
+
+        /* A socket that has been freed went all the way to CLOSED */
+        if (gone)
+            chilog(TRACE, "Socket is in CLOSED state");
+        else if (states & closing_states)
+            chilog(TRACE, "Socket entered a closing state");
+        else
+        {
+            if (chitcpd_handler_park(si, r, CHISOCKET_ENTRY(si, sockfd)) == CHITCP_EWOULDBLOCK)
+                return CHITCP_EWOULDBLOCK;
+            ret = -1;
+            error_code = EINTR;
+            goto done;
+        }
+    }
 
     ret = 0;
 
@@ -380,89 +2805,167 @@ done:
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__BIND");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__CLOSE");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chisocket_listen() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__LISTEN)
+/* Handler for chitcpd_get_socket_state() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE)
 {
     chisocket_t sockfd;
-    int backlog;
     int ret, error_code = 0;;
-    ChitcpdListenArgs *req;
+    ChitcpdGetSocketStateArgs *req;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__LISTEN");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_STATE");
 
     /* Unpack request */
-    assert(req_msg->listen_args != NULL);
-    req = req_msg->listen_args;
+    assert(req_msg->get_socket_state_args != NULL);
+    req = req_msg->get_socket_state_args;
 
     sockfd = req->sockfd;
-    backlog = req->backlog;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available || CHISOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
 
-    if(entry->tcp_state != CLOSED)
+    resp->socket_state = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdSocketState));
+
+    if (!resp->socket_state)
     {
-        chilog(ERROR, "Tried to listen() a non-CLOSED socket: %i", sockfd);
         ret = -1;
-        error_code = EBADF;
+        error_code = ENOMEM;
         goto done;
     }
 
-    /* Update the socket to reflect that this will be a passive socket */
-    passive_chisocket_state_t *socket_state;
+    chitcpd_socket_state__init(resp->socket_state);
 
-    si->chisocket_table[sockfd].actpas_type = SOCKET_PASSIVE;
-    socket_state = &si->chisocket_table[sockfd].socket_state.passive;
-    entry->tcp_state = LISTEN;
+    resp->socket_state->tcp_state = CHISOCKET_ENTRY(si, sockfd)->tcp_state;
+    tcp_data_t *tcp_data = &CHISOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
+    resp->socket_state->iss = tcp_data->ISS;
+    resp->socket_state->irs = tcp_data->IRS;
+    resp->socket_state->snd_una = tcp_data->SND_UNA;
+    resp->socket_state->rcv_nxt = tcp_data->RCV_NXT;
+    resp->socket_state->snd_nxt = tcp_data->SND_NXT;
+    resp->socket_state->rcv_wnd = tcp_data->RCV_WND;
+    resp->socket_state->snd_wnd = tcp_data->SND_WND;
+
+    ret = 0;
+
+ done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_STATE");
+
+    return CHITCP_OK;
+}
+
+/* Handler for chitcpd_get_socket_buffer_contents() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdGetSocketBufferContentsArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS");
+
+    /* Unpack request */
+    assert(req_msg->get_socket_buffer_contents_args != NULL);
+    req = req_msg->get_socket_buffer_contents_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available || CHISOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+    }
+    else
+    {
+        resp->socket_buffer_contents = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdSocketBufferContents));
+
+        if (!resp->socket_buffer_contents)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+        }
+        else
+        {
+            chitcpd_socket_buffer_contents__init(resp->socket_buffer_contents);
+
+            tcp_data_t *tcp_data = &CHISOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
+
+            ret = 0;
+
+            int snd_len = circular_buffer_count(&tcp_data->send);
+            uint8_t *snd_data = chitcpd_arena_alloc(&r->arena, snd_len);
+            if (!snd_data)
+            {
+                ret = -1;
+                error_code = ENOMEM;
+            }
+            int rcv_len = circular_buffer_count(&tcp_data->recv);
+            uint8_t *rcv_data = chitcpd_arena_alloc(&r->arena, rcv_len);
+            if (!rcv_data)
+            {
+                ret = -1;
+                error_code = ENOMEM;
+            }
 
-    socket_state->backlog = backlog;
+            /* Get the data itself, if the allocation succeeded and len > 0 */
+            if (snd_data && snd_len)
+                circular_buffer_peek(&tcp_data->send, snd_data, snd_len, FALSE);
+            if (rcv_data && rcv_len)
+                circular_buffer_peek(&tcp_data->recv, rcv_data, rcv_len, FALSE);
 
-    socket_state->pending_connections = NULL;
-    pthread_mutex_init(&socket_state->lock_pending_connections, NULL);
-    pthread_cond_init(&socket_state->cv_pending_connections, NULL);
+            resp->socket_buffer_contents->snd.len = snd_len;
+            resp->socket_buffer_contents->snd.data = snd_data;
 
-    ret = 0;
+            resp->socket_buffer_contents->rcv.len = rcv_len;
+            resp->socket_buffer_contents->rcv.data = rcv_data;
+        }
+    }
 
-done:
     /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__LISTEN");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chisocket_accept() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
+/* Handler for chitcpd_wait_for_state() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
 {
     chisocket_t sockfd;
-    int socket_index;
-    int ret, error_code = 0;;
-    ChitcpdAcceptArgs *req;
+    int ret, error_code = 0;
+    tcp_state_t tcp_state;
+    ChitcpdWaitForStateArgs *req;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__ACCEPT");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__WAIT_FOR_STATE");
 
     /* Unpack request */
-    assert(req_msg->accept_args != NULL);
-    req = req_msg->accept_args;
+    assert(req_msg->wait_for_state_args != NULL);
+    req = req_msg->wait_for_state_args;
 
     sockfd = req->sockfd;
+    tcp_state = req->tcp_state;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    /* We are already watching the socket (which may have been freed since) */
+    if(r->registered)
+        goto wait;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
@@ -470,295 +2973,293 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
         goto done;
     }
 
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
-    passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
-    pending_connection_t *pending_connection;
-
-    if(entry->actpas_type != SOCKET_PASSIVE)
+    if(CHISOCKET_ENTRY(si, sockfd)->available && tcp_state == CLOSED)
     {
-        /* We need to check this because sockets spawned by a passive socket are
-         * (fleetingly) in the LISTEN state. */
-        chilog(ERROR, "Tried to accept() a socket that is not passive: %i", sockfd);
-        ret = -1;
-        error_code = EINVAL;
+        chilog(TRACE, "Waiting for CLOSED, but socket %i has already been freed, so returning", sockfd);
+        ret = 0;
+
         goto done;
     }
 
-    if(entry->tcp_state != LISTEN)
+    if(CHISOCKET_ENTRY(si, sockfd)->available || CHISOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
     {
-        chilog(ERROR, "Tried to accept() a socket that is not in LISTEN state: %i", sockfd);
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
-        error_code = EINVAL;
+        error_code = EBADF;
         goto done;
     }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
 
-    /* Get the next pending connection from the pending connection queue.
-     * If there are no pending connections, then block until one arrives */
-    pthread_mutex_lock(&socket_state->lock_pending_connections);
-    while(socket_state->pending_connections == NULL)
-        pthread_cond_wait(&socket_state->cv_pending_connections, &socket_state->lock_pending_connections);
-    pending_connection = socket_state->pending_connections;
-    DL_DELETE(socket_state->pending_connections, pending_connection);
-    pthread_mutex_unlock(&socket_state->lock_pending_connections);
-
-    /* Allocate a socket. This will be an active socket */
-    ret = chitcpd_allocate_socket(si, &socket_index);
-
-    if(ret != CHITCP_OK)
+    if(!IS_VALID_TCP_STATE(tcp_state))
     {
+        chilog(ERROR, "Not a valid TCP state: %i", tcp_state);
         ret = -1;
-        error_code = ENOMEM;
+        error_code = EINVAL;
         goto done;
     }
 
-    chilog(MINIMAL, "[S%i] Passive socket has spawned active socket S%i", sockfd, socket_index);
-
-    /* Initialize the socket entry */
-    chisocketentry_t *active_entry = &si->chisocket_table[socket_index];
-    active_chisocket_state_t *active_socket_state = &active_entry->socket_state.active;
-    struct sockaddr* local_addr = (struct sockaddr*) &pending_connection->local_addr;
-    struct sockaddr* remote_addr = (struct sockaddr*) &pending_connection->remote_addr;
-
-    active_entry->domain = entry->domain;
-    active_entry->type = entry->type;
-    active_entry->protocol = entry->protocol;
-
-    active_entry->actpas_type = SOCKET_ACTIVE;
-    active_socket_state->parent_socket = entry;
-
-    tcp_data_init(si, active_entry);
-
-    active_socket_state->flags.raw = 0;
-    pthread_mutex_init(&active_socket_state->lock_event, NULL);
-    pthread_cond_init(&active_socket_state->cv_event, NULL);
-
-    active_socket_state->realtcpconn = chitcpd_get_connection(si, remote_addr);
-
-    memcpy(&active_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
-    memcpy(&active_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
-
-    enum chitcpd_debug_response r =
-        chitcpd_debug_breakpoint(si, sockfd, DBG_EVT_PENDING_CONNECTION, socket_index);
+    /* The registration remembers the states the socket has been in,
+     * so we don't miss states the socket only goes through briefly */
+    chitcpd_handler_watch(si, r, entry);
 
-    if (r != DBG_RESP_NONE)
+wait:
     {
-        chilog(ERROR, "Unexpected return value in DBG_EVT_PENDING_CONNECTION breakpoint.");
-    }
-
-    /* Linking of the debug monitor to the new socket
-     * (if r == DBG_RESP_ACCEPT_MONITOR) is actually performed _within_
-     * chitcpd_debug_breakpoint, in order to avoid a race condition. */
-
-    /* Strictly speaking, the socket should transition to SYN_RCVD
-     * because we've received a SYN packet. However, this transition
-     * is handled in the TCP thread, not here. So, we initialize
-     * the state of the socket to LISTEN (even though only the passive
-     * socket should have that state), so that the transition will
-     * correctly happen in the TCP thread. */
-    active_entry->tcp_state = LISTEN;
-
-    pthread_mutex_lock(&active_socket_state->tcp_data.lock_pending_packets);
-    chilog(TRACE, "accept() initial packet: enqueueing a copy");
-    chitcp_packet_list_append(&active_socket_state->tcp_data.pending_packets, pending_connection->initial_packet);
-    pthread_mutex_unlock(&active_socket_state->tcp_data.lock_pending_packets);
-
-    /* Start TCP thread */
-    chitcpd_tcp_start_thread(si, &si->chisocket_table[socket_index]);
-
-    pthread_mutex_lock(&active_entry->lock_tcp_state);
-    /* Signal the thread to indicate there is an incoming packet
-     * Assuming it's a SYN packet, this will initiate the three-way
-     * handshake with the peer */
-    chilog(TRACE, "Signaling socket thread...");
-    pthread_mutex_lock(&active_socket_state->lock_event);
-    active_socket_state->flags.net_recv = 1;
-    pthread_cond_broadcast(&active_socket_state->cv_event);
-    pthread_mutex_unlock(&active_socket_state->lock_event);
-
-    /* Wait for socket to enter ESTABLISHED state */
-    chilog(TRACE, "Waiting for ESTABLISHED...");
-    while(active_entry->tcp_state != ESTABLISHED)
-        pthread_cond_wait(&active_entry->cv_tcp_state, &active_entry->lock_tcp_state);
-    pthread_mutex_unlock(&active_entry->lock_tcp_state);
-
-    chilog(TRACE, "Socket connection is ESTABLISHED");
-
-    free(pending_connection);
+        bool_t gone;
+        unsigned int states = chitcpd_handler_seen_states(si, r, &gone);
 
-    ret = socket_index;
-
-    /* Create chitcpd response address information */
-    resp->has_addr = TRUE;
-    resp->addr.data = (uint8_t *) &active_entry->remote_addr;
+        chilog(TRACE, "Socket %i is %s. Waiting for %s.", sockfd, gone? "freed" : tcp_str(CHISOCKET_ENTRY(si, sockfd)->tcp_state), tcp_str(tcp_state));
+        if (!(states & (1 << tcp_state)))
+        {
+            if (gone)
+            {
+                /* A freed socket went all the way to CLOSED */
+                ret = (tcp_state == CLOSED)? 0 : -1;
+                error_code = (tcp_state == CLOSED)? 0 : EBADF;
+                goto done;
+            }
 
-    /* Finding the length of this address turns out to be complicated. */
-#ifdef SIN6_LEN
-    if(active_entry->remote_addr.ss_len != 0)
-        resp->addr.len = active_entry->remote_addr.ss_len;
-#else
-    switch(active_entry->remote_addr.ss_family)
-    {
-    case AF_INET:
-        resp->addr.len = sizeof(struct sockaddr_in);
-    case AF_INET6:
-        resp->addr.len = sizeof(struct sockaddr_in6);
-    default:
-        resp->addr.len = sizeof(struct sockaddr_storage);
+            if (chitcpd_handler_park(si, r, CHISOCKET_ENTRY(si, sockfd)) == CHITCP_EWOULDBLOCK)
+                return CHITCP_EWOULDBLOCK;
+            ret = -1;
+            error_code = EINTR;
+            goto done;
+        }
     }
-#endif
 
-done:
-    /* Create response return code */
+    ret = 0;
+
+ done:
+    /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__ACCEPT");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__WAIT_FOR_STATE");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chisocket_connect() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
+/* Handler for chisocket_setsockopt() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SETSOCKOPT)
 {
     chisocket_t sockfd;
-    int addrlen;
-    struct sockaddr_storage addr;
-    int ret, error_code = 0;;
-    ChitcpdConnectArgs *req;
+    int rc, ret, error_code = 0;
+    uint32_t size;
+    ChitcpdSockoptArgs *req;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__CONNECT");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SETSOCKOPT");
 
     /* Unpack request */
-    assert(req_msg->connect_args != NULL);
-    req = req_msg->connect_args;
+    assert(req_msg->sockopt_args != NULL);
+    req = req_msg->sockopt_args;
 
     sockfd = req->sockfd;
-    addrlen = req->addr.len;
-    memcpy(&addr, req->addr.data, addrlen);
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
 
-    tcpconnentry_t *connection;
-    active_chisocket_state_t *socket_state;
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
-    int port;
-
-    if(entry->tcp_state != CLOSED)
+    if(req->level == IPPROTO_TCP && req->optname == TCP_CONGESTION)
     {
-        chilog(ERROR, "Tried to connect a non-CLOSED socket: %i %i", sockfd, entry->tcp_state);
-        ret = -1;
-        error_code = EALREADY;
+        /* The algorithm is set up when the connection starts */
+        if(tcp_cc_get(req->optval) == NULL)
+        {
+            ret = -1;
+            error_code = ENOENT;
+            goto done;
+        }
+        if(entry->actpas_type == SOCKET_ACTIVE && entry->tcp_state != CLOSED)
+        {
+            ret = -1;
+            error_code = EISCONN;
+            goto done;
+        }
+
+        entry->cc_algorithm = req->optval;
+        ret = 0;
         goto done;
     }
 
-    /* See if we are already connected to the chiTCP daemon on the peer */
-    connection = chitcpd_get_connection(si, (struct sockaddr*) &addr);
-
-    /* If not, establish a connection with the peer's chiTCP daemon */
-    if(connection == NULL)
+    if(req->level == IPPROTO_TCP && req->optname == TCP_FASTOPEN)
     {
-        chilog(DEBUG, "No connection entry found, creating one.");
-        connection = chitcpd_create_connection(si, (struct sockaddr*) &addr);
-    }
+        /* Like TCP_CONGESTION, this only matters when the connection
+         * starts (Linux takes the length of the queue of connections
+         * that haven't been acknowledged yet, but they all go in the
+         * listener's SYN queue here, so it is only a flag) */
+        if(entry->actpas_type == SOCKET_ACTIVE && entry->tcp_state != CLOSED)
+        {
+            ret = -1;
+            error_code = EISCONN;
+            goto done;
+        }
 
-    /* Find available ephemeral port */
-    port = chitcpd_find_ephemeral_port(si);
+        entry->fastopen = (req->optval != 0);
+        ret = 0;
+        goto done;
+    }
 
-    if(port == -1)
+    if(req->level == IPPROTO_TCP && (req->optname == TCP_NODELAY || req->optname == TCP_QUICKACK))
     {
-        ret = -1;
-        error_code = EAGAIN;
+        bool_t on = (req->optval != 0);
+
+        if(req->optname == TCP_NODELAY)
+            entry->nodelay = on;
+        else
+            entry->quickack = on;
+
+        /* The TCP thread only reads these from tcp_data (they are copied
+         * there when it starts). Like Linux, setting TCP_NODELAY sends
+         * any data that Nagle's algorithm was holding back. */
+        if(entry->actpas_type == SOCKET_ACTIVE)
+        {
+            active_chisocket_state_t *socket_state = &entry->socket_state.active;
+
+            if(req->optname == TCP_NODELAY)
+                socket_state->tcp_data.nodelay = on;
+            else
+                socket_state->tcp_data.quickack = on;
+
+            if(on && req->optname == TCP_NODELAY &&
+               (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT))
+            {
+                chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_SEND);
+            }
+        }
+
+        ret = 0;
         goto done;
     }
 
-    /* Initialize socket entry */
-    entry = &si->chisocket_table[sockfd];
-    entry->actpas_type = SOCKET_ACTIVE;
-    socket_state = &entry->socket_state.active;
+    if(req->level == SOL_SOCKET && req->optname == SO_RCVLOWAT)
+    {
+        if(req->optval < 0)
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
 
-    tcp_data_init(si, entry);
+        /* As on Linux, zero means one. Parked recv() calls and polls
+         * pick up the new value the next time they are woken up. */
+        entry->rcvlowat = MAX(req->optval, 1);
+        ret = 0;
+        goto done;
+    }
 
-    socket_state->flags.raw = 0;
-    pthread_mutex_init(&socket_state->lock_event, NULL);
-    pthread_cond_init(&socket_state->cv_event, NULL);
+    if(req->level == SOL_SOCKET && req->optname == SO_PRIORITY)
+    {
+        /* As on Linux, priorities above 6 are reserved */
+        if(req->optval < 0 || req->optval > TX_PRIO_STRICT)
+        {
+            ret = -1;
+            error_code = EPERM;
+            goto done;
+        }
 
-    socket_state->realtcpconn = connection;
+        /* The connection's scheduler picks up the new priority the
+         * next time the socket has segments queued */
+        entry->priority = req->optval;
+        ret = 0;
+        goto done;
+    }
 
-    /* Zero out the local address, effectively binding the local address
-     * to the ANY address. This is not ideal, but will work.
-     * Ideally, we would query the routing table to determine what
-     * interface we would use for the specified remote_address, and
-     * set the local_address to the address of that interface.
-     *
-     * Note: We treat the loopback address as a special case because
-     * that is what will be used for the tests. */
-    bzero(&entry->local_addr, sizeof(struct sockaddr_storage));
-    if (chitcp_addr_is_loopback((struct sockaddr *) &addr))
+    if(req->level == SOL_SOCKET && req->optname == SO_MAX_PACING_RATE)
     {
-        memcpy(&entry->local_addr,  &addr, sizeof(struct sockaddr_storage));
+        if(req->optval < 0 && req->optval != CHITCP_PACING_AUTO)
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        /* CHITCP_PACING_AUTO is stored as UINT32_MAX. The TCP thread
+         * picks up the new rate the next time it sends data */
+        entry->pacing_rate = (uint32_t) req->optval;
+        if(entry->actpas_type == SOCKET_ACTIVE)
+            entry->socket_state.active.tcp_data.pacing_rate = entry->pacing_rate;
+
+        ret = 0;
+        goto done;
     }
-    entry->local_addr.ss_family = addr.ss_family;
-    chitcp_set_addr_port((struct sockaddr *) &entry->local_addr, chitcp_htons(port));
 
-    /* Copy remote address */
-    memcpy(&entry->remote_addr, &addr, sizeof(struct sockaddr_storage));
+    if(req->level == SOL_SOCKET && req->optname == SO_REUSEPORT)
+    {
+        /* Whether the port can be shared is decided when binding */
+        if(entry->demux_index != DEMUX_INDEX_NONE)
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
 
-    /* Update port table */
-    si->port_table[port] = entry;
+        entry->reuseport = (req->optval != 0);
+        ret = 0;
+        goto done;
+    }
 
+    if(req->level != SOL_SOCKET || (req->optname != SO_SNDBUF && req->optname != SO_RCVBUF))
+    {
+        chilog(ERROR, "Unsupported socket option: level=%i optname=%i", req->level, req->optname);
+        ret = -1;
+        error_code = ENOPROTOOPT;
+        goto done;
+    }
 
-    /* Start socket thread */
-    chitcpd_tcp_start_thread(si, &si->chisocket_table[sockfd]);
+    if(req->optval <= 0)
+    {
+        ret = -1;
+        error_code = EINVAL;
+        goto done;
+    }
 
-    /* Signal the TCP thread to let it know that the application
-     * has produced a CONNECT event. This will trigger a three-way
-     * handshake with the peer. */
-    chilog(TRACE, "Signaling socket thread...");
-    pthread_mutex_lock(&entry->lock_tcp_state);
-    pthread_mutex_lock(&socket_state->lock_event);
-    socket_state->flags.app_connect = 1;
-    pthread_cond_broadcast(&socket_state->cv_event);
-    pthread_mutex_unlock(&socket_state->lock_event);
+    /* Like other stacks, we silently clamp the requested size */
+    size = MIN(MAX((uint32_t) req->optval, TCP_BUFFER_MIN), si->tcp_buf_max);
 
-    /* Wait for socket to enter ESTABLISHED state */
-    chilog(TRACE, "Waiting for ESTABLISHED...");
-    /* TODO: There is a potential race condition here, where the thread
-     *       will wake up to check the condition variable, but it will have
-     *       gone past the ESTABLISHED state because the peer has already
-     *       initiated a condition teardown. So far, this race condition
-     *       only manifested itself in the tests, and we fixed that
-     *       by ensuring the tests don't initiate a connection tear-down until
-     *       the socket is in an ESTABLISHED state.
-     *
-     *       Solving this issue would require additional variables / synchronization
-     *       to ensure that a connection teardown cannot be initiated if the socket
-     *       is in ESTABLISHED state by connect() hasn't returned yet.
-     */
-    while(entry->tcp_state != ESTABLISHED)
+    /* If the socket is already connected, its buffers can grow right
+     * away. They are never shrunk, since they may hold more data than
+     * would fit in the new size. Note that the receive window of a
+     * connected socket can't grow past what its window scale allows,
+     * and that the buffers of sockets that aren't autotuned are SPSC
+     * buffers (see chitcpd_tcp_start_thread), which can't grow at all. */
+    if(entry->actpas_type == SOCKET_ACTIVE)
     {
-        struct timespec ts;
-        int rc;
+        tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+        circular_buffer_t *buf = (req->optname == SO_SNDBUF)? &tcp_data->send : &tcp_data->recv;
+        uint32_t capacity = circular_buffer_capacity(buf);
+        uint32_t grown = (size > capacity)? size - capacity : 0;
 
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
+        /* The buffer only grows if the memory budget can take it */
+        if(capacity > 0 && grown > 0 && !mem_budget_charge(&si->mem, grown, TRUE))
+        {
+            ret = -1;
+            error_code = ENOBUFS;
+            goto done;
+        }
 
-        /* TODO: Implement ETIMEDOUT return value in connect() */
-        rc = pthread_cond_timedwait(&entry->cv_tcp_state, &entry->lock_tcp_state, &ts);
-        if (rc == ETIMEDOUT)
+        if(capacity > 0 && (rc = circular_buffer_resize(buf, size)) != CHITCP_OK)
         {
-            chilog(TRACE, "Waiting for ESTABLISHED... [timeout, state=%i]", entry->tcp_state);
+            mem_budget_uncharge(&si->mem, grown);
+            ret = -1;
+            error_code = (rc == CHITCP_ENOMEM)? ENOMEM : EINVAL;
+            goto done;
         }
+
+        if(capacity > 0)
+            tcp_data->buf_mem += grown;
     }
-    pthread_mutex_unlock(&entry->lock_tcp_state);
 
-    chilog(TRACE, "Socket connection is ESTABLISHED");
+    /* Setting a size explicitly stops the buffers from being autotuned */
+    entry->buf_autotune = FALSE;
+
+    if(req->optname == SO_SNDBUF)
+        entry->sndbuf_size = size;
+    else
+        entry->rcvbuf_size = size;
 
     ret = 0;
 
@@ -767,394 +3268,750 @@ done:
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__CONNECT");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SETSOCKOPT");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chitcp_send() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
+/* Handler for chisocket_getsockopt() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GETSOCKOPT)
 {
     chisocket_t sockfd;
-    uint8_t *data;
-    size_t length;
-    int ret, error_code = 0;;
-    ChitcpdSendArgs *req;
+    int ret, error_code = 0;
+    ChitcpdSockoptArgs *req;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SEND");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GETSOCKOPT");
 
     /* Unpack request */
-    assert(req_msg->send_args != NULL);
-    req = req_msg->send_args;
+    assert(req_msg->sockopt_args != NULL);
+    req = req_msg->sockopt_args;
 
     sockfd = req->sockfd;
-    length = req->buf.len;
-    data = req->buf.data;
-
-    /* TODO: handle the different flags */
-    /* int flags = req->flags; */
 
-    if(length <= 0)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
     {
-        chilog(ERROR, "Invalid length: %i", length);
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
-        error_code = EINVAL;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(req->level == IPPROTO_TCP && (req->optname == TCP_NODELAY || req->optname == TCP_QUICKACK))
+    {
+        ret = (req->optname == TCP_NODELAY)? entry->nodelay : entry->quickack;
+        goto done;
+    }
+
+    if(req->level == IPPROTO_TCP && req->optname == TCP_CONGESTION)
+    {
+        ret = entry->cc_algorithm;
         goto done;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(req->level == IPPROTO_TCP && req->optname == TCP_FASTOPEN)
     {
-        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
+        ret = entry->fastopen;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
 
-    if(entry->tcp_state == CLOSED)
+    if(req->level == SOL_SOCKET && req->optname == SO_RCVLOWAT)
     {
-        chilog(ERROR, "Tried to send() on a CLOSED socket: %i", sockfd);
-        ret = -1;
-        error_code = ENOTCONN;
+        ret = entry->rcvlowat;
         goto done;
     }
 
-    if (entry->tcp_state == LISTEN )
+    if(req->level == SOL_SOCKET && req->optname == SO_PRIORITY)
     {
-        /* This is allowed by the TCP standard, but we do not support it
-         * in chitcp */
-        chilog(ERROR, "Tried to send() on a LISTEN socket: %i", sockfd);
-        ret = -1;
-        error_code = EOPNOTSUPP;
+        ret = entry->priority;
         goto done;
     }
 
-    if (entry->tcp_state != SYN_SENT    && entry->tcp_state != SYN_RCVD   &&
-        entry->tcp_state != ESTABLISHED && entry->tcp_state != CLOSE_WAIT    )
+    if(req->level == SOL_SOCKET && req->optname == SO_MAX_PACING_RATE)
     {
-        chilog(ERROR, "Tried to send() on a closing socket: %i", sockfd);
-        ret = -1;
-        error_code = ENOTCONN;
+        ret = (int) entry->pacing_rate;
         goto done;
     }
 
-    active_chisocket_state_t *socket_state;
-    tcp_data_t *tcp_data;
-    socket_state = &entry->socket_state.active;
-    tcp_data = &socket_state->tcp_data;
-    int nbytes;
-
-    nbytes = circular_buffer_write(&tcp_data->send, data, length, BUFFER_BLOCKING);
-
-    /* TODO: Be more discerning about the returned error */
-    if (nbytes < 0)
+    if(req->level == SOL_SOCKET && req->optname == SO_REUSEPORT)
     {
-        chilog(ERROR, "circular_buffer_write returned an error: %i", nbytes);
-        ret = -1;
-        error_code = EINVAL;
+        ret = entry->reuseport;
         goto done;
     }
 
-    /* If the socket is still being synchronized, we enqueue the data,
-     * but we don't notify the TCP thread */
-    if (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT)
+    if(req->level != SOL_SOCKET || (req->optname != SO_SNDBUF && req->optname != SO_RCVBUF))
     {
-        pthread_mutex_lock(&socket_state->lock_event);
-        socket_state->flags.app_send = 1;
-        pthread_cond_broadcast(&socket_state->cv_event);
-        pthread_mutex_unlock(&socket_state->lock_event);
+        chilog(ERROR, "Unsupported socket option: level=%i optname=%i", req->level, req->optname);
+        ret = -1;
+        error_code = ENOPROTOOPT;
+        goto done;
     }
 
-    ret = nbytes;
+    /* The socket's sizes are kept up to date when its buffers grow */
+    if(req->optname == SO_SNDBUF)
+        ret = entry->sndbuf_size;
+    else
+        ret = entry->rcvbuf_size;
 
 done:
     /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SEND");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GETSOCKOPT");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chisocket_recv() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
+/* Handler for chisocket_fcntl() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__FCNTL)
 {
     chisocket_t sockfd;
-    size_t length;
-    int ret, error_code = 0;;
-    ChitcpdRecvArgs *req;
+    int ret, error_code = 0;
+    ChitcpdFcntlArgs *req;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__RECV");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__FCNTL");
 
     /* Unpack request */
-    assert(req_msg->recv_args != NULL);
-    req = req_msg->recv_args;
+    assert(req_msg->fcntl_args != NULL);
+    req = req_msg->fcntl_args;
 
     sockfd = req->sockfd;
-    length = req->len;
-    /* TODO: handle the different flags */
-    if(length <= 0)
-    {
-        chilog(ERROR, "Invalid length: %i", length);
-        ret = -1;
-        error_code = EINVAL;
-        goto done;
-    }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = CHISOCKET_ENTRY(si, sockfd);
 
-    if(entry->tcp_state == CLOSED)
+    if(req->cmd == F_GETFL)
+        ret = O_RDWR | (entry->nonblocking? O_NONBLOCK : 0);
+    else if(req->cmd == F_SETFL)
     {
-        chilog(ERROR, "Tried to recv() on a CLOSED socket: %i", sockfd);
+        /* O_NONBLOCK is the only status flag a chisocket has */
+        entry->nonblocking = (req->arg & O_NONBLOCK) != 0;
+        ret = 0;
+    }
+    else
+    {
+        chilog(ERROR, "Unsupported fcntl() command: %i", req->cmd);
         ret = -1;
-        error_code = ENOTCONN;
-        goto done;
+        error_code = EINVAL;
     }
 
-    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_PASSIVE)
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__FCNTL");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_poll_socket - Find out what a socket is ready for
+ *
+ * These are the conditions under which a non-blocking call on the socket
+ * would not fail with EAGAIN (or, for a non-blocking connect(), under which
+ * the connection has been established):
+ *  - POLLIN: accept() on a passive socket with pending connections, or
+ *            recv() on an active socket with data (or at its end).
+ *  - POLLOUT: send() on a connected socket with space in its send buffer.
+ *  - POLLHUP: the connection is closing or closed (or was never opened).
+ *  - POLLNVAL: not a valid socket (sockets that have gone through the
+ *              whole TCP termination are freed, so they end up here).
+ *
+ * si: Server info
+ *
+ * sockfd: Socket
+ *
+ * Returns: The events the socket is ready for.
+ *
+ */
+static int chitcpd_poll_socket(serverinfo_t *si, chisocket_t sockfd)
+{
+    chisocketentry_t *entry;
+    tcp_data_t *tcp_data;
+    int revents = 0;
+
+    if(sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available)
+        return POLLNVAL;
+    entry = CHISOCKET_ENTRY(si, sockfd);
+
+    if(entry->actpas_type == SOCKET_PASSIVE)
     {
-        chilog(ERROR, "Cannot recv() on a passive socket: %i", sockfd);
-        ret = -1;
-        error_code = ENOTCONN;
-        goto done;
+        passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
+
+        pthread_mutex_lock(&si->lock_listen);
+        if(socket_state->accept_queue != NULL)
+            revents |= POLLIN;
+        pthread_mutex_unlock(&si->lock_listen);
+
+        return revents;
     }
+    else if(entry->actpas_type != SOCKET_ACTIVE)
+        return POLLHUP;
 
-    else if (entry->tcp_state == LAST_ACK    || entry->tcp_state == TIME_WAIT ||
-             entry->tcp_state == CLOSING)
+    tcp_data = &entry->socket_state.active.tcp_data;
+
+    switch(entry->tcp_state)
     {
-        ret = 0;
-        goto done;
+    case ESTABLISHED:
+    case FIN_WAIT_1:
+    case FIN_WAIT_2:
+        if((uint32_t) circular_buffer_count(&tcp_data->recv) >= chitcpd_recv_lowat(entry, SIZE_MAX, FALSE) || tcp_data->recv.closed)
+            revents |= POLLIN;
+        if(entry->tcp_state == ESTABLISHED && circular_buffer_available(&tcp_data->send) > 0)
+            revents |= POLLOUT;
+        break;
+    case CLOSE_WAIT:
+        /* recv() returns the rest of the data, and then zero */
+        revents |= POLLIN;
+        if(circular_buffer_available(&tcp_data->send) > 0)
+            revents |= POLLOUT;
+        break;
+    case CLOSING:
+    case LAST_ACK:
+    case TIME_WAIT:
+        /* recv() returns zero right away in these states */
+        revents |= POLLIN | POLLHUP;
+        break;
+    case CLOSED:
+        revents |= POLLHUP;
+        break;
+    case SYN_RCVD:
+        /* A socket accepted with the data in its peer's SYN (see
+         * chitcpd_listen_update) can already be read and written */
+        if(tcp_data->tfo_accepted)
+        {
+            if((uint32_t) circular_buffer_count(&tcp_data->recv) >= chitcpd_recv_lowat(entry, SIZE_MAX, FALSE))
+                revents |= POLLIN;
+            if(circular_buffer_available(&tcp_data->send) > 0)
+                revents |= POLLOUT;
+        }
+        break;
+    default:
+        /* Still synchronizing */
+        break;
     }
 
-    /* Extract maximum possible data from buffer.
-     * This call may block if there is no data to receive */
-    active_chisocket_state_t *socket_state;
-    tcp_data_t *tcp_data;
-    int nbytes;
+    return revents;
+}
 
-    socket_state = &si->chisocket_table[sockfd].socket_state.active;
-    tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
 
-    resp->buf.data = malloc(length);
-    nbytes = circular_buffer_read(&tcp_data->recv, resp->buf.data, length, BUFFER_BLOCKING);
+/*
+ * chitcpd_poll_scan - Find out which of the sockets in a poll request are ready
+ *
+ * si: Server info
+ *
+ * req: Poll request
+ *
+ * revents: Array where the events of each socket are stored
+ *
+ * Returns: The number of sockets with events.
+ *
+ */
+static int chitcpd_poll_scan(serverinfo_t *si, ChitcpdPollArgs *req, int32_t *revents)
+{
+    int nready = 0;
 
-    /* TODO: Be more discerning about the returned error */
-    if (nbytes < 0)
+    for (size_t i = 0; i < req->n_fds; i++)
     {
-        chilog(ERROR, "circular_buffer_write returned an error: %i", nbytes);
-        ret = -1;
-        error_code = EINVAL;
-        goto done;
+        /* As in poll(), negative descriptors are ignored, and errors
+         * and hang-ups are always reported */
+        if (req->fds[i]->sockfd < 0)
+            revents[i] = 0;
+        else
+            revents[i] = chitcpd_poll_socket(si, req->fds[i]->sockfd) &
+                         (req->fds[i]->events | POLLERR | POLLHUP | POLLNVAL);
+
+        if (revents[i])
+            nready++;
     }
-    if (nbytes == 0)
+
+    return nready;
+}
+
+
+/*
+ * chitcpd_handler_poll_timeout - Timer callback of a POLL request's timeout
+ *
+ * mt: The request's multitimer
+ *
+ * timer: The timer that expired
+ *
+ * args: The request
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_handler_poll_timeout(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    handler_request_t *r = (handler_request_t *) args;
+    serverinfo_t *si = r->ha->si;
+
+    pthread_mutex_lock(&si->lock_poll);
+    r->timed_out = TRUE;
+    r->waiter.notified = TRUE;
+    chitcpd_handler_wake(&r->waiter, r);
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+
+/* Handler for chisocket_poll() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__POLL)
+{
+    int ret, error_code = 0;
+    ChitcpdPollArgs *req;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__POLL");
+
+    /* Unpack request */
+    assert(req_msg->poll_args != NULL);
+    req = req_msg->poll_args;
+
+    if (resp->revents == NULL)
     {
-        /* This means the buffer has been closed */
-        assert(entry->tcp_state == CLOSING    ||
-               entry->tcp_state == TIME_WAIT  ||
-               entry->tcp_state == CLOSE_WAIT ||
-               entry->tcp_state == LAST_ACK   ||
-               entry->tcp_state == CLOSED);
+        resp->revents = chitcpd_arena_calloc(&r->arena, req->n_fds + 1, sizeof(int32_t));
+        if (resp->revents == NULL)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        resp->n_revents = req->n_fds;
+    }
+
+    if (r->regs == NULL && req->timeout != 0)
+    {
+        /* Register on every socket before checking them, so we can't
+         * miss a change. The timeout (if any) is on the timer wheel. */
+        r->regs = calloc(req->n_fds + 1, sizeof(poll_registration_t));
+        if (r->regs == NULL)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        r->num_regs = 0;
+        r->waiter.notified = TRUE;
+        for (size_t i = 0; i < req->n_fds; i++)
+            if (req->fds[i]->sockfd >= 0 && req->fds[i]->sockfd < si->chisocket_table_size)
+                chitcpd_poll_register(si, CHISOCKET_ENTRY(si, req->fds[i]->sockfd), &r->regs[r->num_regs++], &r->waiter);
+
+        if (req->timeout > 0)
+        {
+            if (mt_init_wheel(&r->mt, 1, &si->timer_wheel) != CHITCP_OK)
+            {
+                ret = -1;
+                error_code = ENOMEM;
+                goto done;
+            }
+            r->has_timer = TRUE;
+            mt_set_timer_name(&r->mt, 0, "POLL");
+            mt_set_timer(&r->mt, 0, (uint64_t) req->timeout * MILLISECOND, chitcpd_handler_poll_timeout, r);
+        }
+    }
+
+    ret = chitcpd_poll_scan(si, req, resp->revents);
 
+    if (ret == 0 && req->timeout != 0 && !r->timed_out)
+    {
+        /* Wait for a notification (or for the timeout) */
+        if (!ha->stopping)
+            return CHITCP_EWOULDBLOCK;
+    }
+
+done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__POLL");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * chitcpd_batch_sockfd - Get the socket argument of a request
+ *
+ * req_msg: Request
+ *
+ * Returns: A pointer to the request's sockfd field, or NULL if the request
+ *          has no such field (or is not allowed in a batch).
+ *
+ */
+static int32_t *chitcpd_batch_sockfd(ChitcpdMsg *req_msg)
+{
+    switch (req_msg->code)
+    {
+    case CHITCPD_MSG_CODE__BIND:
+        return req_msg->bind_args? &req_msg->bind_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__LISTEN:
+        return req_msg->listen_args? &req_msg->listen_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__ACCEPT:
+        return req_msg->accept_args? &req_msg->accept_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__CONNECT:
+        return req_msg->connect_args? &req_msg->connect_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__SEND:
+        return req_msg->send_args? &req_msg->send_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__RECV:
+        return req_msg->recv_args? &req_msg->recv_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__CLOSE:
+        return req_msg->close_args? &req_msg->close_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__SETSOCKOPT:
+    case CHITCPD_MSG_CODE__GETSOCKOPT:
+        return req_msg->sockopt_args? &req_msg->sockopt_args->sockfd : NULL;
+    case CHITCPD_MSG_CODE__FCNTL:
+        return req_msg->fcntl_args? &req_msg->fcntl_args->sockfd : NULL;
+    default:
+        return NULL;
+    }
+}
+
+
+/* Handler for chisocket_batch_run() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__BATCH)
+{
+    int ret, error_code = 0;
+    ChitcpdBatchArgs *req;
+    size_t n = 0;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__BATCH");
+
+    /* Unpack request */
+    assert(req_msg->batch_args != NULL);
+    req = req_msg->batch_args;
+
+    if (req->n_requests == 0)
+    {
         ret = 0;
         goto done;
     }
 
-    chilog(DEBUG, "recv() has extracted %i bytes from the recv buffer", nbytes);
-
-    /* We don't signal the TCP thread if the connection has not yet
-     * been synchronized */
-    if (entry->tcp_state == ESTABLISHED ||
-        entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2)
+    if (resp->batch == NULL)
     {
-        pthread_mutex_lock(&socket_state->lock_event);
-        socket_state->flags.app_recv = 1;
-        pthread_cond_broadcast(&socket_state->cv_event);
-        pthread_mutex_unlock(&socket_state->lock_event);
+        resp->batch = chitcpd_arena_calloc(&r->arena, req->n_requests, sizeof(ChitcpdResp*));
+        if (resp->batch == NULL)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
     }
 
-    ret = nbytes;
+    /* The requests are handled in order, just as if they had been sent
+     * one by one on this connection. If one of them is parked, so is
+     * the batch, and it picks up from that request (see r->batch_next). */
+    for (n = r->batch_next; n < req->n_requests; n++)
+    {
+        ChitcpdMsg *sub = req->requests[n];
+        ChitcpdResp *sub_resp;
+        int32_t *sockfd, ref_sockfd;
+        int rc = CHITCP_OK;
 
-    /* Create response payload */
-    resp->has_buf = TRUE;
-    resp->buf.len = nbytes;
+        if (n < resp->n_batch)
+        {
+            /* This is the request that was parked */
+            sockfd = chitcpd_batch_sockfd(sub);
+            ref_sockfd = r->batch_ref;
+            rc = handlers[sub->code](si, ha, r, sub, resp->batch[n]);
+            goto handled;
+        }
 
- done:
-    /* Create response return value */
+        sub_resp = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdResp));
+        if (sub_resp == NULL)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        chitcpd_resp__init(sub_resp);
+        resp->batch[n] = sub_resp;
+        resp->n_batch = n + 1;
+
+        sockfd = chitcpd_batch_sockfd(sub);
+        ref_sockfd = (sockfd != NULL)? *sockfd : 0;
+        if (sub->code != CHITCPD_MSG_CODE__SOCKET && sockfd == NULL)
+        {
+            chilog(ERROR, "Request %zu in batch has unsupported code %i", n, sub->code);
+            sub_resp->ret = -1;
+            sub_resp->error_code = EINVAL;
+        }
+        else if (sockfd != NULL && *sockfd <= -2)
+        {
+            /* Refers to the socket returned by an earlier request */
+            size_t ref = -2 - *sockfd;
+
+            if (ref >= n || resp->batch[ref]->ret < 0)
+            {
+                chilog(ERROR, "Request %zu in batch refers to an invalid request (%zu)", n, ref);
+                sub_resp->ret = -1;
+                sub_resp->error_code = EBADF;
+            }
+            else
+            {
+                *sockfd = resp->batch[ref]->ret;
+                rc = handlers[sub->code](si, ha, r, sub, sub_resp);
+            }
+        }
+        else
+            rc = handlers[sub->code](si, ha, r, sub, sub_resp);
+
+handled:
+        if (rc == CHITCP_EWOULDBLOCK)
+        {
+            r->batch_next = n;
+            r->batch_ref = ref_sockfd;
+            return CHITCP_EWOULDBLOCK;
+        }
+
+        /* Put the reference back, since the batch may be the application's
+         * own and run again (see chitcpd_handler_call) */
+        if (ref_sockfd <= -2)
+            *sockfd = ref_sockfd;
+
+        /* The next request starts from scratch */
+        chitcpd_handler_unwait(si, r);
+        r->step = 0;
+        r->done = 0;
+        r->timed_out = FALSE;
+
+        if (req->stop_on_error && resp->batch[n]->error_code)
+        {
+            n++;
+            break;
+        }
+    }
+
+    /* Number of requests that were handled */
+    ret = n;
+
+done:
+    /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__RECV");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__BATCH");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chisocket_close() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
+/* Names of the stages in trace_stage_t (as reported by GET_STATS) */
+static const char *trace_stage_names[TRACE_STAGES] =
+{
+    "delivery",
+    "pending",
+    "tcp",
+    "total"
+};
+
+
+/*
+ * chitcpd_rpc_stats_new - Create a GET_STATS submessage with a latency histogram
+ *
+ * The buckets are stored right after the submessage, in the same
+ * allocation.
+ *
+ * arena: Arena the submessage is allocated in
+ *
+ * rpc: Histogram
+ *
+ * code: Code of the histogram (request code or trace_stage_t)
+ *
+ * name: Name of the histogram
+ *
+ * Returns: The submessage, or NULL if it could not be allocated
+ *
+ */
+static ChitcpdRpcStats *chitcpd_rpc_stats_new(chitcpd_arena_t *arena, rpc_stats_t *rpc, int code, const char *name)
+{
+    ChitcpdRpcStats *rpc_stats = chitcpd_arena_alloc(arena, sizeof(ChitcpdRpcStats) + RPC_LATENCY_BUCKETS * sizeof(uint64_t));
+
+    if (!rpc_stats)
+        return NULL;
+    chitcpd_rpc_stats__init(rpc_stats);
+
+    rpc_stats->code = code;
+    rpc_stats->name = (char *) name;
+    rpc_stats->count = atomic_load_explicit(&rpc->count, memory_order_relaxed);
+    rpc_stats->total_us = atomic_load_explicit(&rpc->total_us, memory_order_relaxed);
+    rpc_stats->buckets = (uint64_t *) (rpc_stats + 1);
+    rpc_stats->n_buckets = RPC_LATENCY_BUCKETS;
+    for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+        rpc_stats->buckets[i] = atomic_load_explicit(&rpc->buckets[i], memory_order_relaxed);
+
+    return rpc_stats;
+}
+
+
+/* Handler for chitcpd_get_stats() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_STATS)
 {
     chisocket_t sockfd;
     int ret, error_code = 0;
-    ChitcpdCloseArgs *req;
+    ChitcpdGetStatsArgs *req;
+    ChitcpdStats *stats;
+    size_t n;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__CLOSE");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_STATS");
 
     /* Unpack request */
-    assert(req_msg->close_args != NULL);
-    req = req_msg->close_args;
+    assert(req_msg->get_stats_args != NULL);
+    req = req_msg->get_stats_args;
 
     sockfd = req->sockfd;
 
-    chilog(TRACE, ">>> CLOSE sockfd=%i", sockfd);
-
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd != -1 && (sockfd < 0 || sockfd >= si->chisocket_table_size || CHISOCKET_ENTRY(si, sockfd)->available || CHISOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE))
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
 
-    if(entry->tcp_state == CLOSED)
+    stats = resp->stats = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdStats));
+    if (!stats)
     {
-        chilog(ERROR, "Tried to close() a CLOSED socket: %i", sockfd);
         ret = -1;
-        error_code = ENOTCONN;
+        error_code = ENOMEM;
         goto done;
     }
+    chitcpd_stats__init(stats);
 
-    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_PASSIVE)
+    if (sockfd != -1)
     {
-        /* Since this is a passive socket, there is no TCP thread, so we
-         * can simply go ahead and release its resources */
-        /* TODO: If chitcp ever implements ICMP, we would need to sent
-         * ICMP messages to any pending connections to let them know
-         * this socket has been closed. */
-        chitcpd_free_socket_entry(si, entry);
-        ret = 0;
-        goto done;
-    }
+        tcp_data_t *tcp_data = &CHISOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
 
-    if (entry->tcp_state == LISTEN && entry->actpas_type == SOCKET_ACTIVE)
-    {
-        /* Very unlikely this will happen, since an active LISTEN socket
-         * almost immediately transitions to SYN_RCVD. */
-        chilog(ERROR, "Not supported: close()ing an active LISTEN socket: %i", sockfd);
-        ret = -1;
-        error_code = EOPNOTSUPP;
-        goto done;
+        stats->socket = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdSocketStats));
+        if (!stats->socket)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        chitcpd_socket_stats__init(stats->socket);
+
+        stats->socket->segs_in = TCP_STATS_GET(tcp_data, segs_in);
+        stats->socket->segs_out = TCP_STATS_GET(tcp_data, segs_out);
+        stats->socket->bytes_in = TCP_STATS_GET(tcp_data, bytes_in);
+        stats->socket->bytes_out = TCP_STATS_GET(tcp_data, bytes_out);
+        stats->socket->retransmits = TCP_STATS_GET(tcp_data, retransmits);
+        stats->socket->dup_acks = TCP_STATS_GET(tcp_data, dup_acks);
+        stats->socket->out_of_order = TCP_STATS_GET(tcp_data, out_of_order);
+        stats->socket->zero_window = TCP_STATS_GET(tcp_data, zero_window);
+        stats->socket->srtt_us = tcp_data->SRTT / MICROSECOND;
+        stats->socket->cwnd = tcp_data->cwnd;
     }
 
-    if (entry->tcp_state == SYN_SENT)
+    /* Connections to other daemons. The peer's address is stored
+     * right after each submessage, in the same allocation */
+    pthread_mutex_lock(&si->lock_connection_table);
+    n = 0;
+    for (int i = 0; i < si->connection_table_size; i++)
+        if (!si->connection_table[i].available)
+            n++;
+    stats->connections = chitcpd_arena_calloc(&r->arena, n, sizeof(ChitcpdConnectionStats *));
+    for (int i = 0; stats->connections != NULL && i < si->connection_table_size; i++)
     {
-        /* Not supported. TCP standard requires:
-         *
-         *     SYN-SENT STATE
-         *
-         *       Delete the TCB and return "error:  closing" responses to any
-         *       queued SENDs, or RECEIVEs.
-         *
-         */
-        chilog(ERROR, "Not supported: close()ing a SYN_SENT socket: %i", sockfd);
-        ret = -1;
-        error_code = EOPNOTSUPP;
-        goto done;
-    }
+        tcpconnentry_t *connection = &si->connection_table[i];
+        ChitcpdConnectionStats *conn_stats;
 
-    if (entry->tcp_state == SYN_RCVD)
-    {
-        /* Not supported. TCP standard requires:
-         *
-         *     SYN-RECEIVED STATE
-         *
-         *       If no SENDs have been issued and there is no pending data to send,
-         *       then form a FIN segment and send it, and enter FIN-WAIT-1 state;
-         *       otherwise queue for processing after entering ESTABLISHED state.
-         *
-         */
-        chilog(ERROR, "Not supported: close()ing a SYN_RCVD socket: %i", sockfd);
-        ret = -1;
-        error_code = EOPNOTSUPP;
-        goto done;
+        if (connection->available)
+            continue;
+
+        conn_stats = chitcpd_arena_alloc(&r->arena, sizeof(ChitcpdConnectionStats) + sizeof(struct sockaddr_storage));
+        if (!conn_stats)
+            break;
+        chitcpd_connection_stats__init(conn_stats);
+
+        conn_stats->peer_addr.data = (uint8_t *) (conn_stats + 1);
+        conn_stats->peer_addr.len = sizeof(struct sockaddr_storage);
+        memcpy(conn_stats->peer_addr.data, &connection->peer_addr, sizeof(struct sockaddr_storage));
+        conn_stats->packets_in = atomic_load_explicit(&connection->packets_in, memory_order_relaxed);
+        conn_stats->packets_out = atomic_load_explicit(&connection->packets_out, memory_order_relaxed);
+
+        stats->connections[stats->n_connections++] = conn_stats;
     }
+    pthread_mutex_unlock(&si->lock_connection_table);
 
-    if (entry->tcp_state == FIN_WAIT_1  || entry->tcp_state == FIN_WAIT_2  ||
-        entry->tcp_state == CLOSING     || entry->tcp_state == LAST_ACK    ||
-        entry->tcp_state == TIME_WAIT )
+    if (n > 0 && stats->n_connections < n)
     {
-        chilog(ERROR, "Tried to close() an already closing socket: %i", sockfd);
         ret = -1;
-        error_code = ENOTCONN;
+        error_code = ENOMEM;
         goto done;
     }
 
-    /* ESTABLISHED or CLOSE_WAIT */
-
-    /* Signal the TCP thread that the application has
-     * requested that the connection be closed */
-    active_chisocket_state_t *socket_state;
-
-    socket_state = &entry->socket_state.active;
+    pthread_mutex_lock(&si->lock_delivery);
+    stats->delivery_queue_len = si->delivery_queue_len;
+    stats->delivery_queue_max = si->delivery_queue_max;
+    pthread_mutex_unlock(&si->lock_delivery);
 
-    chilog(TRACE, "Signaling socket thread...");
-    pthread_mutex_lock(&entry->lock_tcp_state);
-    pthread_mutex_lock(&socket_state->lock_event);
-    socket_state->flags.app_close = 1;
-    pthread_cond_broadcast(&socket_state->cv_event);
-    pthread_mutex_unlock(&socket_state->lock_event);
+    stats->mem_limit = si->mem.limit;
+    stats->mem_used = atomic_load_explicit(&si->mem.used, memory_order_relaxed);
+    stats->mem_drops = atomic_load_explicit(&si->mem.drops, memory_order_relaxed);
 
-    /* Wait for socket to enter a valid closing state */
-    if (! (entry->tcp_state == CLOSE_WAIT || entry->tcp_state == ESTABLISHED))
+    /* RPC latency histograms of the request codes that have been used.
+     * As above, the buckets are stored right after each submessage */
+    stats->rpcs = chitcpd_arena_calloc(&r->arena, RPC_STATS_MAX_CODES, sizeof(ChitcpdRpcStats *));
+    if (!stats->rpcs)
     {
-        chilog(ERROR, "Socket entered an inconsist"
-                "ent state (should be ESTABLISHED or CLOSE_WAIT)");
         ret = -1;
-        error_code = EBADF;
+        error_code = ENOMEM;
         goto done;
     }
+    for (int code = CHITCPD_MSG_CODE__SOCKET; code < sizeof(handlers) / sizeof(handler_function) && code < RPC_STATS_MAX_CODES; code++)
+    {
+        rpc_stats_t *rpc = &si->rpc_stats[code];
+        ChitcpdRpcStats *rpc_stats;
 
-    chilog(TRACE, "Waiting for closing state...");
+        if (atomic_load_explicit(&rpc->count, memory_order_relaxed) == 0)
+            continue;
 
-    if (entry->tcp_state == ESTABLISHED)
-    {
-        /* TODO: According to RFC 793, we actually shouldn't return from close()
-         * until we're in FIN_WAIT_2 *and* the retransmission queue is empty.
-         * However, a simultaneous close could land us in CLOSING or TIME_WAIT */
-        while(! (entry->tcp_state == FIN_WAIT_2 || entry->tcp_state == CLOSING ||
-                 entry->tcp_state == TIME_WAIT || entry->tcp_state == CLOSED ))
-            pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
-    }
-    else if (entry->tcp_state == CLOSE_WAIT)
-    {
-        while(! (entry->tcp_state == LAST_ACK || entry->tcp_state == CLOSED) )
-            pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
+        rpc_stats = chitcpd_rpc_stats_new(&r->arena, rpc, code, handler_code_string(code));
+        if (!rpc_stats)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+
+        stats->rpcs[stats->n_rpcs++] = rpc_stats;
     }
 
-    if (entry->tcp_state == CLOSED)
-        chilog(TRACE, "Socket is in CLOSED state");
-    else if (entry->tcp_state == FIN_WAIT_2 || entry->tcp_state == CLOSING ||
-             entry->tcp_state == TIME_WAIT  || entry->tcp_state == LAST_ACK )
-        chilog(TRACE, "Socket entered a closing state");
-    else
+    /* Segment latency histograms, if segments are being traced */
+    if (si->trace_sample > 0)
     {
-        chilog(ERROR, "Socket entered an inconsistent state %i", entry->tcp_state);
-        ret = -1;
-        error_code = EBADF;
-        pthread_mutex_unlock(&entry->lock_tcp_state);
-        goto done;
-    }
+        stats->stages = chitcpd_arena_calloc(&r->arena, TRACE_STAGES, sizeof(ChitcpdRpcStats *));
+        if (!stats->stages)
+        {
+            ret = -1;
+            error_code = ENOMEM;
+            goto done;
+        }
+        for (int stage = 0; stage < TRACE_STAGES; stage++)
+        {
+            ChitcpdRpcStats *stage_stats = chitcpd_rpc_stats_new(&r->arena, &si->trace_stats[stage], stage, trace_stage_names[stage]);
 
-    pthread_mutex_unlock(&entry->lock_tcp_state);
+            if (!stage_stats)
+            {
+                ret = -1;
+                error_code = ENOMEM;
+                goto done;
+            }
+
+            stats->stages[stats->n_stages++] = stage_stats;
+        }
+    }
 
     ret = 0;
 
@@ -1163,206 +4020,247 @@ done:
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__CLOSE");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_STATS");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chitcpd_get_socket_state() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE)
+/*
+ * chitcpd_subscription_scan - Find out what to tell a subscriber about one of its sockets
+ *
+ * si: Server info
+ *
+ * sub: What was last reported about the socket (updated here)
+ *
+ * reg: The subscription's registration on the socket
+ *
+ * note: Notification to fill in
+ *
+ * Returns: The events to report (0 if there is nothing new).
+ *
+ */
+static int chitcpd_subscription_scan(serverinfo_t *si, handler_subscription_t *sub, poll_registration_t *reg, ChitcpdNotification *note)
 {
-    chisocket_t sockfd;
-    int ret, error_code = 0;;
-    ChitcpdGetSocketStateArgs *req;
-
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_STATE");
-
-    /* Unpack request */
-    assert(req_msg->get_socket_state_args != NULL);
-    req = req_msg->get_socket_state_args;
+    chisocketentry_t *entry;
+    unsigned int states = 0;
+    int tcp_state = CLOSED, events = 0, ready = 0, revents;
 
-    sockfd = req->sockfd;
+    if (sub->freed)
+        return 0;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
+    /* The states seen since the last scan start over from the current one */
+    pthread_mutex_lock(&si->lock_poll);
+    entry = reg->entry;
+    if (entry != NULL)
     {
-        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
-        goto done;
+        tcp_state = entry->tcp_state;
+        states = reg->states | (1 << tcp_state);
+        reg->states = 1 << tcp_state;
     }
+    pthread_mutex_unlock(&si->lock_poll);
 
-    /* This will be freed back in the dispatch function. */
-    resp->socket_state = malloc(sizeof(ChitcpdSocketState));
-
-    if (!resp->socket_state)
+    if (entry == NULL)
     {
-        ret = -1;
-        error_code = errno;
-        goto done;
+        sub->freed = TRUE;
+        events = CHITCPD_NOTIFY_FREED;
     }
+    else
+    {
+        revents = chitcpd_poll_socket(si, sub->sockfd);
+        if (revents & POLLIN)
+            ready |= CHITCPD_NOTIFY_READABLE;
+        if (revents & POLLOUT)
+            ready |= CHITCPD_NOTIFY_WRITABLE;
+
+        if (tcp_state != sub->tcp_state || states != (1U << tcp_state))
+            events |= CHITCPD_NOTIFY_STATE;
+        events |= ready & ~sub->ready;
+
+        /* Only a connection that can send has a window to reopen */
+        if (entry->actpas_type == SOCKET_ACTIVE &&
+            (tcp_state == ESTABLISHED || tcp_state == CLOSE_WAIT))
+        {
+            bool_t closed = (entry->socket_state.active.tcp_data.SND_WND == 0);
 
-    chitcpd_socket_state__init(resp->socket_state);
-
-    resp->socket_state->tcp_state = si->chisocket_table[sockfd].tcp_state;
-    tcp_data_t *tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
-    resp->socket_state->iss = tcp_data->ISS;
-    resp->socket_state->irs = tcp_data->IRS;
-    resp->socket_state->snd_una = tcp_data->SND_UNA;
-    resp->socket_state->rcv_nxt = tcp_data->RCV_NXT;
-    resp->socket_state->snd_nxt = tcp_data->SND_NXT;
-    resp->socket_state->rcv_wnd = tcp_data->RCV_WND;
-    resp->socket_state->snd_wnd = tcp_data->SND_WND;
-
-    ret = 0;
+            if (sub->window_closed && !closed)
+                events |= CHITCPD_NOTIFY_WINDOW;
+            sub->window_closed = closed;
+        }
 
- done:
-    /* Create response */
-    resp->ret = ret;
-    resp->error_code = error_code;
+        sub->tcp_state = tcp_state;
+        sub->ready = ready;
+        events &= sub->events;
+    }
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_STATE");
+    note->sockfd = sub->sockfd;
+    note->events = events;
+    note->tcp_state = tcp_state;
+    note->states = states;
 
-    return CHITCP_OK;
+    return events;
 }
 
-/* Handler for chitcpd_get_socket_buffer_contents() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS)
+
+/* Handler for chitcpd_subscribe() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SUBSCRIBE)
 {
-    chisocket_t sockfd;
-    int ret, error_code = 0;
-    ChitcpdGetSocketBufferContentsArgs *req;
+    int ret = 0, error_code = 0;
+    ChitcpdSubscribeArgs *req;
+    ChitcpdMsg notify_outer = CHITCPD_MSG__INIT;
+    ChitcpdResp notify = CHITCPD_RESP__INIT;
+    ChitcpdNotification *notes, **notes_p;
+    size_t n = 0;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SUBSCRIBE");
 
     /* Unpack request */
-    assert(req_msg->get_socket_buffer_contents_args != NULL);
-    req = req_msg->get_socket_buffer_contents_args;
-
-    sockfd = req->sockfd;
+    assert(req_msg->subscribe_args != NULL);
+    req = req_msg->subscribe_args;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
-    {
-        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
-    }
-    else
+    if (r->subs == NULL)
     {
-        /* This will be freed back in the dispatch function. */
-        resp->socket_buffer_contents = malloc(sizeof(ChitcpdSocketBufferContents));
-
-        if (!resp->socket_buffer_contents)
+        /* Register on every socket before the first scan, so we can't
+         * miss a change. A descriptor that is not a valid socket gets
+         * no registration, and is reported as freed. */
+        r->subs = calloc(req->n_fds + 1, sizeof(handler_subscription_t));
+        r->regs = calloc(req->n_fds + 1, sizeof(poll_registration_t));
+        if (r->subs == NULL || r->regs == NULL)
         {
             ret = -1;
-            error_code = errno;
+            error_code = ENOMEM;
+            goto done;
         }
-        else
+        r->num_regs = req->n_fds;
+        r->waiter.notified = TRUE;
+        for (size_t i = 0; i < req->n_fds; i++)
         {
-            chitcpd_socket_buffer_contents__init(resp->socket_buffer_contents);
+            chisocket_t sockfd = req->fds[i]->sockfd;
 
-            tcp_data_t *tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
-
-            ret = 0;
-
-            int snd_len = circular_buffer_count(&tcp_data->send);
-            uint8_t *snd_data = malloc(snd_len);
-            if (!snd_data)
-            {
-                ret = -1;
-                error_code = errno;
-            }
-            int rcv_len = circular_buffer_count(&tcp_data->recv);
-            uint8_t *rcv_data = malloc(rcv_len);
-            if (!rcv_data)
+            r->subs[i].sockfd = sockfd;
+            r->subs[i].events = req->fds[i]->events;
+            r->subs[i].tcp_state = -1;
+            if (sockfd >= 0 && sockfd < si->chisocket_table_size && !CHISOCKET_ENTRY(si, sockfd)->available)
             {
-                ret = -1;
-                error_code = errno;
+                chitcpd_poll_register(si, CHISOCKET_ENTRY(si, sockfd), &r->regs[i], &r->waiter);
+
+                /* The socket may have been freed before we registered */
+                if (CHISOCKET_ENTRY(si, sockfd)->available)
+                    chitcpd_poll_unregister(si, &r->regs[i]);
             }
+        }
+    }
 
-            /* Get the data itself, if malloc succeeded and len > 0 */
-            if (snd_data && snd_len)
-                circular_buffer_peek(&tcp_data->send, snd_data, snd_len, FALSE);
-            if (rcv_data && rcv_len)
-                circular_buffer_peek(&tcp_data->recv, rcv_data, rcv_len, FALSE);
+    if (r->cancelled || ha->stopping)
+        goto done;
 
-            resp->socket_buffer_contents->snd.len = snd_len;
-            resp->socket_buffer_contents->snd.data = snd_data;
+    notes = calloc(req->n_fds + 1, sizeof(ChitcpdNotification));
+    notes_p = calloc(req->n_fds + 1, sizeof(ChitcpdNotification*));
+    if (notes == NULL || notes_p == NULL)
+    {
+        free(notes);
+        free(notes_p);
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
 
-            resp->socket_buffer_contents->rcv.len = rcv_len;
-            resp->socket_buffer_contents->rcv.data = rcv_data;
+    for (size_t i = 0; i < req->n_fds; i++)
+    {
+        chitcpd_notification__init(&notes[n]);
+        if (chitcpd_subscription_scan(si, &r->subs[i], &r->regs[i], &notes[n]))
+        {
+            notes_p[n] = &notes[n];
+            n++;
         }
     }
 
+    if (n > 0)
+    {
+        notify.n_notifications = n;
+        notify.notifications = notes_p;
+
+        notify_outer.code = CHITCPD_MSG_CODE__NOTIFY;
+        notify_outer.resp = &notify;
+        notify_outer.request_id = req_msg->request_id;
+
+        /* Notifications are sent just like responses (see chitcpd_handler_complete) */
+        pthread_mutex_lock(&ha->handler_lock);
+        if (chitcpd_channel_send_msg(&ha->channel, &notify_outer) < 0)
+            chilog(DEBUG, "Could not send notifications (client may have disconnected)");
+        pthread_mutex_unlock(&ha->handler_lock);
+    }
+
+    free(notes);
+    free(notes_p);
+
+    /* Wait for the next change (or for an UNSUBSCRIBE) */
+    return CHITCP_EWOULDBLOCK;
+
+done:
     /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SUBSCRIBE");
 
     return CHITCP_OK;
 }
 
 
-/* Handler for chitcpd_wait_for_state() */
-HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
+/* Handler for chitcpd_unsubscribe() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__UNSUBSCRIBE)
 {
-    chisocket_t sockfd;
+    handler_pool_t *pool = si->handler_pool;
     int ret, error_code = 0;
-    tcp_state_t tcp_state;
-    ChitcpdWaitForStateArgs *req;
+    ChitcpdUnsubscribeArgs *req;
+    handler_request_t *sub;
 
-    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__WAIT_FOR_STATE");
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__UNSUBSCRIBE");
 
     /* Unpack request */
-    assert(req_msg->wait_for_state_args != NULL);
-    req = req_msg->wait_for_state_args;
-
-    sockfd = req->sockfd;
-    tcp_state = req->tcp_state;
-
-    if(si->chisocket_table[sockfd].available && tcp_state == CLOSED)
+    assert(req_msg->unsubscribe_args != NULL);
+    req = req_msg->unsubscribe_args;
+
+    /* Once it is cancelled, the subscription completes the next time
+     * it runs (if it is parked, it is put back on the run queue, as in
+     * chitcpd_handler_wake). It can't be freed while we hold the pool's
+     * lock, because it has to be taken off the running list first. */
+    pthread_mutex_lock(&si->lock_poll);
+    pthread_mutex_lock(&pool->lock);
+    DL_FOREACH(ha->running, sub)
     {
-        chilog(TRACE, "Waiting for CLOSED, but socket %i has already been freed, so returning", sockfd);
-        ret = 0;
-
-        goto done;
+        if (sub->req->code == CHITCPD_MSG_CODE__SUBSCRIBE &&
+            sub->req->request_id == req->subscription_id)
+            break;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
+    if (sub != NULL && !sub->cancelled)
     {
-        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
-        ret = -1;
-        error_code = EBADF;
-        goto done;
+        sub->cancelled = TRUE;
+        sub->waiter.notified = TRUE;
+        if (sub->parked)
+        {
+            sub->parked = FALSE;
+            sub->waiter.notified = FALSE;
+            chitcpd_handler_enqueue(pool, sub);
+        }
+        ret = 0;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
-
-    if(!IS_VALID_TCP_STATE(tcp_state))
+    else
     {
-        chilog(ERROR, "Not a valid TCP state: %i", tcp_state);
+        chilog(ERROR, "No such subscription: %u", req->subscription_id);
         ret = -1;
-        error_code = EINVAL;
-        goto done;
-    }
-
-    pthread_mutex_lock(&entry->lock_tcp_state);
-    chilog(TRACE, "Socket %i is %s. Waiting for %s.", sockfd, tcp_str(entry->tcp_state), tcp_str(tcp_state));
-    while(entry->tcp_state != tcp_state)
-    {
-        pthread_cond_wait(&entry->cv_tcp_state, &entry->lock_tcp_state);
-        chilog(TRACE, "Socket %i is %s. Waiting for %s.", sockfd, tcp_str(entry->tcp_state), tcp_str(tcp_state));
+        error_code = ENOENT;
     }
-    pthread_mutex_unlock(&entry->lock_tcp_state);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&si->lock_poll);
 
-    ret = 0;
-
- done:
     /* Create response */
     resp->ret = ret;
     resp->error_code = error_code;
 
-    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__WAIT_FOR_STATE");
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__UNSUBSCRIBE");
 
     return CHITCP_OK;
 }
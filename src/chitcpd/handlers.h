@@ -41,16 +41,280 @@
 #define HANDLER_H_
 
 #include "serverinfo.h"
+#include "protobuf-wrapper.h"
+#include "arena.h"
 
+struct handler_thread_args;
+
+/* What a SUBSCRIBE request last reported about one of its sockets */
+typedef struct handler_subscription
+{
+    chisocket_t sockfd;
+    int events;       /* Events the client subscribed to (CHITCPD_NOTIFY_*) */
+    int tcp_state;    /* -1 until the first notification */
+    int ready;        /* CHITCPD_NOTIFY_READABLE and CHITCPD_NOTIFY_WRITABLE */
+    bool_t window_closed;
+    bool_t freed;
+} handler_subscription_t;
+
+/* A request waiting to be handled, being handled, or parked
+ *
+ * A handler that can't complete a request right away (e.g., a RECV on
+ * an empty buffer) parks it instead of blocking (see chitcpd_handler_park):
+ * the request is registered on the socket it is waiting on, and is handled
+ * again from the start whenever that socket's state or buffers change.
+ * Whatever the handler needs to pick up where it left off is kept here. */
+typedef struct handler_request
+{
+    ChitcpdMsg *req;   /* NULL for a connection's reader */
+    uint32_t lane;
+    struct handler_thread_args *ha;
+
+    /* The request (unless it was made in-process) is unpacked in this
+     * arena, and handlers allocate the parts of the response in it too.
+     * It is reset once the response has been sent, and the request is
+     * then kept by its connection (see handler_thread_args_t), so the
+     * arena is reused by the connection's next request. */
+    chitcpd_arena_t arena;
+
+    ChitcpdResp resp;
+    uint64_t start;    /* When the request was first handled (see tcp_now) */
+
+    /* Registration on the socket the request is waiting on */
+    poll_waiter_t waiter;
+    poll_registration_t reg;
+    bool_t registered;
+    bool_t parked;
+
+    /* POLL registers on several sockets, and has a timeout */
+    poll_registration_t *regs;
+    size_t num_regs;
+    multi_timer_t mt;
+    bool_t has_timer;
+    bool_t timed_out;
+
+    /* SUBSCRIBE also registers on several sockets (through regs), and
+     * keeps what it last reported about each of them. It runs until an
+     * UNSUBSCRIBE cancels it. */
+    handler_subscription_t *subs;
+    bool_t cancelled;
+
+    /* Buffer holding the data returned by RECV (see chitcpd_handler_recv_buf) */
+    uint8_t *recv_buf;
+    size_t recv_buf_size;
+
+    /* Requests made by an in-process application (see chitcpd_handler_call)
+     * are handled in the application's thread, which waits on cv_local
+     * instead of putting the request back on the run queue. RECV copies
+     * the data straight into recv_dst (if not NULL), and the response is
+     * returned in resp_msg. */
+    pthread_cond_t *cv_local;
+    uint8_t *recv_dst;
+    ChitcpdMsg resp_msg;
+
+    /* Progress of the request (meaning depends on the handler) */
+    int step;
+    size_t done;
+    size_t batch_next;
+    int32_t batch_ref;
+
+    /* Connection's list of queued or running requests */
+    struct handler_request *prev;
+    struct handler_request *next;
+
+    /* Handler pool's run queue */
+    struct handler_request *rq_prev;
+    struct handler_request *rq_next;
+} handler_request_t;
+
+/* A command connection on the UNIX socket */
 typedef struct handler_thread_args
 {
     serverinfo_t *si;
     socket_t client_socket;
-    pthread_mutex_t *handler_lock;
-    char thread_name [16];
+    chitcpd_channel_t channel;  /* On client_socket */
+
+    /* Makes sure responses from different requests are not interleaved */
+    pthread_mutex_t handler_lock;
+
+    /* Shared data window set up by the client during INIT (NULL if
+     * there is none). It is unmapped when the connection is freed. */
+    uint8_t *shm;
+    uint32_t shm_size;
+
+    /* Buffer for the data returned by RECV, kept between requests so it
+     * doesn't have to be allocated every time (protected by handler_lock) */
+    uint8_t *recv_buf;
+    size_t recv_buf_size;
+
+    /* Queued on the handler pool's run queue when the client socket
+     * is readable, to read the next request */
+    handler_request_t reader;
+
+    /* Requests in the same lane are handled in order; requests in different
+     * lanes can be handled (and can complete) in any order. Requests that
+     * are running or parked are in running, and requests waiting for
+     * their lane to be free are in requests. These lists (and the run
+     * queue) are protected by the pool's lock. */
+    handler_request_t *requests;
+    handler_request_t *running;
+
+    /* Requests that have completed, kept to be reused along with their
+     * arenas (protected by the pool's lock, like the lists above) */
+    handler_request_t *spare;
+
+    /* The client has disconnected. Once the last request has completed,
+     * the connection's sockets are freed, and so is the connection. */
+    bool_t stopping;
+
+    struct handler_thread_args *prev;
+    struct handler_thread_args *next;
 } handler_thread_args_t;
 
-void* chitcpd_handler_dispatch(void *args);
+/* Pool of threads that handle the requests on all the command connections.
+ * A poll thread waits for the client sockets to become readable, and
+ * queues their readers (see handler_thread_args_t) on the run queue. */
+typedef struct handler_pool
+{
+    serverinfo_t *si;
+    int num_threads;
+    pthread_t *threads;
+    atomic_int next_thread_id;   /* For naming the threads */
+
+    pthread_t poll_thread;
+    bool_t polling;       /* The poll thread has been started */
+    int epoll_fd;
+    int wakeup_fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv_run_queue;     /* The run queue is not empty */
+    pthread_cond_t cv_connections;   /* A connection has been freed */
+    handler_request_t *run_queue;
+    handler_thread_args_t *connections;
+    bool_t done;
+} handler_pool_t;
+
+
+/*
+ * chitcpd_handler_start_pool - Start the handler pool
+ *
+ * The pool has si->num_handler_threads threads (or, if that is zero,
+ * one per online CPU, with a minimum of two).
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The pool has started
+ *  - CHITCP_ENOMEM: Could not allocate memory for the pool
+ *  - CHITCP_ESOCKET: Could not create the poll thread's descriptors
+ *  - CHITCP_ETHREAD: Could not create the pool's threads
+ *
+ */
+int chitcpd_handler_start_pool(serverinfo_t *si);
+
+
+/*
+ * chitcpd_handler_add_connection - Start handling the requests on a command connection
+ *
+ * si: Server info
+ *
+ * ha: Connection (with its socket, channel and shared data window
+ *     already set up). The pool frees it once the client disconnects.
+ *
+ * Returns:
+ *  - CHITCP_OK: The connection has been added
+ *  - CHITCP_ESOCKET: Could not poll the connection's socket
+ *
+ */
+int chitcpd_handler_add_connection(serverinfo_t *si, handler_thread_args_t *ha);
+
+
+/*
+ * chitcpd_handler_stop_pool - Stop the handler pool
+ *
+ * Shuts down every command connection, waits for the connections
+ * (and their sockets) to be freed, and then stops the pool's threads.
+ *
+ * si: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_handler_stop_pool(serverinfo_t *si);
+
+
+/*
+ * chitcpd_handler_add_local_connection - Create a connection for an in-process application
+ *
+ * The requests on this connection are not read from a socket: the
+ * application makes them with chitcpd_handler_call. SUBSCRIBE and
+ * UNSUBSCRIBE are not supported, since there is nowhere to send the
+ * notifications.
+ *
+ * si: Server info (the handler pool must have been started)
+ *
+ * Returns: The connection, or NULL if it could not be allocated.
+ *
+ */
+handler_thread_args_t *chitcpd_handler_add_local_connection(serverinfo_t *si);
+
+
+/*
+ * chitcpd_handler_call - Handle a request made by an in-process application
+ *
+ * The request is handled in the calling thread, which blocks whenever the
+ * handler parks the request. Requests from different threads are handled
+ * at the same time (like requests in different lanes).
+ *
+ * ha: Connection (see chitcpd_handler_add_local_connection)
+ *
+ * req: Request. It belongs to the caller, but the handler may modify it.
+ *
+ * fd: File descriptor that comes with a SENDFILE request (-1 if none).
+ *     The handler gets its own copy of it.
+ *
+ * recv_dst: For a RECV, where to copy the data (NULL to return it in the
+ *           response, as usual). It must have room for the requested
+ *           number of bytes.
+ *
+ * resp_p: Output parameter to return the response, which must be
+ *         released with chitcpd_handler_release.
+ *
+ * Returns:
+ *  - CHITCP_OK: The request has been handled
+ *  - CHITCP_EINVAL: The request is not supported
+ *  - CHITCP_ENOMEM: Could not allocate memory for the request
+ *
+ */
+int chitcpd_handler_call(handler_thread_args_t *ha, ChitcpdMsg *req, int fd, uint8_t *recv_dst, ChitcpdMsg **resp_p);
+
+
+/*
+ * chitcpd_handler_release - Release a response returned by chitcpd_handler_call
+ *
+ * ha: Connection
+ *
+ * resp: Response
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_handler_release(handler_thread_args_t *ha, ChitcpdMsg *resp);
+
+
+/*
+ * chitcpd_handler_remove_local_connection - Remove an in-process application's connection
+ *
+ * Like a client disconnecting: any calls that are blocked return, and
+ * the connection's sockets are freed once the last of their responses
+ * has been released. The connection can't be used after this.
+ *
+ * ha: Connection
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_handler_remove_local_connection(handler_thread_args_t *ha);
 
 
 #endif /* HANDLER_H_ */
@@ -57,6 +57,8 @@
 #include "chitcp/chitcpd.h"
 #include "chitcp/log.h"
 #include "server.h"
+#include "transport.h"
+#include "affinity.h"
 
 int main(int argc, char *argv[])
 {
@@ -67,7 +69,29 @@ int main(int argc, char *argv[])
     char *port = NULL;
     char *usocket = NULL;
     char *cap_file = NULL;
+    char *netem_file = NULL;
+    pcap_options_t pcap_options = {PCAP_FORMAT_PCAP, 0, 0, 0};
     int verbosity = 0;
+    bool_t sync_log = FALSE;
+    tcp_engine_t tcp_engine = TCP_ENGINE_THREAD_PER_SOCKET;
+    int num_tcp_workers = 0;
+    int num_handler_threads = 0;
+    uint32_t buf_size = 0;
+    uint32_t buf_max = 0;
+    bool_t buf_autotune = FALSE;
+    size_t mem_limit = 0;
+    size_t socket_mem_limit = 0;
+    bool_t timestamps = FALSE;
+    bool_t sack = FALSE;
+    bool_t syncookies = FALSE;
+    bool_t coalesce = FALSE;
+    int stripes = 1;
+    const transport_t *transport = &transport_tcp;
+    cpu_placement_t placement = {0};
+    int cc_algorithm = TCP_CC_NEWRENO;
+    bool_t virtual_time = FALSE;
+    uint64_t virtual_quiet = 0;
+    unsigned int trace_sample = 0;
 
     /* Stop SIGPIPE from messing with our sockets */
     sigemptyset (&new);
@@ -79,23 +103,137 @@ int main(int argc, char *argv[])
     }
 
     /* Process command-line arguments */
-    while ((opt = getopt(argc, argv, "c:p:s:vh")) != -1)
+    while ((opt = getopt(argc, argv, "c:GL:R:T:p:s:w:H:m:x:A:b:a:M:Q:tSKgC:N:V:P:lvh")) != -1)
         switch (opt)
         {
         case 'c':
             cap_file = strdup(optarg);
             break;
+        case 'G':
+            pcap_options.format = PCAP_FORMAT_PCAPNG;
+            break;
+        case 'L':
+            pcap_options.snaplen = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            pcap_options.rotate_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            pcap_options.rotate_secs = strtoul(optarg, NULL, 10);
+            break;
         case 'p':
             port = strdup(optarg);
             break;
         case 's':
             usocket = strdup(optarg);
             break;
+        case 'w':
+            tcp_engine = TCP_ENGINE_WORKER_POOL;
+            num_tcp_workers = atoi(optarg);
+            break;
+        case 'H':
+            num_handler_threads = atoi(optarg);
+            break;
+        case 'm':
+            stripes = atoi(optarg);
+            break;
+        case 'x':
+            if ((transport = transport_lookup(optarg)) == NULL)
+            {
+                printf("ERROR: Unknown transport: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'A':
+            if (affinity_parse_cpus(optarg, &placement) != CHITCP_OK)
+            {
+                printf("ERROR: Invalid list of CPUs: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'b':
+            buf_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            buf_autotune = TRUE;
+            buf_max = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            mem_limit = strtoull(optarg, NULL, 10);
+            break;
+        case 'Q':
+            socket_mem_limit = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            timestamps = TRUE;
+            break;
+        case 'S':
+            sack = TRUE;
+            break;
+        case 'K':
+            syncookies = TRUE;
+            break;
+        case 'g':
+            coalesce = TRUE;
+            break;
+        case 'C':
+            if ((cc_algorithm = tcp_cc_lookup(optarg)) < 0)
+            {
+                printf("ERROR: Unknown congestion control algorithm: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'N':
+            netem_file = strdup(optarg);
+            break;
+        case 'V':
+            virtual_time = TRUE;
+            virtual_quiet = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'P':
+            trace_sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            sync_log = TRUE;
+            break;
         case 'v':
             verbosity++;
             break;
         case 'h':
-            printf("Usage: chitcpd [-p PORT] [-s UNIX_SOCKET] [(-v|-vv|-vvv|-vvvv)]\n");
+            printf("Usage: chitcpd [-p PORT] [-s UNIX_SOCKET] [-w NUM_WORKERS] [-H NUM_HANDLERS] [-m STRIPES] [-x TRANSPORT] [-A CPUS] [-b BYTES] [-a MAX_BYTES] [-M BYTES] [-Q BYTES] [-t] [-S] [-K] [-g] [-C ALGORITHM] [-N PROFILE_FILE] [-V QUIET_US] [-P RATIO] [-c CAPTURE_FILE [-G] [-L SNAPLEN] [-R BYTES] [-T SECONDS]] [-l] [(-v|-vv|-vvv|-vvvv)]\n");
+            printf("       -w: Run TCP on a pool of NUM_WORKERS threads (0: one per CPU)\n");
+            printf("           instead of one thread per socket\n");
+            printf("       -H: Handle the requests from all the applications on a pool of\n");
+            printf("           NUM_HANDLERS threads (default: one per CPU)\n");
+            printf("       -m: Open STRIPES connections to each peer chitcpd (up to %i), and\n", CONNECTION_MAX_STRIPES);
+            printf("           receive on them with as many threads\n");
+            printf("       -x: Send the packets to the other chitcpd's over TRANSPORT: tcp (default),\n");
+            printf("           udp, or (for the connections to this chitcpd) unix or shm\n");
+            printf("       -A: Pin the threads to the CPUs in CPUS (e.g., 0-3,8): one each for the\n");
+            printf("           network I/O threads and TCP workers, and the rest on their NUMA nodes\n");
+            printf("       -b: Default size of the sockets' send and receive buffers\n");
+            printf("       -a: Grow the sockets' buffers as they fill up, up to MAX_BYTES\n");
+            printf("       -M: Limit the memory used by packet queues and socket buffers to BYTES\n");
+            printf("           (packets are dropped, and windows stop opening, as it fills up)\n");
+            printf("       -Q: Limit the memory used by each socket's queued packets to BYTES\n");
+            printf("       -t: Use the TCP timestamps option (for per-segment RTT samples)\n");
+            printf("       -S: Use selective acknowledgements (SACK)\n");
+            printf("       -K: Answer SYNs with SYN cookies when a listener's queues are full\n");
+            printf("       -g: Coalesce in-order data segments before TCP handles them\n");
+            printf("       -C: Default congestion control algorithm (newreno or cubic)\n");
+            printf("       -N: Emulate the links from the peers with the profiles in PROFILE_FILE\n");
+            printf("           (delay, jitter, bandwidth, loss and reordering; see netem.h)\n");
+            printf("       -V: Run on virtual time, which skips ahead to the next timeout once\n");
+            printf("           nothing has happened for QUIET_US microseconds (0: default)\n");
+            printf("       -P: Time one in every RATIO received segments through each stage of\n");
+            printf("           chitcpd (see chitcpd_get_stats)\n");
+            printf("       -c: Capture the packets that are sent and received to CAPTURE_FILE\n");
+            printf("       -G: Write the capture in pcapng format, with one interface per socket\n");
+            printf("       -L: Only capture the first SNAPLEN bytes of each packet\n");
+            printf("       -R: Start a new capture file (CAPTURE_FILE.1, .2, ...) every BYTES bytes\n");
+            printf("       -T: Start a new capture file every SECONDS seconds\n");
+            printf("       -l: Print log messages as they are logged, instead of from a\n");
+            printf("           separate thread (slower, but nothing is lost if chitcpd crashes)\n");
             exit(0);
         default:
             printf("ERROR: Unknown option -%c\n", opt);
@@ -128,6 +266,15 @@ int main(int argc, char *argv[])
         break;
     }
 
+    if(virtual_time && chitcp_clock_set(CHITCP_CLOCK_VIRTUAL, virtual_quiet) != CHITCP_OK)
+    {
+        fprintf(stderr, "Could not use virtual time.\n");
+        exit(-1);
+    }
+
+    if(!sync_log && chitcp_log_async_start() != CHITCP_OK)
+        fprintf(stderr, "Could not start the log writer. Logging synchronously.\n");
+
 
     /* Allocate the serverinfo struct. It contains all of the daemon's state */
     si = calloc(1, sizeof(serverinfo_t));
@@ -140,6 +287,31 @@ int main(int argc, char *argv[])
     else
         chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
     si->libpcap_file_name = cap_file;
+    si->pcap_options = pcap_options;
+    si->tcp_engine = tcp_engine;
+    si->num_tcp_workers = num_tcp_workers;
+    si->num_handler_threads = num_handler_threads;
+    si->connection_stripes = stripes;
+    si->transport = transport;
+    si->placement = placement;
+    si->tcp_sndbuf_default = buf_size;
+    si->tcp_rcvbuf_default = buf_size;
+    si->tcp_buf_max = buf_max;
+    si->tcp_buf_autotune = buf_autotune;
+    si->mem_limit = mem_limit;
+    si->socket_mem_limit = socket_mem_limit;
+    si->tcp_timestamps = timestamps;
+    si->tcp_sack = sack;
+    si->tcp_syncookies = syncookies;
+    si->tcp_coalesce = coalesce;
+    si->tcp_cc_default = cc_algorithm;
+    si->trace_sample = trace_sample;
+
+    if(netem_file && netem_load_profiles(netem_file, &si->netem_profiles) != CHITCP_OK)
+    {
+        fprintf(stderr, "Could not load link profiles from %s.\n", netem_file);
+        exit(-1);
+    }
 
     /* Run the daemon */
     rc = chitcpd_server_init(si);
@@ -0,0 +1,184 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Memory budgets of the daemon and of its sockets
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MEMBUDGET_H_
+#define MEMBUDGET_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+
+/* A budget is split in eighths. Data (segments with a payload, and
+ * socket buffers) can only be charged to the first MEM_BUDGET_DATA_SHARE
+ * of them, so the rest is kept for ACKs, FINs and RSTs, which are what
+ * drains the queues. Past MEM_BUDGET_PRESSURE eighths, the budget is
+ * under pressure, and receivers stop opening their windows. */
+#define MEM_BUDGET_DATA_SHARE (7)
+#define MEM_BUDGET_PRESSURE (4)
+
+/* What a queued packet is charged: its data, and its tcp_packet_t
+ * (which the pending packets queue is linked through) */
+#define MEM_PACKET_COST(packet) ((packet)->length + sizeof(tcp_packet_t))
+
+/* A memory budget. used is charged and uncharged by any thread, so it
+ * is only accessed atomically. A limit of 0 means there is no limit
+ * (but the memory is still accounted for). */
+typedef struct mem_budget
+{
+    size_t limit;
+    atomic_size_t used;
+
+    /* Charges refused because they didn't fit in the budget */
+    atomic_uint_fast64_t drops;
+} mem_budget_t;
+
+
+/*
+ * mem_budget_init - Initializes a memory budget
+ *
+ * budget: Budget
+ *
+ * limit: Most bytes that can be charged to it (0 for no limit)
+ *
+ * Returns: Nothing.
+ *
+ */
+static inline void mem_budget_init(mem_budget_t *budget, size_t limit)
+{
+    budget->limit = limit;
+    atomic_init(&budget->used, 0);
+    atomic_init(&budget->drops, 0);
+}
+
+
+/*
+ * mem_budget_charge - Charges memory to a budget, if it fits
+ *
+ * budget: Budget
+ *
+ * n: Bytes to charge
+ *
+ * data: Is this data (which can't use the share of the budget that is
+ *       kept for segments without a payload)?
+ *
+ * Returns: TRUE if the bytes were charged, FALSE if they did not fit.
+ *
+ */
+static inline bool_t mem_budget_charge(mem_budget_t *budget, size_t n, bool_t data)
+{
+    size_t limit = budget->limit;
+    size_t used;
+
+    if (limit == 0)
+    {
+        atomic_fetch_add_explicit(&budget->used, n, memory_order_relaxed);
+        return TRUE;
+    }
+
+    if (data)
+        limit = limit / 8 * MEM_BUDGET_DATA_SHARE;
+
+    used = atomic_load_explicit(&budget->used, memory_order_relaxed);
+    do
+    {
+        if (used + n > limit)
+        {
+            atomic_fetch_add_explicit(&budget->drops, 1, memory_order_relaxed);
+            return FALSE;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&budget->used, &used, used + n,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    return TRUE;
+}
+
+
+/*
+ * mem_budget_force - Charges memory to a budget, even if it doesn't fit
+ *
+ * For memory that has already been committed to (e.g., the buffers of
+ * a socket that has already been connected). It still counts towards
+ * the charges that will be refused afterwards.
+ *
+ * budget: Budget
+ *
+ * n: Bytes to charge
+ *
+ * Returns: Nothing.
+ *
+ */
+static inline void mem_budget_force(mem_budget_t *budget, size_t n)
+{
+    atomic_fetch_add_explicit(&budget->used, n, memory_order_relaxed);
+}
+
+
+/*
+ * mem_budget_uncharge - Returns memory to a budget
+ *
+ * budget: Budget
+ *
+ * n: Bytes to return (which must have been charged)
+ *
+ * Returns: Nothing.
+ *
+ */
+static inline void mem_budget_uncharge(mem_budget_t *budget, size_t n)
+{
+    atomic_fetch_sub_explicit(&budget->used, n, memory_order_relaxed);
+}
+
+
+/*
+ * mem_budget_pressure - Is a budget under pressure?
+ *
+ * budget: Budget
+ *
+ * Returns: TRUE if more than MEM_BUDGET_PRESSURE eighths of the budget are
+ *          used (never, if it has no limit), FALSE otherwise.
+ *
+ */
+static inline bool_t mem_budget_pressure(mem_budget_t *budget)
+{
+    return budget->limit != 0 &&
+           atomic_load_explicit(&budget->used, memory_order_relaxed) > budget->limit / 8 * MEM_BUDGET_PRESSURE;
+}
+
+#endif /* MEMBUDGET_H_ */
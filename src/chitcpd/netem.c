@@ -0,0 +1,445 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Network emulation, along the lines of Linux's netem
+ *
+ *  Every packet received from a peer with a link profile goes through
+ *  the profile's loss models and token bucket, and is given a delivery
+ *  time. The packet delivery thread (see connection.c) then delivers
+ *  the packets in delivery time order.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include "netem.h"
+#include "chitcp/addr.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/utlist.h"
+
+#define NETEM_LINE_MAX (1024)
+
+/* Minimum token bucket size (a full Ethernet frame) */
+#define NETEM_BURST_MIN (1500)
+
+/* Uniform random number in [0, 1) (xorshift64*) */
+static double netem_random(netem_profile_t *profile)
+{
+    uint64_t x = profile->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    profile->rng = x;
+
+    return ((x * UINT64_C(2685821657736338717)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Parses a time (in seconds). The default unit is ms, like in tc */
+static int netem_parse_time(const char *value, double *seconds)
+{
+    char *end;
+    double t = strtod(value, &end);
+
+    if (end == value || t < 0)
+        return CHITCP_EINVAL;
+
+    if (*end == '\0' || !strcmp(end, "ms"))
+        *seconds = t / 1e3;
+    else if (!strcmp(end, "s"))
+        *seconds = t;
+    else if (!strcmp(end, "us"))
+        *seconds = t / 1e6;
+    else
+        return CHITCP_EINVAL;
+
+    return CHITCP_OK;
+}
+
+/* Parses a rate (in bytes per second) */
+static int netem_parse_rate(const char *value, double *rate)
+{
+    static const struct { const char *unit; double bytes; } units[] =
+    {
+        {"", 1}, {"bps", 1}, {"kbps", 1e3}, {"mbps", 1e6},
+        {"bit", 1 / 8.0}, {"kbit", 1e3 / 8}, {"mbit", 1e6 / 8}, {"gbit", 1e9 / 8},
+    };
+    char *end;
+    double r = strtod(value, &end);
+
+    if (end == value || r < 0)
+        return CHITCP_EINVAL;
+
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+        if (!strcasecmp(end, units[i].unit))
+        {
+            *rate = r * units[i].bytes;
+            return CHITCP_OK;
+        }
+
+    return CHITCP_EINVAL;
+}
+
+/* Parses a probability (a number in [0, 1] or a percentage). If end
+ * is not NULL, the probability may be followed by other characters */
+static int netem_parse_prob(const char *value, double *prob, const char **end)
+{
+    char *e;
+    double p = strtod(value, &e);
+
+    if (e == value)
+        return CHITCP_EINVAL;
+
+    if (*e == '%')
+    {
+        p /= 100;
+        e++;
+    }
+
+    if (p < 0 || p > 1 || (end == NULL && *e != '\0'))
+        return CHITCP_EINVAL;
+
+    if (end != NULL)
+        *end = e;
+    *prob = p;
+
+    return CHITCP_OK;
+}
+
+/* Parses a Gilbert-Elliott model (P/R[/BAD_LOSS[/GOOD_LOSS]]) */
+static int netem_parse_ge(const char *value, netem_profile_t *profile)
+{
+    double *params[] = {&profile->ge_p, &profile->ge_r, &profile->ge_loss_bad, &profile->ge_loss_good};
+    const char *p = value;
+
+    /* By default, every packet is lost in the Bad state, and none in the Good state */
+    profile->ge_loss_bad = 1.0;
+    profile->ge_loss_good = 0.0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (netem_parse_prob(p, params[i], &p) != CHITCP_OK)
+            return CHITCP_EINVAL;
+
+        if (*p == '\0')
+            return i >= 1 ? CHITCP_OK : CHITCP_EINVAL;
+        else if (*p != '/')
+            return CHITCP_EINVAL;
+        p++;
+    }
+
+    return CHITCP_EINVAL;
+}
+
+/* Parses a peer ("default" or an IP address) */
+static int netem_parse_peer(const char *value, netem_profile_t *profile)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *) &profile->peer;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &profile->peer;
+
+    if (!strcmp(value, "default"))
+    {
+        profile->any_peer = TRUE;
+        return CHITCP_OK;
+    }
+
+    if (inet_pton(AF_INET, value, &sin->sin_addr) == 1)
+        sin->sin_family = AF_INET;
+    else if (inet_pton(AF_INET6, value, &sin6->sin6_addr) == 1)
+        sin6->sin6_family = AF_INET6;
+    else
+        return CHITCP_EINVAL;
+
+    return CHITCP_OK;
+}
+
+/* See netem.h */
+int netem_parse_profile(const char *line, netem_profile_t *profile)
+{
+    char buf[NETEM_LINE_MAX];
+    char *saveptr, *token;
+    int rc = CHITCP_OK;
+
+    strncpy(buf, line, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    if ((token = strchr(buf, '#')) != NULL)
+        *token = '\0';
+
+    memset(profile, 0, sizeof(netem_profile_t));
+    profile->dist = NETEM_DIST_UNIFORM;
+
+    if ((token = strtok_r(buf, " \t\r\n", &saveptr)) == NULL)
+        return CHITCP_ENOENT;
+
+    if (netem_parse_peer(token, profile) != CHITCP_OK)
+    {
+        chilog(ERROR, "Invalid peer in link profile: %s", token);
+        return CHITCP_EINVAL;
+    }
+
+    while (rc == CHITCP_OK && (token = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+    {
+        char *value = strchr(token, '=');
+
+        if (value == NULL)
+        {
+            chilog(ERROR, "Expected OPTION=VALUE in link profile: %s", token);
+            return CHITCP_EINVAL;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(token, "delay"))
+            rc = netem_parse_time(value, &profile->delay);
+        else if (!strcmp(token, "jitter"))
+            rc = netem_parse_time(value, &profile->jitter);
+        else if (!strcmp(token, "dist"))
+        {
+            if (!strcmp(value, "uniform"))
+                profile->dist = NETEM_DIST_UNIFORM;
+            else if (!strcmp(value, "normal"))
+                profile->dist = NETEM_DIST_NORMAL;
+            else
+                rc = CHITCP_EINVAL;
+        }
+        else if (!strcmp(token, "rate"))
+            rc = netem_parse_rate(value, &profile->rate);
+        else if (!strcmp(token, "burst"))
+        {
+            char *end;
+            profile->burst = strtod(value, &end);
+            if (end == value || *end != '\0' || profile->burst < 0)
+                rc = CHITCP_EINVAL;
+        }
+        else if (!strcmp(token, "loss"))
+            rc = netem_parse_prob(value, &profile->loss, NULL);
+        else if (!strcmp(token, "reorder"))
+            rc = netem_parse_prob(value, &profile->reorder, NULL);
+        else if (!strcmp(token, "ge"))
+            rc = netem_parse_ge(value, profile);
+        else if (!strcmp(token, "seed"))
+        {
+            char *end;
+            profile->rng = strtoull(value, &end, 0);
+            if (end == value || *end != '\0')
+                rc = CHITCP_EINVAL;
+        }
+        else
+        {
+            chilog(ERROR, "Unknown option in link profile: %s", token);
+            return CHITCP_EINVAL;
+        }
+
+        if (rc != CHITCP_OK)
+            chilog(ERROR, "Invalid value in link profile: %s=%s", token, value);
+    }
+
+    if (rc != CHITCP_OK)
+        return rc;
+
+    /* The bucket must hold at least one full packet, and starts full */
+    if (profile->burst < NETEM_BURST_MIN)
+        profile->burst = NETEM_BURST_MIN;
+    profile->tokens = profile->burst;
+
+    /* xorshift must not be seeded with 0 */
+    if (profile->rng == 0)
+        profile->rng = ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ (uint64_t) time(NULL) ^ 1;
+
+    return CHITCP_OK;
+}
+
+/* See netem.h */
+int netem_load_profiles(const char *filename, netem_profile_t **profiles)
+{
+    char line[NETEM_LINE_MAX];
+    int lineno = 0, rc = CHITCP_OK;
+    FILE *f;
+
+    if ((f = fopen(filename, "r")) == NULL)
+    {
+        perror("Could not open link profile file");
+        return CHITCP_ENOENT;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        netem_profile_t profile, *p;
+
+        lineno++;
+        rc = netem_parse_profile(line, &profile);
+
+        if (rc == CHITCP_ENOENT)
+        {
+            rc = CHITCP_OK;
+            continue;
+        }
+        else if (rc != CHITCP_OK)
+        {
+            chilog(ERROR, "%s:%i: Invalid link profile", filename, lineno);
+            break;
+        }
+
+        if ((p = malloc(sizeof(netem_profile_t))) == NULL)
+        {
+            rc = CHITCP_ENOMEM;
+            break;
+        }
+        memcpy(p, &profile, sizeof(netem_profile_t));
+        DL_APPEND(*profiles, p);
+    }
+
+    fclose(f);
+
+    return rc;
+}
+
+/* See netem.h */
+netem_profile_t *netem_lookup_profile(netem_profile_t *profiles, struct sockaddr *peer)
+{
+    netem_profile_t *profile, *any = NULL;
+
+    DL_FOREACH(profiles, profile)
+    {
+        if (profile->any_peer)
+        {
+            if (any == NULL)
+                any = profile;
+        }
+        else if (profile->peer.ss_family == peer->sa_family &&
+                 chitcp_addr_cmp((struct sockaddr *) &profile->peer, peer) == 0)
+            return profile;
+    }
+
+    return any;
+}
+
+/* Delay of a packet, following the profile's distribution */
+static double netem_sample_delay(netem_profile_t *profile)
+{
+    double delay = profile->delay;
+
+    if (profile->jitter > 0)
+    {
+        if (profile->dist == NETEM_DIST_NORMAL)
+        {
+            /* Box-Muller */
+            double u1 = 1.0 - netem_random(profile);
+            double u2 = netem_random(profile);
+            delay += profile->jitter * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+        }
+        else
+            delay += profile->jitter * (2 * netem_random(profile) - 1);
+    }
+
+    return delay > 0 ? delay : 0;
+}
+
+/* See netem.h */
+bool_t netem_schedule(netem_profile_t *profile, uint32_t len, struct timespec *now, struct timespec *delivery_time)
+{
+    double t = 0.0;
+
+    /* Gilbert-Elliott loss: first move to the next state, and then
+     * lose the packet with that state's probability */
+    if (profile->ge_p > 0)
+    {
+        if (profile->ge_bad)
+        {
+            if (netem_random(profile) < profile->ge_r)
+                profile->ge_bad = FALSE;
+        }
+        else if (netem_random(profile) < profile->ge_p)
+            profile->ge_bad = TRUE;
+
+        if (netem_random(profile) < (profile->ge_bad ? profile->ge_loss_bad : profile->ge_loss_good))
+            return FALSE;
+    }
+
+    if (profile->loss > 0 && netem_random(profile) < profile->loss)
+        return FALSE;
+
+    /* Token bucket. The tokens can go negative: the packet then has to
+     * wait until the bucket has been refilled up to zero (which
+     * also accounts for the packets that are already waiting) */
+    if (profile->rate > 0)
+    {
+        if (profile->last_refill.tv_sec != 0 || profile->last_refill.tv_nsec != 0)
+        {
+            double elapsed = (now->tv_sec - profile->last_refill.tv_sec) +
+                             (now->tv_nsec - profile->last_refill.tv_nsec) / 1e9;
+            if (elapsed > 0)
+                profile->tokens = MIN(profile->tokens + elapsed * profile->rate, profile->burst);
+        }
+        profile->last_refill = *now;
+
+        profile->tokens -= len;
+        if (profile->tokens < 0)
+            t += -profile->tokens / profile->rate;
+    }
+
+    /* Reordered packets skip the delay, so they overtake the others */
+    if (profile->reorder == 0 || netem_random(profile) >= profile->reorder)
+        t += netem_sample_delay(profile);
+
+    uint64_t ns = (uint64_t) (t * 1e9);
+
+    delivery_time->tv_sec = now->tv_sec + ns / 1000000000;
+    delivery_time->tv_nsec = now->tv_nsec + ns % 1000000000;
+    if (delivery_time->tv_nsec >= 1000000000)
+    {
+        delivery_time->tv_nsec -= 1000000000;
+        delivery_time->tv_sec += 1;
+    }
+
+    return TRUE;
+}
+
+/* See netem.h */
+void netem_free_profiles(netem_profile_t **profiles)
+{
+    netem_profile_t *profile, *tmp;
+
+    DL_FOREACH_SAFE(*profiles, profile, tmp)
+    {
+        DL_DELETE(*profiles, profile);
+        free(profile);
+    }
+}
@@ -0,0 +1,186 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Network emulation (see netem.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NETEM_H_
+#define NETEM_H_
+
+#include <time.h>
+#include <sys/socket.h>
+#include "chitcp/types.h"
+
+/* Distribution of the per-packet delay */
+typedef enum
+{
+    NETEM_DIST_UNIFORM = 0,  /* Uniform in [delay - jitter, delay + jitter] */
+    NETEM_DIST_NORMAL  = 1,  /* Normal, with mean delay and standard deviation jitter */
+} netem_dist_t;
+
+/* Profile of the emulated link from a peer. Packets received from the
+ * peer can be lost (at random, and/or following a Gilbert-Elliott
+ * model), are limited by a token bucket, and are then delayed (or,
+ * if they are reordered, delivered without a delay).
+ *
+ * The probabilities are in [0, 1], times are in seconds, and the
+ * rate is in bytes per second (0: no limit). Packets are received by
+ * several threads, so a profile's state is only used with the server's
+ * lock_delivery held (see chitcpd_dispatch_packet). */
+typedef struct netem_profile
+{
+    /* Peer (only the IP address is compared). If any_peer is TRUE,
+     * the profile applies to all the peers without a profile */
+    bool_t any_peer;
+    struct sockaddr_storage peer;
+
+    double delay;
+    double jitter;
+    netem_dist_t dist;
+
+    double rate;
+    double burst;           /* Token bucket size, in bytes */
+
+    double loss;            /* Random loss */
+    double ge_p;            /* Gilbert-Elliott: Good -> Bad (0: no model) */
+    double ge_r;            /* Gilbert-Elliott: Bad -> Good */
+    double ge_loss_bad;     /* Loss in the Bad state */
+    double ge_loss_good;    /* Loss in the Good state */
+
+    double reorder;
+
+    /* State */
+    bool_t ge_bad;
+    double tokens;
+    struct timespec last_refill;
+    uint64_t rng;
+
+    struct netem_profile *prev;
+    struct netem_profile *next;
+} netem_profile_t;
+
+
+/*
+ * netem_load_profiles - Load link profiles from a file
+ *
+ * Each line of the file has a peer ("default", or an IPv4 or IPv6
+ * address), followed by any number of OPTION=VALUE pairs:
+ *
+ *   delay=TIME, jitter=TIME   Times are in ms, unless they end in s, ms or us
+ *   dist=uniform|normal
+ *   rate=RATE                 In bytes/s, unless it ends in bit, kbit,
+ *                             mbit, gbit, bps, kbps or mbps
+ *   burst=BYTES
+ *   loss=PROB, reorder=PROB   Probabilities can be percentages (e.g., 1%)
+ *   ge=P/R[/BAD_LOSS[/GOOD_LOSS]]
+ *   seed=N                    Seed of the profile's random numbers
+ *
+ * Everything after a # is a comment.
+ *
+ * filename: Name of the file
+ *
+ * profiles: Output parameter with the list of profiles. The profiles
+ *           are appended to it.
+ *
+ * Returns:
+ *  - CHITCP_OK: Profiles loaded correctly
+ *  - CHITCP_ENOENT: Could not open the file
+ *  - CHITCP_EINVAL: Syntax error in the file
+ *  - CHITCP_ENOMEM: Could not allocate memory for a profile
+ *
+ */
+int netem_load_profiles(const char *filename, netem_profile_t **profiles);
+
+
+/*
+ * netem_parse_profile - Parse a profile
+ *
+ * line: A line of a profile file (see netem_load_profiles)
+ *
+ * profile: Profile to initialize
+ *
+ * Returns:
+ *  - CHITCP_OK: Profile parsed correctly
+ *  - CHITCP_ENOENT: The line is empty (or just a comment)
+ *  - CHITCP_EINVAL: Syntax error
+ *
+ */
+int netem_parse_profile(const char *line, netem_profile_t *profile);
+
+
+/*
+ * netem_lookup_profile - Find the profile of a peer
+ *
+ * profiles: List of profiles
+ *
+ * peer: Peer's address
+ *
+ * Returns: The peer's profile, the default profile if the peer has
+ *          none, or NULL if there is no default profile either.
+ *
+ */
+netem_profile_t *netem_lookup_profile(netem_profile_t *profiles, struct sockaddr *peer);
+
+
+/*
+ * netem_schedule - Emulate the link for a packet
+ *
+ * profile: Link profile
+ *
+ * len: Length of the packet (in bytes)
+ *
+ * now: Time when the packet was received
+ *
+ * delivery_time: Output parameter with the time when the packet
+ *                must be delivered (in the same clock as now)
+ *
+ * Returns: FALSE if the packet is lost, TRUE otherwise.
+ *
+ */
+bool_t netem_schedule(netem_profile_t *profile, uint32_t len, struct timespec *now, struct timespec *delivery_time);
+
+
+/*
+ * netem_free_profiles - Free a list of profiles
+ *
+ * profiles: List of profiles (set to NULL)
+ *
+ * Returns: Nothing.
+ *
+ */
+void netem_free_profiles(netem_profile_t **profiles);
+
+#endif /* NETEM_H_ */
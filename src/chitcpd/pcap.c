@@ -0,0 +1,662 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Packet capture, in pcap or pcapng format
+ *
+ *  The threads that send and receive packets only add a record to a
+ *  lock-free ring (sharing the packet's contents instead of copying
+ *  them). A capture thread takes the records out of the ring, adds an
+ *  IPv4 or IPv6 header to them, and writes them to the capture file
+ *  through a large buffer, which is only written out when it fills up
+ *  or when the ring is empty.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "pcap.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+
+#define PCAP_RING_MASK (PCAP_RING_SIZE - 1)
+
+#define PCAP_MAGIC (0xa1b23c4d)   /* Nanosecond timestamps */
+#define LINKTYPE_RAW (101)
+
+#define PCAPNG_SHB (0x0A0D0D0A)
+#define PCAPNG_IDB (0x00000001)
+#define PCAPNG_EPB (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+#define PCAPNG_OPT_ENDOFOPT (0)
+#define PCAPNG_OPT_IF_NAME (2)
+#define PCAPNG_OPT_IF_TSRESOL (9)
+
+#define PAD4(len) (((len) + 3) & ~3)
+
+/* Longest IP header we generate (IPv6) */
+#define PCAP_IPHDR_MAX (40)
+
+/* Where the checksum is in the TCP header */
+#define PCAP_TCP_CKSUM_OFFSET (16)
+
+static const uint8_t pcap_zeroes[4] = {0, 0, 0, 0};
+
+typedef struct pcap_file_hdr
+{
+    uint32_t magic_number;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} pcap_file_hdr_t;
+
+typedef struct pcap_rec_hdr
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_hdr_t;
+
+typedef struct pcapng_shb
+{
+    uint32_t block_type;
+    uint32_t block_len;
+    uint32_t byte_order_magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t  section_len;
+    uint32_t block_len_trailer;
+} __attribute__ ((packed)) pcapng_shb_t;
+
+typedef struct pcapng_idb
+{
+    uint32_t block_type;
+    uint32_t block_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+} pcapng_idb_t;
+
+typedef struct pcapng_epb
+{
+    uint32_t block_type;
+    uint32_t block_len;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t origlen;
+} pcapng_epb_t;
+
+static int pcap_open_file(pcap_writer_t *w);
+static void *pcap_thread_func(void *args);
+
+
+/* See pcap.h */
+int pcap_writer_open(const char *filename, pcap_options_t *options, pcap_writer_t **writer)
+{
+    pcap_writer_t *w;
+    int rc;
+
+    w = calloc(1, sizeof(pcap_writer_t));
+    if(w == NULL)
+        return CHITCP_ENOMEM;
+
+    if(options)
+        w->options = *options;
+    if(w->options.snaplen == 0)
+        w->options.snaplen = PCAP_SNAPLEN_DEFAULT;
+
+    w->filename = strdup(filename);
+    w->ring = calloc(PCAP_RING_SIZE, sizeof(pcap_record_t));
+    w->buf = malloc(PCAP_BUFFER_SIZE);
+    if(w->filename == NULL || w->ring == NULL || w->buf == NULL)
+    {
+        rc = CHITCP_ENOMEM;
+        goto fail;
+    }
+
+    for(int i = 0; i < PCAP_RING_SIZE; i++)
+        atomic_init(&w->ring[i].seq, i);
+    atomic_init(&w->head, 0);
+    atomic_init(&w->captured, 0);
+    atomic_init(&w->dropped, 0);
+    atomic_init(&w->sleeping, FALSE);
+    atomic_init(&w->stopping, FALSE);
+
+    if(pcap_open_file(w) != CHITCP_OK)
+    {
+        rc = CHITCP_ENOENT;
+        goto fail;
+    }
+
+    pthread_mutex_init(&w->lock_ring, NULL);
+    pthread_cond_init(&w->cv_ring, NULL);
+
+    if(pthread_create(&w->thread, NULL, pcap_thread_func, w) != 0)
+    {
+        pthread_mutex_destroy(&w->lock_ring);
+        pthread_cond_destroy(&w->cv_ring);
+        fclose(w->file);
+        rc = CHITCP_ETHREAD;
+        goto fail;
+    }
+
+    chilog(INFO, "Capturing packets to %s file %s", w->options.format == PCAP_FORMAT_PCAPNG ? "pcapng" : "pcap", filename);
+
+    *writer = w;
+    return CHITCP_OK;
+
+fail:
+    free(w->interfaces);
+    free(w->buf);
+    free(w->ring);
+    free(w->filename);
+    free(w);
+    return rc;
+}
+
+
+/* See pcap.h */
+int pcap_capture(pcap_writer_t *w, int sockfd, pcap_direction_t direction,
+                 struct sockaddr *src, struct sockaddr *dst, tcp_packet_t *packet)
+{
+    pcap_record_t *rec;
+    size_t pos, seq;
+    socklen_t addrlen;
+
+    if(src->sa_family == AF_INET && dst->sa_family == AF_INET)
+        addrlen = sizeof(struct sockaddr_in);
+    else if(src->sa_family == AF_INET6 && dst->sa_family == AF_INET6)
+        addrlen = sizeof(struct sockaddr_in6);
+    else
+        return CHITCP_EINVAL;
+
+    // Claim a slot. A slot is free when its sequence number is the
+    // position we're claiming; if it is behind, the capture thread
+    // hasn't written out the record from the previous lap yet.
+    pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+    for(;;)
+    {
+        rec = &w->ring[pos & PCAP_RING_MASK];
+        seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+        if(seq == pos)
+        {
+            if(atomic_compare_exchange_weak_explicit(&w->head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if((ssize_t) (seq - pos) < 0)
+        {
+            atomic_fetch_add_explicit(&w->dropped, 1, memory_order_relaxed);
+            return CHITCP_EWOULDBLOCK;
+        }
+        else
+            pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->sockfd = sockfd;
+    rec->direction = direction;
+    memcpy(&rec->src, src, addrlen);
+    memcpy(&rec->dst, dst, addrlen);
+    chitcp_tcp_packet_share(&rec->packet, packet);
+
+    // Publish the record, and wake up the capture thread if it's
+    // waiting for one (both this store and the load of sleeping are
+    // sequentially consistent, so the thread can't miss the record)
+    atomic_store(&rec->seq, pos + 1);
+    atomic_fetch_add_explicit(&w->captured, 1, memory_order_relaxed);
+
+    if(atomic_load(&w->sleeping))
+    {
+        pthread_mutex_lock(&w->lock_ring);
+        pthread_cond_signal(&w->cv_ring);
+        pthread_mutex_unlock(&w->lock_ring);
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See pcap.h */
+void pcap_writer_close(pcap_writer_t *w)
+{
+    uint_fast64_t captured, dropped;
+
+    pthread_mutex_lock(&w->lock_ring);
+    atomic_store(&w->stopping, TRUE);
+    pthread_cond_signal(&w->cv_ring);
+    pthread_mutex_unlock(&w->lock_ring);
+
+    pthread_join(w->thread, NULL);
+
+    captured = atomic_load(&w->captured);
+    dropped = atomic_load(&w->dropped);
+    if(dropped > 0)
+        chilog(WARNING, "%lu of %lu packets were dropped from the capture (the capture ring was full)",
+               (unsigned long) dropped, (unsigned long) (captured + dropped));
+
+    fclose(w->file);
+    pthread_mutex_destroy(&w->lock_ring);
+    pthread_cond_destroy(&w->cv_ring);
+    free(w->interfaces);
+    free(w->buf);
+    free(w->ring);
+    free(w->filename);
+    free(w);
+}
+
+
+/*
+ * The functions below are only used by the capture thread (they write
+ * to the current file), so they don't need any synchronization.
+ */
+
+static void pcap_flush(pcap_writer_t *w)
+{
+    if(w->buf_len > 0)
+    {
+        if(fwrite(w->buf, w->buf_len, 1, w->file) != 1)
+            chilog(ERROR, "Could not write to capture file %s", w->filename);
+        w->buf_len = 0;
+    }
+    fflush(w->file);
+}
+
+static void pcap_append(pcap_writer_t *w, const void *data, size_t len)
+{
+    if(w->buf_len + len > PCAP_BUFFER_SIZE)
+    {
+        fwrite(w->buf, w->buf_len, 1, w->file);
+        w->buf_len = 0;
+    }
+
+    if(len > PCAP_BUFFER_SIZE)
+        fwrite(data, len, 1, w->file);
+    else
+    {
+        memcpy(w->buf + w->buf_len, data, len);
+        w->buf_len += len;
+    }
+    w->file_size += len;
+}
+
+static int pcap_open_file(pcap_writer_t *w)
+{
+    char *name = w->filename;
+    FILE *file;
+
+    if(w->file_index > 0)
+    {
+        name = malloc(strlen(w->filename) + 16);
+        if(name == NULL)
+            return CHITCP_ENOMEM;
+        sprintf(name, "%s.%d", w->filename, w->file_index);
+    }
+
+    file = fopen(name, "wb");
+    if(file == NULL)
+    {
+        chilog(ERROR, "Could not open capture file %s for writing", name);
+        if(name != w->filename)
+            free(name);
+        return CHITCP_ENOENT;
+    }
+    if(name != w->filename)
+        free(name);
+
+    w->file = file;
+    w->file_size = 0;
+    clock_gettime(CLOCK_REALTIME, &w->file_start);
+
+    // Interface IDs are per section, so every socket gets a new
+    // interface in the new file
+    w->num_interfaces = 0;
+    for(int i = 0; i < w->interfaces_size; i++)
+        w->interfaces[i] = -1;
+
+    if(w->options.format == PCAP_FORMAT_PCAPNG)
+    {
+        pcapng_shb_t shb;
+
+        shb.block_type = PCAPNG_SHB;
+        shb.block_len = sizeof(pcapng_shb_t);
+        shb.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC;
+        shb.version_major = 1;
+        shb.version_minor = 0;
+        shb.section_len = -1;
+        shb.block_len_trailer = sizeof(pcapng_shb_t);
+        pcap_append(w, &shb, sizeof(shb));
+    }
+    else
+    {
+        pcap_file_hdr_t hdr;
+
+        hdr.magic_number = PCAP_MAGIC;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.thiszone = 0;
+        hdr.sigfigs = 0;
+        hdr.snaplen = w->options.snaplen;
+        hdr.network = LINKTYPE_RAW;
+        pcap_append(w, &hdr, sizeof(hdr));
+    }
+
+    return CHITCP_OK;
+}
+
+static void pcap_rotate(pcap_writer_t *w, struct timespec *ts, size_t len)
+{
+    size_t header_len = w->options.format == PCAP_FORMAT_PCAPNG ? sizeof(pcapng_shb_t) : sizeof(pcap_file_hdr_t);
+    bool_t rotate = FALSE;
+    FILE *file = w->file;
+
+    // A file always gets at least one packet, or a packet larger than
+    // the rotation size would make us rotate forever
+    if(w->file_size <= header_len)
+        return;
+
+    if(w->options.rotate_size && w->file_size + len > w->options.rotate_size)
+        rotate = TRUE;
+    if(w->options.rotate_secs && ts->tv_sec - w->file_start.tv_sec >= (time_t) w->options.rotate_secs)
+        rotate = TRUE;
+
+    if(rotate)
+    {
+        pcap_flush(w);
+        w->file_index++;
+        if(pcap_open_file(w) == CHITCP_OK)
+            fclose(file);
+        else
+        {
+            // Keep writing to the current file
+            chilog(ERROR, "Could not rotate the capture, so it will stay in its current file");
+            w->file_index--;
+            w->options.rotate_size = 0;
+            w->options.rotate_secs = 0;
+        }
+    }
+}
+
+/* Returns the pcapng interface of a socket, writing an Interface
+ * Description Block the first time the socket appears in the file */
+static uint32_t pcap_interface(pcap_writer_t *w, int sockfd)
+{
+    pcapng_idb_t idb;
+    char name[32];
+    size_t name_len;
+    uint16_t opt[2];
+    uint32_t block_len;
+    uint8_t tsresol = 9;
+
+    if(sockfd < 0)
+        sockfd = 0;
+
+    if(sockfd >= w->interfaces_size)
+    {
+        int new_size = MAX(sockfd + 1, 2 * w->interfaces_size);
+        int *interfaces = realloc(w->interfaces, new_size * sizeof(int));
+
+        if(interfaces == NULL)
+            return 0;
+        for(int i = w->interfaces_size; i < new_size; i++)
+            interfaces[i] = -1;
+        w->interfaces = interfaces;
+        w->interfaces_size = new_size;
+    }
+
+    if(w->interfaces[sockfd] >= 0)
+        return w->interfaces[sockfd];
+
+    name_len = snprintf(name, sizeof(name), "socket%d", sockfd);
+    block_len = sizeof(pcapng_idb_t)
+                + 4 + PAD4(name_len)    /* if_name */
+                + 4 + 4                 /* if_tsresol */
+                + 4                     /* opt_endofopt */
+                + 4;                    /* Block length */
+
+    idb.block_type = PCAPNG_IDB;
+    idb.block_len = block_len;
+    idb.linktype = LINKTYPE_RAW;
+    idb.reserved = 0;
+    idb.snaplen = w->options.snaplen;
+    pcap_append(w, &idb, sizeof(idb));
+
+    opt[0] = PCAPNG_OPT_IF_NAME;
+    opt[1] = name_len;
+    pcap_append(w, opt, sizeof(opt));
+    pcap_append(w, name, name_len);
+    pcap_append(w, pcap_zeroes, PAD4(name_len) - name_len);
+
+    opt[0] = PCAPNG_OPT_IF_TSRESOL;
+    opt[1] = 1;
+    pcap_append(w, opt, sizeof(opt));
+    pcap_append(w, &tsresol, 1);
+    pcap_append(w, pcap_zeroes, 3);
+
+    opt[0] = PCAPNG_OPT_ENDOFOPT;
+    opt[1] = 0;
+    pcap_append(w, opt, sizeof(opt));
+    pcap_append(w, &block_len, sizeof(block_len));
+
+    w->interfaces[sockfd] = w->num_interfaces++;
+    return w->interfaces[sockfd];
+}
+
+/* Builds the IP header of a record, and returns its length */
+static size_t pcap_ip_header(pcap_record_t *rec, uint8_t *hdr)
+{
+    size_t len = rec->packet.length;
+
+    if(rec->src.ss_family == AF_INET)
+    {
+        uint16_t total_len = htons(20 + len);
+        uint16_t sum;
+
+        memset(hdr, 0, 20);
+        hdr[0] = 0x45;    /* Version 4, 5 words */
+        memcpy(hdr + 2, &total_len, 2);
+        hdr[8] = 64;      /* TTL */
+        hdr[9] = IPPROTO_TCP;
+        memcpy(hdr + 12, &((struct sockaddr_in *) &rec->src)->sin_addr, 4);
+        memcpy(hdr + 16, &((struct sockaddr_in *) &rec->dst)->sin_addr, 4);
+        sum = cksum(hdr, 20);
+        memcpy(hdr + 10, &sum, 2);
+        return 20;
+    }
+    else
+    {
+        uint16_t payload_len = htons(len);
+
+        memset(hdr, 0, 40);
+        hdr[0] = 0x60;    /* Version 6 */
+        memcpy(hdr + 4, &payload_len, 2);
+        hdr[6] = IPPROTO_TCP;
+        hdr[7] = 64;      /* Hop limit */
+        memcpy(hdr + 8, &((struct sockaddr_in6 *) &rec->src)->sin6_addr, 16);
+        memcpy(hdr + 24, &((struct sockaddr_in6 *) &rec->dst)->sin6_addr, 16);
+        return 40;
+    }
+}
+
+/* Computes the TCP checksum of a record's segment. chiTCP doesn't
+ * checksum the segments it sends (they're carried over a reliable
+ * connection), but without one every packet in the capture would be
+ * flagged as corrupted */
+static uint16_t pcap_tcp_cksum(pcap_record_t *rec)
+{
+    uint8_t pseudo[PCAP_IPHDR_MAX];
+    size_t pseudo_len, len = rec->packet.length;
+    uint32_t sum;
+
+    memset(pseudo, 0, sizeof(pseudo));
+    if(rec->src.ss_family == AF_INET)
+    {
+        // Addresses, zero, protocol, TCP length
+        memcpy(pseudo, &((struct sockaddr_in *) &rec->src)->sin_addr, 4);
+        memcpy(pseudo + 4, &((struct sockaddr_in *) &rec->dst)->sin_addr, 4);
+        pseudo[9] = IPPROTO_TCP;
+        pseudo[10] = len >> 8;
+        pseudo[11] = len & 0xff;
+        pseudo_len = 12;
+    }
+    else
+    {
+        // Addresses, TCP length (32 bits), zeroes, next header
+        memcpy(pseudo, &((struct sockaddr_in6 *) &rec->src)->sin6_addr, 16);
+        memcpy(pseudo + 16, &((struct sockaddr_in6 *) &rec->dst)->sin6_addr, 16);
+        pseudo[34] = len >> 8;
+        pseudo[35] = len & 0xff;
+        pseudo[39] = IPPROTO_TCP;
+        pseudo_len = 40;
+    }
+
+    // The checksum field itself counts as zero
+    sum = cksum_partial(pseudo, pseudo_len, 0);
+    sum = cksum_partial(rec->packet.raw, PCAP_TCP_CKSUM_OFFSET, sum);
+    sum = cksum_partial(rec->packet.raw + PCAP_TCP_CKSUM_OFFSET + 2, len - PCAP_TCP_CKSUM_OFFSET - 2, sum);
+
+    return cksum_finish(sum);
+}
+
+/* Appends the first LEN bytes of a record's segment, with its checksum */
+static void pcap_append_segment(pcap_writer_t *w, pcap_record_t *rec, size_t len)
+{
+    uint16_t sum = pcap_tcp_cksum(rec);
+
+    pcap_append(w, rec->packet.raw, MIN(len, PCAP_TCP_CKSUM_OFFSET));
+    if(len > PCAP_TCP_CKSUM_OFFSET)
+        pcap_append(w, &sum, MIN(len - PCAP_TCP_CKSUM_OFFSET, 2));
+    if(len > PCAP_TCP_CKSUM_OFFSET + 2)
+        pcap_append(w, rec->packet.raw + PCAP_TCP_CKSUM_OFFSET + 2, len - PCAP_TCP_CKSUM_OFFSET - 2);
+}
+
+static void pcap_write_record(pcap_writer_t *w, pcap_record_t *rec)
+{
+    uint8_t ip_header[PCAP_IPHDR_MAX];
+    size_t ip_len, orig_len, incl_len, ip_incl, tcp_incl;
+    bool_t pcapng = w->options.format == PCAP_FORMAT_PCAPNG;
+
+    ip_len = pcap_ip_header(rec, ip_header);
+    orig_len = ip_len + rec->packet.length;
+    incl_len = MIN(orig_len, w->options.snaplen);
+    ip_incl = MIN(ip_len, incl_len);
+    tcp_incl = incl_len - ip_incl;
+
+    pcap_rotate(w, &rec->ts, pcapng ? sizeof(pcapng_epb_t) + PAD4(incl_len) + 4
+                                    : sizeof(pcap_rec_hdr_t) + incl_len);
+
+    if(pcapng)
+    {
+        pcapng_epb_t epb;
+        uint64_t ts = (uint64_t) rec->ts.tv_sec * 1000000000ULL + rec->ts.tv_nsec;
+        uint32_t block_len = sizeof(pcapng_epb_t) + PAD4(incl_len) + 4;
+
+        epb.block_type = PCAPNG_EPB;
+        epb.block_len = block_len;
+        epb.interface_id = pcap_interface(w, rec->sockfd);
+        epb.ts_high = ts >> 32;
+        epb.ts_low = ts & 0xffffffff;
+        epb.caplen = incl_len;
+        epb.origlen = orig_len;
+        pcap_append(w, &epb, sizeof(epb));
+        pcap_append(w, ip_header, ip_incl);
+        pcap_append_segment(w, rec, tcp_incl);
+        pcap_append(w, pcap_zeroes, PAD4(incl_len) - incl_len);
+        pcap_append(w, &block_len, sizeof(block_len));
+    }
+    else
+    {
+        pcap_rec_hdr_t hdr;
+
+        hdr.ts_sec = rec->ts.tv_sec;
+        hdr.ts_nsec = rec->ts.tv_nsec;
+        hdr.incl_len = incl_len;
+        hdr.orig_len = orig_len;
+        pcap_append(w, &hdr, sizeof(hdr));
+        pcap_append(w, ip_header, ip_incl);
+        pcap_append_segment(w, rec, tcp_incl);
+    }
+}
+
+static void *pcap_thread_func(void *args)
+{
+    pcap_writer_t *w = (pcap_writer_t *) args;
+    pcap_record_t *rec;
+    struct timespec timeout;
+
+    for(;;)
+    {
+        rec = &w->ring[w->tail & PCAP_RING_MASK];
+
+        if(atomic_load(&rec->seq) == w->tail + 1)
+        {
+            pcap_write_record(w, rec);
+            chitcp_tcp_packet_free(&rec->packet);
+
+            // Hand the slot back to the producers, for the next lap
+            atomic_store_explicit(&rec->seq, w->tail + PCAP_RING_SIZE, memory_order_release);
+            w->tail++;
+            continue;
+        }
+
+        // The ring is empty, so this is a good time to write out
+        // what we have
+        pcap_flush(w);
+
+        if(atomic_load(&w->stopping))
+            break;
+
+        pthread_mutex_lock(&w->lock_ring);
+        atomic_store(&w->sleeping, TRUE);
+        if(atomic_load(&rec->seq) != w->tail + 1 && !atomic_load(&w->stopping))
+        {
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += 1;
+            pthread_cond_timedwait(&w->cv_ring, &w->lock_ring, &timeout);
+        }
+        atomic_store(&w->sleeping, FALSE);
+        pthread_mutex_unlock(&w->lock_ring);
+    }
+
+    return NULL;
+}
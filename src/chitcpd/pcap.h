@@ -0,0 +1,200 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Packet capture (see pcap.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PCAP_H_
+#define PCAP_H_
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+
+/* Number of records in the capture ring (must be a power of two) */
+#define PCAP_RING_SIZE (4096)
+
+/* Size of the capture thread's output buffer */
+#define PCAP_BUFFER_SIZE (256 * 1024)
+
+#define PCAP_SNAPLEN_DEFAULT (65535)
+
+typedef enum
+{
+    PCAP_FORMAT_PCAP   = 0,  /* Classic pcap, with nanosecond timestamps */
+    PCAP_FORMAT_PCAPNG = 1,  /* pcapng, with one interface per socket */
+} pcap_format_t;
+
+typedef enum
+{
+    PCAP_INBOUND  = 0,
+    PCAP_OUTBOUND = 1,
+} pcap_direction_t;
+
+typedef struct pcap_options
+{
+    pcap_format_t format;
+    uint32_t snaplen;          /* 0: PCAP_SNAPLEN_DEFAULT */
+    uint64_t rotate_size;      /* Start a new file after this many bytes (0: never) */
+    uint32_t rotate_secs;      /* Start a new file after this many seconds (0: never) */
+} pcap_options_t;
+
+/* A captured packet. The packet shares its contents with the packet
+ * that was sent or received (see chitcp_tcp_packet_share), so capturing
+ * a packet doesn't copy it. */
+typedef struct pcap_record
+{
+    /* Sequence number of the slot in the ring (see pcap_capture) */
+    atomic_size_t seq;
+
+    struct timespec ts;
+    int sockfd;
+    pcap_direction_t direction;
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+    tcp_packet_t packet;
+} pcap_record_t;
+
+/* Packet capture writer. Packets are captured into a bounded ring that
+ * any thread can add to without taking a lock, and a single capture
+ * thread takes them out of the ring and writes them to the file through
+ * a large buffer. If the ring is full, the packet is dropped from the
+ * capture (and counted), so sending and receiving never block on the
+ * disk. */
+typedef struct pcap_writer
+{
+    char *filename;
+    pcap_options_t options;
+
+    /* Ring. Producers claim slots by incrementing head, and the capture
+     * thread is the only one that reads from tail */
+    pcap_record_t *ring;
+    atomic_size_t head;
+    size_t tail;
+    atomic_uint_fast64_t captured;
+    atomic_uint_fast64_t dropped;
+
+    /* The capture thread waits on cv_ring when the ring is empty
+     * (producers only signal it if sleeping is set) */
+    pthread_t thread;
+    pthread_mutex_t lock_ring;
+    pthread_cond_t cv_ring;
+    atomic_bool sleeping;
+    atomic_bool stopping;
+
+    /* Output (only used by the capture thread) */
+    FILE *file;
+    int file_index;
+    uint64_t file_size;
+    struct timespec file_start;
+    uint8_t *buf;
+    size_t buf_len;
+
+    /* pcapng interface of each socket in the current file (-1: none yet) */
+    int *interfaces;
+    int interfaces_size;
+    int num_interfaces;
+} pcap_writer_t;
+
+
+/*
+ * pcap_writer_open - Create a capture file and start its capture thread
+ *
+ * The packets are written to filename. If the capture is rotated, the
+ * next files are named filename.1, filename.2, etc. Existing files
+ * are overwritten.
+ *
+ * filename: Name of the capture file
+ *
+ * options: Capture options (NULL: defaults)
+ *
+ * writer: Output parameter with the writer
+ *
+ * Returns:
+ *  - CHITCP_OK: Writer created correctly
+ *  - CHITCP_ENOENT: Could not open the file
+ *  - CHITCP_ENOMEM: Could not allocate memory for the writer
+ *  - CHITCP_ETHREAD: Could not create the capture thread
+ *
+ */
+int pcap_writer_open(const char *filename, pcap_options_t *options, pcap_writer_t **writer);
+
+
+/*
+ * pcap_capture - Capture a packet
+ *
+ * Can be called from any thread, and doesn't block.
+ *
+ * writer: Writer
+ *
+ * sockfd: Socket the packet belongs to (the pcapng interface)
+ *
+ * direction: PCAP_INBOUND or PCAP_OUTBOUND
+ *
+ * src, dst: Source and destination of the packet (IPv4 or IPv6)
+ *
+ * packet: TCP packet. Its contents must not be modified afterwards.
+ *
+ * Returns:
+ *  - CHITCP_OK: Packet captured
+ *  - CHITCP_EWOULDBLOCK: The ring is full, and the packet was dropped
+ *                        from the capture
+ *  - CHITCP_EINVAL: Unsupported address family
+ *
+ */
+int pcap_capture(pcap_writer_t *writer, int sockfd, pcap_direction_t direction,
+                 struct sockaddr *src, struct sockaddr *dst, tcp_packet_t *packet);
+
+
+/*
+ * pcap_writer_close - Write out the captured packets and close the capture
+ *
+ * Stops the capture thread (once it has written every packet that was
+ * captured), closes the file and frees the writer.
+ *
+ * writer: Writer
+ *
+ * Returns: Nothing.
+ *
+ */
+void pcap_writer_close(pcap_writer_t *writer);
+
+
+#endif /* PCAP_H_ */
@@ -9,19 +9,21 @@
  *  THE SERVER THREAD: This thread listens on a UNIX socket (by default,
  *  /tmp/chitcpd.socket). Local applications will connect to this socket
  *  to send requests to chitcpd (for example, to create a new chisocket).
- *  The server thread is in charge of handling these requests, and it
- *  spawns a new HANDLER THREAD for each connection on the UNIX socket.
+ *  The server thread accepts the connections on this socket, and hands
+ *  them to the HANDLER POOL, a fixed set of threads that handle the
+ *  requests on all the connections.
  *
- *  The code for the handler thread is contained in handlers.c
+ *  The code for the handler pool is contained in handlers.c
  *
  *  THE NETWORK THREAD: This thread listens on a TCP socket (by default,
  *  23300). chiTCP daemons on different hosts communicate via TCP.
  *  For example, a chiTCP daemon on one host that needs to deliver a
  *  chiTCP packet to another host will do so via this TCP connection.
- *  The network thread is in charge of handling these connections, and
- *  spawns a new CONNECTION THREAD for each connection on this TCP socket.
+ *  The network thread is in charge of accepting these connections, and
+ *  registers each connection on this TCP socket with the NETWORK I/O
+ *  THREAD, which receives the packets sent over all the connections.
  *
- *  The code for the connection thread is contained in connection.c
+ *  The code for the network I/O thread is contained in connection.c
  *
  */
 
@@ -62,17 +64,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "server.h"
 #include "connection.h"
+#include "transport.h"
 #include "handlers.h"
 #include "breakpoint.h"
+#include "tcp_thread.h"
 #include "protobuf-wrapper.h"
+#include "fast-codec.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/log.h"
 #include "chitcp/addr.h"
@@ -85,6 +93,7 @@ int chitcpd_server_start_thread(serverinfo_t *si);
 void* chitcpd_server_thread_func(void *args);
 int chitcpd_server_start_network_thread(serverinfo_t *si);
 void* chitcpd_server_network_thread_func(void *args);
+static void chitcpd_server_close_network_sockets(serverinfo_t *si);
 
 /* Arguments to the server thread */
 typedef struct server_thread_args
@@ -98,16 +107,6 @@ typedef struct network_thread_args
     serverinfo_t *si;
 } network_thread_args_t;
 
-/* Header for pcap file if necessary. */
-typedef struct pcap_hdr {
-        uint32_t magic_number;   /* magic number */
-        uint16_t version_major;  /* major version number */
-        uint16_t version_minor;  /* minor version number */
-        int32_t  thiszone;       /* GMT to local correction */
-        uint32_t sigfigs;        /* accuracy of timestamps */
-        uint32_t snaplen;        /* max length of captured packets, in octets */
-        uint32_t network;        /* data link type */
-} pcap_hdr_t;
 
 
 /*
@@ -126,32 +125,57 @@ typedef struct pcap_hdr {
 int chitcpd_server_init(serverinfo_t *si)
 {
     /* TODO: Make this configurable */
-    si->chisocket_table_size = DEFAULT_MAX_SOCKETS;
     si->port_table_size = DEFAULT_MAX_PORTS;
     si->connection_table_size = DEFAULT_MAX_CONNECTIONS;
     si->ephemeral_port_start = DEFAULT_EPHEMERAL_PORT_START;
 
     si->latency = 0.0;
 
-    /* Initialize chisocket table */
+    /* Socket buffer sizes that haven't been set default to TCP_BUFFER_SIZE */
+    if(si->tcp_buf_max == 0)
+        si->tcp_buf_max = TCP_BUFFER_MAX;
+    si->tcp_buf_max = MIN(MAX(si->tcp_buf_max, TCP_BUFFER_MIN), TCP_BUFFER_MAX);
+    if(si->tcp_sndbuf_default == 0)
+        si->tcp_sndbuf_default = TCP_BUFFER_SIZE;
+    if(si->tcp_rcvbuf_default == 0)
+        si->tcp_rcvbuf_default = TCP_BUFFER_SIZE;
+    si->tcp_sndbuf_default = MIN(MAX(si->tcp_sndbuf_default, TCP_BUFFER_MIN), si->tcp_buf_max);
+    si->tcp_rcvbuf_default = MIN(MAX(si->tcp_rcvbuf_default, TCP_BUFFER_MIN), si->tcp_buf_max);
+
+    /* Memory budget (no limit if mem_limit is 0) */
+    mem_budget_init(&si->mem, si->mem_limit);
+
+    /* Initialize chisocket table (with a single chunk; it grows as needed) */
     pthread_mutex_init(&si->lock_chisocket_table, NULL);
-    si->chisocket_table = calloc(si->chisocket_table_size, sizeof(chisocketentry_t));
+    atomic_init(&si->chisocket_table_size, 0);
+    si->chisocket_free = NULL;
 
-    if(si->chisocket_table == NULL)
+    if(chitcpd_grow_socket_table(si) != CHITCP_OK)
     {
         perror("Could not initialize chisocket table");
         return CHITCP_ENOMEM;
     }
 
-    for(int i=0; i< si->chisocket_table_size; i++)
-    {
-        pthread_mutex_init(&si->chisocket_table[i].lock_debug_monitor, NULL);
-        si->chisocket_table[i].available = TRUE;
-    }
 
+    /* Initialize socket demultiplexing indexes */
+    si->socket_conn_index = NULL;
+    si->socket_listen_index = NULL;
+    pthread_mutex_init(&si->lock_socket_index, NULL);
+    pthread_mutex_init(&si->lock_poll, NULL);
+
+    /* Initialize passive socket queues */
+    pthread_mutex_init(&si->lock_listen, NULL);
+    si->syncookie_secret = (uint32_t) rand() ^ (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
 
     /* Initialize connection table */
+    if(si->transport == NULL)
+        si->transport = &transport_tcp;
     pthread_mutex_init(&si->lock_connection_table, NULL);
+    pthread_cond_init(&si->cv_connection_table, NULL);
+    si->peer_index = NULL;
+    if(si->connection_stripes <= 0)
+        si->connection_stripes = 1;
+    si->connection_stripes = MIN(si->connection_stripes, CONNECTION_MAX_STRIPES);
     si->connection_table = calloc(si->connection_table_size, sizeof(tcpconnentry_t));
 
     if(si->connection_table == NULL)
@@ -161,10 +185,16 @@ int chitcpd_server_init(serverinfo_t *si)
     }
 
     for(int i=0; i< si->connection_table_size; i++)
+    {
+        pthread_mutex_init(&si->connection_table[i].lock_tx, NULL);
+        pthread_cond_init(&si->connection_table[i].cv_tx, NULL);
+        tx_sched_init(&si->connection_table[i].tx_sched);
         si->connection_table[i].available = TRUE;
+    }
 
     /* Initialize port table */
     /* This is an array of pointers, and they are all set to NULL */
+    pthread_mutex_init(&si->lock_port_table, NULL);
     si->port_table = calloc(si->port_table_size, sizeof(chisocketentry_t*));
 
     if(si->port_table == NULL)
@@ -173,41 +203,91 @@ int chitcpd_server_init(serverinfo_t *si)
         return CHITCP_ENOMEM;
     }
 
+    /* The bits past the last ephemeral port are set, so they are never picked */
+    uint32_t nports = si->port_table_size - si->ephemeral_port_start;
+    si->ephemeral_bitmap = calloc((nports + 63) / 64, sizeof(uint64_t));
+
+    if(si->ephemeral_bitmap == NULL)
+    {
+        perror("Could not initialize ephemeral port bitmap");
+        return CHITCP_ENOMEM;
+    }
+
+    if(nports % 64 != 0)
+        si->ephemeral_bitmap[nports / 64] = UINT64_MAX << (nports % 64);
+    si->ephemeral_cursor = 0;
+
+    /* Timer wheel (this starts the timer thread) */
+    if(tw_init(&si->timer_wheel) != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not initialize timer wheel");
+        return CHITCP_EINIT;
+    }
+
+    /* TIME_WAIT index (its timer is on the timer wheel) */
+    si->timewait_index = NULL;
+    si->timewait_list = NULL;
+    atomic_init(&si->timewait_count, 0);
+    pthread_mutex_init(&si->lock_timewait, NULL);
+    mt_init_wheel(&si->timewait_timer, 1, &si->timer_wheel);
+    mt_set_timer_name(&si->timewait_timer, 0, "TIME_WAIT");
+
+    /* TCP worker pool (if the daemon is not running one thread per socket) */
+    si->tcp_workers = NULL;
+    if(si->tcp_engine == TCP_ENGINE_WORKER_POOL)
+    {
+        int rc = chitcpd_tcp_start_workers(si);
+        if(rc != CHITCP_OK)
+        {
+            chilog(ERROR, "Could not start TCP workers");
+            return rc;
+        }
+    }
+
+    /* Handler pool (its POLL timeouts are on the timer wheel) */
+    si->handler_pool = NULL;
+    {
+        int rc = chitcpd_handler_start_pool(si);
+        if(rc != CHITCP_OK)
+        {
+            chilog(ERROR, "Could not start handler pool");
+            return rc;
+        }
+    }
+
     /* Daemon state lock and condvar */
     pthread_mutex_init(&si->lock_state, NULL);
     pthread_cond_init(&si->cv_state, NULL);
 
-    /* Delivery list (+ lock and condvar) */
+    /* Delivery queue (+ lock and condvar). The delivery times are
+     * measured with chitcp_clock_now, so the condvar must wait on MT_CLOCK */
     si->delivery_queue = NULL;
+    si->delivery_queue_len = 0;
+    si->delivery_queue_size = 0;
+    si->delivery_seq = 0;
     pthread_mutex_init(&si->lock_delivery, NULL);
-    pthread_cond_init(&si->cv_delivery, NULL);
 
-    /* Open libpcap file if a name is provided. Will overwrite any data currentlly
-       in said file. */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, MT_CLOCK);
+#endif
+    pthread_cond_init(&si->cv_delivery, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* Start capturing packets if a capture file is provided. Will overwrite
+       any data currently in said file. */
     if (si->libpcap_file_name != NULL)
     {
-        si->libpcap_file = fopen(si->libpcap_file_name, "wb");
-        if (si->libpcap_file == NULL)
+        if (pcap_writer_open(si->libpcap_file_name, &si->pcap_options, &si->pcap) != CHITCP_OK)
         {
             perror("Could not open libpcap file for writing");
             return CHITCP_ENOMEM;
         }
-
-        chilog(INFO, "Logging to libpcap file %s", si->libpcap_file_name);
-        /* Write the libpcap header */
-        pcap_hdr_t pcap_header;
-        pcap_header.magic_number = 0xa1b23c4d;
-        pcap_header.version_major = 2;
-        pcap_header.version_minor = 4;
-        pcap_header.thiszone = 0;
-        pcap_header.sigfigs = 0;
-        pcap_header.snaplen = 65535;
-        pcap_header.network = 101;
-        fwrite(&pcap_header, sizeof(pcap_hdr_t), 1, si->libpcap_file);
     }
     else
     {
-        si->libpcap_file = NULL;
+        si->pcap = NULL;
     }
 
     si->state = CHITCPD_STATE_READY;
@@ -224,11 +304,15 @@ int chitcpd_server_start(serverinfo_t *si)
     pthread_cond_broadcast(&si->cv_state);
     pthread_mutex_unlock(&si->lock_state);
 
-    /* Start server thread */
-    rc = chitcpd_server_start_thread(si);
-    if(rc != 0)
+    /* Start server thread (unless the daemon is only used in-process,
+     * see chitcp_embedded_start) */
+    if(si->server_socket_path[0] != '\0')
     {
-        return rc;
+        rc = chitcpd_server_start_thread(si);
+        if(rc != 0)
+        {
+            return rc;
+        }
     }
 
     /* Start network thread */
@@ -297,15 +381,17 @@ int chitcpd_server_wait(serverinfo_t *si)
 int chitcpd_server_stop(serverinfo_t *si)
 {
     int rc;
+    char c = 0;
 
     chilog(DEBUG, "Stopping the chiTCP daemon.");
 
-    /* To stop the server, all we need to do is shutdown the server's
-     * TCP and UNIX sockets. Once the server is running, its two
-     * threads (server and network) are blocking on accept() on
-     * each of these two sockets. Shutting down the sockets forces
-     * a return from those calls which, combined with the change
-     * in the state of the server, will result in an orderly shutdown. */
+    /* To stop the server, all we need to do is wake up its two threads.
+     * Once the server is running, the server thread is blocking on
+     * accept() on the UNIX socket, and shutting down that socket forces
+     * a return from the call. The network thread is polling the network
+     * sockets, and is woken up through its wakeup pipe. Combined with the
+     * change in the state of the server, this will result in an orderly
+     * shutdown. */
 
     pthread_mutex_lock(&si->lock_state);
     si->state = CHITCPD_STATE_STOPPING;
@@ -318,24 +404,24 @@ int chitcpd_server_stop(serverinfo_t *si)
 
     chilog(DEBUG, "Stopping network thread...");
 
-    // rc = shutdown(si->network_socket, SHUT_RDWR);
-    rc = close(si->network_socket);
-    if(rc != 0)
+    /* Neither closing nor shutting down a listening socket reliably
+     * wakes up a thread that is polling it, so we use a pipe */
+    if(write(si->network_wakeup[1], &c, 1) != 1)
         return CHITCP_ESOCKET;
 
     pthread_join(si->network_thread, NULL);
+    chitcpd_server_close_network_sockets(si);
 
     chilog(DEBUG, "Stopping server thread...");
 
-    // rc = shutdown(si->server_socket, SHUT_RDWR);
-    rc = close(si->server_socket);
-    if(rc != 0)
-        return CHITCP_ESOCKET;
-
-    pthread_join(si->server_thread, NULL);
+    if(si->server_socket_path[0] != '\0')
+    {
+        // rc = shutdown(si->server_socket, SHUT_RDWR);
+        rc = close(si->server_socket);
+        if(rc != 0)
+            return CHITCP_ESOCKET;
 
-    if (si->libpcap_file != NULL) {
-        fclose(si->libpcap_file);
+        pthread_join(si->server_thread, NULL);
     }
 
     pthread_mutex_lock(&si->lock_state);
@@ -352,9 +438,54 @@ int chitcpd_server_stop(serverinfo_t *si)
 
 int chitcpd_server_free(serverinfo_t *si)
 {
-    free(si->chisocket_table);
+    tcppeer_t *peer, *tmp_peer;
+
+    /* The index handles live in the socket entries, so the
+     * indexes must be cleared before the socket table is freed */
+    HASH_CLEAR(hh_demux, si->socket_conn_index);
+    HASH_CLEAR(hh_demux, si->socket_listen_index);
+    pthread_mutex_destroy(&si->lock_socket_index);
+    pthread_mutex_destroy(&si->lock_poll);
+    pthread_mutex_destroy(&si->lock_listen);
+
+    chitcpd_handler_stop_pool(si);
+    chitcpd_tcp_stop_workers(si);
+    chitcpd_timewait_free(si);
+    tw_free(&si->timer_wheel);
+
+    /* No more packets can be sent or received, so the capture
+     * can be written out */
+    if (si->pcap != NULL)
+    {
+        pcap_writer_close(si->pcap);
+        si->pcap = NULL;
+    }
+
+    for(int i=0; i< si->connection_table_size; i++)
+    {
+        tcpconnentry_t *connection = &si->connection_table[i];
+        if(!connection->available && connection->transport->free)
+            connection->transport->free(connection);
+        pthread_mutex_destroy(&si->connection_table[i].lock_tx);
+        pthread_cond_destroy(&si->connection_table[i].cv_tx);
+    }
+
+    for(int i=0; i < CHISOCKET_MAX_CHUNKS; i++)
+    {
+        free(si->chisocket_chunks[i]);
+        free(si->chisocket_cold_chunks[i]);
+    }
     free(si->connection_table);
+    HASH_ITER(hh, si->peer_index, peer, tmp_peer)
+    {
+        HASH_DEL(si->peer_index, peer);
+        free(peer);
+    }
     free(si->port_table);
+    free(si->ephemeral_bitmap);
+    netem_free_profiles(&si->netem_profiles);
+    affinity_free(&si->placement);
+    pthread_mutex_destroy(&si->lock_port_table);
 
     pthread_mutex_destroy(&si->lock_state);
     pthread_cond_destroy(&si->cv_state);
@@ -424,24 +555,11 @@ int chitcpd_server_start_thread(serverinfo_t *si)
 }
 
 
-/* Used only in the following function to keep track of
- * the UNIX socket handler threads. */
-typedef struct handler_thread
-{
-    pthread_t thread;
-    socket_t handler_socket;
-    pthread_mutex_t handler_lock;
-
-    /* List pointers */
-    struct handler_thread *prev;
-    struct handler_thread *next;
-} handler_thread_t;
-
 /*
  * chitcpd_server_thread_func - Server thread function
  *
- * This function will spawn a handler thread (see handler.c) for each
- * new connection on the UNIX socket.
+ * This function will hand each new command connection on the UNIX
+ * socket to the handler pool (see handlers.c).
  *
  * args: arguments (a serverinfo_t variable in server_threads_args_t)
  *
@@ -451,11 +569,9 @@ typedef struct handler_thread
 void* chitcpd_server_thread_func(void *args)
 {
     socklen_t sunSize;
-    handler_thread_t *handler_thread;
     server_thread_args_t *sta;
     serverinfo_t *si;
     handler_thread_args_t *ha;
-    handler_thread_t *handler_thread_list=NULL;
     int rc;
     ChitcpdMsg *req;
     ChitcpdInitArgs *init_args;
@@ -466,14 +582,14 @@ void* chitcpd_server_thread_func(void *args)
     resp_outer.code = CHITCPD_MSG_CODE__RESP;
     resp_outer.resp = &resp_inner;
 
-    /* For naming the handler threads we create (for debugging/logging) */
-    int next_thread_id = 0;
     pthread_setname_np("unix_server");
 
     /* Unpack arguments */
     sta = (server_thread_args_t *) args;
     si = sta->si;
 
+    affinity_pin_all(&si->placement);
+
     struct sockaddr_un client_addr;
 
     /* Accept connections on the UNIX socket */
@@ -528,9 +644,9 @@ void* chitcpd_server_thread_func(void *args)
         /* There are two types of connections: command connections and debug
          * connections.
          *
-         * When a command connection is created, a new thread is created to
-         * handle the incoming chisocket commands on that connection (socket,
-         * send, recv, etc.)
+         * When a command connection is created, it is handed to the handler
+         * pool, which handles the incoming chisocket commands on that
+         * connection (socket, send, recv, etc.)
          *
          * When a debug connection is created, no additional thread is necessary.
          * The connection on the UNIX socket is simply "handed off" to a
@@ -540,37 +656,74 @@ void* chitcpd_server_thread_func(void *args)
 
         if (conntype == CHITCPD_CONNECTION_TYPE__COMMAND_CONNECTION)
         {
-            /* Create arguments for handler thread */
-            ha = malloc(sizeof(handler_thread_args_t));
+            /* Create the connection's state (see handlers.h) */
+            ha = calloc(1, sizeof(handler_thread_args_t));
             ha->si = si;
-
-            handler_thread = malloc(sizeof(handler_thread_t));
-            handler_thread->handler_socket = client_socket;
-            pthread_mutex_init(&handler_thread->handler_lock, NULL);
-
-            /* Create handler thread to handle this connection */
-            ha->client_socket = handler_thread->handler_socket;
-            ha->handler_lock = &handler_thread->handler_lock;
-            snprintf(ha->thread_name, 16, "socket-layer-%d", next_thread_id++);
-            if (pthread_create(&handler_thread->thread, NULL, chitcpd_handler_dispatch, ha) != 0)
+            ha->shm = NULL;
+            ha->shm_size = 0;
+
+            /* The client may follow the INIT message with the descriptor
+             * of a shared data window, through which send() and recv()
+             * payloads will be exchanged. If we can't map it, we tell
+             * the client (shm_size = 0), and it will carry the payloads
+             * in the messages themselves. */
+            if (init_args->shm_size > 0)
             {
-                perror("Could not create a worker thread");
+                int shm_fd;
+
+                rc = chitcpd_recv_fd(client_socket, &shm_fd);
+                if (rc < 0)
+                {
+                    chilog(ERROR, "Error when receiving shared data window descriptor");
+                    free(ha);
+                    chitcpd_msg__free_unpacked(req, NULL);
+                    if (rc != -1)
+                        shutdown(client_socket, SHUT_RDWR);
+                    continue;
+                }
+
+                if (init_args->shm_size <= CHITCPD_SHM_MAX)
+                {
+                    void *shm = mmap(NULL, init_args->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+                    if (shm != MAP_FAILED)
+                    {
+                        ha->shm = shm;
+                        ha->shm_size = init_args->shm_size;
+                    }
+                    else
+                        chilog(WARNING, "Could not map shared data window: %s", strerror(errno));
+                }
+                else
+                    chilog(WARNING, "Shared data window is too large (%u bytes)", init_args->shm_size);
+                close(shm_fd);
+            }
+            resp_outer.resp->shm_size = ha->shm_size;
 
-                resp_outer.resp->ret = CHITCP_ETHREAD;
-                resp_outer.resp->error_code = 0;
-                rc = chitcpd_send_msg(client_socket, &resp_outer);
+            /* Agree on the version of the fast-path encoding (after we've
+             * sent the INIT response, which is always protobuf) */
+            chitcpd_channel_init(&ha->channel, client_socket);
+            resp_outer.resp->fast_codec = MIN(init_args->fast_codec, CHITCPD_FAST_VERSION);
+            ha->channel.fast_version = resp_outer.resp->fast_codec;
 
-                free(ha);
-                close(ha->client_socket);
-                close(si->server_socket);
-                // TODO: Perform an orderly shutdown instead of exiting
-                pthread_exit(NULL);
-            }
+            ha->client_socket = client_socket;
+
+            /* The client can send requests as soon as it gets the
+             * response, and the pool starts reading them right away */
             resp_outer.resp->ret = CHITCP_OK;
             resp_outer.resp->error_code = 0;
             rc = chitcpd_send_msg(client_socket, &resp_outer);
+            resp_outer.resp->shm_size = 0;
+            resp_outer.resp->fast_codec = 0;
 
-            DL_APPEND(handler_thread_list, handler_thread);
+            if (rc < 0 || chitcpd_handler_add_connection(si, ha) != CHITCP_OK)
+            {
+                chilog(ERROR, "Could not add command connection to the handler pool");
+                chitcpd_channel_free(&ha->channel);
+                if (ha->shm)
+                    munmap(ha->shm, ha->shm_size);
+                free(ha);
+                close(client_socket);
+            }
         }
         else if(conntype == CHITCPD_CONNECTION_TYPE__DEBUG_CONNECTION)
         {
@@ -613,32 +766,10 @@ void* chitcpd_server_thread_func(void *args)
         chitcpd_msg__free_unpacked(req, NULL);
     }
 
-    /* Free the resources in the active_list. */
-    handler_thread_t *ht, *tmp;
-    DL_FOREACH_SAFE(handler_thread_list, ht, tmp)
-    {
-        /* For each handler thread we spawned, we close its socket, which
-         * will force the thread to exit (and we then join it).
-         *
-         * Note that closing a handler thread will also free up all chiTCP
-         * sockets created through that thread, and will also terminate
-         * all associated TCP threads.
-         *
-         * TODO: We should simply detach those threads, since they can exit
-         * before an orderly shutdown and would be left lingering until
-         * we call join here. */
-
-        /* We don't want to shutdown the handler's socket if an operation is
-         * in progress. The handler thread may have read a command, but
-         * not sent a response back yet */
-        pthread_mutex_lock(&ht->handler_lock);
-        shutdown(ht->handler_socket, SHUT_RDWR);
-        pthread_mutex_unlock(&ht->handler_lock);
-        pthread_join(ht->thread, NULL);
-        pthread_mutex_destroy(&ht->handler_lock);
-        DL_DELETE(handler_thread_list, ht);
-        free(ht);
-    }
+    /* Shutting down the command connections will also free up all
+     * chiTCP sockets created through them, and will also terminate
+     * all associated TCP threads. */
+    chitcpd_handler_stop_pool(si);
 
     chilog(DEBUG, "Server thread is exiting.");
 
@@ -646,6 +777,24 @@ void* chitcpd_server_thread_func(void *args)
 }
 
 
+/*
+ * chitcpd_server_close_network_sockets - Close the network thread's sockets
+ *
+ * si: Server info
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_server_close_network_sockets(serverinfo_t *si)
+{
+    close(si->network_socket);
+    if(si->transport_socket != -1)
+        close(si->transport_socket);
+    close(si->network_wakeup[0]);
+    close(si->network_wakeup[1]);
+}
+
+
 /*
  * chitcpd_server_start_network_thread - Starts the network thread
  *
@@ -659,47 +808,41 @@ void* chitcpd_server_thread_func(void *args)
  */
 int chitcpd_server_start_network_thread(serverinfo_t *si)
 {
-    int yes=1;
-
-    struct sockaddr_in server_addr;
-
-    memset(&server_addr, 0, sizeof(server_addr));
-
-    /* TODO: Add IPv6 support */
-    server_addr.sin_family = AF_INET;          // IPv4
-    server_addr.sin_port = si->server_port;
-    server_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to any address
+    int rc;
 
-    /* Create the socket */
-    si->network_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(si->network_socket  == -1)
-    {
-        perror("Could not open network socket");
-        return CHITCP_ESOCKET;
-    }
+    /* There is always a TCP socket, since TCP is used with the peers
+     * that a local transport can't reach (see transport_for_peer) */
+    rc = transport_tcp.listen(si, &si->network_socket);
+    if(rc != CHITCP_OK)
+        return rc;
 
-    /* Make port immediately available after we close the socket */
-    if(setsockopt(si->network_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+    si->transport_socket = -1;
+    if(si->transport != &transport_tcp)
     {
-        perror("Socket setsockopt() failed");
-        close(si->network_socket);
-        return CHITCP_ESOCKET;
+        rc = si->transport->listen(si, &si->transport_socket);
+        if(rc != CHITCP_OK)
+        {
+            close(si->network_socket);
+            return rc;
+        }
     }
 
-    /* Bind the socket to the address */
-    if(bind(si->network_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1)
+    if(pipe(si->network_wakeup) == -1)
     {
-        perror("Socket bind() failed");
+        perror("Could not create network wakeup pipe");
         close(si->network_socket);
+        if(si->transport_socket != -1)
+            close(si->transport_socket);
         return CHITCP_ESOCKET;
     }
 
-    /* Start listening */
-    if(listen(si->network_socket, 5) == -1)
+    /* Start the network I/O threads, which receive the packets
+     * on the connections to the other daemons */
+    rc = chitcpd_start_netio_threads(si);
+    if(rc != CHITCP_OK)
     {
-        perror("Network socket listen() failed");
-        close(si->network_socket);
-        return CHITCP_ESOCKET;
+        chitcpd_server_close_network_sockets(si);
+        return rc;
     }
 
     /* Create arguments to network thread */
@@ -721,8 +864,9 @@ int chitcpd_server_start_network_thread(serverinfo_t *si)
 /*
  * chitcpd_server_network_thread_func - Server thread function
  *
- * This function will spawn a connection thread (see connection.c)
- * for each new connection on the UNIX socket.
+ * This function will register each new connection on the TCP socket
+ * (and on the transport's socket) with the network I/O threads (see
+ * connection.c), until the network wakeup pipe is written to.
  *
  * args: arguments (a serverinfo_t variable in network_thread_args_t)
  *
@@ -731,12 +875,11 @@ int chitcpd_server_start_network_thread(serverinfo_t *si)
  */
 void* chitcpd_server_network_thread_func(void *args)
 {
-    socklen_t sunSize;
     network_thread_args_t *nta;
-    socket_t realsocket;
     serverinfo_t *si;
     tcpconnentry_t* connection;
-    char addr_str[100];
+    struct pollfd fds[3];
+    int nfds = 2;
 
     pthread_setname_np("network_server");
 
@@ -744,82 +887,44 @@ void* chitcpd_server_network_thread_func(void *args)
     nta = (network_thread_args_t *) args;
     si = nta->si;
 
-    struct sockaddr_storage client_addr;
+    affinity_pin_all(&si->placement);
 
-    /* Accept connections on the TCP socket */
-    for(;;)
+    fds[0].fd = si->network_wakeup[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = si->network_socket;
+    fds[1].events = POLLIN;
+    if(si->transport_socket != -1)
     {
-        /* Accept a connection */
-        sunSize = sizeof(client_addr);
-        if ((realsocket = accept(si->network_socket, (struct sockaddr *)&client_addr, &sunSize)) == -1)
-        {
-            /* If accept() returns in the CHITCPD_STATE_STOPPING, we don't
-             * care what the error is. We just break out of the loop and
-             * initiate an orderly shutdown. */
-            if(si->state == CHITCPD_STATE_STOPPING)
-                break;
-
-            /* If this particular connection fails, no need to kill the entire thread. */
-            perror("Could not accept() connection on network socket");
-            continue;
-        }
-
-        chitcp_addr_str((struct sockaddr *) &client_addr, addr_str, sizeof(addr_str));
-        chilog(INFO, "TCP connection received from %s", addr_str);
+        fds[2].fd = si->transport_socket;
+        fds[2].events = POLLIN;
+        nfds++;
+    }
 
-        /* Check whether the connection already exists. */
-        connection = chitcpd_get_connection(si, (struct sockaddr *) &client_addr);
-        if (connection != NULL)
+    /* Accept connections from other daemons */
+    for(;;)
+    {
+        if(poll(fds, nfds, -1) == -1)
         {
-            /* If this is a loopback connection, there is already an entry in
-             * the connection table, but we need to update its receive socket
-             * and create its connection thread. */
-           if(chitcp_addr_is_loopback((struct sockaddr *) &client_addr))
-           {
-               connection->realsocket_recv = realsocket;
-
-               if(chitcpd_create_connection_thread(si, connection) != CHITCP_OK)
-               {
-                   perror("Could not create connection thread.");
-                   // TODO: Perform orderly shutdown
-                   pthread_exit(NULL);
-               }
-
-               continue;
-           }
-           else
-           /* Otherwise, this is an error. The peer chiTCP daemon tried to create
-            * a second connection, which shouldn't happen. */
-            {
-                perror("Peer chiTCP daemon tried to establish more than one connection.");
-                close(realsocket);
-                close(si->server_socket);
-                // TODO: Perform orderly shutdown instead of just exiting
-                pthread_exit(NULL);
-            }
+            if(errno == EINTR)
+                continue;
+            perror("Network thread poll() failed");
+            break;
         }
 
-        /* If this is not a loopback connection, we need to add an entry
-         * for this connection */
-        connection = chitcpd_add_connection(si, realsocket, realsocket, (struct sockaddr*) &client_addr);
+        /* We're woken up when the server is stopping, so we just break
+         * out of the loop and initiate an orderly shutdown. */
+        if(fds[0].revents || si->state == CHITCPD_STATE_STOPPING)
+            break;
 
-        if (!connection)
-        {
-            perror("Could not create a connection to a peer chiTCP daemon");
-            // TODO: Perform orderly shutdown
-            pthread_exit(NULL);
-        }
-
-        if(chitcpd_create_connection_thread(si, connection) != CHITCP_OK)
-        {
-            perror("Could not create connection thread.");
-            // TODO: Perform orderly shutdown
-            pthread_exit(NULL);
-        }
+        /* If a particular connection fails, no need to kill the entire thread. */
+        if(fds[1].revents)
+            transport_tcp.accept(si, si->network_socket);
+        if(nfds == 3 && fds[2].revents)
+            si->transport->accept(si, si->transport_socket);
     }
 
-    /* Close all TCP connections. This will force an exit of the
-     * corresponding connection threads. */
+    /* Shut down all the connections, and stop the network I/O threads
+     * (which close the receive sockets) */
     for(int i=0; i < si->connection_table_size; i++)
     {
         connection = &si->connection_table[i];
@@ -828,9 +933,9 @@ void* chitcpd_server_network_thread_func(void *args)
             shutdown(connection->realsocket_recv, SHUT_RDWR);
             if (connection->realsocket_recv != connection->realsocket_send)
                 shutdown(connection->realsocket_send, SHUT_RDWR);
-            pthread_join(connection->thread, NULL);
         }
     }
+    chitcpd_stop_netio_threads(si);
 
     chilog(DEBUG, "Network thread is exiting.");
 
@@ -48,9 +48,30 @@
 #include "chitcp/log.h"
 #include "chitcp/chitcpd.h"
 #include "breakpoint.h"
+#include "tcp_thread.h"
+#include "connection.h"
 
 
 
+/*
+ * chitcpd_poll_wake - Notify a poll waiter (see poll_waiter_t)
+ *
+ * Must be called with lock_poll held.
+ *
+ * waiter: Poll waiter
+ *
+ * Returns: nothing.
+ *
+ */
+static void chitcpd_poll_wake(poll_waiter_t *waiter)
+{
+    waiter->notified = TRUE;
+    if(waiter->wake != NULL)
+        waiter->wake(waiter, waiter->wake_arg);
+    else
+        pthread_cond_signal(&waiter->cv);
+}
+
 /*
  * chitcpd_set_header_ports - Set the TCP ports on a packet, based on the local/remote
  *                            addresses in a socket entry.
@@ -86,6 +107,18 @@ int chitcpd_tcp_packet_create(chisocketentry_t *entry, tcp_packet_t *packet, con
 /* See serverinfo.h */
 void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_state_t newstate)
 {
+    /* A socket that went through TIME_WAIT is already CLOSED (see below),
+     * and its cleanup is pending, so TCP moving it to CLOSED itself
+     * doesn't do anything */
+    if (newstate == CLOSED && entry->tcp_state == CLOSED && entry->actpas_type == SOCKET_ACTIVE &&
+        (atomic_load(&entry->socket_state.active.events) & TCP_EVENT_CLEANUP))
+        return;
+
+    /* Only the addresses and sequence numbers are needed in TIME_WAIT,
+     * so they are kept in the TIME_WAIT index, and the socket is freed */
+    if (newstate == TIME_WAIT && entry->actpas_type == SOCKET_ACTIVE)
+        chitcpd_timewait_enter(si, entry);
+
     chilog(MINIMAL, "[S%i] %s -> %s", SOCKET_NO(si, entry), tcp_str(entry->tcp_state), tcp_str(newstate));
 
     pthread_mutex_lock(&entry->lock_tcp_state);
@@ -96,36 +129,89 @@ void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_sta
 
     pthread_mutex_unlock(&entry->lock_tcp_state);
 
+    /* A socket spawned by a passive socket may have to move between
+     * the passive socket's queues (this has to happen before a CLOSED
+     * socket is cleaned up) */
+    if (entry->actpas_type == SOCKET_ACTIVE)
+        chitcpd_listen_update(si, entry, newstate);
+
+    chitcpd_poll_notify(si, entry);
+
     if (newstate == CLOSED && entry->actpas_type == SOCKET_ACTIVE)
-    {
-        active_chisocket_state_t *socket_state = &entry->socket_state.active;
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_CLEANUP);
 
-        pthread_mutex_lock(&socket_state->lock_event);
-        socket_state->flags.cleanup = 1;
-        pthread_cond_broadcast(&socket_state->cv_event);
-        pthread_mutex_unlock(&socket_state->lock_event);
-    }
+    if (newstate == TIME_WAIT && entry->actpas_type == SOCKET_ACTIVE)
+        chitcpd_update_tcp_state(si, entry, CLOSED);
 }
 
 /* See serverinfo.h */
 void chitcpd_timeout(serverinfo_t *si, chisocketentry_t *entry, tcp_timer_type_t type)
 {
-
-
-    active_chisocket_state_t *socket_state = &entry->socket_state.active;
-    pthread_mutex_lock(&socket_state->lock_event);
     if (type == RETRANSMISSION)
     {
-        socket_state->flags.timeout_rtx = 1;
         chilog(MINIMAL, "[S%i] RETRANSMISSION TIMEOUT", SOCKET_NO(si, entry));
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_TIMEOUT_RTX);
     }
     else if(type == PERSIST)
     {
-        socket_state->flags.timeout_pst = 1;
         chilog(MINIMAL, "[S%i] PERSIST TIMEOUT", SOCKET_NO(si, entry));
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_TIMEOUT_PST);
+    }
+    else if(type == DELAYED_ACK)
+    {
+        chilog(DEBUG, "[S%i] DELAYED ACK TIMEOUT", SOCKET_NO(si, entry));
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_TIMEOUT_DACK);
+    }
+    else if(type == PACING)
+    {
+        /* The token bucket can hold the next segment now */
+        chitcpd_tcp_raise_event(si, entry, TCP_EVENT_APP_SEND);
+    }
+}
+
+/* See serverinfo.h */
+int chitcpd_grow_socket_table(serverinfo_t *si)
+{
+    int size = si->chisocket_table_size;
+    int nchunk = size / CHISOCKET_CHUNK_SIZE;
+    chisocketentry_t *chunk;
+    chisocket_cold_t *cold;
+
+    if(nchunk >= CHISOCKET_MAX_CHUNKS)
+        return CHITCP_ENOMEM;
+
+    /* Entries are aligned on cache lines (and their size is a multiple
+     * of a cache line), so that no two entries share a cache line */
+    chunk = aligned_alloc(CHITCP_CACHE_LINE, CHISOCKET_CHUNK_SIZE * sizeof(chisocketentry_t));
+    cold = calloc(CHISOCKET_CHUNK_SIZE, sizeof(chisocket_cold_t));
+    if(chunk == NULL || cold == NULL)
+    {
+        free(chunk);
+        free(cold);
+        return CHITCP_ENOMEM;
+    }
+    memset(chunk, 0, CHISOCKET_CHUNK_SIZE * sizeof(chisocketentry_t));
+
+    /* Add the new entries to the free list, lowest index first */
+    for(int i = CHISOCKET_CHUNK_SIZE - 1; i >= 0; i--)
+    {
+        chunk[i].cold = &cold[i];
+        pthread_mutex_init(&cold[i].lock_debug_monitor, NULL);
+        chunk[i].available = TRUE;
+        chunk[i].sockfd = size + i;
+        chunk[i].free_next = si->chisocket_free;
+        si->chisocket_free = &chunk[i];
     }
-    pthread_cond_broadcast(&socket_state->cv_event);
-    pthread_mutex_unlock(&socket_state->lock_event);
+
+    si->chisocket_chunks[nchunk] = chunk;
+    si->chisocket_cold_chunks[nchunk] = cold;
+
+    /* Only now can the new entries be looked up */
+    atomic_store(&si->chisocket_table_size, size + CHISOCKET_CHUNK_SIZE);
+
+    chilog(DEBUG, "Socket table has grown to %i entries", size + CHISOCKET_CHUNK_SIZE);
+
+    return CHITCP_OK;
 }
 
 /* See serverinfo.h */
@@ -136,17 +222,17 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 
     pthread_mutex_lock(&si->lock_chisocket_table);
 
-    /* Find available slot in socket table */
-    for(int i=0; i < si->chisocket_table_size; i++)
-    {
-        if(si->chisocket_table[i].available)
-        {
-            si->chisocket_table[i].available = FALSE;
+    /* Take the first available slot in socket table */
+    if(si->chisocket_free == NULL)
+        chitcpd_grow_socket_table(si);
 
-            entry = &si->chisocket_table[i];
-            *socket_index = i;
-            break;
-        }
+    if(si->chisocket_free != NULL)
+    {
+        entry = si->chisocket_free;
+        si->chisocket_free = entry->free_next;
+        entry->free_next = NULL;
+        entry->available = FALSE;
+        *socket_index = entry->sockfd;
     }
     pthread_mutex_unlock(&si->lock_chisocket_table);
 
@@ -159,14 +245,32 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
     {
         chilog(DEBUG, "Assigned socket %i", *socket_index);
 
-        entry->creator_thread = pthread_self();
+        /* The handler that asked for the socket sets this */
+        entry->cold->creator = NULL;
 
         entry->actpas_type = SOCKET_UNINITIALIZED;
         entry->tcp_state = CLOSED;
 
-        entry->withheld_packets = NULL;
-
-        pthread_mutex_init(&entry->lock_withheld_packets, NULL);
+        entry->cold->withheld_packets = NULL;
+        entry->demux_index = DEMUX_INDEX_NONE;
+
+        entry->nonblocking = FALSE;
+        entry->pollers = NULL;
+        atomic_init(&entry->num_pollers, 0);
+
+        entry->sndbuf_size = si->tcp_sndbuf_default;
+        entry->rcvbuf_size = si->tcp_rcvbuf_default;
+        entry->buf_autotune = si->tcp_buf_autotune;
+        entry->rcvlowat = 1;
+        entry->nodelay = FALSE;
+        entry->quickack = FALSE;
+        entry->cc_algorithm = si->tcp_cc_default;
+        entry->fastopen = FALSE;
+        entry->pacing_rate = 0;
+        entry->priority = 0;
+        mem_budget_init(&entry->mem, si->socket_mem_limit);
+
+        pthread_mutex_init(&entry->cold->lock_withheld_packets, NULL);
         pthread_mutex_init(&entry->lock_tcp_state, NULL);
         pthread_cond_init(&entry->cv_tcp_state, NULL);
 
@@ -181,6 +285,12 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 {
     uint16_t port;
     struct sockaddr *addr;
+    chisocket_cold_t *cold;
+    int sockfd;
+
+    /* Remove from demultiplexing indexes first, so no more packets
+     * will be delivered to this entry while it is being freed */
+    chitcpd_unindex_socket(si, entry);
 
     if(entry->actpas_type == SOCKET_PASSIVE)
     {
@@ -188,15 +298,10 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 
         passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
 
-        pending_connection_t *item, *tmp;
-        DL_FOREACH_SAFE(socket_state->pending_connections, item, tmp)
-        {
-            DL_DELETE(socket_state->pending_connections, item);
-            free(item);
-        }
+        /* Abort any connections that were never accepted */
+        chitcpd_listen_close(si, entry);
 
-        pthread_mutex_destroy(&socket_state->lock_pending_connections);
-        pthread_cond_destroy(&socket_state->cv_pending_connections);
+        pthread_cond_destroy(&socket_state->cv_accept);
     }
     else if(entry->actpas_type == SOCKET_ACTIVE)
     {
@@ -206,138 +311,467 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 
         tcp_data_free(si, entry);
 
-        pthread_mutex_unlock(&socket_state->lock_event);
         pthread_mutex_destroy(&socket_state->lock_event);
         pthread_cond_destroy(&socket_state->cv_event);
     }
 
     withheld_tcp_packet_list_t *elt, *tmp;
 
-    DL_FOREACH_SAFE(entry->withheld_packets,elt,tmp)
+    DL_FOREACH_SAFE(entry->cold->withheld_packets,elt,tmp)
     {
-        DL_DELETE(entry->withheld_packets,elt);
+        DL_DELETE(entry->cold->withheld_packets,elt);
+        chitcpd_mem_uncharge(si, entry, MEM_PACKET_COST(elt->packet));
         free(elt);
     }
 
-    pthread_mutex_destroy(&entry->lock_withheld_packets);
+    pthread_mutex_destroy(&entry->cold->lock_withheld_packets);
     pthread_mutex_destroy(&entry->lock_tcp_state);
     pthread_cond_destroy(&entry->cv_tcp_state);
 
-    if (entry->debug_monitor != NULL)
+    if (entry->cold->debug_monitor != NULL)
     {
         chitcpd_debug_detach_monitor(entry);
     }
-    pthread_mutex_destroy(&entry->lock_debug_monitor);
+    pthread_mutex_destroy(&entry->cold->lock_debug_monitor);
+
+    /* Anyone still polling the socket must find out it's gone, and
+     * must not touch the entry's list of pollers once it is cleared */
+    pthread_mutex_lock(&si->lock_poll);
+    poll_registration_t *reg, *reg_tmp;
+    DL_FOREACH_SAFE(entry->pollers, reg, reg_tmp)
+    {
+        DL_DELETE(entry->pollers, reg);
+        reg->entry = NULL;
+        chitcpd_poll_wake(reg->waiter);
+    }
+    atomic_store(&entry->num_pollers, 0);
+    pthread_mutex_unlock(&si->lock_poll);
 
     /* Mark local port as available */
     addr = (struct sockaddr*) &entry->local_addr;
     if ((port = chitcp_ntohs(chitcp_get_addr_port(addr))) >= 0)
-        si->port_table[port] = NULL;
+        chitcpd_release_port(si, entry, port);
 
+    sockfd = entry->sockfd;
+    cold = entry->cold;
     memset(entry, 0, sizeof(chisocketentry_t));
+    memset(cold, 0, sizeof(chisocket_cold_t));
+    entry->sockfd = sockfd;
+    entry->cold = cold;
+    pthread_mutex_init(&cold->lock_debug_monitor, NULL);
 
+    /* Return the entry to the free list */
+    pthread_mutex_lock(&si->lock_chisocket_table);
     entry->available = TRUE;
+    entry->free_next = si->chisocket_free;
+    si->chisocket_free = entry;
+    pthread_mutex_unlock(&si->lock_chisocket_table);
 
     chilog(TRACE, "Finished freeing entry for socket %i", SOCKET_NO(si, entry));
 
     return CHITCP_OK;
 }
 
+/* Must be called with lock_port_table held */
+static void __chitcpd_assign_port(serverinfo_t *si, chisocketentry_t *entry, uint16_t port, bool_t taken)
+{
+    si->port_table[port] = taken ? entry : NULL;
+
+    if(port >= si->ephemeral_port_start)
+    {
+        uint32_t i = port - si->ephemeral_port_start;
+
+        if(taken)
+            si->ephemeral_bitmap[i / 64] |= UINT64_C(1) << (i % 64);
+        else
+            si->ephemeral_bitmap[i / 64] &= ~(UINT64_C(1) << (i % 64));
+    }
+}
+
+/* See serverinfo.h */
+int chitcpd_reserve_port(serverinfo_t *si, chisocketentry_t *entry, uint16_t port)
+{
+    chisocketentry_t *owner;
+    int ret = CHITCP_OK;
+
+    if (port >= si->port_table_size)
+        return CHITCP_EINVAL;
+
+    pthread_mutex_lock(&si->lock_port_table);
+    owner = si->port_table[port];
+    if (owner == NULL)
+        __chitcpd_assign_port(si, entry, port, TRUE);
+    else if (owner->reuseport && entry->reuseport)
+    {
+        /* Every socket sharing the port must have set SO_REUSEPORT */
+        chisocketentry_t *other;
+
+        for (other = owner; other != NULL; other = other->cold->port_next)
+            if (!other->reuseport)
+                break;
+
+        if (other == NULL)
+        {
+            entry->cold->port_next = owner->cold->port_next;
+            owner->cold->port_next = entry;
+        }
+        else
+            ret = CHITCP_ESOCKET;
+    }
+    else
+        ret = CHITCP_ESOCKET;
+    pthread_mutex_unlock(&si->lock_port_table);
+
+    return ret;
+}
+
 /* See serverinfo.h */
-int chitcpd_find_ephemeral_port(serverinfo_t *si)
+int chitcpd_reserve_ephemeral_port(serverinfo_t *si, chisocketentry_t *entry)
 {
-    uint16_t port = -1;
+    uint32_t nports = si->port_table_size - si->ephemeral_port_start;
+    uint32_t nwords = (nports + 63) / 64;
+    int port = -1;
+
+    pthread_mutex_lock(&si->lock_port_table);
+
+    uint32_t cursor = si->ephemeral_cursor;
+    uint32_t w = cursor / 64;
 
-    for(int i = si->ephemeral_port_start; i < si->port_table_size; i++)
+    /* Look at every word once, starting at the cursor. The cursor's word is
+     * looked at again at the end, in case the only free ports are below
+     * the cursor. The bits past the last port are always set. */
+    for(uint32_t n = 0; n <= nwords; n++, w = (w + 1) % nwords)
     {
-        if(si->port_table[i] == NULL)
+        uint64_t free_ports = ~si->ephemeral_bitmap[w];
+
+        if(n == 0)
+            free_ports &= UINT64_MAX << (cursor % 64);
+
+        if(free_ports != 0)
         {
-            port = i;
+            uint32_t i = w * 64 + __builtin_ctzll(free_ports);
+
+            port = si->ephemeral_port_start + i;
+            __chitcpd_assign_port(si, entry, port, TRUE);
+            si->ephemeral_cursor = (i + 1) % nports;
             break;
         }
     }
 
+    pthread_mutex_unlock(&si->lock_port_table);
+
     return port;
 }
 
-
 /* See serverinfo.h */
-/* This implementation is based on the implementation of in_pcblookup in
- * TCP/IP Illustrated, Volume 2.
- */
-chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only)
+void chitcpd_release_port(serverinfo_t *si, chisocketentry_t *entry, uint16_t port)
 {
-    assert(local_addr->sa_family == AF_INET || local_addr->sa_family == AF_INET6);
-    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
-    assert(local_addr->sa_family == remote_addr->sa_family);
+    if (port >= si->port_table_size)
+        return;
 
-    int max_nwildcards = 3;
-    chisocketentry_t *match = NULL;
-    for(int i=0; i < si->chisocket_table_size; i++)
+    pthread_mutex_lock(&si->lock_port_table);
+    if (si->port_table[port] == entry)
+    {
+        /* The next socket sharing the port (if any) takes it over */
+        if (entry->cold->port_next != NULL)
+            si->port_table[port] = entry->cold->port_next;
+        else
+            __chitcpd_assign_port(si, entry, port, FALSE);
+    }
+    else if (si->port_table[port] != NULL)
     {
-        chisocketentry_t *this_entry = &si->chisocket_table[i];
-        int nwildcards = 0;
+        chisocketentry_t *prev = si->port_table[port];
+
+        while (prev->cold->port_next != NULL && prev->cold->port_next != entry)
+            prev = prev->cold->port_next;
+        if (prev->cold->port_next == entry)
+            prev->cold->port_next = entry->cold->port_next;
+    }
+    entry->cold->port_next = NULL;
+    pthread_mutex_unlock(&si->lock_port_table);
+}
 
-        if(this_entry->available)
-            continue;
 
-        /* If the families differ, this is not the socket we're looking for */
-        if(local_addr->sa_family != this_entry->local_addr.ss_family)
-            continue;
+/* See serverinfo.h */
+void chitcpd_demux_key_init(chisocket_demux_key_t *key, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    size_t addr_len = local_addr->sa_family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
 
-        if(remote_addr->sa_family != this_entry->remote_addr.ss_family)
-            continue;
+    memset(key, 0, sizeof(chisocket_demux_key_t));
 
-        /* Check whether the local ports match */
-        if(chitcp_addr_port_cmp(local_addr, (struct sockaddr *) &this_entry->local_addr))
-            continue;
+    key->family = local_addr->sa_family;
+    key->local_port = chitcp_get_addr_port(local_addr);
 
-        /* Check whether the local address matches, accounting for
-         * the fact that the socket could have a wildcard local address */
-        if(chitcp_addr_is_any((struct sockaddr *) &this_entry->local_addr))
+    if(remote_addr != NULL)
+    {
+        memcpy(key->local_addr, chitcp_get_addr(local_addr), addr_len);
+        memcpy(key->remote_addr, chitcp_get_addr(remote_addr), addr_len);
+        key->remote_port = chitcp_get_addr_port(remote_addr);
+    }
+}
+
+/* Must be called with lock_socket_index held */
+static void __chitcpd_unindex_socket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    if(entry->demux_index == DEMUX_INDEX_CONNECTION)
+        HASH_DELETE(hh_demux, si->socket_conn_index, entry);
+    else if(entry->demux_index == DEMUX_INDEX_LISTENER)
+    {
+        chisocketentry_t *next = entry->reuseport_next;
+
+        HASH_DELETE(hh_demux, si->socket_listen_index, entry);
+
+        /* The next socket in the group (if any) takes its place */
+        if(next != NULL)
         {
-            if(!chitcp_addr_is_any(local_addr))
-                nwildcards++;
+            next->reuseport_count = entry->reuseport_count - 1;
+            next->demux_index = DEMUX_INDEX_LISTENER;
+            HASH_ADD(hh_demux, si->socket_listen_index, demux_key, sizeof(chisocket_demux_key_t), next);
         }
-        else
+    }
+    else if(entry->demux_index == DEMUX_INDEX_REUSEPORT)
+    {
+        chisocketentry_t *first, *prev;
+
+        HASH_FIND(hh_demux, si->socket_listen_index, &entry->demux_key, sizeof(chisocket_demux_key_t), first);
+        assert(first != NULL);
+
+        for(prev = first; prev->reuseport_next != entry; prev = prev->reuseport_next)
+            assert(prev->reuseport_next != NULL);
+        prev->reuseport_next = entry->reuseport_next;
+        first->reuseport_count--;
+    }
+
+    entry->reuseport_next = NULL;
+    entry->reuseport_count = 0;
+    entry->demux_index = DEMUX_INDEX_NONE;
+}
+
+/*
+ * chitcpd_reuseport_select - Choose a socket from a listener's group
+ *
+ * Only the sockets in the LISTEN state are considered, and the choice
+ * only depends on the packet's 4-tuple (as long as the group doesn't
+ * change), so every packet of a connection goes to the same socket.
+ *
+ * first: First socket in the group (the one in the listener index)
+ *
+ * local_addr, remote_addr: Packet's addresses
+ *
+ * Returns: The chosen socket (first, if none of them is listening).
+ *
+ * Must be called with lock_socket_index held.
+ */
+static chisocketentry_t *chitcpd_reuseport_select(chisocketentry_t *first, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    chisocket_demux_key_t key;
+    chisocketentry_t *entry;
+    uint8_t *bytes = (uint8_t *) &key;
+    uint32_t hash = 2166136261u, n = 0;
+
+    for(entry = first; entry != NULL; entry = entry->reuseport_next)
+        if(entry->tcp_state == LISTEN)
+            n++;
+    if(n == 0)
+        return first;
+
+    /* FNV-1a, as in chitcpd_syncookie */
+    chitcpd_demux_key_init(&key, local_addr, remote_addr);
+    for(size_t i = 0; i < sizeof(key); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    n = hash % n;
+    for(entry = first; entry != NULL; entry = entry->reuseport_next)
+        if(entry->tcp_state == LISTEN && n-- == 0)
+            break;
+
+    return entry;
+}
+
+/* See serverinfo.h */
+int chitcpd_index_socket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    struct sockaddr *local_addr = (struct sockaddr *) &entry->local_addr;
+    struct sockaddr *remote_addr = (struct sockaddr *) &entry->remote_addr;
+    chisocketentry_t *other = NULL;
+    int ret = CHITCP_OK;
+
+    assert(local_addr->sa_family == AF_INET || local_addr->sa_family == AF_INET6);
+    assert(local_addr->sa_family == remote_addr->sa_family);
+
+    pthread_mutex_lock(&si->lock_socket_index);
+
+    __chitcpd_unindex_socket(si, entry);
+
+    if(chitcp_addr_is_any(remote_addr))
+    {
+        chitcpd_demux_key_init(&entry->demux_key, local_addr, NULL);
+        HASH_FIND(hh_demux, si->socket_listen_index, &entry->demux_key, sizeof(chisocket_demux_key_t), other);
+        if(other == NULL)
         {
-            if(chitcp_addr_is_any(local_addr))
-                nwildcards++;
-            else if (chitcp_addr_cmp(local_addr, (struct sockaddr *) &this_entry->local_addr))
-                continue;
+            HASH_ADD(hh_demux, si->socket_listen_index, demux_key, sizeof(chisocket_demux_key_t), entry);
+            entry->demux_index = DEMUX_INDEX_LISTENER;
+            entry->reuseport_count = 1;
         }
-
-        /* Likewise for the remote address, but checking the ports too */
-        if(chitcp_addr_is_any((struct sockaddr *) &this_entry->remote_addr))
+        else if(other->reuseport && entry->reuseport &&
+                !chitcp_addr_cmp(local_addr, (struct sockaddr *) &other->local_addr))
         {
-            if(!chitcp_addr_is_any(remote_addr))
-                nwildcards++;
+            /* Join the listener's group */
+            chisocketentry_t *last = other;
+
+            while(last->reuseport_next != NULL)
+                last = last->reuseport_next;
+            last->reuseport_next = entry;
+            other->reuseport_count++;
+            entry->demux_index = DEMUX_INDEX_REUSEPORT;
+            other = NULL;
         }
-        else
+    }
+    else
+    {
+        chitcpd_demux_key_init(&entry->demux_key, local_addr, remote_addr);
+        HASH_FIND(hh_demux, si->socket_conn_index, &entry->demux_key, sizeof(chisocket_demux_key_t), other);
+        if(other == NULL)
         {
-            if(chitcp_addr_is_any(remote_addr))
-                nwildcards++;
-            else if (chitcp_addr_cmp(remote_addr, (struct sockaddr *) &this_entry->remote_addr) ||
-                     chitcp_addr_port_cmp(remote_addr, (struct sockaddr *) &this_entry->remote_addr))
-                continue;
+            HASH_ADD(hh_demux, si->socket_conn_index, demux_key, sizeof(chisocket_demux_key_t), entry);
+            entry->demux_index = DEMUX_INDEX_CONNECTION;
         }
+    }
 
-        /* If we're looking for an exact match only, we're not
-         * interested in matches with wildcards */
-        if(nwildcards > 0 && exact_match_only)
-            continue;
+    pthread_mutex_unlock(&si->lock_socket_index);
 
-        if(nwildcards < max_nwildcards)
-        {
-            match = this_entry;
-            max_nwildcards = nwildcards;
+    if(other != NULL)
+    {
+        chilog(ERROR, "[S%i] Socket has the same addresses as socket %i", SOCKET_NO(si, entry), SOCKET_NO(si, other));
+        ret = CHITCP_ESOCKET;
+    }
 
-            /* If we have an exact match, we've found what we're
-             * looking for */
-            if(nwildcards == 0)
-                break;
-        }
+    return ret;
+}
+
+/* See serverinfo.h */
+void chitcpd_unindex_socket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    pthread_mutex_lock(&si->lock_socket_index);
+    __chitcpd_unindex_socket(si, entry);
+    pthread_mutex_unlock(&si->lock_socket_index);
+}
+
+/* See serverinfo.h */
+/* The lookup follows the same precedence as in_pcblookup in TCP/IP
+ * Illustrated, Volume 2 (fewer wildcards win), but uses the hashed
+ * indexes instead of scanning the whole socket table. */
+chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only)
+{
+    assert(local_addr->sa_family == AF_INET || local_addr->sa_family == AF_INET6);
+    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
+    assert(local_addr->sa_family == remote_addr->sa_family);
+
+    chisocket_demux_key_t key;
+    chisocketentry_t *match = NULL, *listener = NULL;
+
+    pthread_mutex_lock(&si->lock_socket_index);
+
+    /* Exact match on the 4-tuple */
+    chitcpd_demux_key_init(&key, local_addr, remote_addr);
+    HASH_FIND(hh_demux, si->socket_conn_index, &key, sizeof(chisocket_demux_key_t), match);
+
+    /* Connected socket with a wildcard local address (see the
+     * CONNECT handler). The ANY address is all zeroes in both
+     * IPv4 and IPv6, so we just clear the local address in the key */
+    if(match == NULL && !exact_match_only && !chitcp_addr_is_any(local_addr))
+    {
+        memset(key.local_addr, 0, sizeof(key.local_addr));
+        HASH_FIND(hh_demux, si->socket_conn_index, &key, sizeof(chisocket_demux_key_t), match);
+    }
+
+    /* Socket bound to the local port, with a wildcard remote address.
+     * There is at most one candidate (or group, which all have the same
+     * local address), but its local address must still match. */
+    if(match == NULL && !exact_match_only)
+    {
+        chitcpd_demux_key_init(&key, local_addr, NULL);
+        HASH_FIND(hh_demux, si->socket_listen_index, &key, sizeof(chisocket_demux_key_t), listener);
+
+        if(listener != NULL &&
+           (chitcp_addr_is_any((struct sockaddr *) &listener->local_addr) ||
+            chitcp_addr_is_any(local_addr) ||
+            !chitcp_addr_cmp(local_addr, (struct sockaddr *) &listener->local_addr)))
+            match = (listener->reuseport_count > 1)? chitcpd_reuseport_select(listener, local_addr, remote_addr) : listener;
     }
 
+    pthread_mutex_unlock(&si->lock_socket_index);
+
     return match;
 }
+
+/* See serverinfo.h */
+void chitcpd_poll_register(serverinfo_t *si, chisocketentry_t *entry, poll_registration_t *reg, poll_waiter_t *waiter)
+{
+    pthread_mutex_lock(&si->lock_poll);
+    reg->waiter = waiter;
+    reg->entry = entry;
+    reg->states = 1 << entry->tcp_state;
+    DL_APPEND(entry->pollers, reg);
+    atomic_fetch_add(&entry->num_pollers, 1);
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See serverinfo.h */
+void chitcpd_poll_unregister(serverinfo_t *si, poll_registration_t *reg)
+{
+    pthread_mutex_lock(&si->lock_poll);
+    if(reg->entry != NULL)
+    {
+        DL_DELETE(reg->entry->pollers, reg);
+        atomic_fetch_sub(&reg->entry->num_pollers, 1);
+        reg->entry = NULL;
+    }
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See serverinfo.h
+ *
+ * A handler that polls a socket registers itself (incrementing
+ * num_pollers) before checking whether the socket is ready, while we're
+ * called after the socket's state has changed. The fence ensures that
+ * either the handler sees the new state, or we see the handler's
+ * registration, so a notification can't be lost. */
+void chitcpd_poll_notify(serverinfo_t *si, chisocketentry_t *entry)
+{
+    poll_registration_t *reg;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&entry->num_pollers) == 0)
+        return;
+
+    pthread_mutex_lock(&si->lock_poll);
+    DL_FOREACH(entry->pollers, reg)
+    {
+        reg->states |= 1 << entry->tcp_state;
+        chitcpd_poll_wake(reg->waiter);
+    }
+    pthread_mutex_unlock(&si->lock_poll);
+}
+
+/* See serverinfo.h */
+bool_t chitcpd_mem_charge(serverinfo_t *si, chisocketentry_t *entry, size_t n, bool_t data)
+{
+    if(!mem_budget_charge(&entry->mem, n, data))
+        return FALSE;
+
+    if(!mem_budget_charge(&si->mem, n, data))
+    {
+        mem_budget_uncharge(&entry->mem, n);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* See serverinfo.h */
+void chitcpd_mem_uncharge(serverinfo_t *si, chisocketentry_t *entry, size_t n)
+{
+    mem_budget_uncharge(&entry->mem, n);
+    mem_budget_uncharge(&si->mem, n);
+}
@@ -48,53 +48,195 @@
 #include <pthread.h>
 
 #include "tcp.h"
+#include "netem.h"
+#include "affinity.h"
+#include "pcap.h"
+#include "txsched.h"
+#include "membudget.h"
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
 #include "chitcp/debug_api.h"
-
-#define DEFAULT_MAX_SOCKETS (1024u)
+#include "chitcp/uthash.h"
+#include "chitcp/timerwheel.h"
+
+/* The socket table grows in chunks of CHISOCKET_CHUNK_SIZE entries,
+ * up to DEFAULT_MAX_SOCKETS entries */
+#define DEFAULT_MAX_SOCKETS (65536u)
+#define CHISOCKET_CHUNK_SIZE (1024u)
+#define CHISOCKET_MAX_CHUNKS (DEFAULT_MAX_SOCKETS / CHISOCKET_CHUNK_SIZE)
 #define DEFAULT_MAX_PORTS (65536u)
 #define DEFAULT_MAX_CONNECTIONS (1024u)
+#define CONNECTION_MAX_STRIPES (16)
 #define DEFAULT_EPHEMERAL_PORT_START (49152u)
+#define CONNECTION_TX_BATCH_MAX (16)
 
 typedef struct chisocketentry chisocketentry_t;
+typedef struct tcpconnentry tcpconnentry_t;
+struct transport;
+
+/* Key of a peer in the peer index: the IP address of its daemon */
+typedef struct tcppeer_key
+{
+    uint8_t addr[16];
+    uint16_t family;
+} tcppeer_key_t;
+
+/* A peer chiTCP daemon. The traffic to a peer is striped over several
+ * connections, and every chiTCP socket is hashed onto one of them by
+ * its addresses (see chitcpd_get_connection). So the packets of a socket
+ * are still sent in order, but sockets don't have to wait behind each
+ * other's packets, and are received by different network I/O threads.
+ *
+ * Peers are in the peer index, and are protected by lock_connection_table.
+ * A peer that we are still connecting to is not ready until all of
+ * its stripes are connected (see chitcpd_create_connection). */
+typedef struct tcppeer
+{
+    tcppeer_key_t key;
+    bool_t ready;
+    int num_stripes;
+    tcpconnentry_t *stripes[CONNECTION_MAX_STRIPES];
+
+    /* TCP Fast Open cookie issued by the peer, if any (see
+     * chitcpd_fastopen_cookie_get). chiTCP addresses are the addresses
+     * of their daemons, so this is the cookie for every server on it */
+    bool_t has_tfo_cookie;
+    uint8_t tfo_cookie[TCP_FASTOPEN_COOKIE_LEN];
+
+    UT_hash_handle hh;
+} tcppeer_t;
 
 /* Represents single TCP connection between chiTCP daemons */
-typedef struct tcpconnentry
+struct tcpconnentry
 {
     /* Is this entry available? */
     bool_t available;
 
-    /* Thread that is handling this connection */
-    pthread_t thread;
-
-    /* Real TCP sockets associated with this connection.
+    /* Real sockets associated with this connection.
      * Note that, when two peers are distinct, these sockets
      * will have the same value. When connecting to the
      * loopback address, they'll have different values. */
     socket_t realsocket_send;
     socket_t realsocket_recv;
 
-    /* Peer chiTCP daemon */
+    /* Transport that carries the connection's frames, and its
+     * per-connection state (see transport.h) */
+    const struct transport *transport;
+    void *transport_data;
+
+    /* Peer chiTCP daemon, and index of this connection among the
+     * peer's stripes (which also picks the network I/O thread that
+     * receives on it) */
     struct sockaddr_storage peer_addr;
+    tcppeer_t *peer;
+    int stripe;
+
+    /* Inbound side of the connection, which is polled by the
+     * network I/O thread (see chitcpd_register_connection).
+     * rx_buf holds bytes that have been read from realsocket_recv
+     * but not yet parsed into chiTCP frames, and rx_packet is the
+     * packet whose payload is being received (if any), of which
+     * rx_packet_len bytes have been received so far. (Message-based
+     * transports only use rx_buf, to receive several messages at once.) */
+    bool_t rx_registered;
+    uint8_t *rx_buf;
+    size_t rx_len;
+    tcp_packet_t *rx_packet;
+    size_t rx_packet_len;
+    struct sockaddr_storage rx_local_addr;
+    struct sockaddr_storage rx_peer_addr;
+
+    /* Outbound side of the connection. Segments are queued in tx_sched,
+     * and only one thread at a time (the one that sets tx_busy) writes
+     * to realsocket_send, sending the queued segments in the order the
+     * scheduler picks, up to CONNECTION_TX_BATCH_MAX at a time. */
+    tx_sched_t tx_sched;
+    bool_t tx_busy;
+    pthread_mutex_t lock_tx;
+    pthread_cond_t cv_tx;
+
+    /* Number of chiTCP packets received and sent (see GET_STATS) */
+    atomic_uint_fast64_t packets_in;
+    atomic_uint_fast64_t packets_out;
+
+};
+
+/* Latency histogram of the requests with a given code (see GET_STATS).
+ * Bucket i counts the requests that took less than 2^i microseconds
+ * (and at least 2^(i-1)), and the last bucket all the slower ones.
+ * Requests are handled by many threads at once, so the counters are
+ * relaxed atomics. */
+#define RPC_LATENCY_BUCKETS (CHITCP_RPC_LATENCY_BUCKETS)
+#define RPC_STATS_MAX_CODES (32)
+
+typedef struct rpc_stats
+{
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_us;
+    atomic_uint_fast64_t buckets[RPC_LATENCY_BUCKETS];
+} rpc_stats_t;
 
-} tcpconnentry_t;
+/*
+ * rpc_stats_add - Add an entry to a latency histogram
+ *
+ * stats: Histogram
+ *
+ * us: Latency, in microseconds
+ *
+ * Returns: Nothing.
+ *
+ */
+static inline void rpc_stats_add(rpc_stats_t *stats, uint64_t us)
+{
+    int bucket = 0;
+
+    /* Entries that took [2^(i-1), 2^i) microseconds go in bucket i */
+    if (us > 0)
+        bucket = MIN(64 - __builtin_clzll(us), RPC_LATENCY_BUCKETS - 1);
 
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_us, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->buckets[bucket], 1, memory_order_relaxed);
+}
 
-/* A pending connection in a passive socket */
-typedef struct pending_connection
+/* Stages of the path of a received segment, as measured by the segment
+ * latency tracer (see the trace_* fields in tcp_packet_t). Only one in
+ * every trace_sample segments is traced. */
+typedef enum
 {
-    /* First packet received */
-    tcp_packet_t *initial_packet;
+    TRACE_STAGE_DELIVERY = 0,  /* Received -> handed to its socket (including the delivery queue) */
+    TRACE_STAGE_PENDING,       /* Handed to its socket -> picked up by TCP */
+    TRACE_STAGE_TCP,           /* Handled by TCP */
+    TRACE_STAGE_TOTAL,         /* Received -> handled by TCP */
+    TRACE_STAGES
+} trace_stage_t;
+
+
+/* Queue of a passive socket that an active socket spawned by it is in
+ * (see passive_chisocket_state_t) */
+typedef enum
+{
+    LISTEN_QUEUE_NONE   = 0,  /* Accepted, or no longer tied to the passive socket */
+    LISTEN_QUEUE_SYN    = 1,  /* Handshake in progress */
+    LISTEN_QUEUE_ACCEPT = 2,  /* Established, waiting to be accepted */
+} listen_queue_t;
 
-    /* Addresses */
-    struct sockaddr_storage local_addr;
-    struct sockaddr_storage remote_addr;
 
-    /* List pointers */
-    struct pending_connection *prev;
-    struct pending_connection *next;
-} pending_connection_t;
+/* Events that can be raised on an active socket */
+#define TCP_EVENT_APP_CONNECT  (1U << 0)  /* Application has called connect() */
+#define TCP_EVENT_APP_SEND     (1U << 1)  /* Application has data to send */
+#define TCP_EVENT_APP_RECV     (1U << 2)  /* Application has read data from the buffer */
+#define TCP_EVENT_NET_RECV     (1U << 3)  /* Data has arrived through the network */
+#define TCP_EVENT_APP_CLOSE    (1U << 4)  /* Application has requested the connection be closed */
+#define TCP_EVENT_TIMEOUT_RTX  (1U << 5)  /* A retransmission timeout has occurred. */
+#define TCP_EVENT_TIMEOUT_PST  (1U << 6)  /* A persist timeout has occurred. */
+#define TCP_EVENT_TIMEOUT_DACK (1U << 7)  /* A delayed ACK timeout has occurred. */
+#define TCP_EVENT_CLEANUP      (1U << 8)  /* Socket must release all its resources */
+
+/* Not an event: nobody is handling the socket's events (see
+ * active_chisocket_state_t) */
+#define TCP_EVENT_SLEEPING     (1U << 31)
+#define TCP_EVENT_ALL          (~TCP_EVENT_SLEEPING)
 
 
 /* State that is specific to active sockets */
@@ -106,46 +248,84 @@ typedef struct active_chisocket_state
     /* Passive socket (if any) from which this socket was created */
     chisocketentry_t* parent_socket;
 
-    /* Event flags, with lock and condition variable */
-    union
-    {
-        struct
-        {
-            uint8_t app_connect:1,  /* Application has called connect() */
-                    app_send:1,     /* Application has data to send */
-                    app_recv:1,     /* Application has read data from the buffer */
-                    net_recv:1,     /* Data has arrived through the network */
-                    app_close:1,    /* Application has requested the connection be closed */
-                    timeout_rtx:1,  /* A retransmission timeout has occurred. */
-                    timeout_pst:1,  /* A persist timeout has occurred. */
-                    cleanup:1;      /* Socket must release all its resources */
-        };
-        uint8_t raw;
-    } flags;
+    /* Queue of the passive socket that this socket is in, and linkage.
+     * These are protected by the server's lock_listen. */
+    listen_queue_t listen_queue;
+    chisocketentry_t *lq_prev;
+    chisocketentry_t *lq_next;
+
+    /* Event flags (TCP_EVENT_*), raised with chitcpd_tcp_raise_event.
+     * TCP_EVENT_SLEEPING is set while nobody is handling the socket's
+     * events, so raising an event only has to wake up the TCP thread
+     * (or queue the socket on its worker) when that bit was set. The
+     * lock and condition variable are only used to sleep on systems
+     * without futexes. */
+    atomic_uint events;
     pthread_mutex_t lock_event;
     pthread_cond_t cv_event;
 
     /* Thread that does all the magic */
     pthread_t tcp_thread;
 
+    /* Run queue linkage, used instead of tcp_thread when the daemon
+     * runs the worker pool engine (see chitcpd_tcp_notify). These are
+     * protected by the lock of the worker that owns the socket. */
+    bool_t rq_queued;   /* Socket is in its worker's run queue */
+    bool_t rq_closed;   /* Socket is being freed; must not be queued again */
+    chisocketentry_t *rq_prev;
+    chisocketentry_t *rq_next;
+
     /* Real TCP connection for this socket */
     tcpconnentry_t *realtcpconn;
 
+    /* The socket's queue in the connection's transmit scheduler. It is
+     * protected by the connection's lock_tx */
+    tx_flow_t tx_flow;
+
 } active_chisocket_state_t;
 
-/* State that is specific to passive sockets */
+/* State that is specific to passive sockets
+ *
+ * When a SYN arrives, the passive socket spawns an active socket that
+ * does the three-way handshake right away, without waiting for the
+ * application to call accept(). While the handshake is in progress, the
+ * new socket is in the SYN queue (and also in the connection index, so
+ * retransmitted SYNs go straight to it). Once it is ESTABLISHED, it moves
+ * to the accept queue, and accept() just pops it from there.
+ *
+ * As in 4.4BSD, the backlog bounds the number of sockets in both queues
+ * together. SYNs that arrive when they are full are dropped, or answered
+ * with a SYN cookie (see chitcpd_syncookie). The queues are protected by
+ * the server's lock_listen. */
 typedef struct passive_chisocket_state
 {
     /* Socket backlog */
     int backlog;
 
-    /* Queue with pending connections received from the network */
-    pending_connection_t *pending_connections;
-    pthread_mutex_t lock_pending_connections;
-    pthread_cond_t cv_pending_connections;
+    /* SYN and accept queues */
+    chisocketentry_t *syn_queue;
+    chisocketentry_t *accept_queue;
+    int syn_qlen;
+    int accept_qlen;
+    pthread_cond_t cv_accept;
 } passive_chisocket_state_t;
 
 
+/* Debug event waiting to be sent by a non-blocking debug monitor */
+typedef struct debug_event
+{
+    int sockfd;
+    int event_flag;
+    int new_sockfd;
+    bool_t is_active;
+    struct debug_event *prev;
+    struct debug_event *next;
+} debug_event_t;
+
+/* Maximum number of events queued in a non-blocking debug monitor.
+ * Any other events are dropped (and logged) */
+#define DEBUG_MONITOR_MAX_EVENTS (4096)
+
 /* Container for thread-safe debug communication */
 typedef struct debug_monitor
 {
@@ -155,14 +335,161 @@ typedef struct debug_monitor
     bool_t dying;   /* Has the peer closed the sockfd connection? */
     int sockfd;     /* The UNIX socket to which to write debug messages */
     int ref_count;  /* The number of chisockets registered to this monitor */
+
+    /* Non-blocking monitors (DBG_FLAG_NONBLOCKING) don't make breakpoints
+     * wait for the client: events are queued, and a streaming thread
+     * sends them to the client. The streaming thread is the one that
+     * frees the monitor (once stopping is set) */
+    bool_t nonblocking;
+    struct serverinfo *si;
+    pthread_t streamer;
+    pthread_mutex_t lock_events;
+    pthread_cond_t cv_events;
+    debug_event_t *events;
+    int num_events;
+    int dropped_events;
+    bool_t stopping;
 } debug_monitor_t;
 
-/* Entry in socket table */
+
+/* Key used to index sockets in the demultiplexing tables. It is built
+ * from a local/remote address pair and zero-padded, so it can be hashed
+ * and compared bytewise. Addresses and ports are in network order. */
+typedef struct chisocket_demux_key
+{
+    uint8_t local_addr[16];
+    uint8_t remote_addr[16];
+    uint16_t local_port;
+    uint16_t remote_port;
+    uint16_t family;
+} chisocket_demux_key_t;
+
+/* Demultiplexing index that a socket entry is stored in (if any) */
+typedef enum
+{
+    DEMUX_INDEX_NONE        = 0,  /* Not indexed */
+    DEMUX_INDEX_CONNECTION  = 1,  /* Keyed on the full 4-tuple */
+    DEMUX_INDEX_LISTENER    = 2,  /* Keyed on the local port */
+    DEMUX_INDEX_REUSEPORT   = 3,  /* In the group of the listener with
+                                   * the same key (see reuseport_next) */
+} demux_index_t;
+
+/* A connection in the TIME_WAIT state. As soon as a socket enters
+ * TIME_WAIT, its entry (with its buffers and TCP thread) is freed, and
+ * only this is kept, for 2*MSL, to acknowledge retransmissions of the
+ * peer's FIN (see chitcpd_timewait_enter). The entries are in the TIME_WAIT
+ * index, keyed on the 4-tuple, and in a list ordered by expiry. */
+typedef struct timewait_entry
+{
+    chisocket_demux_key_t key;
+    uint32_t SND_NXT;
+    uint32_t RCV_NXT;
+    uint16_t win;           /* Window we advertise (already scaled) */
+    bool_t ts_enabled;
+    uint32_t TS_RECENT;
+    uint64_t expiry;        /* See tcp_now */
+    UT_hash_handle hh;
+    struct timewait_entry *prev;
+    struct timewait_entry *next;
+} timewait_entry_t;
+
+/* A handler waiting for any of several sockets to change (e.g., to
+ * become ready in chisocket_poll()). It is registered on each of those
+ * sockets with a poll_registration_t (see chitcpd_poll_register). Both
+ * are protected by the server's lock_poll.
+ *
+ * When the waiter is notified, notified is set and, if there is a wake
+ * function, it is called (with lock_poll held). Otherwise, cv is signalled. */
+struct poll_waiter;
+typedef void (*poll_wake_func)(struct poll_waiter *waiter, void *arg);
+
+typedef struct poll_waiter
+{
+    pthread_cond_t cv;
+    bool_t notified;
+    poll_wake_func wake;
+    void *wake_arg;
+} poll_waiter_t;
+
+typedef struct poll_registration
+{
+    poll_waiter_t *waiter;
+    chisocketentry_t *entry;   /* NULL once the socket has been freed */
+
+    /* TCP states the socket has been in since the registration was made
+     * (bit N is set for state N), so a waiter can't miss a state the socket
+     * only goes through briefly (such as TIME_WAIT) */
+    unsigned int states;
+
+    struct poll_registration *prev;
+    struct poll_registration *next;
+} poll_registration_t;
+
+/* State of a socket entry that is rarely used: only when the socket is
+ * created or freed, when a test withholds its packets, or when it is
+ * being debugged. It is kept out of line, in a separate chunk of the
+ * socket table (see chitcpd_grow_socket_table), so that it doesn't take
+ * up cache lines in the entries themselves. */
+typedef struct chisocket_cold
+{
+    /* Command connection that created this entry (see handlers.h) */
+    struct handler_thread_args *creator;
+
+    /* Queue for withheld packets (simulating unreliable network) */
+    withheld_tcp_packet_list_t *withheld_packets;
+    pthread_mutex_t lock_withheld_packets;
+
+    /* For debug communications (see event_flags in chisocketentry_t) */
+    debug_monitor_t *debug_monitor;
+    pthread_mutex_t lock_debug_monitor;
+
+    /* Next socket bound to the same port (SO_REUSEPORT, see
+     * chitcpd_reserve_port). Protected by the server's lock_port_table. */
+    chisocketentry_t *port_next;
+} chisocket_cold_t;
+
+/* Entry in socket table
+ *
+ * The fields that are checked on every request and segment come first,
+ * in the entry's first cache line, and the state of an active socket
+ * starts with its TCB (see tcp_data_t). */
 typedef struct chisocketentry
 {
     /* Is this entry available? */
+    _Alignas(CHITCP_CACHE_LINE)
     bool_t available;
 
+    /* Index of this entry in the socket table (i.e., the socket's
+     * descriptor), and next entry in the table's free list */
+    int sockfd;
+
+    /* TCP state (CLOSED, SYN_SENT, LISTEN, etc.) */
+    tcp_state_t tcp_state;
+
+    /* Socket type: active or passive */
+    socket_type_t actpas_type;
+
+    /* Non-blocking mode (O_NONBLOCK, see chisocket_fcntl) */
+    bool_t nonblocking;
+
+    /* Handlers polling this socket (see chitcpd_poll_notify).
+     * num_pollers may be checked without holding the server's lock_poll */
+    atomic_int num_pollers;
+
+    /* Debug events. event_flags is only modified while holding the
+     * cold state's lock_debug_monitor, and is zero if there is no
+     * monitor, so breakpoints can check it without taking the lock */
+    atomic_int event_flags;
+
+    /* Demultiplexing index (see chitcpd_index_socket) */
+    demux_index_t demux_index;
+
+    chisocketentry_t *free_next;
+    poll_registration_t *pollers;
+
+    /* Everything that is rarely used (see chisocket_cold_t) */
+    chisocket_cold_t *cold;
+
     /* Socket domain
      * Only AF_INET and AF_INET6 are supported. */
     int domain;
@@ -175,29 +502,66 @@ typedef struct chisocketentry
      * Only IPPROTO_TCP and IPPROTO_RAW are supported */
     int protocol;
 
-    /* Addresses */
-    struct sockaddr_storage local_addr;
-    struct sockaddr_storage remote_addr;
-
-    /* TCP state (CLOSED, SYN_SENT, LISTEN, etc.) */
-    tcp_state_t tcp_state;
+    /* Size of the send and receive buffers (SO_SNDBUF and SO_RCVBUF).
+     * If buf_autotune is true, the buffers of an active socket grow
+     * as they fill up (up to the daemon's tcp_buf_max). Explicitly
+     * setting either size with chisocket_setsockopt disables this. */
+    uint32_t sndbuf_size;
+    uint32_t rcvbuf_size;
+    bool_t buf_autotune;
+
+    /* Minimum number of bytes a blocking recv() waits for (SO_RCVLOWAT),
+     * which is also when poll() reports the socket as readable */
+    uint32_t rcvlowat;
+
+    /* TCP_NODELAY and TCP_QUICKACK (copied into the socket's tcp_data
+     * when its TCP thread starts) */
+    bool_t nodelay;
+    bool_t quickack;
+
+    /* Congestion control algorithm (TCP_CONGESTION, see tcp_cc.h) */
+    int cc_algorithm;
+
+    /* TCP Fast Open: set with TCP_FASTOPEN on a listener (and inherited
+     * by the sockets it spawns), or by a MSG_FASTOPEN connect (see
+     * chisocket_sendto). Copied into tcp_data when the TCP thread starts */
+    bool_t fastopen;
+
+    /* SO_PRIORITY: the socket's class and weight in the transmit
+     * scheduler of its connection (see tx_flow_set_priority) */
+    int priority;
+
+    /* Pacing rate in bytes per second (SO_MAX_PACING_RATE, copied into
+     * the socket's tcp_data when its TCP thread starts). Zero if pacing
+     * is disabled, and UINT32_MAX for CHITCP_PACING_AUTO */
+    uint32_t pacing_rate;
+
+    /* Memory charged for the packets queued for this socket (pending
+     * and withheld), limited by the daemon's socket_mem_limit. Its
+     * buffers are limited by their own sizes instead */
+    mem_budget_t mem;
+
+    /* SO_REUSEPORT: the socket may share its port (and address) with
+     * other sockets that also set it. Such sockets form a group: the
+     * first one is in the listener index, and the others are chained
+     * from it through reuseport_next. reuseport_count (only meaningful
+     * in the first one) is the number of sockets in the group. These
+     * are protected by the server's lock_socket_index. */
+    bool_t reuseport;
+    chisocketentry_t *reuseport_next;
+    uint32_t reuseport_count;
+
+    /* Waiting for changes of tcp_state */
     pthread_mutex_t lock_tcp_state;
     pthread_cond_t cv_tcp_state;
 
-    /* Socket type: active or passive */
-    socket_type_t actpas_type;
-
-    /* Thread that created this entry */
-    pthread_t creator_thread;
-
-    /* Queue for withheld packets (simulating unreliable network) */
-    withheld_tcp_packet_list_t *withheld_packets;
-    pthread_mutex_t lock_withheld_packets;
+    /* Addresses */
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage remote_addr;
 
-    /* For debug communications */
-    debug_monitor_t *debug_monitor;
-    pthread_mutex_t lock_debug_monitor;
-    int event_flags;
+    /* Key in the demultiplexing index */
+    chisocket_demux_key_t demux_key;
+    UT_hash_handle hh_demux;
 
     union
     {
@@ -240,21 +604,60 @@ typedef enum
 
 /* The packet_delivery_list_entry_t is used to keep track
  * of packets receoived from the network layer, and which
- * have to be delivered to the appropriate socket */
+ * have to be delivered to the appropriate socket. The delivery
+ * time is measured with chitcp_clock_now, and packets with the same
+ * delivery time are delivered in the order they were queued (seq) */
 typedef struct packet_delivery_list_entry
 {
     chisocketentry_t *entry;
     tcp_packet_t* tcp_packet;
     struct timespec delivery_time;
+    uint64_t seq;
     char* log_prefix;
     struct sockaddr_storage local_addr;
     struct sockaddr_storage remote_addr;
-
-    struct packet_delivery_list_entry *prev;
-    struct packet_delivery_list_entry *next;
 } packet_delivery_list_entry_t;
 
 
+/* TCP engine, i.e., what threads run the TCP state machine */
+typedef enum
+{
+    TCP_ENGINE_THREAD_PER_SOCKET  = 0,  /* One TCP thread per active socket */
+    TCP_ENGINE_WORKER_POOL        = 1,  /* Sockets are sharded onto a fixed pool of workers */
+} tcp_engine_t;
+
+/* A TCP worker runs the events of all the sockets sharded onto it,
+ * taking them from its run queue (see tcp_thread.c) */
+typedef struct tcp_worker
+{
+    int id;
+    struct serverinfo *si;
+    pthread_t thread;
+
+    /* Sockets with pending events */
+    chisocketentry_t *run_queue;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+
+    /* Signaled when a socket owned by this worker is freed */
+    pthread_cond_t cv_freed;
+
+    bool_t done;
+} tcp_worker_t;
+
+/* A network I/O thread receives the chiTCP packets sent by peers over
+ * the connections of one stripe (see connection.c). The pipe is used to
+ * wake it up when a connection is registered, or when the daemon is
+ * stopping. */
+typedef struct netio_thread
+{
+    int id;
+    struct serverinfo *si;
+    pthread_t thread;
+    int wakeup[2];
+} netio_thread_t;
+
+
 /* The serverinfo_t struct is a singleton data structure that contains
  * all the state for the chiTCP daemon. It is often the first parameter
  * in most chitcpd_* functions. */
@@ -267,7 +670,8 @@ typedef struct serverinfo
     pthread_mutex_t lock_state;
     pthread_cond_t cv_state;
 
-    /* Daemon TCP port and UNIX socket path */
+    /* Daemon TCP port and UNIX socket path (if the path is empty, there
+     * is no UNIX socket, and the daemon can only be used in-process) */
     uint16_t server_port;
     char server_socket_path[UNIX_PATH_MAX];
 
@@ -277,43 +681,196 @@ typedef struct serverinfo
     socket_t server_socket;
 
     /* This is the thread that listens on a TCP port for
-     * incoming chiTCP packets */
+     * incoming connections from other daemons. If the daemon's
+     * transport is not TCP, it also listens on transport_socket.
+     * network_wakeup is written to when the daemon stops. */
     pthread_t network_thread;
     socket_t network_socket;
+    socket_t transport_socket;
+    int network_wakeup[2];
+    const struct transport *transport;
+
+    /* These are the threads that receive the chiTCP packets sent
+     * by peers over the connections in the connection table. There
+     * is one per connection stripe, and each one receives on the
+     * connections of its stripe (see chitcpd_register_connection) */
+    int num_netio_threads;
+    netio_thread_t *netio_threads;
+    bool_t netio_done;
 
     /* This is the thread that delivers the packets received
-     * by the network thread (possibly delayed by a latency) */
+     * by the network thread (possibly delayed by a latency, or by
+     * the link profile of the peer they came from). The delivery
+     * queue is a binary min-heap, ordered by delivery time. */
     pthread_t delivery_thread;
-    packet_delivery_list_entry_t *delivery_queue;
+    packet_delivery_list_entry_t **delivery_queue;
+    size_t delivery_queue_len;
+    size_t delivery_queue_size;
+    size_t delivery_queue_max;  /* Largest delivery_queue_len so far */
+    uint64_t delivery_seq;
     pthread_mutex_t lock_delivery;
     pthread_cond_t cv_delivery;
     double latency;
-
-    /* Connections to other chiTCP daemons */
+    netem_profile_t *netem_profiles;
+
+    /* Memory budget of the daemon (limited by mem_limit, if not 0), which
+     * is charged for the packets in the delivery queue and in the sockets'
+     * queues, and for the sockets' buffers. Each socket's queues are also
+     * limited by socket_mem_limit (see the socket entry's budget). When
+     * either budget is full, packets are dropped, and, before that,
+     * sockets stop opening their receive windows, and listeners stop
+     * taking connections (see membudget.h) */
+    size_t mem_limit;
+    size_t socket_mem_limit;
+    mem_budget_t mem;
+
+    /* Connections to other chiTCP daemons, and index of the peers
+     * they connect to. connection_stripes is the number of connections
+     * we open to each peer. cv_connection_table is signaled when a peer
+     * becomes ready. */
     uint16_t connection_table_size;
     tcpconnentry_t *connection_table;
+    tcppeer_t *peer_index;
+    int connection_stripes;
     pthread_mutex_t lock_connection_table;
-
-    /* Socket table */
-    uint16_t chisocket_table_size;
-    chisocketentry_t *chisocket_table;
+    pthread_cond_t cv_connection_table;
+
+    /* Socket table. It is allocated in chunks (which are never moved,
+     * so pointers to socket entries remain valid as the table grows),
+     * and its available entries are kept in a free list. Entries must
+     * be accessed with CHISOCKET_ENTRY. The size is only updated once
+     * a new chunk has been initialized, so it can be read without
+     * holding the lock. Each chunk of entries has a chunk with their
+     * cold state (see chisocket_cold_t). */
+    atomic_int chisocket_table_size;
+    chisocketentry_t *chisocket_chunks[CHISOCKET_MAX_CHUNKS];
+    chisocket_cold_t *chisocket_cold_chunks[CHISOCKET_MAX_CHUNKS];
+    chisocketentry_t *chisocket_free;
     pthread_mutex_t lock_chisocket_table;
 
     /* Table of pointers to socket entries.
      * If an entry is NULL, the port is available.
      * If not NULL, it contains a pointer to the socket that
-     * is assigned to that port. */
+     * is assigned to that port (or, with SO_REUSEPORT, to the first
+     * of the sockets sharing it, see port_next). The ephemeral ports also have
+     * a bitmap (a set bit means the port is taken), which is
+     * searched starting at a rotating cursor. */
     uint32_t port_table_size;
     uint16_t ephemeral_port_start;
     chisocketentry_t **port_table;
-
-    /* The libcap file that this server is logging to. */
+    uint64_t *ephemeral_bitmap;
+    uint32_t ephemeral_cursor;
+    pthread_mutex_t lock_port_table;
+
+    /* Socket demultiplexing indexes (uthash tables). The connection
+     * index is keyed on the 4-tuple of connected sockets, and the
+     * listener index is keyed on the local port of sockets with
+     * a wildcard remote address (bound and listening sockets, or
+     * groups of them, see reuseport_next). */
+    chisocketentry_t *socket_conn_index;
+    chisocketentry_t *socket_listen_index;
+    pthread_mutex_t lock_socket_index;
+
+    /* Lock for the SYN and accept queues of all the passive sockets
+     * (see passive_chisocket_state_t) */
+    pthread_mutex_t lock_listen;
+
+    /* Lock for the poll registrations of all the sockets */
+    pthread_mutex_t lock_poll;
+
+    /* Connections in TIME_WAIT (see timewait_entry_t). The timer is set
+     * to expire when the first entry in the list does (or earlier), and
+     * removes the entries that have expired. timewait_count is only there
+     * so packets don't have to take the lock when the index is empty. */
+    timewait_entry_t *timewait_index;
+    timewait_entry_t *timewait_list;
+    atomic_int timewait_count;
+    multi_timer_t timewait_timer;
+    pthread_mutex_t lock_timewait;
+
+    /* TCP engine. By default, every active socket has its own TCP thread.
+     * With the worker pool engine, active sockets are instead sharded
+     * onto num_tcp_workers worker threads. */
+    tcp_engine_t tcp_engine;
+    int num_tcp_workers;
+    tcp_worker_t *tcp_workers;
+
+    /* Default sizes of the sockets' send and receive buffers, and
+     * whether they are autotuned (growing up to tcp_buf_max bytes). */
+    uint32_t tcp_sndbuf_default;
+    uint32_t tcp_rcvbuf_default;
+    uint32_t tcp_buf_max;
+    bool_t tcp_buf_autotune;
+
+    /* Should sockets offer the timestamps option (RFC 7323)? */
+    bool_t tcp_timestamps;
+
+    /* Should sockets offer selective acknowledgements (RFC 2018)? */
+    bool_t tcp_sack;
+
+    /* Should passive sockets send SYN cookies when their queues are
+     * full? The secret is picked at random when the server starts */
+    bool_t tcp_syncookies;
+    uint32_t syncookie_secret;
+
+    /* Should in-order data segments be coalesced before TCP handles them? */
+    bool_t tcp_coalesce;
+
+    /* Default congestion control algorithm (see tcp_cc.h) */
+    int tcp_cc_default;
+
+    /* Timer wheel with the timers of all the active sockets
+     * (see the multitimer in tcp_data_t) */
+    timer_wheel_t timer_wheel;
+
+    /* Pool of threads that handle the requests on the command
+     * connections (see handlers.h) */
+    int num_handler_threads;
+    struct handler_pool *handler_pool;
+
+    /* The libpcap file that this server is logging to, and the writer
+     * that captures the packets into it (see pcap.h) */
     const char *libpcap_file_name;
-    FILE *libpcap_file;
+    pcap_options_t pcap_options;
+    pcap_writer_t *pcap;
+
+    /* Latency of the requests handled, indexed by request code */
+    rpc_stats_t rpc_stats[RPC_STATS_MAX_CODES];
+
+    /* Segment latency tracing. One in every trace_sample received
+     * segments (none if zero) is timed through each trace_stage_t */
+    unsigned int trace_sample;
+    atomic_uint_fast64_t trace_seq;
+    rpc_stats_t trace_stats[TRACE_STAGES];
+
+    /* CPUs the threads are placed on (see affinity.h). The network I/O
+     * threads get the first num_netio_threads slots, and the TCP
+     * workers get the slots after those. Each socket's TCP thread runs
+     * on the NUMA node of the network I/O thread of its connection */
+    cpu_placement_t placement;
 
 } serverinfo_t;
 
-#define SOCKET_NO(si, entry) ((int) (entry - si->chisocket_table))
+/*
+ * chitcpd_trace_stage - Add a traced segment's time in a stage to its histogram
+ *
+ * si: Server info
+ *
+ * stage: Stage
+ *
+ * from, to: When the segment entered and left the stage (as returned by tcp_now)
+ *
+ * Returns: Nothing.
+ *
+ */
+static inline void chitcpd_trace_stage(serverinfo_t *si, trace_stage_t stage, uint64_t from, uint64_t to)
+{
+    rpc_stats_add(&si->trace_stats[stage], to > from? (to - from) / MICROSECOND : 0);
+}
+
+#define CHISOCKET_ENTRY(si, sockfd) \
+    (&(si)->chisocket_chunks[(sockfd) / CHISOCKET_CHUNK_SIZE][(sockfd) % CHISOCKET_CHUNK_SIZE])
+#define SOCKET_NO(si, entry) ((entry)->sockfd)
 
 /*
  * chitcpd_update_tcp_state - Updates the TCP state of a socket
@@ -344,9 +901,29 @@ void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_sta
 void chitcpd_timeout(serverinfo_t *si, chisocketentry_t *entry, tcp_timer_type_t type);
 
 
+/*
+ * chitcpd_grow_socket_table - Add a chunk to the socket table
+ *
+ * The new entries are added to the free list. Must be called with
+ * lock_chisocket_table held (or before the server has started).
+ *
+ * si: Server info
+ *
+ * Returns:
+ *   - CHITCP_OK: Socket table grown succesfully
+ *   - CHITCP_ENOMEM: The table is already at its maximum size,
+ *                    or the chunk could not be allocated
+ *
+ */
+int chitcpd_grow_socket_table(serverinfo_t *si);
+
+
 /*
  * chitcpd_allocate_socket - Allocate a socket entry
  *
+ * Takes the first entry in the socket table's free list. If the
+ * free list is empty, the table is grown by one chunk.
+ *
  * si: Server info
  *
  * socket_entry: Output parameter with the index of the allocated entry
@@ -374,19 +951,225 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry);
 
 
 /*
- * chitcpd_find_ephemeral_port - Find an ephemeral port
+ * chitcpd_reserve_port - Assign a port to a socket
+ *
+ * A port that is already taken can still be assigned to the socket if
+ * both it and the sockets that have the port set SO_REUSEPORT. Whether
+ * they can also share the address is checked when the socket is indexed.
  *
  * si: Server info
  *
+ * entry: Socket entry
+ *
+ * port: Port (in host order)
+ *
+ * Returns:
+ *   - CHITCP_OK: Port assigned to the socket
+ *   - CHITCP_EINVAL: Invalid port
+ *   - CHITCP_ESOCKET: Port is already taken
+ *
+ */
+int chitcpd_reserve_port(serverinfo_t *si, chisocketentry_t *entry, uint16_t port);
+
+
+/*
+ * chitcpd_reserve_ephemeral_port - Assign an ephemeral port to a socket
+ *
+ * The search starts right after the last ephemeral port that was
+ * assigned, so recently released ports are not reused right away.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
  * Returns: -1 if no ephemeral ports are available.
- *          Otherwise, the port number.
+ *          Otherwise, the port number (in host order).
  *
  */
-int chitcpd_find_ephemeral_port(serverinfo_t *si);
+int chitcpd_reserve_ephemeral_port(serverinfo_t *si, chisocketentry_t *entry);
 
 
+/*
+ * chitcpd_release_port - Release a socket's port
+ *
+ * Does nothing if the port is not assigned to the socket (e.g.,
+ * sockets spawned by a passive socket share its port, but don't
+ * own it). If other sockets share the port (SO_REUSEPORT), it
+ * remains assigned to them.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
+ * port: Port (in host order)
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_release_port(serverinfo_t *si, chisocketentry_t *entry, uint16_t port);
+
+
+/*
+ * chitcpd_demux_key_init - Build a demultiplexing key
+ *
+ * key: Key to initialize
+ *
+ * local_addr: Local address and port
+ *
+ * remote_addr: Remote address and port. If NULL, the key will
+ *              only contain the family and the local port (this
+ *              is the key used in the listener index)
+ *
+ * Returns: nothing.
+ *
+ */
+void chitcpd_demux_key_init(chisocket_demux_key_t *key, struct sockaddr *local_addr, struct sockaddr *remote_addr);
+
+
+/*
+ * chitcpd_index_socket - Add a socket to the demultiplexing indexes
+ *
+ * The socket is added to the listener index if its remote address is
+ * the ANY address, and to the connection index otherwise. If the socket
+ * was already indexed, it is first removed from its previous index, so
+ * this function must be called every time the addresses of a socket
+ * entry are modified.
+ *
+ * If a socket with the same key is already in the listener index, and
+ * both it and this socket set SO_REUSEPORT and have the same local
+ * address, this socket joins its group instead.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * Returns:
+ *   - CHITCP_OK: Socket indexed successfully
+ *   - CHITCP_ESOCKET: Another socket is already indexed with the same key
+ *
+ */
+int chitcpd_index_socket(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_unindex_socket - Remove a socket from the demultiplexing indexes
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_unindex_socket(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_lookup_socket - Find the socket a packet must be delivered to
+ *
+ * A socket matching the 4-tuple exactly is preferred over a connected
+ * socket with a wildcard local address, which in turn is preferred over
+ * a socket in the listener index. If that socket has a group
+ * (SO_REUSEPORT), a listening socket in the group is chosen based on
+ * a hash of the 4-tuple, so all the packets of a connection go to
+ * the same one.
+ *
+ * si: Server info
+ *
+ * local_addr, remote_addr: Addresses (including ports) of the packet
+ *
+ * exact_match_only: Only return a socket matching the 4-tuple exactly
+ *
+ * Returns: The matching socket entry, or NULL if there is none.
+ *
+ */
 chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only);
 
+/*
+ * chitcpd_poll_register - Register a poll waiter on a socket
+ *
+ * From now on, and until the registration is removed (or the socket
+ * is freed), the waiter is notified whenever the socket's state changes.
+ * The registration's states start out with the socket's current state.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * reg: Registration (owned by the caller)
+ *
+ * waiter: Poll waiter
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_poll_register(serverinfo_t *si, chisocketentry_t *entry, poll_registration_t *reg, poll_waiter_t *waiter);
+
+
+/*
+ * chitcpd_poll_unregister - Remove a poll waiter's registration on a socket
+ *
+ * si: Server info
+ *
+ * reg: Registration (see chitcpd_poll_register)
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_poll_unregister(serverinfo_t *si, poll_registration_t *reg);
+
+
+/*
+ * chitcpd_poll_notify - Notify the handlers polling a socket that its state has changed
+ *
+ * Must be called after any change that can make a socket ready to be read
+ * from, written to, or accepted on (or that closes it). It only takes
+ * a lock if someone is actually polling the socket.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_poll_notify(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_mem_charge - Charge a packet queued for a socket to the memory budgets
+ *
+ * The packet is charged to both the socket's budget and the daemon's
+ * (see mem_budget_charge), or to neither.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * n: Bytes to charge (see MEM_PACKET_COST)
+ *
+ * data: Does the packet have a payload?
+ *
+ * Returns: TRUE if the packet was charged, FALSE if either budget is full.
+ *
+ */
+bool_t chitcpd_mem_charge(serverinfo_t *si, chisocketentry_t *entry, size_t n, bool_t data);
+
+
+/*
+ * chitcpd_mem_uncharge - Return what chitcpd_mem_charge charged to the memory budgets
+ *
+ * si: Server info
+ *
+ * entry: Pointer to entry in socket table.
+ *
+ * n: Bytes to return
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_mem_uncharge(serverinfo_t *si, chisocketentry_t *entry, size_t n);
+
 void tcp_data_init(serverinfo_t *si, chisocketentry_t *entry);
 void tcp_data_free(serverinfo_t *si, chisocketentry_t *entry);
 
@@ -92,40 +92,117 @@
 #include "chitcp/utils.h"
 #include "chitcp/buffer.h"
 #include "chitcp/chitcpd.h"
+#include "chitcp/utlist.h"
 #include "serverinfo.h"
 #include "connection.h"
 #include "tcp.h"
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 void handle_PACKET_ARRIVAL(serverinfo_t *, chisocketentry_t *, tcp_state_t);
+int tcp_send_data(serverinfo_t *, chisocketentry_t *);
+int tcp_send_segment(serverinfo_t *, chisocketentry_t *, uint32_t, uint32_t);
+void tcp_retransmit(serverinfo_t *, chisocketentry_t *);
+void tcp_rtt_update(tcp_data_t *, uint64_t);
+void tcp_process_timestamp(tcp_data_t *, tcp_packet_t *, uint32_t, uint64_t);
+void tcp_congestion_ack(serverinfo_t *, chisocketentry_t *, uint32_t, bool_t);
+void tcp_send_ack(serverinfo_t *, chisocketentry_t *);
+void tcp_ack_data(serverinfo_t *, chisocketentry_t *, bool_t);
+void tcp_batch_end(serverinfo_t *, chisocketentry_t *, bool_t);
+uint32_t tcp_receive_data(tcp_data_t *, tcp_packet_t *, bool_t *);
+void tcp_ooo_insert(tcp_data_t *, uint32_t, uint8_t *, uint32_t);
+uint32_t tcp_ooo_flush(tcp_data_t *);
+void tcp_ooo_free(tcp_data_t *);
+void tcp_sack_add_blocks(tcp_data_t *, tcp_packet_t *);
+void tcp_sack_update(tcp_data_t *, tcp_packet_t *);
+uint32_t tcp_sack_pipe(tcp_data_t *);
+bool_t tcp_sack_next_hole(tcp_data_t *, uint32_t, uint32_t *, uint32_t *);
+int tcp_sack_retransmit(serverinfo_t *, chisocketentry_t *, bool_t);
+void tcp_sack_free(tcp_data_t *);
+void tcp_rtx_add(tcp_data_t *, uint32_t, uint32_t);
+void tcp_rtx_resent(tcp_data_t *, uint32_t, uint32_t);
+uint64_t tcp_rtx_ack(tcp_data_t *, uint32_t);
+void tcp_rtx_free(tcp_data_t *);
+uint64_t tcp_pacing_rate(tcp_data_t *);
+bool_t tcp_pacing_allow(tcp_data_t *, uint32_t);
+uint32_t tcp_rcv_window(serverinfo_t *, chisocketentry_t *, uint32_t);
+void tcp_window_update(serverinfo_t *, chisocketentry_t *);
+void tcp_persist_probe(serverinfo_t *, chisocketentry_t *);
+void tcp_persist_stop(tcp_data_t *);
 
 tcp_packet_t *ACK_PACKET(chisocketentry_t *, tcp_data_t *);
 tcp_packet_t *SYN_ACK_PACKET(chisocketentry_t *, tcp_data_t *);
 
+/* Timer callback: lets the TCP thread know that a timer has expired */
+void tcp_timeout_callback(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    tcp_timer_args_t *timer_args = (tcp_timer_args_t *) args;
+
+    chitcpd_timeout(timer_args->si, timer_args->entry, (tcp_timer_type_t) timer->id);
+}
+
 void tcp_data_init(serverinfo_t *si, chisocketentry_t *entry)
 {
     tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
 
-    tcp_data->pending_packets = NULL;
-    pthread_mutex_init(&tcp_data->lock_pending_packets, NULL);
-    pthread_cond_init(&tcp_data->cv_pending_packets, NULL);
+    chitcp_packet_queue_init(&tcp_data->pending_packets);
+    tcp_data->arrived_packets = NULL;
+    atomic_init(&tcp_data->pending_mem, 0);
+    tcp_data->buf_mem = 0;
+    tcp_data->batch_pending = FALSE;
+    tcp_data->batch_rcvd = 0;
+    tcp_data->ooo_queue = NULL;
+    tcp_data->ooo_bytes = 0;
+    tcp_data->ooo_recent = 0;
+    tcp_data->sack_scoreboard = NULL;
+    tcp_data->rtx_queue = NULL;
+    tcp_data->rtx_head = 0;
+    tcp_data->rtx_count = 0;
+    tcp_data->rtx_capacity = 0;
 
     /* Initialization of additional tcp_data_t fields,
      * and creation of retransmission thread, goes here */
+    tcp_data->timer_args.si = si;
+    tcp_data->timer_args.entry = entry;
+
+    mt_init_wheel(&tcp_data->mt, TCP_NUM_TIMERS, &si->timer_wheel);
+    mt_set_timer_name(&tcp_data->mt, RETRANSMISSION, "Retransmission");
+    mt_set_timer_name(&tcp_data->mt, PERSIST, "Persist");
+    mt_set_timer_name(&tcp_data->mt, DELAYED_ACK, "Delayed ACK");
+    mt_set_timer_name(&tcp_data->mt, PACING, "Pacing");
+
+    tcp_data->SRTT = 0;
+    tcp_data->RTTVAR = 0;
+    tcp_data->RTO = TCP_RTO_INITIAL;
+    tcp_data->rtt_sampled = FALSE;
+    tcp_data->persist_timeout = 0;
+
+    memset(&tcp_data->stats, 0, sizeof(tcp_stats_t));
 }
 
 void tcp_data_free(serverinfo_t *si, chisocketentry_t *entry)
 {
     tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packet, *tmp;
 
     circular_buffer_free(&tcp_data->send);
     circular_buffer_free(&tcp_data->recv);
-    chitcp_packet_list_destroy(&tcp_data->pending_packets);
-    pthread_mutex_destroy(&tcp_data->lock_pending_packets);
-    pthread_cond_destroy(&tcp_data->cv_pending_packets);
+    chitcp_packet_queue_destroy(&tcp_data->pending_packets);
+    LL_FOREACH_SAFE(tcp_data->arrived_packets, packet, tmp)
+    {
+        chitcp_tcp_packet_free(packet);
+        free(packet);
+    }
+    tcp_data->arrived_packets = NULL;
+    chitcpd_mem_uncharge(si, entry, atomic_load(&tcp_data->pending_mem));
+    mem_budget_uncharge(&si->mem, tcp_data->buf_mem);
 
     /* Cleanup of additional tcp_data_t fields goes here */
+    mt_free(&tcp_data->mt);
+    tcp_ooo_free(tcp_data);
+    tcp_sack_free(tcp_data);
+    tcp_rtx_free(tcp_data);
 }
 
 
@@ -139,22 +216,38 @@ int chitcpd_tcp_state_handle_CLOSED(serverinfo_t *si, chisocketentry_t *entry, t
         data->ISS     = rand() % 1000 + 1;
         data->SND_UNA = data->ISS;
         data->SND_NXT = data->ISS + 1;
+        circular_buffer_set_seq_initial(&data->send, data->ISS + 1);
         
         data->RCV_WND = circular_buffer_available(&data->recv);
-        
+
+        // with TCP Fast Open, if we have a cookie from the peer, the
+        // data queued by the connect goes in the SYN (up to one MSS)
+        uint8_t payload[TCP_MSS];
+        int nbytes = 0;
+
+        if (data->fastopen &&
+            chitcpd_fastopen_cookie_get(si, (struct sockaddr *) &entry->remote_addr, data->tfo_cookie)) {
+            data->tfo_cookie_len = TCP_FASTOPEN_COOKIE_LEN;
+            nbytes = MAX(circular_buffer_peek_at(&data->send, payload, data->ISS + 1, TCP_MSS), 0);
+        }
+
         tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
-        chitcpd_tcp_packet_create(entry, packet, NULL, 0);
+        chitcpd_tcp_packet_create(entry, packet, payload, nbytes);
         tcphdr_t *SYN = TCP_PACKET_HEADER(packet);
 
         SYN->seq     = chitcp_htonl(data->ISS);
         // SYN->ack_seq = chitcp_htonl(data->ISS + 1);
         SYN->syn     = 1;
-        SYN->win     = chitcp_htons(data->RCV_WND);
+        SYN->win     = chitcp_htons(TCP_ADVERTISED_WND(data, TRUE));
         
 
-        chilog_tcp(CRITICAL, packet, LOG_OUTBOUND);
         chitcpd_send_tcp_packet(si, entry, packet);
 
+        if (nbytes > 0) {
+            tcp_rtx_add(data, data->SND_NXT, nbytes);
+            data->SND_NXT += nbytes;
+        }
+
         chitcpd_update_tcp_state(si, entry, SYN_SENT);
         chitcp_tcp_packet_free(packet);
     }
@@ -187,6 +280,12 @@ int chitcpd_tcp_state_handle_SYN_RCVD(serverinfo_t *si, chisocketentry_t *entry,
     {
         handle_PACKET_ARRIVAL(si, entry, SYN_RCVD);
     }
+    else if (event == APPLICATION_SEND)
+    {
+        /* The application can only send before the handshake is
+         * complete if the peer's SYN carried Fast Open data */
+        tcp_send_data(si, entry);
+    }
     else if (event == TIMEOUT_RTX)
     {
         /* Your code goes here */
@@ -217,16 +316,15 @@ int chitcpd_tcp_state_handle_ESTABLISHED(serverinfo_t *si, chisocketentry_t *ent
 {
     if (event == APPLICATION_SEND)
     {
-        /* Your code goes here */
+        tcp_send_data(si, entry);
     }
     else if (event == PACKET_ARRIVAL)
     {
-        /* Your code goes here */
-
+        handle_PACKET_ARRIVAL(si, entry, ESTABLISHED);
     }
     else if (event == APPLICATION_RECEIVE)
     {
-        /* Your code goes here */
+        tcp_window_update(si, entry);
     }
     else if (event == APPLICATION_CLOSE)
     {
@@ -234,11 +332,15 @@ int chitcpd_tcp_state_handle_ESTABLISHED(serverinfo_t *si, chisocketentry_t *ent
     }
     else if (event == TIMEOUT_RTX)
     {
-      /* Your code goes here */
+        tcp_retransmit(si, entry);
     }
     else if (event == TIMEOUT_PST)
     {
-        /* Your code goes here */
+        tcp_persist_probe(si, entry);
+    }
+    else if (event == TIMEOUT_DACK)
+    {
+        tcp_send_ack(si, entry);
     }
     else
         chilog(WARNING, "In ESTABLISHED state, received unexpected event (%i).", event);
@@ -264,6 +366,10 @@ int chitcpd_tcp_state_handle_FIN_WAIT_1(serverinfo_t *si, chisocketentry_t *entr
     {
         /* Your code goes here */
     }
+    else if (event == TIMEOUT_DACK)
+    {
+        tcp_send_ack(si, entry);
+    }
     else
        chilog(WARNING, "In FIN_WAIT_1 state, received unexpected event (%i).", event);
 
@@ -285,6 +391,10 @@ int chitcpd_tcp_state_handle_FIN_WAIT_2(serverinfo_t *si, chisocketentry_t *entr
     {
       /* Your code goes here */
     }
+    else if (event == TIMEOUT_DACK)
+    {
+        tcp_send_ack(si, entry);
+    }
     else
         chilog(WARNING, "In FIN_WAIT_2 state, received unexpected event (%i).", event);
 
@@ -298,17 +408,25 @@ int chitcpd_tcp_state_handle_CLOSE_WAIT(serverinfo_t *si, chisocketentry_t *entr
     {
         /* Your code goes here */
     }
+    else if (event == APPLICATION_SEND)
+    {
+        tcp_send_data(si, entry);
+    }
     else if (event == PACKET_ARRIVAL)
     {
-        /* Your code goes here */
+        handle_PACKET_ARRIVAL(si, entry, CLOSE_WAIT);
     }
     else if (event == TIMEOUT_RTX)
     {
-      /* Your code goes here */
+        tcp_retransmit(si, entry);
     }
     else if (event == TIMEOUT_PST)
     {
-        /* Your code goes here */
+        tcp_persist_probe(si, entry);
+    }
+    else if (event == TIMEOUT_DACK)
+    {
+        tcp_send_ack(si, entry);
     }
     else
        chilog(WARNING, "In CLOSE_WAIT state, received unexpected event (%i).", event);
@@ -373,10 +491,10 @@ int chitcpd_tcp_state_handle_LAST_ACK(serverinfo_t *si, chisocketentry_t *entry,
 void handle_PACKET_ARRIVAL(serverinfo_t *si, chisocketentry_t *entry, tcp_state_t state) {
     tcp_data_t *data = &entry->socket_state.active.tcp_data;
 
-    pthread_mutex_lock(&data->lock_pending_packets);
-    tcp_packet_t *packet_rcvd = data->pending_packets->packet;
-    chitcp_packet_list_pop_head(&data->pending_packets);
-    pthread_mutex_unlock(&data->lock_pending_packets);
+    // the packets were taken off pending_packets by the TCP thread
+    tcp_packet_t *packet_rcvd = data->arrived_packets;
+    data->arrived_packets = packet_rcvd->next;
+    packet_rcvd->next = NULL;
 
     tcphdr_t *header = TCP_PACKET_HEADER(packet_rcvd);
 
@@ -387,19 +505,29 @@ void handle_PACKET_ARRIVAL(serverinfo_t *si, chisocketentry_t *entry, tcp_state_
             if (header->syn) {
                 data->RCV_NXT = SEG_SEQ(packet_rcvd) + 1;
                 data->IRS     = SEG_SEQ(packet_rcvd);
-                
+                circular_buffer_set_seq_initial(&data->recv, data->RCV_NXT);
+
+                // with a valid Fast Open cookie (see chitcpd_tcp_process_syn),
+                // the data in the SYN is accepted, and acknowledged by our SYN/ACK
+                if (data->tfo_accepted) {
+                    int nbytes = circular_buffer_write(&data->recv, TCP_PAYLOAD_START(packet_rcvd),
+                                                       TCP_PAYLOAD_LEN(packet_rcvd), FALSE);
+                    if (nbytes > 0)
+                        data->RCV_NXT += nbytes;
+                }
+
                 data->ISS     = rand() % 1000 + 1;
+                circular_buffer_set_seq_initial(&data->send, data->ISS + 1);
 
                 data->RCV_WND = circular_buffer_available(&data->recv);
 
                 tcp_packet_t *syn_ack_packet = SYN_ACK_PACKET(entry, data);
 
-                chilog_tcp(CRITICAL, syn_ack_packet, LOG_OUTBOUND);
                 chitcpd_send_tcp_packet(si, entry, syn_ack_packet);
 
                 data->SND_NXT = data->ISS + 1;
                 data->SND_UNA = data->ISS;
-                data->SND_WND = SEG_WND(packet_rcvd);
+                data->SND_WND = TCP_SEG_WND(data, packet_rcvd);
 
                 chitcpd_update_tcp_state(si, entry, SYN_RCVD);
                 chitcp_tcp_packet_free(syn_ack_packet);
@@ -426,26 +554,41 @@ void handle_PACKET_ARRIVAL(serverinfo_t *si, chisocketentry_t *entry, tcp_state_
 
                         data->RCV_NXT = SEG_SEQ(packet_rcvd) + 1;
                         data->IRS     = SEG_SEQ(packet_rcvd);
+                        circular_buffer_set_seq_initial(&data->recv, data->RCV_NXT);
+
+                        // the data in a Fast Open SYN is only kept if it was
+                        // acknowledged, and otherwise is sent again once we
+                        // are ESTABLISHED (the peer rejected our cookie)
+                        if (SEG_ACK(packet_rcvd) > data->ISS + 1) {
+                            circular_buffer_read(&data->send, NULL, SEG_ACK(packet_rcvd) - (data->ISS + 1), FALSE);
+                            tcp_rtx_ack(data, SEG_ACK(packet_rcvd));
+                        }
+                        if (SEG_ACK(packet_rcvd) != data->SND_NXT) {
+                            tcp_rtx_free(data);
+                            data->SND_NXT = SEG_ACK(packet_rcvd);
+                        }
+
                         data->SND_UNA = SEG_ACK(packet_rcvd);
-                        data->SND_WND = SEG_WND(packet_rcvd);
+                        data->SND_WND = TCP_SEG_WND(data, packet_rcvd);
 
                         if (data->SND_UNA > data->ISS) {
                             // our SYN has been ACKed, change the connection 
                             // state to ESTABLISHED, form an ACK segment
 
                             tcp_packet_t *ack_packet = ACK_PACKET(entry, data);
-                            chilog_tcp(CRITICAL, ack_packet, LOG_OUTBOUND);
                             chitcpd_send_tcp_packet(si, entry, ack_packet);
 
                             chitcpd_update_tcp_state(si, entry, ESTABLISHED);
                             chitcp_tcp_packet_free(ack_packet);
+
+                            /* Send anything written while connecting */
+                            tcp_send_data(si, entry);
                         } else {
                             // SYN has not been ACKed, retransmit SYN_ACK packet
                             // enter SYN-RECEIVED
 
                             tcp_packet_t *syn_ack_packet = SYN_ACK_PACKET(entry, data);
 
-                            chilog_tcp(CRITICAL, syn_ack_packet, LOG_OUTBOUND);
                             chitcpd_send_tcp_packet(si, entry, syn_ack_packet);
 
                             chitcpd_update_tcp_state(si, entry, SYN_RCVD);
@@ -471,19 +614,119 @@ void handle_PACKET_ARRIVAL(serverinfo_t *si, chisocketentry_t *entry, tcp_state_
                     data->SND_UNA <= SEG_ACK(packet_rcvd) &&
                     SEG_ACK(packet_rcvd) <= data->SND_NXT
                 ) {
-                    data->RCV_NXT = SEG_SEQ(packet_rcvd) + 1;
+                    // with Fast Open, we may have sent data before the
+                    // handshake was complete, and it may be ACKed too
+                    if (SEG_ACK(packet_rcvd) > data->ISS + 1) {
+                        circular_buffer_read(&data->send, NULL, SEG_ACK(packet_rcvd) - (data->ISS + 1), FALSE);
+                        tcp_rtx_ack(data, SEG_ACK(packet_rcvd));
+                    }
                     data->SND_UNA = SEG_ACK(packet_rcvd);
-                    data->SND_WND = SEG_WND(packet_rcvd);
+                    data->SND_WND = TCP_SEG_WND(data, packet_rcvd);
+                    if (data->tfo_accepted) {
+                        mt_cancel_timer(&data->mt, RETRANSMISSION);
+                        if (data->SND_UNA != data->SND_NXT)
+                            mt_set_timer(&data->mt, RETRANSMISSION, data->RTO, tcp_timeout_callback, &data->timer_args);
+                    }
 
                     chitcpd_update_tcp_state(si, entry, ESTABLISHED);
+                    tcp_send_data(si, entry);
                 }
             }
         }
         break;
+
+        case ESTABLISHED:
+        case CLOSE_WAIT: {
+            bool_t ack_now = FALSE, dupack = FALSE, wnd_opened = FALSE;
+            uint32_t rcvd = 0, acked = 0;
+            uint64_t sent = 0;
+
+            if (header->ack && SEQ_LEQ(data->SND_UNA, SEG_ACK(packet_rcvd)) &&
+                SEQ_LEQ(SEG_ACK(packet_rcvd), data->SND_NXT)) {
+                // acceptable ACK: drop the acknowledged bytes from the
+                // send buffer, and update the send window
+                acked = SEG_ACK(packet_rcvd) - data->SND_UNA;
+
+                // a duplicate ACK (as defined in RFC 5681) acknowledges
+                // nothing new, carries no data, and doesn't move the window
+                dupack = (acked == 0 && data->SND_UNA != data->SND_NXT &&
+                          TCP_PAYLOAD_LEN(packet_rcvd) == 0 && !header->syn && !header->fin &&
+                          TCP_SEG_WND(data, packet_rcvd) == data->SND_WND);
+
+                if (dupack)
+                    TCP_STATS_ADD(data, dup_acks, 1);
+                if (data->SND_WND > 0 && TCP_SEG_WND(data, packet_rcvd) == 0)
+                    TCP_STATS_ADD(data, zero_window, 1);
+                else if (data->SND_WND == 0 && TCP_SEG_WND(data, packet_rcvd) > 0)
+                    wnd_opened = TRUE;
+
+                if (acked > 0) {
+                    circular_buffer_read(&data->send, NULL, acked, FALSE);
+                    sent = tcp_rtx_ack(data, SEG_ACK(packet_rcvd));
+                }
+                data->SND_UNA = SEG_ACK(packet_rcvd);
+                data->SND_WND = TCP_SEG_WND(data, packet_rcvd);
+                tcp_sack_update(data, packet_rcvd);
+
+                // a window update doesn't necessarily change the buffers,
+                // so subscribers have to be told about it explicitly
+                if (wnd_opened) {
+                    chitcpd_poll_notify(si, entry);
+                    tcp_persist_stop(data);
+                }
+            }
+
+            // take an RTT sample, and then restart the retransmission
+            // timer (or stop it, if everything has been ACKed)
+            tcp_process_timestamp(data, packet_rcvd, acked, sent);
+            if (acked > 0) {
+                mt_cancel_timer(&data->mt, RETRANSMISSION);
+                if (data->SND_UNA != data->SND_NXT)
+                    mt_set_timer(&data->mt, RETRANSMISSION, data->RTO, tcp_timeout_callback, &data->timer_args);
+            }
+            if (acked > 0 || dupack)
+                tcp_congestion_ack(si, entry, acked, dupack);
+
+            if (state == ESTABLISHED && TCP_PAYLOAD_LEN(packet_rcvd) > 0) {
+                uint32_t edge = data->RCV_NXT + data->RCV_WND;
+
+                rcvd = tcp_receive_data(data, packet_rcvd, &ack_now);
+                data->RCV_UNACKED += rcvd;
+                data->RCV_WND = tcp_rcv_window(si, entry, edge);
+            }
+
+            // the window may have opened, and data may need to be ACKed,
+            // but that can wait until the end of the batch, unless the
+            // ACK must be sent right away (e.g., a duplicate ACK)
+            data->batch_pending = TRUE;
+            data->batch_rcvd += rcvd;
+            if (ack_now)
+                tcp_batch_end(si, entry, TRUE);
+        }
+        break;
     }
 
     // free packet_rcvd
     chitcp_tcp_packet_free(packet_rcvd);
+
+    if (data->arrived_packets == NULL && data->batch_pending)
+        tcp_batch_end(si, entry, FALSE);
+}
+
+/*
+ * Makes the decision that was put off while handling a batch of
+ * arrived packets: send whatever now fits in the window (the ACK for
+ * any data we received is piggybacked onto it), or else ACK the data
+ * we received (right away if "ack_now" is set, or as a delayed ACK).
+ */
+void tcp_batch_end(serverinfo_t *si, chisocketentry_t *entry, bool_t ack_now) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+
+    if (tcp_send_data(si, entry) == 0 && (ack_now || data->batch_rcvd > 0))
+        tcp_ack_data(si, entry, ack_now);
+
+    data->batch_pending = FALSE;
+    data->batch_rcvd = 0;
 }
 
 tcp_packet_t *ACK_PACKET(chisocketentry_t *entry, tcp_data_t *data) {
@@ -494,7 +737,8 @@ tcp_packet_t *ACK_PACKET(chisocketentry_t *entry, tcp_data_t *data) {
     SYN_ACK->ack     = 1;
     SYN_ACK->seq     = htonl(data->SND_NXT);
     SYN_ACK->ack_seq = htonl(data->RCV_NXT);
-    SYN_ACK->win     = htons(data->RCV_WND);
+    SYN_ACK->win     = htons(TCP_ADVERTISED_WND(data, FALSE));
+    tcp_sack_add_blocks(data, packet);
     
     return packet;
 }
@@ -508,7 +752,982 @@ tcp_packet_t *SYN_ACK_PACKET(chisocketentry_t *entry, tcp_data_t *data) {
     SYN_ACK->ack     = 1;
     SYN_ACK->seq     = htonl(data->ISS);
     SYN_ACK->ack_seq = htonl(data->RCV_NXT);
-    SYN_ACK->win     = htons(data->RCV_WND);
+    SYN_ACK->win     = htons(TCP_ADVERTISED_WND(data, TRUE));
     
     return packet;
 }
+
+/*
+ * Sends as much of the unsent data in the send buffer as the send
+ * window and the congestion window allow, in segments of at most TCP_MSS bytes. Data is sent
+ * starting at SND.NXT, so the bytes between SND.UNA and SND.NXT
+ * (sent but not yet acknowledged) stay in the buffer until they're ACKed.
+ *
+ * Returns the number of segments sent.
+ */
+int tcp_send_data(serverinfo_t *si, chisocketentry_t *entry) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    int nsegs = 0;
+
+    // in SYN_RCVD (with Fast Open), our SYN is in flight too, but it
+    // isn't in the send buffer, and Nagle's algorithm doesn't hold
+    // data back for it
+    uint32_t syn = (entry->tcp_state == SYN_RCVD) ? 1 : 0;
+
+    for (;;) {
+        uint32_t in_flight = data->SND_NXT - data->SND_UNA;
+        uint32_t unsent    = circular_buffer_count(&data->send) - (in_flight - syn);
+        uint32_t cwnd      = data->cc->cwnd(data);
+        uint32_t usable    = data->SND_WND > in_flight ? data->SND_WND - in_flight : 0;
+        uint32_t len;
+
+        // the congestion window limits the data in the network, which
+        // (during SACK recovery) doesn't include the SACKed or lost data
+        uint32_t pipe = (data->sack_enabled && data->ca_state == TCP_CA_RECOVERY) ? tcp_sack_pipe(data) : in_flight;
+        usable = MIN(usable, cwnd > pipe ? cwnd - pipe : 0);
+        len = MIN(MIN(unsent, usable), TCP_MSS);
+
+        if (len == 0)
+            break;
+
+        // Nagle's algorithm: while there is unacknowledged data, hold
+        // back small segments until an ACK arrives or a full one can be sent
+        if (len < TCP_MSS && in_flight > syn && !data->nodelay)
+            break;
+
+        // pacing: hold the segment back until the token bucket has
+        // room for it (the pacing timer raises APPLICATION_SEND then)
+        if (!tcp_pacing_allow(data, len))
+            break;
+
+        int nbytes = tcp_send_segment(si, entry, data->SND_NXT, len);
+        if (nbytes <= 0)
+            break;
+
+        if (data->pacing_rate != 0)
+            data->pacing_credit -= MIN((uint64_t) nbytes * SECOND, data->pacing_credit);
+
+        tcp_rtx_add(data, data->SND_NXT, nbytes);
+        data->SND_NXT += nbytes;
+        nsegs++;
+    }
+
+    if (nsegs > 0) {
+        // if the retransmission timer is already running, it keeps
+        // running (RFC 6298, section 5.1)
+        mt_set_timer(&data->mt, RETRANSMISSION, data->RTO, tcp_timeout_callback, &data->timer_args);
+    }
+
+    // with the peer's window closed and nothing in flight, no ACK will
+    // tell us when it opens, unless we probe it (the persist timer
+    // keeps its interval if it is already running)
+    if (data->SND_WND == 0 && data->SND_NXT == data->SND_UNA && circular_buffer_count(&data->send) > 0) {
+        if (data->persist_timeout == 0)
+            data->persist_timeout = data->RTO;
+        mt_set_timer(&data->mt, PERSIST, data->persist_timeout, tcp_timeout_callback, &data->timer_args);
+    }
+
+    return nsegs;
+}
+
+/*
+ * Handles a persist timeout: while the peer's window is closed, a
+ * window probe (the first byte that doesn't fit in it) is sent, so the
+ * peer's ACK tells us when the window opens, even if the window update
+ * it sent was lost (RFC 9293, section 3.8.6.1). The probe byte counts
+ * as sent (if the window has opened, the peer keeps it), but it only
+ * is resent by the next probe. The persist timer is then restarted with
+ * twice the interval, up to TCP_RTO_MAX, as in BSD.
+ */
+void tcp_persist_probe(serverinfo_t *si, chisocketentry_t *entry) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+
+    if (data->SND_WND > 0 || circular_buffer_count(&data->send) == 0) {
+        tcp_persist_stop(data);
+        tcp_send_data(si, entry);
+        return;
+    }
+
+    if (tcp_send_segment(si, entry, data->SND_UNA, 1) == 1 && data->SND_NXT == data->SND_UNA) {
+        tcp_rtx_add(data, data->SND_NXT, 1);
+        data->SND_NXT++;
+    }
+
+    data->persist_timeout = MIN(MAX(data->persist_timeout, data->RTO) * 2, TCP_RTO_MAX);
+    mt_set_timer(&data->mt, PERSIST, data->persist_timeout, tcp_timeout_callback, &data->timer_args);
+}
+
+/*
+ * Stops probing once the peer's window has opened. A probe byte that
+ * the peer didn't keep is now up to the retransmission timer.
+ */
+void tcp_persist_stop(tcp_data_t *data) {
+    mt_cancel_timer(&data->mt, PERSIST);
+    data->persist_timeout = 0;
+
+    if (data->SND_UNA != data->SND_NXT)
+        mt_set_timer(&data->mt, RETRANSMISSION, data->RTO, tcp_timeout_callback, &data->timer_args);
+}
+
+/*
+ * Returns the socket's pacing rate, in bytes per second (or zero if it
+ * isn't being paced): either the rate set with SO_MAX_PACING_RATE, or
+ * one derived from cwnd and SRTT (see TCP_PACING_GAIN_SS).
+ */
+uint64_t tcp_pacing_rate(tcp_data_t *data) {
+    uint64_t cwnd;
+
+    if (data->pacing_rate != (uint32_t) CHITCP_PACING_AUTO)
+        return data->pacing_rate;
+    if (data->SRTT == 0)
+        return 0;
+
+    cwnd = data->cc->cwnd(data);
+    cwnd = cwnd * (cwnd < data->ssthresh ? TCP_PACING_GAIN_SS : TCP_PACING_GAIN_CA) / 100;
+
+    return MIN(MAX(cwnd * SECOND / data->SRTT, 1), UINT32_MAX);
+}
+
+/*
+ * Refills the pacing token bucket, and checks whether it can release a
+ * segment with "len" bytes of data. If it can't, the pacing timer is
+ * set to expire when it can (unless it is already running).
+ */
+bool_t tcp_pacing_allow(tcp_data_t *data, uint32_t len) {
+    uint64_t rate = tcp_pacing_rate(data);
+    uint64_t now, elapsed, burst, needed;
+
+    if (rate == 0)
+        return TRUE;
+
+    // the bucket's size (in bytes times SECOND, like the credit)
+    burst = MAX(rate * TCP_PACING_BURST_TIME / SECOND, TCP_PACING_BURST_MIN) * SECOND;
+
+    now = tcp_now();
+    elapsed = MIN(now - data->pacing_stamp, SECOND);
+    data->pacing_credit = MIN(data->pacing_credit + rate * elapsed, burst);
+    data->pacing_stamp = now;
+
+    needed = (uint64_t) len * SECOND;
+    if (data->pacing_credit >= needed || data->pacing_credit == burst)
+        return TRUE;
+
+    mt_set_timer(&data->mt, PACING, (needed - data->pacing_credit + rate - 1) / rate,
+                 tcp_timeout_callback, &data->timer_args);
+
+    return FALSE;
+}
+
+/*
+ * Sends a segment with the data in the send buffer starting at "seq"
+ * (at most "len" bytes), acknowledging everything we have received.
+ *
+ * Returns the number of bytes of data sent.
+ */
+int tcp_send_segment(serverinfo_t *si, chisocketentry_t *entry, uint32_t seq, uint32_t len) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    uint8_t payload[TCP_MSS];
+
+    int nbytes = circular_buffer_peek_at(&data->send, payload, seq, MIN(len, TCP_MSS));
+    if (nbytes <= 0)
+        return 0;
+
+    tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
+    chitcpd_tcp_packet_create(entry, packet, payload, nbytes);
+    tcphdr_t *header = TCP_PACKET_HEADER(packet);
+
+    header->ack     = 1;
+    header->seq     = chitcp_htonl(seq);
+    header->ack_seq = chitcp_htonl(data->RCV_NXT);
+    header->win     = chitcp_htons(TCP_ADVERTISED_WND(data, FALSE));
+    tcp_sack_add_blocks(data, packet);
+
+    chilog_tcp(TRACE, packet, LOG_OUTBOUND);
+    chitcpd_send_tcp_packet(si, entry, packet);
+    chitcp_tcp_packet_free(packet);
+    free(packet);
+
+    // anything before SND.NXT has been sent before
+    if (SEQ_LT(seq, data->SND_NXT)) {
+        TCP_STATS_ADD(data, retransmits, 1);
+        tcp_rtx_resent(data, seq, nbytes);
+    }
+
+    // the segment acknowledged everything we've received
+    if (data->RCV_UNACKED > 0) {
+        data->RCV_UNACKED = 0;
+        mt_cancel_timer(&data->mt, DELAYED_ACK);
+    }
+
+    return nbytes;
+}
+
+/*
+ * Handles a retransmission timeout: the first unacknowledged segment
+ * is sent again, and the retransmission timer is restarted with twice
+ * the RTO (RFC 6298, section 5.5). With no timestamps, we stop timing
+ * the segment we were timing, since its ACK could be for either copy
+ * (Karn's algorithm).
+ *
+ * The congestion control algorithm shrinks cwnd (only on the first
+ * timeout, if there are several in a row), and the sender enters the
+ * LOSS state until everything that was outstanding has been ACKed.
+ * The SACK scoreboard is cleared, since the peer may have discarded
+ * the data it SACKed (RFC 2018, section 8).
+ */
+void tcp_retransmit(serverinfo_t *si, chisocketentry_t *entry) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+
+    if (data->SND_UNA == data->SND_NXT)
+        return;
+
+    data->RTO = MIN(data->RTO * 2, TCP_RTO_MAX);
+
+    if (data->ca_state != TCP_CA_LOSS)
+        data->cc->on_rto(data);
+    data->cwnd = MIN(data->cwnd, TCP_MSS);
+    data->ca_state = TCP_CA_LOSS;
+    data->recover = data->SND_NXT;
+    data->dupacks = 0;
+    tcp_sack_free(data);
+
+    tcp_send_segment(si, entry, data->SND_UNA, data->SND_NXT - data->SND_UNA);
+
+    mt_set_timer(&data->mt, RETRANSMISSION, data->RTO, tcp_timeout_callback, &data->timer_args);
+}
+
+/*
+ * Updates SRTT, RTTVAR and RTO with a new RTT measurement, in
+ * nanoseconds (RFC 6298, sections 2.2 and 2.3). This also undoes any
+ * backoff of the RTO (RFC 6298, section 5.7).
+ */
+void tcp_rtt_update(tcp_data_t *data, uint64_t rtt) {
+    if (!data->rtt_sampled) {
+        data->SRTT = rtt;
+        data->RTTVAR = rtt / 2;
+        data->rtt_sampled = TRUE;
+    } else {
+        uint64_t delta = data->SRTT > rtt ? data->SRTT - rtt : rtt - data->SRTT;
+
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        data->RTTVAR = (3 * data->RTTVAR + delta) / 4;
+        data->SRTT = (7 * data->SRTT + rtt) / 8;
+    }
+
+    data->RTO = data->SRTT + MAX(TCP_CLOCK_GRANULARITY, 4 * data->RTTVAR);
+    data->RTO = MIN(MAX(data->RTO, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/*
+ * Processes the timestamps option of a segment received in a
+ * synchronized state (if timestamps are in use), and takes an RTT
+ * sample if the segment acknowledged "acked" new bytes.
+ *
+ * As in RFC 7323, TS.Recent is only updated by segments that don't
+ * start after RCV.NXT (which is our Last.ACK.sent, unless we're
+ * delaying an ACK), so the TSval we echo is from the segment that
+ * prompted the ACK. With timestamps, every ACK of new data gives
+ * an RTT sample, even for retransmitted segments. Otherwise, "sent" is
+ * when the newest segment the ACK covers was sent, if it can be
+ * timed (see tcp_rtx_ack), or 0.
+ */
+void tcp_process_timestamp(tcp_data_t *data, tcp_packet_t *packet, uint32_t acked, uint64_t sent) {
+    uint32_t tsval, tsecr;
+
+    if (data->ts_enabled) {
+        if (chitcp_tcp_packet_get_timestamp(packet, &tsval, &tsecr) != CHITCP_OK)
+            return;
+
+        if (SEQ_GEQ(tsval, data->TS_RECENT) && SEQ_LEQ(SEG_SEQ(packet), data->RCV_NXT))
+            data->TS_RECENT = tsval;
+
+        if (acked > 0 && tsecr != 0)
+            tcp_rtt_update(data, (uint64_t) (TCP_TS_NOW() - tsecr) * TCP_CLOCK_GRANULARITY);
+    }
+    else if (acked > 0 && sent != 0) {
+        tcp_rtt_update(data, tcp_now() - sent);
+    }
+}
+
+/*
+ * Builds the header of the connection's pure ACKs: the ports, the ACK
+ * flag and (if timestamps are in use) a timestamps option, laid out like
+ * chitcpd_send_tcp_packet would add it. Only done once the connection is
+ * synchronized, when the options can no longer change.
+ */
+static void tcp_ack_template_init(chisocketentry_t *entry, tcp_data_t *data) {
+    tcp_packet_t packet;
+
+    chitcpd_tcp_packet_create(entry, &packet, NULL, 0);
+    TCP_PACKET_HEADER(&packet)->ack = 1;
+    if (data->ts_enabled && chitcp_tcp_packet_add_timestamp(&packet, 0, 0) != CHITCP_OK)
+        chilog(WARNING, "Could not add timestamps option to ACK template");
+
+    assert(packet.length <= TCP_ACK_TEMPLATE_LEN);
+    memcpy(data->ack_template, packet.raw, packet.length);
+    data->ack_template_len = packet.length;
+    chitcp_tcp_packet_free(&packet);
+}
+
+/*
+ * Sends an ACK for the data we have received but not acknowledged yet
+ * (if any), and cancels the delayed ACK timer.
+ */
+void tcp_send_ack(serverinfo_t *si, chisocketentry_t *entry) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+
+    mt_cancel_timer(&data->mt, DELAYED_ACK);
+    data->RCV_UNACKED = 0;
+
+    /* Fast path: once the connection is synchronized, a pure ACK is the
+     * socket's ACK template with its sequence numbers, window and
+     * timestamps patched in (ACKs with SACK blocks are built from scratch) */
+    if (entry->tcp_state >= ESTABLISHED && !(data->sack_enabled && data->ooo_queue != NULL)) {
+        tcp_packet_t packet = {0};
+        tcphdr_t *header;
+
+        if (data->ack_template_len == 0)
+            tcp_ack_template_init(entry, data);
+
+        packet.length = data->ack_template_len;
+        packet.raw = chitcp_packet_buf_alloc(packet.length);
+        memcpy(packet.raw, data->ack_template, packet.length);
+
+        header = TCP_PACKET_HEADER(&packet);
+        header->seq     = htonl(data->SND_NXT);
+        header->ack_seq = htonl(data->RCV_NXT);
+        header->win     = htons(TCP_ADVERTISED_WND(data, FALSE));
+        if (packet.length > TCP_HEADER_NOOPTIONS_SIZE) {
+            uint32_t tsval = htonl(TCP_TS_NOW()), tsecr = htonl(data->TS_RECENT);
+
+            memcpy(packet.raw + TCP_HEADER_NOOPTIONS_SIZE + 4, &tsval, sizeof(uint32_t));
+            memcpy(packet.raw + TCP_HEADER_NOOPTIONS_SIZE + 8, &tsecr, sizeof(uint32_t));
+        }
+
+        chilog_tcp(TRACE, &packet, LOG_OUTBOUND);
+        chitcpd_send_prepared_tcp_packet(si, entry, &packet);
+        chitcp_tcp_packet_free(&packet);
+        return;
+    }
+
+    tcp_packet_t *ack_packet = ACK_PACKET(entry, data);
+    chilog_tcp(TRACE, ack_packet, LOG_OUTBOUND);
+    chitcpd_send_tcp_packet(si, entry, ack_packet);
+    chitcp_tcp_packet_free(ack_packet);
+    free(ack_packet);
+}
+
+/*
+ * Acknowledges received data that couldn't be piggybacked onto a data
+ * segment. Unless ack_now or TCP_QUICKACK is set, the ACK is delayed
+ * until there are TCP_DELAYED_ACK_BYTES unacknowledged bytes, or until
+ * the delayed ACK timer expires (if new data or a data segment arrives
+ * before then, it will carry the ACK instead).
+ */
+void tcp_ack_data(serverinfo_t *si, chisocketentry_t *entry, bool_t ack_now) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+
+    if (ack_now || data->quickack || data->RCV_UNACKED >= TCP_DELAYED_ACK_BYTES) {
+        tcp_send_ack(si, entry);
+        return;
+    }
+
+    // if the timer is already running, the ACK is sent when it expires
+    mt_set_timer(&data->mt, DELAYED_ACK, TCP_DELAYED_ACK_TIMEOUT, tcp_timeout_callback, &data->timer_args);
+}
+
+/*
+ * Returns the receive window to advertise: the space in the receive
+ * buffer. Under memory pressure (of the daemon, or of the socket's
+ * queues), the window isn't opened past the right edge that was
+ * already advertised (edge), or TCP_MEM_PRESSURE_WND bytes, whichever
+ * is further, so the sender slows down before its segments have to be
+ * dropped. The window is never shrunk (its right edge never moves
+ * back), as per RFC 9293.
+ */
+uint32_t tcp_rcv_window(serverinfo_t *si, chisocketentry_t *entry, uint32_t edge) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    uint32_t wnd = circular_buffer_available(&data->recv);
+    uint32_t promised = SEQ_GT(edge, data->RCV_NXT) ? edge - data->RCV_NXT : 0;
+
+    if (mem_budget_pressure(&si->mem) || mem_budget_pressure(&entry->mem))
+        wnd = MIN(wnd, MAX(promised, TCP_MEM_PRESSURE_WND));
+
+    // receiver-side SWS avoidance (RFC 1122, section 4.2.3.3): the right
+    // edge only moves forward once it can move by a full segment, or
+    // by half the buffer if that is smaller
+    if (wnd > promised && wnd - promised < MIN(TCP_MSS, circular_buffer_capacity(&data->recv) / 2))
+        wnd = promised;
+
+    return wnd;
+}
+
+/*
+ * Handles the application reading from the receive buffer. The window
+ * opens as tcp_rcv_window allows, and the window update goes out with
+ * the next ACK: right away if the window was too small for the peer
+ * to send anything, or else as a delayed ACK, so a series of reads
+ * only sends one update.
+ */
+void tcp_window_update(serverinfo_t *si, chisocketentry_t *entry) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    uint32_t old = data->RCV_WND;
+
+    data->RCV_WND = tcp_rcv_window(si, entry, data->RCV_NXT + data->RCV_WND);
+
+    if (data->RCV_WND > old)
+        tcp_ack_data(si, entry, old < MIN(TCP_MSS, circular_buffer_capacity(&data->recv) / 2));
+}
+
+/*
+ * Processes the payload of a segment received in a synchronized state.
+ * Data starting at RCV.NXT (possibly after some bytes we already have)
+ * goes into the receive buffer, followed by any data from the
+ * out-of-order queue that it makes contiguous. Data after a gap is
+ * added to the out-of-order queue, if it is inside the receive window.
+ *
+ * Sets *ack_now if the segment should be ACKed right away: as per
+ * RFC 5681, when it is out of order or fills (part of) a gap, and also
+ * when it couldn't be stored.
+ *
+ * Returns the number of bytes written to the receive buffer.
+ */
+uint32_t tcp_receive_data(tcp_data_t *data, tcp_packet_t *packet, bool_t *ack_now) {
+    uint32_t seq = SEG_SEQ(packet);
+    uint32_t len = TCP_PAYLOAD_LEN(packet);
+    uint8_t *payload = TCP_PAYLOAD_START(packet);
+    uint32_t rcvd = 0;
+
+    // drop the part of the segment we have already received
+    if (SEQ_LT(seq, data->RCV_NXT)) {
+        uint32_t dup = data->RCV_NXT - seq;
+
+        if (dup >= len) {
+            *ack_now = TRUE;
+            return 0;
+        }
+        seq += dup;
+        payload += dup;
+        len -= dup;
+    }
+
+    // and the part that is outside the window
+    if (SEQ_GEQ(seq, data->RCV_NXT + data->RCV_WND)) {
+        *ack_now = TRUE;
+        return 0;
+    }
+    len = MIN(len, data->RCV_NXT + data->RCV_WND - seq);
+
+    if (seq != data->RCV_NXT) {
+        TCP_STATS_ADD(data, out_of_order, 1);
+        tcp_ooo_insert(data, seq, payload, len);
+        *ack_now = TRUE;
+        return 0;
+    }
+
+    int nbytes = circular_buffer_write(&data->recv, payload, len, FALSE);
+    if (nbytes > 0) {
+        data->RCV_NXT += nbytes;
+        rcvd = nbytes;
+    }
+    if (rcvd < TCP_PAYLOAD_LEN(packet))
+        *ack_now = TRUE;
+
+    if (data->ooo_queue != NULL) {
+        rcvd += tcp_ooo_flush(data);
+        *ack_now = TRUE;
+    }
+
+    data->RCV_WND = circular_buffer_available(&data->recv);
+
+    return rcvd;
+}
+
+/*
+ * Adds data received after a gap to the out-of-order queue, merging it
+ * with every range it overlaps or is adjacent to.
+ */
+void tcp_ooo_insert(tcp_data_t *data, uint32_t seq, uint8_t *payload, uint32_t len) {
+    tcp_ooo_segment_t *seg, *tmp, *after = NULL;
+    uint32_t start = seq, end = seq + len;
+    uint8_t *buf;
+
+    // find the ranges that will be merged (the queue is sorted, so they
+    // are consecutive, and merging one can only extend the range forward)
+    DL_FOREACH(data->ooo_queue, seg) {
+        if (SEQ_GT(seg->seq, end))
+            break;
+        if (SEQ_LT(seg->seq + seg->len, start))
+            continue;
+        if (SEQ_LT(seg->seq, start))
+            start = seg->seq;
+        if (SEQ_GT(seg->seq + seg->len, end))
+            end = seg->seq + seg->len;
+    }
+
+    if ((buf = malloc(end - start)) == NULL) {
+        chilog(WARNING, "Could not allocate memory for out-of-order data. Dropping it.");
+        return;
+    }
+
+    DL_FOREACH_SAFE(data->ooo_queue, seg, tmp) {
+        if (SEQ_LT(seg->seq, start))
+            continue;
+        if (SEQ_GEQ(seg->seq, end)) {
+            after = seg;
+            break;
+        }
+        memcpy(buf + (seg->seq - start), seg->data, seg->len);
+        DL_DELETE(data->ooo_queue, seg);
+        data->ooo_bytes -= seg->len;
+        free(seg->data);
+        free(seg);
+    }
+    memcpy(buf + (seq - start), payload, len);
+    data->ooo_recent = seq;
+
+    if ((seg = malloc(sizeof(tcp_ooo_segment_t))) == NULL) {
+        chilog(WARNING, "Could not allocate memory for out-of-order data. Dropping it.");
+        free(buf);
+        return;
+    }
+    seg->seq = start;
+    seg->len = end - start;
+    seg->data = buf;
+    data->ooo_bytes += seg->len;
+
+    if (after != NULL)
+        DL_PREPEND_ELEM(data->ooo_queue, after, seg);
+    else
+        DL_APPEND(data->ooo_queue, seg);
+}
+
+/*
+ * Moves the data at the head of the out-of-order queue that has become
+ * contiguous with RCV.NXT into the receive buffer (with a single write,
+ * since that data is always a single range), and drops anything that
+ * is now before RCV.NXT.
+ *
+ * Returns the number of bytes written to the receive buffer.
+ */
+uint32_t tcp_ooo_flush(tcp_data_t *data) {
+    tcp_ooo_segment_t *seg, *tmp;
+    uint32_t rcvd = 0;
+
+    DL_FOREACH_SAFE(data->ooo_queue, seg, tmp) {
+        if (SEQ_GT(seg->seq, data->RCV_NXT))
+            break;
+
+        uint32_t skip = data->RCV_NXT - seg->seq;
+        if (skip < seg->len) {
+            int nbytes = circular_buffer_write(&data->recv, seg->data + skip, seg->len - skip, FALSE);
+            if (nbytes > 0) {
+                data->RCV_NXT += nbytes;
+                rcvd += nbytes;
+            }
+        }
+
+        // anything that didn't fit in the buffer is dropped (it was
+        // inside the window, so this only happens if the window shrank)
+        DL_DELETE(data->ooo_queue, seg);
+        data->ooo_bytes -= seg->len;
+        free(seg->data);
+        free(seg);
+    }
+
+    return rcvd;
+}
+
+/* Frees the out-of-order queue */
+void tcp_ooo_free(tcp_data_t *data) {
+    tcp_ooo_segment_t *seg, *tmp;
+
+    DL_FOREACH_SAFE(data->ooo_queue, seg, tmp) {
+        DL_DELETE(data->ooo_queue, seg);
+        free(seg->data);
+        free(seg);
+    }
+    data->ooo_bytes = 0;
+}
+
+/*
+ * Updates the congestion state on an ACK of "acked" new bytes, or on a
+ * duplicate ACK, and does fast retransmit and fast recovery as in
+ * NewReno (RFC 6582):
+ *
+ *  - On the third duplicate ACK, the first unacknowledged segment is
+ *    retransmitted, and cwnd is set to ssthresh (as reduced by the
+ *    congestion control algorithm) plus the three segments that have
+ *    left the network. Every further duplicate ACK inflates cwnd by
+ *    one segment, so new data can keep flowing.
+ *
+ *  - An ACK that doesn't cover everything that was outstanding when
+ *    recovery started (a partial ACK) means that the next segment was
+ *    lost too, so it is retransmitted right away, without waiting for
+ *    three more duplicate ACKs. After a timeout (the LOSS state), partial
+ *    ACKs are handled the same way, so holes are repaired once per RTT.
+ *
+ *  - The ACK that covers it ends recovery and deflates cwnd to ssthresh.
+ *
+ * With SACK, recovery follows RFC 6675 instead: cwnd is not inflated,
+ * and every ACK during recovery retransmits the holes in the scoreboard
+ * (and then new data) while the data in the network fits in cwnd.
+ */
+void tcp_congestion_ack(serverinfo_t *si, chisocketentry_t *entry, uint32_t acked, bool_t dupack) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    uint32_t flight = data->SND_NXT - data->SND_UNA;
+
+    if (dupack) {
+        data->dupacks++;
+
+        if (data->ca_state == TCP_CA_RECOVERY) {
+            if (data->sack_enabled)
+                tcp_sack_retransmit(si, entry, FALSE);
+            else
+                data->cwnd = MIN(data->cwnd + TCP_MSS, TCP_CWND_MAX);
+        } else if (data->ca_state == TCP_CA_OPEN && data->dupacks == 3) {
+            data->cc->on_loss(data);
+            data->ca_state = TCP_CA_RECOVERY;
+            data->recover = data->SND_NXT;
+
+            if (data->sack_enabled) {
+                data->cwnd = data->ssthresh;
+                data->sack_high_rxt = data->SND_UNA;
+                tcp_sack_retransmit(si, entry, TRUE);
+            } else {
+                tcp_send_segment(si, entry, data->SND_UNA, flight);
+                data->cwnd = data->ssthresh + 3 * TCP_MSS;
+            }
+        }
+        return;
+    }
+
+    data->dupacks = 0;
+
+    switch (data->ca_state) {
+        case TCP_CA_OPEN:
+            data->cc->on_ack(data, acked);
+            break;
+
+        case TCP_CA_RECOVERY:
+            if (SEQ_GEQ(data->SND_UNA, data->recover)) {
+                // full ACK
+                data->cwnd = MIN(data->ssthresh, MAX(flight, TCP_MSS) + TCP_MSS);
+                data->ca_state = TCP_CA_OPEN;
+            } else if (data->sack_enabled) {
+                tcp_sack_retransmit(si, entry, FALSE);
+            } else {
+                // partial ACK: deflate cwnd by the amount of new data
+                // acknowledged, and add back one segment
+                tcp_send_segment(si, entry, data->SND_UNA, flight);
+                data->cwnd -= MIN(acked, data->cwnd - TCP_MSS);
+                if (acked >= TCP_MSS)
+                    data->cwnd += TCP_MSS;
+            }
+            break;
+
+        case TCP_CA_LOSS:
+            data->cc->on_ack(data, acked);
+            if (SEQ_GEQ(data->SND_UNA, data->recover))
+                data->ca_state = TCP_CA_OPEN;
+            else
+                tcp_send_segment(si, entry, data->SND_UNA, flight);
+            break;
+    }
+}
+
+/*
+ * Adds a SACK option to a segment we are sending, if there is data in
+ * the out-of-order queue. The first block is the one with the segment
+ * that arrived last, as required by RFC 2018, followed by the others
+ * in sequence order (for as many as fit in the header).
+ */
+void tcp_sack_add_blocks(tcp_data_t *data, tcp_packet_t *packet) {
+    tcp_sack_block_t blocks[TCP_SACK_MAX_BLOCKS];
+    tcp_ooo_segment_t *seg, *recent = NULL;
+    int max = data->ts_enabled ? TCP_SACK_MAX_BLOCKS - 1 : TCP_SACK_MAX_BLOCKS;
+    int nblocks = 0;
+
+    if (!data->sack_enabled || data->ooo_queue == NULL)
+        return;
+
+    DL_FOREACH(data->ooo_queue, seg) {
+        if (SEQ_LEQ(seg->seq, data->ooo_recent) && SEQ_LT(data->ooo_recent, seg->seq + seg->len)) {
+            recent = seg;
+            blocks[nblocks].left = seg->seq;
+            blocks[nblocks].right = seg->seq + seg->len;
+            nblocks++;
+            break;
+        }
+    }
+
+    DL_FOREACH(data->ooo_queue, seg) {
+        if (nblocks == max)
+            break;
+        if (seg == recent)
+            continue;
+        blocks[nblocks].left = seg->seq;
+        blocks[nblocks].right = seg->seq + seg->len;
+        nblocks++;
+    }
+
+    if (chitcp_tcp_packet_add_sack(packet, blocks, nblocks) < 0)
+        chilog(WARNING, "Could not add SACK option to segment");
+}
+
+/*
+ * Adds the blocks in the SACK option of an ACK to the scoreboard, and
+ * drops whatever has been cumulatively acknowledged from it. Blocks that
+ * don't fall between SND.UNA and SND.NXT (including D-SACK blocks, as
+ * in RFC 2883) are ignored.
+ */
+void tcp_sack_update(tcp_data_t *data, tcp_packet_t *packet) {
+    tcp_sack_block_t blocks[TCP_SACK_MAX_BLOCKS];
+    tcp_sack_range_t *range, *tmp, *after;
+    int nblocks;
+
+    if (!data->sack_enabled)
+        return;
+
+    nblocks = chitcp_tcp_packet_get_sack(packet, blocks);
+
+    for (int i = 0; i < nblocks; i++) {
+        uint32_t start = blocks[i].left, end = blocks[i].right;
+
+        if (SEQ_GEQ(start, end) || SEQ_LEQ(start, data->SND_UNA) || SEQ_GT(end, data->SND_NXT))
+            continue;
+
+        // merge every range it overlaps or is adjacent to
+        after = NULL;
+        DL_FOREACH_SAFE(data->sack_scoreboard, range, tmp) {
+            if (SEQ_GT(range->start, end)) {
+                after = range;
+                break;
+            }
+            if (SEQ_LT(range->end, start))
+                continue;
+            if (SEQ_LT(range->start, start))
+                start = range->start;
+            if (SEQ_GT(range->end, end))
+                end = range->end;
+            DL_DELETE(data->sack_scoreboard, range);
+            free(range);
+        }
+
+        if ((range = malloc(sizeof(tcp_sack_range_t))) == NULL) {
+            chilog(WARNING, "Could not allocate memory for SACK scoreboard. Ignoring SACK block.");
+            continue;
+        }
+        range->start = start;
+        range->end = end;
+
+        if (after != NULL)
+            DL_PREPEND_ELEM(data->sack_scoreboard, after, range);
+        else
+            DL_APPEND(data->sack_scoreboard, range);
+    }
+
+    DL_FOREACH_SAFE(data->sack_scoreboard, range, tmp) {
+        if (SEQ_GT(range->end, data->SND_UNA)) {
+            if (SEQ_LT(range->start, data->SND_UNA))
+                range->start = data->SND_UNA;
+            break;
+        }
+        DL_DELETE(data->sack_scoreboard, range);
+        free(range);
+    }
+}
+
+/*
+ * Estimates the amount of data in the network (pipe, in RFC 6675) from
+ * the SACK scoreboard: the holes before the highest SACKed byte are
+ * presumed lost, so they only count if they have been retransmitted,
+ * while everything after it is still in flight.
+ */
+uint32_t tcp_sack_pipe(tcp_data_t *data) {
+    tcp_sack_range_t *range;
+    uint32_t seq = data->SND_UNA, pipe = 0;
+
+    DL_FOREACH(data->sack_scoreboard, range) {
+        uint32_t rxt_end = SEQ_LT(data->sack_high_rxt, range->start) ? data->sack_high_rxt : range->start;
+
+        if (SEQ_GT(rxt_end, seq))
+            pipe += rxt_end - seq;
+        seq = range->end;
+    }
+
+    return pipe + (data->SND_NXT - seq);
+}
+
+/*
+ * Finds the first hole in the SACK scoreboard (data before the highest
+ * SACKed byte that hasn't been SACKed) at or after "from".
+ *
+ * Returns TRUE and sets *seq and *len to the hole if there is one.
+ */
+bool_t tcp_sack_next_hole(tcp_data_t *data, uint32_t from, uint32_t *seq, uint32_t *len) {
+    tcp_sack_range_t *range;
+    uint32_t cur = SEQ_LT(from, data->SND_UNA) ? data->SND_UNA : from;
+
+    DL_FOREACH(data->sack_scoreboard, range) {
+        if (SEQ_LT(cur, range->start)) {
+            *seq = cur;
+            *len = range->start - cur;
+            return TRUE;
+        }
+        if (SEQ_LT(cur, range->end))
+            cur = range->end;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Retransmits, one segment at a time, the holes in the SACK scoreboard
+ * that haven't been retransmitted yet in this recovery, for as long as
+ * the data in the network fits in cwnd (RFC 6675, section 5). If "force"
+ * is set, at least one segment is sent (the fast retransmit), even if
+ * the peer hasn't SACKed anything.
+ *
+ * Returns the number of segments retransmitted.
+ */
+int tcp_sack_retransmit(serverinfo_t *si, chisocketentry_t *entry, bool_t force) {
+    tcp_data_t *data = &entry->socket_state.active.tcp_data;
+    uint32_t seq, len;
+    int nsegs = 0;
+
+    for (;;) {
+        if (!force && data->cc->cwnd(data) < tcp_sack_pipe(data) + TCP_MSS)
+            break;
+
+        if (!tcp_sack_next_hole(data, data->sack_high_rxt, &seq, &len)) {
+            if (!force)
+                break;
+            seq = data->SND_UNA;
+            len = data->SND_NXT - data->SND_UNA;
+        }
+
+        int nbytes = tcp_send_segment(si, entry, seq, len);
+        if (nbytes <= 0)
+            break;
+
+        data->sack_high_rxt = seq + nbytes;
+        force = FALSE;
+        nsegs++;
+    }
+
+    return nsegs;
+}
+
+/* Frees the SACK scoreboard */
+void tcp_sack_free(tcp_data_t *data) {
+    tcp_sack_range_t *range, *tmp;
+
+    DL_FOREACH_SAFE(data->sack_scoreboard, range, tmp) {
+        DL_DELETE(data->sack_scoreboard, range);
+        free(range);
+    }
+}
+
+/*
+ * Adds a segment that has just been sent for the first time (starting
+ * at SND.NXT) to the retransmission queue. The queue doubles in size
+ * when it is full; if it can't, the segment just won't be timed.
+ */
+void tcp_rtx_add(tcp_data_t *data, uint32_t seq, uint32_t len) {
+    tcp_rtx_segment_t *seg;
+
+    if (data->rtx_count == data->rtx_capacity) {
+        uint32_t capacity = data->rtx_capacity ? 2 * data->rtx_capacity : TCP_RTX_QUEUE_INITIAL;
+        tcp_rtx_segment_t *queue = malloc(capacity * sizeof(tcp_rtx_segment_t));
+
+        if (queue == NULL) {
+            chilog(WARNING, "Could not grow the retransmission queue.");
+            return;
+        }
+        for (uint32_t i = 0; i < data->rtx_count; i++)
+            queue[i] = *TCP_RTX_SEGMENT(data, i);
+        free(data->rtx_queue);
+        data->rtx_queue = queue;
+        data->rtx_head = 0;
+        data->rtx_capacity = capacity;
+    }
+
+    seg = TCP_RTX_SEGMENT(data, data->rtx_count);
+    seg->seq = seq;
+    seg->len = len;
+    seg->rexmits = 0;
+    seg->sent = tcp_now();
+    data->rtx_count++;
+}
+
+/*
+ * Records that the data from "seq" (for "len" bytes) has been sent
+ * again, in every segment of the retransmission queue it overlaps. The
+ * queue is sorted by sequence number, so the first of them is found
+ * with a binary search.
+ */
+void tcp_rtx_resent(tcp_data_t *data, uint32_t seq, uint32_t len) {
+    uint32_t lo = 0, hi = data->rtx_count;
+    uint64_t now = tcp_now();
+
+    // the first segment that ends after seq
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        tcp_rtx_segment_t *seg = TCP_RTX_SEGMENT(data, mid);
+
+        if (SEQ_LEQ(seg->seq + seg->len, seq))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (uint32_t i = lo; i < data->rtx_count; i++) {
+        tcp_rtx_segment_t *seg = TCP_RTX_SEGMENT(data, i);
+
+        if (SEQ_GEQ(seg->seq, seq + len))
+            break;
+        seg->rexmits++;
+        seg->sent = now;
+    }
+}
+
+/*
+ * Drops the segments that an ACK up to "ack" covers from the
+ * retransmission queue, and trims the one it covers partially (if
+ * any), so this only takes time for the segments that were ACKed.
+ *
+ * Returns when the newest of the segments that were fully covered was
+ * sent, if it was only sent once (so it gives a valid RTT sample, by
+ * Karn's algorithm), or 0.
+ */
+uint64_t tcp_rtx_ack(tcp_data_t *data, uint32_t ack) {
+    uint64_t sent = 0;
+
+    while (data->rtx_count > 0) {
+        tcp_rtx_segment_t *seg = TCP_RTX_SEGMENT(data, 0);
+
+        if (SEQ_LEQ(seg->seq + seg->len, ack)) {
+            sent = seg->rexmits == 0 ? seg->sent : 0;
+            data->rtx_head = (data->rtx_head + 1) & (data->rtx_capacity - 1);
+            data->rtx_count--;
+        } else {
+            if (SEQ_GT(ack, seg->seq)) {
+                seg->len -= ack - seg->seq;
+                seg->seq = ack;
+            }
+            break;
+        }
+    }
+
+    return sent;
+}
+
+/* Frees the retransmission queue */
+void tcp_rtx_free(tcp_data_t *data) {
+    free(data->rtx_queue);
+    data->rtx_queue = NULL;
+    data->rtx_head = 0;
+    data->rtx_count = 0;
+    data->rtx_capacity = 0;
+}
@@ -42,12 +42,27 @@
 #include "chitcp/buffer.h"
 #include "chitcp/packet.h"
 #include "chitcp/multitimer.h"
+#include "tcp_cc.h"
+#include <time.h>
+#include <stdatomic.h>
 
 #ifndef TCP_H_
 #define TCP_H_
 
 #define TCP_BUFFER_SIZE (4096)
+
+/* The MSS can be changed at build time (e.g., with -DTCP_MSS=1460) */
+#ifndef TCP_MSS
 #define TCP_MSS (536)
+#endif
+
+/* Bounds on the size of a socket's send and receive buffers
+ * (see SO_SNDBUF and SO_RCVBUF in chisocket_setsockopt) */
+#define TCP_BUFFER_MIN (TCP_MSS)
+#define TCP_BUFFER_MAX (4 * 1024 * 1024)
+
+/* Largest window that can be advertised without window scaling */
+#define TCP_MAX_WND (65535)
 
 /* TCP events. Roughly correspond to the ones specified in
  * http://tools.ietf.org/html/rfc793#section-3.9 */
@@ -60,7 +75,8 @@ typedef enum
     PACKET_ARRIVAL      = 5,
     TIMEOUT_RTX         = 6,
     TIMEOUT_PST         = 7,
-    CLEANUP             = 8
+    CLEANUP             = 8,
+    TIMEOUT_DACK        = 9
 } tcp_event_type_t;
 
 
@@ -68,8 +84,138 @@ typedef enum
 {
     RETRANSMISSION      = 0,
     PERSIST             = 1,
+    DELAYED_ACK         = 2,
+    PACING              = 3,
 } tcp_timer_type_t;
 
+#define TCP_NUM_TIMERS (4)
+
+/* Delayed ACKs: received data is acknowledged once there are
+ * TCP_DELAYED_ACK_BYTES unacknowledged bytes (two full segments),
+ * or after TCP_DELAYED_ACK_TIMEOUT nanoseconds, whichever comes first */
+#define TCP_DELAYED_ACK_BYTES (2 * TCP_MSS)
+#define TCP_DELAYED_ACK_TIMEOUT (40 * MILLISECOND)
+
+/* Segment coalescing: the largest payload that in-order data segments
+ * are coalesced into before TCP handles them */
+#define TCP_COALESCE_MAX_LEN (16 * TCP_MSS)
+
+/* Pacing (SO_MAX_PACING_RATE). A rate derived from the connection is
+ * cwnd/SRTT scaled up by TCP_PACING_GAIN_SS percent in slow start (so
+ * cwnd can keep doubling every RTT) and TCP_PACING_GAIN_CA percent
+ * otherwise, as in Linux. The token bucket holds TCP_PACING_BURST_TIME
+ * worth of data, but never less than TCP_PACING_BURST_MIN bytes, so
+ * segments still leave in small batches (and the pacing timer, which
+ * has the timer wheel's granularity, doesn't have to fire for each one) */
+#define TCP_PACING_GAIN_SS (200)
+#define TCP_PACING_GAIN_CA (120)
+#define TCP_PACING_BURST_TIME (1 * MILLISECOND)
+#define TCP_PACING_BURST_MIN (2 * TCP_MSS)
+
+/* Under memory pressure, a receive window is only opened up to
+ * TCP_MEM_PRESSURE_WND bytes past RCV.NXT, as in Linux (so the peer
+ * can still make progress, with few segments in flight) */
+#define TCP_MEM_PRESSURE_WND (2 * TCP_MSS)
+
+/* Longest header of a pure ACK: no options other than timestamps
+ * (see ack_template in tcp_data_t) */
+#define TCP_ACK_TEMPLATE_LEN (TCP_HEADER_NOOPTIONS_SIZE + 12)
+
+/* Retransmission timeout (RFC 6298): initial value and bounds. Like most
+ * stacks, we allow a smaller RTO than the 1 second minimum recommended
+ * by RFC 6298. TCP_CLOCK_GRANULARITY is G in RFC 6298 (the granularity
+ * of the timestamps clock) */
+#define TCP_RTO_INITIAL (1 * SECOND)
+#define TCP_RTO_MIN (200 * MILLISECOND)
+#define TCP_RTO_MAX (60 * SECOND)
+#define TCP_CLOCK_GRANULARITY (1 * MILLISECOND)
+
+/* Initial capacity of the retransmission queue (in segments; it
+ * doubles whenever it fills up) */
+#define TCP_RTX_QUEUE_INITIAL (16)
+
+/* Maximum segment lifetime. Connections stay in TIME_WAIT for 2*MSL
+ * (like in Linux, a minute in total) */
+#define TCP_MSL (30 * SECOND)
+
+/* Initial congestion window (RFC 3390), and an upper bound on the
+ * congestion window (the largest window that can be advertised) */
+#define TCP_INITIAL_CWND (MIN(4 * TCP_MSS, MAX(2 * TCP_MSS, 4380)))
+#define TCP_CWND_MAX ((uint32_t) TCP_MAX_WND << TCP_WSCALE_MAX)
+
+/* Parameters to the timer callback function. The multitimer
+ * identifiers are the tcp_timer_type_t values, so the callback
+ * only needs to know which socket the timer belongs to. */
+struct serverinfo;
+struct chisocketentry;
+
+typedef struct tcp_timer_args
+{
+    struct serverinfo *si;
+    struct chisocketentry *entry;
+} tcp_timer_args_t;
+
+/* A contiguous range of data received ahead of RCV.NXT. Segments that
+ * overlap or are adjacent are merged, so the ranges in the out-of-order
+ * queue never touch, and are kept sorted by sequence number */
+typedef struct tcp_ooo_segment
+{
+    uint32_t seq;   /* Sequence number of the first byte */
+    uint32_t len;
+    uint8_t *data;
+    struct tcp_ooo_segment *prev;
+    struct tcp_ooo_segment *next;
+} tcp_ooo_segment_t;
+
+/* A segment that has been sent, and not (fully) acknowledged yet. Its
+ * data is still in the send buffer, so the retransmission queue only
+ * describes the segments, and they are read back from the buffer if
+ * they have to be sent again. A partial ACK trims the oldest segment */
+typedef struct tcp_rtx_segment
+{
+    uint32_t seq;       /* Sequence number of the first byte */
+    uint32_t len;
+    uint32_t rexmits;   /* Times (any of) it has been sent again */
+    uint64_t sent;      /* When it was last sent (see tcp_now) */
+} tcp_rtx_segment_t;
+
+/* Slot i of the retransmission queue, counting from the oldest segment */
+#define TCP_RTX_SEGMENT(data, i) \
+    (&(data)->rtx_queue[((data)->rtx_head + (i)) & ((data)->rtx_capacity - 1)])
+
+/* A range of data sent after SND.UNA that the peer has reported, in
+ * SACK blocks, as received. The ranges on the SACK scoreboard are kept
+ * sorted and merged, just like the out-of-order queue's */
+typedef struct tcp_sack_range
+{
+    uint32_t start; /* Sequence number of the first byte */
+    uint32_t end;   /* Sequence number after the last byte */
+    struct tcp_sack_range *prev;
+    struct tcp_sack_range *next;
+} tcp_sack_range_t;
+
+/* Performance counters of a socket (returned by GET_STATS). They are
+ * updated by the socket's TCP thread and by whichever threads send and
+ * deliver its segments, and only read elsewhere, so they are relaxed
+ * atomics (updated with TCP_STATS_ADD) */
+typedef struct tcp_stats
+{
+    atomic_uint_fast64_t segs_in;
+    atomic_uint_fast64_t segs_out;
+    atomic_uint_fast64_t bytes_in;      /* Payload bytes */
+    atomic_uint_fast64_t bytes_out;
+    atomic_uint_fast64_t retransmits;   /* Segments sent again */
+    atomic_uint_fast64_t dup_acks;
+    atomic_uint_fast64_t out_of_order;  /* Segments queued after a gap */
+    atomic_uint_fast64_t zero_window;   /* Times the peer closed its window */
+} tcp_stats_t;
+
+#define TCP_STATS_ADD(data, counter, n) \
+    atomic_fetch_add_explicit(&(data)->stats.counter, (n), memory_order_relaxed)
+
+#define TCP_STATS_GET(data, counter) \
+    atomic_load_explicit(&(data)->stats.counter, memory_order_relaxed)
+
 /*  Many values in tcp_data have identifiers from RFC 793, as below     */
 
 /*  From RFC 793 definition of the Transmission Control Block:
@@ -98,6 +244,10 @@ typedef enum
 
 /* SND.UP, SND.WL1, SND.WL2, and RCV.UP are unused */
 
+/* SND.WND and RCV.WND are kept unscaled. Segments carry them scaled by
+ * the window scale shift counts negotiated in the SYNs (RFC 7323),
+ * except for the SYNs themselves, whose window is never scaled */
+
 static char *tcp_event_type_names[] =
 {
     "APPLICATION_CONNECT",
@@ -107,7 +257,8 @@ static char *tcp_event_type_names[] =
     "PACKET_ARRIVAL",
     "TIMEOUT_RTX",
     "TIMEOUT_PST",
-    "CLEANUP"
+    "CLEANUP",
+    "TIMEOUT_DACK"
 };
 
 static inline char *tcp_event_str (tcp_event_type_t evt)
@@ -118,33 +269,195 @@ static inline char *tcp_event_str (tcp_event_type_t evt)
 
 /* TCP data. Roughly corresponds to the variables and buffers
  * one would expect in a Transmission Control Block (as
- * specified in RFC 793). */
+ * specified in RFC 793).
+ *
+ * The fields that are used for almost every segment come first, in the
+ * two cache lines that start the struct, and the queue of pending packets
+ * (which the network threads write to) is on a cache line of its own,
+ * so that it doesn't bounce the TCB between the network threads and the
+ * socket's TCP thread. Everything else is used less often. */
 typedef struct tcp_data
 {
-    /* Queue with pending packets received from the network */
-    tcp_packet_list_t *pending_packets;
-    pthread_mutex_t lock_pending_packets;
-    pthread_cond_t cv_pending_packets;
-
-    /* Transmission control block */
+    /* Transmission control block (first cache line) */
 
     /* Send sequence variables */
-    uint32_t ISS;      /* Initial send sequence number */
+    _Alignas(CHITCP_CACHE_LINE)
     uint32_t SND_UNA;  /* First byte sent but not acknowledged */
     uint32_t SND_NXT;  /* Next sendable byte */
-    uint16_t SND_WND;  /* Send Window */
+    uint32_t SND_WND;  /* Send Window */
 
     /* Receive sequence variables */
-    uint32_t IRS;      /* Initial receive sequence number */
     uint32_t RCV_NXT;  /* Next byte expected */
-    uint16_t RCV_WND;  /* Receive Window */
+    uint32_t RCV_WND;  /* Receive Window */
 
-    /* Buffers */
-    circular_buffer_t send;
-    circular_buffer_t recv;
+    /* Window scaling (RFC 7323). The shift counts are zero unless
+     * both SYNs carried a window scale option */
+    uint8_t SND_WND_SHIFT;  /* Shift applied to the peer's windows */
+    uint8_t RCV_WND_SHIFT;  /* Shift applied to our windows */
+    bool_t wscale_rcvd;     /* Did the peer's SYN carry a window scale option? */
+
+    /* Nagle's algorithm and delayed ACKs (disabled by TCP_NODELAY
+     * and TCP_QUICKACK). RCV_UNACKED is the number of received
+     * bytes that we haven't acknowledged yet */
+    bool_t nodelay;
+    bool_t quickack;
+    uint32_t RCV_UNACKED;
+
+    /* Whether to send data or an ACK is only decided after the last
+     * of the arrived packets (unless an ACK has to be sent right away),
+     * so a burst of segments gets a single ACK and window update.
+     * batch_rcvd is the data received since the last such decision */
+    bool_t batch_pending;
+    uint32_t batch_rcvd;
+
+    /* Timestamps option (RFC 7323). Before the peer's SYN arrives,
+     * ts_enabled says whether we offer the option; after that, whether
+     * both SYNs carried it. TS_RECENT is the TSval we echo to the peer */
+    bool_t ts_enabled;
+    uint32_t TS_RECENT;
+
+    /* Header of the connection's pure ACKs, built when the first one is
+     * sent once the connection is synchronized (and the options it will
+     * use are settled). Only the sequence numbers, the window and the
+     * timestamps change from one ACK to the next (see tcp_send_ack).
+     * ack_template_len is zero until the template is built */
+    uint8_t ack_template[TCP_ACK_TEMPLATE_LEN];
+    uint8_t ack_template_len;
+
+    /* Selective acknowledgements (RFC 2018). sack_enabled works like
+     * ts_enabled. The scoreboard has the data the peer has SACKed, and
+     * sack_high_rxt is the end of the data retransmitted in the current
+     * recovery (HighRxt in RFC 6675) */
+    bool_t sack_enabled;
+    uint32_t sack_high_rxt;
+
+    /* Second cache line */
 
     /* Has a CLOSE been requested on this socket? */
     bool_t closing;
+
+    /* Congestion control (see tcp_cc.h). cwnd and ssthresh are in bytes */
+    const tcp_cc_ops_t *cc;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    tcp_ca_state_t ca_state;
+    uint32_t recover;   /* SND.NXT when RECOVERY or LOSS was entered */
+    uint32_t dupacks;   /* Number of consecutive duplicate ACKs */
+
+    /* Round-trip time estimation (RFC 6298), in nanoseconds. Without
+     * timestamps, an ACK gives a sample if it covers a segment in the
+     * retransmission queue that was only sent once (Karn's algorithm) */
+    uint64_t RTO;
+    uint64_t SRTT;
+    uint64_t RTTVAR;
+    bool_t rtt_sampled;     /* Do we have an RTT measurement yet? */
+
+    /* Interval of the persist timer (see tcp_persist_probe), which
+     * doubles after each window probe. Zero if the peer's window
+     * hasn't been closed since it last opened */
+    uint64_t persist_timeout;
+
+    /* Pacing (see TCP_PACING_GAIN_SS). pacing_rate is the socket's
+     * SO_MAX_PACING_RATE (zero if pacing is disabled). The token bucket
+     * holds pacing_credit bytes, times SECOND (so no fraction of a byte
+     * is lost when it is refilled), as of pacing_stamp */
+    uint32_t pacing_rate;
+    uint64_t pacing_credit;
+    uint64_t pacing_stamp;
+
+    /* TCP Fast Open (RFC 7413), if the socket entry's fastopen is set.
+     * tfo_cookie is the cookie that our SYN carries (if tfo_cookie_len
+     * is zero, it carries a cookie request) or that our SYN/ACK issues.
+     * tfo_accepted is set if the peer's SYN carried a valid cookie, in
+     * which case its data is accepted (see chitcpd_tcp_process_syn) */
+    bool_t fastopen;
+    bool_t tfo_accepted;
+    uint8_t tfo_cookie_len;
+    uint8_t tfo_cookie[TCP_FASTOPEN_COOKIE_LEN];
+
+    /* Initial sequence numbers */
+    uint32_t ISS;      /* Initial send sequence number */
+    uint32_t IRS;      /* Initial receive sequence number */
+
+    /* Packets taken off pending_packets in one go (see the net_recv
+     * event in tcp_thread.c), linked through their next field, and
+     * handled one PACKET_ARRIVAL at a time. Only the socket's TCP thread
+     * (or worker) uses it, so it has no lock */
+    tcp_packet_t *arrived_packets;
+
+    /* Out-of-order queue: data received inside the receive window,
+     * but after a gap starting at RCV.NXT */
+    tcp_ooo_segment_t *ooo_queue;
+    uint32_t ooo_bytes;
+    uint32_t ooo_recent;    /* Sequence number of the last segment queued */
+
+    tcp_sack_range_t *sack_scoreboard;
+
+    /* Retransmission queue: the segments between SND.UNA and SND.NXT,
+     * oldest first, in a ring whose capacity is a power of two */
+    tcp_rtx_segment_t *rtx_queue;
+    uint32_t rtx_head;
+    uint32_t rtx_count;
+    uint32_t rtx_capacity;
+
+    /* Queue with pending packets received from the network. Any thread
+     * can deliver packets to it, and the socket's TCP thread (or worker)
+     * is its only consumer */
+    _Alignas(CHITCP_CACHE_LINE)
+    tcp_packet_queue_t pending_packets;
+
+    /* Bytes charged to the memory budgets for the pending packets (see
+     * chitcpd_deliver_active) */
+    atomic_size_t pending_mem;
+
+    /* Buffers. Their data is only allocated while they're in use, and
+     * snd_idle_seq and rcv_idle_seq are used to find out when they
+     * have become idle (see chitcpd_tcp_trim_buffer) */
+    _Alignas(CHITCP_CACHE_LINE)
+    circular_buffer_t send;
+    circular_buffer_t recv;
+    uint32_t snd_idle_seq;
+    uint32_t rcv_idle_seq;
+
+    /* Bytes charged to the daemon's memory budget for the buffers (their
+     * capacity, whether or not their data is allocated) */
+    size_t buf_mem;
+
+    union
+    {
+        tcp_cubic_t cubic;
+    } cc_priv;
+
+    /* Retransmission and persist timers (indexed by tcp_timer_type_t).
+     * The timers are kept in the daemon's timer wheel. */
+    multi_timer_t mt;
+    tcp_timer_args_t timer_args;
+
+    /* Performance counters */
+    tcp_stats_t stats;
 } tcp_data_t;
 
+/* Value of the window field in a segment advertising RCV.WND */
+#define TCP_ADVERTISED_WND(data, syn) \
+    ((uint16_t) MIN((syn) ? (data)->RCV_WND : (data)->RCV_WND >> (data)->RCV_WND_SHIFT, TCP_MAX_WND))
+
+/* Window advertised by the peer in a received segment (unscaled) */
+#define TCP_SEG_WND(data, p) \
+    (TCP_PACKET_HEADER(p)->syn ? (uint32_t) SEG_WND(p) : (uint32_t) SEG_WND(p) << (data)->SND_WND_SHIFT)
+
+/* Current time, in nanoseconds, for RTT measurements (see clock.h) */
+static inline uint64_t tcp_now(void)
+{
+    return chitcp_clock_now_ns();
+}
+
+/* Current value of the timestamps clock (which ticks every millisecond) */
+#define TCP_TS_NOW() ((uint32_t) (tcp_now() / TCP_CLOCK_GRANULARITY))
+
+/* Sequence number comparisons (modulo 2^32, as described in RFC 793 section 3.3) */
+#define SEQ_LT(a, b)  ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t) ((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t) ((a) - (b)) >= 0)
+
 #endif /* TCP_H_ */
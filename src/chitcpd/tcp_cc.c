@@ -0,0 +1,143 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Congestion control framework, and the NewReno module
+ *
+ *  The congestion control algorithm of a socket is a set of functions
+ *  (a tcp_cc_ops_t), which the sender in tcp.c calls when new data is
+ *  acknowledged, when three duplicate ACKs arrive, and when the
+ *  retransmission timer expires. The algorithm keeps cwnd and ssthresh
+ *  (and any state of its own) in the socket's tcp_data_t, and the
+ *  sender never has more than min(cwnd, SND.WND) bytes outstanding.
+ *
+ *  NewReno (RFC 5681 and RFC 6582) is the default algorithm. Its
+ *  functions are exported, so other modules can reuse them (e.g., for
+ *  slow start).
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "tcp.h"
+#include "tcp_cc.h"
+#include <string.h>
+
+static const tcp_cc_ops_t *tcp_cc_modules[TCP_CC_NUM_ALGORITHMS] =
+{
+    [TCP_CC_NEWRENO] = &tcp_cc_newreno,
+    [TCP_CC_CUBIC] = &tcp_cc_cubic,
+};
+
+/* See tcp_cc.h */
+const tcp_cc_ops_t *tcp_cc_get(tcp_cc_algorithm_t algorithm)
+{
+    if (algorithm < 0 || algorithm >= TCP_CC_NUM_ALGORITHMS)
+        return NULL;
+
+    return tcp_cc_modules[algorithm];
+}
+
+/* See tcp_cc.h */
+int tcp_cc_lookup(const char *name)
+{
+    for (int i = 0; i < TCP_CC_NUM_ALGORITHMS; i++)
+        if (strcmp(tcp_cc_modules[i]->name, name) == 0)
+            return i;
+
+    return -1;
+}
+
+
+/*
+ *
+ *  NewReno
+ *
+ */
+
+/* See tcp_cc.h */
+void tcp_cc_newreno_init(struct tcp_data *data)
+{
+    data->cwnd = TCP_INITIAL_CWND;
+    data->ssthresh = TCP_CWND_MAX;
+}
+
+/* See tcp_cc.h */
+void tcp_cc_newreno_on_ack(struct tcp_data *data, uint32_t acked)
+{
+    if (data->cwnd < data->ssthresh)
+    {
+        /* Slow start (RFC 5681, section 3.1, with L = 1 SMSS) */
+        data->cwnd += MIN(acked, TCP_MSS);
+    }
+    else
+    {
+        /* Congestion avoidance: about one SMSS per RTT */
+        data->cwnd += MAX(1, (uint64_t) TCP_MSS * MIN(acked, TCP_MSS) / data->cwnd);
+    }
+
+    data->cwnd = MIN(data->cwnd, TCP_CWND_MAX);
+}
+
+/* See tcp_cc.h */
+void tcp_cc_newreno_on_loss(struct tcp_data *data)
+{
+    uint32_t flight = data->SND_NXT - data->SND_UNA;
+
+    /* RFC 5681, equation (4) */
+    data->ssthresh = MAX(flight / 2, 2 * TCP_MSS);
+}
+
+/* See tcp_cc.h */
+void tcp_cc_newreno_on_rto(struct tcp_data *data)
+{
+    tcp_cc_newreno_on_loss(data);
+
+    /* The loss window is one segment */
+    data->cwnd = TCP_MSS;
+}
+
+/* See tcp_cc.h */
+uint32_t tcp_cc_newreno_cwnd(struct tcp_data *data)
+{
+    return data->cwnd;
+}
+
+const tcp_cc_ops_t tcp_cc_newreno =
+{
+    .name = "newreno",
+    .init = tcp_cc_newreno_init,
+    .on_ack = tcp_cc_newreno_on_ack,
+    .on_loss = tcp_cc_newreno_on_loss,
+    .on_rto = tcp_cc_newreno_on_rto,
+    .cwnd = tcp_cc_newreno_cwnd,
+};
@@ -0,0 +1,137 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Congestion control (see tcp_cc.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TCP_CC_H_
+#define TCP_CC_H_
+
+#include "chitcp/types.h"
+#include "chitcp/socket.h"
+
+/* Congestion control algorithms (see TCP_CONGESTION in chisocket_setsockopt).
+ * The values are the CHITCP_CC_* constants defined in socket.h */
+typedef enum
+{
+    TCP_CC_NEWRENO = CHITCP_CC_NEWRENO,
+    TCP_CC_CUBIC   = CHITCP_CC_CUBIC,
+} tcp_cc_algorithm_t;
+
+#define TCP_CC_NUM_ALGORITHMS (2)
+
+/* Congestion avoidance state of a connection. The sender enters
+ * RECOVERY on three duplicate ACKs (fast retransmit), and LOSS on
+ * a retransmission timeout. Either is left once everything that was
+ * outstanding when it was entered ("recover") has been ACKed */
+typedef enum
+{
+    TCP_CA_OPEN     = 0,
+    TCP_CA_RECOVERY = 1,
+    TCP_CA_LOSS     = 2,
+} tcp_ca_state_t;
+
+/* Private state of the CUBIC module (RFC 9438). Windows are in bytes,
+ * and times in nanoseconds */
+typedef struct tcp_cubic
+{
+    uint32_t W_max;         /* Window before the last reduction */
+    uint32_t W_est;         /* Reno-friendly window estimate */
+    uint64_t epoch_start;   /* Start of the current congestion avoidance stage (0: none) */
+    double K;               /* Time (in seconds) to grow back to W_max */
+} tcp_cubic_t;
+
+struct tcp_data;
+
+/* A congestion control module. The sender (tcp.c) takes care of
+ * detecting losses and of fast retransmit/fast recovery (RFC 6582),
+ * and calls into the module to update cwnd and ssthresh. */
+typedef struct tcp_cc_ops
+{
+    const char *name;
+
+    /* Sets up cwnd, ssthresh and the module's private state */
+    void (*init)(struct tcp_data *data);
+
+    /* "acked" new bytes have been acknowledged (outside fast recovery) */
+    void (*on_ack)(struct tcp_data *data, uint32_t acked);
+
+    /* Three duplicate ACKs: reduce ssthresh before fast recovery (the
+     * sender sets cwnd while recovering, and to ssthresh afterwards) */
+    void (*on_loss)(struct tcp_data *data);
+
+    /* Retransmission timeout: reduce ssthresh and cwnd */
+    void (*on_rto)(struct tcp_data *data);
+
+    /* Number of bytes that the sender may have outstanding */
+    uint32_t (*cwnd)(struct tcp_data *data);
+} tcp_cc_ops_t;
+
+
+/*
+ * tcp_cc_get - Get a congestion control module
+ *
+ * algorithm: Congestion control algorithm
+ *
+ * Returns: The module, or NULL if the algorithm is not valid.
+ *
+ */
+const tcp_cc_ops_t *tcp_cc_get(tcp_cc_algorithm_t algorithm);
+
+
+/*
+ * tcp_cc_lookup - Get a congestion control algorithm by name
+ *
+ * name: Name of the algorithm ("newreno" or "cubic")
+ *
+ * Returns: The algorithm, or -1 if there is no algorithm with that name.
+ *
+ */
+int tcp_cc_lookup(const char *name);
+
+
+/* Modules */
+extern const tcp_cc_ops_t tcp_cc_newreno;
+extern const tcp_cc_ops_t tcp_cc_cubic;
+
+/* NewReno functions, which other modules can reuse */
+void tcp_cc_newreno_init(struct tcp_data *data);
+void tcp_cc_newreno_on_ack(struct tcp_data *data, uint32_t acked);
+void tcp_cc_newreno_on_loss(struct tcp_data *data);
+void tcp_cc_newreno_on_rto(struct tcp_data *data);
+uint32_t tcp_cc_newreno_cwnd(struct tcp_data *data);
+
+#endif /* TCP_CC_H_ */
@@ -0,0 +1,159 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  CUBIC congestion control (RFC 9438)
+ *
+ *  After a reduction, the window grows along a cubic function of the
+ *  time since the reduction, centered on the window before it (W_max),
+ *  so it quickly grows back to W_max, stays around it for a while, and
+ *  then probes for more bandwidth. This makes the window's growth
+ *  independent of the RTT. Where Reno would grow faster (e.g., when the
+ *  RTT is short), CUBIC follows Reno's estimated window instead.
+ *
+ *  Slow start is the same as in NewReno.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "tcp.h"
+#include "tcp_cc.h"
+#include <math.h>
+
+/* Constants from RFC 9438 */
+#define CUBIC_C     (0.4)
+#define CUBIC_BETA  (0.7)
+#define CUBIC_ALPHA (3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA))
+
+/* W_cubic(t), in bytes (RFC 9438, equation 1) */
+static double cubic_window(tcp_cubic_t *cubic, double t)
+{
+    double d = t - cubic->K;
+
+    return CUBIC_C * d * d * d * TCP_MSS + cubic->W_max;
+}
+
+/* Reduces W_max and ssthresh after a loss (RFC 9438, sections 4.6 and 4.7) */
+static void cubic_reduce(struct tcp_data *data)
+{
+    tcp_cubic_t *cubic = &data->cc_priv.cubic;
+
+    /* Fast convergence: if the window didn't grow back to W_max,
+     * release some bandwidth for the flows that are competing with us */
+    if (data->cwnd < cubic->W_max)
+        cubic->W_max = data->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+    else
+        cubic->W_max = data->cwnd;
+
+    data->ssthresh = MAX((uint32_t) (data->cwnd * CUBIC_BETA), 2 * TCP_MSS);
+    cubic->epoch_start = 0;
+}
+
+static void cubic_init(struct tcp_data *data)
+{
+    tcp_cubic_t *cubic = &data->cc_priv.cubic;
+
+    tcp_cc_newreno_init(data);
+    cubic->W_max = 0;
+    cubic->W_est = 0;
+    cubic->epoch_start = 0;
+    cubic->K = 0;
+}
+
+static void cubic_on_ack(struct tcp_data *data, uint32_t acked)
+{
+    tcp_cubic_t *cubic = &data->cc_priv.cubic;
+    uint64_t now = tcp_now();
+    double t, rtt, target;
+
+    if (data->cwnd < data->ssthresh)
+    {
+        tcp_cc_newreno_on_ack(data, acked);
+        return;
+    }
+
+    /* Start of a congestion avoidance stage */
+    if (cubic->epoch_start == 0)
+    {
+        cubic->epoch_start = now;
+        if (data->cwnd < cubic->W_max)
+            cubic->K = cbrt((double) (cubic->W_max - data->cwnd) / TCP_MSS / CUBIC_C);
+        else
+        {
+            cubic->K = 0;
+            cubic->W_max = data->cwnd;
+        }
+        cubic->W_est = data->cwnd;
+    }
+
+    t = (double) (now - cubic->epoch_start) / SECOND;
+    rtt = (double) (data->rtt_sampled ? data->SRTT : data->RTO) / SECOND;
+
+    /* Reno-friendly window (RFC 9438, section 4.3) */
+    cubic->W_est += MAX(1, (uint32_t) (CUBIC_ALPHA * TCP_MSS * MIN(acked, TCP_MSS) / data->cwnd));
+
+    if (cubic_window(cubic, t) < cubic->W_est)
+        data->cwnd = cubic->W_est;
+    else
+    {
+        /* Concave and convex regions (RFC 9438, sections 4.4 and 4.5):
+         * grow towards W_cubic one RTT from now, but at most by half
+         * the current window per RTT */
+        target = cubic_window(cubic, t + rtt);
+        target = MIN(MAX(target, data->cwnd), 1.5 * data->cwnd);
+        data->cwnd += MAX(1, (uint32_t) ((target - data->cwnd) * MIN(acked, TCP_MSS) / data->cwnd));
+    }
+
+    data->cwnd = MIN(data->cwnd, TCP_CWND_MAX);
+}
+
+static void cubic_on_loss(struct tcp_data *data)
+{
+    cubic_reduce(data);
+}
+
+static void cubic_on_rto(struct tcp_data *data)
+{
+    cubic_reduce(data);
+    data->cwnd = TCP_MSS;
+}
+
+const tcp_cc_ops_t tcp_cc_cubic =
+{
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_rto = cubic_on_rto,
+    .cwnd = tcp_cc_newreno_cwnd,
+};
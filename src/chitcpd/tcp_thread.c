@@ -53,7 +53,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "serverinfo.h"
 #include "connection.h"
@@ -61,8 +67,10 @@
 #include "chitcp/packet.h"
 #include "chitcp/types.h"
 #include "chitcp/log.h"
+#include "chitcp/utlist.h"
 #include "chitcp/debug_api.h"
 #include "chitcp/chitcpd.h"
+#include "chitcp/probes.h"
 #include "breakpoint.h"
 
 /* Dispatch table */
@@ -103,24 +111,26 @@ tcp_state_handler_function tcp_state_handlers[] =
 
 void chilog_tcp_data(loglevel_t level, tcp_data_t *tcp_data, tcp_state_t state)
 {
-    int snd_buf_size, snd_buf_capacity, rcv_buf_size, rcv_buf_capacity;
+    int snd_buf_size, snd_buf_capacity, rcv_buf_size, rcv_buf_capacity, arrived;
+    tcp_packet_t *packet;
 
     snd_buf_size = circular_buffer_count(&tcp_data->send);
     snd_buf_capacity = circular_buffer_capacity(&tcp_data->send);
     rcv_buf_size = circular_buffer_count(&tcp_data->recv);
     rcv_buf_capacity = circular_buffer_capacity(&tcp_data->recv);
+    LL_COUNT(tcp_data->arrived_packets, packet, arrived);
 
     flockfile(stdout);
     chilog(level, "   ······················································");
     chilog(level, "                         %s", tcp_str(state));
-    chilog(level, "");
+    chilog(level, "%s", "");
     chilog(level, "            ISS:  %10i           IRS:  %10i", tcp_data->ISS, tcp_data->IRS);
     chilog(level, "        SND.UNA:  %10i ", tcp_data->SND_UNA);
     chilog(level, "        SND.NXT:  %10i       RCV.NXT:  %10i ", tcp_data->SND_NXT, tcp_data->RCV_NXT);
     chilog(level, "        SND.WND:  %10i       RCV.WND:  %10i ", tcp_data->SND_WND, tcp_data->RCV_WND);
     chilog(level, "    Send Buffer: %4i / %4i   Recv Buffer: %4i / %4i", snd_buf_size, snd_buf_capacity, rcv_buf_size, rcv_buf_capacity);
-    chilog(level, "");
-    chilog(level, "       Pending packets: %4i    Closing? %s", chitcp_packet_list_size(tcp_data->pending_packets), tcp_data->closing?"YES":"NO");
+    chilog(level, "%s", "");
+    chilog(level, "       Pending packets: %4i    Closing? %s", chitcp_packet_queue_size(&tcp_data->pending_packets) + arrived, tcp_data->closing?"YES":"NO");
     chilog(level, "   ······················································");
     funlockfile(stdout);
 }
@@ -151,7 +161,9 @@ void chitcpd_dispatch_tcp(serverinfo_t *si, chisocketentry_t *entry, tcp_event_t
     chilog(DEBUG, ">>> TCP data BEFORE handling:");
     chilog_tcp_data(DEBUG, &socket_state->tcp_data, state);
 
+    CHITCP_PROBE(dispatch_tcp_entry, SOCKET_NO(si, entry), event, state);
     rc = tcp_state_handlers[state](si, entry, event);
+    CHITCP_PROBE(dispatch_tcp_exit, SOCKET_NO(si, entry), event, state, rc);
 
     chilog(DEBUG, "<<< TCP data AFTER handling:");
     chilog_tcp_data(DEBUG, &socket_state->tcp_data, entry->tcp_state);
@@ -170,8 +182,15 @@ void chitcpd_dispatch_tcp(serverinfo_t *si, chisocketentry_t *entry, tcp_event_t
 }
 
 
+/* Maximum number of times a TCP worker will take the pending events
+ * of a socket before moving on to the next socket in its run queue */
+#define TCP_WORKER_BATCH (16)
+
+#define TCP_WORKER(si, entry) (&(si)->tcp_workers[SOCKET_NO(si, entry) % (si)->num_tcp_workers])
+
 /* Advance declaration of TCP thread function */
 void* chitcpd_tcp_thread_func(void *args);
+void* chitcpd_tcp_worker_func(void *args);
 
 typedef struct tcp_thread_args
 {
@@ -182,23 +201,205 @@ typedef struct tcp_thread_args
 
 
 /*
- * chitcpd_tcp_start_thread - Starts a TCP thread
+ * chitcpd_tcp_wscale_shift - Window scale shift count for a socket
+ *
+ * The shift is the smallest one that will allow the socket to advertise
+ * all of its receive buffer, including any growth due to autotuning.
  *
  * si: Server info
  *
- * entry: Pointer to socket entry for which a TCP thread is being started
+ * entry: Pointer to socket entry
  *
- * Returns: TODO
+ * Returns: Shift count (between 0 and TCP_WSCALE_MAX)
+ *
+ */
+static uint8_t chitcpd_tcp_wscale_shift(serverinfo_t *si, chisocketentry_t *entry)
+{
+    uint32_t max_wnd = entry->buf_autotune ? MAX(si->tcp_buf_max, entry->rcvbuf_size) : entry->rcvbuf_size;
+    uint8_t shift = 0;
+
+    while (shift < TCP_WSCALE_MAX && (max_wnd >> shift) > TCP_MAX_WND)
+        shift++;
+
+    return shift;
+}
+
+
+/*
+ * chitcpd_tcp_buffer_notify - Called when the state of a socket's buffers changes
+ *
+ * buf: The socket's send or receive buffer
+ *
+ * arg: The socket's timer arguments (which are just the socket and
+ *      its server info)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_buffer_notify(circular_buffer_t *buf, void *arg)
+{
+    tcp_timer_args_t *args = (tcp_timer_args_t *) arg;
+
+    chitcpd_poll_notify(args->si, args->entry);
+}
+
+
+/*
+ * chitcpd_tcp_affinity_slot - Placement slot of a socket's TCP thread
+ *
+ * This is the slot of the network I/O thread that receives the socket's
+ * packets (see chitcpd_register_connection), so that the TCP thread and
+ * the socket's buffers are on the same NUMA node as that thread.
+ *
+ * si: Server info
+ *
+ * entry: Active socket
+ *
+ * Returns: The slot, or -1 if the socket has no connection.
+ *
+ */
+static int chitcpd_tcp_affinity_slot(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcpconnentry_t *connection = entry->socket_state.active.realtcpconn;
+
+    if (connection == NULL || si->num_netio_threads == 0)
+        return -1;
+
+    return connection->stripe % si->num_netio_threads;
+}
+
+
+/*
+ * chitcpd_tcp_buffer_alloc - Places a socket buffer's data
+ *
+ * Called when the data of one of the socket's buffers is allocated
+ * (see circular_buffer_set_alloc_hook). Its pages haven't been touched
+ * yet, so they can still be placed on the node the socket's packets
+ * are processed on.
+ *
+ * data, len: The buffer's data
+ *
+ * arg: The socket's timer arguments
+ *
+ * Returns: Nothing.
  *
  */
+static void chitcpd_tcp_buffer_alloc(uint8_t *data, size_t len, void *arg)
+{
+    tcp_timer_args_t *args = (tcp_timer_args_t *) arg;
+    int slot = chitcpd_tcp_affinity_slot(args->si, args->entry);
+
+    if (slot >= 0)
+        affinity_bind_memory(data, len, affinity_node(&args->si->placement, slot));
+}
+
+
+/*
+ * chitcpd_tcp_trim_buffer - Frees the data of a drained, idle buffer
+ *
+ * A buffer is idle if no data has gone through it since the last time
+ * its socket's events were handled. Its data will be allocated again
+ * if more data is written to it.
+ *
+ * buf: The socket's send or receive buffer
+ *
+ * idle_seq: Where the buffer's next sequence number was stored the
+ *           last time this was called
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_trim_buffer(circular_buffer_t *buf, uint32_t *idle_seq)
+{
+    uint32_t next = circular_buffer_next(buf);
+
+    if (circular_buffer_count(buf) > 0)
+        return;
+
+    if (next == *idle_seq)
+        circular_buffer_trim(buf);
+    else
+        *idle_seq = next;
+}
+
+
+/* See tcp_thread.h */
 int chitcpd_tcp_start_thread(serverinfo_t *si, chisocketentry_t *entry)
 {
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    tcp_data_t *tcp_data = &socket_state->tcp_data;
+
+    /* Initialize buffers and window scaling. The shift counts may be
+     * reset when the peer's SYN arrives (see chitcpd_tcp_process_syn).
+     *
+     * Each buffer has a single producer and a single consumer (the
+     * application's handler thread and the socket's TCP thread or
+     * worker), so they can be lock-free SPSC buffers, unless they
+     * are autotuned (SPSC buffers can't be resized) */
+    if (entry->buf_autotune)
+    {
+        circular_buffer_init(&tcp_data->send, entry->sndbuf_size);
+        circular_buffer_init(&tcp_data->recv, entry->rcvbuf_size);
+    }
+    else
+    {
+        circular_buffer_init_spsc(&tcp_data->send, entry->sndbuf_size);
+        circular_buffer_init_spsc(&tcp_data->recv, entry->rcvbuf_size);
+    }
+    circular_buffer_set_notify(&tcp_data->send, chitcpd_tcp_buffer_notify, &tcp_data->timer_args);
+    circular_buffer_set_notify(&tcp_data->recv, chitcpd_tcp_buffer_notify, &tcp_data->timer_args);
+    circular_buffer_set_alloc_hook(&tcp_data->send, chitcpd_tcp_buffer_alloc, &tcp_data->timer_args);
+    circular_buffer_set_alloc_hook(&tcp_data->recv, chitcpd_tcp_buffer_alloc, &tcp_data->timer_args);
+    tcp_data->snd_idle_seq = 0;
+    tcp_data->rcv_idle_seq = 0;
+
+    /* The socket is already connected (or connecting), so its buffers
+     * are charged even if the memory budget is full */
+    tcp_data->buf_mem = (size_t) entry->sndbuf_size + entry->rcvbuf_size;
+    mem_budget_force(&si->mem, tcp_data->buf_mem);
+
+    tcp_data->RCV_WND_SHIFT = chitcpd_tcp_wscale_shift(si, entry);
+    tcp_data->SND_WND_SHIFT = 0;
+    tcp_data->wscale_rcvd = FALSE;
+    tcp_data->nodelay = entry->nodelay;
+    tcp_data->quickack = entry->quickack;
+    tcp_data->pacing_rate = entry->pacing_rate;
+    tcp_data->pacing_credit = 0;
+    tcp_data->pacing_stamp = 0;
+    tcp_data->RCV_UNACKED = 0;
+    tcp_data->ts_enabled = si->tcp_timestamps;
+    tcp_data->TS_RECENT = 0;
+    tcp_data->ack_template_len = 0;
+    tcp_data->sack_enabled = si->tcp_sack;
+    tcp_data->sack_high_rxt = 0;
+    tcp_data->fastopen = entry->fastopen;
+    tcp_data->tfo_accepted = FALSE;
+    tcp_data->tfo_cookie_len = 0;
+
+    tcp_data->cc = tcp_cc_get(entry->cc_algorithm);
+    tcp_data->cc->init(tcp_data);
+    tcp_data->ca_state = TCP_CA_OPEN;
+    tcp_data->recover = 0;
+    tcp_data->dupacks = 0;
+
+    if (si->tcp_engine == TCP_ENGINE_WORKER_POOL)
+    {
+        /* There is no thread to start. The socket's events will be run
+         * by its worker, so we only need to set up the state that the
+         * TCP thread would otherwise set up itself */
+        socket_state->rq_queued = FALSE;
+        socket_state->rq_closed = FALSE;
+        socket_state->rq_prev = socket_state->rq_next = NULL;
+
+        return CHITCP_OK;
+    }
+
     tcp_thread_args_t *tta = malloc(sizeof(tcp_thread_args_t));
     tta->si = si;
     tta->entry = entry;
     snprintf (tta->thread_name, 16, "tcp-socket-%d", ptr_to_fd(si, entry));
 
-    if (pthread_create(&entry->socket_state.active.tcp_thread, NULL, chitcpd_tcp_thread_func, tta) < 0)
+    if (pthread_create(&socket_state->tcp_thread, NULL, chitcpd_tcp_thread_func, tta) < 0)
     {
         perror("Could not create TCP thread");
         free(tta);
@@ -209,6 +410,510 @@ int chitcpd_tcp_start_thread(serverinfo_t *si, chisocketentry_t *entry)
 }
 
 
+/* See tcp_thread.h */
+void chitcpd_tcp_join_thread(serverinfo_t *si, chisocketentry_t *entry)
+{
+    if (si->tcp_engine == TCP_ENGINE_WORKER_POOL)
+    {
+        tcp_worker_t *worker = TCP_WORKER(si, entry);
+
+        pthread_mutex_lock(&worker->lock);
+        while(!entry->available)
+            pthread_cond_wait(&worker->cv_freed, &worker->lock);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    else
+        pthread_join(entry->socket_state.active.tcp_thread, NULL);
+}
+
+
+/*
+ * chitcpd_tcp_sleep - Waits until an event is raised on a socket
+ *
+ * Must be called by the socket's TCP thread after setting the socket's
+ * events to TCP_EVENT_SLEEPING.
+ *
+ * socket_state: Active socket state
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_sleep(active_chisocket_state_t *socket_state)
+{
+#ifdef __linux__
+    while(atomic_load(&socket_state->events) == TCP_EVENT_SLEEPING)
+        syscall(SYS_futex, &socket_state->events, FUTEX_WAIT_PRIVATE, TCP_EVENT_SLEEPING, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&socket_state->lock_event);
+    while(atomic_load(&socket_state->events) == TCP_EVENT_SLEEPING)
+        pthread_cond_wait(&socket_state->cv_event, &socket_state->lock_event);
+    pthread_mutex_unlock(&socket_state->lock_event);
+#endif
+}
+
+
+/*
+ * chitcpd_tcp_notify - Gets a socket's events handled
+ *
+ * Wakes up the socket's TCP thread or, with the worker pool engine,
+ * puts the socket in its worker's run queue. Must only be called by
+ * whoever took the socket out of the TCP_EVENT_SLEEPING state.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_notify(serverinfo_t *si, chisocketentry_t *entry)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+
+    if (si->tcp_engine == TCP_ENGINE_WORKER_POOL)
+    {
+        tcp_worker_t *worker = TCP_WORKER(si, entry);
+
+        pthread_mutex_lock(&worker->lock);
+        if(!socket_state->rq_queued && !socket_state->rq_closed)
+        {
+            DL_APPEND2(worker->run_queue, entry, socket_state.active.rq_prev, socket_state.active.rq_next);
+            socket_state->rq_queued = TRUE;
+            pthread_cond_signal(&worker->cv);
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    else
+    {
+#ifdef __linux__
+        syscall(SYS_futex, &socket_state->events, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+        pthread_mutex_lock(&socket_state->lock_event);
+        pthread_cond_broadcast(&socket_state->cv_event);
+        pthread_mutex_unlock(&socket_state->lock_event);
+#endif
+    }
+}
+
+
+/* See tcp_thread.h */
+void chitcpd_tcp_raise_event(serverinfo_t *si, chisocketentry_t *entry, unsigned int events)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+    unsigned int old = atomic_load(&socket_state->events);
+
+    /* Raise the events and clear TCP_EVENT_SLEEPING in one go, so only
+     * one of the threads raising events on a sleeping socket wakes it up */
+    while(!atomic_compare_exchange_weak(&socket_state->events, &old, (old | events) & TCP_EVENT_ALL))
+        ;
+
+    if (old & TCP_EVENT_SLEEPING)
+        chitcpd_tcp_notify(si, entry);
+}
+
+
+/*
+ * chitcpd_tcp_process_syn - Process the options of a SYN
+ *
+ * If the next packet to be handled by TCP is a SYN, and the socket is
+ * still waiting for the peer's SYN, the peer's window scale option (if
+ * any) is recorded. Window scaling is only used if both SYNs carry the
+ * option (RFC 7323, section 2.2), so our own shift count is reset to
+ * zero if the peer's SYN doesn't (or if it is a SYN/ACK replying to
+ * a SYN in which we didn't offer window scaling). The same goes for
+ * the timestamps and SACK permitted options.
+ *
+ * With TCP Fast Open, a socket spawned by a listener accepts the data
+ * in the SYN if it carries a valid cookie (this is checked here, and
+ * TCP then takes the data), and otherwise issues a cookie in its
+ * SYN/ACK, if the SYN carried a Fast Open option. A client caches the
+ * cookie in the peer's SYN/ACK.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_process_syn(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packet = NULL;
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+    uint32_t tsval, tsecr;
+    int shift, len;
+
+    if (entry->tcp_state != LISTEN && entry->tcp_state != SYN_SENT)
+        return;
+
+    packet = tcp_data->arrived_packets;
+
+    if (packet == NULL || !TCP_PACKET_HEADER(packet)->syn)
+        return;
+
+    shift = chitcp_tcp_packet_get_wscale(packet);
+
+    if (shift >= 0 && (!TCP_PACKET_HEADER(packet)->ack || tcp_data->RCV_WND_SHIFT > 0))
+    {
+        tcp_data->SND_WND_SHIFT = shift;
+        tcp_data->wscale_rcvd = TRUE;
+    }
+    else
+    {
+        tcp_data->SND_WND_SHIFT = 0;
+        tcp_data->RCV_WND_SHIFT = 0;
+        tcp_data->wscale_rcvd = FALSE;
+    }
+
+    if (tcp_data->ts_enabled && chitcp_tcp_packet_get_timestamp(packet, &tsval, &tsecr) == CHITCP_OK)
+        tcp_data->TS_RECENT = tsval;
+    else
+        tcp_data->ts_enabled = FALSE;
+
+    if (chitcp_tcp_packet_get_sack_permitted(packet) != CHITCP_OK)
+        tcp_data->sack_enabled = FALSE;
+
+    if (!tcp_data->fastopen || (len = chitcp_tcp_packet_get_fastopen(packet, cookie)) < 0)
+        return;
+
+    if (entry->tcp_state == LISTEN)
+    {
+        bool_t valid;
+
+        chitcpd_fastopen_cookie(si, (struct sockaddr *) &entry->remote_addr, tcp_data->tfo_cookie);
+        valid = (len == TCP_FASTOPEN_COOKIE_LEN && memcmp(cookie, tcp_data->tfo_cookie, len) == 0);
+        tcp_data->tfo_accepted = valid && TCP_PAYLOAD_LEN(packet) > 0;
+        tcp_data->tfo_cookie_len = valid? 0 : TCP_FASTOPEN_COOKIE_LEN;
+    }
+    else if (len == TCP_FASTOPEN_COOKIE_LEN)
+        chitcpd_fastopen_cookie_set(si, (struct sockaddr *) &entry->remote_addr, cookie);
+}
+
+
+/*
+ * chitcpd_coalesce_packet - Coalesce a data segment with the one before it
+ *
+ * If the previous packet is a data segment that the new one continues
+ * (same headers and options, and contiguous sequence numbers), the new
+ * segment's payload is appended to it, so TCP handles both as a single,
+ * larger segment. Only plain ACK segments (with or without PSH) are
+ * coalesced. The first time a packet is coalesced into, it is copied
+ * into a buffer with room for TCP_COALESCE_MAX_LEN bytes of payload.
+ *
+ * tail: Previous packet
+ *
+ * tcp_packet: Packet to coalesce. If it is coalesced, it is freed.
+ *
+ * coalesce_raw: Buffer that tail was copied into, if it was (updated if
+ *               it is copied now)
+ *
+ * Returns: TRUE if the packet was coalesced, FALSE otherwise.
+ *
+ */
+static bool_t chitcpd_coalesce_packet(tcp_packet_t *tail, tcp_packet_t *tcp_packet, uint8_t **coalesce_raw)
+{
+    tcphdr_t *tail_header = TCP_PACKET_HEADER(tail), *header = TCP_PACKET_HEADER(tcp_packet);
+    uint8_t tmp[15 * sizeof(uint32_t)]; /* Largest possible header */
+    size_t hdr_len, tail_len, len;
+    uint8_t *raw;
+
+    hdr_len = header->doff * 4;
+
+    if (hdr_len != tail_header->doff * 4 || tcp_packet->length < hdr_len || tail->length < hdr_len)
+        return FALSE;
+
+    tail_len = TCP_PAYLOAD_LEN(tail);
+    len = TCP_PAYLOAD_LEN(tcp_packet);
+
+    if (tail_len == 0 || len == 0 || tail_len + len > TCP_COALESCE_MAX_LEN)
+        return FALSE;
+    if (!tail_header->ack || tail_header->syn || tail_header->fin || tail_header->rst || tail_header->psh || tail_header->urg)
+        return FALSE;
+    if (SEG_SEQ(tail) + tail_len != SEG_SEQ(tcp_packet))
+        return FALSE;
+
+    /* Apart from the sequence number, the PSH flag and the checksum,
+     * the headers (including the options) must be the same */
+    memcpy(tmp, header, hdr_len);
+    ((tcphdr_t *) tmp)->seq = tail_header->seq;
+    ((tcphdr_t *) tmp)->psh = tail_header->psh;
+    ((tcphdr_t *) tmp)->sum = tail_header->sum;
+    if (memcmp(tmp, tail_header, hdr_len) != 0)
+        return FALSE;
+
+    if (tail->raw != *coalesce_raw)
+    {
+        /* The previous packet's buffer may be shared (e.g., with the
+         * capture file), so it is copied into one we can write to */
+        raw = chitcp_packet_buf_alloc(hdr_len + TCP_COALESCE_MAX_LEN);
+        if (raw == NULL)
+            return FALSE;
+        memcpy(raw, tail->raw, tail->length);
+        chitcp_packet_buf_unref(tail->raw);
+        tail->raw = raw;
+        tail_header = TCP_PACKET_HEADER(tail);
+        *coalesce_raw = raw;
+    }
+
+    memcpy(tail->raw + tail->length, TCP_PAYLOAD_START(tcp_packet), len);
+    tail->length += len;
+    tail_header->psh = header->psh;
+
+    chitcp_tcp_packet_free(tcp_packet);
+    free(tcp_packet);
+
+    return TRUE;
+}
+
+
+/*
+ * chitcpd_tcp_take_packets - Take all the pending packets in one go
+ *
+ * The socket's pending packets are appended to its arrived packets,
+ * which TCP handles without touching the pending packets queue again
+ * (if coalescing is enabled, consecutive data segments are coalesced
+ * on the way). They are no longer queued, so their memory is returned
+ * to the budgets (see chitcpd_deliver_active).
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_take_packets(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packets, *packet, *tail;
+    uint8_t *coalesce_raw = NULL;
+    size_t mem;
+
+    packets = chitcp_packet_queue_take(&tcp_data->pending_packets);
+    mem = atomic_exchange(&tcp_data->pending_mem, 0);
+
+    if (mem > 0)
+        chitcpd_mem_uncharge(si, entry, mem);
+
+    /* The arrived packets are normally all handled by now (unless the
+     * socket was closed half-way through a batch) */
+    for (tail = tcp_data->arrived_packets; tail != NULL && tail->next != NULL; tail = tail->next);
+
+    while (packets != NULL)
+    {
+        packet = packets;
+        packets = packet->next;
+        packet->next = NULL;
+
+        if (si->tcp_coalesce && tail != NULL && chitcpd_coalesce_packet(tail, packet, &coalesce_raw))
+            continue;
+
+        if (tail == NULL)
+            tcp_data->arrived_packets = packet;
+        else
+            tail->next = packet;
+        tail = packet;
+    }
+}
+
+
+/*
+ * chitcpd_tcp_grow_buffer - Grow a socket buffer that is filling up
+ *
+ * There is no RTT estimator to size the buffers by the bandwidth-delay
+ * product, so a buffer is doubled (up to the daemon's tcp_buf_max)
+ * whenever it is more than three quarters full, as long as the daemon's
+ * memory budget can take it.
+ *
+ * si: Server info
+ *
+ * tcp_data: The socket's TCP data
+ *
+ * buf: Buffer
+ *
+ * size: Socket's size for this buffer (updated if the buffer grows)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_grow_buffer(serverinfo_t *si, tcp_data_t *tcp_data, circular_buffer_t *buf, uint32_t *size)
+{
+    uint32_t capacity = circular_buffer_capacity(buf);
+    uint32_t newsize;
+
+    if (capacity >= si->tcp_buf_max || circular_buffer_count(buf) * 4 <= capacity * 3)
+        return;
+
+    newsize = MIN(capacity * 2, si->tcp_buf_max);
+
+    if (!mem_budget_charge(&si->mem, newsize - capacity, TRUE))
+        return;
+
+    if (circular_buffer_resize(buf, newsize) == CHITCP_OK)
+    {
+        chilog(DEBUG, "Socket buffer grown from %u to %u bytes", capacity, newsize);
+        tcp_data->buf_mem += newsize - capacity;
+        *size = newsize;
+    }
+    else
+        mem_budget_uncharge(&si->mem, newsize - capacity);
+}
+
+
+/*
+ * chitcpd_tcp_handle_net_recv - Handles a net_recv event
+ *
+ * Takes all the pending packets, and handles them as one batch.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_handle_net_recv(serverinfo_t *si, chisocketentry_t *entry)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+
+    chitcpd_tcp_take_packets(si, entry);
+
+    /* Handle the whole batch. TCP only decides whether to send an ACK
+     * (or data) after the last packet. If the socket is CLOSED half-way
+     * through, the rest of the batch is dropped when it is cleaned up */
+    while(socket_state->tcp_data.arrived_packets != NULL && entry->tcp_state != CLOSED)
+    {
+        /* TCP frees the packet, so the trace stamps are taken first */
+        tcp_packet_t *packet = socket_state->tcp_data.arrived_packets;
+        uint64_t recv = packet->trace_recv, delivered = packet->trace_delivered, start = 0, end;
+
+        if (delivered != 0)
+        {
+            start = tcp_now();
+            chitcpd_trace_stage(si, TRACE_STAGE_PENDING, delivered, start);
+        }
+
+        chitcpd_tcp_process_syn(si, entry);
+        chitcpd_dispatch_tcp(si, entry, PACKET_ARRIVAL);
+
+        if (delivered != 0)
+        {
+            end = tcp_now();
+            chitcpd_trace_stage(si, TRACE_STAGE_TCP, start, end);
+            chitcpd_trace_stage(si, TRACE_STAGE_TOTAL, recv, end);
+        }
+    }
+
+    if (entry->buf_autotune)
+        chitcpd_tcp_grow_buffer(si, &socket_state->tcp_data, &socket_state->tcp_data.recv, &entry->rcvbuf_size);
+
+    /* If more packets arrived in the meantime, raise net_recv again.
+     * Nobody else takes the socket out of TCP_EVENT_SLEEPING while we
+     * are handling its events, so there is no one to wake up */
+    if(!chitcp_packet_queue_empty(&socket_state->tcp_data.pending_packets) || socket_state->tcp_data.arrived_packets != NULL)
+        atomic_fetch_or(&socket_state->events, TCP_EVENT_NET_RECV);
+}
+
+
+/* Events in the order they are handled (other than cleanup) */
+static const struct
+{
+    unsigned int flag;
+    tcp_event_type_t event;
+    const char *name;
+} tcp_events[] =
+{
+    { TCP_EVENT_APP_CLOSE,    APPLICATION_CLOSE,   "app_close" },
+    { TCP_EVENT_APP_CONNECT,  APPLICATION_CONNECT, "app_connect" },
+    { TCP_EVENT_APP_RECV,     APPLICATION_RECEIVE, "app_recv" },
+    { TCP_EVENT_APP_SEND,     APPLICATION_SEND,    "app_send" },
+    { TCP_EVENT_NET_RECV,     PACKET_ARRIVAL,      "net_recv" },
+    { TCP_EVENT_TIMEOUT_RTX,  TIMEOUT_RTX,         "timeout_rtx" },
+    { TCP_EVENT_TIMEOUT_PST,  TIMEOUT_PST,         "timeout_pst" },
+    { TCP_EVENT_TIMEOUT_DACK, TIMEOUT_DACK,        "timeout_dack" },
+};
+
+
+/*
+ * chitcpd_tcp_handle_events - Handles the pending events of a socket
+ *
+ * The events are the ones that were taken off the socket, in one go,
+ * by the socket's TCP thread (or worker). If the socket has to be
+ * cleaned up, the socket entry is freed and the other events are
+ * dropped. The same happens if the socket is closed (and a cleanup
+ * raised) while the events are being handled.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * events: Events to handle (TCP_EVENT_*)
+ *
+ * Returns: TRUE if the socket entry was freed, FALSE otherwise.
+ *
+ */
+static bool_t chitcpd_tcp_handle_events(serverinfo_t *si, chisocketentry_t *entry, unsigned int events)
+{
+    active_chisocket_state_t *socket_state = &entry->socket_state.active;
+
+    if(events & TCP_EVENT_CLEANUP)
+    {
+        chilog(DEBUG, "Event received: cleanup");
+
+        /* Cleanup can only happen in the CLOSED state */
+        assert(entry->tcp_state == CLOSED);
+
+        /* The entry is about to be freed, so it must not stay
+         * in (or be put back into) its worker's run queue */
+        if (si->tcp_engine == TCP_ENGINE_WORKER_POOL)
+        {
+            tcp_worker_t *worker = TCP_WORKER(si, entry);
+
+            pthread_mutex_lock(&worker->lock);
+            if(socket_state->rq_queued)
+                DL_DELETE2(worker->run_queue, entry, socket_state.active.rq_prev, socket_state.active.rq_next);
+            socket_state->rq_queued = FALSE;
+            socket_state->rq_closed = TRUE;
+            pthread_mutex_unlock(&worker->lock);
+        }
+
+        chitcpd_dispatch_tcp(si, entry, CLEANUP);
+        chitcpd_free_socket_entry(si, entry);
+
+        return TRUE;
+    }
+
+    for(int i = 0; i < sizeof(tcp_events) / sizeof(tcp_events[0]); i++)
+    {
+        if(!(events & tcp_events[i].flag))
+            continue;
+
+        /* The rest of the events will be dropped by the cleanup */
+        if(atomic_load(&socket_state->events) & TCP_EVENT_CLEANUP)
+            break;
+
+        chilog(TRACE, "Event received: %s", tcp_events[i].name);
+
+        if(tcp_events[i].flag == TCP_EVENT_NET_RECV)
+            chitcpd_tcp_handle_net_recv(si, entry);
+        else
+            chitcpd_dispatch_tcp(si, entry, tcp_events[i].event);
+
+        if(tcp_events[i].flag == TCP_EVENT_APP_SEND && entry->buf_autotune)
+            chitcpd_tcp_grow_buffer(si, &socket_state->tcp_data, &socket_state->tcp_data.send, &entry->sndbuf_size);
+    }
+
+    /* The TCP thread writes to the receive buffer and reads from the
+     * send buffer, so it can trim both (see circular_buffer_trim) */
+    chitcpd_tcp_trim_buffer(&socket_state->tcp_data.send, &socket_state->tcp_data.snd_idle_seq);
+    chitcpd_tcp_trim_buffer(&socket_state->tcp_data.recv, &socket_state->tcp_data.rcv_idle_seq);
+    chilog(TRACE, "TCP events have been handled");
+
+    return FALSE;
+}
+
+
 /*
  * chitcpd_tcp_thread_func - TCP thread function
  *
@@ -224,18 +929,16 @@ void* chitcpd_tcp_thread_func(void *args)
     chisocketentry_t *entry = tta->entry;
     pthread_setname_np(tta->thread_name);
     active_chisocket_state_t *socket_state = &entry->socket_state.active;
-    tcp_data_t *tcp_data = &socket_state->tcp_data;
+    unsigned int events, sleeping;
     int done = FALSE;
 
-    /* Initialize buffers */
-    circular_buffer_init(&tcp_data->send, TCP_BUFFER_SIZE);
-    circular_buffer_init(&tcp_data->recv, TCP_BUFFER_SIZE);
+    affinity_pin_node(&si->placement, chitcpd_tcp_affinity_slot(si, entry));
 
     chilog(DEBUG, "TCP thread running");
 
     /* The TCP thread is basically an event loop, where we wait for an
      * event to happen that merits waking up the TCP thread. The events
-     * are indicated through the active socket entry's "flags" attribute.
+     * are indicated through the active socket entry's "events" attribute.
      *
      * The possible events are:
      *
@@ -254,10 +957,12 @@ void* chitcpd_tcp_thread_func(void *args)
      *
      * - timeout: A timeout has expired and the TCP thread must handle it.
      *
-     * Once an event is received, we clear the corresponding bit in the flags,
-     * and release the lock on the flags. This means that, while the event is being
-     * processed, the corresponding flag could be raised again (which means
-     * the event loop just happens again, without having to go to sleep).
+     * We take all the pending events at once, clearing them with a single
+     * atomic exchange, and handle them all. This means that, while the events
+     * are being processed, they could be raised again (which means the event
+     * loop just happens again, without having to go to sleep). We only go to
+     * sleep once there are no events, after setting TCP_EVENT_SLEEPING, and
+     * only the thread that clears that bit has to wake us up.
      *
      * For the most part, handling an event just involves calling
      * chitcpd_dispatch_tcp to call the appropriate function in tcp.c,
@@ -268,90 +973,164 @@ void* chitcpd_tcp_thread_func(void *args)
     {
         /* Wait for event */
         chilog(TRACE, "Waiting for TCP event");
-        pthread_mutex_lock(&socket_state->lock_event);
-        while(socket_state->flags.raw == 0)
-            pthread_cond_wait(&socket_state->cv_event, &socket_state->lock_event);
+        sleeping = 0;
+        if(atomic_compare_exchange_strong(&socket_state->events, &sleeping, TCP_EVENT_SLEEPING))
+            chitcpd_tcp_sleep(socket_state);
 
-        if(socket_state->flags.cleanup)
-        {
-            chilog(DEBUG, "Event received: cleanup");
+        events = atomic_exchange(&socket_state->events, 0) & TCP_EVENT_ALL;
+        if(events != 0)
+            done = chitcpd_tcp_handle_events(si, entry, events);
+    }
 
-            /* Cleanup can only happen in the CLOSED state */
-            assert(entry->tcp_state == CLOSED);
+    chilog(DEBUG, "TCP thread is exiting.");
+    return NULL;
+}
 
-            chitcpd_dispatch_tcp(si, entry, CLEANUP);
-            chitcpd_free_socket_entry(si, entry);
 
-            done = TRUE;
-        }
-        else if(socket_state->flags.app_close)
-        {
-            chilog(TRACE, "Event received: app_close");
-            socket_state->flags.app_close = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+/*
+ * chitcpd_tcp_worker_func - TCP worker thread function
+ *
+ * This is the same event loop as chitcpd_tcp_thread_func, except it
+ * runs the events of every socket sharded onto this worker. A socket
+ * is in the worker's run queue while it has raised events (see
+ * chitcpd_tcp_raise_event), and the worker takes its events up to
+ * TCP_WORKER_BATCH times before putting it back at the end of the
+ * queue, so a busy socket cannot starve the others.
+ *
+ * args: Worker (tcp_worker_t)
+ *
+ * Returns: Always returns NULL
+ *
+ */
+void* chitcpd_tcp_worker_func(void *args)
+{
+    tcp_worker_t *worker = (tcp_worker_t *) args;
+    serverinfo_t *si = worker->si;
+    char thread_name[16];
 
-            chitcpd_dispatch_tcp(si, entry, APPLICATION_CLOSE);
-        }
-        else if(socket_state->flags.app_connect)
-        {
-            chilog(TRACE, "Event received: app_connect");
-            socket_state->flags.app_connect = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+    snprintf(thread_name, 16, "tcp-worker-%d", worker->id);
+    pthread_setname_np(thread_name);
+    /* The workers are started before the network I/O threads, so
+     * num_netio_threads isn't set yet (but there is one per stripe) */
+    affinity_pin_cpu(&si->placement, si->connection_stripes + worker->id);
 
-            chitcpd_dispatch_tcp(si, entry, APPLICATION_CONNECT);
-        }
-        else if(socket_state->flags.app_recv)
-        {
-            chilog(TRACE, "Event received: app_recv");
-            socket_state->flags.app_recv = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+    chilog(DEBUG, "TCP worker %i running", worker->id);
 
-            chitcpd_dispatch_tcp(si, entry, APPLICATION_RECEIVE);
+    for(;;)
+    {
+        chisocketentry_t *entry;
+        active_chisocket_state_t *socket_state;
+        unsigned int events, sleeping;
+        bool_t freed = FALSE;
+
+        pthread_mutex_lock(&worker->lock);
+        while(worker->run_queue == NULL && !worker->done)
+            pthread_cond_wait(&worker->cv, &worker->lock);
+
+        if(worker->done)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            break;
         }
-        else if(socket_state->flags.app_send)
+
+        entry = worker->run_queue;
+        socket_state = &entry->socket_state.active;
+        DL_DELETE2(worker->run_queue, entry, socket_state.active.rq_prev, socket_state.active.rq_next);
+        socket_state->rq_queued = FALSE;
+        pthread_mutex_unlock(&worker->lock);
+
+        for(int i = 0; i < TCP_WORKER_BATCH; i++)
         {
-            chilog(TRACE, "Event received: app_send");
-            socket_state->flags.app_send = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+            events = atomic_exchange(&socket_state->events, 0) & TCP_EVENT_ALL;
+            if (events == 0)
+                break;
+            if ((freed = chitcpd_tcp_handle_events(si, entry, events)))
+                break;
+        }
 
-            chitcpd_dispatch_tcp(si, entry, APPLICATION_SEND);
+        if(freed)
+        {
+            pthread_mutex_lock(&worker->lock);
+            pthread_cond_broadcast(&worker->cv_freed);
+            pthread_mutex_unlock(&worker->lock);
         }
-        else if(socket_state->flags.net_recv)
+        else
         {
-            chilog(TRACE, "Event received: net_recv");
+            /* Events that were raised while we were handling this
+             * socket (or that didn't fit in the batch) */
+            sleeping = 0;
+            if(!atomic_compare_exchange_strong(&socket_state->events, &sleeping, TCP_EVENT_SLEEPING))
+                chitcpd_tcp_notify(si, entry);
+        }
+    }
 
-            socket_state->flags.net_recv = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+    chilog(DEBUG, "TCP worker %i is exiting.", worker->id);
+    return NULL;
+}
 
-            chitcpd_dispatch_tcp(si, entry, PACKET_ARRIVAL);
 
-            /* If there are more packets to process, set net_recv to 1 again */
-            if(socket_state->tcp_data.pending_packets != NULL)
-            {
-                pthread_mutex_lock(&socket_state->lock_event);
-                socket_state->flags.net_recv = 1;
-                pthread_mutex_unlock(&socket_state->lock_event);
-            }
-        }
-        else if(socket_state->flags.timeout_rtx)
-        {
-            chilog(TRACE, "Event received: timeout_rtx");
-            socket_state->flags.timeout_rtx = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+/* See tcp_thread.h */
+int chitcpd_tcp_start_workers(serverinfo_t *si)
+{
+    if (si->num_tcp_workers <= 0)
+    {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        si->num_tcp_workers = ncpus > 0 ? (int) ncpus : 1;
+    }
 
-            chitcpd_dispatch_tcp(si, entry, TIMEOUT_RTX);
-        }
-        else if(socket_state->flags.timeout_pst)
-        {
-            chilog(TRACE, "Event received: timeout_pst");
-            socket_state->flags.timeout_pst = 0;
-            pthread_mutex_unlock(&socket_state->lock_event);
+    si->tcp_workers = calloc(si->num_tcp_workers, sizeof(tcp_worker_t));
+    if (si->tcp_workers == NULL)
+        return CHITCP_ENOMEM;
+
+    for(int i = 0; i < si->num_tcp_workers; i++)
+    {
+        tcp_worker_t *worker = &si->tcp_workers[i];
+
+        worker->id = i;
+        worker->si = si;
+        worker->run_queue = NULL;
+        worker->done = FALSE;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cv, NULL);
+        pthread_cond_init(&worker->cv_freed, NULL);
 
-            chitcpd_dispatch_tcp(si, entry, TIMEOUT_PST);
+        if (pthread_create(&worker->thread, NULL, chitcpd_tcp_worker_func, worker) != 0)
+        {
+            perror("Could not create TCP worker thread");
+            si->num_tcp_workers = i;
+            chitcpd_tcp_stop_workers(si);
+            return CHITCP_ETHREAD;
         }
-        chilog(TRACE, "TCP event has been handled");
     }
 
-    chilog(DEBUG, "TCP thread is exiting.");
-    return NULL;
+    chilog(DEBUG, "Started %i TCP workers", si->num_tcp_workers);
+
+    return CHITCP_OK;
+}
+
+
+/* See tcp_thread.h */
+void chitcpd_tcp_stop_workers(serverinfo_t *si)
+{
+    if (si->tcp_workers == NULL)
+        return;
+
+    for(int i = 0; i < si->num_tcp_workers; i++)
+    {
+        tcp_worker_t *worker = &si->tcp_workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        worker->done = TRUE;
+        pthread_cond_signal(&worker->cv);
+        pthread_mutex_unlock(&worker->lock);
+
+        pthread_join(worker->thread, NULL);
+
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cv);
+        pthread_cond_destroy(&worker->cv_freed);
+    }
+
+    free(si->tcp_workers);
+    si->tcp_workers = NULL;
 }
@@ -42,6 +42,87 @@
 
 #include "tcp.h"
 
+/*
+ * chitcpd_tcp_start_thread - Starts running TCP on an active socket
+ *
+ * With the thread-per-socket engine, this starts the socket's TCP thread.
+ * With the worker pool engine, the socket's events will be run by the
+ * worker it is sharded onto, so no thread is started.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns:
+ *  - CHITCP_OK: TCP is running on the socket
+ *  - CHITCP_ETHREAD: Could not create the TCP thread
+ *
+ */
 int chitcpd_tcp_start_thread(serverinfo_t *si, chisocketentry_t *entry);
 
+
+/*
+ * chitcpd_tcp_join_thread - Waits for TCP to stop running on a socket
+ *
+ * Returns once the socket has handled its cleanup event, and its
+ * entry has been freed.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_tcp_join_thread(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_tcp_raise_event - Raises events on a socket
+ *
+ * Can be called from any thread, without holding any locks. If nobody
+ * was handling the socket's events, wakes up the socket's TCP thread or,
+ * with the worker pool engine, puts the socket in its worker's run queue.
+ *
+ * si: Server info
+ *
+ * entry: Pointer to socket entry
+ *
+ * events: Events to raise (TCP_EVENT_* in serverinfo.h)
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_tcp_raise_event(serverinfo_t *si, chisocketentry_t *entry, unsigned int events);
+
+
+/*
+ * chitcpd_tcp_start_workers - Starts the TCP worker pool
+ *
+ * Only used with the worker pool engine. If si->num_tcp_workers is
+ * not positive, one worker per online CPU is started.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: Workers started correctly
+ *  - CHITCP_ENOMEM: Could not allocate memory for the workers
+ *  - CHITCP_ETHREAD: Could not create a worker thread
+ *
+ */
+int chitcpd_tcp_start_workers(serverinfo_t *si);
+
+
+/*
+ * chitcpd_tcp_stop_workers - Stops the TCP worker pool
+ *
+ * Any sockets still in the workers' run queues are not run.
+ *
+ * si: Server info
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_tcp_stop_workers(serverinfo_t *si);
+
 #endif /* TCP_THREAD_H_ */
@@ -0,0 +1,1549 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Inter-daemon transports
+ *
+ *  The chiTCP frames (a chitcphdr_t followed by a TCP packet) between
+ *  two daemons are normally sent over a TCP connection. Daemons can
+ *  also use UDP (one frame per datagram, without TCP's own reliability
+ *  and congestion control getting in the way of chiTCP's), or, for the
+ *  connections to themselves, an AF_UNIX socket or a pair of rings in
+ *  shared memory, which skip the loopback TCP/IP stack altogether.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/un.h>
+#include <sys/mman.h>
+#endif
+#include "transport.h"
+#include "connection.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/addr.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+
+/* Maximum number of segments sent with a single writev() or sendmmsg() */
+#define TRANSPORT_TX_MAX_SEGMENTS (32)
+
+
+/*
+ * transport_new_packet - Allocate a packet for a received frame
+ *
+ * payload_len: Length of the TCP packet
+ *
+ * Returns: The packet, or NULL if it could not be allocated
+ *
+ */
+static tcp_packet_t *transport_new_packet(uint16_t payload_len)
+{
+    tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
+
+    if(packet == NULL || (packet->raw = chitcp_packet_buf_alloc(payload_len)) == NULL)
+    {
+        free(packet);
+        return NULL;
+    }
+    packet->length = payload_len;
+
+    return packet;
+}
+
+
+/*
+ * transport_check_header - Check the chiTCP header of a received frame
+ *
+ * chitcp_header: chiTCP header
+ *
+ * Returns:
+ *  - CHITCP_OK: The frame has a TCP payload
+ *  - CHITCP_EINVAL: The frame has an unknown payload type
+ *
+ */
+static int transport_check_header(chitcphdr_t *chitcp_header)
+{
+    if(chitcp_header->proto != CHITCP_PROTO_TCP)
+    {
+        chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header->proto);
+        return CHITCP_EINVAL;
+    }
+
+    chilog(TRACE, "Received a chiTCP header.");
+    chilog_chitcp(TRACE, (uint8_t *) chitcp_header, LOG_INBOUND);
+    chilog(TRACE, "chiTCP packet contains a TCP payload");
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * TCP
+ */
+
+/*
+ * transport_tcp_listen - Open the daemon's TCP socket
+ *
+ * See transport.h
+ *
+ */
+static int transport_tcp_listen(serverinfo_t *si, socket_t *listener)
+{
+    int yes=1;
+    socket_t realsocket;
+    struct sockaddr_in server_addr;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+
+    /* TODO: Add IPv6 support */
+    server_addr.sin_family = AF_INET;          // IPv4
+    server_addr.sin_port = si->server_port;
+    server_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to any address
+
+    /* Create the socket */
+    realsocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(realsocket == -1)
+    {
+        perror("Could not open network socket");
+        return CHITCP_ESOCKET;
+    }
+
+    /* Make port immediately available after we close the socket */
+    if(setsockopt(realsocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+    {
+        perror("Socket setsockopt() failed");
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    /* Bind the socket to the address */
+    if(bind(realsocket, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1)
+    {
+        perror("Socket bind() failed");
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    /* Start listening (the stripes of a peer all connect at once) */
+    if(listen(realsocket, SOMAXCONN) == -1)
+    {
+        perror("Network socket listen() failed");
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    *listener = realsocket;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_tcp_accept - Accept a TCP connection from another daemon
+ *
+ * See transport.h
+ *
+ */
+static int transport_tcp_accept(serverinfo_t *si, socket_t listener)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t sunSize = sizeof(client_addr);
+    tcpconnentry_t* connection;
+    socket_t realsocket;
+    char addr_str[100];
+
+    /* Accept a connection */
+    if ((realsocket = accept(listener, (struct sockaddr *)&client_addr, &sunSize)) == -1)
+    {
+        perror("Could not accept() connection on network socket");
+        return CHITCP_ESOCKET;
+    }
+
+    chitcp_addr_str((struct sockaddr *) &client_addr, addr_str, sizeof(addr_str));
+    chilog(INFO, "TCP connection received from %s", addr_str);
+
+    /* Add the connection to the connection table. It is either a new
+     * stripe of the peer, or (if we're connecting to ourselves) the
+     * receiving side of one of the stripes we opened. */
+    connection = chitcpd_accept_connection(si, &transport_tcp, realsocket, (struct sockaddr*) &client_addr);
+
+    if (!connection)
+    {
+        chilog(ERROR, "Could not add the connection from %s to the connection table", addr_str);
+        close(realsocket);
+        return CHITCP_ENOMEM;
+    }
+
+    return chitcpd_register_connection(si, connection);
+}
+
+
+/*
+ * transport_tcp_connect - Open a TCP connection to another daemon
+ *
+ * See transport.h
+ *
+ */
+static int transport_tcp_connect(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    struct sockaddr *addr = (struct sockaddr*) &connection->peer_addr;
+    socklen_t addrsize = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    socket_t realsocket = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+    if(realsocket == -1)
+        return CHITCP_ESOCKET;
+
+    if(connect(realsocket, addr, addrsize) == -1)
+    {
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    /* If we're connecting to ourselves, we receive on the accepted
+     * connection instead (see chitcpd_create_connection) */
+    connection->realsocket_send = realsocket;
+    if(!chitcp_addr_is_loopback(addr))
+        connection->realsocket_recv = realsocket;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_tcp_send - Send a list of segments on a TCP connection
+ *
+ * The chiTCP header and TCP packet of each segment are sent directly
+ * from where they are (without copying them into a single buffer) with
+ * as few writev() calls as possible.
+ *
+ * See transport.h
+ *
+ */
+static int transport_tcp_send(tcpconnentry_t *connection, connection_tx_entry_t *batch)
+{
+    struct iovec iov[TRANSPORT_TX_MAX_SEGMENTS * 2];
+    connection_tx_entry_t *elt = batch;
+
+    while(elt)
+    {
+        int iovcnt = 0;
+        ssize_t nbytes;
+
+        for(; elt && iovcnt < TRANSPORT_TX_MAX_SEGMENTS * 2; elt = elt->next)
+        {
+            iov[iovcnt].iov_base = &elt->header;
+            iov[iovcnt].iov_len = sizeof(chitcphdr_t);
+            iovcnt++;
+            iov[iovcnt].iov_base = elt->packet->raw;
+            iov[iovcnt].iov_len = elt->packet->length;
+            iovcnt++;
+        }
+
+        /* Keep writing until the whole iovec has been sent */
+        struct iovec *cur = iov;
+        while(iovcnt > 0)
+        {
+            nbytes = writev(connection->realsocket_send, cur, iovcnt);
+            if(nbytes == -1 && errno == EINTR)
+                continue;
+            if(nbytes <= 0)
+                return CHITCP_ESOCKET;
+
+            while(iovcnt > 0 && (size_t) nbytes >= cur->iov_len)
+            {
+                nbytes -= cur->iov_len;
+                cur++;
+                iovcnt--;
+            }
+            if(iovcnt > 0)
+            {
+                cur->iov_base = (uint8_t *) cur->iov_base + nbytes;
+                cur->iov_len -= nbytes;
+            }
+        }
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_tcp_parse_frames - Process the frames in a connection's buffer
+ *
+ * Every complete chiTCP frame at the start of the reassembly buffer is
+ * delivered. If the buffer ends with a frame whose payload is incomplete,
+ * a packet is allocated for it and becomes the connection's rx_packet,
+ * so the rest of the payload can be read straight into it (see
+ * transport_tcp_recv). A trailing partial chiTCP header is left at the
+ * start of the buffer.
+ *
+ * Must not be called while there is an rx_packet.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry
+ *
+ * Returns:
+ *  - CHITCP_OK: Frames were processed correctly
+ *  - CHITCP_EINVAL: Received a frame with an unknown payload type
+ *  - CHITCP_ENOMEM: Could not allocate a packet
+ *
+ */
+static int transport_tcp_parse_frames(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    size_t offset = 0;
+
+    while(connection->rx_len - offset >= sizeof(chitcphdr_t))
+    {
+        chitcphdr_t *chitcp_header = (chitcphdr_t *) (connection->rx_buf + offset);
+        uint16_t payload_len = chitcp_ntohs(chitcp_header->payload_len);
+        size_t available;
+
+        if(transport_check_header(chitcp_header) != CHITCP_OK)
+            return CHITCP_EINVAL;
+
+        /* Allocate memory for received TCP packet */
+        tcp_packet_t *packet = transport_new_packet(payload_len);
+        if(packet == NULL)
+            return CHITCP_ENOMEM;
+
+        offset += sizeof(chitcphdr_t);
+        available = connection->rx_len - offset;
+
+        if(available < payload_len)
+        {
+            /* The rest of the payload will be read directly into the packet */
+            memcpy(packet->raw, connection->rx_buf + offset, available);
+            connection->rx_packet = packet;
+            connection->rx_packet_len = available;
+            offset += available;
+            break;
+        }
+
+        memcpy(packet->raw, connection->rx_buf + offset, payload_len);
+        offset += payload_len;
+
+        chitcpd_connection_deliver(si, connection, packet);
+    }
+
+    /* Move the partial header (if any) to the start of the buffer */
+    if(offset > 0)
+    {
+        connection->rx_len -= offset;
+        memmove(connection->rx_buf, connection->rx_buf + offset, connection->rx_len);
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_tcp_recv - Read whatever is available on a TCP connection
+ *
+ * If a packet is being received (rx_packet), the rest of its payload is
+ * read directly into the packet, and anything after it is read into the
+ * reassembly buffer, with a single recvmsg().
+ *
+ * The receive socket is shared with the sending side when the peers are
+ * distinct, so it is left in blocking mode and read with MSG_DONTWAIT.
+ * A read that doesn't fill the buffers means the socket has been drained,
+ * so we don't need an extra recvmsg() to find out it would block.
+ *
+ * See transport.h
+ *
+ */
+static int transport_tcp_recv(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t nbytes;
+    size_t requested, packet_left;
+
+    for(;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 0;
+        requested = 0;
+        packet_left = 0;
+
+        if(connection->rx_packet)
+        {
+            tcp_packet_t *packet = connection->rx_packet;
+
+            packet_left = packet->length - connection->rx_packet_len;
+            iov[msg.msg_iovlen].iov_base = packet->raw + connection->rx_packet_len;
+            iov[msg.msg_iovlen].iov_len = packet_left;
+            msg.msg_iovlen++;
+            requested += packet_left;
+        }
+
+        iov[msg.msg_iovlen].iov_base = connection->rx_buf + connection->rx_len;
+        iov[msg.msg_iovlen].iov_len = CONNECTION_RX_BUFFER_SIZE - connection->rx_len;
+        requested += iov[msg.msg_iovlen].iov_len;
+        msg.msg_iovlen++;
+
+        nbytes = recvmsg(connection->realsocket_recv, &msg, MSG_DONTWAIT);
+
+        if (nbytes == 0)
+        {
+            // Peer closed the connection
+            return CHITCP_ESOCKET;
+        }
+        else if (nbytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CHITCP_OK;
+
+            chilog(ERROR, "Socket recvmsg() failed on fd %d: %s", connection->realsocket_recv,
+                    strerror(errno));
+            return CHITCP_ESOCKET;
+        }
+
+        if(connection->rx_packet)
+        {
+            if((size_t) nbytes < packet_left)
+            {
+                connection->rx_packet_len += nbytes;
+                return CHITCP_OK;
+            }
+
+            /* The packet is complete */
+            tcp_packet_t *packet = connection->rx_packet;
+            connection->rx_packet = NULL;
+            connection->rx_len += nbytes - packet_left;
+
+            if (si->state != CHITCPD_STATE_STOPPING)
+                chitcpd_connection_deliver(si, connection, packet);
+            else
+            {
+                chitcp_tcp_packet_free(packet);
+                free(packet);
+            }
+        }
+        else
+            connection->rx_len += nbytes;
+
+        if (si->state == CHITCPD_STATE_STOPPING)
+            connection->rx_len = 0;
+        else if (transport_tcp_parse_frames(si, connection) != CHITCP_OK)
+            return CHITCP_ESOCKET;
+
+        if ((size_t) nbytes < requested)
+            return CHITCP_OK;
+    }
+}
+
+
+const transport_t transport_tcp =
+{
+    .name = "tcp",
+    .local = FALSE,
+    .listen = transport_tcp_listen,
+    .accept = transport_tcp_accept,
+    .connect = transport_tcp_connect,
+    .send = transport_tcp_send,
+    .recv = transport_tcp_recv,
+};
+
+
+#ifdef __linux__
+
+/*
+ * Message-based transports (UDP and AF_UNIX)
+ */
+
+/* Number of messages received with a single recvmmsg() (each one
+ * goes in its own TRANSPORT_MSG_MAX-byte slot of rx_buf) */
+#define TRANSPORT_RX_MAX_MSGS (CONNECTION_RX_BUFFER_SIZE / TRANSPORT_MSG_MAX)
+
+
+/*
+ * transport_msg_send - Send a list of segments, one message per segment
+ *
+ * See transport.h
+ *
+ */
+static int transport_msg_send(tcpconnentry_t *connection, connection_tx_entry_t *batch)
+{
+    struct mmsghdr msgs[TRANSPORT_TX_MAX_SEGMENTS];
+    struct iovec iov[TRANSPORT_TX_MAX_SEGMENTS * 2];
+    connection_tx_entry_t *elt = batch;
+
+    while(elt)
+    {
+        unsigned int nmsgs = 0, sent = 0;
+        int n;
+
+        memset(msgs, 0, sizeof(msgs));
+        for(; elt && nmsgs < TRANSPORT_TX_MAX_SEGMENTS; elt = elt->next)
+        {
+            if(sizeof(chitcphdr_t) + elt->packet->length > TRANSPORT_MSG_MAX)
+            {
+                chilog(WARNING, "Dropping a %zu-byte packet, which does not fit in a message", elt->packet->length);
+                continue;
+            }
+
+            iov[nmsgs * 2].iov_base = &elt->header;
+            iov[nmsgs * 2].iov_len = sizeof(chitcphdr_t);
+            iov[nmsgs * 2 + 1].iov_base = elt->packet->raw;
+            iov[nmsgs * 2 + 1].iov_len = elt->packet->length;
+            msgs[nmsgs].msg_hdr.msg_iov = &iov[nmsgs * 2];
+            msgs[nmsgs].msg_hdr.msg_iovlen = 2;
+            nmsgs++;
+        }
+
+        while(sent < nmsgs)
+        {
+            n = sendmmsg(connection->realsocket_send, msgs + sent, nmsgs - sent, 0);
+            if(n == -1)
+            {
+                /* A UDP socket reports that an earlier datagram could
+                 * not be delivered on a later send. That datagram is
+                 * simply lost, so we just try again. */
+                if(errno == EINTR || errno == ECONNREFUSED)
+                    continue;
+                return CHITCP_ESOCKET;
+            }
+            sent += n;
+        }
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_msg_deliver - Deliver a frame received as a single message
+ *
+ * Malformed messages are dropped.
+ *
+ * si: Server info
+ *
+ * connection: Connection entry
+ *
+ * msg, len: Message
+ *
+ * Returns: Nothing.
+ *
+ */
+static void transport_msg_deliver(serverinfo_t *si, tcpconnentry_t *connection, uint8_t *msg, size_t len)
+{
+    chitcphdr_t *chitcp_header = (chitcphdr_t *) msg;
+    tcp_packet_t *packet;
+
+    if(len < sizeof(chitcphdr_t) || len - sizeof(chitcphdr_t) != chitcp_ntohs(chitcp_header->payload_len))
+    {
+        chilog(WARNING, "Dropping a malformed %zu-byte message", len);
+        return;
+    }
+
+    if(transport_check_header(chitcp_header) != CHITCP_OK)
+        return;
+
+    if((packet = transport_new_packet(len - sizeof(chitcphdr_t))) == NULL)
+    {
+        chilog(ERROR, "Could not allocate a received packet");
+        return;
+    }
+    memcpy(packet->raw, msg + sizeof(chitcphdr_t), packet->length);
+
+    chitcpd_connection_deliver(si, connection, packet);
+}
+
+
+/*
+ * transport_msg_recv - Receive whatever messages are available
+ *
+ * See transport.h
+ *
+ */
+static int transport_msg_recv(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    struct mmsghdr msgs[TRANSPORT_RX_MAX_MSGS];
+    struct iovec iov[TRANSPORT_RX_MAX_MSGS];
+    bool_t seqpacket = connection->transport != &transport_udp;
+    int n;
+
+    for(;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i=0; i < TRANSPORT_RX_MAX_MSGS; i++)
+        {
+            iov[i].iov_base = connection->rx_buf + i * TRANSPORT_MSG_MAX;
+            iov[i].iov_len = TRANSPORT_MSG_MAX;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = recvmmsg(connection->realsocket_recv, msgs, TRANSPORT_RX_MAX_MSGS, MSG_DONTWAIT, NULL);
+        if(n == -1)
+        {
+            if(errno == EINTR || errno == ECONNREFUSED)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CHITCP_OK;
+
+            chilog(ERROR, "Socket recvmmsg() failed on fd %d: %s", connection->realsocket_recv,
+                    strerror(errno));
+            return CHITCP_ESOCKET;
+        }
+
+        for(int i=0; i < n; i++)
+        {
+            /* An empty record means that the peer closed the AF_UNIX socket */
+            if(msgs[i].msg_len == 0 && seqpacket)
+                return CHITCP_ESOCKET;
+
+            if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                chilog(WARNING, "Dropping a message longer than %i bytes", TRANSPORT_MSG_MAX);
+                continue;
+            }
+
+            if(si->state != CHITCPD_STATE_STOPPING)
+                transport_msg_deliver(si, connection, iov[i].iov_base, msgs[i].msg_len);
+        }
+
+        if(n < TRANSPORT_RX_MAX_MSGS)
+            return CHITCP_OK;
+    }
+}
+
+
+/*
+ * UDP
+ */
+
+/*
+ * transport_udp_socket - Create a UDP socket on a local address
+ *
+ * All the UDP sockets on the daemon's port share it with SO_REUSEPORT.
+ * A datagram goes to the socket that is connected to its source, if
+ * there is one, and to the unconnected listener otherwise.
+ *
+ * addr: Local address
+ *
+ * Returns: The socket, or -1 if it could not be created.
+ *
+ */
+static socket_t transport_udp_socket(struct sockaddr *addr)
+{
+    int yes=1;
+    socklen_t addrsize = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    socket_t realsocket = socket(addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(realsocket == -1)
+        return -1;
+
+    if(setsockopt(realsocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+       setsockopt(realsocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1 ||
+       bind(realsocket, addr, addrsize) == -1)
+    {
+        close(realsocket);
+        return -1;
+    }
+
+    return realsocket;
+}
+
+
+/*
+ * transport_udp_listen - Open the daemon's UDP socket
+ *
+ * See transport.h
+ *
+ */
+static int transport_udp_listen(serverinfo_t *si, socket_t *listener)
+{
+    struct sockaddr_in server_addr;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+
+    /* TODO: Add IPv6 support */
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = si->server_port;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    *listener = transport_udp_socket((struct sockaddr *) &server_addr);
+    if(*listener == -1)
+    {
+        perror("Could not open UDP network socket");
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_udp_open - Open the connection for a new UDP peer
+ *
+ * The connection gets its own socket, which is bound to the daemon's
+ * port and connected to the peer, so the peer's next datagrams are
+ * received on it (and not on the listener).
+ *
+ * si: Server info
+ *
+ * listener: Daemon's UDP socket
+ *
+ * addr: Source of the peer's first datagram
+ *
+ * Returns: The registered connection, or NULL if it could not be opened.
+ *
+ */
+static tcpconnentry_t *transport_udp_open(serverinfo_t *si, socket_t listener, struct sockaddr *addr)
+{
+    struct sockaddr_storage local_addr;
+    socklen_t addrsize = sizeof(local_addr);
+    tcpconnentry_t *connection;
+    socket_t realsocket;
+    char addr_str[100];
+
+    chitcp_addr_str(addr, addr_str, sizeof(addr_str));
+    chilog(INFO, "UDP peer found at %s", addr_str);
+
+    if(getsockname(listener, (struct sockaddr *) &local_addr, &addrsize) == -1 ||
+       (realsocket = transport_udp_socket((struct sockaddr *) &local_addr)) == -1)
+    {
+        perror("Could not open a UDP socket for a peer");
+        return NULL;
+    }
+
+    addrsize = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    if(connect(realsocket, addr, addrsize) == -1)
+    {
+        perror("Could not connect() a UDP socket to a peer");
+        close(realsocket);
+        return NULL;
+    }
+
+    /* As with TCP, this is either a new stripe of the peer, or the
+     * receiving side of one of the stripes we opened to ourselves. */
+    connection = chitcpd_accept_connection(si, &transport_udp, realsocket, addr);
+    if (!connection)
+    {
+        chilog(ERROR, "Could not add the connection from %s to the connection table", addr_str);
+        close(realsocket);
+        return NULL;
+    }
+
+    if(chitcpd_register_connection(si, connection) != CHITCP_OK)
+        return NULL;
+
+    return connection;
+}
+
+
+/*
+ * transport_udp_accept - Receive the datagrams sent to the daemon's UDP socket
+ *
+ * These are the first datagrams from a new peer (which get a new
+ * connection), and datagrams that were received before the peer's
+ * connection was opened.
+ *
+ * See transport.h
+ *
+ */
+static int transport_udp_accept(serverinfo_t *si, socket_t listener)
+{
+    uint8_t msg[TRANSPORT_MSG_MAX];
+    struct sockaddr_storage addr;
+    socklen_t addrsize;
+    tcpconnentry_t *connection;
+    ssize_t nbytes;
+
+    for(;;)
+    {
+        addrsize = sizeof(addr);
+        nbytes = recvfrom(listener, msg, sizeof(msg), MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *) &addr, &addrsize);
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CHITCP_OK;
+            perror("Could not receive on UDP network socket");
+            return CHITCP_ESOCKET;
+        }
+
+        if((size_t) nbytes > sizeof(msg))
+        {
+            chilog(WARNING, "Dropping a datagram longer than %i bytes", TRANSPORT_MSG_MAX);
+            continue;
+        }
+
+        if(addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+            continue;
+
+        connection = chitcpd_find_connection(si, (struct sockaddr *) &addr);
+        if(connection == NULL)
+            connection = transport_udp_open(si, listener, (struct sockaddr *) &addr);
+
+        if(connection != NULL && si->state != CHITCPD_STATE_STOPPING)
+            transport_msg_deliver(si, connection, msg, nbytes);
+    }
+}
+
+
+/*
+ * transport_udp_connect - Open a UDP connection to another daemon
+ *
+ * See transport.h
+ *
+ */
+static int transport_udp_connect(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    struct sockaddr *addr = (struct sockaddr*) &connection->peer_addr;
+    socklen_t addrsize = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    socket_t realsocket = socket(addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(realsocket == -1)
+        return CHITCP_ESOCKET;
+
+    if(connect(realsocket, addr, addrsize) == -1)
+    {
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    /* If we're connecting to ourselves, we receive on the socket that
+     * the network thread opens when our first datagram arrives */
+    connection->realsocket_send = realsocket;
+    if(!chitcp_addr_is_loopback(addr))
+        connection->realsocket_recv = realsocket;
+
+    return CHITCP_OK;
+}
+
+
+const transport_t transport_udp =
+{
+    .name = "udp",
+    .local = FALSE,
+    .listen = transport_udp_listen,
+    .accept = transport_udp_accept,
+    .connect = transport_udp_connect,
+    .send = transport_msg_send,
+    .recv = transport_msg_recv,
+};
+
+
+/*
+ * AF_UNIX
+ */
+
+/* How long the network thread waits for the hello of a new AF_UNIX
+ * connection (in milliseconds) */
+#define TRANSPORT_HELLO_TIMEOUT (1000)
+
+/* First message on an AF_UNIX connection. Since there is no IP address
+ * to get from the socket, the daemon that connects sends the address
+ * the connection stands for (always a loopback address, see
+ * transport_for_peer). With shared memory, the memory of the rings
+ * comes with it (as an SCM_RIGHTS file descriptor). */
+typedef struct transport_hello
+{
+    struct sockaddr_storage addr;
+    uint8_t shm;
+} transport_hello_t;
+
+
+/*
+ * transport_unix_addr - Build the AF_UNIX address of a daemon's local transports
+ *
+ * This is an abstract address (which doesn't have to be removed from
+ * the filesystem) derived from the daemon's port.
+ *
+ * addr: Address to initialize
+ *
+ * port: Daemon's port (in host byte order)
+ *
+ * Returns: Length of the address.
+ *
+ */
+static socklen_t transport_unix_addr(struct sockaddr_un *addr, uint16_t port)
+{
+    int len;
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "chitcpd.link.%u", port);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+
+/*
+ * transport_unix_listen - Open the daemon's AF_UNIX socket
+ *
+ * See transport.h
+ *
+ */
+static int transport_unix_listen(serverinfo_t *si, socket_t *listener)
+{
+    struct sockaddr_un addr;
+    socklen_t addrsize = transport_unix_addr(&addr, chitcp_ntohs(si->server_port));
+    socket_t realsocket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if(realsocket == -1)
+    {
+        perror("Could not open AF_UNIX network socket");
+        return CHITCP_ESOCKET;
+    }
+
+    if(bind(realsocket, (struct sockaddr *) &addr, addrsize) == -1 ||
+       listen(realsocket, SOMAXCONN) == -1)
+    {
+        perror("Could not listen on AF_UNIX network socket");
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    *listener = realsocket;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_unix_open - Open an AF_UNIX connection to the peer's daemon
+ *
+ * The peer's daemon is on this host, so it is ourselves, and we
+ * receive on the connection that we accept (see transport_unix_accept).
+ *
+ * connection: Connection entry
+ *
+ * memfd: Shared memory to send with the hello (-1 if none)
+ *
+ * Returns:
+ *  - CHITCP_OK: Connection opened correctly
+ *  - CHITCP_ESOCKET: Could not connect, or send the hello
+ *
+ */
+static int transport_unix_open(tcpconnentry_t *connection, int memfd)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    socklen_t addrsize = transport_unix_addr(&addr, GET_CHITCPD_PORT);
+    transport_hello_t hello;
+    struct iovec iov;
+    struct msghdr msg;
+    socket_t realsocket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if(realsocket == -1)
+        return CHITCP_ESOCKET;
+
+    if(connect(realsocket, (struct sockaddr *) &addr, addrsize) == -1)
+    {
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    memcpy(&hello.addr, &connection->peer_addr, sizeof(struct sockaddr_storage));
+    hello.shm = memfd != -1;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(memfd != -1)
+    {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    }
+
+    if(sendmsg(realsocket, &msg, 0) != sizeof(hello))
+    {
+        close(realsocket);
+        return CHITCP_ESOCKET;
+    }
+
+    connection->realsocket_send = realsocket;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_unix_connect - Open an AF_UNIX connection to ourselves
+ *
+ * See transport.h
+ *
+ */
+static int transport_unix_connect(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    return transport_unix_open(connection, -1);
+}
+
+
+static int transport_shm_attach(tcpconnentry_t *connection, int memfd);
+
+/*
+ * transport_unix_accept - Accept an AF_UNIX connection
+ *
+ * This is a connection to ourselves, either over AF_UNIX or with
+ * shared memory, depending on what the hello says.
+ *
+ * See transport.h
+ *
+ */
+static int transport_unix_accept(serverinfo_t *si, socket_t listener)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    transport_hello_t hello;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    const transport_t *transport;
+    tcpconnentry_t *connection;
+    int memfd = -1;
+    int rc = CHITCP_OK;
+    socket_t realsocket;
+
+    if((realsocket = accept(listener, NULL, NULL)) == -1)
+    {
+        perror("Could not accept() connection on AF_UNIX network socket");
+        return CHITCP_ESOCKET;
+    }
+
+    /* The hello is sent right after connecting, so we don't wait long */
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    pfd.fd = realsocket;
+    pfd.events = POLLIN;
+
+    if(poll(&pfd, 1, TRANSPORT_HELLO_TIMEOUT) != 1 || recvmsg(realsocket, &msg, 0) != sizeof(hello))
+    {
+        chilog(ERROR, "Did not receive a hello on an AF_UNIX connection");
+        rc = CHITCP_ESOCKET;
+        goto done;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    if((hello.addr.ss_family != AF_INET && hello.addr.ss_family != AF_INET6) || (hello.shm && memfd == -1))
+    {
+        chilog(ERROR, "Received a malformed hello on an AF_UNIX connection");
+        rc = CHITCP_EINVAL;
+        goto done;
+    }
+
+    chilog(INFO, "AF_UNIX connection received (%s)", hello.shm ? "shared memory" : "records");
+
+    transport = hello.shm ? &transport_shm : &transport_unix;
+    connection = chitcpd_accept_connection(si, transport, realsocket, (struct sockaddr *) &hello.addr);
+    if (!connection)
+    {
+        chilog(ERROR, "Could not add an AF_UNIX connection to the connection table");
+        rc = CHITCP_ENOMEM;
+        goto done;
+    }
+    /* The socket now belongs to the connection entry */
+    realsocket = -1;
+
+    if(hello.shm && (rc = transport_shm_attach(connection, memfd)) != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not map the shared memory of a connection");
+        goto done;
+    }
+
+    rc = chitcpd_register_connection(si, connection);
+
+done:
+    if(memfd != -1)
+        close(memfd);
+    if(rc != CHITCP_OK && realsocket != -1)
+        close(realsocket);
+
+    return rc;
+}
+
+
+const transport_t transport_unix =
+{
+    .name = "unix",
+    .local = TRUE,
+    .listen = transport_unix_listen,
+    .accept = transport_unix_accept,
+    .connect = transport_unix_connect,
+    .send = transport_msg_send,
+    .recv = transport_msg_recv,
+};
+
+
+/*
+ * Shared memory
+ */
+
+/* A single-producer, single-consumer byte ring. The frames are stored
+ * one after the other (a chitcphdr_t followed by the TCP packet), and
+ * wrap around the end of the ring. head and tail only ever grow (so
+ * the ring is empty when they are equal), and are only written by the
+ * consumer and the producer, respectively.
+ *
+ * Before it sleeps, the consumer sets waiting, and the producer, when
+ * it sees it set, clears it and "kicks" the consumer by sending a byte
+ * on the AF_UNIX socket. */
+typedef struct transport_shm_ring
+{
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) atomic_int waiting;
+    atomic_int closed;              /* The consumer has gone away */
+    _Alignas(64) uint8_t data[TRANSPORT_SHM_RING_SIZE];
+} transport_shm_ring_t;
+
+/* Shared memory of a connection. The first ring carries the frames
+ * sent by the daemon that opened the connection. */
+typedef struct transport_shm_rings
+{
+    transport_shm_ring_t rings[2];
+} transport_shm_rings_t;
+
+/* Per-connection state. When a daemon connects to itself, the sending
+ * and receiving sides are two different connections (and each one
+ * has its own mapping of the memory). */
+typedef struct transport_shm
+{
+    transport_shm_ring_t *tx;
+    transport_shm_ring_t *rx;
+    void *tx_map;
+    void *rx_map;
+} transport_shm_t;
+
+/* How long a producer waits for room in a full ring before it tries again */
+#define TRANSPORT_SHM_FULL_WAIT_NS (50000L)
+
+
+/*
+ * transport_shm_map - Map the shared memory of a connection
+ *
+ * memfd: File descriptor of the memory
+ *
+ * Returns: The mapping, or NULL if it could not be mapped.
+ *
+ */
+static void *transport_shm_map(int memfd)
+{
+    void *map = mmap(NULL, sizeof(transport_shm_rings_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+
+/*
+ * transport_shm_copy - Copy bytes to or from a ring
+ *
+ * ring: Ring
+ *
+ * pos: Position in the ring (it will wrap around)
+ *
+ * buf, len: Bytes to copy
+ *
+ * to_ring: TRUE to copy into the ring, FALSE to copy out of it
+ *
+ * Returns: Nothing.
+ *
+ */
+static void transport_shm_copy(transport_shm_ring_t *ring, unsigned int pos, void *buf, size_t len, bool_t to_ring)
+{
+    size_t offset = pos % TRANSPORT_SHM_RING_SIZE;
+    size_t first = MIN(len, TRANSPORT_SHM_RING_SIZE - offset);
+
+    if(to_ring)
+    {
+        memcpy(ring->data + offset, buf, first);
+        memcpy(ring->data, (uint8_t *) buf + first, len - first);
+    }
+    else
+    {
+        memcpy(buf, ring->data + offset, first);
+        memcpy((uint8_t *) buf + first, ring->data, len - first);
+    }
+}
+
+
+/*
+ * transport_shm_kick - Wake up the consumer of a ring, if it is sleeping
+ *
+ * connection: Connection entry
+ *
+ * ring: Ring that has just been written to
+ *
+ * Returns:
+ *  - CHITCP_OK: The consumer is awake
+ *  - CHITCP_ESOCKET: Could not write to the AF_UNIX socket
+ *
+ */
+static int transport_shm_kick(tcpconnentry_t *connection, transport_shm_ring_t *ring)
+{
+    char c = 0;
+
+    if(atomic_load(&ring->waiting) && atomic_exchange(&ring->waiting, 0))
+        while(send(connection->realsocket_send, &c, 1, 0) == -1)
+            if(errno != EINTR)
+                return CHITCP_ESOCKET;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_shm_connect - Open a shared-memory connection to ourselves
+ *
+ * See transport.h
+ *
+ */
+static int transport_shm_connect(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    transport_shm_t *shm;
+    int memfd, rc;
+
+    memfd = memfd_create("chitcpd-link", MFD_CLOEXEC);
+    if(memfd == -1)
+    {
+        perror("Could not create the shared memory of a connection");
+        return CHITCP_ENOMEM;
+    }
+
+    shm = calloc(1, sizeof(transport_shm_t));
+    if(shm == NULL || ftruncate(memfd, sizeof(transport_shm_rings_t)) == -1 ||
+       (shm->tx_map = transport_shm_map(memfd)) == NULL)
+    {
+        perror("Could not create the shared memory of a connection");
+        free(shm);
+        close(memfd);
+        return CHITCP_ENOMEM;
+    }
+    shm->tx = &((transport_shm_rings_t *) shm->tx_map)->rings[0];
+    connection->transport_data = shm;
+
+    rc = transport_unix_open(connection, memfd);
+    close(memfd);
+
+    return rc;
+}
+
+
+/*
+ * transport_shm_attach - Map the shared memory of an accepted connection
+ *
+ * connection: Connection entry
+ *
+ * memfd: Memory received with the hello
+ *
+ * Returns:
+ *  - CHITCP_OK: Memory mapped correctly
+ *  - CHITCP_ENOMEM: Could not map the memory
+ *
+ */
+static int transport_shm_attach(tcpconnentry_t *connection, int memfd)
+{
+    transport_shm_t *shm = connection->transport_data;
+    void *map = transport_shm_map(memfd);
+
+    if(map == NULL)
+        return CHITCP_ENOMEM;
+
+    /* If this is not the receiving side of a connection we opened to
+     * ourselves, we send on the second ring */
+    if(shm == NULL)
+    {
+        if((shm = calloc(1, sizeof(transport_shm_t))) == NULL)
+        {
+            munmap(map, sizeof(transport_shm_rings_t));
+            return CHITCP_ENOMEM;
+        }
+        shm->tx_map = map;
+        shm->tx = &((transport_shm_rings_t *) map)->rings[1];
+        connection->transport_data = shm;
+    }
+
+    shm->rx_map = map;
+    shm->rx = &((transport_shm_rings_t *) map)->rings[0];
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_shm_send - Copy a list of segments into the ring
+ *
+ * If the ring is full, we wait for the consumer to make room (unless
+ * it has gone away).
+ *
+ * See transport.h
+ *
+ */
+static int transport_shm_send(tcpconnentry_t *connection, connection_tx_entry_t *batch)
+{
+    transport_shm_t *shm = connection->transport_data;
+    transport_shm_ring_t *ring = shm->tx;
+    struct timespec full_wait = {0, TRANSPORT_SHM_FULL_WAIT_NS};
+
+    for(connection_tx_entry_t *elt = batch; elt; elt = elt->next)
+    {
+        size_t len = sizeof(chitcphdr_t) + elt->packet->length;
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while(TRANSPORT_SHM_RING_SIZE - (tail - atomic_load_explicit(&ring->head, memory_order_acquire)) < len)
+        {
+            if(atomic_load(&ring->closed))
+                return CHITCP_ESOCKET;
+            if(transport_shm_kick(connection, ring) != CHITCP_OK)
+                return CHITCP_ESOCKET;
+            nanosleep(&full_wait, NULL);
+        }
+
+        transport_shm_copy(ring, tail, &elt->header, sizeof(chitcphdr_t), TRUE);
+        transport_shm_copy(ring, tail + sizeof(chitcphdr_t), elt->packet->raw, elt->packet->length, TRUE);
+        atomic_store(&ring->tail, tail + len);
+
+        if(transport_shm_kick(connection, ring) != CHITCP_OK)
+            return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_shm_recv - Deliver the frames in the ring
+ *
+ * The AF_UNIX socket only carries kicks (which are discarded), and
+ * tells us when the peer has gone away.
+ *
+ * See transport.h
+ *
+ */
+static int transport_shm_recv(serverinfo_t *si, tcpconnentry_t *connection)
+{
+    transport_shm_t *shm = connection->transport_data;
+    transport_shm_ring_t *ring = shm->rx;
+    unsigned int head, tail;
+    char kicks[64];
+    ssize_t nbytes;
+
+    while((nbytes = recv(connection->realsocket_recv, kicks, sizeof(kicks), MSG_DONTWAIT)) > 0);
+    if(nbytes == 0)
+        return CHITCP_ESOCKET;
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        chilog(ERROR, "Socket recv() failed on fd %d: %s", connection->realsocket_recv, strerror(errno));
+        return CHITCP_ESOCKET;
+    }
+
+    atomic_store(&ring->waiting, 0);
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while(head != tail)
+    {
+        chitcphdr_t chitcp_header;
+        tcp_packet_t *packet;
+        uint16_t payload_len;
+
+        transport_shm_copy(ring, head, &chitcp_header, sizeof(chitcphdr_t), FALSE);
+        payload_len = chitcp_ntohs(chitcp_header.payload_len);
+
+        if(transport_check_header(&chitcp_header) != CHITCP_OK)
+            return CHITCP_ESOCKET;
+        if((packet = transport_new_packet(payload_len)) == NULL)
+            return CHITCP_ESOCKET;
+
+        transport_shm_copy(ring, head + sizeof(chitcphdr_t), packet->raw, payload_len, FALSE);
+        head += sizeof(chitcphdr_t) + payload_len;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if (si->state != CHITCPD_STATE_STOPPING)
+            chitcpd_connection_deliver(si, connection, packet);
+        else
+        {
+            chitcp_tcp_packet_free(packet);
+            free(packet);
+        }
+
+        if(head == tail)
+            tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * transport_shm_arm - Ask to be kicked when the producer writes to the ring
+ *
+ * See transport.h
+ *
+ */
+static bool_t transport_shm_arm(tcpconnentry_t *connection)
+{
+    transport_shm_ring_t *ring = ((transport_shm_t *) connection->transport_data)->rx;
+
+    atomic_store(&ring->waiting, 1);
+
+    return atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+
+/*
+ * transport_shm_close - Stop consuming the ring
+ *
+ * See transport.h
+ *
+ */
+static void transport_shm_close(tcpconnentry_t *connection)
+{
+    transport_shm_t *shm = connection->transport_data;
+
+    if(shm == NULL || shm->rx == NULL)
+        return;
+
+    atomic_store(&shm->rx->closed, 1);
+    if(shm->rx_map != shm->tx_map)
+        munmap(shm->rx_map, sizeof(transport_shm_rings_t));
+    shm->rx = NULL;
+    shm->rx_map = NULL;
+}
+
+
+/*
+ * transport_shm_free - Unmap the shared memory of a connection
+ *
+ * See transport.h
+ *
+ */
+static void transport_shm_free(tcpconnentry_t *connection)
+{
+    transport_shm_t *shm = connection->transport_data;
+
+    if(shm == NULL)
+        return;
+
+    transport_shm_close(connection);
+    if(shm->tx_map)
+        munmap(shm->tx_map, sizeof(transport_shm_rings_t));
+    free(shm);
+    connection->transport_data = NULL;
+}
+
+
+const transport_t transport_shm =
+{
+    .name = "shm",
+    .local = TRUE,
+    .listen = transport_unix_listen,
+    .accept = transport_unix_accept,
+    .connect = transport_shm_connect,
+    .send = transport_shm_send,
+    .recv = transport_shm_recv,
+    .arm = transport_shm_arm,
+    .close = transport_shm_close,
+    .free = transport_shm_free,
+};
+
+#endif /* __linux__ */
+
+
+/* See transport.h */
+const transport_t *transport_lookup(const char *name)
+{
+    static const transport_t *transports[] =
+    {
+        &transport_tcp,
+#ifdef __linux__
+        &transport_udp,
+        &transport_unix,
+        &transport_shm,
+#endif
+    };
+
+    for(size_t i=0; i < sizeof(transports) / sizeof(transports[0]); i++)
+        if(!strcmp(transports[i]->name, name))
+            return transports[i];
+
+    return NULL;
+}
+
+
+/* See transport.h */
+const transport_t *transport_for_peer(serverinfo_t *si, struct sockaddr *addr)
+{
+    if(si->transport->local && !chitcp_addr_is_loopback(addr))
+        return &transport_tcp;
+
+    return si->transport;
+}
@@ -0,0 +1,140 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Inter-daemon transports (see transport.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include "serverinfo.h"
+
+/* Largest chiTCP frame that can be sent as a single message (a datagram,
+ * or an AF_UNIX record). Larger frames are dropped. */
+#define TRANSPORT_MSG_MAX (2048)
+
+/* Size of each of the two rings of a shared-memory connection */
+#define TRANSPORT_SHM_RING_SIZE (1 << 18)
+
+/* A transport carries the chiTCP frames between two daemons. Every
+ * connection entry has one, which is picked when the connection is
+ * opened (see transport_for_peer). Transports that are only used
+ * with peers on the same host are "local" (the peer's address is then
+ * the loopback address, since there is no real address to get it from).
+ *
+ * listen, accept, connect and recv can only be called by the network
+ * and network I/O threads, while send is called by the connection's
+ * writer (see chitcpd_send_tcp_packet). arm, close and free are optional. */
+typedef struct transport
+{
+    const char *name;
+    bool_t local;
+
+    /* Open the daemon's listener for this transport */
+    int (*listen)(serverinfo_t *si, socket_t *listener);
+
+    /* Handle activity on the listener (usually, by accepting a connection,
+     * and adding it to the connection table) */
+    int (*accept)(serverinfo_t *si, socket_t listener);
+
+    /* Connect a new connection entry to connection->peer_addr. This sets
+     * realsocket_send, and realsocket_recv if the connection can receive
+     * on the same socket (otherwise, it is set when the connection
+     * is accepted, see chitcpd_accept_connection) */
+    int (*connect)(serverinfo_t *si, tcpconnentry_t *connection);
+
+    /* Send a list of segments */
+    int (*send)(tcpconnentry_t *connection, connection_tx_entry_t *batch);
+
+    /* Read, and deliver, whatever is available on realsocket_recv.
+     * Returns CHITCP_ESOCKET once the connection can't be received on */
+    int (*recv)(serverinfo_t *si, tcpconnentry_t *connection);
+
+    /* Called before the network I/O thread sleeps on realsocket_recv.
+     * Returns TRUE if there is already something to receive */
+    bool_t (*arm)(tcpconnentry_t *connection);
+
+    /* Release the receiving side of the connection */
+    void (*close)(tcpconnentry_t *connection);
+
+    /* Release whatever is left when the daemon is freed */
+    void (*free)(tcpconnentry_t *connection);
+} transport_t;
+
+/* Frames over a TCP stream (the default) */
+extern const transport_t transport_tcp;
+
+#ifdef __linux__
+/* One frame per UDP datagram */
+extern const transport_t transport_udp;
+
+/* One frame per record of an AF_UNIX SOCK_SEQPACKET socket */
+extern const transport_t transport_unix;
+
+/* Frames in a pair of shared-memory rings, with an AF_UNIX socket
+ * to hand over the memory and to wake up the receiver */
+extern const transport_t transport_shm;
+#endif
+
+
+/*
+ * transport_lookup - Find a transport by name
+ *
+ * name: "tcp", "udp", "unix" or "shm"
+ *
+ * Returns: The transport, or NULL if there is no such transport (or
+ *          it is not supported on this platform)
+ *
+ */
+const transport_t *transport_lookup(const char *name);
+
+
+/*
+ * transport_for_peer - Pick the transport to a peer's daemon
+ *
+ * This is the daemon's transport (si->transport), unless it is local
+ * and the peer is not on this host, in which case TCP is used.
+ *
+ * si: Server info
+ *
+ * addr: Address of the peer's daemon
+ *
+ * Returns: The transport.
+ *
+ */
+const transport_t *transport_for_peer(serverinfo_t *si, struct sockaddr *addr);
+
+#endif /* TRANSPORT_H_ */
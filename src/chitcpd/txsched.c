@@ -0,0 +1,159 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Transmit scheduler
+ *
+ *  All the sockets hashed onto the same connection to a peer's daemon
+ *  share it, so its writer (see chitcpd_connection_send_packet) picks
+ *  the segments to send with a deficit round robin scheduler instead
+ *  of in arrival order: a bulk transfer can't starve the sockets that
+ *  only send now and then, and sockets can be given a larger share
+ *  of the connection, or strict priority over the others, with
+ *  SO_PRIORITY.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "txsched.h"
+#include "chitcp/utlist.h"
+
+/* What a segment costs a flow's deficit */
+#define TX_ENTRY_COST(entry) (sizeof(chitcphdr_t) + (entry)->packet->length)
+
+/* See txsched.h */
+void tx_sched_init(tx_sched_t *sched)
+{
+    sched->strict = NULL;
+    sched->flows = NULL;
+    sched->credited = FALSE;
+}
+
+/* See txsched.h */
+void tx_flow_init(tx_flow_t *flow)
+{
+    flow->queue = NULL;
+    flow->deficit = 0;
+    flow->weight = 1;
+    flow->strict = FALSE;
+    flow->active = FALSE;
+    flow->prev = flow->next = NULL;
+}
+
+/* See txsched.h */
+void tx_flow_set_priority(tx_flow_t *flow, int priority)
+{
+    if (flow->active)
+        return;
+
+    flow->strict = (priority >= TX_PRIO_STRICT);
+    flow->weight = (priority > 0 && priority < TX_PRIO_STRICT) ? priority + 1 : 1;
+}
+
+/* See txsched.h */
+void tx_sched_enqueue(tx_sched_t *sched, tx_flow_t *flow, connection_tx_entry_t *entry)
+{
+    if (flow == NULL || flow->strict)
+    {
+        DL_APPEND(sched->strict, entry);
+        return;
+    }
+
+    DL_APPEND(flow->queue, entry);
+    if (!flow->active)
+    {
+        /* A flow that becomes active joins the end of the round */
+        flow->active = TRUE;
+        flow->deficit = 0;
+        DL_APPEND(sched->flows, flow);
+    }
+}
+
+/* See txsched.h */
+bool_t tx_sched_empty(tx_sched_t *sched)
+{
+    return sched->strict == NULL && sched->flows == NULL;
+}
+
+/* See txsched.h */
+connection_tx_entry_t *tx_sched_dequeue(tx_sched_t *sched, int max)
+{
+    connection_tx_entry_t *batch = NULL, *entry;
+    int n = 0;
+
+    for (; n < max && sched->strict != NULL; n++)
+    {
+        entry = sched->strict;
+        DL_DELETE(sched->strict, entry);
+        DL_APPEND(batch, entry);
+    }
+
+    while (n < max && sched->flows != NULL)
+    {
+        tx_flow_t *flow = sched->flows;
+
+        /* Start of the flow's turn */
+        if (!sched->credited)
+        {
+            flow->deficit += TX_QUANTUM * flow->weight;
+            sched->credited = TRUE;
+        }
+
+        entry = flow->queue;
+        if (TX_ENTRY_COST(entry) > flow->deficit)
+        {
+            /* End of its turn: the flow goes to the back of the round,
+             * and keeps its deficit for the next one */
+            DL_DELETE(sched->flows, flow);
+            DL_APPEND(sched->flows, flow);
+            sched->credited = FALSE;
+            continue;
+        }
+
+        flow->deficit -= TX_ENTRY_COST(entry);
+        DL_DELETE(flow->queue, entry);
+        DL_APPEND(batch, entry);
+        n++;
+
+        /* A flow with nothing left to send doesn't keep its deficit */
+        if (flow->queue == NULL)
+        {
+            flow->active = FALSE;
+            flow->deficit = 0;
+            DL_DELETE(sched->flows, flow);
+            sched->credited = FALSE;
+        }
+    }
+
+    return batch;
+}
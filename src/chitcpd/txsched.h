@@ -0,0 +1,182 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Transmit scheduler of a connection to a peer's daemon (see txsched.c)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TXSCHED_H_
+#define TXSCHED_H_
+
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+#include "tcp.h"
+
+/* A segment waiting to be sent on a connection. These are owned (and
+ * allocated on the stack) by the thread calling chitcpd_send_tcp_packet,
+ * which waits until the segment has been written. */
+typedef struct connection_tx_entry
+{
+    chitcphdr_t header;
+    tcp_packet_t *packet;
+
+    bool_t done;
+    int rc;
+
+    struct connection_tx_entry *prev;
+    struct connection_tx_entry *next;
+} connection_tx_entry_t;
+
+/* Sockets with an SO_PRIORITY of at least TX_PRIO_STRICT (Linux's
+ * TC_PRIO_INTERACTIVE) are in the strict-priority class. Below that,
+ * a socket with priority p has a weight of p + 1 */
+#define TX_PRIO_STRICT (6)
+
+/* Number of bytes a flow of weight 1 may send in each round: a full
+ * segment, with the largest TCP header and the chiTCP header */
+#define TX_QUANTUM (TCP_MSS + 60 + sizeof(chitcphdr_t))
+
+/* A socket's queue in the scheduler of its connection. A flow is only
+ * in the scheduler (and "active") while it has queued segments */
+typedef struct tx_flow
+{
+    connection_tx_entry_t *queue;
+    uint32_t deficit;
+    uint32_t weight;
+    bool_t strict;
+    bool_t active;
+
+    struct tx_flow *prev;
+    struct tx_flow *next;
+} tx_flow_t;
+
+/* Transmit scheduler. Segments in the strict-priority class (including
+ * those that don't belong to any socket, like the SYN/ACKs of
+ * listening sockets) are sent first, in order. The other flows share
+ * what's left by deficit round robin, in proportion to their weights.
+ * credited is TRUE if the flow at the head of the round has already
+ * been given its quantum for its current turn. */
+typedef struct tx_sched
+{
+    connection_tx_entry_t *strict;
+    tx_flow_t *flows;
+    bool_t credited;
+} tx_sched_t;
+
+
+/*
+ * tx_sched_init - Initialize a transmit scheduler
+ *
+ * sched: Scheduler
+ *
+ * Returns: Nothing.
+ *
+ */
+void tx_sched_init(tx_sched_t *sched);
+
+
+/*
+ * tx_flow_init - Initialize a flow
+ *
+ * flow: Flow
+ *
+ * Returns: Nothing.
+ *
+ */
+void tx_flow_init(tx_flow_t *flow);
+
+
+/*
+ * tx_flow_set_priority - Set the class and weight of a flow
+ *
+ * Only takes effect if the flow is not active (so a flow's class can't
+ * change while it has segments queued).
+ *
+ * flow: Flow
+ *
+ * priority: The socket's SO_PRIORITY (see TX_PRIO_STRICT)
+ *
+ * Returns: Nothing.
+ *
+ */
+void tx_flow_set_priority(tx_flow_t *flow, int priority);
+
+
+/*
+ * tx_sched_enqueue - Queue a segment
+ *
+ * sched: Scheduler
+ *
+ * flow: Flow of the socket that sends the segment (NULL if the
+ *       segment doesn't belong to a socket)
+ *
+ * entry: Segment
+ *
+ * Returns: Nothing.
+ *
+ */
+void tx_sched_enqueue(tx_sched_t *sched, tx_flow_t *flow, connection_tx_entry_t *entry);
+
+
+/*
+ * tx_sched_empty - Check whether a scheduler has queued segments
+ *
+ * sched: Scheduler
+ *
+ * Returns: TRUE if nothing is queued, FALSE otherwise.
+ *
+ */
+bool_t tx_sched_empty(tx_sched_t *sched);
+
+
+/*
+ * tx_sched_dequeue - Take the next segments to send off a scheduler
+ *
+ * The strict-priority segments come first, and then those picked by
+ * deficit round robin. Taking at most a few segments at a time bounds
+ * how long a segment that is queued in the meantime has to wait.
+ *
+ * sched: Scheduler
+ *
+ * max: Maximum number of segments to take
+ *
+ * Returns: The segments, in the order they must be sent (as a list
+ *          linked through their prev and next), or NULL if nothing
+ *          is queued.
+ *
+ */
+connection_tx_entry_t *tx_sched_dequeue(tx_sched_t *sched, int max);
+
+#endif /* TXSCHED_H_ */
@@ -42,10 +42,31 @@
 #include <stdlib.h>
 
 #include "chitcp/buffer.h"
+#include "chitcp/probes.h"
 
-int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
+static int __circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize, bool_t spsc)
 {
-    buf->data = malloc(maxsize);
+    uint32_t datasize = maxsize;
+
+    /* SPSC buffers are indexed by masking, so their storage is
+     * rounded up to a power of two (the capacity is still maxsize) */
+    if(spsc)
+    {
+        datasize = 1;
+        while(datasize < maxsize)
+            datasize <<= 1;
+    }
+
+    /* The data is only allocated when it is first written to (see
+     * circular_buffer_alloc), so idle buffers take no memory */
+    buf->data = NULL;
+    buf->spsc = spsc;
+    buf->mask = datasize - 1;
+    atomic_init(&buf->head, 0);
+    atomic_init(&buf->tail, 0);
+    atomic_init(&buf->waiters_notempty, 0);
+    atomic_init(&buf->waiters_notfull, 0);
+
     buf->start = 0;
     buf->end = 0;
     buf->count = 0;
@@ -54,6 +75,12 @@ int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
     buf->seq_end = 0;
     buf->maxsize = maxsize;
     buf->closed = FALSE;
+    buf->notify = NULL;
+    buf->notify_arg = NULL;
+    buf->alloc_hook = NULL;
+    buf->alloc_hook_arg = NULL;
+    atomic_init(&buf->writing, 0);
+    atomic_init(&buf->trimming, 0);
 
     pthread_mutex_init(&buf->lock, NULL);
     pthread_cond_init(&buf->cv_notempty, NULL);
@@ -62,8 +89,75 @@ int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
     return CHITCP_OK;
 }
 
+int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
+{
+    return __circular_buffer_init(buf, maxsize, FALSE);
+}
+
+int circular_buffer_init_spsc(circular_buffer_t *buf, uint32_t maxsize)
+{
+    return __circular_buffer_init(buf, maxsize, TRUE);
+}
+
+int circular_buffer_set_notify(circular_buffer_t *buf, circular_buffer_notify_t notify, void *arg)
+{
+    buf->notify = notify;
+    buf->notify_arg = arg;
+
+    return CHITCP_OK;
+}
+
+static inline void circular_buffer_notify(circular_buffer_t *buf)
+{
+    if(buf->notify)
+        buf->notify(buf, buf->notify_arg);
+}
+
+/* Number of bytes a read of "len" bytes with low watermark "lowat" has to
+ * wait for. This is never more than the buffer can hold, or a reader
+ * asking for more than that would wait forever. */
+static inline uint32_t circular_buffer_need(circular_buffer_t *buf, uint32_t len, uint32_t lowat)
+{
+    return MAX(MIN(MIN(lowat, len), buf->maxsize), 1);
+}
+
+int circular_buffer_set_alloc_hook(circular_buffer_t *buf, circular_buffer_alloc_hook_t hook, void *arg)
+{
+    buf->alloc_hook = hook;
+    buf->alloc_hook_arg = arg;
+
+    return CHITCP_OK;
+}
+
+/* Allocates the buffer's data, if it hasn't been allocated yet. Must be
+ * called by the writer, before writing (with the lock held, unless it's
+ * an SPSC buffer) */
+static int circular_buffer_alloc(circular_buffer_t *buf)
+{
+    size_t len = buf->spsc? (size_t) buf->mask + 1 : buf->maxsize;
+
+    if(buf->data != NULL)
+        return CHITCP_OK;
+
+    buf->data = malloc(len);
+    if(buf->data == NULL)
+        return CHITCP_ENOMEM;
+
+    if(buf->alloc_hook)
+        buf->alloc_hook(buf->data, len, buf->alloc_hook_arg);
+
+    return CHITCP_OK;
+}
+
 int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial)
 {
+    if(buf->spsc)
+    {
+        /* Sequence numbers are relative to the start of the stream */
+        buf->seq_initial = seq_initial - atomic_load(&buf->head);
+        return CHITCP_OK;
+    }
+
     buf->seq_initial = seq_initial;
     buf->seq_start = seq_initial;
     buf->seq_end = seq_initial + buf->end;
@@ -72,8 +166,176 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
 }
 
 
-int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
+/*
+ * SPSC mode
+ *
+ * The writer only ever advances tail, and the reader only ever advances
+ * head, so each side can compute the number of bytes it can use from
+ * the other side's counter without a lock. A side that has to block
+ * registers itself in waiters_* and then re-checks the buffer under the
+ * lock, while the other side publishes its counter before checking
+ * waiters_*. Since all of these are sequentially consistent, either the
+ * blocking side sees the new counter, or the other side sees the waiter
+ * (and signals it while holding the lock, so the wakeup can't be lost).
+ *
+ * The data of an empty buffer can be freed by circular_buffer_trim,
+ * which can be called by the reader while the writer is writing. The
+ * same pattern is used for this: the writer sets "writing" and then
+ * waits for "trimming" to be clear, while the trimmer sets "trimming"
+ * and only frees the data if "writing" is clear. Either the trimmer
+ * sees the writer (and leaves the data alone), or the writer waits for
+ * the trimmer to finish (and then allocates the data again, if needed).
+ * The reader itself never sees the data being freed, since the buffer
+ * is only trimmed when the reader has read everything.
+ */
+
+static void circular_buffer_spsc_wait(circular_buffer_t *buf, bool_t for_data, uint32_t need)
+{
+    atomic_int *waiters = for_data? &buf->waiters_notempty : &buf->waiters_notfull;
+    pthread_cond_t *cv = for_data? &buf->cv_notempty : &buf->cv_notfull;
+
+    pthread_mutex_lock(&buf->lock);
+    atomic_fetch_add(waiters, 1);
+    while(!buf->closed)
+    {
+        uint32_t count = atomic_load(&buf->tail) - atomic_load(&buf->head);
+
+        /* Wait for at least "need" bytes of data (or of space) */
+        if(for_data? count >= need : buf->maxsize - count >= need)
+            break;
+
+        pthread_cond_wait(cv, &buf->lock);
+    }
+    atomic_fetch_sub(waiters, 1);
+    pthread_mutex_unlock(&buf->lock);
+}
+
+static void circular_buffer_spsc_wake(circular_buffer_t *buf, bool_t for_data)
+{
+    if(atomic_load(for_data? &buf->waiters_notempty : &buf->waiters_notfull) > 0)
+    {
+        pthread_mutex_lock(&buf->lock);
+        pthread_cond_signal(for_data? &buf->cv_notempty : &buf->cv_notfull);
+        pthread_mutex_unlock(&buf->lock);
+    }
+}
+
+static int circular_buffer_spsc_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
+{
+    uint32_t tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+    uint32_t written = 0;
+
+    if(len <= 0)
+        return CHITCP_EINVAL;
+
+    if(!blocking && tail - atomic_load_explicit(&buf->head, memory_order_acquire) + len > buf->maxsize)
+        return CHITCP_EWOULDBLOCK;
+
+    /* We don't allow writes that are larger than the size of the buffer */
+    if (len > buf->maxsize)
+        len = buf->maxsize;
+
+    atomic_store(&buf->writing, 1);
+    while(atomic_load(&buf->trimming))
+        ;
+
+    if(circular_buffer_alloc(buf) != CHITCP_OK)
+    {
+        atomic_store(&buf->writing, 0);
+        return CHITCP_ENOMEM;
+    }
+
+    while (written < len)
+    {
+        uint32_t space = buf->maxsize - (tail - atomic_load_explicit(&buf->head, memory_order_acquire));
+
+        if(buf->closed)
+            break;
+
+        if(space == 0)
+        {
+            circular_buffer_spsc_wait(buf, FALSE, 1);
+            continue;
+        }
+
+        uint32_t towrite = MIN(space, len - written);
+        uint32_t pos = tail & buf->mask;
+        uint32_t to_max = MIN(towrite, buf->mask + 1 - pos);
+
+        memcpy(buf->data + pos, data + written, to_max);
+        memcpy(buf->data, data + written + to_max, towrite - to_max);
+
+        tail += towrite;
+        written += towrite;
+        atomic_store(&buf->tail, tail);
+
+        circular_buffer_spsc_wake(buf, TRUE);
+    }
+    atomic_store(&buf->writing, 0);
+
+    if(written > 0)
+        circular_buffer_notify(buf);
+
+    return written;
+}
+
+static int circular_buffer_spsc_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t offset, uint32_t lowat, bool_t blocking, bool_t peeking)
+{
+    uint32_t head, tail, need;
+
+    if(len <= 0)
+        return CHITCP_EINVAL;
+
+    need = circular_buffer_need(buf, len, lowat);
+
+    head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+
+    if(tail - head < need && !blocking && !buf->closed)
+        return CHITCP_EWOULDBLOCK;
+
+    while(tail - head < need && !buf->closed)
+    {
+        circular_buffer_spsc_wait(buf, TRUE, need);
+        tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+    }
+
+    if(tail == head)
+        return 0;
+
+    /* Only possible if the data at the offset was read by the
+     * reader after the offset was computed (see peek_at) */
+    if(offset >= tail - head)
+        return CHITCP_EINVAL;
+
+    /* We're not going to read more than the number
+     * of bytes stored in the buffer */
+    uint32_t toread = MIN(len, tail - head - offset);
+    uint32_t pos = (head + offset) & buf->mask;
+    uint32_t to_max = MIN(toread, buf->mask + 1 - pos);
+
+    if(dst)
+    {
+        memcpy(dst, buf->data + pos, to_max);
+        memcpy(dst + to_max, buf->data, toread - to_max);
+    }
+
+    if(!peeking)
+    {
+        atomic_store(&buf->head, head + toread);
+        circular_buffer_spsc_wake(buf, FALSE);
+        circular_buffer_notify(buf);
+    }
+
+    return toread;
+}
+
+
+static int __circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
 {
+    if(buf->spsc)
+        return circular_buffer_spsc_write(buf, data, len, blocking);
+
     if(len <= 0)
         return CHITCP_EINVAL;
 
@@ -84,6 +346,12 @@ int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, b
         return CHITCP_EWOULDBLOCK;
     }
 
+    if(circular_buffer_alloc(buf) != CHITCP_OK)
+    {
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_ENOMEM;
+    }
+
     int written = 0;
 
     /* We don't allow writes that are larger than the size of the buffer */
@@ -98,6 +366,8 @@ int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, b
         if(buf->closed)
         {
             pthread_mutex_unlock(&buf->lock);
+            if(written > 0)
+                circular_buffer_notify(buf);
             return written;
         }
 
@@ -132,22 +402,38 @@ int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, b
     pthread_cond_signal(&buf->cv_notempty);
     pthread_mutex_unlock(&buf->lock);
 
+    circular_buffer_notify(buf);
+
     return written;
 }
 
-int __circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t offset, bool_t blocking, bool_t peeking)
+int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
 {
+    int written = __circular_buffer_write(buf, data, len, blocking);
+
+    CHITCP_PROBE(buffer_write, buf, len, written);
+
+    return written;
+}
+
+static int __circular_buffer_do_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t offset, uint32_t lowat, bool_t blocking, bool_t peeking)
+{
+    if(buf->spsc)
+        return circular_buffer_spsc_read(buf, dst, len, offset, lowat, blocking, peeking);
+
     if(len <= 0)
         return CHITCP_EINVAL;
 
     pthread_mutex_lock(&buf->lock);
-    if(buf->count == 0 && !blocking)
+    if(buf->count < circular_buffer_need(buf, len, lowat) && !blocking && !buf->closed)
     {
         pthread_mutex_unlock(&buf->lock);
         return CHITCP_EWOULDBLOCK;
     }
 
-    while(buf->count == 0 && !buf->closed)
+    /* The buffer can grow while we wait (see circular_buffer_resize),
+     * so the number of bytes we need is recomputed every time */
+    while(buf->count < circular_buffer_need(buf, len, lowat) && !buf->closed)
         pthread_cond_wait(&buf->cv_notempty, &buf->lock);
 
     if(buf->closed && buf->count == 0)
@@ -196,39 +482,157 @@ int __circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, u
     pthread_cond_signal(&buf->cv_notfull);
     pthread_mutex_unlock(&buf->lock);
 
+    if(!peeking)
+        circular_buffer_notify(buf);
+
     return toread;
 }
 
+int __circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t offset, uint32_t lowat, bool_t blocking, bool_t peeking)
+{
+    int nread = __circular_buffer_do_read(buf, dst, len, offset, lowat, blocking, peeking);
+
+    if(!peeking)
+        CHITCP_PROBE(buffer_read, buf, len, nread);
+
+    return nread;
+}
+
 int circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking)
 {
-    return __circular_buffer_read(buf, dst, len, 0, blocking, FALSE);
+    return __circular_buffer_read(buf, dst, len, 0, 1, blocking, FALSE);
 }
 
 int circular_buffer_peek(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking)
 {
-    return __circular_buffer_read(buf, dst, len, 0, blocking, TRUE);
+    return __circular_buffer_read(buf, dst, len, 0, 1, blocking, TRUE);
+}
+
+int circular_buffer_read_lowat(circular_buffer_t *buf, uint8_t *dst, uint32_t len, uint32_t lowat, bool_t blocking, bool_t peeking)
+{
+    return __circular_buffer_read(buf, dst, len, 0, lowat, blocking, peeking);
 }
 
 int circular_buffer_peek_at(circular_buffer_t *buf, uint8_t *dst, uint32_t at, uint32_t len)
 {
     uint32_t offset;
+    uint32_t seq_start = circular_buffer_first(buf);
+    uint32_t seq_end = circular_buffer_next(buf);
 
     /* Check that the sequence number is valid */
-    if (at < buf->seq_start || at >= buf->seq_end)
+    if (at < seq_start || at >= seq_end)
         return CHITCP_EINVAL;
 
-    offset = at - buf->seq_start;
+    offset = at - seq_start;
 
-    return __circular_buffer_read(buf, dst, len, offset, FALSE, TRUE);
+    return __circular_buffer_read(buf, dst, len, offset, 1, FALSE, TRUE);
+}
+
+int circular_buffer_resize(circular_buffer_t *buf, uint32_t maxsize)
+{
+    uint8_t *data;
+
+    if(buf->spsc)
+        return CHITCP_EINVAL;
+
+    pthread_mutex_lock(&buf->lock);
+    if(maxsize <= buf->maxsize)
+    {
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_OK;
+    }
+
+    /* If the data hasn't been allocated yet, it will be allocated
+     * with the new size */
+    if(buf->data == NULL)
+    {
+        buf->maxsize = maxsize;
+        pthread_cond_signal(&buf->cv_notfull);
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_OK;
+    }
+
+    data = malloc(maxsize);
+    if(data == NULL)
+    {
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_ENOMEM;
+    }
+
+    if(buf->alloc_hook)
+        buf->alloc_hook(data, maxsize, buf->alloc_hook_arg);
+
+    /* Copy the contents to the start of the new buffer, so they
+     * won't wrap around until the new end of the buffer */
+    if(buf->count > 0 && buf->start + buf->count > buf->maxsize)
+    {
+        uint32_t to_max = buf->maxsize - buf->start;
+
+        memcpy(data, buf->data + buf->start, to_max);
+        memcpy(data + to_max, buf->data, buf->count - to_max);
+    }
+    else if(buf->count > 0)
+        memcpy(data, buf->data + buf->start, buf->count);
+
+    free(buf->data);
+    buf->data = data;
+    buf->start = 0;
+    buf->end = buf->count;
+    buf->maxsize = maxsize;
+
+    pthread_cond_signal(&buf->cv_notfull);
+    pthread_mutex_unlock(&buf->lock);
+
+    return CHITCP_OK;
+}
+
+int circular_buffer_trim(circular_buffer_t *buf)
+{
+    int rc = CHITCP_OK;
+
+    if(buf->spsc)
+    {
+        atomic_store(&buf->trimming, 1);
+        if(atomic_load(&buf->writing) || atomic_load(&buf->tail) != atomic_load(&buf->head))
+            rc = CHITCP_EWOULDBLOCK;
+        else
+        {
+            free(buf->data);
+            buf->data = NULL;
+        }
+        atomic_store(&buf->trimming, 0);
+
+        return rc;
+    }
+
+    pthread_mutex_lock(&buf->lock);
+    if(buf->count > 0)
+        rc = CHITCP_EWOULDBLOCK;
+    else
+    {
+        free(buf->data);
+        buf->data = NULL;
+        buf->start = 0;
+        buf->end = 0;
+    }
+    pthread_mutex_unlock(&buf->lock);
+
+    return rc;
 }
 
 int circular_buffer_first(circular_buffer_t *buf)
 {
+    if(buf->spsc)
+        return buf->seq_initial + atomic_load(&buf->head);
+
     return buf->seq_start;
 }
 
 int circular_buffer_next(circular_buffer_t *buf)
 {
+    if(buf->spsc)
+        return buf->seq_initial + atomic_load(&buf->tail);
+
     return buf->seq_end;
 }
 
@@ -239,12 +643,20 @@ int circular_buffer_capacity(circular_buffer_t *buf)
 
 int circular_buffer_count(circular_buffer_t *buf)
 {
+    if(buf->spsc)
+    {
+        /* Load head first, so the count can't be negative (but it can
+         * include bytes written after head was loaded, hence the MIN) */
+        uint32_t head = atomic_load(&buf->head);
+        return MIN(atomic_load(&buf->tail) - head, buf->maxsize);
+    }
+
     return buf->count;
 }
 
 int circular_buffer_available(circular_buffer_t *buf)
 {
-    return buf->maxsize - buf->count;
+    return buf->maxsize - circular_buffer_count(buf);
 }
 
 int circular_buffer_dump(circular_buffer_t *buf)
@@ -252,12 +664,23 @@ int circular_buffer_dump(circular_buffer_t *buf)
     printf("# # # # # # # # # # # # # # # # #\n");
 
     printf("maxsize: %i\n", buf->maxsize);
-    printf("count: %i\n", buf->count);
+    printf("count: %i\n", circular_buffer_count(buf));
+
+    if(buf->spsc)
+    {
+        uint32_t head = atomic_load(&buf->head), tail = atomic_load(&buf->tail);
+
+        printf("head: %u (data[%u])\n", head, head & buf->mask);
+        printf("tail: %u (data[%u])\n", tail, tail & buf->mask);
+        printf(" # # # # # # # # # # # # # # # # #\n");
+
+        return CHITCP_OK;
+    }
 
     printf("start: %i\n", buf->start);
     printf("end: %i\n", buf->end);
 
-    for(int i=0; i<buf->maxsize; i++)
+    for(int i=0; buf->data != NULL && i<buf->maxsize; i++)
     {
         printf("data[%i] = %i", i, buf->data[i]);
         if(i==buf->start)
@@ -279,6 +702,8 @@ int circular_buffer_close(circular_buffer_t *buf)
     pthread_cond_broadcast(&buf->cv_notfull);
     pthread_mutex_unlock(&buf->lock);
 
+    circular_buffer_notify(buf);
+
     return CHITCP_OK;
 }
 
@@ -0,0 +1,256 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Real and virtual clocks (see clock.h)
+ *
+ *  The virtual clock keeps the current (virtual) time, the last time
+ *  (in real time) that any thread looked at it, and the deadlines of
+ *  the threads that are waiting on it. A waiting thread wakes up once
+ *  per quiet period to check whether the clock has been idle for that
+ *  long and, if so, moves the clock to the earliest deadline. The other
+ *  waiters see the new time the next time they wake up.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "chitcp/clock.h"
+#include "chitcp/types.h"
+#include "chitcp/utlist.h"
+
+#define CLOCK_SECOND (1000000000L)
+
+/* A thread waiting on the virtual clock */
+typedef struct clock_sleeper
+{
+    uint64_t deadline;
+    struct clock_sleeper *prev;
+    struct clock_sleeper *next;
+} clock_sleeper_t;
+
+static chitcp_clock_type_t clock_type = CHITCP_CLOCK_REAL;
+static uint64_t clock_quiet = CHITCP_CLOCK_QUIET_DEFAULT;
+
+/* Virtual time, and real time of the last activity (in nanoseconds) */
+static _Atomic uint64_t virtual_now = 0;
+static _Atomic uint64_t last_activity = 0;
+
+/* Threads waiting on the virtual clock */
+static pthread_mutex_t lock_sleepers = PTHREAD_MUTEX_INITIALIZER;
+static clock_sleeper_t *sleepers = NULL;
+static int num_sleepers = 0;
+
+
+static inline uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * CLOCK_SECOND + ts->tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / CLOCK_SECOND;
+    ts->tv_nsec = ns % CLOCK_SECOND;
+}
+
+static inline uint64_t real_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(MT_CLOCK, &now);
+
+    return timespec_to_ns(&now);
+}
+
+/*
+ * clock_virtual_advance - Move the virtual clock forward, if it is idle
+ *
+ * Returns: Nothing.
+ *
+ */
+static void clock_virtual_advance(void)
+{
+    clock_sleeper_t *s;
+    uint64_t real, next = UINT64_MAX;
+
+    pthread_mutex_lock(&lock_sleepers);
+
+    real = real_now_ns();
+    if (real - atomic_load(&last_activity) >= clock_quiet)
+    {
+        DL_FOREACH(sleepers, s)
+            if (s->deadline < next)
+                next = s->deadline;
+
+        if (next != UINT64_MAX && next > atomic_load(&virtual_now))
+            atomic_store(&virtual_now, next);
+
+        /* The threads that are due get a quiet period of their own,
+         * so the clock doesn't jump again before they have run */
+        atomic_store(&last_activity, real);
+    }
+
+    pthread_mutex_unlock(&lock_sleepers);
+}
+
+
+/* See clock.h */
+int chitcp_clock_set(chitcp_clock_type_t type, uint64_t quiet)
+{
+    int ret = CHITCP_OK;
+
+    if (type != CHITCP_CLOCK_REAL && type != CHITCP_CLOCK_VIRTUAL)
+        return CHITCP_EINVAL;
+
+    pthread_mutex_lock(&lock_sleepers);
+    if (num_sleepers > 0)
+        ret = CHITCP_EINVAL;
+    else
+    {
+        clock_type = type;
+        clock_quiet = quiet? quiet : CHITCP_CLOCK_QUIET_DEFAULT;
+        atomic_store(&virtual_now, real_now_ns());
+        atomic_store(&last_activity, real_now_ns());
+    }
+    pthread_mutex_unlock(&lock_sleepers);
+
+    return ret;
+}
+
+/* See clock.h */
+chitcp_clock_type_t chitcp_clock_type(void)
+{
+    return clock_type;
+}
+
+/* See clock.h */
+uint64_t chitcp_clock_now_ns(void)
+{
+    if (clock_type == CHITCP_CLOCK_REAL)
+        return real_now_ns();
+
+    atomic_store_explicit(&last_activity, real_now_ns(), memory_order_relaxed);
+
+    return atomic_load(&virtual_now);
+}
+
+/* See clock.h */
+void chitcp_clock_now(struct timespec *ts)
+{
+    if (clock_type == CHITCP_CLOCK_REAL)
+        clock_gettime(MT_CLOCK, ts);
+    else
+        ns_to_timespec(chitcp_clock_now_ns(), ts);
+}
+
+/* See clock.h */
+int chitcp_clock_timedwait(pthread_cond_t *cv, pthread_mutex_t *lock, const struct timespec *abstime)
+{
+    clock_sleeper_t sleeper;
+    struct timespec ts;
+    int rc;
+
+    if (clock_type == CHITCP_CLOCK_REAL)
+        return pthread_cond_timedwait(cv, lock, abstime);
+
+    sleeper.deadline = timespec_to_ns(abstime);
+    if (atomic_load(&virtual_now) >= sleeper.deadline)
+        return ETIMEDOUT;
+
+    pthread_mutex_lock(&lock_sleepers);
+    DL_APPEND(sleepers, &sleeper);
+    num_sleepers++;
+    pthread_mutex_unlock(&lock_sleepers);
+
+    for (;;)
+    {
+        ns_to_timespec(real_now_ns() + clock_quiet, &ts);
+        rc = pthread_cond_timedwait(cv, lock, &ts);
+
+        if (rc != ETIMEDOUT)
+        {
+            /* Woken up by another thread, which is activity too */
+            atomic_store(&last_activity, real_now_ns());
+            rc = 0;
+            break;
+        }
+
+        if (atomic_load(&virtual_now) < sleeper.deadline)
+            clock_virtual_advance();
+        if (atomic_load(&virtual_now) >= sleeper.deadline)
+            break;
+    }
+
+    pthread_mutex_lock(&lock_sleepers);
+    DL_DELETE(sleepers, &sleeper);
+    num_sleepers--;
+    pthread_mutex_unlock(&lock_sleepers);
+
+    return rc;
+}
+
+/* See clock.h */
+void chitcp_clock_sleep(uint64_t ns)
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_condattr_t attr;
+    struct timespec deadline;
+
+    if (clock_type == CHITCP_CLOCK_REAL)
+    {
+        ns_to_timespec(ns, &deadline);
+        while (nanosleep(&deadline, &deadline) != 0 && errno == EINTR);
+        return;
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, MT_CLOCK);
+#endif
+    pthread_cond_init(&cv, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ns_to_timespec(atomic_load(&virtual_now) + ns, &deadline);
+
+    pthread_mutex_lock(&lock);
+    while (chitcp_clock_timedwait(&cv, &lock, &deadline) != ETIMEDOUT);
+    pthread_mutex_unlock(&lock);
+
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&lock);
+}
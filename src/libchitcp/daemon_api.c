@@ -49,70 +49,314 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include "daemon_api.h"
 #include "chitcp/chitcpd.h"
+#include "chitcp/utlist.h"
+#include "fast-codec.h"
 
-static pthread_once_t daemon_socket_key_init = PTHREAD_ONCE_INIT;
-static pthread_key_t daemon_socket_key;
+/* A request waiting for its response */
+typedef struct daemon_request
+{
+    uint32_t request_id;
+    ChitcpdMsg *resp;
+    bool_t done;
+    pthread_cond_t cv_done;
+    struct daemon_request *prev;
+    struct daemon_request *next;
+} daemon_request_t;
+
+/* A subscription to socket notifications (see chitcpd_subscribe). It is
+ * a SUBSCRIBE request that stays in progress until it is cancelled: the
+ * daemon sends NOTIFY messages with its request ID, and finally a response
+ * (once it has been cancelled, or if it failed). */
+struct chitcpd_subscription
+{
+    struct daemon_conn *conn;
+    uint32_t request_id;
+
+    /* Notifications received, and not picked up yet */
+    chitcpd_notification_t *notes;
+    int num_notes;
+    int max_notes;
+
+    bool_t ended;       /* The daemon has sent the final response */
+    int error_code;     /* ...and this is its error code */
+    bool_t waiting;     /* A thread is waiting for notifications */
+    pthread_cond_t cv;
+
+    struct chitcpd_subscription *prev;
+    struct chitcpd_subscription *next;
+};
+
+/* The process's connection to the daemon, shared by all its threads.
+ * Requests are tagged with an ID, and responses are handed to the thread
+ * waiting for them. At any given time, one of the waiting threads reads
+ * responses (and notifications) from the socket on behalf of all the others. */
+typedef struct daemon_conn
+{
+    int daemon_socket;
+    chitcpd_channel_t channel;  /* On daemon_socket */
+    uint8_t *shm;        /* Shared data window (NULL if there is none) */
+    uint32_t shm_size;
 
-static void create_daemon_socket_key()
+    /* Serializes sending requests on the socket */
+    pthread_mutex_t lock_send;
+
+    /* Protects everything below */
+    pthread_mutex_t lock_requests;
+    daemon_request_t *pending;  /* Requests waiting for a response */
+    chitcpd_subscription_t *subscriptions;
+    bool_t reading;             /* Is some thread reading responses? */
+    int error;                  /* Set if reading a response failed */
+    uint32_t next_request_id;
+    uint32_t shm_slots_used;    /* Bitmap of shared data window slots */
+} daemon_conn_t;
+
+static pthread_mutex_t daemon_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static daemon_conn_t *daemon_conn = NULL;
+
+/* In-process daemon, if there is one (see chitcpd_set_local) */
+static const chitcpd_local_t *daemon_local = NULL;
+
+/* Each thread sends its requests in its own lane, so the daemon handles
+ * them in order (as if each thread had its own connection), while
+ * requests from different threads can complete in any order. */
+static pthread_once_t daemon_lane_key_init = PTHREAD_ONCE_INIT;
+static pthread_key_t daemon_lane_key;
+static uint32_t next_lane = 0;
+
+static void create_daemon_lane_key()
 {
-    pthread_key_create(&daemon_socket_key, NULL);
+    pthread_key_create(&daemon_lane_key, NULL);
+}
+
+static uint32_t chitcpd_get_lane()
+{
+    uintptr_t lane;
+
+    pthread_once(&daemon_lane_key_init, create_daemon_lane_key);
+
+    lane = (uintptr_t) pthread_getspecific(daemon_lane_key);
+    if (lane == 0)
+    {
+        lane = __atomic_add_fetch(&next_lane, 1, __ATOMIC_RELAXED);
+        pthread_setspecific(daemon_lane_key, (void *) lane);
+    }
+
+    return (uint32_t) lane;
+}
+
+/*
+ * chitcpd_create_shm - Create an anonymous shared memory object
+ *
+ * Uses memfd_create where available. Otherwise, a POSIX shared memory
+ * object is created and immediately unlinked, so that it only lives as
+ * long as the descriptors (and mappings) that refer to it.
+ *
+ * size: Size of the object
+ *
+ * Returns: A file descriptor for the object, or -1 on error.
+ *
+ */
+static int chitcpd_create_shm(uint32_t size)
+{
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("chitcpd-shm", MFD_CLOEXEC);
+#else
+    char name[64];
+    static int shm_count = 0;
+
+    snprintf(name, sizeof(name), "/chitcpd-%d-%d", (int) getpid(),
+             __atomic_fetch_add(&shm_count, 1, __ATOMIC_RELAXED));
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd != -1)
+        shm_unlink(name);
+#endif
+
+    if (fd == -1)
+        return -1;
+
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* See daemon_api.h */
+int chitcpd_set_local(const chitcpd_local_t *local)
+{
+    if (local != NULL && daemon_local != NULL)
+        return CHITCP_EINVAL;
+
+    daemon_local = local;
+
+    return CHITCP_OK;
 }
 
 int chitcpd_get_socket()
 {
-    void *daemon_socket_ptr;
+    daemon_conn_t *conn;
     int daemon_socket;
-    int rc;
+    int rc, shm_fd = -1;
+    uint8_t *shm = NULL;
     ChitcpdMsg msg = CHITCPD_MSG__INIT;
     ChitcpdInitArgs ia = CHITCPD_INIT_ARGS__INIT;
     ChitcpdMsg *resp_p;
 
-    pthread_once(&daemon_socket_key_init, create_daemon_socket_key);
+    if (daemon_local)
+        return CHITCPD_LOCAL_SOCKET;
 
-    daemon_socket_ptr = pthread_getspecific(daemon_socket_key);
+    pthread_mutex_lock(&daemon_conn_lock);
 
-    if (daemon_socket_ptr)
+    if (daemon_conn)
     {
-        daemon_socket = *((int*) daemon_socket_ptr);
+        daemon_socket = daemon_conn->daemon_socket;
+        pthread_mutex_unlock(&daemon_conn_lock);
+        return daemon_socket;
     }
-    else
+
+    daemon_socket = chitcpd_connect();
+
+    /* If there was an error, don't store the socket value.
+     * Return the error code immediately. */
+    if(daemon_socket < 0)
     {
-        daemon_socket_ptr = malloc(sizeof(int));
-        daemon_socket = chitcpd_connect();
+        pthread_mutex_unlock(&daemon_conn_lock);
+        return daemon_socket;
+    }
 
-        /* If there was an error, don't store the socket value.
-         * Return the error code immediately. */
-        if(daemon_socket < 0)
-            return daemon_socket;
+    conn = calloc(1, sizeof(daemon_conn_t));
+    if (conn == NULL)
+    {
+        close(daemon_socket);
+        pthread_mutex_unlock(&daemon_conn_lock);
+        return CHITCP_ENOMEM;
+    }
+    conn->daemon_socket = daemon_socket;
+    conn->next_request_id = 1;
+    pthread_mutex_init(&conn->lock_send, NULL);
+    pthread_mutex_init(&conn->lock_requests, NULL);
 
-        /* Send INIT message */
-        msg.code = CHITCPD_MSG_CODE__INIT;
-        msg.init_args = &ia;
-        msg.init_args->connection_type = CHITCPD_CONNECTION_TYPE__COMMAND_CONNECTION;
+    /* Create the shared data window. If we can't, we simply go
+     * without one. */
+    shm_fd = chitcpd_create_shm(CHITCPD_SHM_SIZE);
+    if (shm_fd != -1)
+    {
+        shm = mmap(NULL, CHITCPD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (shm == MAP_FAILED)
+        {
+            shm = NULL;
+            close(shm_fd);
+            shm_fd = -1;
+        }
+    }
 
-        rc = chitcpd_send_command(daemon_socket, &msg, &resp_p);
-        if (rc < 0)
-            return rc;
+    /* Send INIT message */
+    msg.code = CHITCPD_MSG_CODE__INIT;
+    msg.init_args = &ia;
+    msg.init_args->connection_type = CHITCPD_CONNECTION_TYPE__COMMAND_CONNECTION;
+    msg.init_args->shm_size = (shm_fd != -1)? CHITCPD_SHM_SIZE : 0;
+    msg.init_args->fast_codec = CHITCPD_FAST_VERSION;
 
-        /* Unpack response */
-        assert(resp_p->resp != NULL);
-        rc = resp_p->resp->ret;
-        errno = resp_p->resp->error_code;
-        chitcpd_msg__free_unpacked(resp_p, NULL);
+    rc = chitcpd_send_msg(daemon_socket, &msg);
+    if (rc == CHITCP_OK && shm_fd != -1)
+    {
+        /* The descriptor follows the INIT message */
+        rc = chitcpd_send_fd(daemon_socket, shm_fd);
+        close(shm_fd);
+    }
+    if (rc == CHITCP_OK)
+        rc = chitcpd_recv_msg(daemon_socket, &resp_p);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Daemon socket disconnected\n");
+        if (shm)
+            munmap(shm, CHITCPD_SHM_SIZE);
+        free(conn);
+        pthread_mutex_unlock(&daemon_conn_lock);
+        return rc;
+    }
 
-        if (rc < 0)
-            return rc;
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    rc = resp_p->resp->ret;
+    errno = resp_p->resp->error_code;
 
-        *((int*)daemon_socket_ptr) = daemon_socket;
+    /* The daemon tells us whether it was able to map the window */
+    if (rc >= 0 && shm && resp_p->resp->shm_size == CHITCPD_SHM_SIZE)
+    {
+        conn->shm = shm;
+        conn->shm_size = CHITCPD_SHM_SIZE;
+    }
+    else if (shm)
+        munmap(shm, CHITCPD_SHM_SIZE);
+
+    /* ...and which version of the fast-path encoding to use */
+    chitcpd_channel_init(&conn->channel, daemon_socket);
+    if (resp_p->resp->fast_codec <= CHITCPD_FAST_VERSION)
+        conn->channel.fast_version = resp_p->resp->fast_codec;
 
-        pthread_setspecific(daemon_socket_key, daemon_socket_ptr);
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    if (rc < 0)
+    {
+        free(conn);
+        pthread_mutex_unlock(&daemon_conn_lock);
+        return rc;
     }
 
+    daemon_conn = conn;
+    pthread_mutex_unlock(&daemon_conn_lock);
+
     return daemon_socket;
 }
 
+/* See daemon_api.h */
+uint8_t *chitcpd_shm_acquire(uint32_t *offset, uint32_t *size)
+{
+    daemon_conn_t *conn = daemon_conn;
+    uint8_t *slot = NULL;
+
+    if (conn == NULL || conn->shm == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&conn->lock_requests);
+    for (int i = 0; i < CHITCPD_SHM_SLOTS; i++)
+    {
+        if (!(conn->shm_slots_used & (1U << i)))
+        {
+            conn->shm_slots_used |= (1U << i);
+            *offset = i * CHITCPD_SHM_SLOT_SIZE;
+            *size = CHITCPD_SHM_SLOT_SIZE;
+            slot = conn->shm + *offset;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock_requests);
+
+    return slot;
+}
+
+/* See daemon_api.h */
+void chitcpd_shm_release(uint32_t offset)
+{
+    daemon_conn_t *conn = daemon_conn;
+
+    pthread_mutex_lock(&conn->lock_requests);
+    conn->shm_slots_used &= ~(1U << (offset / CHITCPD_SHM_SLOT_SIZE));
+    pthread_mutex_unlock(&conn->lock_requests);
+}
+
 /* See daemon_api.h */
 int chitcpd_connect()
 {
@@ -139,14 +383,565 @@ int chitcpd_connect()
     return clientSocket;
 }
 
+/*
+ * chitcpd_conn_request_id - Get a fresh request ID
+ *
+ * Must be called with the connection's lock_requests held.
+ *
+ * conn: Connection to the daemon
+ *
+ * Returns: The request ID (never 0).
+ *
+ */
+static uint32_t chitcpd_conn_request_id(daemon_conn_t *conn)
+{
+    uint32_t request_id = conn->next_request_id++;
+
+    if (conn->next_request_id == 0)
+        conn->next_request_id = 1;
+
+    return request_id;
+}
+
+/*
+ * chitcpd_subscription_deliver - Hand a message from the daemon to a subscription
+ *
+ * Must be called with the connection's lock_requests held.
+ *
+ * sub: Subscription
+ *
+ * msg: NOTIFY message, or the subscription's final response
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_subscription_deliver(chitcpd_subscription_t *sub, ChitcpdMsg *msg)
+{
+    if (msg->code != CHITCPD_MSG_CODE__NOTIFY)
+    {
+        sub->ended = TRUE;
+        sub->error_code = msg->resp? msg->resp->error_code : EPROTO;
+    }
+    else if (msg->resp != NULL && msg->resp->n_notifications > 0)
+    {
+        int needed = sub->num_notes + msg->resp->n_notifications;
+
+        if (needed > sub->max_notes)
+        {
+            chitcpd_notification_t *notes;
+            int max_notes = MAX(needed, 2 * sub->max_notes);
+
+            notes = realloc(sub->notes, max_notes * sizeof(chitcpd_notification_t));
+            if (notes == NULL)
+            {
+                fprintf(stderr, "Could not store notifications\n");
+                return;
+            }
+            sub->notes = notes;
+            sub->max_notes = max_notes;
+        }
+
+        for (size_t i = 0; i < msg->resp->n_notifications; i++)
+        {
+            ChitcpdNotification *n = msg->resp->notifications[i];
+            chitcpd_notification_t *note = &sub->notes[sub->num_notes++];
+
+            note->sockfd = n->sockfd;
+            note->events = n->events;
+            note->tcp_state = n->tcp_state;
+            note->states = n->states;
+        }
+    }
+
+    pthread_cond_signal(&sub->cv);
+}
+
+/*
+ * chitcpd_conn_read - Read a message from the daemon on behalf of every waiting thread
+ *
+ * Must be called with the connection's lock_requests held, and when no
+ * other thread is reading. The lock is released while reading.
+ *
+ * conn: Connection to the daemon
+ *
+ * Returns:
+ *  - CHITCP_OK: A message was read (and handed to whoever was waiting for it)
+ *  - A negative value: The connection is unusable (see chitcpd_send_command)
+ *
+ */
+static int chitcpd_conn_read(daemon_conn_t *conn)
+{
+    ChitcpdMsg *resp;
+    daemon_request_t *r;
+    chitcpd_subscription_t *sub;
+    int rc;
+
+    conn->reading = TRUE;
+    pthread_mutex_unlock(&conn->lock_requests);
+    rc = chitcpd_channel_recv_msg(&conn->channel, &resp, NULL);
+    pthread_mutex_lock(&conn->lock_requests);
+    conn->reading = FALSE;
+
+    if (rc < 0)
+    {
+        /* The connection is unusable. Fail every pending request
+         * (and subscription). */
+        conn->error = rc;
+        DL_FOREACH(conn->pending, r)
+            pthread_cond_signal(&r->cv_done);
+        DL_FOREACH(conn->subscriptions, sub)
+            pthread_cond_signal(&sub->cv);
+        return rc;
+    }
+
+    DL_FOREACH(conn->pending, r)
+    {
+        if (r->request_id == resp->request_id)
+            break;
+    }
+
+    if (r && !r->done)
+    {
+        r->resp = resp;
+        r->done = TRUE;
+        pthread_cond_signal(&r->cv_done);
+        return CHITCP_OK;
+    }
+
+    DL_FOREACH(conn->subscriptions, sub)
+    {
+        if (sub->request_id == resp->request_id)
+            break;
+    }
+
+    if (sub)
+        chitcpd_subscription_deliver(sub, resp);
+    else
+        fprintf(stderr, "Received response for unknown request %u\n", resp->request_id);
+    chitcpd_msg__free_unpacked(resp, NULL);
+
+    return CHITCP_OK;
+}
+
+/*
+ * chitcpd_conn_handoff - Let another waiting thread read from the daemon
+ *
+ * Must be called with the connection's lock_requests held, by a thread
+ * that stops waiting.
+ *
+ * conn: Connection to the daemon
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_conn_handoff(daemon_conn_t *conn)
+{
+    chitcpd_subscription_t *sub;
+
+    if (conn->reading)
+        return;
+
+    if (conn->pending)
+    {
+        pthread_cond_signal(&conn->pending->cv_done);
+        return;
+    }
+
+    DL_FOREACH(conn->subscriptions, sub)
+    {
+        if (sub->waiting)
+        {
+            pthread_cond_signal(&sub->cv);
+            return;
+        }
+    }
+}
+
+/*
+ * chitcpd_send_command_mux - Send a command on the shared daemon connection
+ *
+ * The request is tagged with a fresh request ID and the calling thread's
+ * lane, and the calling thread waits until the response with that ID
+ * arrives. If no thread is reading responses, the calling thread does
+ * so (delivering other threads' responses along the way) until its own
+ * response arrives, and then hands that role over to another waiting
+ * thread.
+ *
+ * If fd is not negative, that file descriptor is passed to the daemon right
+ * after the request (see chitcpd_send_command_fd).
+ *
+ * Returns: Same as chitcpd_send_command
+ *
+ */
+static int chitcpd_send_command_mux(daemon_conn_t *conn, const ChitcpdMsg *req, int fd, ChitcpdMsg **resp_p)
+{
+    ChitcpdMsg msg = *req;
+    daemon_request_t request;
+    int rc;
+
+    request.resp = NULL;
+    request.done = FALSE;
+    pthread_cond_init(&request.cv_done, NULL);
+
+    pthread_mutex_lock(&conn->lock_requests);
+    if (conn->error)
+    {
+        rc = conn->error;
+        pthread_mutex_unlock(&conn->lock_requests);
+        pthread_cond_destroy(&request.cv_done);
+        return rc;
+    }
+    request.request_id = chitcpd_conn_request_id(conn);
+    DL_APPEND(conn->pending, &request);
+    pthread_mutex_unlock(&conn->lock_requests);
+
+    msg.request_id = request.request_id;
+    msg.lane = chitcpd_get_lane();
+
+    pthread_mutex_lock(&conn->lock_send);
+    rc = chitcpd_channel_send_msg(&conn->channel, &msg);
+    if (rc == CHITCP_OK && fd >= 0)
+        rc = chitcpd_send_fd(conn->daemon_socket, fd);
+    pthread_mutex_unlock(&conn->lock_send);
+
+    pthread_mutex_lock(&conn->lock_requests);
+
+    while (rc == CHITCP_OK && !request.done)
+    {
+        if (conn->error)
+        {
+            rc = conn->error;
+            break;
+        }
+
+        if (conn->reading)
+        {
+            pthread_cond_wait(&request.cv_done, &conn->lock_requests);
+            continue;
+        }
+
+        /* Nobody is reading responses, so we do */
+        rc = chitcpd_conn_read(conn);
+    }
+
+    DL_DELETE(conn->pending, &request);
+
+    /* Someone else has to read responses now */
+    chitcpd_conn_handoff(conn);
+
+    pthread_mutex_unlock(&conn->lock_requests);
+    pthread_cond_destroy(&request.cv_done);
+
+    if (rc == CHITCP_OK)
+        *resp_p = request.resp;
+
+    return rc;
+}
+
 /* See daemon_api.h */
 int chitcpd_send_command(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p)
 {
+    daemon_conn_t *conn = daemon_conn;
+    int r; /* return value */
+
+    if (daemon_local && sockfd == CHITCPD_LOCAL_SOCKET)
+        return daemon_local->call(daemon_local->arg, (ChitcpdMsg *) req, -1, NULL, resp_p);
+
+    if (conn && sockfd == conn->daemon_socket)
+        r = chitcpd_send_command_mux(conn, req, -1, resp_p);
+    else
+        r = chitcpd_send_and_recv_msg(sockfd, req, resp_p);
+    if (r == -1)
+        fprintf(stderr, "Daemon socket disconnected\n");
+
+    return r;
+}
+
+/* See daemon_api.h */
+int chitcpd_send_command_fd(int sockfd, const ChitcpdMsg *req, int fd, ChitcpdMsg **resp_p)
+{
+    daemon_conn_t *conn = daemon_conn;
     int r; /* return value */
 
-    r = chitcpd_send_and_recv_msg(sockfd, req, resp_p);
+    if (daemon_local && sockfd == CHITCPD_LOCAL_SOCKET)
+        return daemon_local->call(daemon_local->arg, (ChitcpdMsg *) req, fd, NULL, resp_p);
+
+    if (conn && sockfd == conn->daemon_socket)
+        r = chitcpd_send_command_mux(conn, req, fd, resp_p);
+    else if ((r = chitcpd_send_msg(sockfd, req)) == CHITCP_OK &&
+             (r = chitcpd_send_fd(sockfd, fd)) == CHITCP_OK)
+        r = chitcpd_recv_msg(sockfd, resp_p);
     if (r == -1)
         fprintf(stderr, "Daemon socket disconnected\n");
 
     return r;
 }
+
+/* See daemon_api.h */
+int chitcpd_send_command_dst(int sockfd, const ChitcpdMsg *req, void *dst, ChitcpdMsg **resp_p)
+{
+    if (daemon_local && sockfd == CHITCPD_LOCAL_SOCKET)
+        return daemon_local->call(daemon_local->arg, (ChitcpdMsg *) req, -1, dst, resp_p);
+
+    return chitcpd_send_command(sockfd, req, resp_p);
+}
+
+/* See daemon_api.h */
+void chitcpd_free_response(int sockfd, ChitcpdMsg *resp)
+{
+    if (daemon_local && sockfd == CHITCPD_LOCAL_SOCKET)
+        daemon_local->release(daemon_local->arg, resp);
+    else
+        chitcpd_msg__free_unpacked(resp, NULL);
+}
+
+/* See debug_api.h */
+chitcpd_subscription_t *chitcpd_subscribe(const chitcpd_subscription_fd_t *fds, int nfds)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSubscribeArgs sa = CHITCPD_SUBSCRIBE_ARGS__INIT;
+    ChitcpdPollFd *pfds, **pfds_p;
+    chitcpd_subscription_t *sub;
+    daemon_conn_t *conn;
+    int rc;
+
+    /* An in-process daemon has nowhere to send the notifications */
+    if (daemon_local)
+    {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    if (chitcpd_get_socket() < 0 || (conn = daemon_conn) == NULL)
+    {
+        fprintf(stderr, "%s: Error when connecting to chiTCP daemon.\n", __func__);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    sub = calloc(1, sizeof(chitcpd_subscription_t));
+    pfds = malloc((nfds + 1) * sizeof(ChitcpdPollFd));
+    pfds_p = malloc((nfds + 1) * sizeof(ChitcpdPollFd*));
+    if (!sub || !pfds || !pfds_p)
+    {
+        free(sub);
+        free(pfds);
+        free(pfds_p);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (int i = 0; i < nfds; i++)
+    {
+        chitcpd_poll_fd__init(&pfds[i]);
+        pfds[i].sockfd = fds[i].sockfd;
+        pfds[i].events = fds[i].events;
+        pfds_p[i] = &pfds[i];
+    }
+
+    req.code = CHITCPD_MSG_CODE__SUBSCRIBE;
+    req.subscribe_args = &sa;
+
+    sa.n_fds = nfds;
+    sa.fds = pfds_p;
+
+    sub->conn = conn;
+    pthread_cond_init(&sub->cv, NULL);
+
+    pthread_mutex_lock(&conn->lock_requests);
+    rc = conn->error;
+    if (rc == CHITCP_OK)
+    {
+        sub->request_id = chitcpd_conn_request_id(conn);
+        DL_APPEND(conn->subscriptions, sub);
+    }
+    pthread_mutex_unlock(&conn->lock_requests);
+
+    /* The subscription doesn't complete until it is cancelled, so it
+     * gets a lane of its own (or it would hold up this thread's lane) */
+    req.request_id = sub->request_id;
+    req.lane = __atomic_add_fetch(&next_lane, 1, __ATOMIC_RELAXED);
+
+    if (rc == CHITCP_OK)
+    {
+        pthread_mutex_lock(&conn->lock_send);
+        rc = chitcpd_channel_send_msg(&conn->channel, &req);
+        pthread_mutex_unlock(&conn->lock_send);
+
+        if (rc != CHITCP_OK)
+        {
+            pthread_mutex_lock(&conn->lock_requests);
+            DL_DELETE(conn->subscriptions, sub);
+            pthread_mutex_unlock(&conn->lock_requests);
+        }
+    }
+
+    free(pfds);
+    free(pfds_p);
+
+    if (rc != CHITCP_OK)
+    {
+        fprintf(stderr, "%s: Error when communicating with chiTCP daemon.\n", __func__);
+        pthread_cond_destroy(&sub->cv);
+        free(sub);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return sub;
+}
+
+/* See debug_api.h */
+int chitcpd_get_notifications(chitcpd_subscription_t *sub, chitcpd_notification_t *notes, int max, int timeout)
+{
+    daemon_conn_t *conn = sub->conn;
+    struct timespec deadline;
+    int n, rc = CHITCP_OK;
+
+    if (timeout > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&conn->lock_requests);
+    sub->waiting = TRUE;
+
+    while (sub->num_notes == 0 && !sub->ended && !conn->error)
+    {
+        if (conn->reading)
+        {
+            if (timeout == 0)
+                break;
+            else if (timeout < 0)
+                pthread_cond_wait(&sub->cv, &conn->lock_requests);
+            else if (pthread_cond_timedwait(&sub->cv, &conn->lock_requests, &deadline) == ETIMEDOUT)
+                break;
+            continue;
+        }
+
+        /* Nobody is reading from the daemon, so we do. With a timeout,
+         * we first wait for the daemon to send something, so we don't
+         * block past the deadline (meanwhile, nobody else reads, but
+         * we read whatever arrives for them too). */
+        if (timeout >= 0)
+        {
+            struct pollfd pfd = { .fd = conn->daemon_socket, .events = POLLIN };
+            struct timespec now;
+            long remaining = 0;
+            int ready;
+
+            if (timeout > 0)
+            {
+                clock_gettime(CLOCK_REALTIME, &now);
+                remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+                            (deadline.tv_nsec - now.tv_nsec) / 1000000;
+                if (remaining < 0)
+                    remaining = 0;
+            }
+
+            conn->reading = TRUE;
+            pthread_mutex_unlock(&conn->lock_requests);
+            ready = poll(&pfd, 1, remaining);
+            pthread_mutex_lock(&conn->lock_requests);
+            conn->reading = FALSE;
+
+            if (ready == -1 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                break;
+        }
+
+        rc = chitcpd_conn_read(conn);
+        if (rc < 0)
+            break;
+    }
+
+    sub->waiting = FALSE;
+
+    n = MIN(max, sub->num_notes);
+    if (n > 0)
+    {
+        memcpy(notes, sub->notes, n * sizeof(chitcpd_notification_t));
+        sub->num_notes -= n;
+        memmove(sub->notes, sub->notes + n, sub->num_notes * sizeof(chitcpd_notification_t));
+    }
+    else if (sub->ended && sub->error_code)
+    {
+        errno = sub->error_code;
+        n = -1;
+    }
+    else if (sub->ended || conn->error)
+    {
+        errno = EPROTO;
+        n = -1;
+    }
+
+    /* Someone else has to read responses now */
+    chitcpd_conn_handoff(conn);
+    pthread_mutex_unlock(&conn->lock_requests);
+
+    return n;
+}
+
+/* See debug_api.h */
+int chitcpd_unsubscribe(chitcpd_subscription_t *sub)
+{
+    daemon_conn_t *conn = sub->conn;
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdUnsubscribeArgs ua = CHITCPD_UNSUBSCRIBE_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int ret = 0, error_code = 0;
+    int rc;
+
+    req.code = CHITCPD_MSG_CODE__UNSUBSCRIBE;
+    req.unsubscribe_args = &ua;
+
+    ua.subscription_id = sub->request_id;
+
+    rc = chitcpd_send_command(conn->daemon_socket, &req, &resp_p);
+    if (rc == CHITCP_OK)
+    {
+        assert(resp_p->resp != NULL);
+        ret = resp_p->resp->ret;
+        error_code = resp_p->resp->error_code;
+        chitcpd_msg__free_unpacked(resp_p, NULL);
+    }
+
+    /* Wait for the subscription's final response, so nothing can
+     * arrive for it once it has been freed */
+    pthread_mutex_lock(&conn->lock_requests);
+    sub->waiting = TRUE;
+    while (!sub->ended && !conn->error)
+    {
+        if (conn->reading)
+            pthread_cond_wait(&sub->cv, &conn->lock_requests);
+        else if (chitcpd_conn_read(conn) < 0)
+            break;
+    }
+    DL_DELETE(conn->subscriptions, sub);
+    chitcpd_conn_handoff(conn);
+    pthread_mutex_unlock(&conn->lock_requests);
+
+    pthread_cond_destroy(&sub->cv);
+    free(sub->notes);
+    free(sub);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* The subscription may have already ended on its own */
+    if (error_code == ENOENT)
+        return 0;
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
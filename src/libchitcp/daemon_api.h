@@ -44,6 +44,7 @@
 #ifndef DAEMON_API_H_
 #define DAEMON_API_H_
 
+#include <limits.h>
 #include "protobuf-wrapper.h"
 
 #define CHITCPD_FAIL(msg) { \
@@ -51,8 +52,79 @@
     errno = EPROTO; \
     return -1; }
 
+/* Descriptor returned by chitcpd_get_socket when the daemon is running
+ * in-process (see chitcpd_set_local) */
+#define CHITCPD_LOCAL_SOCKET (INT_MAX)
+
+/* A daemon running in the same process as the application (see
+ * chitcp_embedded_start). Instead of being sent to the daemon, requests
+ * are handed to "call", which handles them in the calling thread and
+ * returns the response (which is eventually handed to "release"). The
+ * arguments are the same as chitcpd_send_command_dst's. */
+typedef struct chitcpd_local
+{
+    int (*call)(void *arg, ChitcpdMsg *req, int fd, void *dst, ChitcpdMsg **resp_p);
+    void (*release)(void *arg, ChitcpdMsg *resp);
+    void *arg;
+} chitcpd_local_t;
+
+/*
+ * chitcpd_set_local - Send all the requests to an in-process daemon
+ *
+ * Once this is called, chitcpd_get_socket returns CHITCPD_LOCAL_SOCKET, and
+ * the requests sent on it are handled by "local". It must not be called
+ * while other threads are using the socket API.
+ *
+ * local: The in-process daemon (NULL to go back to using chitcpd)
+ *
+ * Returns:
+ *  - CHITCP_OK: The daemon has been set
+ *  - CHITCP_EINVAL: There already is an in-process daemon
+ *
+ */
+int chitcpd_set_local(const chitcpd_local_t *local);
+
+/*
+ * chitcpd_get_socket - Get the process's connection to the chiTCP daemon
+ *
+ * The connection (and its shared data window) is set up the first time
+ * this function is called, and is then shared by all the threads in the
+ * process (see chitcpd_send_command).
+ *
+ * Returns: The socket descriptor of the connection to the daemon
+ *          (CHITCPD_LOCAL_SOCKET if the daemon is in-process),
+ *          or a negative value if there was an error.
+ */
 int chitcpd_get_socket();
 
+/*
+ * chitcpd_shm_acquire - Get a slot in the shared data window of the
+ *                       process's connection to the daemon
+ *
+ * The window is set up by chitcpd_get_socket (when the daemon supports
+ * it), so this function must be called after it. The caller has
+ * exclusive use of the slot until it releases it with chitcpd_shm_release
+ * (which it must not do before it receives the response to the request
+ * that uses the slot).
+ *
+ * offset: Output parameter to return the offset of the slot in the window
+ *
+ * size: Output parameter to return the size of the slot
+ *
+ * Returns: The slot, or NULL if there is no window or no free slot
+ *          (in which case payloads are carried in the messages themselves)
+ */
+uint8_t *chitcpd_shm_acquire(uint32_t *offset, uint32_t *size);
+
+/*
+ * chitcpd_shm_release - Release a slot obtained with chitcpd_shm_acquire
+ *
+ * offset: Offset of the slot in the window
+ *
+ * Returns: Nothing.
+ */
+void chitcpd_shm_release(uint32_t offset);
+
 /*
  * chitcpd_connect - Create a connection to the local chiTCP daemon
  *
@@ -68,11 +140,17 @@ int chitcpd_connect();
  * the local chiTCP daemon, and assumes that a connection has already
  * been made on that socket.
  *
+ * If SOCKFD is the connection returned by chitcpd_get_socket, which is
+ * shared by all the threads in the process, this function can be called
+ * from several threads at once: each one gets the response to its own
+ * request, and a request that blocks in the daemon does not hold up
+ * requests from other threads.
+ *
  * req: The chiTCP daemon request
  *
  * resp_p: Output parameter to return the response from the chiTCP daemon.
  *         The returned pointer should be freed by the caller using
- *         chitcpd_msg__free_unpacked(*resp_p, NULL).
+ *         chitcpd_free_response(sockfd, *resp_p).
  *
  * Returns:
  *   0 - Success
@@ -82,4 +160,40 @@ int chitcpd_connect();
  */
 int chitcpd_send_command(int sockfd, const ChitcpdMsg *req, ChitcpdMsg **resp_p);
 
+/*
+ * chitcpd_send_command_fd - Send a command that comes with a file descriptor
+ *
+ * Same as chitcpd_send_command, but the file descriptor is passed to the
+ * daemon (see chitcpd_send_fd) right after the request, so the daemon
+ * can read it as soon as it has received the request.
+ *
+ * fd: File descriptor to pass
+ *
+ */
+int chitcpd_send_command_fd(int sockfd, const ChitcpdMsg *req, int fd, ChitcpdMsg **resp_p);
+
+/*
+ * chitcpd_send_command_dst - Send a RECV command, with a place for its data
+ *
+ * Same as chitcpd_send_command but, if the daemon is in-process, it copies
+ * the data straight into "dst", and the response carries no data (its ret
+ * is still the number of bytes received). Otherwise, "dst" is ignored.
+ *
+ * dst: Where to copy the data (with room for the requested number of bytes)
+ *
+ */
+int chitcpd_send_command_dst(int sockfd, const ChitcpdMsg *req, void *dst, ChitcpdMsg **resp_p);
+
+/*
+ * chitcpd_free_response - Free a response returned by chitcpd_send_command
+ *
+ * sockfd: Socket the command was sent on
+ *
+ * resp: The response
+ *
+ * Returns: Nothing.
+ *
+ */
+void chitcpd_free_response(int sockfd, ChitcpdMsg *resp);
+
 #endif /* DAEMON_API_H_ */
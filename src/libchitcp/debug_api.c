@@ -41,6 +41,7 @@
 #include "daemon_api.h"
 #include "chitcp/types.h"
 #include "chitcp/socket.h"
+#include "chitcp/addr.h"
 #include "chitcp/utlist.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -505,7 +506,7 @@ debug_socket_state_t *chitcpd_get_socket_state(int sockfd, bool_t include_buffer
     ret->RCV_WND = resp_p->resp->socket_state->rcv_wnd;
     ret->SND_WND = resp_p->resp->socket_state->snd_wnd;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
     if (include_buffers)
     {
         /* Send the command to get the buffer contents */
@@ -554,7 +555,7 @@ debug_socket_state_t *chitcpd_get_socket_state(int sockfd, bool_t include_buffer
         memcpy(ret->recv, resp_p->resp->socket_buffer_contents->rcv.data, ret->recv_len);
         memcpy(ret->send, resp_p->resp->socket_buffer_contents->snd.data, ret->send_len);
 
-        chitcpd_msg__free_unpacked(resp_p, NULL);
+        chitcpd_free_response(daemon_socket, resp_p);
     }
     return ret;
 }
@@ -589,10 +590,228 @@ int chitcpd_wait_for_state(int sockfd, tcp_state_t tcp_state)
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
 
     return ret;
 }
+
+
+/* Copies one of the latency histograms in a GET_STATS response */
+static void copy_rpc_stats(chitcp_rpc_stats_t *dst, const ChitcpdRpcStats *rpc)
+{
+    dst->code = rpc->code;
+    snprintf(dst->name, sizeof(dst->name), "%s", rpc->name? rpc->name : "");
+    dst->count = rpc->count;
+    dst->total_us = rpc->total_us;
+    for (size_t b = 0; b < rpc->n_buckets && b < CHITCP_RPC_LATENCY_BUCKETS; b++)
+        dst->buckets[b] = rpc->buckets[b];
+}
+
+int chitcpd_get_stats(int sockfd, chitcp_socket_stats_t *socket_stats, chitcp_daemon_stats_t *daemon_stats)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdGetStatsArgs gsa = CHITCPD_GET_STATS_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    ChitcpdStats *stats;
+    int rc;
+
+    int daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.")
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__GET_STATS;
+    req.get_stats_args = &gsa;
+
+    gsa.sockfd = sockfd;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    if (resp_p->resp->error_code)
+    {
+        errno = resp_p->resp->error_code;
+        chitcpd_free_response(daemon_socket, resp_p);
+        return -1;
+    }
+
+    stats = resp_p->resp->stats;
+    assert(stats != NULL);
+
+    if (socket_stats && sockfd != -1)
+    {
+        assert(stats->socket != NULL);
+        socket_stats->segs_in = stats->socket->segs_in;
+        socket_stats->segs_out = stats->socket->segs_out;
+        socket_stats->bytes_in = stats->socket->bytes_in;
+        socket_stats->bytes_out = stats->socket->bytes_out;
+        socket_stats->retransmits = stats->socket->retransmits;
+        socket_stats->dup_acks = stats->socket->dup_acks;
+        socket_stats->out_of_order = stats->socket->out_of_order;
+        socket_stats->zero_window = stats->socket->zero_window;
+        socket_stats->srtt_us = stats->socket->srtt_us;
+        socket_stats->cwnd = stats->socket->cwnd;
+    }
+
+    if (daemon_stats)
+    {
+        memset(daemon_stats, 0, sizeof(chitcp_daemon_stats_t));
+        daemon_stats->delivery_queue_len = stats->delivery_queue_len;
+        daemon_stats->delivery_queue_max = stats->delivery_queue_max;
+        daemon_stats->mem_limit = stats->mem_limit;
+        daemon_stats->mem_used = stats->mem_used;
+        daemon_stats->mem_drops = stats->mem_drops;
+        daemon_stats->connections = calloc(stats->n_connections + 1, sizeof(chitcp_connection_stats_t));
+        daemon_stats->rpcs = calloc(stats->n_rpcs + 1, sizeof(chitcp_rpc_stats_t));
+        daemon_stats->stages = calloc(stats->n_stages + 1, sizeof(chitcp_rpc_stats_t));
+        if (!daemon_stats->connections || !daemon_stats->rpcs || !daemon_stats->stages)
+        {
+            chitcpd_free_stats(daemon_stats);
+            chitcpd_free_response(daemon_socket, resp_p);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for (size_t i = 0; i < stats->n_connections; i++)
+        {
+            ChitcpdConnectionStats *conn = stats->connections[i];
+            chitcp_connection_stats_t *dst = &daemon_stats->connections[daemon_stats->num_connections++];
+
+            memcpy(&dst->peer_addr, conn->peer_addr.data, MIN(conn->peer_addr.len, sizeof(struct sockaddr_storage)));
+            dst->packets_in = conn->packets_in;
+            dst->packets_out = conn->packets_out;
+        }
+
+        for (size_t i = 0; i < stats->n_rpcs; i++)
+            copy_rpc_stats(&daemon_stats->rpcs[daemon_stats->num_rpcs++], stats->rpcs[i]);
+        for (size_t i = 0; i < stats->n_stages; i++)
+            copy_rpc_stats(&daemon_stats->stages[daemon_stats->num_stages++], stats->stages[i]);
+    }
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    return 0;
+}
+
+
+void chitcpd_free_stats(chitcp_daemon_stats_t *daemon_stats)
+{
+    free(daemon_stats->connections);
+    free(daemon_stats->rpcs);
+    free(daemon_stats->stages);
+    daemon_stats->connections = NULL;
+    daemon_stats->rpcs = NULL;
+    daemon_stats->stages = NULL;
+    daemon_stats->num_connections = 0;
+    daemon_stats->num_rpcs = 0;
+    daemon_stats->num_stages = 0;
+}
+
+
+/* Writes the HELP and TYPE lines of a metric in the Prometheus text format */
+static void prometheus_metric(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s %s\n", name, type);
+}
+
+/* Writes the samples of one of the latency histograms of a metric, with
+ * the histogram's name as the value of LABEL. The buckets are cumulative
+ * in Prometheus histograms */
+static void prometheus_histogram(FILE *out, const char *name, const char *label, const chitcp_rpc_stats_t *hist)
+{
+    uint64_t cumulative = 0;
+
+    for (int b = 0; b < CHITCP_RPC_LATENCY_BUCKETS - 1; b++)
+    {
+        cumulative += hist->buckets[b];
+        fprintf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n",
+                name, label, hist->name, (double) (1ULL << b) / 1e6, (unsigned long long) cumulative);
+    }
+    fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, hist->name, (unsigned long long) hist->count);
+    fprintf(out, "%s_sum{%s=\"%s\"} %.6f\n", name, label, hist->name, hist->total_us / 1e6);
+    fprintf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, hist->name, (unsigned long long) hist->count);
+}
+
+int chitcpd_write_stats_prometheus(FILE *out, int sockfd, const chitcp_socket_stats_t *socket_stats,
+                                   const chitcp_daemon_stats_t *daemon_stats)
+{
+    if (socket_stats)
+    {
+        const struct
+        {
+            const char *name;
+            const char *help;
+            uint64_t value;
+        } counters[] =
+        {
+            {"chitcp_socket_segments_in_total", "Segments received", socket_stats->segs_in},
+            {"chitcp_socket_segments_out_total", "Segments sent", socket_stats->segs_out},
+            {"chitcp_socket_bytes_in_total", "Payload bytes received", socket_stats->bytes_in},
+            {"chitcp_socket_bytes_out_total", "Payload bytes sent", socket_stats->bytes_out},
+            {"chitcp_socket_retransmits_total", "Segments retransmitted", socket_stats->retransmits},
+            {"chitcp_socket_dup_acks_total", "Duplicate ACKs received", socket_stats->dup_acks},
+            {"chitcp_socket_out_of_order_total", "Segments received out of order", socket_stats->out_of_order},
+            {"chitcp_socket_zero_window_total", "Times the peer closed its window", socket_stats->zero_window}
+        };
+
+        for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+        {
+            prometheus_metric(out, counters[i].name, "counter", counters[i].help);
+            fprintf(out, "%s{sockfd=\"%i\"} %llu\n", counters[i].name, sockfd, (unsigned long long) counters[i].value);
+        }
+
+        prometheus_metric(out, "chitcp_socket_srtt_seconds", "gauge", "Smoothed round-trip time");
+        fprintf(out, "chitcp_socket_srtt_seconds{sockfd=\"%i\"} %.6f\n", sockfd, socket_stats->srtt_us / 1e6);
+        prometheus_metric(out, "chitcp_socket_cwnd_bytes", "gauge", "Congestion window");
+        fprintf(out, "chitcp_socket_cwnd_bytes{sockfd=\"%i\"} %u\n", sockfd, socket_stats->cwnd);
+    }
+
+    if (daemon_stats)
+    {
+        char addr[INET6_ADDRSTRLEN + 8];
+
+        prometheus_metric(out, "chitcp_connection_packets_in_total", "counter", "Packets received from a chiTCP daemon");
+        for (int i = 0; i < daemon_stats->num_connections; i++)
+            fprintf(out, "chitcp_connection_packets_in_total{peer=\"%s\"} %llu\n",
+                    chitcp_addr_str((struct sockaddr *) &daemon_stats->connections[i].peer_addr, addr, sizeof(addr)),
+                    (unsigned long long) daemon_stats->connections[i].packets_in);
+        prometheus_metric(out, "chitcp_connection_packets_out_total", "counter", "Packets sent to a chiTCP daemon");
+        for (int i = 0; i < daemon_stats->num_connections; i++)
+            fprintf(out, "chitcp_connection_packets_out_total{peer=\"%s\"} %llu\n",
+                    chitcp_addr_str((struct sockaddr *) &daemon_stats->connections[i].peer_addr, addr, sizeof(addr)),
+                    (unsigned long long) daemon_stats->connections[i].packets_out);
+
+        prometheus_metric(out, "chitcp_delivery_queue_length", "gauge", "Packets waiting to be delivered");
+        fprintf(out, "chitcp_delivery_queue_length %llu\n", (unsigned long long) daemon_stats->delivery_queue_len);
+        prometheus_metric(out, "chitcp_delivery_queue_max_length", "gauge", "Most packets that have been waiting to be delivered");
+        fprintf(out, "chitcp_delivery_queue_max_length %llu\n", (unsigned long long) daemon_stats->delivery_queue_max);
+
+        prometheus_metric(out, "chitcp_memory_limit_bytes", "gauge", "Memory budget of the daemon (0: no limit)");
+        fprintf(out, "chitcp_memory_limit_bytes %llu\n", (unsigned long long) daemon_stats->mem_limit);
+        prometheus_metric(out, "chitcp_memory_used_bytes", "gauge", "Memory charged to the daemon's budget");
+        fprintf(out, "chitcp_memory_used_bytes %llu\n", (unsigned long long) daemon_stats->mem_used);
+        prometheus_metric(out, "chitcp_memory_drops_total", "counter", "Packets and buffer growth refused because the memory budget was full");
+        fprintf(out, "chitcp_memory_drops_total %llu\n", (unsigned long long) daemon_stats->mem_drops);
+
+        prometheus_metric(out, "chitcp_rpc_latency_seconds", "histogram", "Time taken to handle requests");
+        for (int i = 0; i < daemon_stats->num_rpcs; i++)
+            prometheus_histogram(out, "chitcp_rpc_latency_seconds", "code", &daemon_stats->rpcs[i]);
+
+        if (daemon_stats->num_stages > 0)
+        {
+            prometheus_metric(out, "chitcp_segment_latency_seconds", "histogram", "Time taken by received segments in each stage of the daemon");
+            for (int i = 0; i < daemon_stats->num_stages; i++)
+                prometheus_histogram(out, "chitcp_segment_latency_seconds", "stage", &daemon_stats->stages[i]);
+        }
+    }
+
+    return ferror(out)? -1 : 0;
+}
@@ -40,85 +40,417 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
 #include <pthread.h> /* for pthread_self */
 
+#include "chitcp/types.h"
 #include "chitcp/log.h"
 #include "chitcp/addr.h"
 
 
 /* Logging level. Set by default to print just errors */
-static int loglevel = ERROR;
+int chilog_level = ERROR;
 
+/* Longest message in a log record (including the terminating NUL) */
+#define CHILOG_MSG_MAX (256)
 
-void chitcp_setloglevel(loglevel_t level)
-{
-    loglevel = level;
-}
+/* Number of records in each thread's ring (must be a power of two) */
+#define CHILOG_RING_SIZE (256)
+#define CHILOG_RING_MASK (CHILOG_RING_SIZE - 1)
 
+/* Longest log line (timestamp, level and thread name included) */
+#define CHILOG_LINE_MAX (CHILOG_MSG_MAX + 64)
 
-void chilog(loglevel_t level, char *fmt, ...)
+typedef struct chilog_record
 {
     struct timespec ts;
-    struct tm *tm;
-    char timefmt[64], buf[80], *levelstr;
-    va_list argptr;
+    loglevel_t level;
+    char msg[CHILOG_MSG_MAX];
+} chilog_record_t;
+
+/* Ring of log records of a single thread. The thread is the only one
+ * that advances head, and the writer thread is the only one that advances
+ * tail. When a thread exits, its ring is recycled (once it has been
+ * drained) for a new thread, so rings are never freed. */
+typedef struct chilog_ring
+{
+    char threadname[16];
+    chilog_record_t records[CHILOG_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool in_use;
+    atomic_bool exited;
+    struct chilog_ring *next;
+} chilog_ring_t;
+
+/* Asynchronous logging */
+static atomic_bool async_enabled = FALSE;
+static bool_t async_started = FALSE;
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cv = PTHREAD_COND_INITIALIZER;
+static atomic_bool async_sleeping = FALSE;
+static atomic_bool async_stopping = FALSE;
+static pthread_key_t async_ring_key;
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+static chilog_ring_t *_Atomic async_rings = NULL;
+static char async_buf[64 * 1024];
+static size_t async_buf_len = 0;
+
+/* Per-thread state */
+static __thread char thread_name[16];
+static __thread bool_t thread_named = FALSE;
+static __thread chilog_ring_t *thread_ring = NULL;
 
-    if(level > loglevel)
-        return;
 
+void chitcp_setloglevel(loglevel_t level)
+{
+    chilog_level = level;
+}
 
-    clock_gettime(CLOCK_REALTIME, &ts);
-    if((tm = localtime(&ts.tv_sec)) != NULL)
-    {
-            strftime(timefmt, sizeof(timefmt), "%H:%M:%S.%%09u", tm);
-            snprintf(buf, sizeof(buf), timefmt, ts.tv_nsec);
-    }
 
+static const char *chilog_level_str(loglevel_t level)
+{
     switch(level)
     {
     case CRITICAL:
-        levelstr = "CRITIC";
-        break;
+        return "CRITIC";
     case ERROR:
-        levelstr = "ERROR";
-        break;
+        return "ERROR";
     case WARNING:
-        levelstr = "WARN";
-        break;
+        return "WARN";
     case MINIMAL:
-        levelstr = "MINIMAL";
-        break;
+        return "MINIMAL";
     case INFO:
-        levelstr = "INFO";
-        break;
+        return "INFO";
     case DEBUG:
-        levelstr = "DEBUG";
-        break;
+        return "DEBUG";
     case TRACE:
-        levelstr = "TRACE";
-        break;
+        return "TRACE";
     default:
-        levelstr = "UNKNOWN";
-        break;
+        return "UNKNOWN";
     }
+}
 
-    /* Get the thread's name. */
-    char threadname[16];
-    pthread_getname_np(pthread_self(), threadname, 16);
+/* The thread's name is only read the first time the thread logs
+ * something (pthread_getname_np can be a system call) */
+static const char *chilog_thread_name()
+{
+    if(!thread_named)
+    {
+        pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name));
+        thread_named = TRUE;
+    }
+    return thread_name;
+}
 
-    flockfile(stdout);
-    if (loglevel == MINIMAL)
-        printf("[%s] %16s ", buf, threadname);
+/* Formats a log line, and returns its length */
+static int chilog_format(char *out, size_t size, const char *threadname, loglevel_t level, struct timespec *ts,
+                         const char *msg, int len)
+{
+    static __thread time_t cached_sec = -1;
+    static __thread char cached_time[16];
+    struct tm tm;
+    int n;
+
+    /* Formatting the time of day is only needed once per second */
+    if(ts->tv_sec != cached_sec)
+    {
+        if(localtime_r(&ts->tv_sec, &tm) != NULL)
+            strftime(cached_time, sizeof(cached_time), "%H:%M:%S", &tm);
+        else
+            cached_time[0] = '\0';
+        cached_sec = ts->tv_sec;
+    }
+
+    if (chilog_level == MINIMAL)
+        n = snprintf(out, size, "[%s.%09lu] %16s %.*s\n", cached_time, (unsigned long) ts->tv_nsec, threadname, len, msg);
     else
-        printf("[%s] %7s %16s ", buf, levelstr, threadname);
+        n = snprintf(out, size, "[%s.%09lu] %7s %16s %.*s\n", cached_time, (unsigned long) ts->tv_nsec,
+                     chilog_level_str(level), threadname, len, msg);
+
+    return MIN(n, (int) size - 1);
+}
+
+static void chilog_async_wake()
+{
+    pthread_mutex_lock(&async_lock);
+    pthread_cond_signal(&async_cv);
+    pthread_mutex_unlock(&async_lock);
+}
+
+/* pthread_key destructor: the ring can be recycled once it's drained */
+static void chilog_ring_release(void *arg)
+{
+    chilog_ring_t *ring = (chilog_ring_t *) arg;
+
+    atomic_store(&ring->exited, TRUE);
+    if(atomic_load(&async_sleeping))
+        chilog_async_wake();
+}
+
+static void chilog_async_init_key()
+{
+    pthread_key_create(&async_ring_key, chilog_ring_release);
+}
+
+/* Returns the calling thread's ring, getting one first if needed */
+static chilog_ring_t *chilog_thread_ring()
+{
+    chilog_ring_t *ring;
+    bool expected;
+
+    if(thread_ring != NULL)
+        return thread_ring;
+
+    /* Reuse the ring of a thread that has exited (if any) */
+    for(ring = atomic_load(&async_rings); ring != NULL; ring = ring->next)
+    {
+        expected = false;
+        if(atomic_compare_exchange_strong(&ring->in_use, &expected, true))
+            break;
+    }
+
+    if(ring == NULL)
+    {
+        ring = calloc(1, sizeof(chilog_ring_t));
+        if(ring == NULL)
+            return NULL;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->in_use, TRUE);
+        atomic_init(&ring->exited, FALSE);
+
+        ring->next = atomic_load(&async_rings);
+        while(!atomic_compare_exchange_weak(&async_rings, &ring->next, ring));
+    }
+
+    strncpy(ring->threadname, chilog_thread_name(), sizeof(ring->threadname) - 1);
+    pthread_setspecific(async_ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+static bool_t chilog_async(loglevel_t level, char *fmt, va_list argptr)
+{
+    chilog_ring_t *ring = chilog_thread_ring();
+    chilog_record_t *rec;
+    size_t head;
+
+    if(ring == NULL)
+        return FALSE;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= CHILOG_RING_SIZE)
+    {
+        /* The ring is full, so we wait for the writer to make room */
+        chilog_async_wake();
+        sched_yield();
+    }
+
+    rec = &ring->records[head & CHILOG_RING_MASK];
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->level = level;
+    vsnprintf(rec->msg, CHILOG_MSG_MAX, fmt, argptr);
+
+    /* Publish the record, and wake up the writer if it's waiting for
+     * one (both this store and the load of async_sleeping are
+     * sequentially consistent, so the writer can't miss the record) */
+    atomic_store(&ring->head, head + 1);
+    if(atomic_load(&async_sleeping))
+        chilog_async_wake();
+
+    return TRUE;
+}
+
+/* The writer writes straight to the standard output's file descriptor
+ * through its own buffer (instead of using stdout, which threads may
+ * be holding the lock of while they log) */
+static void chilog_async_flush()
+{
+    size_t written = 0;
+    ssize_t n;
+
+    while(written < async_buf_len)
+    {
+        n = write(STDOUT_FILENO, async_buf + written, async_buf_len - written);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        written += n;
+    }
+    async_buf_len = 0;
+}
+
+/* Prints all the records in the rings, merging them in timestamp order.
+ * Returns the number of records printed. */
+static int chilog_async_drain()
+{
+    chilog_ring_t *ring, *min;
+    chilog_record_t *rec, *min_rec;
+    int printed = 0;
+
+    for(;;)
+    {
+        min = NULL;
+        min_rec = NULL;
+
+        for(ring = atomic_load(&async_rings); ring != NULL; ring = ring->next)
+        {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+            if(atomic_load(&ring->head) == tail)
+            {
+                /* A thread that exited has nothing else to log (but it
+                 * may have logged something right before exiting) */
+                if(atomic_load(&ring->exited) && atomic_load(&ring->head) == tail)
+                {
+                    atomic_store(&ring->exited, FALSE);
+                    atomic_store(&ring->in_use, FALSE);
+                }
+                continue;
+            }
+
+            rec = &ring->records[tail & CHILOG_RING_MASK];
+            if(min_rec == NULL || rec->ts.tv_sec < min_rec->ts.tv_sec ||
+               (rec->ts.tv_sec == min_rec->ts.tv_sec && rec->ts.tv_nsec < min_rec->ts.tv_nsec))
+            {
+                min = ring;
+                min_rec = rec;
+            }
+        }
+
+        if(min == NULL)
+            return printed;
+
+        if(sizeof(async_buf) - async_buf_len < CHILOG_LINE_MAX)
+            chilog_async_flush();
+        async_buf_len += chilog_format(async_buf + async_buf_len, sizeof(async_buf) - async_buf_len,
+                                       min->threadname, min_rec->level, &min_rec->ts,
+                                       min_rec->msg, strlen(min_rec->msg));
+        atomic_store_explicit(&min->tail, atomic_load_explicit(&min->tail, memory_order_relaxed) + 1,
+                              memory_order_release);
+        printed++;
+    }
+}
+
+static void *chilog_async_writer(void *args)
+{
+    struct timespec timeout;
+
+    for(;;)
+    {
+        if(chilog_async_drain() > 0)
+            continue;
+
+        chilog_async_flush();
+
+        if(atomic_load(&async_stopping))
+            break;
+
+        pthread_mutex_lock(&async_lock);
+        atomic_store(&async_sleeping, TRUE);
+        /* Check again, now that producers will wake us up */
+        if(chilog_async_drain() == 0 && !atomic_load(&async_stopping))
+        {
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += 1;
+            pthread_cond_timedwait(&async_cv, &async_lock, &timeout);
+        }
+        atomic_store(&async_sleeping, FALSE);
+        pthread_mutex_unlock(&async_lock);
+    }
+
+    return NULL;
+}
+
+
+int chitcp_log_async_start()
+{
+    static bool_t atexit_registered = FALSE;
+
+    if(async_started)
+        return CHITCP_OK;
+
+    pthread_once(&async_once, chilog_async_init_key);
+
+    /* Anything printed so far must come out before the writer's output */
+    fflush(stdout);
+
+    atomic_store(&async_stopping, FALSE);
+    if(pthread_create(&async_thread, NULL, chilog_async_writer, NULL) != 0)
+        return CHITCP_ETHREAD;
+
+    async_started = TRUE;
+    atomic_store(&async_enabled, TRUE);
+
+    if(!atexit_registered)
+    {
+        atexit(chitcp_log_async_stop);
+        atexit_registered = TRUE;
+    }
+
+    return CHITCP_OK;
+}
+
+
+void chitcp_log_async_stop()
+{
+    if(!async_started)
+        return;
+
+    /* Threads that are logging right now may still add records, which
+     * the writer prints before exiting */
+    atomic_store(&async_enabled, FALSE);
+
+    pthread_mutex_lock(&async_lock);
+    atomic_store(&async_stopping, TRUE);
+    pthread_cond_signal(&async_cv);
+    pthread_mutex_unlock(&async_lock);
+
+    pthread_join(async_thread, NULL);
+    chilog_async_drain();
+    chilog_async_flush();
+
+    async_started = FALSE;
+}
+
+
+void chilog_emit(loglevel_t level, char *fmt, ...)
+{
+    struct timespec ts;
+    char msg[CHILOG_MSG_MAX * 4], line[CHILOG_MSG_MAX * 4 + CHILOG_LINE_MAX];
+    va_list argptr;
+    int len;
+
+    if(level > chilog_level)
+        return;
+
     va_start(argptr, fmt);
-    vprintf(fmt, argptr);
-    printf("\n");
-    funlockfile(stdout);
+    if(atomic_load_explicit(&async_enabled, memory_order_relaxed) && chilog_async(level, fmt, argptr))
+    {
+        va_end(argptr);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    len = vsnprintf(msg, sizeof(msg), fmt, argptr);
     va_end(argptr);
+    if(len >= (int) sizeof(msg))
+        len = sizeof(msg) - 1;
+
+    len = chilog_format(line, sizeof(line), chilog_thread_name(), level, &ts, msg, len);
+    fwrite(line, 1, len, stdout);
     fflush(stdout);
 }
 
@@ -140,9 +472,9 @@ static char* srcdst_str(struct sockaddr *src, struct sockaddr *dst, char *buf, i
     return buf;
 }
 
-void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char* prefix)
+void chilog_tcp_minimal_emit(struct sockaddr *src, struct sockaddr *dst, int sockfd, tcp_packet_t *packet, char* prefix)
 {
-    if(loglevel != MINIMAL)
+    if(chilog_level != MINIMAL)
         return;
 
     tcphdr_t *header = (tcphdr_t*) packet->raw;
@@ -183,9 +515,9 @@ void chilog_tcp_minimal(struct sockaddr *src, struct sockaddr *dst, int sockfd,
                     sockfd, prefix, srcdst, flags, seqstr, ackstr, chitcp_ntohs(header->win), payload_len);
 }
 
-void chilog_tcp(loglevel_t level, tcp_packet_t *packet, char prefix)
+void chilog_tcp_emit(loglevel_t level, tcp_packet_t *packet, char prefix)
 {
-    if(level > loglevel)
+    if(level > chilog_level)
         return;
 
     tcphdr_t *header = (tcphdr_t*) packet->raw;
@@ -228,9 +560,9 @@ void chilog_tcp(loglevel_t level, tcp_packet_t *packet, char prefix)
 }
 
 
-void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix)
+void chilog_chitcp_emit(loglevel_t level, uint8_t *packet, char prefix)
 {
-    if(level > loglevel)
+    if(level > chilog_level)
         return;
 
     chitcphdr_t *header = (chitcphdr_t*) packet;
@@ -245,7 +577,7 @@ void chilog_chitcp(loglevel_t level, uint8_t *packet, char prefix)
 
 
 // Based on http://stackoverflow.com/questions/7775991/how-to-get-hexdump-of-a-structure-data
-void chilog_hex (loglevel_t level, void *data, int len)
+void chilog_hex_emit(loglevel_t level, void *data, int len)
 {
     int i;
     char buf[8];
@@ -0,0 +1,400 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include "chitcp/types.h"
+#include "chitcp/addr.h"
+#include "chitcp/log.h"
+#include "chitcp/utils.h"
+#include "chitcp/multitimer.h"
+#include "chitcp/socket.h"
+#include "chitcp/tester.h"
+
+/* How often (in ms) a server that is still waiting for connections
+ * checks whether the clients that would make them have given up */
+#define MULTI_TESTER_POLL_INTERVAL (100)
+
+struct chitcp_multi_tester_client
+{
+    chitcp_tester_runnable func;
+    void *func_args;
+    chitcp_tester_result_t result;
+};
+
+/* A connection accepted by a server, which runs in a thread of its own */
+typedef struct multi_tester_conn
+{
+    chitcp_multi_tester_t *mt;
+    int sockfd;
+    int rc;
+    pthread_t thread;
+} multi_tester_conn_t;
+
+/* A server. Once clients_done is set, no client will connect to it
+ * anymore, so it only has to accept the connections already queued */
+struct chitcp_multi_tester_server
+{
+    chitcp_multi_tester_t *mt;
+    int sockfd;
+    uint16_t port;
+    pthread_t thread;
+    bool_t running;
+
+    int max_conns;
+    int accepted;
+    multi_tester_conn_t *conns;
+
+    bool_t clients_done;
+};
+
+
+static uint64_t multi_tester_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * SECOND + now.tv_nsec;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_init(chitcp_multi_tester_t *mt, int num_clients, int num_servers)
+{
+    if (num_clients <= 0 || num_servers <= 0)
+        return CHITCP_EINVAL;
+
+    memset(mt, 0, sizeof(chitcp_multi_tester_t));
+    mt->num_clients = num_clients;
+    mt->num_servers = num_servers;
+    mt->port = CHITCP_TESTER_DEFAULT_PORT;
+
+    mt->clients = calloc(num_clients, sizeof(chitcp_multi_tester_client_t));
+    mt->servers = calloc(num_servers, sizeof(chitcp_multi_tester_server_t));
+    if (mt->clients == NULL || mt->servers == NULL)
+    {
+        free(mt->clients);
+        free(mt->servers);
+        return CHITCP_ENOMEM;
+    }
+
+    for (int i = 0; i < num_clients; i++)
+        mt->clients[i].result.rc = -1;
+
+    RET_ON_ERROR(pthread_mutex_init(&mt->lock, NULL),
+            CHITCP_ESYNC);
+
+    return CHITCP_OK;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_client_run_set(chitcp_multi_tester_t *mt, int client, chitcp_tester_runnable func, void *args)
+{
+    if (client < -1 || client >= mt->num_clients)
+        return CHITCP_EINVAL;
+
+    for (int i = 0; i < mt->num_clients; i++)
+        if (client == -1 || client == i)
+        {
+            mt->clients[i].func = func;
+            mt->clients[i].func_args = args;
+        }
+
+    return CHITCP_OK;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_server_run_set(chitcp_multi_tester_t *mt, chitcp_tester_runnable func, void *args)
+{
+    mt->server_func = func;
+    mt->server_args = args;
+
+    return CHITCP_OK;
+}
+
+
+static void *multi_tester_conn_thread(void *args)
+{
+    multi_tester_conn_t *conn = (multi_tester_conn_t *) args;
+    chitcp_multi_tester_t *mt = conn->mt;
+
+    conn->rc = mt->server_func ? mt->server_func(conn->sockfd, mt->server_args) : 0;
+    chisocket_close(conn->sockfd);
+
+    return NULL;
+}
+
+/* Accepts the server's connections (each gets a thread that runs the
+ * server runnable), and waits for all of them to be done */
+static void *multi_tester_server_thread(void *args)
+{
+    chitcp_multi_tester_server_t *server = (chitcp_multi_tester_server_t *) args;
+    chitcp_multi_tester_t *mt = server->mt;
+    struct pollfd pfd = { .fd = server->sockfd, .events = POLLIN };
+
+    while (server->accepted < server->max_conns)
+    {
+        multi_tester_conn_t *conn;
+        bool_t clients_done;
+        int ready;
+
+        pthread_mutex_lock(&mt->lock);
+        clients_done = server->clients_done;
+        pthread_mutex_unlock(&mt->lock);
+
+        ready = chisocket_poll(&pfd, 1, MULTI_TESTER_POLL_INTERVAL);
+        if (ready <= 0)
+        {
+            if (clients_done)
+                break;
+            continue;
+        }
+
+        conn = &server->conns[server->accepted];
+        conn->mt = mt;
+        conn->rc = -1;
+        conn->sockfd = chisocket_accept(server->sockfd, NULL, NULL);
+        if (conn->sockfd == -1)
+        {
+            perror("Socket accept() failed");
+            continue;
+        }
+
+        if (pthread_create(&conn->thread, NULL, multi_tester_conn_thread, conn) != 0)
+        {
+            perror("Could not create tester's connection thread");
+            chisocket_close(conn->sockfd);
+            conn->sockfd = -1;
+        }
+        server->accepted++;
+    }
+
+    for (int i = 0; i < server->accepted; i++)
+        if (server->conns[i].sockfd != -1)
+            pthread_join(server->conns[i].thread, NULL);
+
+    return NULL;
+}
+
+/* Opens a server's socket, and starts its thread */
+static int multi_tester_server_start(chitcp_multi_tester_t *mt, chitcp_multi_tester_server_t *server, uint16_t port)
+{
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = chitcp_htons(port);
+    addr.sin_addr.s_addr = chitcp_htonl(INADDR_ANY);
+
+    server->mt = mt;
+    server->port = port;
+    server->accepted = 0;
+    server->clients_done = FALSE;
+
+    if ((server->sockfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+        return CHITCP_ESOCKET;
+
+    if (chisocket_bind(server->sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        chisocket_listen(server->sockfd, server->max_conns) == -1)
+    {
+        perror("Could not open tester's server socket");
+        chisocket_close(server->sockfd);
+        return CHITCP_ESOCKET;
+    }
+
+    if (pthread_create(&server->thread, NULL, multi_tester_server_thread, server) != 0)
+    {
+        perror("Could not create tester's server thread");
+        chisocket_close(server->sockfd);
+        return CHITCP_ETHREAD;
+    }
+
+    server->running = TRUE;
+
+    return CHITCP_OK;
+}
+
+/* Connects a client to its server, and runs its runnable */
+static void multi_tester_client_run(chitcp_multi_tester_t *mt, int i)
+{
+    chitcp_multi_tester_client_t *client = &mt->clients[i];
+    chitcp_multi_tester_server_t *server = &mt->servers[i % mt->num_servers];
+    struct sockaddr_in addr;
+    char port[6];
+    uint64_t t0, t1;
+    int sockfd;
+
+    snprintf(port, sizeof(port), "%u", server->port);
+    if (chitcp_addr_construct("localhost", port, &addr) ||
+        (sockfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+        client->result.error = errno;
+        return;
+    }
+
+    t0 = multi_tester_now();
+    if (chisocket_connect(sockfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1)
+    {
+        client->result.error = errno;
+        chisocket_close(sockfd);
+        return;
+    }
+    t1 = multi_tester_now();
+    client->result.connect_ns = t1 - t0;
+
+    client->result.rc = client->func ? client->func(sockfd, client->func_args) : 0;
+    client->result.run_ns = multi_tester_now() - t1;
+
+    chisocket_close(sockfd);
+}
+
+/* Runs clients, one at a time, until there are none left. Client i
+ * doesn't start before its share of the ramp-up has elapsed */
+static void *multi_tester_worker_thread(void *args)
+{
+    chitcp_multi_tester_t *mt = (chitcp_multi_tester_t *) args;
+
+    for (;;)
+    {
+        struct timespec ts;
+        uint64_t start;
+        int i;
+
+        pthread_mutex_lock(&mt->lock);
+        i = mt->next_client++;
+        pthread_mutex_unlock(&mt->lock);
+        if (i >= mt->num_clients)
+            break;
+
+        start = mt->start + (uint64_t) (mt->ramp_up * SECOND * i / mt->num_clients);
+        ts.tv_sec = start / SECOND;
+        ts.tv_nsec = start % SECOND;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        multi_tester_client_run(mt, i);
+    }
+
+    return NULL;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_run(chitcp_multi_tester_t *mt)
+{
+    int num_workers = (mt->concurrency > 0) ? MIN(mt->concurrency, mt->num_clients) : mt->num_clients;
+    int started = 0, rc = CHITCP_OK;
+    pthread_t *workers;
+
+    workers = calloc(num_workers, sizeof(pthread_t));
+    if (workers == NULL)
+        return CHITCP_ENOMEM;
+
+    /* The servers listen before any client starts */
+    for (int s = 0; s < mt->num_servers && rc == CHITCP_OK; s++)
+    {
+        chitcp_multi_tester_server_t *server = &mt->servers[s];
+
+        server->max_conns = (mt->num_clients + mt->num_servers - 1) / mt->num_servers;
+        server->conns = calloc(server->max_conns, sizeof(multi_tester_conn_t));
+        if (server->conns == NULL)
+            rc = CHITCP_ENOMEM;
+        else
+            rc = multi_tester_server_start(mt, server, mt->port + s);
+    }
+
+    mt->next_client = 0;
+    mt->start = multi_tester_now();
+    for (; rc == CHITCP_OK && started < num_workers; started++)
+        if (pthread_create(&workers[started], NULL, multi_tester_worker_thread, mt) != 0)
+        {
+            perror("Could not create tester's client thread");
+            rc = CHITCP_ETHREAD;
+        }
+
+    /* If not every worker could be started, the others still run
+     * all the clients */
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_lock(&mt->lock);
+    for (int s = 0; s < mt->num_servers; s++)
+        mt->servers[s].clients_done = TRUE;
+    pthread_mutex_unlock(&mt->lock);
+
+    for (int s = 0; s < mt->num_servers; s++)
+    {
+        chitcp_multi_tester_server_t *server = &mt->servers[s];
+
+        if (!server->running)
+            continue;
+        pthread_join(server->thread, NULL);
+        chisocket_close(server->sockfd);
+        server->running = FALSE;
+    }
+
+    free(workers);
+
+    return (started > 0) ? CHITCP_OK : rc;
+}
+
+/* See tester.h */
+const chitcp_tester_result_t *chitcp_multi_tester_result(chitcp_multi_tester_t *mt, int client)
+{
+    if (client < 0 || client >= mt->num_clients)
+        return NULL;
+
+    return &mt->clients[client].result;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_summary(chitcp_multi_tester_t *mt, chitcp_tester_summary_t *summary)
+{
+    uint64_t connect_total = 0, run_total = 0;
+
+    memset(summary, 0, sizeof(chitcp_tester_summary_t));
+    summary->clients = mt->num_clients;
+    summary->elapsed_ns = multi_tester_now() - mt->start;
+
+    for (int i = 0; i < mt->num_clients; i++)
+    {
+        chitcp_tester_result_t *result = &mt->clients[i].result;
+
+        if (result->rc != 0)
+            summary->failed++;
+        if (result->error != 0 || result->rc == -1)
+            continue;
+
+        summary->connected++;
+        connect_total += result->connect_ns;
+        run_total += result->run_ns;
+        summary->connect_max_ns = MAX(summary->connect_max_ns, result->connect_ns);
+        summary->run_max_ns = MAX(summary->run_max_ns, result->run_ns);
+    }
+
+    if (summary->connected > 0)
+    {
+        summary->connect_avg_ns = connect_total / summary->connected;
+        summary->run_avg_ns = run_total / summary->connected;
+    }
+
+    for (int s = 0; s < mt->num_servers; s++)
+        for (int i = 0; i < mt->servers[s].accepted; i++)
+            if (mt->servers[s].conns[i].rc != 0)
+                summary->server_failed++;
+
+    return CHITCP_OK;
+}
+
+/* See tester.h */
+int chitcp_multi_tester_free(chitcp_multi_tester_t *mt)
+{
+    for (int s = 0; s < mt->num_servers; s++)
+        free(mt->servers[s].conns);
+    free(mt->servers);
+    free(mt->clients);
+    pthread_mutex_destroy(&mt->lock);
+
+    return CHITCP_OK;
+}
@@ -43,6 +43,7 @@
 #include <errno.h>
 
 #include "chitcp/multitimer.h"
+#include "chitcp/timerwheel.h"
 #include "chitcp/log.h"
 
 
@@ -76,19 +77,271 @@ int timespec_subtract(struct timespec *result, struct timespec *x, struct timesp
 }
 
 
+/*
+ * timespec_cmp - Compares two timespecs
+ *
+ * Returns: A negative value if x < y, zero if x == y, and
+ *          a positive value if x > y
+ */
+static inline int timespec_cmp(struct timespec *x, struct timespec *y)
+{
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec)
+        return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+
+/* Returns the lock that protects the multitimer's timers */
+static inline pthread_mutex_t *mt_lock(multi_timer_t *mt)
+{
+    return mt->wheel != NULL ? &mt->wheel->lock : &mt->lock;
+}
+
+
+/* Heap functions. These must be called with the multitimer lock held. */
+
+static inline void mt_heap_place(multi_timer_t *mt, single_timer_t *timer, uint16_t i)
+{
+    mt->heap[i] = timer;
+    timer->heap_index = i;
+}
+
+/* Moves the timer at position i up the heap, until its parent
+ * expires before it does */
+static void mt_heap_sift_up(multi_timer_t *mt, uint16_t i)
+{
+    single_timer_t *timer = mt->heap[i];
+
+    while (i > 0)
+    {
+        uint16_t parent = (i - 1) / 2;
+
+        if (timespec_cmp(&mt->heap[parent]->expiry, &timer->expiry) <= 0)
+            break;
+
+        mt_heap_place(mt, mt->heap[parent], i);
+        i = parent;
+    }
+
+    mt_heap_place(mt, timer, i);
+}
+
+/* Moves the timer at position i down the heap, until both
+ * its children expire after it does */
+static void mt_heap_sift_down(multi_timer_t *mt, uint16_t i)
+{
+    single_timer_t *timer = mt->heap[i];
+
+    for (;;)
+    {
+        uint32_t child = 2 * (uint32_t) i + 1;
+
+        if (child >= mt->heap_size)
+            break;
+
+        if (child + 1 < mt->heap_size &&
+            timespec_cmp(&mt->heap[child + 1]->expiry, &mt->heap[child]->expiry) < 0)
+            child++;
+
+        if (timespec_cmp(&timer->expiry, &mt->heap[child]->expiry) <= 0)
+            break;
+
+        mt_heap_place(mt, mt->heap[child], i);
+        i = child;
+    }
+
+    mt_heap_place(mt, timer, i);
+}
+
+static void mt_heap_insert(multi_timer_t *mt, single_timer_t *timer)
+{
+    mt_heap_place(mt, timer, mt->heap_size++);
+    mt_heap_sift_up(mt, timer->heap_index);
+}
+
+static void mt_heap_remove(multi_timer_t *mt, single_timer_t *timer)
+{
+    uint16_t i = timer->heap_index;
+    single_timer_t *last = mt->heap[--mt->heap_size];
+
+    if (last == timer)
+        return;
+
+    /* Fill the hole with the last timer in the heap, which may
+     * need to move either up or down from there */
+    mt_heap_place(mt, last, i);
+    mt_heap_sift_up(mt, i);
+    mt_heap_sift_down(mt, last->heap_index);
+}
+
+
+/*
+ * mt_thread_func - Multitimer thread
+ *
+ * Sleeps until the timer at the top of the heap expires (or until
+ * the top of the heap changes), and calls that timer's callback.
+ *
+ * args: The multitimer
+ *
+ * Returns: NULL
+ */
+static void* mt_thread_func(void *args)
+{
+    multi_timer_t *mt = (multi_timer_t *) args;
+    single_timer_t *timer;
+    mt_callback_func callback;
+    void *callback_args;
+    struct timespec now;
+
+    pthread_mutex_lock(&mt->lock);
+    while (!mt->done)
+    {
+        if (mt->heap_size == 0)
+        {
+            pthread_cond_wait(&mt->cv, &mt->lock);
+            continue;
+        }
+
+        timer = mt->heap[0];
+        chitcp_clock_now(&now);
+
+        if (timespec_cmp(&timer->expiry, &now) > 0)
+        {
+            /* Whether we time out or are signaled because the top
+             * of the heap has changed, we simply check again */
+            chitcp_clock_timedwait(&mt->cv, &mt->lock, &timer->expiry);
+            continue;
+        }
+
+        mt_heap_remove(mt, timer);
+        timer->active = false;
+        timer->num_timeouts++;
+
+        /* The callback is called without holding the lock, so the
+         * timer could be set again (with a different callback) by
+         * the time the callback runs */
+        callback = timer->callback;
+        callback_args = timer->callback_args;
+
+        pthread_mutex_unlock(&mt->lock);
+        if (callback)
+            callback(mt, timer, callback_args);
+        pthread_mutex_lock(&mt->lock);
+    }
+    pthread_mutex_unlock(&mt->lock);
+
+    return NULL;
+}
+
+
+/* Allocates and initializes the timers of a multitimer */
+static int mt_init_timers(multi_timer_t *mt, uint16_t num_timers)
+{
+    mt->num_timers = num_timers;
+    mt->timers = calloc(num_timers, sizeof(single_timer_t));
+
+    if (mt->timers == NULL)
+        return CHITCP_ENOMEM;
+
+    for (uint16_t i = 0; i < num_timers; i++)
+    {
+        mt->timers[i].id = i;
+        mt->timers[i].active = false;
+        mt->timers[i].num_timeouts = 0;
+        mt->timers[i].mt = mt;
+    }
+
+    return CHITCP_OK;
+}
+
+
 /* See multitimer.h */
 int mt_init(multi_timer_t *mt, uint16_t num_timers)
 {
-    /* Your code here */
+    pthread_condattr_t attr;
+
+    mt->heap_size = 0;
+    mt->done = false;
+    mt->wheel = NULL;
+
+    if (mt_init_timers(mt, num_timers) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+
+    mt->heap = calloc(num_timers, sizeof(single_timer_t*));
+
+    if (mt->heap == NULL)
+    {
+        free(mt->timers);
+        return CHITCP_ENOMEM;
+    }
+
+    if (pthread_mutex_init(&mt->lock, NULL) != 0)
+        return CHITCP_EINIT;
+
+    if (pthread_condattr_init(&attr) != 0)
+        return CHITCP_EINIT;
+#ifndef __APPLE__
+    if (pthread_condattr_setclock(&attr, MT_CLOCK) != 0)
+        return CHITCP_EINIT;
+#endif
+    if (pthread_cond_init(&mt->cv, &attr) != 0)
+        return CHITCP_EINIT;
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&mt->thread, NULL, mt_thread_func, mt) != 0)
+        return CHITCP_ETHREAD;
 
     return CHITCP_OK;
 }
 
 
+/* See multitimer.h */
+int mt_init_wheel(multi_timer_t *mt, uint16_t num_timers, timer_wheel_t *tw)
+{
+    mt->heap = NULL;
+    mt->heap_size = 0;
+    mt->done = false;
+    mt->wheel = tw;
+
+    return mt_init_timers(mt, num_timers);
+}
+
+
 /* See multitimer.h */
 int mt_free(multi_timer_t *mt)
 {
-    /* Your code here */
+    if (mt->wheel != NULL)
+    {
+        /* Take our timers out of the wheel, and make sure the wheel
+         * isn't running one of our callbacks before freeing them */
+        pthread_mutex_lock(&mt->wheel->lock);
+        for (uint16_t i = 0; i < mt->num_timers; i++)
+        {
+            __tw_remove(mt->wheel, &mt->timers[i]);
+            mt->timers[i].active = false;
+        }
+        __tw_wait_for_callbacks(mt->wheel, mt);
+        pthread_mutex_unlock(&mt->wheel->lock);
+
+        free(mt->timers);
+
+        return CHITCP_OK;
+    }
+
+    pthread_mutex_lock(&mt->lock);
+    mt->done = true;
+    pthread_cond_signal(&mt->cv);
+    pthread_mutex_unlock(&mt->lock);
+
+    pthread_join(mt->thread, NULL);
+
+    pthread_mutex_destroy(&mt->lock);
+    pthread_cond_destroy(&mt->cv);
+
+    free(mt->timers);
+    free(mt->heap);
 
     return CHITCP_OK;
 }
@@ -97,7 +350,10 @@ int mt_free(multi_timer_t *mt)
 /* See multitimer.h */
 int mt_get_timer_by_id(multi_timer_t *mt, uint16_t id, single_timer_t **timer)
 {
-    /* Your code here */
+    if (id >= mt->num_timers)
+        return CHITCP_EINVAL;
+
+    *timer = &mt->timers[id];
 
     return CHITCP_OK;
 }
@@ -106,7 +362,49 @@ int mt_get_timer_by_id(multi_timer_t *mt, uint16_t id, single_timer_t **timer)
 /* See multitimer.h */
 int mt_set_timer(multi_timer_t *mt, uint16_t id, uint64_t timeout, mt_callback_func callback, void* callback_args)
 {
-    /* Your code here */
+    single_timer_t *timer;
+
+    if (id >= mt->num_timers)
+        return CHITCP_EINVAL;
+
+    timer = &mt->timers[id];
+
+    pthread_mutex_lock(mt_lock(mt));
+
+    if (timer->active)
+    {
+        pthread_mutex_unlock(mt_lock(mt));
+        return CHITCP_EINVAL;
+    }
+
+    chitcp_clock_now(&timer->expiry);
+    timer->expiry.tv_sec += timeout / SECOND;
+    timer->expiry.tv_nsec += timeout % SECOND;
+    if (timer->expiry.tv_nsec >= SECOND)
+    {
+        timer->expiry.tv_sec++;
+        timer->expiry.tv_nsec -= SECOND;
+    }
+
+    timer->callback = callback;
+    timer->callback_args = callback_args;
+    timer->active = true;
+
+    if (mt->wheel != NULL)
+    {
+        __tw_add(mt->wheel, timer, timeout);
+    }
+    else
+    {
+        mt_heap_insert(mt, timer);
+
+        /* The multitimer thread only needs to wake up if this
+         * timer is now the next one to expire */
+        if (timer->heap_index == 0)
+            pthread_cond_signal(&mt->cv);
+    }
+
+    pthread_mutex_unlock(mt_lock(mt));
 
     return CHITCP_OK;
 }
@@ -115,7 +413,41 @@ int mt_set_timer(multi_timer_t *mt, uint16_t id, uint64_t timeout, mt_callback_f
 /* See multitimer.h */
 int mt_cancel_timer(multi_timer_t *mt, uint16_t id)
 {
-    /* Your code here */
+    single_timer_t *timer;
+    bool was_next;
+
+    if (id >= mt->num_timers)
+        return CHITCP_EINVAL;
+
+    timer = &mt->timers[id];
+
+    pthread_mutex_lock(mt_lock(mt));
+
+    if (!timer->active)
+    {
+        pthread_mutex_unlock(mt_lock(mt));
+        return CHITCP_EINVAL;
+    }
+
+    timer->active = false;
+
+    if (mt->wheel != NULL)
+    {
+        __tw_remove(mt->wheel, timer);
+    }
+    else
+    {
+        was_next = (timer->heap_index == 0);
+
+        mt_heap_remove(mt, timer);
+
+        /* Likewise, the thread only needs to wake up if it was
+         * waiting for this timer */
+        if (was_next)
+            pthread_cond_signal(&mt->cv);
+    }
+
+    pthread_mutex_unlock(mt_lock(mt));
 
     return CHITCP_OK;
 }
@@ -124,7 +456,13 @@ int mt_cancel_timer(multi_timer_t *mt, uint16_t id)
 /* See multitimer.h */
 int mt_set_timer_name(multi_timer_t *mt, uint16_t id, const char *name)
 {
-    /* Your code here */
+    if (id >= mt->num_timers)
+        return CHITCP_EINVAL;
+
+    pthread_mutex_lock(mt_lock(mt));
+    strncpy(mt->timers[id].name, name, MAX_TIMER_NAME_LEN);
+    mt->timers[id].name[MAX_TIMER_NAME_LEN] = '\0';
+    pthread_mutex_unlock(mt_lock(mt));
 
     return CHITCP_OK;
 }
@@ -141,15 +479,17 @@ int mt_set_timer_name(multi_timer_t *mt, uint16_t id, const char *name)
 int mt_chilog_single_timer(loglevel_t level, single_timer_t *timer)
 {
     struct timespec now, diff;
-    clock_gettime(CLOCK_REALTIME, &now);
+    chitcp_clock_now(&now);
 
     if(timer->active)
     {
-        /* Compute the appropriate value for "diff" here; it should contain
-         * the time remaining until the timer times out.
-         * Note: The timespec_subtract function can come in handy here*/
-        diff.tv_sec = 0;
-        diff.tv_nsec = 0;
+        /* The timer may be overdue if the multitimer thread
+         * hasn't gotten around to processing it yet */
+        if (timespec_subtract(&diff, &timer->expiry, &now))
+        {
+            diff.tv_sec = 0;
+            diff.tv_nsec = 0;
+        }
         chilog(level, "%i %s %lis %lins", timer->id, timer->name, diff.tv_sec, diff.tv_nsec);
     }
     else
@@ -162,7 +502,13 @@ int mt_chilog_single_timer(loglevel_t level, single_timer_t *timer)
 /* See multitimer.h */
 int mt_chilog(loglevel_t level, multi_timer_t *mt, bool active_only)
 {
-    /* Your code here */
+    pthread_mutex_lock(mt_lock(mt));
+    for (uint16_t i = 0; i < mt->num_timers; i++)
+    {
+        if (!active_only || mt->timers[i].active)
+            mt_chilog_single_timer(level, &mt->timers[i]);
+    }
+    pthread_mutex_unlock(mt_lock(mt));
 
     return CHITCP_OK;
 }
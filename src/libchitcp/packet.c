@@ -40,9 +40,16 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
@@ -72,14 +79,261 @@ uint32_t chitcp_htonl(uint32_t hostlong)
     return htonl(hostlong);
 }
 
+/* Packet buffers are preceded by this header */
+typedef struct packet_buf
+{
+    atomic_int refcount;
+    uint8_t pooled;             /* Is this a slab from the pool? */
+    uint8_t node;               /* NUMA node of the slab's pool */
+    struct packet_buf *next;    /* Next free slab */
+    uint8_t data[];
+} packet_buf_t;
+
+#define PACKET_BUF(raw) ((packet_buf_t *) ((raw) - offsetof(packet_buf_t, data)))
+
+/* Number of slabs moved between a thread's cache and the shared pool at once */
+#define PACKET_POOL_BATCH (CHITCP_PACKET_CACHE_SIZE / 2)
+
+/* Number of shared pools. There is one per NUMA node (nodes beyond
+ * the last pool share pools), so a slab is only ever reused by threads
+ * running on the node whose memory it was first touched from */
+#define PACKET_POOL_NODES (8)
+
+/* A thread's cache of free slabs, all from the pool of its node */
+typedef struct packet_cache
+{
+    packet_buf_t *free;
+    int count;
+    int node;
+} packet_cache_t;
+
+/* Shared pools of free slabs */
+typedef struct packet_pool
+{
+    packet_buf_t *free;
+    pthread_mutex_t lock;
+} packet_pool_t;
+
+static packet_pool_t pools[PACKET_POOL_NODES];
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_init = PTHREAD_ONCE_INIT;
+
+/* Returns a cache's slabs to the shared pool when its thread exits */
+static void cache_key_destructor(void *mem)
+{
+    packet_cache_t *cache = (packet_cache_t *) mem;
+    packet_pool_t *pool = &pools[cache->node];
+    packet_buf_t *buf, *next;
+
+    pthread_mutex_lock(&pool->lock);
+    for(buf = cache->free; buf != NULL; buf = next)
+    {
+        next = buf->next;
+        buf->next = pool->free;
+        pool->free = buf;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(cache);
+}
+
+static void create_cache_key()
+{
+    pthread_key_create(&cache_key, cache_key_destructor);
+    for(int i = 0; i < PACKET_POOL_NODES; i++)
+        pthread_mutex_init(&pools[i].lock, NULL);
+}
+
+/* Returns the pool of the NUMA node the calling thread is running on
+ * (threads that allocate packets are expected to stay on their node;
+ * see chitcpd's affinity.h) */
+static int packet_pool_node()
+{
+#ifdef __linux__
+    unsigned int cpu, node;
+
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return node % PACKET_POOL_NODES;
+#endif
+    return 0;
+}
+
+/* Puts a slab back in its pool */
+static void packet_pool_put(packet_buf_t *buf)
+{
+    packet_pool_t *pool = &pools[buf->node];
+
+    pthread_mutex_lock(&pool->lock);
+    buf->next = pool->free;
+    pool->free = buf;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static packet_cache_t *packet_cache_get()
+{
+    packet_cache_t *cache;
+
+    pthread_once(&cache_key_init, create_cache_key);
+
+    cache = pthread_getspecific(cache_key);
+    if(cache == NULL)
+    {
+        cache = calloc(1, sizeof(packet_cache_t));
+        if(cache != NULL)
+        {
+            cache->node = packet_pool_node();
+            pthread_setspecific(cache_key, cache);
+        }
+    }
+
+    return cache;
+}
+
+/* Moves up to PACKET_POOL_BATCH slabs from the cache's pool to a cache,
+ * allocating new slabs if the pool is empty */
+static void packet_cache_refill(packet_cache_t *cache)
+{
+    packet_pool_t *pool = &pools[cache->node];
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->free != NULL && cache->count < PACKET_POOL_BATCH)
+    {
+        packet_buf_t *buf = pool->free;
+        pool->free = buf->next;
+        buf->next = cache->free;
+        cache->free = buf;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(cache->count == 0)
+    {
+        /* Slabs are allocated in chunks, and are never returned to the
+         * system. Their pages are first touched here, so (with the
+         * default first-touch policy) they are on the cache's node */
+        size_t slab_size = sizeof(packet_buf_t) + CHITCP_PACKET_SLAB_SIZE;
+        uint8_t *chunk = malloc(slab_size * PACKET_POOL_BATCH);
+
+        if(chunk == NULL)
+            return;
+
+        for(int i = 0; i < PACKET_POOL_BATCH; i++)
+        {
+            packet_buf_t *buf = (packet_buf_t *) (chunk + i * slab_size);
+            buf->pooled = TRUE;
+            buf->node = cache->node;
+            buf->next = cache->free;
+            cache->free = buf;
+            cache->count++;
+        }
+    }
+}
+
+/* Moves PACKET_POOL_BATCH slabs from a (full) cache to its pool */
+static void packet_cache_drain(packet_cache_t *cache)
+{
+    packet_pool_t *pool = &pools[cache->node];
+
+    pthread_mutex_lock(&pool->lock);
+    for(int i = 0; i < PACKET_POOL_BATCH && cache->free != NULL; i++)
+    {
+        packet_buf_t *buf = cache->free;
+        cache->free = buf->next;
+        cache->count--;
+        buf->next = pool->free;
+        pool->free = buf;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* See packet.h */
+uint8_t *chitcp_packet_buf_alloc(size_t size)
+{
+    packet_buf_t *buf = NULL;
+    packet_cache_t *cache;
+
+    if(size <= CHITCP_PACKET_SLAB_SIZE && (cache = packet_cache_get()) != NULL)
+    {
+        if(cache->free == NULL)
+            packet_cache_refill(cache);
+
+        buf = cache->free;
+        if(buf != NULL)
+        {
+            cache->free = buf->next;
+            cache->count--;
+        }
+    }
+
+    if(buf == NULL)
+    {
+        buf = malloc(sizeof(packet_buf_t) + size);
+        if(buf == NULL)
+            return NULL;
+        buf->pooled = FALSE;
+    }
+
+    buf->next = NULL;
+    atomic_init(&buf->refcount, 1);
+
+    return buf->data;
+}
+
+/* See packet.h */
+uint8_t *chitcp_packet_buf_ref(uint8_t *raw)
+{
+    atomic_fetch_add(&PACKET_BUF(raw)->refcount, 1);
+
+    return raw;
+}
+
+/* See packet.h */
+void chitcp_packet_buf_unref(uint8_t *raw)
+{
+    packet_buf_t *buf;
+    packet_cache_t *cache;
+
+    if(raw == NULL)
+        return;
+
+    buf = PACKET_BUF(raw);
+    if(atomic_fetch_sub(&buf->refcount, 1) != 1)
+        return;
+
+    if(!buf->pooled)
+    {
+        free(buf);
+        return;
+    }
+
+    cache = packet_cache_get();
+    if(cache == NULL || cache->node != buf->node)
+    {
+        /* Can't cache it (or it is from another node's pool, typically
+         * a packet received on one node and freed on another), so put
+         * it straight back in its pool */
+        packet_pool_put(buf);
+        return;
+    }
+
+    buf->next = cache->free;
+    cache->free = buf;
+    cache->count++;
+
+    if(cache->count > CHITCP_PACKET_CACHE_SIZE)
+        packet_cache_drain(cache);
+}
+
 /* See packet.h */
 int chitcp_tcp_packet_create(tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len)
 {
     tcphdr_t *header;
 
     packet->length = TCP_HEADER_NOOPTIONS_SIZE + payload_len;
-    packet->raw = calloc(packet->length, 1);
+    packet->raw = chitcp_packet_buf_alloc(packet->length);
     header = (tcphdr_t*) packet->raw;
+    memset(header, 0, TCP_HEADER_NOOPTIONS_SIZE);
 
     // No TCP options
     header->doff = TCP_HEADER_NOOPTIONS_SIZE / sizeof(uint32_t);
@@ -93,9 +347,250 @@ int chitcp_tcp_packet_create(tcp_packet_t *packet, const uint8_t* payload, uint1
 /* See packet.h */
 void chitcp_tcp_packet_free(tcp_packet_t *packet)
 {
-    free((void *) packet->raw);
+    chitcp_packet_buf_unref(packet->raw);
 }
 
+/* See packet.h */
+int chitcp_tcp_packet_share(tcp_packet_t *dst, tcp_packet_t *src)
+{
+    dst->raw = chitcp_packet_buf_ref(src->raw);
+    dst->length = src->length;
+
+    return dst->length;
+}
+
+
+/*
+ * chitcp_tcp_packet_add_option - Appends options to a TCP packet's header
+ *
+ * packet: Pointer to packet.
+ *
+ * opt, len: Options to append (len must be a multiple of 4)
+ *
+ * Returns:
+ *  - CHITCP_OK: Options added correctly
+ *  - CHITCP_EINVAL: No room for more options
+ *  - CHITCP_ENOMEM: Could not allocate memory for packet
+ *
+ */
+static int chitcp_tcp_packet_add_option(tcp_packet_t *packet, const uint8_t *opt, size_t len)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(packet);
+    size_t hdr_len = header->doff * sizeof(uint32_t);
+    uint8_t *raw;
+
+    /* The data offset is a 4-bit field, so the header can't
+     * be larger than 15 words */
+    if (header->doff + len / sizeof(uint32_t) > 15)
+        return CHITCP_EINVAL;
+
+    raw = chitcp_packet_buf_alloc(packet->length + len);
+    if (raw == NULL)
+        return CHITCP_ENOMEM;
+
+    memcpy(raw, packet->raw, hdr_len);
+    memcpy(raw + hdr_len, opt, len);
+    memcpy(raw + hdr_len + len, packet->raw + hdr_len, packet->length - hdr_len);
+
+    chitcp_packet_buf_unref(packet->raw);
+    packet->raw = raw;
+    packet->length += len;
+    TCP_PACKET_HEADER(packet)->doff += len / sizeof(uint32_t);
+
+    return CHITCP_OK;
+}
+
+/*
+ * chitcp_tcp_packet_find_option - Finds an option in a TCP packet's header
+ *
+ * packet: Pointer to packet.
+ *
+ * kind, len: Kind and length of the option (a length of zero
+ *            matches an option of that kind with any length)
+ *
+ * Returns: Pointer to the option (its kind byte) in the packet,
+ *          or NULL if the packet has no such option.
+ *
+ */
+static uint8_t *chitcp_tcp_packet_find_option(tcp_packet_t *packet, uint8_t kind, uint8_t len)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(packet);
+    size_t hdr_len = header->doff * sizeof(uint32_t);
+    size_t i = TCP_HEADER_NOOPTIONS_SIZE;
+
+    if (hdr_len > packet->length)
+        return NULL;
+
+    while (i < hdr_len)
+    {
+        uint8_t opt_kind = packet->raw[i];
+
+        if (opt_kind == TCP_OPTION_EOL)
+            break;
+        if (opt_kind == TCP_OPTION_NOP)
+        {
+            i++;
+            continue;
+        }
+
+        /* Every other option has a length byte (which includes
+         * the kind and length bytes themselves) */
+        if (i + 1 >= hdr_len || packet->raw[i + 1] < 2 || i + packet->raw[i + 1] > hdr_len)
+            break;
+
+        if (opt_kind == kind && (len == 0 || packet->raw[i + 1] == len))
+            return packet->raw + i;
+
+        i += packet->raw[i + 1];
+    }
+
+    return NULL;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_add_wscale(tcp_packet_t *packet, uint8_t shift)
+{
+    uint8_t opt[] = {TCP_OPTION_NOP, TCP_OPTION_WSCALE, TCP_OPTION_WSCALE_LEN, shift};
+
+    if (shift > TCP_WSCALE_MAX)
+        return CHITCP_EINVAL;
+
+    return chitcp_tcp_packet_add_option(packet, opt, sizeof(opt));
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_get_wscale(tcp_packet_t *packet)
+{
+    uint8_t *opt = chitcp_tcp_packet_find_option(packet, TCP_OPTION_WSCALE, TCP_OPTION_WSCALE_LEN);
+
+    if (opt == NULL)
+        return CHITCP_ENOENT;
+
+    return MIN(opt[2], TCP_WSCALE_MAX);
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_add_timestamp(tcp_packet_t *packet, uint32_t tsval, uint32_t tsecr)
+{
+    uint8_t opt[12] = {TCP_OPTION_NOP, TCP_OPTION_NOP, TCP_OPTION_TIMESTAMP, TCP_OPTION_TIMESTAMP_LEN};
+
+    tsval = chitcp_htonl(tsval);
+    tsecr = chitcp_htonl(tsecr);
+    memcpy(opt + 4, &tsval, sizeof(uint32_t));
+    memcpy(opt + 8, &tsecr, sizeof(uint32_t));
+
+    return chitcp_tcp_packet_add_option(packet, opt, sizeof(opt));
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_get_timestamp(tcp_packet_t *packet, uint32_t *tsval, uint32_t *tsecr)
+{
+    uint8_t *opt = chitcp_tcp_packet_find_option(packet, TCP_OPTION_TIMESTAMP, TCP_OPTION_TIMESTAMP_LEN);
+
+    if (opt == NULL)
+        return CHITCP_ENOENT;
+
+    memcpy(tsval, opt + 2, sizeof(uint32_t));
+    memcpy(tsecr, opt + 6, sizeof(uint32_t));
+    *tsval = chitcp_ntohl(*tsval);
+    *tsecr = chitcp_ntohl(*tsecr);
+
+    return CHITCP_OK;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_add_sack_permitted(tcp_packet_t *packet)
+{
+    uint8_t opt[] = {TCP_OPTION_NOP, TCP_OPTION_NOP, TCP_OPTION_SACK_PERMITTED, TCP_OPTION_SACK_PERMITTED_LEN};
+
+    return chitcp_tcp_packet_add_option(packet, opt, sizeof(opt));
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_get_sack_permitted(tcp_packet_t *packet)
+{
+    uint8_t *opt = chitcp_tcp_packet_find_option(packet, TCP_OPTION_SACK_PERMITTED, TCP_OPTION_SACK_PERMITTED_LEN);
+
+    return opt == NULL? CHITCP_ENOENT : CHITCP_OK;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_add_sack(tcp_packet_t *packet, const tcp_sack_block_t *blocks, int nblocks)
+{
+    uint8_t opt[4 + TCP_SACK_MAX_BLOCKS * 8] = {TCP_OPTION_NOP, TCP_OPTION_NOP, TCP_OPTION_SACK};
+    int room = (15 - TCP_PACKET_HEADER(packet)->doff) * sizeof(uint32_t);
+    int ret;
+
+    /* Each block takes eight bytes, plus four for the NOPs, kind and length */
+    nblocks = MIN(nblocks, (room - 4) / 8);
+    if (nblocks <= 0 || nblocks > TCP_SACK_MAX_BLOCKS)
+        return CHITCP_EINVAL;
+
+    opt[3] = 2 + nblocks * 8;
+    for (int i = 0; i < nblocks; i++)
+    {
+        uint32_t left = chitcp_htonl(blocks[i].left);
+        uint32_t right = chitcp_htonl(blocks[i].right);
+
+        memcpy(opt + 4 + i * 8, &left, sizeof(uint32_t));
+        memcpy(opt + 8 + i * 8, &right, sizeof(uint32_t));
+    }
+
+    ret = chitcp_tcp_packet_add_option(packet, opt, 4 + nblocks * 8);
+
+    return ret == CHITCP_OK? nblocks : ret;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_get_sack(tcp_packet_t *packet, tcp_sack_block_t *blocks)
+{
+    uint8_t *opt = chitcp_tcp_packet_find_option(packet, TCP_OPTION_SACK, 0);
+    int nblocks;
+
+    if (opt == NULL)
+        return 0;
+
+    nblocks = MIN((opt[1] - 2) / 8, TCP_SACK_MAX_BLOCKS);
+    for (int i = 0; i < nblocks; i++)
+    {
+        memcpy(&blocks[i].left, opt + 2 + i * 8, sizeof(uint32_t));
+        memcpy(&blocks[i].right, opt + 6 + i * 8, sizeof(uint32_t));
+        blocks[i].left = chitcp_ntohl(blocks[i].left);
+        blocks[i].right = chitcp_ntohl(blocks[i].right);
+    }
+
+    return nblocks;
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_add_fastopen(tcp_packet_t *packet, const uint8_t *cookie, int len)
+{
+    uint8_t opt[4 + TCP_FASTOPEN_COOKIE_LEN] = {TCP_OPTION_NOP, TCP_OPTION_NOP, TCP_OPTION_FASTOPEN};
+
+    if (len != 0 && len != TCP_FASTOPEN_COOKIE_LEN)
+        return CHITCP_EINVAL;
+
+    opt[3] = 2 + len;
+    if (len > 0)
+        memcpy(opt + 4, cookie, len);
+
+    return chitcp_tcp_packet_add_option(packet, opt, 4 + len);
+}
+
+/* See packet.h */
+int chitcp_tcp_packet_get_fastopen(tcp_packet_t *packet, uint8_t *cookie)
+{
+    uint8_t *opt = chitcp_tcp_packet_find_option(packet, TCP_OPTION_FASTOPEN, 0);
+
+    if (opt == NULL)
+        return CHITCP_ENOENT;
+    if (opt[1] != 2 + TCP_FASTOPEN_COOKIE_LEN)
+        return 0;
+
+    memcpy(cookie, opt + 2, TCP_FASTOPEN_COOKIE_LEN);
+
+    return TCP_FASTOPEN_COOKIE_LEN;
+}
 
 
 /* See packet.h */
@@ -154,4 +649,77 @@ int chitcp_packet_list_size(tcp_packet_list_t *pl)
     DL_COUNT(pl, elt, count);
 
     return count;
-}
\ No newline at end of file
+}
+
+/* See packet.h */
+int chitcp_packet_queue_init(tcp_packet_queue_t *q)
+{
+    atomic_init(&q->head, NULL);
+
+    return CHITCP_OK;
+}
+
+/* See packet.h */
+bool chitcp_packet_queue_push(tcp_packet_queue_t *q, tcp_packet_t *packet)
+{
+    tcp_packet_t *head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    /* The release makes the packet (and its next field) visible to the
+     * consumer that takes it. It is only retried if another producer
+     * pushed a packet in the meantime */
+    do
+        packet->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&q->head, &head, packet,
+                                                  memory_order_release, memory_order_relaxed));
+
+    return head == NULL;
+}
+
+/* See packet.h */
+tcp_packet_t *chitcp_packet_queue_take(tcp_packet_queue_t *q)
+{
+    tcp_packet_t *packet, *next, *packets = NULL;
+
+    /* The packets are newest first, so they're reversed */
+    packet = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
+    while (packet != NULL)
+    {
+        next = packet->next;
+        packet->next = packets;
+        packets = packet;
+        packet = next;
+    }
+
+    return packets;
+}
+
+/* See packet.h */
+bool chitcp_packet_queue_empty(tcp_packet_queue_t *q)
+{
+    return atomic_load_explicit(&q->head, memory_order_relaxed) == NULL;
+}
+
+/* See packet.h */
+int chitcp_packet_queue_size(tcp_packet_queue_t *q)
+{
+    int count = 0;
+    tcp_packet_t *packets = atomic_load_explicit(&q->head, memory_order_acquire), *elt;
+
+    LL_COUNT(packets, elt, count);
+
+    return count;
+}
+
+/* See packet.h */
+int chitcp_packet_queue_destroy(tcp_packet_queue_t *q)
+{
+    tcp_packet_t *packets = chitcp_packet_queue_take(q), *elt, *tmp;
+
+    LL_FOREACH_SAFE(packets, elt, tmp)
+    {
+        chitcp_tcp_packet_free(elt);
+        free(elt);
+    }
+
+    return CHITCP_OK;
+}
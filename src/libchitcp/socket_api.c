@@ -50,6 +50,8 @@
 #include <string.h>
 #include <stdlib.h> /* for malloc */
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 
 #include "chitcp/socket.h"
 #include "chitcp/types.h"
@@ -86,7 +88,7 @@ int chisocket_socket(int domain, int type, int protocol)
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -127,7 +129,7 @@ int chisocket_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -168,7 +170,7 @@ int chisocket_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -205,7 +207,7 @@ int chisocket_listen(int sockfd, int backlog)
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -253,7 +255,7 @@ int chisocket_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
         memcpy(addr, resp_p->resp->addr.data, len);
     }
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -288,7 +290,7 @@ int chisocket_close(int sockfd)
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -296,30 +298,260 @@ int chisocket_close(int sockfd)
     return ret;
 }
 
+/*
+ * chisocket_iov_gather - Copy data out of an I/O vector
+ *
+ * dst: Buffer to copy the data to
+ *
+ * iov, iovcnt: I/O vector
+ *
+ * skip: Number of bytes at the start of the vector to skip
+ *
+ * len: Number of bytes to copy
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chisocket_iov_gather(uint8_t *dst, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
+{
+    for (int i = 0; i < iovcnt && len > 0; i++)
+    {
+        size_t chunk;
+
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        chunk = MIN(iov[i].iov_len - skip, len);
+        memcpy(dst, (const uint8_t *) iov[i].iov_base + skip, chunk);
+        dst += chunk;
+        len -= chunk;
+        skip = 0;
+    }
+}
+
+/*
+ * chisocket_iov_scatter - Copy data into an I/O vector
+ *
+ * iov, iovcnt: I/O vector
+ *
+ * src: Data to copy
+ *
+ * len: Number of bytes to copy (at most the total length of the vector)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chisocket_iov_scatter(const struct iovec *iov, int iovcnt, const uint8_t *src, size_t len)
+{
+    for (int i = 0; i < iovcnt && len > 0; i++)
+    {
+        size_t chunk = MIN(iov[i].iov_len, len);
+
+        memcpy(iov[i].iov_base, src, chunk);
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * chisocket_iov_len - Get the total length of an I/O vector
+ *
+ * Returns: The total length, or -1 (with errno set to EINVAL) if the
+ *          vector is invalid
+ */
+static ssize_t chisocket_iov_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    return len;
+}
+
+/*
+ * chisocket_sendv_shm - sendv() through the shared data window
+ *
+ * The data is gathered into a slot of the window one slot-sized chunk at a
+ * time, and each chunk is handed to the daemon with a SEND message that
+ * only carries its length.
+ *
+ * Returns: Same as chisocket_sendv
+ */
+static ssize_t chisocket_sendv_shm(int daemon_socket, uint8_t *shm, uint32_t shm_offset, uint32_t shm_size,
+                                   int sockfd, const struct iovec *iov, int iovcnt, size_t len, int flags)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSendArgs sa = CHITCPD_SEND_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int rc, ret, error_code;
+    size_t sent = 0, chunk;
+
+    req.code = CHITCPD_MSG_CODE__SEND;
+    req.send_args = &sa;
+
+    sa.sockfd = sockfd;
+    sa.flags = flags;
+    sa.shm_offset = shm_offset;
+
+    do
+    {
+        chunk = MIN(len - sent, shm_size);
+        chisocket_iov_gather(shm, iov, iovcnt, sent, chunk);
+        sa.shm_len = chunk;
+
+        rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+        if(rc != CHITCP_OK)
+            CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+        /* Unpack response */
+        assert(resp_p->resp != NULL);
+        ret = resp_p->resp->ret;
+        error_code = resp_p->resp->error_code;
+
+        chitcpd_free_response(daemon_socket, resp_p);
+
+        if (error_code)
+        {
+            /* Report the data that was already sent, if any */
+            if (sent > 0)
+                return sent;
+            errno = error_code;
+            return -1;
+        }
+
+        sent += ret;
+    }
+    while (sent < len && ret == chunk);
+
+    return sent;
+}
+
 ssize_t chisocket_send(int sockfd, const void *buf, size_t buf_len, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = buf_len;
+
+    return chisocket_sendv(sockfd, &iov, 1, flags);
+}
+
+ssize_t chisocket_sendto(int sockfd, const void *buf, size_t buf_len, int flags,
+                         const struct sockaddr *addr, socklen_t addrlen)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdConnectArgs ca = CHITCPD_CONNECT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int ret, error_code;
+    int daemon_socket;
+    int rc;
+
+    /* As for a connected TCP socket in Linux, the address is ignored */
+    if (!(flags & MSG_FASTOPEN))
+        return chisocket_send(sockfd, buf, buf_len, flags);
+
+    if (addr == NULL)
+    {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+
+    uint8_t addr_copy [addrlen]; /* for const-correctness */
+    memcpy(addr_copy, addr, addrlen);
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    /* Create request. The data is sent along with the connect request,
+     * so it can go in the SYN */
+    req.code = CHITCPD_MSG_CODE__CONNECT;
+    req.connect_args = &ca;
+
+    ca.sockfd = sockfd;
+    ca.addr.data = addr_copy;
+    ca.addr.len = addrlen;
+    ca.fastopen = TRUE;
+    ca.data.data = (uint8_t *) buf;
+    ca.data.len = buf_len;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+ssize_t chisocket_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags)
 {
     ChitcpdMsg req = CHITCPD_MSG__INIT;
     ChitcpdSendArgs sa = CHITCPD_SEND_ARGS__INIT;
     ChitcpdMsg *resp_p;
     int daemon_socket;
     int rc, ret, error_code;
-    uint8_t *newbuf;
+    uint8_t *newbuf, *shm;
+    uint32_t shm_offset, shm_size;
+    ssize_t len;
+
+    if ((len = chisocket_iov_len(iov, iovcnt)) < 0)
+        return -1;
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
         CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
 
-    /* Copy the buf for const-correctness
-     * (Irritatingly, there seems to be no way to tell the compiler that we
-     * won't harm any sub-structures pointed to by the ChitcpdMsg.) */
-    newbuf = malloc(buf_len);
-    if (!newbuf)
+    if (len > 0 && (shm = chitcpd_shm_acquire(&shm_offset, &shm_size)) != NULL)
     {
-        errno = ENOMEM;
-        return -1;
+        ret = chisocket_sendv_shm(daemon_socket, shm, shm_offset, shm_size, sockfd, iov, iovcnt, len, flags);
+        chitcpd_shm_release(shm_offset);
+        return ret;
     }
 
-    memcpy(newbuf, buf, buf_len);
+    if (daemon_socket == CHITCPD_LOCAL_SOCKET && iovcnt == 1)
+    {
+        /* The request is handled in this process, and the stack only
+         * reads the data, so it can be taken from where it already is */
+        newbuf = NULL;
+        sa.buf.data = iov[0].iov_base;
+    }
+    else
+    {
+        /* Gather the data into a single buffer (which also takes care of
+         * const-correctness: irritatingly, there seems to be no way to tell
+         * the compiler that we won't harm any sub-structures pointed to by
+         * the ChitcpdMsg.) */
+        newbuf = malloc(len);
+        if (!newbuf && len > 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        chisocket_iov_gather(newbuf, iov, iovcnt, 0, len);
+        sa.buf.data = newbuf;
+    }
 
 
     /* Create request */
@@ -327,21 +559,23 @@ ssize_t chisocket_send(int sockfd, const void *buf, size_t buf_len, int flags)
     req.send_args = &sa;
 
     sa.sockfd = sockfd;
-    sa.buf.data = newbuf;
-    sa.buf.len = buf_len;
+    sa.buf.len = len;
     sa.flags = flags;
 
     rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
 
     if(rc != CHITCP_OK)
+    {
+        free(newbuf);
         CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+    }
 
     /* Unpack response */
     assert(resp_p->resp != NULL);
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
@@ -352,46 +586,638 @@ ssize_t chisocket_send(int sockfd, const void *buf, size_t buf_len, int flags)
 }
 
 ssize_t chisocket_recv(int sockfd, void *buf, size_t len, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    return chisocket_recvv(sockfd, &iov, 1, flags);
+}
+
+ssize_t chisocket_recvv(int sockfd, const struct iovec *iov, int iovcnt, int flags)
 {
     ChitcpdMsg req = CHITCPD_MSG__INIT;
     ChitcpdRecvArgs ra = CHITCPD_RECV_ARGS__INIT;
     ChitcpdMsg *resp_p;
     int daemon_socket;
     int rc, ret, error_code;
+    uint8_t *shm, *dst = NULL;
+    uint32_t shm_offset, shm_size;
+    ssize_t len;
+
+    if ((len = chisocket_iov_len(iov, iovcnt)) < 0)
+        return -1;
 
     daemon_socket = chitcpd_get_socket();
     if (daemon_socket < 0)
         CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
 
+    /* If the request is handled in this process, the data can be copied
+     * straight into a single buffer */
+    if (daemon_socket == CHITCPD_LOCAL_SOCKET && iovcnt == 1)
+        dst = iov[0].iov_base;
+
+    /* If we can get a slot in the shared data window, the daemon returns
+     * the data in it (so we can't ask for more than fits in the slot) */
+    shm = chitcpd_shm_acquire(&shm_offset, &shm_size);
+
     req.code = CHITCPD_MSG_CODE__RECV;
     req.recv_args = &ra;
 
     ra.sockfd = sockfd;
     ra.flags = flags;
     ra.len = len;
+    if (shm)
+    {
+        ra.use_shm = TRUE;
+        ra.shm_offset = shm_offset;
+        ra.len = MIN(len, shm_size);
+    }
 
-    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+    rc = chitcpd_send_command_dst(daemon_socket, &req, dst, &resp_p);
 
     if(rc != CHITCP_OK)
+    {
+        if (shm)
+            chitcpd_shm_release(shm_offset);
         CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+    }
 
     /* Unpack response */
     assert(resp_p->resp != NULL);
     ret = resp_p->resp->ret;
     error_code = resp_p->resp->error_code;
 
-    if (!error_code && ret != 0)
+    if (!error_code && ret != 0 && shm)
+    {
+        assert(!resp_p->resp->has_buf && ret <= ra.len);
+        chisocket_iov_scatter(iov, iovcnt, shm, ret);
+    }
+    else if (!error_code && ret != 0 && dst)
+    {
+        assert(!resp_p->resp->has_buf && ret <= len);
+    }
+    else if (!error_code && ret != 0)
     {
         assert(resp_p->resp->has_buf
                && resp_p->resp->buf.len == ret
                && ret <= len);
-        memcpy(buf, resp_p->resp->buf.data, ret);
+        chisocket_iov_scatter(iov, iovcnt, resp_p->resp->buf.data, ret);
     }
 
-    chitcpd_msg__free_unpacked(resp_p, NULL);
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    if (shm)
+        chitcpd_shm_release(shm_offset);
 
     ret = (error_code? -1 : ret);
     if(error_code) errno = error_code;
 
     return ret;
 }
+
+ssize_t chisocket_sendfile(int sockfd, int fd, off_t *offset, size_t count)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSendfileArgs sa = CHITCPD_SENDFILE_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    /* The daemon expects a descriptor after the request, so
+     * we have to make sure we'll be able to pass it */
+    if (fcntl(fd, F_GETFD) == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__SENDFILE;
+    req.sendfile_args = &sa;
+
+    sa.sockfd = sockfd;
+    sa.count = count;
+    if (offset)
+    {
+        sa.use_offset = TRUE;
+        sa.offset = *offset;
+    }
+
+    /* The daemon gets its own descriptor for the file, which shares
+     * the file offset with ours (used if offset is NULL) */
+    rc = chitcpd_send_command_fd(daemon_socket, &req, fd, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    if (!error_code && offset)
+        *offset += ret;
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+
+int chisocket_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSockoptArgs sa = CHITCPD_SOCKOPT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    /* Only integer-valued options are supported */
+    if (optval == NULL || optlen < sizeof(int))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__SETSOCKOPT;
+    req.sockopt_args = &sa;
+
+    sa.sockfd = sockfd;
+    sa.level = level;
+    sa.optname = optname;
+    sa.optval = *((const int *) optval);
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSockoptArgs sa = CHITCPD_SOCKOPT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    /* Only integer-valued options are supported */
+    if (optval == NULL || optlen == NULL || *optlen < sizeof(int))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__GETSOCKOPT;
+    req.sockopt_args = &sa;
+
+    sa.sockfd = sockfd;
+    sa.level = level;
+    sa.optname = optname;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    if(error_code)
+    {
+        errno = error_code;
+        return -1;
+    }
+
+    /* The option's value is returned in "ret" */
+    *((int *) optval) = ret;
+    *optlen = sizeof(int);
+
+    return 0;
+}
+
+int chisocket_fcntl(int sockfd, int cmd, ...)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdFcntlArgs fa = CHITCPD_FCNTL_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+    va_list ap;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    req.code = CHITCPD_MSG_CODE__FCNTL;
+    req.fcntl_args = &fa;
+
+    fa.sockfd = sockfd;
+    fa.cmd = cmd;
+    if (cmd == F_SETFL)
+    {
+        va_start(ap, cmd);
+        fa.arg = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdPollArgs pa = CHITCPD_POLL_ARGS__INIT;
+    ChitcpdPollFd *pfds, **pfds_p;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    pfds = malloc((nfds + 1) * sizeof(ChitcpdPollFd));
+    pfds_p = malloc((nfds + 1) * sizeof(ChitcpdPollFd*));
+    if (!pfds || !pfds_p)
+    {
+        free(pfds);
+        free(pfds_p);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+        chitcpd_poll_fd__init(&pfds[i]);
+        pfds[i].sockfd = fds[i].fd;
+        pfds[i].events = fds[i].events;
+        pfds_p[i] = &pfds[i];
+    }
+
+    req.code = CHITCPD_MSG_CODE__POLL;
+    req.poll_args = &pa;
+
+    pa.n_fds = nfds;
+    pa.fds = pfds_p;
+    pa.timeout = timeout;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    free(pfds);
+    free(pfds_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    for (nfds_t i = 0; i < nfds; i++)
+        fds[i].revents = (!error_code && i < resp_p->resp->n_revents)? resp_p->resp->revents[i] : 0;
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+struct chisocket_batch
+{
+    ChitcpdMsg **requests;   /* Allocated like unpacked messages, so they can
+                              * be freed with chitcpd_msg__free_unpacked */
+    int num_requests;
+    int capacity;
+
+    /* Results (once the batch has run) */
+    int num_results;
+    int *ret;
+    int *error_code;
+};
+
+chisocket_batch_t *chisocket_batch_new()
+{
+    chisocket_batch_t *batch = calloc(1, sizeof(chisocket_batch_t));
+
+    if (!batch)
+        errno = ENOMEM;
+
+    return batch;
+}
+
+/*
+ * chisocket_batch_add - Add a request to a batch
+ *
+ * batch: Batch
+ *
+ * code: Request code
+ *
+ * args: Request arguments (allocated with malloc; the batch takes
+ *       ownership of them, even if the request can't be added)
+ *
+ * Returns: The index of the request in the batch, or -1 (with errno set)
+ *          if the request could not be added.
+ */
+static int chisocket_batch_add(chisocket_batch_t *batch, ChitcpdMsgCode code, void *args)
+{
+    ChitcpdMsg *req;
+
+    if (args == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (batch->num_requests == batch->capacity)
+    {
+        int capacity = batch->capacity? batch->capacity * 2 : 16;
+        ChitcpdMsg **requests = realloc(batch->requests, capacity * sizeof(ChitcpdMsg*));
+
+        if (!requests)
+        {
+            free(args);
+            errno = ENOMEM;
+            return -1;
+        }
+        batch->requests = requests;
+        batch->capacity = capacity;
+    }
+
+    req = malloc(sizeof(ChitcpdMsg));
+    if (!req)
+    {
+        free(args);
+        errno = ENOMEM;
+        return -1;
+    }
+    chitcpd_msg__init(req);
+    req->code = code;
+
+    switch (code)
+    {
+    case CHITCPD_MSG_CODE__SOCKET:  req->socket_args = args;  break;
+    case CHITCPD_MSG_CODE__BIND:    req->bind_args = args;    break;
+    case CHITCPD_MSG_CODE__LISTEN:  req->listen_args = args;  break;
+    case CHITCPD_MSG_CODE__CONNECT: req->connect_args = args; break;
+    case CHITCPD_MSG_CODE__SEND:    req->send_args = args;    break;
+    case CHITCPD_MSG_CODE__CLOSE:   req->close_args = args;   break;
+    default:
+        assert(0);
+    }
+
+    batch->requests[batch->num_requests] = req;
+
+    return batch->num_requests++;
+}
+
+/*
+ * chisocket_batch_copy - Copy a caller's buffer into a newly allocated one
+ *
+ * Returns: FALSE if memory could not be allocated, TRUE otherwise.
+ */
+static bool_t chisocket_batch_copy(ProtobufCBinaryData *bd, const void *data, size_t len)
+{
+    bd->len = len;
+    bd->data = NULL;
+    if (len == 0)
+        return TRUE;
+
+    bd->data = malloc(len);
+    if (!bd->data)
+        return FALSE;
+    memcpy(bd->data, data, len);
+
+    return TRUE;
+}
+
+int chisocket_batch_socket(chisocket_batch_t *batch, int domain, int type, int protocol)
+{
+    ChitcpdSocketArgs *sa = malloc(sizeof(ChitcpdSocketArgs));
+
+    if (sa)
+    {
+        chitcpd_socket_args__init(sa);
+        sa->domain = domain;
+        sa->type = type;
+        sa->protocol = protocol;
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__SOCKET, sa);
+}
+
+int chisocket_batch_bind(chisocket_batch_t *batch, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    ChitcpdBindArgs *ba = malloc(sizeof(ChitcpdBindArgs));
+
+    if (ba)
+    {
+        chitcpd_bind_args__init(ba);
+        ba->sockfd = sockfd;
+        if (!chisocket_batch_copy(&ba->addr, addr, addrlen))
+        {
+            free(ba);
+            ba = NULL;
+        }
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__BIND, ba);
+}
+
+int chisocket_batch_listen(chisocket_batch_t *batch, int sockfd, int backlog)
+{
+    ChitcpdListenArgs *la = malloc(sizeof(ChitcpdListenArgs));
+
+    if (la)
+    {
+        chitcpd_listen_args__init(la);
+        la->sockfd = sockfd;
+        la->backlog = backlog;
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__LISTEN, la);
+}
+
+int chisocket_batch_connect(chisocket_batch_t *batch, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    ChitcpdConnectArgs *ca = malloc(sizeof(ChitcpdConnectArgs));
+
+    if (ca)
+    {
+        chitcpd_connect_args__init(ca);
+        ca->sockfd = sockfd;
+        if (!chisocket_batch_copy(&ca->addr, addr, addrlen))
+        {
+            free(ca);
+            ca = NULL;
+        }
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__CONNECT, ca);
+}
+
+int chisocket_batch_send(chisocket_batch_t *batch, int sockfd, const void *buffer, size_t length, int flags)
+{
+    ChitcpdSendArgs *sa = malloc(sizeof(ChitcpdSendArgs));
+
+    if (sa)
+    {
+        chitcpd_send_args__init(sa);
+        sa->sockfd = sockfd;
+        sa->flags = flags;
+        if (!chisocket_batch_copy(&sa->buf, buffer, length))
+        {
+            free(sa);
+            sa = NULL;
+        }
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__SEND, sa);
+}
+
+int chisocket_batch_close(chisocket_batch_t *batch, int sockfd)
+{
+    ChitcpdCloseArgs *ca = malloc(sizeof(ChitcpdCloseArgs));
+
+    if (ca)
+    {
+        chitcpd_close_args__init(ca);
+        ca->sockfd = sockfd;
+    }
+
+    return chisocket_batch_add(batch, CHITCPD_MSG_CODE__CLOSE, ca);
+}
+
+int chisocket_batch_run(chisocket_batch_t *batch, int stop_on_error)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdBatchArgs ba = CHITCPD_BATCH_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+
+    free(batch->ret);
+    free(batch->error_code);
+    batch->num_results = 0;
+    batch->ret = calloc(batch->num_requests + 1, sizeof(int));
+    batch->error_code = calloc(batch->num_requests + 1, sizeof(int));
+    if (!batch->ret || !batch->error_code)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__BATCH;
+    req.batch_args = &ba;
+
+    ba.n_requests = batch->num_requests;
+    ba.requests = batch->requests;
+    ba.stop_on_error = stop_on_error;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    for (int i = 0; i < resp_p->resp->n_batch && i < batch->num_requests; i++)
+    {
+        batch->ret[i] = resp_p->resp->batch[i]->ret;
+        batch->error_code[i] = resp_p->resp->batch[i]->error_code;
+        batch->num_results = i + 1;
+    }
+
+    chitcpd_free_response(daemon_socket, resp_p);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
+
+int chisocket_batch_result(chisocket_batch_t *batch, int i, int *error)
+{
+    int error_code;
+
+    if (i < 0 || i >= batch->num_results)
+    {
+        if (error)
+            *error = ECANCELED;
+        return -1;
+    }
+
+    error_code = batch->error_code[i];
+    if (error)
+        *error = error_code;
+
+    return error_code? -1 : batch->ret[i];
+}
+
+void chisocket_batch_free(chisocket_batch_t *batch)
+{
+    for (int i = 0; i < batch->num_requests; i++)
+        chitcpd_msg__free_unpacked(batch->requests[i], NULL);
+    free(batch->requests);
+    free(batch->ret);
+    free(batch->error_code);
+    free(batch);
+}
@@ -52,6 +52,16 @@ int chitcp_tester_init(chitcp_tester_t* tester)
     tester->client->func = NULL;
     tester->client->debug_handler_func = NULL;
 
+    tester->port = CHITCP_TESTER_DEFAULT_PORT;
+
+    return CHITCP_OK;
+}
+
+/* See tester.h */
+int chitcp_tester_set_port(chitcp_tester_t* tester, uint16_t port)
+{
+    tester->port = port;
+
     return CHITCP_OK;
 }
 
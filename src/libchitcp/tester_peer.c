@@ -48,7 +48,7 @@ void chitcp_tester_peer_listen(chitcp_tester_t *tester, chitcp_tester_peer_t *pe
     memset(&serverAddr, 0, sizeof(serverAddr));
 
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(7); // The echo protocol
+    serverAddr.sin_port = htons(tester->port);
     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if(chisocket_bind(peer->sockfd, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) == -1)
@@ -88,8 +88,10 @@ void chitcp_tester_peer_accept(chitcp_tester_t *tester, chitcp_tester_peer_t *pe
 void chitcp_tester_peer_connect(chitcp_tester_t *tester, chitcp_tester_peer_t *peer)
 {
     struct sockaddr_in serverAddr;
+    char port[6];
 
-    if(chitcp_addr_construct("localhost", "7", &serverAddr))
+    snprintf(port, sizeof(port), "%u", tester->port);
+    if(chitcp_addr_construct("localhost", port, &serverAddr))
     {
         perror("Could not construct address");
         exit(-1);
@@ -0,0 +1,345 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  A hierarchical timer wheel (see timerwheel.h)
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "chitcp/timerwheel.h"
+#include "chitcp/log.h"
+
+
+/* Number of ticks that the whole wheel can represent */
+#define TW_MAX_TICKS ((uint64_t) 1 << (TW_SLOT_BITS * TW_LEVELS))
+
+/* Slot of a given tick in a given level */
+#define TW_SLOT(tick, level) (((tick) >> (TW_SLOT_BITS * (level))) & TW_SLOT_MASK)
+
+
+/* Returns the number of whole ticks elapsed since the wheel was started */
+static uint64_t tw_now_tick(timer_wheel_t *tw)
+{
+    struct timespec now, diff;
+
+    chitcp_clock_now(&now);
+    if (timespec_subtract(&diff, &now, &tw->start_time))
+        return 0;
+
+    return ((uint64_t) diff.tv_sec * SECOND + diff.tv_nsec) / TW_TICK;
+}
+
+/* Converts a tick into an absolute time (see chitcp_clock_now) */
+static void tw_tick_to_timespec(timer_wheel_t *tw, uint64_t tick, struct timespec *ts)
+{
+    uint64_t ns = tick * TW_TICK;
+
+    ts->tv_sec = tw->start_time.tv_sec + ns / SECOND;
+    ts->tv_nsec = tw->start_time.tv_nsec + ns % SECOND;
+    if (ts->tv_nsec >= SECOND)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= SECOND;
+    }
+}
+
+/* Puts a timer in the slot that corresponds to its expiry tick,
+ * relative to the wheel's current tick. */
+static void tw_place(timer_wheel_t *tw, single_timer_t *timer)
+{
+    uint64_t expiry = timer->expiry_tick;
+    uint64_t delta;
+    int level;
+
+    if (expiry < tw->current_tick)
+        expiry = tw->current_tick;
+
+    delta = expiry - tw->current_tick;
+
+    /* Timers beyond the end of the wheel are parked in the last
+     * level, and will be placed again when their slot cascades */
+    if (delta >= TW_MAX_TICKS)
+    {
+        expiry = tw->current_tick + TW_MAX_TICKS - 1;
+        delta = TW_MAX_TICKS - 1;
+    }
+
+    for (level = 0; level < TW_LEVELS - 1; level++)
+        if (delta < ((uint64_t) 1 << (TW_SLOT_BITS * (level + 1))))
+            break;
+
+    timer->wheel_list = &tw->slots[level][TW_SLOT(expiry, level)];
+    DL_APPEND(*timer->wheel_list, timer);
+}
+
+/* Moves the timers in a slot down to the lower levels */
+static void tw_cascade(timer_wheel_t *tw, int level, int slot)
+{
+    single_timer_t *list, *timer, *tmp;
+
+    list = tw->slots[level][slot];
+    tw->slots[level][slot] = NULL;
+
+    DL_FOREACH_SAFE(list, timer, tmp)
+    {
+        DL_DELETE(list, timer);
+        tw_place(tw, timer);
+    }
+}
+
+/* Processes the wheel's current tick: cascades the upper levels
+ * if the lower levels have wrapped around, and moves the timers
+ * that expire in this tick to the expired list */
+static void tw_advance(timer_wheel_t *tw)
+{
+    uint64_t tick = tw->current_tick;
+    single_timer_t **slot, *timer, *tmp;
+
+    for (int level = 1; level < TW_LEVELS; level++)
+    {
+        if (TW_SLOT(tick, level - 1) != 0)
+            break;
+        tw_cascade(tw, level, TW_SLOT(tick, level));
+    }
+
+    /* A slot in level 0 can also contain timers that expire a full
+     * revolution of the level later, so we check the expiry tick */
+    slot = &tw->slots[0][TW_SLOT(tick, 0)];
+    DL_FOREACH_SAFE(*slot, timer, tmp)
+    {
+        if (timer->expiry_tick <= tick)
+        {
+            DL_DELETE(*slot, timer);
+            timer->wheel_list = &tw->expired;
+            DL_APPEND(tw->expired, timer);
+        }
+    }
+
+    tw->current_tick++;
+}
+
+/* Returns the tick the thread has to wake up at. This is the next tick
+ * with a non-empty slot in level 0, or the tick at which level 0
+ * wraps around (and the next slot in level 1 must be cascaded). */
+static uint64_t tw_next_tick(timer_wheel_t *tw)
+{
+    uint64_t boundary = (tw->current_tick | TW_SLOT_MASK) + 1;
+
+    /* The current tick has yet to cascade the upper levels, so
+     * level 0 doesn't tell us anything yet */
+    if (TW_SLOT(tw->current_tick, 0) == 0)
+        return tw->current_tick;
+
+    for (uint64_t tick = tw->current_tick; tick < boundary; tick++)
+        if (tw->slots[0][TW_SLOT(tick, 0)] != NULL)
+            return tick;
+
+    return boundary;
+}
+
+/* Runs the callback of the first timer in the expired list.
+ * Must be called with the wheel's lock held, which is released
+ * while the callback runs. */
+static void tw_run_expired(timer_wheel_t *tw)
+{
+    single_timer_t *timer = tw->expired;
+    mt_callback_func callback = timer->callback;
+    void *callback_args = timer->callback_args;
+
+    __tw_remove(tw, timer);
+    timer->active = false;
+    timer->num_timeouts++;
+
+    tw->running = timer;
+    pthread_mutex_unlock(&tw->lock);
+    if (callback)
+        callback(timer->mt, timer, callback_args);
+    pthread_mutex_lock(&tw->lock);
+    tw->running = NULL;
+    pthread_cond_broadcast(&tw->cv_running);
+}
+
+/*
+ * tw_thread_func - Timer wheel thread
+ *
+ * Advances the wheel as time passes, and runs the callbacks of the
+ * timers that expire. When there is nothing to do, it sleeps until
+ * the next tick with timers (see tw_next_tick).
+ *
+ * args: The timer wheel
+ *
+ * Returns: NULL
+ */
+static void* tw_thread_func(void *args)
+{
+    timer_wheel_t *tw = (timer_wheel_t *) args;
+    struct timespec ts;
+
+    pthread_mutex_lock(&tw->lock);
+    while (!tw->done)
+    {
+        if (tw->expired != NULL)
+        {
+            tw_run_expired(tw);
+        }
+        else if (tw->num_timers == 0)
+        {
+            tw->wake_tick = UINT64_MAX;
+            pthread_cond_wait(&tw->cv, &tw->lock);
+            tw->wake_tick = 0;
+        }
+        else if (tw->current_tick <= tw_now_tick(tw))
+        {
+            tw_advance(tw);
+        }
+        else
+        {
+            tw->wake_tick = tw_next_tick(tw);
+            tw_tick_to_timespec(tw, tw->wake_tick, &ts);
+            chitcp_clock_timedwait(&tw->cv, &tw->lock, &ts);
+            tw->wake_tick = 0;
+        }
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    return NULL;
+}
+
+
+/* See timerwheel.h */
+int tw_init(timer_wheel_t *tw)
+{
+    pthread_condattr_t attr;
+
+    memset(tw->slots, 0, sizeof(tw->slots));
+    tw->expired = NULL;
+    tw->num_timers = 0;
+    tw->current_tick = 0;
+    tw->wake_tick = 0;
+    tw->running = NULL;
+    tw->done = false;
+    chitcp_clock_now(&tw->start_time);
+
+    if (pthread_mutex_init(&tw->lock, NULL) != 0)
+        return CHITCP_EINIT;
+
+    if (pthread_condattr_init(&attr) != 0)
+        return CHITCP_EINIT;
+#ifndef __APPLE__
+    if (pthread_condattr_setclock(&attr, MT_CLOCK) != 0)
+        return CHITCP_EINIT;
+#endif
+    if (pthread_cond_init(&tw->cv, &attr) != 0)
+        return CHITCP_EINIT;
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_cond_init(&tw->cv_running, NULL) != 0)
+        return CHITCP_EINIT;
+
+    if (pthread_create(&tw->thread, NULL, tw_thread_func, tw) != 0)
+        return CHITCP_ETHREAD;
+
+    return CHITCP_OK;
+}
+
+
+/* See timerwheel.h */
+int tw_free(timer_wheel_t *tw)
+{
+    pthread_mutex_lock(&tw->lock);
+    tw->done = true;
+    pthread_cond_signal(&tw->cv);
+    pthread_mutex_unlock(&tw->lock);
+
+    pthread_join(tw->thread, NULL);
+
+    pthread_mutex_destroy(&tw->lock);
+    pthread_cond_destroy(&tw->cv);
+    pthread_cond_destroy(&tw->cv_running);
+
+    return CHITCP_OK;
+}
+
+
+/* See timerwheel.h */
+void __tw_add(timer_wheel_t *tw, single_timer_t *timer, uint64_t timeout)
+{
+    /* If the wheel is empty, the thread may have been sleeping for
+     * a while, so we fast-forward the wheel to the current time
+     * instead of making the thread go through all the missed ticks */
+    if (tw->num_timers == 0)
+        tw->current_tick = tw_now_tick(tw);
+
+    /* A timer never expires in the tick it is set in */
+    timer->expiry_tick = tw_now_tick(tw) + (timeout + TW_TICK - 1) / TW_TICK;
+    if (timer->expiry_tick <= tw->current_tick)
+        timer->expiry_tick = tw->current_tick + 1;
+
+    tw_place(tw, timer);
+    tw->num_timers++;
+
+    /* Only wake up the thread if it is sleeping past this timer */
+    if (timer->expiry_tick < tw->wake_tick)
+        pthread_cond_signal(&tw->cv);
+}
+
+
+/* See timerwheel.h */
+void __tw_remove(timer_wheel_t *tw, single_timer_t *timer)
+{
+    if (timer->wheel_list == NULL)
+        return;
+
+    DL_DELETE(*timer->wheel_list, timer);
+    timer->wheel_list = NULL;
+    tw->num_timers--;
+}
+
+
+/* See timerwheel.h */
+void __tw_wait_for_callbacks(timer_wheel_t *tw, multi_timer_t *mt)
+{
+    /* A callback freeing its own multitimer would wait forever */
+    if (pthread_equal(pthread_self(), tw->thread))
+        return;
+
+    while (tw->running != NULL && tw->running->mt == mt)
+        pthread_cond_wait(&tw->cv_running, &tw->lock);
+}
@@ -45,6 +45,12 @@
 #include "chitcp/socket.h"
 #include "chitcp/types.h"
 #include "chitcp/packet.h"
+#include "chitcp/utils.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 const char *tcp_str(tcp_state_t state);
 
@@ -64,30 +70,260 @@ const char *tcp_state_names[] =
 };
 
 
+/*
+ * Checksums
+ *
+ * The data is added up in host byte order, 8 bytes (or a whole vector)
+ * at a time, into a 64-bit accumulator with end-around carry. Since
+ * 2^16 = 1 (mod 0xffff), folding this sum gives the same result as
+ * adding up the 16-bit words one by one (RFC 1071, section 2).
+ *
+ * Each kernel adds LEN bytes to SUM, copying them to DST if COPY is
+ * set. They are always inlined with a constant COPY, so the checksum
+ * and the copy-and-checksum versions don't test it in the loop.
+ */
+typedef uint64_t (*cksum_kernel_t)(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum);
+
+#define CKSUM_INLINE static inline __attribute__((always_inline))
+
+CKSUM_INLINE uint64_t cksum_add64(uint64_t sum, uint64_t w)
+{
+    sum += w;
+    return sum + (sum < w);
+}
+
+CKSUM_INLINE uint64_t cksum_scalar_kernel(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum, bool_t copy)
+{
+    uint64_t w = 0;
+
+    for (; len >= 8; src += 8, len -= 8)
+    {
+        memcpy(&w, src, 8);
+        if (copy)
+        {
+            memcpy(dst, &w, 8);
+            dst += 8;
+        }
+        sum = cksum_add64(sum, w);
+    }
+
+    /* The rest (at most 7 bytes) makes up the first bytes of one more
+     * word, so the odd byte (if any) is the high-order byte of its
+     * 16-bit word in network byte order, as in cksum */
+    if (len > 0)
+    {
+        w = 0;
+        memcpy(&w, src, len);
+        if (copy)
+            memcpy(dst, src, len);
+        sum = cksum_add64(sum, w);
+    }
+
+    return sum;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* SSE2 is always there on x86-64. The 32-bit halves of each 64-bit
+ * lane are added separately, so the lanes can't overflow */
+CKSUM_INLINE uint64_t cksum_sse2_kernel(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum, bool_t copy)
+{
+    __m128i zero = _mm_setzero_si128(), acc = zero;
+
+    for (; len >= 16; src += 16, len -= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) src);
+        if (copy)
+        {
+            _mm_storeu_si128((__m128i *) dst, v);
+            dst += 16;
+        }
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(acc));
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc)));
+
+    return cksum_scalar_kernel(dst, src, len, sum, copy);
+}
+
+static uint64_t cksum_sse2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_sse2_kernel(NULL, src, len, sum, FALSE);
+}
+
+static uint64_t cksum_copy_sse2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_sse2_kernel(dst, src, len, sum, TRUE);
+}
+
+/* AVX2 is only used if the CPU has it (see cksum_select) */
+__attribute__((target("avx2")))
+CKSUM_INLINE uint64_t cksum_avx2_kernel(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum, bool_t copy)
+{
+    __m256i zero = _mm256_setzero_si256(), acc = zero;
+    __m128i acc128;
+
+    for (; len >= 32; src += 32, len -= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) src);
+        if (copy)
+        {
+            _mm256_storeu_si256((__m256i *) dst, v);
+            dst += 32;
+        }
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    acc128 = _mm256_castsi256_si128(acc);
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(acc128));
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc128, acc128)));
+    acc128 = _mm256_extracti128_si256(acc, 1);
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(acc128));
+    sum = cksum_add64(sum, (uint64_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc128, acc128)));
+
+    return cksum_scalar_kernel(dst, src, len, sum, copy);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_avx2_kernel(NULL, src, len, sum, FALSE);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_avx2_kernel(dst, src, len, sum, TRUE);
+}
+
+static cksum_kernel_t cksum_sum_kernel = cksum_sse2;
+static cksum_kernel_t cksum_copy_kernel = cksum_copy_sse2;
+
+__attribute__((constructor))
+static void cksum_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        cksum_sum_kernel = cksum_avx2;
+        cksum_copy_kernel = cksum_copy_avx2;
+    }
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+/* NEON is always there on AArch64. vpadalq_u32 adds pairs of 32-bit
+ * words into 64-bit lanes, so the lanes can't overflow */
+CKSUM_INLINE uint64_t cksum_neon_kernel(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum, bool_t copy)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+
+    for (; len >= 16; src += 16, len -= 16)
+    {
+        uint8x16_t v = vld1q_u8(src);
+        if (copy)
+        {
+            vst1q_u8(dst, v);
+            dst += 16;
+        }
+        acc = vpadalq_u32(acc, vreinterpretq_u32_u8(v));
+    }
+
+    sum = cksum_add64(sum, vgetq_lane_u64(acc, 0));
+    sum = cksum_add64(sum, vgetq_lane_u64(acc, 1));
+
+    return cksum_scalar_kernel(dst, src, len, sum, copy);
+}
+
+static uint64_t cksum_neon(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_neon_kernel(NULL, src, len, sum, FALSE);
+}
+
+static uint64_t cksum_copy_neon(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_neon_kernel(dst, src, len, sum, TRUE);
+}
+
+static cksum_kernel_t cksum_sum_kernel = cksum_neon;
+static cksum_kernel_t cksum_copy_kernel = cksum_copy_neon;
+
+#else
+static uint64_t cksum_scalar(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_scalar_kernel(NULL, src, len, sum, FALSE);
+}
+
+static uint64_t cksum_copy_scalar(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    return cksum_scalar_kernel(dst, src, len, sum, TRUE);
+}
+
+static cksum_kernel_t cksum_sum_kernel = cksum_scalar;
+static cksum_kernel_t cksum_copy_kernel = cksum_copy_scalar;
+#endif
+
+/* Folds a 64-bit sum into 32 bits (it's still a one's complement sum) */
+static inline uint32_t cksum_fold32(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+
+    return (uint32_t) sum;
+}
+
 /* See utils.h */
-uint16_t cksum (const void *_data, int len)
+uint32_t cksum_partial(const void *_data, int len, uint32_t sum)
 {
-      const uint8_t *data = _data;
-      uint32_t sum;
+    if (len <= 0)
+        return sum;
 
-      for (sum = 0;len >= 2; data += 2, len -= 2)
-      {
-        sum += data[0] << 8 | data[1];
-      }
+    return cksum_fold32(cksum_sum_kernel(NULL, _data, len, sum));
+}
 
-      if (len > 0)
-      {
-        sum += data[0] << 8;
-      }
+/* See utils.h */
+uint32_t cksum_copy_partial(void *dst, const void *src, int len, uint32_t sum)
+{
+    if (len <= 0)
+        return sum;
 
-      while (sum > 0xffff)
-      {
+    return cksum_fold32(cksum_copy_kernel(dst, src, len, sum));
+}
+
+/* See utils.h */
+uint16_t cksum_finish(uint32_t sum)
+{
+    while (sum > 0xffff)
         sum = (sum >> 16) + (sum & 0xffff);
-      }
 
-      sum = htons (~sum);
+    return (uint16_t) ~sum;
+}
+
+/* See utils.h */
+uint16_t cksum(const void *_data, int len)
+{
+    uint16_t sum = cksum_finish(cksum_partial(_data, len, 0));
+
+    return sum ? sum : 0xffff;
+}
+
+/* See utils.h */
+uint16_t cksum_update16(uint16_t check, uint16_t old, uint16_t new)
+{
+    /* HC' = ~(~HC + ~m + m') */
+    return cksum_finish((uint16_t) ~check + (uint16_t) ~old + (uint32_t) new);
+}
+
+/* See utils.h */
+uint16_t cksum_update32(uint16_t check, uint32_t old, uint32_t new)
+{
+    uint32_t sum = (uint16_t) ~check;
+
+    sum += (uint16_t) ~(old >> 16) + (uint16_t) ~(old & 0xffff);
+    sum += (new >> 16) + (new & 0xffff);
 
-      return sum ? sum : 0xffff;
+    return cksum_finish(sum);
 }
 
 
@@ -3,6 +3,7 @@
 #include <criterion/criterion.h>
 #include "serverinfo.h"
 #include "server.h"
+#include "transport.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/debug_api.h"
 #include "chitcp/tester.h"
@@ -46,12 +47,27 @@ void chitcpd_and_tester_setup(void)
 
     log_setup();
 
+    /* With VIRTUAL_TIME set, timeouts and link delays take (almost) no
+     * real time (see clock.h) */
+    if(getenv("VIRTUAL_TIME"))
+    {
+        rc = chitcp_clock_set(CHITCP_CLOCK_VIRTUAL, 0);
+        cr_assert(rc == 0, "Could not use virtual time.");
+    }
+
     si = calloc(1, sizeof(serverinfo_t));
     si->server_port = chitcp_htons(GET_CHITCPD_PORT);
     chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
 
     si->libpcap_file_name = getenv("PCAP");
 
+    /* The tests can be run over any of the inter-daemon transports */
+    if(getenv("TRANSPORT"))
+    {
+        si->transport = transport_lookup(getenv("TRANSPORT"));
+        cr_assert(si->transport != NULL, "Unknown transport: %s", getenv("TRANSPORT"));
+    }
+
     rc = chitcpd_server_init(si);
     cr_assert(rc == 0, "Could not initialize chiTCP daemon.");
 
@@ -0,0 +1,50 @@
+#include "affinity.h"
+#include "chitcp/types.h"
+#include <criterion/criterion.h>
+
+Test(affinity, parse)
+{
+    cpu_placement_t placement;
+
+    cr_assert_eq(affinity_parse_cpus("0-3,8,10-11", &placement), CHITCP_OK);
+    cr_assert_eq(placement.num_cpus, 7);
+    cr_assert_eq(placement.cpus[0], 0);
+    cr_assert_eq(placement.cpus[3], 3);
+    cr_assert_eq(placement.cpus[4], 8);
+    cr_assert_eq(placement.cpus[5], 10);
+    cr_assert_eq(placement.cpus[6], 11);
+    affinity_free(&placement);
+    cr_assert_eq(placement.num_cpus, 0);
+
+    cr_assert_eq(affinity_parse_cpus("5", &placement), CHITCP_OK);
+    cr_assert_eq(placement.num_cpus, 1);
+    cr_assert_eq(placement.cpus[0], 5);
+    affinity_free(&placement);
+
+    cr_assert_eq(affinity_parse_cpus("", &placement), CHITCP_EINVAL);
+    cr_assert_eq(affinity_parse_cpus("1,", &placement), CHITCP_OK);
+    affinity_free(&placement);
+    cr_assert_eq(affinity_parse_cpus("3-1", &placement), CHITCP_EINVAL);
+    cr_assert_eq(affinity_parse_cpus("1-", &placement), CHITCP_EINVAL);
+    cr_assert_eq(affinity_parse_cpus("a", &placement), CHITCP_EINVAL);
+    cr_assert_eq(affinity_parse_cpus("1;2", &placement), CHITCP_EINVAL);
+    cr_assert_eq(affinity_parse_cpus("0-100000", &placement), CHITCP_EINVAL);
+}
+
+Test(affinity, slots)
+{
+    cpu_placement_t placement = {0};
+
+    /* Without a placement, nothing is pinned */
+    cr_assert_eq(affinity_pin_cpu(&placement, 3), CHITCP_OK);
+    cr_assert_eq(affinity_pin_all(&placement), CHITCP_OK);
+    cr_assert_eq(affinity_node(&placement, 0), -1);
+
+    /* Slots wrap around the list */
+    cr_assert_eq(affinity_parse_cpus("0", &placement), CHITCP_OK);
+    cr_assert_eq(affinity_pin_cpu(&placement, 5), CHITCP_OK);
+    cr_assert_eq(affinity_node(&placement, 5), affinity_node(&placement, 0));
+    cr_assert_eq(affinity_pin_node(&placement, 2), CHITCP_OK);
+    cr_assert_eq(affinity_pin_node(&placement, -1), CHITCP_OK);
+    affinity_free(&placement);
+}
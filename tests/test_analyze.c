@@ -0,0 +1,219 @@
+#include "analyze.h"
+#include "pcap.h"
+#include "chitcp/types.h"
+#include "chitcp/multitimer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+
+#define A (0)
+#define B (1)
+
+/* A classic pcap file (nanosecond timestamps, raw IP) of a single IPv4
+ * connection between 10.0.0.1:1000 (A) and 10.0.0.2:2000 (B) */
+typedef struct test_capture
+{
+    FILE *f;
+    struct in_addr addr[2];
+} test_capture_t;
+
+static void capture_start(test_capture_t *tc, char *filename)
+{
+    uint32_t hdr[6] = {0xa1b23c4d, 2 | (4 << 16), 0, 0, 65535, 101};
+
+    close(mkstemp(filename));
+    tc->f = fopen(filename, "wb");
+    cr_assert_not_null(tc->f);
+    fwrite(hdr, sizeof(hdr), 1, tc->f);
+    inet_pton(AF_INET, "10.0.0.1", &tc->addr[A]);
+    inet_pton(AF_INET, "10.0.0.2", &tc->addr[B]);
+}
+
+static void capture_segment(test_capture_t *tc, uint64_t ts_ms, int from, uint32_t seq, uint32_t ack,
+                            const char *flags, uint16_t win, uint16_t len, int wscale)
+{
+    tcp_packet_t packet;
+    tcphdr_t *header;
+    uint8_t payload[1000] = {0}, ip[20] = {0x45};
+    uint32_t rec[4];
+    uint16_t total;
+
+    chitcp_tcp_packet_create(&packet, payload, len);
+    if (wscale >= 0)
+        chitcp_tcp_packet_add_wscale(&packet, wscale);
+    header = TCP_PACKET_HEADER(&packet);
+    header->source = chitcp_htons(from == A ? 1000 : 2000);
+    header->dest = chitcp_htons(from == A ? 2000 : 1000);
+    header->seq = chitcp_htonl(seq);
+    header->ack_seq = chitcp_htonl(ack);
+    header->win = chitcp_htons(win);
+    header->syn = strchr(flags, 'S') != NULL;
+    header->ack = strchr(flags, 'A') != NULL;
+    header->fin = strchr(flags, 'F') != NULL;
+
+    total = htons(20 + packet.length);
+    memcpy(ip + 2, &total, 2);
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip + 12, &tc->addr[from], 4);
+    memcpy(ip + 16, &tc->addr[1 - from], 4);
+
+    rec[0] = ts_ms / 1000;
+    rec[1] = (ts_ms % 1000) * MILLISECOND;
+    rec[2] = rec[3] = 20 + packet.length;
+    fwrite(rec, sizeof(rec), 1, tc->f);
+    fwrite(ip, sizeof(ip), 1, tc->f);
+    fwrite(packet.raw, packet.length, 1, tc->f);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+static void analyze_file(const char *filename, analyzer_t *analyzer, uint64_t interval)
+{
+    capture_t cap;
+    capture_packet_t pkt;
+    int rc;
+
+    cr_assert_eq(capture_open(&cap, filename), CHITCP_OK);
+    analyzer_init(analyzer, interval);
+    while ((rc = capture_next(&cap, &pkt)) == 1)
+        cr_assert_eq(analyzer_add(analyzer, &pkt), CHITCP_OK);
+    cr_assert_eq(rc, 0);
+    analyzer_finish(analyzer);
+    capture_close(&cap);
+}
+
+Test(analyze, connection)
+{
+    char filename[] = "/tmp/test-analyze-XXXXXX";
+    test_capture_t tc;
+    analyzer_t analyzer;
+    analyze_conn_t *conn;
+    analyze_flow_t *flow;
+
+    capture_start(&tc, filename);
+    capture_segment(&tc,   0, A, 1000,    0, "S",  1000,   0, 2);
+    capture_segment(&tc,  10, B, 5000, 1001, "SA", 1000,   0, 3);
+    capture_segment(&tc,  20, A, 1001, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc,  20, A, 1101, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc,  30, B, 5001, 1201, "A",  1000,   0, -1);
+    /* Lost, and retransmitted after a timeout */
+    capture_segment(&tc,  40, A, 1201, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc, 300, A, 1201, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc, 310, B, 5001, 1301, "A",  1000,   0, -1);
+    /* Retransmitted too soon: the ACK comes back in less than half an RTT */
+    capture_segment(&tc, 400, A, 1301, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc, 405, A, 1301, 5001, "A",  1000, 100, -1);
+    capture_segment(&tc, 406, B, 5001, 1401, "A",  1000,   0, -1);
+    /* B's window is closed for 200 ms */
+    capture_segment(&tc, 500, B, 5001, 1401, "A",     0,   0, -1);
+    capture_segment(&tc, 700, B, 5001, 1401, "A",  1000,   0, -1);
+    capture_segment(&tc, 800, A, 1401, 5001, "FA", 1000,   0, -1);
+    capture_segment(&tc, 810, B, 5001, 1402, "FA", 1000,   0, -1);
+    capture_segment(&tc, 820, A, 1402, 5002, "A",  1000,   0, -1);
+    fclose(tc.f);
+
+    analyze_file(filename, &analyzer, 100 * MILLISECOND);
+
+    cr_assert_eq(analyzer.packets, 16);
+    cr_assert_eq(analyzer.ignored, 0);
+    cr_assert_eq(analyzer.num_connections, 1);
+    conn = analyzer.connections;
+    cr_assert(conn->syn_seen);
+    cr_assert(conn->fin[0] && conn->fin[1]);
+    cr_assert_eq(conn->last - conn->first, 820 * MILLISECOND);
+
+    flow = &conn->flows[0];
+    cr_assert_eq(flow->src.port, 1000);
+    cr_assert_eq(flow->segments, 9);
+    cr_assert_eq(flow->bytes, 600);
+    cr_assert_eq(flow->bytes_acked, 400);
+    cr_assert_eq(flow->retransmits, 2);
+    cr_assert_eq(flow->spurious, 1);
+    cr_assert_eq(flow->rtt_min, 10 * MILLISECOND);
+    cr_assert_eq(flow->stalls, 1);
+    cr_assert_eq(flow->stall_time, 200 * MILLISECOND);
+
+    /* Both ends offered window scaling, so B's window is scaled by 3 */
+    cr_assert_eq(flow->rwnd, 1000 << 3);
+
+    /* 200 bytes in the first interval, and 100 in the 4th and 5th (the
+     * FIN is acknowledged in the 9th, but it isn't data) */
+    cr_assert_eq(flow->num_goodput, 9);
+    cr_assert_eq(flow->goodput[0], 200);
+    cr_assert_eq(flow->goodput[1], 0);
+    cr_assert_eq(flow->goodput[3], 100);
+    cr_assert_eq(flow->goodput[4], 100);
+    cr_assert_eq(flow->goodput[8], 0);
+
+    flow = &conn->flows[1];
+    cr_assert_eq(flow->bytes, 0);
+    cr_assert_eq(flow->retransmits, 0);
+    cr_assert_eq(flow->stalls, 0);
+
+    analyzer_free(&analyzer);
+    unlink(filename);
+}
+
+Test(analyze, truncated)
+{
+    char filename[] = "/tmp/test-analyze-XXXXXX";
+    test_capture_t tc;
+    capture_t cap;
+    capture_packet_t pkt;
+
+    capture_start(&tc, filename);
+    capture_segment(&tc, 0, A, 1000, 0, "S", 1000, 0, -1);
+    capture_segment(&tc, 10, B, 5000, 1001, "SA", 1000, 0, -1);
+    fclose(tc.f);
+    cr_assert_eq(truncate(filename, 24 + 16 + 40 + 10), 0);
+
+    cr_assert_eq(capture_open(&cap, filename), CHITCP_OK);
+    cr_assert_eq(capture_next(&cap, &pkt), 1);
+    cr_assert_eq(pkt.caplen, 40);
+    cr_assert_eq(capture_next(&cap, &pkt), CHITCP_EINVAL);
+    capture_close(&cap);
+    unlink(filename);
+}
+
+Test(analyze, pcapng_both_ends)
+{
+    char filename[] = "/tmp/test-analyze-XXXXXX";
+    pcap_writer_t *writer;
+    pcap_options_t options = {PCAP_FORMAT_PCAPNG, 0, 0, 0};
+    struct sockaddr_in a, b;
+    tcp_packet_t packet;
+    uint8_t payload[100] = {0};
+    analyzer_t analyzer;
+
+    close(mkstemp(filename));
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.sin_family = b.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &a.sin_addr);
+    inet_pton(AF_INET, "10.0.0.2", &b.sin_addr);
+    chitcp_tcp_packet_create(&packet, payload, sizeof(payload));
+    TCP_PACKET_HEADER(&packet)->source = chitcp_htons(1000);
+    TCP_PACKET_HEADER(&packet)->dest = chitcp_htons(2000);
+    TCP_PACKET_HEADER(&packet)->seq = chitcp_htonl(1);
+    TCP_PACKET_HEADER(&packet)->ack = 1;
+
+    /* Socket 1 sends the segment, and socket 2 (in the same chitcpd)
+     * receives it: only the first socket's copy is analyzed */
+    cr_assert_eq(pcap_writer_open(filename, &options, &writer), CHITCP_OK);
+    cr_assert_eq(pcap_capture(writer, 1, PCAP_OUTBOUND, (struct sockaddr *) &a, (struct sockaddr *) &b, &packet), CHITCP_OK);
+    cr_assert_eq(pcap_capture(writer, 2, PCAP_INBOUND, (struct sockaddr *) &a, (struct sockaddr *) &b, &packet), CHITCP_OK);
+    pcap_writer_close(writer);
+
+    analyze_file(filename, &analyzer, SECOND);
+    cr_assert_eq(analyzer.packets, 2);
+    cr_assert_eq(analyzer.ignored, 1);
+    cr_assert_eq(analyzer.num_connections, 1);
+    cr_assert_eq(analyzer.connections->flows[0].segments, 1);
+    cr_assert_eq(analyzer.connections->flows[0].bytes, 100);
+
+    analyzer_free(&analyzer);
+    chitcp_tcp_packet_free(&packet);
+    unlink(filename);
+}
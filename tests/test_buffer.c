@@ -292,6 +292,46 @@ Test(buffer, wraparound_2)
     circular_buffer_free(&buf);
 }
 
+Test(buffer, resize_wraparound)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    rc = circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+
+    rc = circular_buffer_read(&buf, tmp, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+
+    rc = circular_buffer_write(&buf, numbers+6, 6, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+
+    rc = circular_buffer_resize(&buf, 16);
+    cr_assert_eq(rc, CHITCP_OK);
+    cr_assert_eq(circular_buffer_capacity(&buf), 16);
+    cr_assert_eq(circular_buffer_count(&buf), 8);
+    cr_assert_eq(circular_buffer_first(&buf), 1004);
+    cr_assert_eq(circular_buffer_next(&buf), 1012);
+
+    rc = circular_buffer_write(&buf, numbers+12, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+
+    rc = circular_buffer_read(&buf, tmp+4, 16, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 12);
+    cr_assert_eq(memcmp(numbers, tmp, 16), 0);
+
+    /* Buffers don't shrink */
+    rc = circular_buffer_resize(&buf, 4);
+    cr_assert_eq(rc, CHITCP_OK);
+    cr_assert_eq(circular_buffer_capacity(&buf), 16);
+
+    circular_buffer_free(&buf);
+}
+
 Test(buffer, concurrency_1)
 {
     circular_buffer_t buf;
@@ -306,3 +346,238 @@ Test(buffer, concurrency_1)
     pthread_join(producer_thread, NULL);
     circular_buffer_free(&buf);
 }
+
+Test(buffer, spsc_wraparound)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    /* Not a power of two, so the storage is larger than the capacity */
+    circular_buffer_init_spsc(&buf, 6);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    rc = circular_buffer_write(&buf, numbers, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 4);
+
+    rc = circular_buffer_write(&buf, numbers+4, 4, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+
+    rc = circular_buffer_read(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 3);
+    cr_assert_eq(circular_buffer_first(&buf), 1003);
+
+    rc = circular_buffer_write(&buf, numbers+4, 5, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 5);
+    cr_assert_eq(circular_buffer_count(&buf), 6);
+    cr_assert_eq(circular_buffer_available(&buf), 0);
+    cr_assert_eq(circular_buffer_next(&buf), 1009);
+
+    rc = circular_buffer_peek_at(&buf, tmp+3, 1005, 4);
+    cr_assert_eq(rc, 4);
+    cr_assert_eq(memcmp(numbers+5, tmp+3, 4), 0);
+
+    rc = circular_buffer_read(&buf, tmp+3, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+    cr_assert_eq(memcmp(numbers, tmp, 9), 0);
+
+    rc = circular_buffer_read(&buf, tmp, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+
+    cr_assert_eq(circular_buffer_resize(&buf, 16), CHITCP_EINVAL);
+
+    circular_buffer_free(&buf);
+}
+
+Test(buffer, spsc_concurrency)
+{
+    circular_buffer_t buf;
+
+    pthread_t consumer_thread, producer_thread;
+
+    circular_buffer_init_spsc(&buf, 8);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    pthread_create(&consumer_thread, NULL, consumer_func1, &buf);
+    pthread_create(&producer_thread, NULL, producer_func1, &buf);
+    pthread_join(consumer_thread, NULL);
+    pthread_join(producer_thread, NULL);
+    circular_buffer_free(&buf);
+}
+
+static void count_notify(circular_buffer_t *buf, void *arg)
+{
+    (*(int *) arg)++;
+}
+
+Test(buffer, notify_and_close)
+{
+    int rc, notified = 0;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init_spsc(&buf, 8);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    circular_buffer_set_notify(&buf, count_notify, &notified);
+
+    rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 3);
+    cr_assert_eq(notified, 1);
+
+    /* Peeking doesn't change the state of the buffer */
+    rc = circular_buffer_peek(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 3);
+    cr_assert_eq(notified, 1);
+
+    rc = circular_buffer_read(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 3);
+    cr_assert_eq(notified, 2);
+
+    rc = circular_buffer_read(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+    cr_assert_eq(notified, 2);
+
+    /* A closed, empty buffer is at its end, so it doesn't block */
+    circular_buffer_close(&buf);
+    cr_assert_eq(notified, 3);
+
+    rc = circular_buffer_read(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 0);
+
+    circular_buffer_free(&buf);
+}
+
+static void count_alloc(uint8_t *data, size_t len, void *arg)
+{
+    (*(int *) arg)++;
+}
+
+Test(buffer, lazy_alloc_and_trim)
+{
+    int rc, allocs = 0;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    circular_buffer_set_alloc_hook(&buf, count_alloc, &allocs);
+    cr_assert_null(buf.data);
+
+    rc = circular_buffer_read(&buf, tmp, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+    cr_assert_null(buf.data);
+
+    rc = circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+    cr_assert_eq(allocs, 1);
+    cr_assert_eq(circular_buffer_trim(&buf), CHITCP_EWOULDBLOCK);
+
+    rc = circular_buffer_read(&buf, tmp, 6, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+    cr_assert_eq(circular_buffer_trim(&buf), CHITCP_OK);
+    cr_assert_null(buf.data);
+
+    /* The sequence numbers carry on where they were */
+    rc = circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 6);
+    cr_assert_eq(allocs, 2);
+    cr_assert_eq(circular_buffer_first(&buf), 1006);
+    cr_assert_eq(circular_buffer_next(&buf), 1012);
+
+    rc = circular_buffer_peek_at(&buf, tmp, 1008, 4);
+    cr_assert_eq(rc, 4);
+    cr_assert_eq(memcmp(numbers + 2, tmp, 4), 0);
+
+    circular_buffer_free(&buf);
+}
+
+Test(buffer, spsc_trim)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init_spsc(&buf, 8);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    cr_assert_eq(circular_buffer_trim(&buf), CHITCP_OK);
+
+    rc = circular_buffer_write(&buf, numbers, 7, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 7);
+    rc = circular_buffer_read(&buf, tmp, 7, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 7);
+    cr_assert_eq(circular_buffer_trim(&buf), CHITCP_OK);
+    cr_assert_null(buf.data);
+
+    /* The next write wraps around the end of the (new) data */
+    rc = circular_buffer_write(&buf, numbers, 5, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 5);
+    cr_assert_eq(circular_buffer_first(&buf), 1007);
+    rc = circular_buffer_read(&buf, tmp, 5, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 5);
+    cr_assert_eq(memcmp(numbers, tmp, 5), 0);
+
+    circular_buffer_free(&buf);
+}
+
+static void check_read_lowat(circular_buffer_t *buf)
+{
+    int rc;
+    uint8_t tmp[26];
+
+    /* Not enough data for the low watermark (or for the whole read) */
+    rc = circular_buffer_write(buf, numbers, 3, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 3);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 4, BUFFER_NONBLOCKING, FALSE);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 6, BUFFER_NONBLOCKING, FALSE);
+    cr_assert_eq(rc, CHITCP_EWOULDBLOCK);
+
+    /* A read of fewer bytes than the low watermark only waits for those */
+    rc = circular_buffer_read_lowat(buf, tmp, 2, 4, BUFFER_NONBLOCKING, TRUE);
+    cr_assert_eq(rc, 2);
+    cr_assert_eq(memcmp(numbers, tmp, 2), 0);
+    cr_assert_eq(circular_buffer_count(buf), 3);
+
+    /* Once the low watermark is reached, everything there is returned */
+    rc = circular_buffer_write(buf, numbers + 3, 2, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 2);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 4, BUFFER_NONBLOCKING, TRUE);
+    cr_assert_eq(rc, 5);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 4, BUFFER_NONBLOCKING, FALSE);
+    cr_assert_eq(rc, 5);
+    cr_assert_eq(memcmp(numbers, tmp, 5), 0);
+    cr_assert_eq(circular_buffer_count(buf), 0);
+
+    /* The low watermark can't be more than the buffer can hold */
+    rc = circular_buffer_write(buf, numbers, 8, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 8);
+    rc = circular_buffer_read_lowat(buf, tmp, 26, 26, BUFFER_NONBLOCKING, FALSE);
+    cr_assert_eq(rc, 8);
+    cr_assert_eq(memcmp(numbers, tmp, 8), 0);
+
+    /* Once the buffer is closed, whatever is left is returned */
+    rc = circular_buffer_write(buf, numbers, 2, BUFFER_NONBLOCKING);
+    cr_assert_eq(rc, 2);
+    circular_buffer_close(buf);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 6, BUFFER_BLOCKING, FALSE);
+    cr_assert_eq(rc, 2);
+    rc = circular_buffer_read_lowat(buf, tmp, 6, 6, BUFFER_BLOCKING, FALSE);
+    cr_assert_eq(rc, 0);
+}
+
+Test(buffer, read_lowat)
+{
+    circular_buffer_t buf;
+
+    circular_buffer_init(&buf, 8);
+    check_read_lowat(&buf);
+    circular_buffer_free(&buf);
+}
+
+Test(buffer, spsc_read_lowat)
+{
+    circular_buffer_t buf;
+
+    circular_buffer_init_spsc(&buf, 8);
+    check_read_lowat(&buf);
+    circular_buffer_free(&buf);
+}
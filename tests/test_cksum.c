@@ -0,0 +1,126 @@
+#include "chitcp/types.h"
+#include "chitcp/utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+
+/* The checksum one 16-bit word at a time, as in RFC 1071 */
+static uint16_t cksum_reference(const uint8_t *data, int len)
+{
+    uint32_t sum = 0;
+
+    for (; len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+
+    sum = htons(~sum);
+    return sum ? sum : 0xffff;
+}
+
+static void random_bytes(uint8_t *data, int len)
+{
+    for (int i = 0; i < len; i++)
+        data[i] = rand();
+}
+
+Test(cksum, known_value)
+{
+    /* A commonly used IPv4 header example, with its checksum field zeroed */
+    uint8_t hdr[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+                       0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+    uint16_t sum = cksum(hdr, sizeof(hdr));
+
+    cr_assert_eq(memcmp(&sum, "\xb8\x61", 2), 0);
+
+    /* A header with its checksum in it checks out */
+    memcpy(hdr + 10, &sum, 2);
+    cr_assert_eq(cksum_finish(cksum_partial(hdr, sizeof(hdr), 0)), 0);
+}
+
+Test(cksum, lengths_and_alignment)
+{
+    uint8_t *data = malloc(70000);
+
+    srand(1);
+    for (int i = 0; i < 2000; i++)
+    {
+        int len = rand() % (i < 1000 ? 300 : 66000);
+        int offset = rand() % 8;
+
+        random_bytes(data + offset, len);
+        if (i % 10 == 0)
+            memset(data + offset, 0xff, len);
+        cr_assert_eq(cksum(data + offset, len), cksum_reference(data + offset, len),
+                     "Wrong checksum of %i bytes at offset %i", len, offset);
+    }
+
+    free(data);
+}
+
+Test(cksum, partial_and_copy)
+{
+    uint8_t *src = malloc(4096), *dst = malloc(4096);
+    uint32_t sum;
+
+    srand(2);
+    for (int i = 0; i < 500; i++)
+    {
+        int len = rand() % 4000;
+        int split = (rand() % (len + 1)) & ~1;
+        uint16_t expected;
+
+        random_bytes(src + 1, len);
+        expected = cksum_reference(src + 1, len);
+
+        /* In two pieces, the first one with an even length */
+        sum = cksum_partial(src + 1, split, 0);
+        sum = cksum_partial(src + 1 + split, len - split, sum);
+        cr_assert_eq(cksum_finish(sum) ? cksum_finish(sum) : 0xffff, expected);
+
+        memset(dst, 0, 4096);
+        sum = cksum_copy_partial(dst + 3, src + 1, len, 0);
+        cr_assert_eq(cksum_finish(sum) ? cksum_finish(sum) : 0xffff, expected);
+        cr_assert_eq(memcmp(dst + 3, src + 1, len), 0);
+        cr_assert_eq(dst[3 + len], 0);
+    }
+
+    free(src);
+    free(dst);
+}
+
+Test(cksum, incremental)
+{
+    uint8_t hdr[60];
+    uint16_t sum, old16, new16;
+    uint32_t old32, new32;
+
+    srand(3);
+    for (int i = 0; i < 1000; i++)
+    {
+        random_bytes(hdr, sizeof(hdr));
+        memset(hdr + 16, 0, 2);
+        sum = cksum_finish(cksum_partial(hdr, sizeof(hdr), 0));
+
+        /* New acknowledgement number */
+        new32 = i % 10 == 0 ? 0 : (uint32_t) rand();
+        memcpy(&old32, hdr + 8, 4);
+        memcpy(hdr + 8, &new32, 4);
+        sum = cksum_update32(sum, old32, new32);
+
+        /* New window */
+        new16 = i % 10 == 1 ? 0xffff : rand();
+        memcpy(&old16, hdr + 14, 2);
+        memcpy(hdr + 14, &new16, 2);
+        sum = cksum_update16(sum, old16, new16);
+
+        /* The updated checksum checks out (0x0000 and 0xffff are both
+         * zero in one's complement) */
+        memcpy(hdr + 16, &sum, 2);
+        cr_assert(cksum_finish(cksum_partial(hdr, sizeof(hdr), 0)) == 0 ||
+                  cksum_finish(cksum_partial(hdr, sizeof(hdr), 0)) == 0xffff);
+    }
+}
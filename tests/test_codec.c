@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <criterion/criterion.h>
+#include "arena.h"
+#include "fast-codec.h"
+#include "protobuf-wrapper.h"
+
+Test(codec, fast_send)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdSendArgs sa = CHITCPD_SEND_ARGS__INIT;
+    ChitcpdMsg *out;
+    uint8_t data[] = "Hello, chiTCP!";
+    uint8_t packed[CHITCPD_FAST_HDR_LEN + sizeof(data)];
+    size_t size;
+
+    msg.code = CHITCPD_MSG_CODE__SEND;
+    msg.request_id = 42;
+    msg.lane = 3;
+    msg.send_args = &sa;
+    sa.sockfd = 7;
+    sa.flags = 1;
+    sa.buf.data = data;
+    sa.buf.len = sizeof(data);
+
+    size = chitcpd_fast_get_packed_size(&msg);
+    cr_assert_eq(size, CHITCPD_FAST_HDR_LEN + sizeof(data), "Unexpected packed size %zu", size);
+    cr_assert_eq(chitcpd_fast_pack(&msg, packed), size, "chitcpd_fast_pack returned the wrong size");
+
+    /* The header is little-endian */
+    cr_assert_eq(packed[0], CHITCPD_FAST_VERSION, "Wrong version");
+    cr_assert_eq(packed[1], CHITCPD_MSG_CODE__SEND, "Wrong code");
+    cr_assert_eq(packed[4], 42, "Request ID is not little-endian");
+    cr_assert_eq(packed[12], 7, "Socket is not little-endian");
+
+    out = chitcpd_fast_unpack(NULL, packed, size);
+    cr_assert_not_null(out, "Could not unpack message");
+    cr_assert_eq(out->code, CHITCPD_MSG_CODE__SEND, "Wrong code");
+    cr_assert_eq(out->request_id, 42, "Wrong request ID");
+    cr_assert_eq(out->lane, 3, "Wrong lane");
+    cr_assert_not_null(out->send_args, "No SEND arguments");
+    cr_assert_eq(out->send_args->sockfd, 7, "Wrong socket");
+    cr_assert_eq(out->send_args->flags, 1, "Wrong flags");
+    cr_assert_eq(out->send_args->buf.len, sizeof(data), "Wrong payload length");
+    cr_assert_arr_eq(out->send_args->buf.data, data, sizeof(data), "Wrong payload");
+    chitcpd_msg__free_unpacked(out, NULL);
+
+    /* A truncated message must be rejected */
+    cr_assert_null(chitcpd_fast_unpack(NULL, packed, size - 1), "Accepted a truncated message");
+}
+
+Test(codec, fast_resp_state)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+    ChitcpdSocketState state = CHITCPD_SOCKET_STATE__INIT;
+    ChitcpdMsg *out;
+    uint8_t packed[CHITCPD_FAST_HDR_LEN + CHITCPD_FAST_STATE_LEN];
+    size_t size;
+
+    msg.code = CHITCPD_MSG_CODE__RESP;
+    msg.resp = &resp;
+    resp.ret = -1;
+    resp.error_code = 22;
+    resp.socket_state = &state;
+    state.tcp_state = 4;
+    state.iss = -2;
+    state.snd_wnd = 65535;
+
+    size = chitcpd_fast_get_packed_size(&msg);
+    cr_assert_eq(size, sizeof(packed), "Unexpected packed size %zu", size);
+    chitcpd_fast_pack(&msg, packed);
+
+    out = chitcpd_fast_unpack(NULL, packed, size);
+    cr_assert_not_null(out, "Could not unpack message");
+    cr_assert_not_null(out->resp, "No response");
+    cr_assert_eq(out->resp->ret, -1, "Wrong return value");
+    cr_assert_eq(out->resp->error_code, 22, "Wrong error code");
+    cr_assert_eq(out->resp->has_buf, FALSE, "Response should not have a buffer");
+    cr_assert_not_null(out->resp->socket_state, "No socket state");
+    cr_assert_eq(out->resp->socket_state->tcp_state, 4, "Wrong TCP state");
+    cr_assert_eq(out->resp->socket_state->iss, -2, "Wrong ISS");
+    cr_assert_eq(out->resp->socket_state->snd_wnd, 65535, "Wrong SND.WND");
+    chitcpd_msg__free_unpacked(out, NULL);
+}
+
+Test(codec, fast_fallback)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdSocketArgs sa = CHITCPD_SOCKET_ARGS__INIT;
+    ChitcpdResp resp = CHITCPD_RESP__INIT;
+    uint8_t addr[4] = {127, 0, 0, 1};
+
+    /* Messages that are not on the data path go through protobuf */
+    msg.code = CHITCPD_MSG_CODE__SOCKET;
+    msg.socket_args = &sa;
+    cr_assert_eq(chitcpd_fast_get_packed_size(&msg), 0, "SOCKET should not be fast-path encodable");
+
+    msg.code = CHITCPD_MSG_CODE__RESP;
+    msg.socket_args = NULL;
+    msg.resp = &resp;
+    resp.has_addr = TRUE;
+    resp.addr.data = addr;
+    resp.addr.len = sizeof(addr);
+    cr_assert_eq(chitcpd_fast_get_packed_size(&msg), 0, "A response with an address should not be fast-path encodable");
+}
+
+
+void *short_writer_func(void *args)
+{
+    int sockfd = *((int *) args);
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdRecvArgs ra = CHITCPD_RECV_ARGS__INIT;
+    uint8_t frame[sizeof(size_t) + CHITCPD_FAST_HDR_LEN];
+    size_t len;
+
+    msg.code = CHITCPD_MSG_CODE__RECV;
+    msg.request_id = 1000;
+    msg.recv_args = &ra;
+    ra.sockfd = 3;
+    ra.len = 4096;
+    ra.use_shm = TRUE;
+    ra.shm_offset = 65536;
+
+    len = chitcpd_fast_pack(&msg, frame + sizeof(size_t));
+    len |= (size_t) 1 << (sizeof(size_t) * 8 - 1);
+    memcpy(frame, &len, sizeof(size_t));
+
+    /* Send the frame one byte at a time */
+    for (int i = 0; i < sizeof(frame); i++)
+    {
+        send(sockfd, frame + i, 1, 0);
+        usleep(100);
+    }
+
+    return NULL;
+}
+
+Test(codec, channel_short_reads)
+{
+    int sv[2];
+    pthread_t writer;
+    chitcpd_channel_t ch;
+    ChitcpdMsg *msg;
+    int rc;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Could not create socket pair");
+
+    chitcpd_channel_init(&ch, sv[0]);
+    ch.fast_version = CHITCPD_FAST_VERSION;
+
+    pthread_create(&writer, NULL, short_writer_func, &sv[1]);
+
+    rc = chitcpd_channel_recv_msg(&ch, &msg, NULL);
+    pthread_join(writer, NULL);
+
+    cr_assert_eq(rc, 0, "Could not receive message");
+    cr_assert_eq(msg->code, CHITCPD_MSG_CODE__RECV, "Wrong code");
+    cr_assert_eq(msg->request_id, 1000, "Wrong request ID");
+    cr_assert_not_null(msg->recv_args, "No RECV arguments");
+    cr_assert_eq(msg->recv_args->sockfd, 3, "Wrong socket");
+    cr_assert_eq(msg->recv_args->len, 4096, "Wrong length");
+    cr_assert(msg->recv_args->use_shm, "use_shm was not set");
+    cr_assert_eq(msg->recv_args->shm_offset, 65536, "Wrong window offset");
+    chitcpd_msg__free_unpacked(msg, NULL);
+
+    chitcpd_channel_free(&ch);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Test(codec, channel_fast_requires_negotiation)
+{
+    int sv[2];
+    chitcpd_channel_t sender, receiver;
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdCloseArgs ca = CHITCPD_CLOSE_ARGS__INIT;
+    ChitcpdMsg *out;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Could not create socket pair");
+
+    chitcpd_channel_init(&sender, sv[0]);
+    chitcpd_channel_init(&receiver, sv[1]);
+    sender.fast_version = CHITCPD_FAST_VERSION;
+
+    msg.code = CHITCPD_MSG_CODE__CLOSE;
+    msg.close_args = &ca;
+    ca.sockfd = 5;
+
+    cr_assert_eq(chitcpd_channel_send_msg(&sender, &msg), 0, "Could not send message");
+
+    /* The receiver has not agreed to use the fast-path encoding */
+    cr_assert_eq(chitcpd_channel_recv_msg(&receiver, &out, NULL), -2, "Accepted a fast-path frame without negotiating it");
+
+    chitcpd_channel_free(&sender);
+    chitcpd_channel_free(&receiver);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Test(codec, arena_unpack)
+{
+    ChitcpdMsg msg = CHITCPD_MSG__INIT;
+    ChitcpdSendArgs sa = CHITCPD_SEND_ARGS__INIT;
+    ChitcpdMsg *out;
+    chitcpd_arena_t arena;
+    chitcpd_arena_chunk_t *chunk;
+    uint8_t data[3000], packed[CHITCPD_FAST_HDR_LEN + sizeof(data)];
+    size_t size;
+
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = i % 256;
+    msg.code = CHITCPD_MSG_CODE__SEND;
+    msg.send_args = &sa;
+    sa.buf.data = data;
+    sa.buf.len = sizeof(data);
+    size = chitcpd_fast_pack(&msg, packed);
+
+    chitcpd_arena_init(&arena);
+
+    /* The second message doesn't fit in the first chunk */
+    for (int i = 0; i < 2; i++)
+    {
+        out = chitcpd_fast_unpack(&arena.allocator, packed, size);
+        cr_assert_not_null(out, "Could not unpack message");
+        cr_assert_arr_eq(out->send_args->buf.data, data, sizeof(data), "Wrong payload");
+        cr_assert_eq((uintptr_t) out % sizeof(void *), 0, "Misaligned message");
+    }
+    cr_assert_not_null(arena.chunks->next, "Expected a second chunk");
+
+    /* Once reset, the arena has room for both in its largest chunk */
+    chitcpd_arena_reset(&arena);
+    chunk = arena.chunks;
+    cr_assert_null(chunk->next, "Smaller chunks were not freed");
+    for (int i = 0; i < 2; i++)
+        cr_assert_not_null(chitcpd_fast_unpack(&arena.allocator, packed, size), "Could not unpack message");
+    cr_assert_eq(arena.chunks, chunk, "Allocated a chunk after the reset");
+
+    chitcpd_arena_free(&arena);
+    cr_assert_null(arena.chunks);
+}
@@ -3,6 +3,10 @@
 #include "chitcp/chitcpd.h"
 #include "serverinfo.h"
 #include "server.h"
+#include "handlers.h"
+#include "chitcp/embedded.h"
+#include "chitcp/socket.h"
+#include <string.h>
 
 Test(daemon, startstop)
 {
@@ -27,3 +31,156 @@ Test(daemon, startstop)
 
     chitcpd_server_free(si);
 }
+
+Test(daemon, startstop_workers)
+{
+    int rc;
+    serverinfo_t *si;
+
+    si = calloc(1, sizeof(serverinfo_t));
+    si->server_port = chitcp_htons(GET_CHITCPD_PORT);
+    chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
+    si->tcp_engine = TCP_ENGINE_WORKER_POOL;
+    si->num_tcp_workers = 2;
+
+    rc = chitcpd_server_init(si);
+    cr_assert(rc == 0, "Could not initialize chiTCP daemon.");
+    cr_assert_not_null(si->tcp_workers, "TCP workers were not started.");
+
+    rc = chitcpd_server_start(si);
+    cr_assert(rc == 0, "Could not start chiTCP daemon.");
+
+    rc = chitcpd_server_stop(si);
+    cr_assert(rc == 0, "Could not stop chiTCP daemon.");
+
+    rc = chitcpd_server_wait(si);
+    cr_assert(rc == 0, "Waiting for chiTCP daemon failed.");
+
+    chitcpd_server_free(si);
+    cr_assert_null(si->tcp_workers, "TCP workers were not stopped.");
+}
+
+Test(daemon, startstop_handlers)
+{
+    int rc;
+    serverinfo_t *si;
+
+    si = calloc(1, sizeof(serverinfo_t));
+    si->server_port = chitcp_htons(GET_CHITCPD_PORT);
+    chitcp_unix_socket(si->server_socket_path, UNIX_PATH_MAX);
+    si->num_handler_threads = 3;
+
+    rc = chitcpd_server_init(si);
+    cr_assert(rc == 0, "Could not initialize chiTCP daemon.");
+    cr_assert_not_null(si->handler_pool, "Handler pool was not started.");
+    cr_assert_eq(si->handler_pool->num_threads, 3, "Handler pool has the wrong number of threads.");
+
+    rc = chitcpd_server_start(si);
+    cr_assert(rc == 0, "Could not start chiTCP daemon.");
+
+    rc = chitcpd_server_stop(si);
+    cr_assert(rc == 0, "Could not stop chiTCP daemon.");
+
+    rc = chitcpd_server_wait(si);
+    cr_assert(rc == 0, "Waiting for chiTCP daemon failed.");
+
+    cr_assert_null(si->handler_pool, "Handler pool was not stopped.");
+    chitcpd_server_free(si);
+}
+
+Test(daemon, embedded)
+{
+    int rc, lfd, cfd, afd;
+    struct sockaddr_in addr;
+    char buf[16];
+
+    rc = chitcp_embedded_start(NULL);
+    cr_assert(rc == 0, "Could not start embedded chiTCP stack.");
+    cr_assert_eq(chitcp_embedded_start(NULL), CHITCP_EINVAL, "Started a second embedded stack.");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(7);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    cr_assert(lfd >= 0, "socket() failed.");
+    cr_assert_eq(chisocket_bind(lfd, (struct sockaddr *) &addr, sizeof(addr)), 0, "bind() failed.");
+    cr_assert_eq(chisocket_listen(lfd, 5), 0, "listen() failed.");
+
+    cfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    cr_assert(cfd >= 0, "socket() failed.");
+    cr_assert_eq(chisocket_connect(cfd, (struct sockaddr *) &addr, sizeof(addr)), 0, "connect() failed.");
+    afd = chisocket_accept(lfd, NULL, NULL);
+    cr_assert(afd >= 0, "accept() failed.");
+
+    /* The data goes straight from and to the application's buffers */
+    cr_assert_eq(chisocket_send(cfd, "hello, world", 12, 0), 12, "send() failed.");
+    cr_assert_eq(chisocket_recv(afd, buf, 5, MSG_PEEK | MSG_WAITALL), 5, "recv(MSG_PEEK) failed.");
+    cr_assert_arr_eq(buf, "hello", 5);
+    cr_assert_eq(chisocket_recv(afd, buf, 12, MSG_WAITALL), 12, "recv() failed.");
+    cr_assert_arr_eq(buf, "hello, world", 12);
+
+    cr_assert_eq(chisocket_close(cfd), 0, "close() failed.");
+    cr_assert_eq(chisocket_recv(afd, buf, sizeof(buf), 0), 0, "Did not get EOF.");
+    cr_assert_eq(chisocket_close(afd), 0, "close() failed.");
+    cr_assert_eq(chisocket_close(lfd), 0, "close() failed.");
+
+    rc = chitcp_embedded_stop();
+    cr_assert(rc == 0, "Could not stop embedded chiTCP stack.");
+    cr_assert_eq(chitcp_embedded_stop(), CHITCP_EINVAL, "Stopped a stack that was not running.");
+}
+
+Test(daemon, fastopen)
+{
+    int rc, lfd, cfd, afd, on = 1;
+    struct sockaddr_in addr;
+    char buf[16];
+
+    rc = chitcp_embedded_start(NULL);
+    cr_assert(rc == 0, "Could not start embedded chiTCP stack.");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(7);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    cr_assert(lfd >= 0, "socket() failed.");
+    cr_assert_eq(chisocket_setsockopt(lfd, IPPROTO_TCP, TCP_FASTOPEN, &on, sizeof(on)), 0, "setsockopt() failed.");
+    cr_assert_eq(chisocket_bind(lfd, (struct sockaddr *) &addr, sizeof(addr)), 0, "bind() failed.");
+    cr_assert_eq(chisocket_listen(lfd, 5), 0, "listen() failed.");
+
+    /* The first connection gets a cookie, and the second one uses it to
+     * send its data in the SYN, so the data is there as soon as the
+     * connection can be accepted */
+    for (int i = 0; i < 2; i++)
+    {
+        cfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        cr_assert(cfd >= 0, "socket() failed.");
+        cr_assert_eq(chisocket_sendto(cfd, "ping", 4, MSG_FASTOPEN, (struct sockaddr *) &addr, sizeof(addr)), 4,
+                     "sendto() failed.");
+        afd = chisocket_accept(lfd, NULL, NULL);
+        cr_assert(afd >= 0, "accept() failed.");
+
+        if (i == 1)
+            cr_assert_eq(chisocket_recv(afd, buf, 4, MSG_DONTWAIT), 4, "Data was not sent in the SYN.");
+        else
+            cr_assert_eq(chisocket_recv(afd, buf, 4, MSG_WAITALL), 4, "recv() failed.");
+        cr_assert_arr_eq(buf, "ping", 4);
+
+        /* The reply doesn't have to wait for the handshake either */
+        cr_assert_eq(chisocket_send(afd, "pong", 4, 0), 4, "send() failed.");
+        cr_assert_eq(chisocket_recv(cfd, buf, 4, MSG_WAITALL), 4, "recv() failed.");
+        cr_assert_arr_eq(buf, "pong", 4);
+
+        cr_assert_eq(chisocket_close(afd), 0, "close() failed.");
+        cr_assert_eq(chisocket_recv(cfd, buf, sizeof(buf), 0), 0, "Did not get EOF.");
+        cr_assert_eq(chisocket_close(cfd), 0, "close() failed.");
+    }
+
+    cr_assert_eq(chisocket_close(lfd), 0, "close() failed.");
+
+    rc = chitcp_embedded_stop();
+    cr_assert(rc == 0, "Could not stop embedded chiTCP stack.");
+}
@@ -0,0 +1,49 @@
+#include "membudget.h"
+#include "chitcp/types.h"
+#include <criterion/criterion.h>
+
+Test(membudget, unlimited)
+{
+    mem_budget_t budget;
+
+    mem_budget_init(&budget, 0);
+    cr_assert(mem_budget_charge(&budget, 1 << 30, TRUE));
+    cr_assert_not(mem_budget_pressure(&budget));
+    mem_budget_uncharge(&budget, 1 << 30);
+    cr_assert_eq(budget.used, 0);
+}
+
+Test(membudget, data_share)
+{
+    mem_budget_t budget;
+
+    mem_budget_init(&budget, 8000);
+
+    /* Data can only use 7000 bytes... */
+    cr_assert(mem_budget_charge(&budget, 6000, TRUE));
+    cr_assert(mem_budget_pressure(&budget));
+    cr_assert_not(mem_budget_charge(&budget, 1001, TRUE));
+    cr_assert(mem_budget_charge(&budget, 1000, TRUE));
+
+    /* ...and the rest is kept for segments without a payload */
+    cr_assert(mem_budget_charge(&budget, 1000, FALSE));
+    cr_assert_not(mem_budget_charge(&budget, 1, FALSE));
+    cr_assert_eq(budget.used, 8000);
+    cr_assert_eq(budget.drops, 2);
+
+    mem_budget_uncharge(&budget, 5000);
+    cr_assert_not(mem_budget_pressure(&budget));
+    cr_assert(mem_budget_charge(&budget, 1, TRUE));
+}
+
+Test(membudget, force)
+{
+    mem_budget_t budget;
+
+    mem_budget_init(&budget, 1000);
+    mem_budget_force(&budget, 2000);
+    cr_assert_eq(budget.used, 2000);
+    cr_assert_not(mem_budget_charge(&budget, 1, FALSE));
+    mem_budget_uncharge(&budget, 1500);
+    cr_assert(mem_budget_charge(&budget, 1, FALSE));
+}
@@ -0,0 +1,135 @@
+#include "netem.h"
+#include "chitcp/types.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+
+static double elapsed(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+Test(netem, parse)
+{
+    netem_profile_t profile;
+
+    cr_assert_eq(netem_parse_profile("10.0.0.1 delay=50ms jitter=1000us dist=normal rate=8mbit burst=3000 loss=1% reorder=0.25 ge=1%/10%/50% seed=42", &profile), CHITCP_OK);
+    cr_assert_not(profile.any_peer);
+    cr_assert_eq(profile.peer.ss_family, AF_INET);
+    cr_assert_float_eq(profile.delay, 0.05, 1e-9);
+    cr_assert_float_eq(profile.jitter, 0.001, 1e-9);
+    cr_assert_eq(profile.dist, NETEM_DIST_NORMAL);
+    cr_assert_float_eq(profile.rate, 1e6, 1e-6);
+    cr_assert_float_eq(profile.burst, 3000, 1e-9);
+    cr_assert_float_eq(profile.loss, 0.01, 1e-9);
+    cr_assert_float_eq(profile.reorder, 0.25, 1e-9);
+    cr_assert_float_eq(profile.ge_p, 0.01, 1e-9);
+    cr_assert_float_eq(profile.ge_r, 0.1, 1e-9);
+    cr_assert_float_eq(profile.ge_loss_bad, 0.5, 1e-9);
+    cr_assert_float_eq(profile.ge_loss_good, 0.0, 1e-9);
+    cr_assert_eq(profile.rng, 42);
+
+    cr_assert_eq(netem_parse_profile("default delay=1s # comment", &profile), CHITCP_OK);
+    cr_assert(profile.any_peer);
+    cr_assert_float_eq(profile.delay, 1.0, 1e-9);
+
+    cr_assert_eq(netem_parse_profile("   # just a comment", &profile), CHITCP_ENOENT);
+    cr_assert_eq(netem_parse_profile("nowhere delay=1", &profile), CHITCP_EINVAL);
+    cr_assert_eq(netem_parse_profile("::1 delay=1h", &profile), CHITCP_EINVAL);
+    cr_assert_eq(netem_parse_profile("::1 loss=150%", &profile), CHITCP_EINVAL);
+    cr_assert_eq(netem_parse_profile("::1 ge=1%", &profile), CHITCP_EINVAL);
+    cr_assert_eq(netem_parse_profile("::1 colour=blue", &profile), CHITCP_EINVAL);
+}
+
+Test(netem, lookup)
+{
+    netem_profile_t peer, any, *profiles = NULL;
+    struct sockaddr_in addr;
+
+    cr_assert_eq(netem_parse_profile("default delay=1", &any), CHITCP_OK);
+    cr_assert_eq(netem_parse_profile("10.0.0.1 delay=2", &peer), CHITCP_OK);
+    profiles = &any;
+    any.prev = &peer;
+    any.next = &peer;
+    peer.prev = &peer;
+    peer.next = NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(7);
+    inet_pton(AF_INET, "10.0.0.1", &addr.sin_addr);
+    cr_assert_eq(netem_lookup_profile(profiles, (struct sockaddr *) &addr), &peer);
+
+    inet_pton(AF_INET, "10.0.0.2", &addr.sin_addr);
+    cr_assert_eq(netem_lookup_profile(profiles, (struct sockaddr *) &addr), &any);
+
+    cr_assert_null(netem_lookup_profile(&peer, (struct sockaddr *) &addr));
+}
+
+Test(netem, delay)
+{
+    netem_profile_t profile;
+    struct timespec now = {100, 0}, when;
+
+    cr_assert_eq(netem_parse_profile("default delay=20ms jitter=5ms seed=1", &profile), CHITCP_OK);
+
+    for(int i = 0; i < 1000; i++)
+    {
+        cr_assert(netem_schedule(&profile, 100, &now, &when));
+        cr_assert_geq(elapsed(&now, &when), 0.015 - 1e-9);
+        cr_assert_leq(elapsed(&now, &when), 0.025 + 1e-9);
+    }
+}
+
+Test(netem, rate)
+{
+    netem_profile_t profile;
+    struct timespec now = {100, 0}, when;
+
+    /* 1000 bytes/s, with room for a single 1500-byte packet */
+    cr_assert_eq(netem_parse_profile("default rate=8kbit burst=1500", &profile), CHITCP_OK);
+
+    /* The first packet fits in the bucket, and the next ones have to
+     * wait for the previous ones to drain */
+    cr_assert(netem_schedule(&profile, 1500, &now, &when));
+    cr_assert_float_eq(elapsed(&now, &when), 0.0, 1e-6);
+    cr_assert(netem_schedule(&profile, 500, &now, &when));
+    cr_assert_float_eq(elapsed(&now, &when), 0.5, 1e-6);
+    cr_assert(netem_schedule(&profile, 500, &now, &when));
+    cr_assert_float_eq(elapsed(&now, &when), 1.0, 1e-6);
+
+    /* Once the bucket has refilled, there is no wait */
+    now.tv_sec += 10;
+    cr_assert(netem_schedule(&profile, 1000, &now, &when));
+    cr_assert_float_eq(elapsed(&now, &when), 0.0, 1e-6);
+}
+
+Test(netem, loss)
+{
+    netem_profile_t profile;
+    struct timespec now = {100, 0}, when;
+    int lost = 0;
+
+    cr_assert_eq(netem_parse_profile("default loss=10% seed=7", &profile), CHITCP_OK);
+    for(int i = 0; i < 10000; i++)
+        if(!netem_schedule(&profile, 100, &now, &when))
+            lost++;
+    cr_assert(lost > 800 && lost < 1200, "Lost %i packets", lost);
+
+    /* Once in the Bad state, every packet is lost until it goes back
+     * to the Good state (which never happens here) */
+    cr_assert_eq(netem_parse_profile("default ge=100%/0%", &profile), CHITCP_OK);
+    for(int i = 0; i < 100; i++)
+        cr_assert_not(netem_schedule(&profile, 100, &now, &when));
+}
+
+Test(netem, reorder)
+{
+    netem_profile_t profile;
+    struct timespec now = {100, 0}, when;
+
+    /* Reordered packets skip the delay */
+    cr_assert_eq(netem_parse_profile("default delay=100ms reorder=100%", &profile), CHITCP_OK);
+    cr_assert(netem_schedule(&profile, 100, &now, &when));
+    cr_assert_float_eq(elapsed(&now, &when), 0.0, 1e-9);
+}
@@ -0,0 +1,282 @@
+#include "chitcp/packet.h"
+#include "chitcp/types.h"
+#include <string.h>
+#include <pthread.h>
+#include <criterion/criterion.h>
+
+uint8_t payload[CHITCP_PACKET_SLAB_SIZE * 2];
+
+Test(packet, create_free)
+{
+    tcp_packet_t packet;
+    int len;
+
+    for(int i = 0; i < (int) sizeof(payload); i++)
+        payload[i] = i % 251;
+
+    len = chitcp_tcp_packet_create(&packet, payload, 100);
+    cr_assert_eq(len, TCP_HEADER_NOOPTIONS_SIZE + 100);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 5);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->seq, 0);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), 100);
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), payload, 100) == 0);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, create_large)
+{
+    tcp_packet_t packet;
+
+    /* Larger than a slab, so it doesn't come from the pool */
+    chitcp_tcp_packet_create(&packet, payload, sizeof(payload));
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(payload));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), payload, sizeof(payload)) == 0);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, share)
+{
+    tcp_packet_t packet, copy;
+
+    chitcp_tcp_packet_create(&packet, payload, 10);
+    chitcp_tcp_packet_share(&copy, &packet);
+    cr_assert_eq(copy.raw, packet.raw);
+    cr_assert_eq(copy.length, packet.length);
+
+    /* The contents must survive until the last packet is freed */
+    chitcp_tcp_packet_free(&packet);
+    cr_assert(memcmp(TCP_PAYLOAD_START(&copy), payload, 10) == 0);
+
+    chitcp_tcp_packet_free(&copy);
+}
+
+void* pool_thread_func(void *args)
+{
+    tcp_packet_t packets[CHITCP_PACKET_CACHE_SIZE * 2];
+
+    for(int round = 0; round < 100; round++)
+    {
+        for(int i = 0; i < CHITCP_PACKET_CACHE_SIZE * 2; i++)
+            chitcp_tcp_packet_create(&packets[i], payload, i);
+        for(int i = 0; i < CHITCP_PACKET_CACHE_SIZE * 2; i++)
+        {
+            if(memcmp(TCP_PAYLOAD_START(&packets[i]), payload, i) != 0)
+                return (void *) 1;
+            chitcp_tcp_packet_free(&packets[i]);
+        }
+    }
+
+    return NULL;
+}
+
+Test(packet, wscale)
+{
+    tcp_packet_t packet;
+    uint8_t data[10] = "abcdefghij";
+
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_get_wscale(&packet), CHITCP_ENOENT);
+
+    cr_assert_eq(chitcp_tcp_packet_add_wscale(&packet, 7), CHITCP_OK);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 6);
+    cr_assert_eq(packet.length, TCP_HEADER_NOOPTIONS_SIZE + 4 + sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_get_wscale(&packet), 7);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(data));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), data, sizeof(data)) == 0);
+
+    cr_assert_eq(chitcp_tcp_packet_add_wscale(&packet, TCP_WSCALE_MAX + 1), CHITCP_EINVAL);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, timestamp)
+{
+    tcp_packet_t packet;
+    uint8_t data[10] = "abcdefghij";
+    uint32_t tsval, tsecr;
+
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_get_timestamp(&packet, &tsval, &tsecr), CHITCP_ENOENT);
+
+    cr_assert_eq(chitcp_tcp_packet_add_wscale(&packet, 7), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_timestamp(&packet, 0x01020304, 0xfffffffe), CHITCP_OK);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 9);
+    cr_assert_eq(packet.length, TCP_HEADER_NOOPTIONS_SIZE + 16 + sizeof(data));
+
+    cr_assert_eq(chitcp_tcp_packet_get_timestamp(&packet, &tsval, &tsecr), CHITCP_OK);
+    cr_assert_eq(tsval, 0x01020304);
+    cr_assert_eq(tsecr, 0xfffffffe);
+    cr_assert_eq(chitcp_tcp_packet_get_wscale(&packet), 7);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(data));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), data, sizeof(data)) == 0);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, sack)
+{
+    tcp_packet_t packet;
+    uint8_t data[10] = "abcdefghij";
+    tcp_sack_block_t blocks[TCP_SACK_MAX_BLOCKS] = {{100, 200}, {300, 400}, {0xfffffff0, 0x10}, {500, 600}};
+    tcp_sack_block_t rcvd[TCP_SACK_MAX_BLOCKS];
+
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_get_sack_permitted(&packet), CHITCP_ENOENT);
+    cr_assert_eq(chitcp_tcp_packet_get_sack(&packet, rcvd), 0);
+
+    cr_assert_eq(chitcp_tcp_packet_add_sack_permitted(&packet), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_get_sack_permitted(&packet), CHITCP_OK);
+
+    /* With the other two options, only two blocks fit in the header */
+    cr_assert_eq(chitcp_tcp_packet_add_timestamp(&packet, 1, 2), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_sack(&packet, blocks, TCP_SACK_MAX_BLOCKS), 2);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 14);
+
+    cr_assert_eq(chitcp_tcp_packet_get_sack(&packet, rcvd), 2);
+    cr_assert_eq(rcvd[0].left, 100);
+    cr_assert_eq(rcvd[0].right, 200);
+    cr_assert_eq(rcvd[1].left, 300);
+    cr_assert_eq(rcvd[1].right, 400);
+    cr_assert_eq(chitcp_tcp_packet_add_sack(&packet, blocks, 1), CHITCP_EINVAL);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(data));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), data, sizeof(data)) == 0);
+
+    chitcp_tcp_packet_free(&packet);
+
+    /* With just timestamps, three blocks fit */
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_add_timestamp(&packet, 1, 2), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_sack(&packet, blocks, TCP_SACK_MAX_BLOCKS), 3);
+    cr_assert_eq(chitcp_tcp_packet_get_sack(&packet, rcvd), 3);
+    cr_assert_eq(rcvd[2].left, 0xfffffff0);
+    cr_assert_eq(rcvd[2].right, 0x10);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, fastopen)
+{
+    tcp_packet_t packet;
+    uint8_t data[10] = "abcdefghij";
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t rcvd[TCP_FASTOPEN_COOKIE_LEN];
+
+    /* A cookie request */
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_get_fastopen(&packet, rcvd), CHITCP_ENOENT);
+    cr_assert_eq(chitcp_tcp_packet_add_fastopen(&packet, NULL, 0), CHITCP_OK);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 6);
+    cr_assert_eq(chitcp_tcp_packet_get_fastopen(&packet, rcvd), 0);
+    chitcp_tcp_packet_free(&packet);
+
+    /* A cookie, alongside the options a SYN carries */
+    chitcp_tcp_packet_create(&packet, data, sizeof(data));
+    cr_assert_eq(chitcp_tcp_packet_add_wscale(&packet, 7), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_timestamp(&packet, 1, 0), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_sack_permitted(&packet), CHITCP_OK);
+    cr_assert_eq(chitcp_tcp_packet_add_fastopen(&packet, cookie, sizeof(cookie)), CHITCP_OK);
+    cr_assert_eq(TCP_PACKET_HEADER(&packet)->doff, 13);
+    cr_assert_eq(chitcp_tcp_packet_get_fastopen(&packet, rcvd), TCP_FASTOPEN_COOKIE_LEN);
+    cr_assert(memcmp(rcvd, cookie, sizeof(cookie)) == 0);
+    cr_assert_eq(chitcp_tcp_packet_get_wscale(&packet), 7);
+    cr_assert_eq(TCP_PAYLOAD_LEN(&packet), sizeof(data));
+    cr_assert(memcmp(TCP_PAYLOAD_START(&packet), data, sizeof(data)) == 0);
+
+    cr_assert_eq(chitcp_tcp_packet_add_fastopen(&packet, cookie, 4), CHITCP_EINVAL);
+
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(packet, pool_threads)
+{
+    pthread_t threads[4];
+    void *rc;
+
+    for(int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, pool_thread_func, NULL);
+
+    for(int i = 0; i < 4; i++)
+    {
+        pthread_join(threads[i], &rc);
+        cr_assert_null(rc, "Packet contents were corrupted");
+    }
+}
+
+Test(packet, queue)
+{
+    tcp_packet_queue_t q;
+    tcp_packet_t packets[4], *taken;
+
+    chitcp_packet_queue_init(&q);
+    cr_assert(chitcp_packet_queue_empty(&q));
+    cr_assert_null(chitcp_packet_queue_take(&q));
+
+    cr_assert(chitcp_packet_queue_push(&q, &packets[0]));
+    for(int i = 1; i < 3; i++)
+        cr_assert_not(chitcp_packet_queue_push(&q, &packets[i]));
+    cr_assert_eq(chitcp_packet_queue_size(&q), 3);
+
+    /* Packets are taken in the order they were pushed */
+    taken = chitcp_packet_queue_take(&q);
+    cr_assert(chitcp_packet_queue_empty(&q));
+    for(int i = 0; i < 3; i++, taken = taken->next)
+        cr_assert_eq(taken, &packets[i]);
+    cr_assert_null(taken);
+
+    cr_assert(chitcp_packet_queue_push(&q, &packets[3]));
+    cr_assert_eq(chitcp_packet_queue_take(&q), &packets[3]);
+    cr_assert_null(packets[3].next);
+}
+
+#define QUEUE_PRODUCERS (4)
+#define QUEUE_PACKETS (10000)
+
+static tcp_packet_queue_t queue;
+static tcp_packet_t queue_packets[QUEUE_PRODUCERS][QUEUE_PACKETS];
+
+void* queue_thread_func(void *args)
+{
+    tcp_packet_t *packets = args;
+
+    /* The length is the packet's position in its producer's sequence */
+    for(int i = 0; i < QUEUE_PACKETS; i++)
+    {
+        packets[i].length = i;
+        chitcp_packet_queue_push(&queue, &packets[i]);
+    }
+
+    return NULL;
+}
+
+Test(packet, queue_threads)
+{
+    pthread_t threads[QUEUE_PRODUCERS];
+    size_t next[QUEUE_PRODUCERS] = {0};
+    tcp_packet_t *packet;
+    int producer, taken = 0;
+
+    chitcp_packet_queue_init(&queue);
+
+    for(int i = 0; i < QUEUE_PRODUCERS; i++)
+        pthread_create(&threads[i], NULL, queue_thread_func, queue_packets[i]);
+
+    /* Every packet is taken exactly once, and each producer's packets
+     * are taken in the order they were pushed */
+    while(taken < QUEUE_PRODUCERS * QUEUE_PACKETS)
+    {
+        for(packet = chitcp_packet_queue_take(&queue); packet != NULL; packet = packet->next)
+        {
+            producer = (packet - &queue_packets[0][0]) / QUEUE_PACKETS;
+            cr_assert_eq(packet->length, next[producer]);
+            next[producer]++;
+            taken++;
+        }
+    }
+
+    for(int i = 0; i < QUEUE_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+
+    cr_assert(chitcp_packet_queue_empty(&queue));
+}
@@ -0,0 +1,183 @@
+#include "pcap.h"
+#include "chitcp/types.h"
+#include "chitcp/utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <criterion/criterion.h>
+
+static uint8_t *read_file(const char *filename, size_t *len)
+{
+    FILE *f = fopen(filename, "rb");
+    uint8_t *data;
+
+    cr_assert_not_null(f, "Could not open %s", filename);
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*len);
+    cr_assert_eq(fread(data, 1, *len, f), *len);
+    fclose(f);
+
+    return data;
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+    uint32_t v;
+    memcpy(&v, data, 4);
+    return v;
+}
+
+static void make_addrs(struct sockaddr_in *src, struct sockaddr_in *dst)
+{
+    memset(src, 0, sizeof(*src));
+    memset(dst, 0, sizeof(*dst));
+    src->sin_family = dst->sin_family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &src->sin_addr);
+    inet_pton(AF_INET, "10.0.0.2", &dst->sin_addr);
+}
+
+Test(pcap, pcap_ipv4)
+{
+    char filename[] = "/tmp/test-pcap-XXXXXX";
+    pcap_writer_t *writer;
+    struct sockaddr_in src, dst;
+    tcp_packet_t packet;
+    uint8_t payload[100], *data;
+    size_t len;
+
+    close(mkstemp(filename));
+    make_addrs(&src, &dst);
+    memset(payload, 0xab, sizeof(payload));
+    chitcp_tcp_packet_create(&packet, payload, sizeof(payload));
+
+    cr_assert_eq(pcap_writer_open(filename, NULL, &writer), CHITCP_OK);
+    for(int i = 0; i < 10; i++)
+        cr_assert_eq(pcap_capture(writer, 1, PCAP_OUTBOUND, (struct sockaddr *) &src, (struct sockaddr *) &dst, &packet), CHITCP_OK);
+    pcap_writer_close(writer);
+
+    /* File header, and 10 records with an IPv4 header */
+    data = read_file(filename, &len);
+    cr_assert_eq(len, 24 + 10 * (16 + 20 + packet.length));
+    cr_assert_eq(get32(data), 0xa1b23c4d);
+    cr_assert_eq(get32(data + 20), 101);
+    cr_assert_eq(get32(data + 24 + 8), 20 + packet.length);
+    cr_assert_eq(data[24 + 16], 0x45);
+    cr_assert_eq(memcmp(data + 24 + 16 + 12, &src.sin_addr, 4), 0);
+    cr_assert_eq(memcmp(data + 24 + 16 + 16, &dst.sin_addr, 4), 0);
+    cr_assert_eq(data[len - 1], 0xab);
+
+    /* The IP header checks out, and so does the TCP segment (with its pseudo-header) */
+    uint8_t *ip = data + 24 + 16, pseudo[12] = {0};
+    uint32_t sum;
+    cr_assert_eq(cksum_finish(cksum_partial(ip, 20, 0)), 0);
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[9] = IPPROTO_TCP;
+    pseudo[11] = packet.length;
+    sum = cksum_partial(pseudo, sizeof(pseudo), 0);
+    sum = cksum_partial(ip + 20, packet.length, sum);
+    cr_assert_eq(cksum_finish(sum), 0);
+
+    free(data);
+    unlink(filename);
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(pcap, pcapng_ipv6_snaplen)
+{
+    char filename[] = "/tmp/test-pcap-XXXXXX";
+    pcap_writer_t *writer;
+    pcap_options_t options = {PCAP_FORMAT_PCAPNG, 50, 0, 0};
+    struct sockaddr_in6 src, dst;
+    tcp_packet_t packet;
+    uint8_t payload[100], *data, *block;
+    size_t len;
+    int idbs = 0, epbs = 0;
+
+    close(mkstemp(filename));
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.sin6_family = dst.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "::1", &src.sin6_addr);
+    inet_pton(AF_INET6, "::2", &dst.sin6_addr);
+    memset(payload, 0, sizeof(payload));
+    chitcp_tcp_packet_create(&packet, payload, sizeof(payload));
+
+    cr_assert_eq(pcap_writer_open(filename, &options, &writer), CHITCP_OK);
+    cr_assert_eq(pcap_capture(writer, 1, PCAP_OUTBOUND, (struct sockaddr *) &src, (struct sockaddr *) &dst, &packet), CHITCP_OK);
+    cr_assert_eq(pcap_capture(writer, 2, PCAP_INBOUND, (struct sockaddr *) &src, (struct sockaddr *) &dst, &packet), CHITCP_OK);
+    cr_assert_eq(pcap_capture(writer, 1, PCAP_OUTBOUND, (struct sockaddr *) &src, (struct sockaddr *) &dst, &packet), CHITCP_OK);
+    pcap_writer_close(writer);
+
+    /* A section header, an interface per socket, and the
+     * packets truncated to the snaplen */
+    data = read_file(filename, &len);
+    cr_assert_eq(get32(data), 0x0A0D0D0A);
+    for(block = data; block < data + len; block += get32(block + 4))
+    {
+        cr_assert_eq(get32(block + get32(block + 4) - 4), get32(block + 4));
+        if(get32(block) == 1)
+            idbs++;
+        else if(get32(block) == 6)
+        {
+            cr_assert_eq(get32(block + 8), epbs == 1 ? 1 : 0);
+            cr_assert_eq(get32(block + 20), 50);
+            cr_assert_eq(get32(block + 24), 40 + packet.length);
+            cr_assert_eq(block[28] >> 4, 6);
+            epbs++;
+        }
+    }
+    cr_assert_eq(block, data + len);
+    cr_assert_eq(idbs, 2);
+    cr_assert_eq(epbs, 3);
+
+    free(data);
+    unlink(filename);
+    chitcp_tcp_packet_free(&packet);
+}
+
+Test(pcap, rotate)
+{
+    char filename[] = "/tmp/test-pcap-XXXXXX", rotated[64];
+    pcap_writer_t *writer;
+    pcap_options_t options = {PCAP_FORMAT_PCAP, 0, 1000, 0};
+    struct sockaddr_in src, dst;
+    tcp_packet_t packet;
+    uint8_t payload[200], *data;
+    size_t len, total = 0;
+    int files = 0;
+
+    close(mkstemp(filename));
+    make_addrs(&src, &dst);
+    memset(payload, 0, sizeof(payload));
+    chitcp_tcp_packet_create(&packet, payload, sizeof(payload));
+
+    cr_assert_eq(pcap_writer_open(filename, &options, &writer), CHITCP_OK);
+    for(int i = 0; i < 20; i++)
+        cr_assert_eq(pcap_capture(writer, 1, PCAP_INBOUND, (struct sockaddr *) &src, (struct sockaddr *) &dst, &packet), CHITCP_OK);
+    pcap_writer_close(writer);
+
+    /* Every file has its own header, and no file is over the limit */
+    for(;; files++)
+    {
+        if(files == 0)
+            strcpy(rotated, filename);
+        else
+            sprintf(rotated, "%s.%d", filename, files);
+        if(access(rotated, F_OK) != 0)
+            break;
+
+        data = read_file(rotated, &len);
+        cr_assert_eq(get32(data), 0xa1b23c4d);
+        cr_assert_leq(len, 1000);
+        total += len - 24;
+        free(data);
+        unlink(rotated);
+    }
+
+    cr_assert_gt(files, 1);
+    cr_assert_eq(total, 20 * (16 + 20 + packet.length));
+    chitcp_tcp_packet_free(&packet);
+}
@@ -7,11 +7,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <criterion/criterion.h>
 #include "serverinfo.h"
 #include "server.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
 #include "chitcp/tester.h"
 #include "fixtures.h"
 
@@ -152,3 +154,63 @@ Test(conn_init, 3way_vars, .init = chitcpd_and_tester_setup, .fini = chitcpd_and
 }
 
 
+Test(conn_init, subscribe, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 1.0)
+{
+    chitcpd_subscription_t *sub;
+    chitcpd_subscription_fd_t fds[2];
+    chitcpd_notification_t notes[2];
+    struct sockaddr_in addr;
+    bool_t listening = FALSE, invalid = FALSE;
+    int sockfd, n;
+
+    sockfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    cr_assert(sockfd >= 0, "Could not create socket");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CHITCP_TESTER_DEFAULT_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    cr_assert(chisocket_bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == 0, "Could not bind socket");
+    cr_assert(chisocket_listen(sockfd, 5) == 0, "Could not listen on socket");
+
+    fds[0].sockfd = sockfd;
+    fds[0].events = CHITCPD_NOTIFY_STATE | CHITCPD_NOTIFY_READABLE;
+    fds[1].sockfd = sockfd + 100;
+    fds[1].events = CHITCPD_NOTIFY_STATE;
+    sub = chitcpd_subscribe(fds, 2);
+    cr_assert_not_null(sub, "Could not subscribe");
+
+    /* The first notifications are a snapshot of both sockets */
+    while (!listening || !invalid)
+    {
+        n = chitcpd_get_notifications(sub, notes, 2, 500);
+        cr_assert(n > 0, "Did not get the first notifications");
+
+        for (int i = 0; i < n; i++)
+        {
+            if (notes[i].sockfd == sockfd)
+            {
+                cr_assert_eq(notes[i].events, CHITCPD_NOTIFY_STATE);
+                cr_assert_eq(notes[i].tcp_state, LISTEN);
+                listening = TRUE;
+            }
+            else
+            {
+                cr_assert_eq(notes[i].sockfd, sockfd + 100);
+                cr_assert_eq(notes[i].events, CHITCPD_NOTIFY_FREED);
+                invalid = TRUE;
+            }
+        }
+    }
+
+    /* Nothing else happens until the socket is closed */
+    cr_assert_eq(chitcpd_get_notifications(sub, notes, 2, 0), 0);
+
+    cr_assert(chisocket_close(sockfd) == 0, "Could not close socket");
+    n = chitcpd_get_notifications(sub, notes, 2, 500);
+    cr_assert_eq(n, 1);
+    cr_assert_eq(notes[0].sockfd, sockfd);
+    cr_assert_eq(notes[0].events, CHITCPD_NOTIFY_FREED);
+
+    cr_assert_eq(chitcpd_unsubscribe(sub), 0);
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <criterion/criterion.h>
 #include <criterion/parameterized.h>
 #include "serverinfo.h"
@@ -8,6 +10,7 @@
 #include "chitcp/debug_api.h"
 #include "chitcp/utils.h"
 #include "chitcp/tester.h"
+#include "chitcp/socket.h"
 #include "fixtures.h"
 
 
@@ -177,6 +180,105 @@ Test(data_transfer, half_duplex_client_sends_32768bytes, .init = chitcpd_and_tes
 }
 
 
+int receiver_stats(int sockfd, void *args)
+{
+    int size = *((int *) args);
+    chitcp_socket_stats_t socket_stats;
+    chitcp_daemon_stats_t daemon_stats;
+    char *text = NULL;
+    size_t text_len;
+    FILE *out;
+
+    receiver(sockfd, args);
+
+    cr_assert_eq(chitcpd_get_stats(sockfd, &socket_stats, &daemon_stats), 0,
+                 "Could not get the socket's counters");
+    cr_assert_geq(socket_stats.bytes_in, size,
+                  "Socket received %llu bytes (expected at least %i)", (unsigned long long) socket_stats.bytes_in, size);
+    cr_assert_geq(socket_stats.segs_in, (size + TCP_MSS - 1) / TCP_MSS);
+    cr_assert_gt(socket_stats.segs_out, 0);
+    cr_assert_gt(daemon_stats.num_connections, 0);
+    cr_assert_gt(daemon_stats.num_rpcs, 0);
+
+    out = open_memstream(&text, &text_len);
+    cr_assert_eq(chitcpd_write_stats_prometheus(out, sockfd, &socket_stats, &daemon_stats), 0);
+    fclose(out);
+    cr_assert_not_null(strstr(text, "# TYPE chitcp_socket_bytes_in_total counter"));
+    cr_assert_not_null(strstr(text, "chitcp_rpc_latency_seconds_bucket{code=\"RECV\",le=\"+Inf\"}"));
+
+    free(text);
+    chitcpd_free_stats(&daemon_stats);
+
+    return 0;
+}
+
+Test(data_transfer, stats, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5.0)
+{
+    int nbytes = 4096;
+
+    chitcp_tester_client_run_set(tester, sender, &nbytes);
+    chitcp_tester_server_run_set(tester, receiver_stats, &nbytes);
+
+    si->latency = 0.05;
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+}
+
+
+int paced_sender(int sockfd, void *args)
+{
+    int rate = 64 * 1024;
+
+    cr_assert_eq(chisocket_setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(int)), 0,
+                 "Could not set the pacing rate");
+
+    return sender(sockfd, args);
+}
+
+
+int paced_receiver(int sockfd, void *args)
+{
+    int size = *((int *) args);
+    struct timespec start, end;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    receiver(sockfd, args);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* All the data but the first burst leaves at 64 KiB/s */
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    cr_assert_geq(elapsed, (size - TCP_PACING_BURST_MIN) / (64.0 * 1024) * 0.9,
+                  "Data arrived too soon for its pacing rate (%.3f seconds)", elapsed);
+
+    return 0;
+}
+
+Test(data_transfer, paced_32768bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5.0)
+{
+    int nbytes = 32768;
+
+    chitcp_tester_client_run_set(tester, paced_sender, &nbytes);
+    chitcp_tester_server_run_set(tester, paced_receiver, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+}
+
+
 void half_duplex_server_sends(int nbytes)
 {
     chitcp_tester_client_run_set(tester, receiver, &nbytes);
@@ -307,3 +409,45 @@ Test(data_transfer, echo_32768bytes, .init = chitcpd_and_tester_setup, .fini = c
 {
     echo(32768);
 }
+
+Test(data_transfer, coalesced_echo_32768bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5.0)
+{
+    si->tcp_coalesce = TRUE;
+    echo(32768);
+}
+
+Test(data_transfer, multi_peer_echo_4096bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 10.0)
+{
+    chitcp_multi_tester_t mt;
+    chitcp_tester_summary_t summary;
+    int nbytes = 4096, rc;
+
+    si->latency = 0.05;
+
+    rc = chitcp_multi_tester_init(&mt, 16, 2);
+    cr_assert(rc == 0, "Could not initialize multi-peer tester.");
+    mt.concurrency = 8;
+    mt.ramp_up = 0.5;
+    chitcp_multi_tester_client_run_set(&mt, -1, client_echo, &nbytes);
+    chitcp_multi_tester_server_run_set(&mt, server_echo, &nbytes);
+
+    rc = chitcp_multi_tester_run(&mt);
+    cr_assert(rc == 0, "Multi-peer tester did not run.");
+
+    chitcp_multi_tester_summary(&mt, &summary);
+    cr_assert_eq(summary.connected, 16);
+    cr_assert_eq(summary.failed, 0);
+    cr_assert_eq(summary.server_failed, 0);
+    cr_assert(summary.connect_max_ns >= summary.connect_avg_ns);
+
+    chitcp_multi_tester_free(&mt);
+}
+
+Test(data_transfer, memory_budget_32768bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5.0)
+{
+    /* The buffers of both sockets (16 KiB) put the budget under
+     * pressure, and leave room for only a few queued segments */
+    mem_budget_init(&si->mem, 24576);
+
+    half_duplex_client_sends(32768);
+}
@@ -724,3 +724,63 @@ Test(multitimer, set_multiple_timer_all_reverse_cancel_test_timing, .init = log_
     cr_assert_eq(rc, CHITCP_OK);
 }
 
+
+
+/* Virtual timing callback. Like timing_callback, but records the time
+ * of the chiTCP clock. */
+void virtual_timing_callback(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    struct callback_args *cargs = args;
+
+    chitcp_clock_now(&cargs->timeouts[cargs->idx]);
+}
+
+/* Sets multiple timers (of up to an hour) on virtual time, and tests
+ * that they fire at the correct (virtual) times, in much less real time */
+Test(multitimer, set_multiple_timer_virtual_time, .init = log_setup, .timeout = 5.0)
+{
+    multi_timer_t mt;
+    single_timer_t *timer;
+    struct timespec start_time, diff;
+    int rc;
+
+    struct timespec *timeouts = calloc(NUM_TIMERS, sizeof(struct timespec));
+    struct callback_args *args = calloc(NUM_TIMERS, sizeof(struct callback_args));
+
+    rc = chitcp_clock_set(CHITCP_CLOCK_VIRTUAL, 0);
+    cr_assert_eq(rc, CHITCP_OK);
+
+    for(int i=0; i<NUM_TIMERS; i++)
+    {
+        args[i].timeouts = timeouts;
+        args[i].idx = i;
+    }
+
+    chitcp_clock_now(&start_time);
+
+    rc = mt_init(&mt, NUM_TIMERS);
+    cr_assert_eq(rc, CHITCP_OK);
+
+    for(uint16_t i=0; i < NUM_TIMERS; i++)
+    {
+        rc = mt_set_timer(&mt, i, (uint64_t) 360 * SECOND * (i+1), virtual_timing_callback, &args[i]);
+        cr_assert_eq(rc, CHITCP_OK);
+    }
+
+    chitcp_clock_sleep((uint64_t) 360 * SECOND * (NUM_TIMERS+1));
+
+    for(uint16_t i=0; i < NUM_TIMERS; i++)
+    {
+        rc = mt_get_timer_by_id(&mt, i, &timer);
+        cr_assert_eq(rc, CHITCP_OK);
+        cr_assert_eq(timer->active, false);
+        cr_assert_eq(timer->num_timeouts, 1);
+
+        /* The clock jumps straight to each timer's expiry time */
+        timespec_subtract(&diff, &timeouts[i], &start_time);
+        cr_assert_eq(diff.tv_sec, 360 * (i+1), "Timer %i fired after %lis (expected %is)", i, diff.tv_sec, 360 * (i+1));
+    }
+
+    rc = mt_free(&mt);
+    cr_assert_eq(rc, CHITCP_OK);
+}
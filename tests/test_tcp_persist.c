@@ -2,6 +2,7 @@
 #include <criterion/criterion.h>
 
 #include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
 #include "chitcp/tester.h"
 #include "chitcp/utils.h"
 #include "fixtures.h"
@@ -28,6 +29,36 @@ int slow_receiver(int sockfd, void *args)
     return 0;
 }
 
+/* Reads the data a few bytes at a time, so the receive window only ever
+ * opens by a sliver: the window updates must be held back until they are
+ * worth sending (instead of one per read) */
+int small_reads_receiver(int sockfd, void *args)
+{
+    int rc;
+    int size = *((int *) args);
+    uint8_t buf[size];
+    chitcp_socket_stats_t stats;
+
+    sleep(1);
+
+    for (int nread = 0; nread < size; nread += rc)
+    {
+        rc = chisocket_recv(sockfd, buf + nread, MIN(16, size - nread), 0);
+        cr_assert(rc > 0, "Socket did not receive all the bytes (got %i)", nread);
+    }
+
+    for (int i = 0; i < size; i++)
+        if(buf[i] != (i % 256))
+            cr_assert_fail("Unexpected value encountered: buf[%i] == %i (expected %i)",
+                           i, buf[i], (i % 256));
+
+    cr_assert_eq(chitcpd_get_stats(sockfd, &stats, NULL), 0);
+    cr_assert_lt(stats.segs_out, size / 16 / 4,
+                 "Receiver sent %lu segments for %i reads", stats.segs_out, size / 16);
+
+    return 0;
+}
+
 void test_slow_receiver(int nbytes)
 {
     chitcp_tester_client_run_set(tester, sender, &nbytes);
@@ -77,4 +108,21 @@ Test(persist, slow_receiver_8192bytes, .init = chitcpd_and_tester_setup, .fini =
 Test(persist, slow_receiver_8728bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5)
 {
     test_slow_receiver(8192);
-}
\ No newline at end of file
+}
+/* Send 2 * BUFFER_SIZE (4096 * 2 = 8192), read 16 bytes at a time */
+Test(persist, small_reads_8192bytes, .init = chitcpd_and_tester_setup, .fini = chitcpd_and_tester_teardown, .timeout = 5)
+{
+    int nbytes = 8192;
+
+    chitcp_tester_client_run_set(tester, sender, &nbytes);
+    chitcp_tester_server_run_set(tester, small_reads_receiver, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+}
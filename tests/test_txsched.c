@@ -0,0 +1,107 @@
+#include "txsched.h"
+#include "chitcp/types.h"
+#include "chitcp/utlist.h"
+#include <string.h>
+#include <criterion/criterion.h>
+
+#define NUM_ENTRIES (8)
+
+/* Full segments cost exactly one quantum */
+#define FULL_LEN (TX_QUANTUM - sizeof(chitcphdr_t))
+
+static tcp_packet_t packets[3][NUM_ENTRIES];
+static connection_tx_entry_t entries[3][NUM_ENTRIES];
+
+static void queue_entries(tx_sched_t *sched, tx_flow_t *flow, int i, int n, size_t len)
+{
+    for (int j = 0; j < n; j++)
+    {
+        memset(&entries[i][j], 0, sizeof(connection_tx_entry_t));
+        packets[i][j].length = len;
+        entries[i][j].packet = &packets[i][j];
+        tx_sched_enqueue(sched, flow, &entries[i][j]);
+    }
+}
+
+/* Index of the group (in entries) that a dequeued segment is in */
+static int entry_group(connection_tx_entry_t *entry)
+{
+    return (entry - &entries[0][0]) / NUM_ENTRIES;
+}
+
+Test(txsched, strict_first)
+{
+    tx_sched_t sched;
+    tx_flow_t flow;
+    connection_tx_entry_t *batch, *elt;
+    int n = 0;
+
+    tx_sched_init(&sched);
+    tx_flow_init(&flow);
+    cr_assert(tx_sched_empty(&sched));
+
+    queue_entries(&sched, &flow, 0, 4, FULL_LEN);
+    queue_entries(&sched, NULL, 1, 2, 20);
+    cr_assert_not(tx_sched_empty(&sched));
+
+    batch = tx_sched_dequeue(&sched, 3);
+    DL_FOREACH(batch, elt)
+    {
+        cr_assert_eq(entry_group(elt), n < 2 ? 1 : 0);
+        n++;
+    }
+    cr_assert_eq(n, 3);
+
+    DL_COUNT(tx_sched_dequeue(&sched, NUM_ENTRIES), elt, n);
+    cr_assert_eq(n, 3);
+    cr_assert(tx_sched_empty(&sched));
+    cr_assert_not(flow.active);
+}
+
+Test(txsched, weights)
+{
+    tx_sched_t sched;
+    tx_flow_t flows[2];
+    int sent[2] = {0, 0};
+
+    tx_sched_init(&sched);
+    tx_flow_init(&flows[0]);
+    tx_flow_init(&flows[1]);
+    tx_flow_set_priority(&flows[1], 2);
+    cr_assert_eq(flows[1].weight, 3);
+
+    queue_entries(&sched, &flows[0], 0, NUM_ENTRIES, FULL_LEN);
+    queue_entries(&sched, &flows[1], 1, NUM_ENTRIES, FULL_LEN);
+
+    /* The class of an active flow can't change */
+    tx_flow_set_priority(&flows[0], TX_PRIO_STRICT);
+    cr_assert_not(flows[0].strict);
+
+    /* Each round, the flow with weight 3 sends three times as much */
+    for (int i = 0; i < NUM_ENTRIES; i++)
+        sent[entry_group(tx_sched_dequeue(&sched, 1))]++;
+    cr_assert_eq(sent[0], 2);
+    cr_assert_eq(sent[1], 6);
+}
+
+Test(txsched, interactive_flow)
+{
+    tx_sched_t sched;
+    tx_flow_t bulk, interactive;
+    connection_tx_entry_t *batch;
+
+    tx_sched_init(&sched);
+    tx_flow_init(&bulk);
+    tx_flow_init(&interactive);
+
+    queue_entries(&sched, &bulk, 0, NUM_ENTRIES, FULL_LEN);
+    batch = tx_sched_dequeue(&sched, 1);
+    cr_assert_eq(entry_group(batch), 0);
+
+    /* A small segment only waits for the bulk flow's current turn */
+    queue_entries(&sched, &interactive, 2, 1, 100);
+    batch = tx_sched_dequeue(&sched, 2);
+    cr_assert_eq(entry_group(batch), 2);
+    cr_assert_eq(entry_group(batch->next), 0);
+    cr_assert_not(interactive.active);
+}
@@ -0,0 +1,834 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Offline analysis of packet captures
+ *
+ *  See analyze.h
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "analyze.h"
+#include "chitcp/utils.h"
+
+#define PCAP_MAGIC_USEC (0xa1b2c3d4)
+#define PCAP_MAGIC_NSEC (0xa1b23c4d)
+#define PCAP_FILE_HDR_LEN (24)
+#define PCAP_REC_HDR_LEN (16)
+
+#define PCAPNG_SHB (0x0A0D0D0A)
+#define PCAPNG_IDB (0x00000001)
+#define PCAPNG_EPB (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+#define PCAPNG_EPB_HDR_LEN (28)
+#define PCAPNG_OPT_IF_TSRESOL (9)
+
+#define LINKTYPE_NULL (0)
+#define LINKTYPE_ETHERNET (1)
+#define LINKTYPE_RAW (101)
+#define LINKTYPE_LINUX_SLL (113)
+#define LINKTYPE_IPV4 (228)
+#define LINKTYPE_IPV6 (229)
+#define LINKTYPE_LINUX_SLL2 (276)
+
+#define ETHERTYPE_IPV4 (0x0800)
+#define ETHERTYPE_IPV6 (0x86DD)
+#define ETHERTYPE_VLAN (0x8100)
+
+#define SEQ_LT(a, b)  ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t) ((a) - (b)) > 0)
+
+#define NSEC_PER_SEC (1000000000ULL)
+
+
+static uint16_t capture_get16(capture_t *cap, const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t capture_get32(capture_t *cap, const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap32(v) : v;
+}
+
+/* Big-endian fields of the packets themselves */
+static uint16_t be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static int capture_add_interface(capture_t *cap, uint16_t linktype, uint64_t ts_units)
+{
+    capture_interface_t *interfaces = realloc(cap->interfaces, (cap->num_interfaces + 1) * sizeof(capture_interface_t));
+
+    if (interfaces == NULL)
+        return CHITCP_ENOMEM;
+
+    interfaces[cap->num_interfaces].linktype = linktype;
+    interfaces[cap->num_interfaces].ts_units = ts_units;
+    cap->interfaces = interfaces;
+    cap->num_interfaces++;
+
+    return CHITCP_OK;
+}
+
+
+/* See analyze.h */
+int capture_open(capture_t *cap, const char *filename)
+{
+    struct stat st;
+    uint32_t magic;
+    void *data;
+    int fd;
+
+    memset(cap, 0, sizeof(capture_t));
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return CHITCP_ENOENT;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return CHITCP_ENOENT;
+    }
+    if (st.st_size < PCAP_FILE_HDR_LEN)
+    {
+        close(fd);
+        return CHITCP_EINVAL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return CHITCP_ENOENT;
+
+    /* The file is read once, front to back */
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    cap->data = data;
+    cap->size = st.st_size;
+
+    memcpy(&magic, cap->data, sizeof(magic));
+    if (magic == PCAPNG_SHB)
+    {
+        /* The section header sets the byte order (see capture_next) */
+        cap->pcapng = TRUE;
+        return CHITCP_OK;
+    }
+
+    if (magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+    {
+        cap->swapped = TRUE;
+        magic = __builtin_bswap32(magic);
+    }
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC)
+    {
+        capture_close(cap);
+        return CHITCP_EINVAL;
+    }
+
+    /* The upper bits of the link type field are used for other things */
+    if (capture_add_interface(cap, capture_get32(cap, cap->data + 20) & 0xffff,
+                              magic == PCAP_MAGIC_NSEC ? NSEC_PER_SEC : 1000000) != CHITCP_OK)
+    {
+        capture_close(cap);
+        return CHITCP_ENOMEM;
+    }
+    cap->offset = PCAP_FILE_HDR_LEN;
+
+    return CHITCP_OK;
+}
+
+
+/*
+ * capture_strip_link - Skip the datalink header of a packet
+ *
+ * linktype: Datalink type
+ *
+ * pkt: Packet (data and caplen are updated to the IP packet)
+ *
+ * Returns: TRUE if the packet is an IPv4 or IPv6 packet, FALSE otherwise
+ *
+ */
+static bool_t capture_strip_link(uint16_t linktype, capture_packet_t *pkt)
+{
+    size_t skip;
+    uint16_t ethertype = 0;
+
+    switch (linktype)
+    {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        skip = 0;
+        break;
+    case LINKTYPE_NULL:
+        skip = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        if (pkt->caplen < 14)
+            return FALSE;
+        skip = 14;
+        ethertype = be16(pkt->data + 12);
+        if (ethertype == ETHERTYPE_VLAN && pkt->caplen >= 18)
+        {
+            skip = 18;
+            ethertype = be16(pkt->data + 16);
+        }
+        if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+            return FALSE;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        skip = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        skip = 20;
+        break;
+    default:
+        return FALSE;
+    }
+
+    if (pkt->caplen <= skip)
+        return FALSE;
+    pkt->data += skip;
+    pkt->caplen -= skip;
+
+    return (pkt->data[0] >> 4) == 4 || (pkt->data[0] >> 4) == 6;
+}
+
+/* Converts a timestamp in the given units per second to nanoseconds */
+static uint64_t capture_ts_ns(uint64_t ts, uint64_t units)
+{
+    return (ts / units) * NSEC_PER_SEC + (ts % units) * NSEC_PER_SEC / units;
+}
+
+/* Reads the options of a pcapng interface description block */
+static int capture_read_idb(capture_t *cap, const uint8_t *block, uint32_t block_len)
+{
+    uint16_t linktype = capture_get16(cap, block + 8);
+    uint64_t ts_units = 1000000;
+    const uint8_t *opt = block + 16, *end = block + block_len - 4;
+
+    while (opt + 4 <= end)
+    {
+        uint16_t code = capture_get16(cap, opt);
+        uint16_t len = capture_get16(cap, opt + 2);
+
+        if (code == 0 || opt + 4 + len > end)
+            break;
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1)
+        {
+            /* Negative power of 10, or of 2 if the top bit is set */
+            uint8_t resol = opt[4];
+
+            ts_units = 1;
+            for (int i = 0; i < (resol & 0x7f) && ts_units <= NSEC_PER_SEC; i++)
+                ts_units *= (resol & 0x80) ? 2 : 10;
+        }
+        opt += 4 + ((len + 3) & ~3);
+    }
+
+    return capture_add_interface(cap, linktype, ts_units);
+}
+
+
+/* See analyze.h */
+int capture_next(capture_t *cap, capture_packet_t *pkt)
+{
+    for (;;)
+    {
+        const uint8_t *block = cap->data + cap->offset;
+        size_t left = cap->size - cap->offset;
+
+        if (left == 0)
+            return 0;
+
+        if (!cap->pcapng)
+        {
+            uint32_t incl_len;
+
+            if (left < PCAP_REC_HDR_LEN)
+                return CHITCP_EINVAL;
+            incl_len = capture_get32(cap, block + 8);
+            if (incl_len > left - PCAP_REC_HDR_LEN)
+                return CHITCP_EINVAL;
+            cap->offset += PCAP_REC_HDR_LEN + incl_len;
+
+            pkt->ts = capture_get32(cap, block) * NSEC_PER_SEC +
+                      capture_ts_ns(capture_get32(cap, block + 4), cap->interfaces[0].ts_units);
+            pkt->interface = 0;
+            pkt->data = block + PCAP_REC_HDR_LEN;
+            pkt->caplen = incl_len;
+            if (capture_strip_link(cap->interfaces[0].linktype, pkt))
+                return 1;
+            continue;
+        }
+
+        uint32_t type, len;
+
+        if (left < 12)
+            return CHITCP_EINVAL;
+        type = capture_get32(cap, block);
+        if (type == PCAPNG_SHB)
+        {
+            uint32_t magic;
+
+            /* Every section can have its own byte order and interfaces */
+            memcpy(&magic, block + 8, sizeof(magic));
+            if (magic != PCAPNG_BYTE_ORDER_MAGIC && magic != __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+                return CHITCP_EINVAL;
+            cap->swapped = magic != PCAPNG_BYTE_ORDER_MAGIC;
+            cap->num_interfaces = 0;
+        }
+        len = capture_get32(cap, block + 4);
+        if (len < 12 || len % 4 != 0 || len > left)
+            return CHITCP_EINVAL;
+        cap->offset += len;
+
+        if (type == PCAPNG_IDB && len >= 20)
+        {
+            if (capture_read_idb(cap, block, len) != CHITCP_OK)
+                return CHITCP_ENOMEM;
+        }
+        else if (type == PCAPNG_EPB && len >= PCAPNG_EPB_HDR_LEN + 4)
+        {
+            uint32_t interface = capture_get32(cap, block + 8);
+            uint64_t ts = ((uint64_t) capture_get32(cap, block + 12) << 32) | capture_get32(cap, block + 16);
+            uint32_t caplen = capture_get32(cap, block + 20);
+
+            if (interface >= cap->num_interfaces || caplen > len - PCAPNG_EPB_HDR_LEN - 4)
+                return CHITCP_EINVAL;
+
+            pkt->ts = capture_ts_ns(ts, cap->interfaces[interface].ts_units);
+            pkt->interface = interface;
+            pkt->data = block + PCAPNG_EPB_HDR_LEN;
+            pkt->caplen = caplen;
+            if (capture_strip_link(cap->interfaces[interface].linktype, pkt))
+                return 1;
+        }
+    }
+}
+
+
+/* See analyze.h */
+void capture_close(capture_t *cap)
+{
+    if (cap->data)
+        munmap((void *) cap->data, cap->size);
+    free(cap->interfaces);
+    memset(cap, 0, sizeof(capture_t));
+}
+
+
+/* See analyze.h */
+void analyzer_init(analyzer_t *analyzer, uint64_t interval)
+{
+    memset(analyzer, 0, sizeof(analyzer_t));
+    analyzer->interval = interval;
+}
+
+/* A TCP segment, as parsed from a captured IP packet */
+typedef struct analyze_segment
+{
+    int family;
+    analyze_endpoint_t src, dst;
+    tcp_packet_t packet;    /* The TCP header and what was captured of the payload */
+    uint32_t len;           /* Payload length (from the IP header) */
+} analyze_segment_t;
+
+/*
+ * analyze_parse - Parse a captured IP packet
+ *
+ * pkt: Packet
+ *
+ * seg: Output parameter with the segment
+ *
+ * Returns: TRUE if the packet is a TCP segment whose header was
+ *          captured in full, FALSE otherwise
+ *
+ */
+static bool_t analyze_parse(const capture_packet_t *pkt, analyze_segment_t *seg)
+{
+    const uint8_t *ip = pkt->data;
+    size_t ip_len, tcp_len, hdr_len;
+
+    memset(seg, 0, sizeof(analyze_segment_t));
+
+    if ((ip[0] >> 4) == 4)
+    {
+        ip_len = (ip[0] & 0x0f) * 4;
+        /* Fragments (other than unfragmented packets) are not reassembled */
+        if (pkt->caplen < 20 || ip_len < 20 || ip[9] != IPPROTO_TCP || (be16(ip + 6) & 0x3fff) != 0)
+            return FALSE;
+        if (be16(ip + 2) < ip_len)
+            return FALSE;
+        tcp_len = be16(ip + 2) - ip_len;
+        seg->family = AF_INET;
+        memcpy(seg->src.addr, ip + 12, 4);
+        memcpy(seg->dst.addr, ip + 16, 4);
+    }
+    else
+    {
+        /* Extension headers are not followed */
+        ip_len = 40;
+        if (pkt->caplen < 40 || ip[6] != IPPROTO_TCP)
+            return FALSE;
+        tcp_len = be16(ip + 4);
+        seg->family = AF_INET6;
+        memcpy(seg->src.addr, ip + 8, 16);
+        memcpy(seg->dst.addr, ip + 24, 16);
+    }
+
+    if (pkt->caplen < ip_len + sizeof(tcphdr_t) || tcp_len < sizeof(tcphdr_t))
+        return FALSE;
+
+    seg->packet.raw = (uint8_t *) ip + ip_len;
+    seg->packet.length = MIN(tcp_len, pkt->caplen - ip_len);
+    hdr_len = TCP_PACKET_HEADER(&seg->packet)->doff * 4;
+    if (hdr_len < sizeof(tcphdr_t) || hdr_len > seg->packet.length)
+        return FALSE;
+
+    seg->len = tcp_len - hdr_len;
+    seg->src.port = chitcp_ntohs(TCP_PACKET_HEADER(&seg->packet)->source);
+    seg->dst.port = chitcp_ntohs(TCP_PACKET_HEADER(&seg->packet)->dest);
+
+    return TRUE;
+}
+
+/* Finds the connection of a segment, creating it if it is a new one */
+static analyze_conn_t *analyze_lookup(analyzer_t *analyzer, const analyze_segment_t *seg, uint64_t ts, int interface)
+{
+    analyze_key_t key;
+    analyze_conn_t *conn;
+    bool_t src_lo = memcmp(&seg->src, &seg->dst, sizeof(analyze_endpoint_t)) < 0;
+
+    memset(&key, 0, sizeof(key));
+    key.family = seg->family;
+    key.lo = src_lo ? seg->src : seg->dst;
+    key.hi = src_lo ? seg->dst : seg->src;
+
+    HASH_FIND(hh, analyzer->index, &key, sizeof(analyze_key_t), conn);
+    if (conn != NULL)
+        return conn;
+
+    if ((conn = calloc(1, sizeof(analyze_conn_t))) == NULL)
+        return NULL;
+    conn->key = key;
+    conn->id = analyzer->num_connections++;
+    conn->interface = interface;
+    conn->first = ts;
+    conn->flows[0].src = conn->flows[1].dst = seg->src;
+    conn->flows[0].dst = conn->flows[1].src = seg->dst;
+    conn->flows[0].wscale = conn->flows[1].wscale = -1;
+
+    HASH_ADD(hh, analyzer->index, key, sizeof(analyze_key_t), conn);
+    if (analyzer->connections_tail)
+        analyzer->connections_tail->next = conn;
+    else
+        analyzer->connections = conn;
+    analyzer->connections_tail = conn;
+
+    return conn;
+}
+
+/* Adds a segment that has been sent for the first time to a flow's
+ * outstanding segments */
+static int analyze_push(analyze_flow_t *flow, uint32_t seq, uint32_t seq_end, uint64_t ts)
+{
+    analyze_outstanding_t *out;
+
+    if (flow->out_head + flow->out_len == flow->out_size)
+    {
+        if (flow->out_head > 0)
+        {
+            memmove(flow->outstanding, flow->outstanding + flow->out_head, flow->out_len * sizeof(analyze_outstanding_t));
+            flow->out_head = 0;
+        }
+        else
+        {
+            size_t size = flow->out_size ? flow->out_size * 2 : 64;
+
+            if ((out = realloc(flow->outstanding, size * sizeof(analyze_outstanding_t))) == NULL)
+                return CHITCP_ENOMEM;
+            flow->outstanding = out;
+            flow->out_size = size;
+        }
+    }
+
+    out = &flow->outstanding[flow->out_head + flow->out_len++];
+    out->seq = seq;
+    out->seq_end = seq_end;
+    out->sent = ts;
+    out->resent = 0;
+    out->resent_tsval = 0;
+
+    return CHITCP_OK;
+}
+
+/* Adds newly acknowledged bytes to the goodput interval of TS */
+static int analyze_goodput(analyzer_t *analyzer, analyze_conn_t *conn, analyze_flow_t *flow, uint64_t ts, uint32_t bytes)
+{
+    size_t i = (ts - conn->first) / analyzer->interval;
+
+    if (i >= flow->num_goodput)
+    {
+        uint64_t *goodput = realloc(flow->goodput, (i + 1) * sizeof(uint64_t));
+
+        if (goodput == NULL)
+            return CHITCP_ENOMEM;
+        memset(goodput + flow->num_goodput, 0, (i + 1 - flow->num_goodput) * sizeof(uint64_t));
+        flow->goodput = goodput;
+        flow->num_goodput = i + 1;
+    }
+    flow->goodput[i] += bytes;
+    flow->bytes_acked += bytes;
+
+    return CHITCP_OK;
+}
+
+/*
+ * analyze_ack - Process the ACK and window of a segment
+ *
+ * analyzer: Analyzer
+ *
+ * conn: Connection
+ *
+ * flow: Flow whose data the segment acknowledges
+ *
+ * sender: Flow that the segment belongs to
+ *
+ * seg: Segment
+ *
+ * ts: When the segment was captured
+ *
+ * Returns:
+ *  - CHITCP_OK: The ACK was processed
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+static int analyze_ack(analyzer_t *analyzer, analyze_conn_t *conn, analyze_flow_t *flow,
+                       analyze_flow_t *sender, analyze_segment_t *seg, uint64_t ts)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(&seg->packet);
+    uint32_t ack = chitcp_ntohl(header->ack_seq), tsval, tsecr, bytes;
+    bool_t has_ts = chitcp_tcp_packet_get_timestamp(&seg->packet, &tsval, &tsecr) == CHITCP_OK;
+    tcp_sack_block_t blocks[TCP_SACK_MAX_BLOCKS];
+    uint64_t rtt = 0;
+    int nblocks, shift = 0;
+
+    /* The window is only scaled if both ends sent the option (and
+     * never in the SYNs themselves) */
+    if (!header->syn && sender->wscale >= 0 && flow->wscale >= 0)
+        shift = sender->wscale;
+    flow->rwnd = (uint32_t) chitcp_ntohs(header->win) << shift;
+    flow->rwnd_valid = TRUE;
+
+    if (flow->rwnd == 0 && !header->rst)
+    {
+        if (flow->stall_start == 0)
+        {
+            flow->stall_start = ts;
+            flow->stalls++;
+        }
+    }
+    else if (flow->stall_start != 0)
+    {
+        flow->stall_time += ts - flow->stall_start;
+        flow->stall_start = 0;
+    }
+
+    if (!header->ack || !flow->seen)
+        return CHITCP_OK;
+
+    /* If the capture starts half-way through the connection, the
+     * first ACK only tells us where the receiver is */
+    if (!flow->acked)
+    {
+        flow->snd_una = (SEQ_LEQ(flow->isn, ack) && SEQ_LEQ(ack, flow->snd_max)) ? flow->isn : ack;
+        flow->acked = TRUE;
+    }
+
+    nblocks = chitcp_tcp_packet_get_sack(&seg->packet, blocks);
+    if (nblocks > 0 && (SEQ_LEQ(blocks[0].right, ack) ||
+                        (nblocks > 1 && SEQ_LEQ(blocks[1].left, blocks[0].left) && SEQ_LEQ(blocks[0].right, blocks[1].right))))
+        flow->dsacks++;
+
+    if (!SEQ_GT(ack, flow->snd_una))
+        return CHITCP_OK;
+
+    /* The SYN and FIN don't count as data */
+    bytes = ack - flow->snd_una;
+    if (flow->syn && SEQ_LEQ(flow->snd_una, flow->isn) && SEQ_GT(ack, flow->isn))
+        bytes--;
+    if (flow->fin && SEQ_LEQ(flow->snd_una, flow->fin_seq) && SEQ_GT(ack, flow->fin_seq))
+        bytes--;
+    if (analyze_goodput(analyzer, conn, flow, ts, bytes) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+    flow->snd_una = ack;
+
+    while (flow->out_len > 0 && SEQ_LEQ(flow->outstanding[flow->out_head].seq_end, ack))
+    {
+        analyze_outstanding_t *out = &flow->outstanding[flow->out_head];
+
+        if (out->resent == 0)
+            rtt = ts - out->sent;
+        else if (out->resent != flow->last_spurious &&
+                 ((has_ts && out->resent_tsval != 0 && SEQ_LT(tsecr, out->resent_tsval)) ||
+                  (!has_ts && flow->rtt_count > 0 && ts - out->resent < flow->rtt_min / 2)))
+        {
+            /* The ACK is for the original segment */
+            flow->spurious++;
+            flow->last_spurious = out->resent;
+        }
+
+        flow->out_head++;
+        flow->out_len--;
+    }
+    if (flow->out_len == 0)
+        flow->out_head = 0;
+
+    /* One sample per ACK, from the last segment it acknowledges */
+    if (rtt > 0)
+    {
+        if (flow->rtt_count == 0 || rtt < flow->rtt_min)
+            flow->rtt_min = rtt;
+        if (rtt > flow->rtt_max)
+            flow->rtt_max = rtt;
+        flow->rtt_sum += rtt;
+        flow->rtt_count++;
+        if (analyzer->rtt_cb)
+            analyzer->rtt_cb(analyzer->cb_arg, conn, flow == &conn->flows[0] ? 0 : 1, ts, rtt);
+    }
+
+    return CHITCP_OK;
+}
+
+/*
+ * analyze_send - Process the data (and the SYN and FIN) of a segment
+ *
+ * flow: Flow that the segment belongs to
+ *
+ * seg: Segment
+ *
+ * ts: When the segment was captured
+ *
+ * retransmit: Output parameter, TRUE if the segment is a retransmission
+ *
+ * Returns:
+ *  - CHITCP_OK: The segment was processed
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+static int analyze_send(analyze_flow_t *flow, analyze_segment_t *seg, uint64_t ts, bool_t *retransmit)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(&seg->packet);
+    uint32_t seq = chitcp_ntohl(header->seq), tsval = 0, tsecr;
+    uint32_t end = seq + seg->len + header->syn + header->fin;
+
+    *retransmit = FALSE;
+    flow->segments++;
+
+    if (header->syn)
+        flow->wscale = chitcp_tcp_packet_get_wscale(&seg->packet);
+    if (!flow->seen || header->syn)
+    {
+        flow->isn = seq;
+        flow->snd_max = seq;
+        flow->seen = TRUE;
+        flow->syn = header->syn;
+    }
+    if (header->fin)
+    {
+        flow->fin = TRUE;
+        flow->fin_seq = seq + seg->len;
+    }
+
+    if (end == seq)
+        return CHITCP_OK;
+
+    flow->data_segments++;
+    flow->bytes += seg->len;
+    chitcp_tcp_packet_get_timestamp(&seg->packet, &tsval, &tsecr);
+
+    if (SEQ_LT(seq, flow->snd_max))
+    {
+        *retransmit = TRUE;
+        flow->retransmits++;
+        for (size_t i = flow->out_head; i < flow->out_head + flow->out_len; i++)
+        {
+            analyze_outstanding_t *out = &flow->outstanding[i];
+
+            if (SEQ_LT(out->seq, end) && SEQ_GT(out->seq_end, seq))
+            {
+                out->resent = ts;
+                out->resent_tsval = tsval;
+            }
+        }
+    }
+
+    if (flow->acked && flow->rwnd_valid && flow->rwnd > 0 && SEQ_LEQ(flow->snd_una + flow->rwnd, end))
+        flow->window_limited++;
+
+    if (SEQ_GT(end, flow->snd_max))
+    {
+        if (analyze_push(flow, *retransmit ? flow->snd_max : seq, end, ts) != CHITCP_OK)
+            return CHITCP_ENOMEM;
+        if (*retransmit)
+        {
+            flow->outstanding[flow->out_head + flow->out_len - 1].resent = ts;
+            flow->outstanding[flow->out_head + flow->out_len - 1].resent_tsval = tsval;
+        }
+        flow->snd_max = end;
+    }
+
+    return CHITCP_OK;
+}
+
+
+/* See analyze.h */
+int analyzer_add(analyzer_t *analyzer, const capture_packet_t *pkt)
+{
+    analyze_segment_t seg;
+    analyze_conn_t *conn;
+    tcphdr_t *header;
+    bool_t retransmit;
+    int dir;
+
+    analyzer->packets++;
+
+    if (!analyze_parse(pkt, &seg))
+    {
+        analyzer->ignored++;
+        return CHITCP_OK;
+    }
+
+    if ((conn = analyze_lookup(analyzer, &seg, pkt->ts, pkt->interface)) == NULL)
+        return CHITCP_ENOMEM;
+
+    /* Both ends of the connection may have been captured */
+    if (conn->interface != pkt->interface)
+    {
+        analyzer->ignored++;
+        return CHITCP_OK;
+    }
+
+    header = TCP_PACKET_HEADER(&seg.packet);
+    dir = memcmp(&seg.src, &conn->flows[0].src, sizeof(analyze_endpoint_t)) == 0 ? 0 : 1;
+    conn->last = pkt->ts;
+    if (header->syn)
+        conn->syn_seen = TRUE;
+    if (header->rst)
+        conn->reset = TRUE;
+    if (header->fin)
+        conn->fin[dir] = TRUE;
+
+    if (analyze_send(&conn->flows[dir], &seg, pkt->ts, &retransmit) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+    if (analyze_ack(analyzer, conn, &conn->flows[1 - dir], &conn->flows[dir], &seg, pkt->ts) != CHITCP_OK)
+        return CHITCP_ENOMEM;
+
+    if (analyzer->segment_cb)
+        analyzer->segment_cb(analyzer->cb_arg, conn, dir, pkt->ts, header, seg.len, retransmit);
+
+    return CHITCP_OK;
+}
+
+
+/* See analyze.h */
+void analyzer_finish(analyzer_t *analyzer)
+{
+    for (analyze_conn_t *conn = analyzer->connections; conn != NULL; conn = conn->next)
+    {
+        for (int dir = 0; dir < 2; dir++)
+        {
+            analyze_flow_t *flow = &conn->flows[dir];
+
+            if (flow->stall_start != 0)
+            {
+                flow->stall_time += conn->last - flow->stall_start;
+                flow->stall_start = 0;
+            }
+        }
+    }
+}
+
+
+/* See analyze.h */
+void analyzer_free(analyzer_t *analyzer)
+{
+    analyze_conn_t *conn, *next;
+
+    HASH_CLEAR(hh, analyzer->index);
+    for (conn = analyzer->connections; conn != NULL; conn = next)
+    {
+        next = conn->next;
+        for (int dir = 0; dir < 2; dir++)
+        {
+            free(conn->flows[dir].outstanding);
+            free(conn->flows[dir].goodput);
+        }
+        free(conn);
+    }
+    analyzer->connections = analyzer->connections_tail = NULL;
+    analyzer->num_connections = 0;
+}
+
+
+/* See analyze.h */
+char *analyze_endpoint_str(int family, const analyze_endpoint_t *ep, char *buf, size_t len)
+{
+    char addr[INET6_ADDRSTRLEN];
+
+    inet_ntop(family, ep->addr, addr, sizeof(addr));
+    if (family == AF_INET6)
+        snprintf(buf, len, "[%s]:%u", addr, ep->port);
+    else
+        snprintf(buf, len, "%s:%u", addr, ep->port);
+
+    return buf;
+}
@@ -0,0 +1,348 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Offline analysis of packet captures
+ *
+ *  A capture (classic pcap, or pcapng, such as the ones written by
+ *  chitcpd -c) is read through a read-only memory mapping, one packet at
+ *  a time, so captures of any size can be analyzed without reading them
+ *  into memory. The analyzer reconstructs the TCP connections in the
+ *  capture and, for each direction of each connection, measures:
+ *
+ *  - Goodput: new bytes acknowledged, per interval of time
+ *  - RTT samples: time from sending a segment to the ACK that covers it
+ *    (skipping retransmitted segments, as in Karn's algorithm)
+ *  - Retransmissions, and how many of them were spurious (the original
+ *    segment was acknowledged, as told by the timestamp echoed in the ACK
+ *    or, without timestamps, by an ACK that comes back in less than half
+ *    the smallest RTT) and D-SACKs received
+ *  - Receive window stalls: how many times, and for how long, the
+ *    receiver advertised a zero window, and how many segments filled
+ *    the receiver's window
+ *
+ *  The measurements are those of the point where the packets were
+ *  captured. A chitcpd captures the packets that each of its sockets
+ *  sends and receives, so its capture is taken at the sender of the
+ *  data (and its RTTs are the ones TCP sees). If both ends of a
+ *  connection are in the same capture, the packets are only taken from
+ *  the pcapng interface (i.e., the socket) of the first packet of the
+ *  connection; a classic pcap file has no interfaces, so it would count
+ *  every segment twice.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+#include "chitcp/uthash.h"
+
+/*
+ *
+ *  Capture reader
+ *
+ */
+
+/* A datalink type and timestamp resolution of the packets in a capture
+ * (pcapng files have one per interface) */
+typedef struct capture_interface
+{
+    uint16_t linktype;
+    uint64_t ts_units;      /* Timestamp units per second */
+} capture_interface_t;
+
+typedef struct capture
+{
+    const uint8_t *data;    /* The whole file, mapped into memory */
+    size_t size;
+    size_t offset;          /* Of the next block or record */
+    bool_t swapped;         /* Written with the other byte order */
+    bool_t pcapng;
+
+    capture_interface_t *interfaces;
+    int num_interfaces;
+} capture_t;
+
+/* A packet in a capture. data points into the mapping, at the start of
+ * the packet's IP header (the datalink header is skipped) */
+typedef struct capture_packet
+{
+    uint64_t ts;            /* Nanoseconds since the epoch */
+    int interface;          /* pcapng interface (0 in pcap files) */
+    const uint8_t *data;
+    uint32_t caplen;        /* Bytes captured (from data) */
+} capture_packet_t;
+
+
+/*
+ * capture_open - Open a capture file
+ *
+ * cap: Capture
+ *
+ * filename: Name of the file
+ *
+ * Returns:
+ *  - CHITCP_OK: The capture was opened
+ *  - CHITCP_ENOENT: The file could not be opened or mapped
+ *  - CHITCP_EINVAL: The file is not a pcap or pcapng file
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+int capture_open(capture_t *cap, const char *filename);
+
+
+/*
+ * capture_next - Get the next packet in a capture
+ *
+ * Packets with a datalink type other than raw IP, IPv4, IPv6, Ethernet,
+ * BSD loopback or Linux cooked capture are skipped, as are the pcapng
+ * blocks other than section headers, interface descriptions and
+ * enhanced packets.
+ *
+ * cap: Capture
+ *
+ * pkt: Output parameter with the packet
+ *
+ * Returns:
+ *  - 1: There is a packet in pkt
+ *  - 0: There are no more packets
+ *  - CHITCP_EINVAL: The rest of the file is truncated or corrupt
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+int capture_next(capture_t *cap, capture_packet_t *pkt);
+
+
+/*
+ * capture_close - Close a capture file
+ *
+ * cap: Capture
+ *
+ * Returns: Nothing.
+ *
+ */
+void capture_close(capture_t *cap);
+
+
+/*
+ *
+ *  Connection analyzer
+ *
+ */
+
+/* A connection is identified by its two endpoints, with the lower one
+ * (in memcmp order) first, so both directions find the same entry */
+typedef struct analyze_endpoint
+{
+    uint8_t addr[16];       /* IPv4 addresses use the first four bytes */
+    uint16_t port;          /* Host byte order */
+} analyze_endpoint_t;
+
+typedef struct analyze_key
+{
+    int family;
+    analyze_endpoint_t lo, hi;
+} analyze_key_t;
+
+/* A segment that has been sent, but not acknowledged, yet */
+typedef struct analyze_outstanding
+{
+    uint32_t seq, seq_end;
+    uint64_t sent;          /* When it was first sent */
+    uint64_t resent;        /* When it was last retransmitted (0: never) */
+    uint32_t resent_tsval;  /* TSval of the last retransmission */
+} analyze_outstanding_t;
+
+/* One direction of a connection: the data sent by one endpoint, and what
+ * the other endpoint says about it (its ACKs and its window) */
+typedef struct analyze_flow
+{
+    analyze_endpoint_t src, dst;
+
+    bool_t seen;
+    bool_t syn, fin;        /* Whether the SYN and FIN were seen */
+    uint32_t isn;           /* Sequence numbers are reported relative to this */
+    uint32_t fin_seq;
+    uint32_t snd_max;       /* Highest sequence number sent, plus one */
+    bool_t acked;
+    uint32_t snd_una;       /* Highest ACK received */
+
+    int wscale;             /* Window scale in the SYN (-1: none) */
+    uint32_t rwnd;          /* Last window advertised by the receiver, scaled */
+    bool_t rwnd_valid;
+
+    uint64_t segments;      /* Segments sent */
+    uint64_t data_segments; /* ... with a payload (or SYN or FIN) */
+    uint64_t bytes;         /* Payload bytes sent, including retransmissions */
+    uint64_t bytes_acked;   /* New bytes acknowledged */
+    uint64_t retransmits;
+    uint64_t spurious;
+    uint64_t dsacks;
+
+    uint64_t rtt_count;
+    uint64_t rtt_min, rtt_max, rtt_sum;  /* Nanoseconds */
+
+    uint64_t stalls;        /* Times the receiver advertised a zero window */
+    uint64_t stall_time;    /* Nanoseconds spent with a zero window */
+    uint64_t stall_start;   /* If non-zero, the window is zero since then */
+    uint64_t last_spurious; /* Retransmission last found to be spurious */
+    uint64_t window_limited; /* Segments that filled the receiver's window */
+
+    /* Segments in flight, in the order they were first sent */
+    analyze_outstanding_t *outstanding;
+    size_t out_head, out_len, out_size;
+
+    /* New bytes acknowledged in each interval (see analyzer_t) */
+    uint64_t *goodput;
+    size_t num_goodput;
+} analyze_flow_t;
+
+typedef struct analyze_conn
+{
+    analyze_key_t key;
+    int id;                 /* In order of appearance, from 0 */
+    int interface;          /* pcapng interface its packets are taken from */
+    uint64_t first, last;   /* Timestamps of the first and last packet */
+    bool_t syn_seen;
+    bool_t reset;
+    bool_t fin[2];
+
+    /* flows[0] is the data sent by the endpoint that sent the first
+     * packet (the SYN, if the capture has it), flows[1] the other way */
+    analyze_flow_t flows[2];
+
+    UT_hash_handle hh;
+    struct analyze_conn *next;
+} analyze_conn_t;
+
+/* Called for each segment of a connection that is analyzed */
+typedef void (*analyze_segment_cb)(void *arg, analyze_conn_t *conn, int dir, uint64_t ts,
+                                   const tcphdr_t *header, uint32_t len, bool_t retransmit);
+
+/* Called for each RTT sample */
+typedef void (*analyze_rtt_cb)(void *arg, analyze_conn_t *conn, int dir, uint64_t ts, uint64_t rtt);
+
+typedef struct analyzer
+{
+    uint64_t interval;      /* Goodput interval, in nanoseconds */
+
+    analyze_conn_t *index;  /* Hash table of the connections */
+    analyze_conn_t *connections;  /* ... in order of appearance */
+    analyze_conn_t *connections_tail;
+    int num_connections;
+
+    uint64_t packets;       /* Packets read */
+    uint64_t ignored;       /* ... that weren't TCP, were truncated, or
+                             * were captured by another interface */
+
+    analyze_segment_cb segment_cb;
+    analyze_rtt_cb rtt_cb;
+    void *cb_arg;
+} analyzer_t;
+
+
+/*
+ * analyzer_init - Initialize an analyzer
+ *
+ * analyzer: Analyzer
+ *
+ * interval: Goodput interval, in nanoseconds
+ *
+ * Returns: Nothing.
+ *
+ */
+void analyzer_init(analyzer_t *analyzer, uint64_t interval);
+
+
+/*
+ * analyzer_add - Add a packet to the analysis
+ *
+ * analyzer: Analyzer
+ *
+ * pkt: Packet
+ *
+ * Returns:
+ *  - CHITCP_OK: The packet was analyzed (or ignored)
+ *  - CHITCP_ENOMEM: Could not allocate memory
+ *
+ */
+int analyzer_add(analyzer_t *analyzer, const capture_packet_t *pkt);
+
+
+/*
+ * analyzer_finish - Finish the analysis
+ *
+ * Closes the receive window stalls that are still open when the capture
+ * ends. Must be called after the last packet is added.
+ *
+ * analyzer: Analyzer
+ *
+ * Returns: Nothing.
+ *
+ */
+void analyzer_finish(analyzer_t *analyzer);
+
+
+/*
+ * analyzer_free - Free the connections of an analyzer
+ *
+ * analyzer: Analyzer
+ *
+ * Returns: Nothing.
+ *
+ */
+void analyzer_free(analyzer_t *analyzer);
+
+
+/*
+ * analyze_endpoint_str - Format an endpoint as ADDRESS:PORT
+ *
+ * family: AF_INET or AF_INET6
+ *
+ * ep: Endpoint
+ *
+ * buf, len: Buffer for the string
+ *
+ * Returns: buf
+ *
+ */
+char *analyze_endpoint_str(int family, const analyze_endpoint_t *ep, char *buf, size_t len);
+
+
+#endif /* ANALYZE_H_ */
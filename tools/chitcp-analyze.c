@@ -0,0 +1,311 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  chitcp-analyze: offline analysis of packet captures
+ *
+ *  Reads a capture (e.g., one written by chitcpd -c), reconstructs its
+ *  TCP connections, and reports, for each direction of each connection,
+ *  its goodput, RTT, retransmissions (and how many were spurious) and
+ *  receive window stalls (see analyze.h). The summary is written to
+ *  the standard output as CSV, or as JSON (with the goodput of each
+ *  interval). With -o, the time-sequence of every segment, every RTT
+ *  sample and the goodput of every interval are also written to CSV
+ *  files, for plotting.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "analyze.h"
+#include "chitcp/multitimer.h"
+
+typedef struct analyze_output
+{
+    FILE *tseq;
+    FILE *rtt;
+} analyze_output_t;
+
+static void usage(void)
+{
+    printf("Usage: chitcp-analyze [-i SECONDS] [-j] [-o PREFIX] CAPTURE_FILE\n");
+    printf("       -i: Measure the goodput over intervals of SECONDS seconds (default: 1)\n");
+    printf("       -j: Write the summary as JSON instead of CSV\n");
+    printf("       -o: Also write PREFIX.tseq.csv (every segment), PREFIX.rtt.csv\n");
+    printf("           (every RTT sample) and PREFIX.goodput.csv (every interval)\n");
+}
+
+static double seconds(uint64_t ns)
+{
+    return ns / (double) SECOND;
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / (double) MILLISECOND;
+}
+
+static void write_segment(void *arg, analyze_conn_t *conn, int dir, uint64_t ts,
+                          const tcphdr_t *header, uint32_t len, bool_t retransmit)
+{
+    analyze_output_t *output = arg;
+    char flags[8], *f = flags;
+
+    if (header->syn) *f++ = 'S';
+    if (header->fin) *f++ = 'F';
+    if (header->rst) *f++ = 'R';
+    if (header->psh) *f++ = 'P';
+    if (header->ack) *f++ = 'A';
+    *f = '\0';
+
+    fprintf(output->tseq, "%d,%d,%.9f,%u,%u,%u,%u,%s,%d\n", conn->id, dir, seconds(ts - conn->first),
+            chitcp_ntohl(header->seq) - conn->flows[dir].isn, len,
+            header->ack ? chitcp_ntohl(header->ack_seq) - conn->flows[1 - dir].isn : 0,
+            chitcp_ntohs(header->win), flags, retransmit ? 1 : 0);
+}
+
+static void write_rtt(void *arg, analyze_conn_t *conn, int dir, uint64_t ts, uint64_t rtt)
+{
+    analyze_output_t *output = arg;
+
+    fprintf(output->rtt, "%d,%d,%.9f,%.3f\n", conn->id, dir, seconds(ts - conn->first), ms(rtt));
+}
+
+static FILE *open_output(const char *prefix, const char *suffix, const char *header)
+{
+    char filename[1024];
+    FILE *file;
+
+    snprintf(filename, sizeof(filename), "%s.%s", prefix, suffix);
+    if ((file = fopen(filename, "w")) == NULL)
+    {
+        perror(filename);
+        exit(-1);
+    }
+    fprintf(file, "%s\n", header);
+
+    return file;
+}
+
+static void write_goodput(FILE *out, analyzer_t *analyzer)
+{
+    for (analyze_conn_t *conn = analyzer->connections; conn != NULL; conn = conn->next)
+        for (int dir = 0; dir < 2; dir++)
+            for (size_t i = 0; i < conn->flows[dir].num_goodput; i++)
+                fprintf(out, "%d,%d,%.3f,%llu,%.1f\n", conn->id, dir, seconds(i * analyzer->interval),
+                        (unsigned long long) conn->flows[dir].goodput[i],
+                        conn->flows[dir].goodput[i] / seconds(analyzer->interval));
+}
+
+/* Average goodput of a flow over the whole connection, in bytes per second */
+static double flow_goodput(analyze_conn_t *conn, analyze_flow_t *flow)
+{
+    return conn->last > conn->first ? flow->bytes_acked / seconds(conn->last - conn->first) : 0;
+}
+
+static void write_summary_csv(FILE *out, analyzer_t *analyzer)
+{
+    char src[64], dst[64];
+
+    fprintf(out, "conn,dir,src,dst,start,duration,segments,data_segments,bytes,bytes_acked,goodput,"
+                 "retransmits,spurious,dsacks,rtt_samples,rtt_min_ms,rtt_avg_ms,rtt_max_ms,"
+                 "zero_window_stalls,stall_time,window_limited\n");
+    for (analyze_conn_t *conn = analyzer->connections; conn != NULL; conn = conn->next)
+    {
+        for (int dir = 0; dir < 2; dir++)
+        {
+            analyze_flow_t *flow = &conn->flows[dir];
+
+            if (flow->segments == 0)
+                continue;
+            fprintf(out, "%d,%d,%s,%s,%.9f,%.6f,%llu,%llu,%llu,%llu,%.1f,%llu,%llu,%llu,%llu,%.3f,%.3f,%.3f,%llu,%.6f,%llu\n",
+                    conn->id, dir,
+                    analyze_endpoint_str(conn->key.family, &flow->src, src, sizeof(src)),
+                    analyze_endpoint_str(conn->key.family, &flow->dst, dst, sizeof(dst)),
+                    seconds(conn->first), seconds(conn->last - conn->first),
+                    (unsigned long long) flow->segments, (unsigned long long) flow->data_segments,
+                    (unsigned long long) flow->bytes, (unsigned long long) flow->bytes_acked,
+                    flow_goodput(conn, flow),
+                    (unsigned long long) flow->retransmits, (unsigned long long) flow->spurious,
+                    (unsigned long long) flow->dsacks, (unsigned long long) flow->rtt_count,
+                    ms(flow->rtt_min), flow->rtt_count ? ms(flow->rtt_sum / flow->rtt_count) : 0.0, ms(flow->rtt_max),
+                    (unsigned long long) flow->stalls, seconds(flow->stall_time),
+                    (unsigned long long) flow->window_limited);
+        }
+    }
+}
+
+static void write_summary_json(FILE *out, const char *filename, analyzer_t *analyzer)
+{
+    char src[64], dst[64];
+
+    fprintf(out, "{\n  \"capture\": \"%s\",\n  \"packets\": %llu,\n  \"ignored\": %llu,\n  \"interval\": %.3f,\n  \"connections\": [",
+            filename, (unsigned long long) analyzer->packets, (unsigned long long) analyzer->ignored,
+            seconds(analyzer->interval));
+    for (analyze_conn_t *conn = analyzer->connections; conn != NULL; conn = conn->next)
+    {
+        fprintf(out, "%s\n    {\n      \"id\": %d,\n      \"start\": %.9f,\n      \"duration\": %.6f,\n"
+                     "      \"handshake\": %s,\n      \"closed\": %s,\n      \"reset\": %s,\n      \"flows\": [",
+                conn == analyzer->connections ? "" : ",", conn->id,
+                seconds(conn->first), seconds(conn->last - conn->first),
+                conn->syn_seen ? "true" : "false", conn->fin[0] && conn->fin[1] ? "true" : "false",
+                conn->reset ? "true" : "false");
+        for (int dir = 0; dir < 2; dir++)
+        {
+            analyze_flow_t *flow = &conn->flows[dir];
+
+            fprintf(out, "%s\n        {\n          \"src\": \"%s\",\n          \"dst\": \"%s\",\n"
+                         "          \"segments\": %llu,\n          \"data_segments\": %llu,\n"
+                         "          \"bytes\": %llu,\n          \"bytes_acked\": %llu,\n          \"goodput\": %.1f,\n"
+                         "          \"retransmits\": %llu,\n          \"spurious_retransmits\": %llu,\n          \"dsacks\": %llu,\n"
+                         "          \"rtt\": { \"samples\": %llu, \"min_ms\": %.3f, \"avg_ms\": %.3f, \"max_ms\": %.3f },\n"
+                         "          \"zero_window_stalls\": %llu,\n          \"stall_time\": %.6f,\n"
+                         "          \"window_limited\": %llu,\n          \"goodput_series\": [",
+                    dir == 0 ? "" : ",",
+                    analyze_endpoint_str(conn->key.family, &flow->src, src, sizeof(src)),
+                    analyze_endpoint_str(conn->key.family, &flow->dst, dst, sizeof(dst)),
+                    (unsigned long long) flow->segments, (unsigned long long) flow->data_segments,
+                    (unsigned long long) flow->bytes, (unsigned long long) flow->bytes_acked,
+                    flow_goodput(conn, flow),
+                    (unsigned long long) flow->retransmits, (unsigned long long) flow->spurious,
+                    (unsigned long long) flow->dsacks,
+                    (unsigned long long) flow->rtt_count, ms(flow->rtt_min),
+                    flow->rtt_count ? ms(flow->rtt_sum / flow->rtt_count) : 0.0, ms(flow->rtt_max),
+                    (unsigned long long) flow->stalls, seconds(flow->stall_time),
+                    (unsigned long long) flow->window_limited);
+            for (size_t i = 0; i < flow->num_goodput; i++)
+                fprintf(out, "%s%.1f", i == 0 ? "" : ", ", flow->goodput[i] / seconds(analyzer->interval));
+            fprintf(out, "]\n        }");
+        }
+        fprintf(out, "\n      ]\n    }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, rc;
+    double interval = 1.0;
+    bool_t json = FALSE;
+    char *prefix = NULL;
+    capture_t cap;
+    capture_packet_t pkt;
+    analyzer_t analyzer;
+    analyze_output_t output = {NULL, NULL};
+
+    while ((opt = getopt(argc, argv, "i:jo:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = strtod(optarg, NULL);
+            break;
+        case 'j':
+            json = TRUE;
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (optind != argc - 1 || interval <= 0)
+    {
+        usage();
+        exit(-1);
+    }
+
+    if ((rc = capture_open(&cap, argv[optind])) != CHITCP_OK)
+    {
+        fprintf(stderr, "ERROR: Could not read %s: %s\n", argv[optind],
+                rc == CHITCP_EINVAL ? "not a pcap or pcapng file" : "could not open the file");
+        exit(-1);
+    }
+
+    analyzer_init(&analyzer, interval * SECOND);
+    if (prefix)
+    {
+        output.tseq = open_output(prefix, "tseq.csv", "conn,dir,time,seq,len,ack,win,flags,retransmit");
+        output.rtt = open_output(prefix, "rtt.csv", "conn,dir,time,rtt_ms");
+        analyzer.segment_cb = write_segment;
+        analyzer.rtt_cb = write_rtt;
+        analyzer.cb_arg = &output;
+    }
+
+    while ((rc = capture_next(&cap, &pkt)) == 1)
+    {
+        if (analyzer_add(&analyzer, &pkt) != CHITCP_OK)
+        {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            exit(-1);
+        }
+    }
+    if (rc == CHITCP_EINVAL)
+        fprintf(stderr, "WARNING: %s is truncated or corrupt (analyzing the first %llu packets)\n",
+                argv[optind], (unsigned long long) analyzer.packets);
+    else if (rc != 0)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(-1);
+    }
+    analyzer_finish(&analyzer);
+
+    if (json)
+        write_summary_json(stdout, argv[optind], &analyzer);
+    else
+        write_summary_csv(stdout, &analyzer);
+
+    if (prefix)
+    {
+        FILE *goodput = open_output(prefix, "goodput.csv", "conn,dir,time,bytes,goodput");
+
+        write_goodput(goodput, &analyzer);
+        fclose(goodput);
+        fclose(output.tseq);
+        fclose(output.rtt);
+    }
+
+    analyzer_free(&analyzer);
+    capture_close(&cap);
+
+    return 0;
+}